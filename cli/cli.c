@@ -310,6 +310,10 @@ void cli_execute_command(char* command) {
         backup_command(arg_count, args);
     } else if (cli_strcmp(args[0], "monitor") == 0) {
         monitor_command(arg_count, args);
+    } else if (cli_strcmp(args[0], "dmesg") == 0) {
+        dmesg_command(arg_count, args);
+    } else if (cli_strcmp(args[0], "iostat") == 0) {
+        iostat_command(arg_count, args);
     } else {
         // Unknown command
         terminal_write("Unknown command: ");
@@ -407,6 +411,8 @@ void cli_cmd_help() {
     terminal_write("    update   - System update commands\n");
     terminal_write("    backup   - Backup and restore commands\n");
     terminal_write("    monitor  - System monitoring commands\n");
+    terminal_write("  dmesg      - Print the kernel log\n");
+    terminal_write("  iostat     - Show storage device I/O statistics\n");
 }
 
 // Clear command
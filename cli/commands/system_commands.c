@@ -5,12 +5,37 @@
 
 #include "system_commands.h"
 #include "../../kernel/kernel.h"
+#include "../../kernel/klog.h"
+#include "../../kernel/page_cache.h"
+#include "../../drivers/storage.h"
 #include "../../package/package_manager.h"
 #include "../../system/update_manager.h"
 #include "../../system/backup_manager.h"
 #include "../../system/monitor_manager.h"
 #include "../../libc/string.h"
 
+// Write an unsigned number to the terminal
+static void system_write_number(unsigned long long value) {
+    char buffer[24];
+    int idx = 0;
+    
+    do {
+        buffer[idx++] = '0' + (value % 10);
+        value /= 10;
+    } while (value > 0);
+    
+    buffer[idx] = '\0';
+    
+    // Reverse the string
+    for (int j = 0; j < idx / 2; j++) {
+        char tmp = buffer[j];
+        buffer[j] = buffer[idx - j - 1];
+        buffer[idx - j - 1] = tmp;
+    }
+    
+    terminal_write(buffer);
+}
+
 // Register system commands
 void register_system_commands() {
     cli_register_command("system", system_command, "System management commands");
@@ -18,6 +43,8 @@ void register_system_commands() {
     cli_register_command("update", update_command, "System update commands");
     cli_register_command("backup", backup_command, "Backup and restore commands");
     cli_register_command("monitor", monitor_command, "System monitoring commands");
+    cli_register_command("dmesg", dmesg_command, "Print the kernel log");
+    cli_register_command("iostat", iostat_command, "Show storage device I/O statistics");
 }
 
 // System command handler
@@ -518,6 +545,7 @@ int monitor_command(int argc, char** argv) {
         terminal_write("  network                               Show network information\n");
         terminal_write("  process                               Show process information\n");
         terminal_write("  system                                Show system information\n");
+        terminal_write("  cache                                 Show page cache statistics\n");
         return 0;
     }
     
@@ -623,6 +651,38 @@ int monitor_command(int argc, char** argv) {
         
         return 0;
     }
+    else if (strcmp(command, "cache") == 0) {
+        page_cache_stats_t stats;
+        page_cache_get_stats(&stats);
+        
+        terminal_write("Page Cache:\n");
+        terminal_write("  Pages:       ");
+        system_write_number(stats.pages);
+        terminal_write(" (");
+        system_write_number(stats.dirty_pages);
+        terminal_write(" dirty)\n");
+        terminal_write("  Mappings:    ");
+        system_write_number(stats.mappings);
+        terminal_write("\n  Hits:        ");
+        system_write_number(stats.hits);
+        terminal_write("\n  Misses:      ");
+        system_write_number(stats.misses);
+        terminal_write("\n  Hit ratio:   ");
+        
+        unsigned long long lookups = stats.hits + stats.misses;
+        system_write_number(lookups ? stats.hits * 100 / lookups : 0);
+        terminal_write("%\n  Evictions:   ");
+        system_write_number(stats.evictions);
+        terminal_write("\n  Writebacks:  ");
+        system_write_number(stats.writebacks);
+        terminal_write("\n  Flushes:     ");
+        system_write_number(stats.flusher_runs);
+        terminal_write("\n  Throttled:   ");
+        system_write_number(stats.throttled);
+        terminal_write("\n");
+        
+        return 0;
+    }
     else {
         terminal_write("Unknown command: ");
         terminal_write(command);
@@ -630,3 +690,82 @@ int monitor_command(int argc, char** argv) {
         return -1;
     }
 }
+
+// Dmesg command handler
+int dmesg_command(int argc, char** argv) {
+    klog_level_t max_level = KLOG_DEBUG;
+    int clear = 0;
+    
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-c") == 0) {
+            clear = 1;
+        }
+        else if (strcmp(argv[i], "-C") == 0) {
+            klog_clear();
+            return 0;
+        }
+        else if ((strcmp(argv[i], "-l") == 0 || strcmp(argv[i], "-n") == 0) && i + 1 < argc) {
+            int level = klog_parse_level(argv[i + 1]);
+            
+            if (level < 0) {
+                terminal_write("Error: Unknown log level: ");
+                terminal_write(argv[i + 1]);
+                terminal_write("\n");
+                return -1;
+            }
+            
+            if (strcmp(argv[i], "-n") == 0) {
+                klog_set_console_level((klog_level_t)level);
+                terminal_write("Console log level set to ");
+                terminal_write(klog_level_name((klog_level_t)level));
+                terminal_write("\n");
+                return 0;
+            }
+            
+            max_level = (klog_level_t)level;
+            i++;
+        }
+        else {
+            terminal_write("Usage: dmesg [options]\n");
+            terminal_write("Options:\n");
+            terminal_write("  -l <level>                            Show records at or above a severity\n");
+            terminal_write("  -n <level>                            Set the console log level\n");
+            terminal_write("  -c                                    Clear the log after printing it\n");
+            terminal_write("  -C                                    Clear the log\n");
+            terminal_write("Levels: emerg, alert, crit, err, warning, notice, info, debug (or 0-7)\n");
+            return strcmp(argv[i], "help") == 0 ? 0 : -1;
+        }
+    }
+    
+    klog_dump(max_level);
+    
+    if (clear) {
+        klog_clear();
+    }
+    
+    return 0;
+}
+
+// Iostat command handler
+int iostat_command(int argc, char** argv) {
+    if (argc < 2) {
+        storage_list_io_stats();
+        return 0;
+    }
+    
+    if (strcmp(argv[1], "-z") == 0) {
+        storage_reset_io_stats(argc > 2 ? argv[2] : NULL);
+        terminal_write("I/O statistics reset\n");
+        return 0;
+    }
+    
+    if (strcmp(argv[1], "help") == 0 || argv[1][0] == '-') {
+        terminal_write("Usage: iostat [device | -z [device]]\n");
+        terminal_write("  iostat                                Show I/O counters for every device\n");
+        terminal_write("  iostat <device>                       Show a device's counters and latency histograms\n");
+        terminal_write("  iostat -z [device]                    Reset the counters\n");
+        return strcmp(argv[1], "help") == 0 ? 0 : -1;
+    }
+    
+    return storage_print_io_stats(argv[1]);
+}
@@ -15,5 +15,7 @@ int package_command(int argc, char** argv);
 int update_command(int argc, char** argv);
 int backup_command(int argc, char** argv);
 int monitor_command(int argc, char** argv);
+int dmesg_command(int argc, char** argv);
+int iostat_command(int argc, char** argv);
 
 #endif /* SYSTEM_COMMANDS_H */
@@ -7,16 +7,24 @@
 #include "../kernel/kernel.h"
 #include "../kernel/memory.h"
 #include "../libc/string.h"
+#include "../libc/hashmap.h"
 #include "docker/docker_support.h"
 #include "lxc/lxc_support.h"
 
 // Maximum number of containers
 #define MAX_CONTAINERS 100
 
+// Name lookup table size
+#define CONTAINER_MAP_CAPACITY 128
+
 // Container array
 static container_t* containers[MAX_CONTAINERS];
 static unsigned int container_count = 0;
 
+// Container name index
+static hashmap_entry_t container_map_entries[CONTAINER_MAP_CAPACITY];
+static hashmap_t container_map;
+
 // Initialize the container manager
 void container_manager_init() {
     terminal_write("Initializing container manager...\n");
@@ -27,6 +35,7 @@ void container_manager_init() {
     }
     
     container_count = 0;
+    hashmap_init(&container_map, container_map_entries, CONTAINER_MAP_CAPACITY);
     
     // Initialize container backends
     docker_init();
@@ -43,13 +52,11 @@ int container_create(const char* name, container_type_t type, const char* image,
     }
     
     // Check if a container with the same name already exists
-    for (unsigned int i = 0; i < container_count; i++) {
-        if (strcmp(containers[i]->name, name) == 0) {
-            terminal_write("Error: Container with name '");
-            terminal_write(name);
-            terminal_write("' already exists\n");
-            return -1;
-        }
+    if (hashmap_get(&container_map, name)) {
+        terminal_write("Error: Container with name '");
+        terminal_write(name);
+        terminal_write("' already exists\n");
+        return -1;
     }
     
     // Check if we have room for another container
@@ -105,8 +112,9 @@ int container_create(const char* name, container_type_t type, const char* image,
     container->label_count = 0;
     container->private_data = NULL;
     
-    // Add the container to the array
+    // Add the container to the array and the name index
     containers[container_count++] = container;
+    hashmap_insert(&container_map, container->name, container);
     
     // Create the container based on its type
     int result = -1;
@@ -137,6 +145,7 @@ int container_create(const char* name, container_type_t type, const char* image,
     
     if (result != 0) {
         // Failed to create the container, remove it from the array
+        hashmap_remove(&container_map, container->name);
         containers[--container_count] = NULL;
         free_block(container);
         return -1;
@@ -222,7 +231,8 @@ int container_destroy(const char* name) {
         free_blocks(container->labels, (container->label_count * sizeof(char*) + MEMORY_BLOCK_SIZE - 1) / MEMORY_BLOCK_SIZE);
     }
     
-    // Remove the container from the array
+    // Remove the container from the name index and the array
+    hashmap_remove(&container_map, container->name);
     free_block(container);
     
     for (unsigned int i = index; i < container_count - 1; i++) {
@@ -292,11 +302,5 @@ container_t* container_get(const char* name) {
         return NULL;
     }
     
-    for (unsigned int i = 0; i < container_count; i++) {
-        if (strcmp(containers[i]->name, name) == 0) {
-            return containers[i];
-        }
-    }
-    
-    return NULL;
+    return (container_t*)hashmap_get(&container_map, name);
 }
@@ -7,14 +7,22 @@
 #include "../kernel/kernel.h"
 #include "../kernel/memory.h"
 #include "../libc/string.h"
+#include "../libc/hashmap.h"
 
 // Maximum number of audio devices
 #define MAX_AUDIO_DEVICES 8
 
+// Name lookup table size
+#define AUDIO_MAP_CAPACITY 16
+
 // Audio device array
 static audio_device_t* audio_devices[MAX_AUDIO_DEVICES];
 static int audio_device_count = 0;
 
+// Audio device name index
+static hashmap_entry_t audio_map_entries[AUDIO_MAP_CAPACITY];
+static hashmap_t audio_map;
+
 // Initialize audio subsystem
 void audio_init() {
     terminal_write("Initializing audio subsystem...\n");
@@ -25,6 +33,7 @@ void audio_init() {
     }
     
     audio_device_count = 0;
+    hashmap_init(&audio_map, audio_map_entries, AUDIO_MAP_CAPACITY);
     
     // Detect audio devices
     detect_audio_devices();
@@ -72,13 +81,11 @@ int audio_register_device(audio_device_t* device) {
     }
     
     // Check if a device with the same name already exists
-    for (int i = 0; i < audio_device_count; i++) {
-        if (strcmp(audio_devices[i]->name, device->name) == 0) {
-            terminal_write("Error: Audio device with name '");
-            terminal_write(device->name);
-            terminal_write("' already exists\n");
-            return -1;
-        }
+    if (hashmap_get(&audio_map, device->name)) {
+        terminal_write("Error: Audio device with name '");
+        terminal_write(device->name);
+        terminal_write("' already exists\n");
+        return -1;
     }
     
     // Allocate memory for the device
@@ -92,6 +99,13 @@ int audio_register_device(audio_device_t* device) {
     // Copy the device data
     memcpy(new_device, device, sizeof(audio_device_t));
     
+    // Index the device by name
+    if (hashmap_insert(&audio_map, new_device->name, new_device) != 0) {
+        terminal_write("Error: Failed to index audio device\n");
+        free_block(new_device);
+        return -1;
+    }
+    
     // Add the device to the array
     audio_devices[audio_device_count++] = new_device;
     
@@ -125,7 +139,8 @@ int audio_unregister_device(const char* name) {
                 audio_devices[i]->close(audio_devices[i]);
             }
             
-            // Free the device memory
+            // Drop the name index entry and free the device memory
+            hashmap_remove(&audio_map, name);
             free_block(audio_devices[i]);
             
             // Remove the device from the array by shifting all subsequent devices
@@ -156,14 +171,7 @@ audio_device_t* audio_get_device(const char* name) {
         return NULL;
     }
     
-    // Find the device
-    for (int i = 0; i < audio_device_count; i++) {
-        if (strcmp(audio_devices[i]->name, name) == 0) {
-            return audio_devices[i];
-        }
-    }
-    
-    return NULL;
+    return (audio_device_t*)hashmap_get(&audio_map, name);
 }
 
 // Play audio on a device
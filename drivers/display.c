@@ -7,14 +7,22 @@
 #include "../kernel/kernel.h"
 #include "../kernel/memory.h"
 #include "../libc/string.h"
+#include "../libc/hashmap.h"
 
 // Maximum number of display devices
 #define MAX_DISPLAY_DEVICES 4
 
+// Name lookup table size
+#define DISPLAY_MAP_CAPACITY 8
+
 // Display device array
 static display_device_t* display_devices[MAX_DISPLAY_DEVICES];
 static int display_device_count = 0;
 
+// Display device name index
+static hashmap_entry_t display_map_entries[DISPLAY_MAP_CAPACITY];
+static hashmap_t display_map;
+
 // Initialize display subsystem
 void display_init() {
     terminal_write("Initializing display subsystem...\n");
@@ -25,6 +33,7 @@ void display_init() {
     }
     
     display_device_count = 0;
+    hashmap_init(&display_map, display_map_entries, DISPLAY_MAP_CAPACITY);
     
     // Detect display devices
     detect_display_devices();
@@ -72,13 +81,11 @@ int display_register_device(display_device_t* device) {
     }
     
     // Check if a device with the same name already exists
-    for (int i = 0; i < display_device_count; i++) {
-        if (strcmp(display_devices[i]->name, device->name) == 0) {
-            terminal_write("Error: Display device with name '");
-            terminal_write(device->name);
-            terminal_write("' already exists\n");
-            return -1;
-        }
+    if (hashmap_get(&display_map, device->name)) {
+        terminal_write("Error: Display device with name '");
+        terminal_write(device->name);
+        terminal_write("' already exists\n");
+        return -1;
     }
     
     // Allocate memory for the device
@@ -92,6 +99,13 @@ int display_register_device(display_device_t* device) {
     // Copy the device data
     memcpy(new_device, device, sizeof(display_device_t));
     
+    // Index the device by name
+    if (hashmap_insert(&display_map, new_device->name, new_device) != 0) {
+        terminal_write("Error: Failed to index display device\n");
+        free_block(new_device);
+        return -1;
+    }
+    
     // Add the device to the array
     display_devices[display_device_count++] = new_device;
     
@@ -125,7 +139,8 @@ int display_unregister_device(const char* name) {
                 display_devices[i]->close(display_devices[i]);
             }
             
-            // Free the device memory
+            // Drop the name index entry and free the device memory
+            hashmap_remove(&display_map, name);
             free_block(display_devices[i]);
             
             // Remove the device from the array by shifting all subsequent devices
@@ -156,14 +171,7 @@ display_device_t* display_get_device(const char* name) {
         return NULL;
     }
     
-    // Find the device
-    for (int i = 0; i < display_device_count; i++) {
-        if (strcmp(display_devices[i]->name, name) == 0) {
-            return display_devices[i];
-        }
-    }
-    
-    return NULL;
+    return (display_device_t*)hashmap_get(&display_map, name);
 }
 
 // Set the mode of a display device
@@ -5,6 +5,7 @@
 
 #include "keyboard.h"
 #include "../kernel/kernel.h"
+#include "serial.h"
 
 // Keyboard buffer
 #define KEYBOARD_BUFFER_SIZE 256
@@ -150,7 +151,12 @@ int keyboard_buffer_available() {
 char keyboard_read() {
     // Wait for a character to be available
     while (!keyboard_buffer_available()) {
+        // Pick up serial console input and drain pending output
         // In a real system, we would yield the CPU here
+        serial_poll();
+        
+        // Run the kernel's background work
+        kernel_idle();
     }
     
     return keyboard_buffer_get();
@@ -0,0 +1,800 @@
+/**
+ * LightOS Drivers
+ * NVMe driver implementation
+ *
+ * Each controller gets one I/O submission/completion queue pair per CPU,
+ * so CPUs never share a queue or a doorbell unless there are more CPUs
+ * than the controller grants queues; then CPUs take the queues in turn by
+ * CPU index and some queues are shared. The CPU-to-queue map is built once
+ * the queues exist, so a submission costs one cpu_index() read. Data buffers are described
+ * with PRP entries (a PRP list for transfers spanning more than two pages)
+ * and completions are found by polling the completion queues' phase tags.
+ * Buffers are passed to the controller by address, relying on the kernel's
+ * identity mapping.
+ */
+
+#include "nvme.h"
+#include "../kernel/kernel.h"
+#include "../kernel/klog.h"
+#include "../kernel/ktime.h"
+#include "../kernel/memory.h"
+#include "../libc/string.h"
+
+KLOG_SUBSYSTEM(nvme_log, "nvme");
+
+// Memory blocks per queue pair: submission queue, completion queue and
+// (for I/O queues) one 512-byte PRP list per command slot
+#define NVME_ADMIN_QUEUE_BLOCKS 2
+#define NVME_IO_QUEUE_BLOCKS (2 + NVME_IO_QUEUE_DEPTH * NVME_PRP_LIST_ENTRIES * 8 / MEMORY_BLOCK_SIZE)
+#define NVME_CONTROLLER_BLOCKS ((sizeof(nvme_controller_t) + MEMORY_BLOCK_SIZE - 1) / MEMORY_BLOCK_SIZE)
+
+// Chunks a synchronous request keeps in flight at once
+#define NVME_SYNC_BATCH 8
+
+// State shared by the chunks of one synchronous request
+typedef struct {
+    unsigned int pending;
+    int error;
+} nvme_sync_t;
+
+static nvme_controller_t* nvme_controllers[NVME_MAX_CONTROLLERS];
+static unsigned int nvme_controller_count = 0;
+
+// Read a 32-bit controller register
+static inline unsigned int nvme_read32(nvme_controller_t* ctrl, unsigned int reg) {
+    return *(volatile unsigned int*) (ctrl->regs + reg);
+}
+
+// Write a 32-bit controller register
+static inline void nvme_write32(nvme_controller_t* ctrl, unsigned int reg, unsigned int value) {
+    *(volatile unsigned int*) (ctrl->regs + reg) = value;
+}
+
+// Read a 64-bit controller register
+static inline unsigned long long nvme_read64(nvme_controller_t* ctrl, unsigned int reg) {
+    unsigned long long low = nvme_read32(ctrl, reg);
+    unsigned long long high = nvme_read32(ctrl, reg + 4);
+    return low | (high << 32);
+}
+
+// Write a 64-bit controller register
+static inline void nvme_write64(nvme_controller_t* ctrl, unsigned int reg, unsigned long long value) {
+    nvme_write32(ctrl, reg, (unsigned int) value);
+    nvme_write32(ctrl, reg + 4, (unsigned int) (value >> 32));
+}
+
+// Keep the compiler from moving memory accesses across a doorbell write
+static inline void nvme_barrier() {
+    __asm__ __volatile__("" : : : "memory");
+}
+
+// Get the I/O queue used by the current CPU
+static nvme_queue_t* nvme_current_queue(nvme_controller_t* ctrl) {
+    return &ctrl->io[ctrl->cpu_queues[cpu_index()]];
+}
+
+// Wait for CSTS.RDY to reach the given value
+static int nvme_wait_ready(nvme_controller_t* ctrl, unsigned int ready) {
+    unsigned long long deadline = ktime_get_ns() + (unsigned long long) ctrl->timeout_ms * NSEC_PER_MSEC;
+
+    while ((nvme_read32(ctrl, NVME_REG_CSTS) & NVME_CSTS_READY) != ready) {
+        if (nvme_read32(ctrl, NVME_REG_CSTS) & NVME_CSTS_FATAL) {
+            return -1;
+        }
+
+        if (ktime_get_ns() > deadline) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Set up a queue pair's software state
+static void nvme_queue_init(nvme_controller_t* ctrl, nvme_queue_t* queue, unsigned short id, unsigned short depth, unsigned char* memory, int has_prp_lists) {
+    memset(queue, 0, sizeof(nvme_queue_t));
+    memset(memory, 0, 2 * MEMORY_BLOCK_SIZE);
+
+    queue->ctrl = ctrl;
+    queue->sq = (nvme_command_t*) memory;
+    queue->cq = (volatile nvme_completion_t*) (memory + MEMORY_BLOCK_SIZE);
+    queue->prp_lists = has_prp_lists ? (unsigned long long*) (memory + 2 * MEMORY_BLOCK_SIZE) : NULL;
+    queue->sq_doorbell = (volatile unsigned int*) (ctrl->regs + NVME_DOORBELL_BASE + (2 * id) * ctrl->doorbell_stride);
+    queue->cq_doorbell = (volatile unsigned int*) (ctrl->regs + NVME_DOORBELL_BASE + (2 * id + 1) * ctrl->doorbell_stride);
+    queue->id = id;
+    queue->depth = depth;
+    queue->phase = 1;
+
+    // One slot stays unused so a full queue never looks empty
+    for (unsigned short cid = 0; cid < depth - 1; cid++) {
+        queue->free_cids[queue->free_count++] = cid;
+    }
+}
+
+// Copy a command into the submission queue (the doorbell is rung later)
+static void nvme_queue_push(nvme_queue_t* queue, const nvme_command_t* command) {
+    memcpy(&queue->sq[queue->sq_tail], command, sizeof(nvme_command_t));
+    queue->sq_tail = (queue->sq_tail + 1) % queue->depth;
+    queue->submitted++;
+}
+
+// Ring the submission doorbell for commands pushed since the last commit
+static void nvme_queue_commit(nvme_queue_t* queue) {
+    if (queue->sq_tail == queue->sq_doorbell_tail) {
+        return;
+    }
+
+    nvme_barrier();
+    *queue->sq_doorbell = queue->sq_tail;
+    queue->sq_doorbell_tail = queue->sq_tail;
+}
+
+// Fail every outstanding command and stop the controller
+static void nvme_fail(nvme_controller_t* ctrl) {
+    if (ctrl->failed) {
+        return;
+    }
+
+    ctrl->failed = 1;
+    KLOG(&nvme_log, KLOG_ERR, "controller %u:%u.%u stopped responding\n", ctrl->pci.bus, ctrl->pci.device, ctrl->pci.function);
+
+    nvme_write32(ctrl, NVME_REG_CC, nvme_read32(ctrl, NVME_REG_CC) & ~NVME_CC_ENABLE);
+
+    for (unsigned int q = 0; q < ctrl->io_queue_count; q++) {
+        nvme_queue_t* queue = &ctrl->io[q];
+
+        for (unsigned short cid = 0; cid < queue->depth; cid++) {
+            storage_hw_request_t* request = queue->requests[cid];
+
+            if (!request) {
+                continue;
+            }
+
+            queue->requests[cid] = NULL;
+            queue->free_cids[queue->free_count++] = cid;
+            queue->outstanding--;
+
+            request->result = -1;
+            request->done(request);
+        }
+    }
+}
+
+// Process new completions on an I/O queue; returns the number processed
+static int nvme_queue_poll(nvme_queue_t* queue) {
+    int processed = 0;
+
+    while ((queue->cq[queue->cq_head].status & 1) == queue->phase) {
+        nvme_barrier();
+
+        unsigned short cid = queue->cq[queue->cq_head].cid;
+        unsigned short status = queue->cq[queue->cq_head].status >> 1;
+        queue->sq_head = queue->cq[queue->cq_head].sq_head;
+
+        queue->cq_head++;
+
+        if (queue->cq_head == queue->depth) {
+            queue->cq_head = 0;
+            queue->phase ^= 1;
+        }
+
+        if (cid >= queue->depth || !queue->requests[cid]) {
+            KLOG(&nvme_log, KLOG_WARNING, "queue %u: completion for unknown command %u\n", queue->id, cid);
+            continue;
+        }
+
+        storage_hw_request_t* request = queue->requests[cid];
+        queue->requests[cid] = NULL;
+        queue->free_cids[queue->free_count++] = cid;
+        queue->outstanding--;
+        queue->completed++;
+        processed++;
+
+        if (status != 0) {
+            KLOG(&nvme_log, KLOG_ERR, "queue %u: command %u failed (status 0x%x)\n", queue->id, cid, status);
+            request->result = -1;
+        } else {
+            request->result = 0;
+        }
+
+        request->done(request);
+    }
+
+    if (processed > 0) {
+        *queue->cq_doorbell = queue->cq_head;
+        queue->last_progress = ktime_get_ns();
+    } else if (queue->outstanding > 0 && ktime_get_ns() - queue->last_progress > NVME_IO_TIMEOUT_NS) {
+        nvme_fail(queue->ctrl);
+    }
+
+    return processed;
+}
+
+// Describe a buffer with PRP entries
+static void nvme_build_prps(nvme_queue_t* queue, unsigned short cid, nvme_command_t* command, void* buffer, unsigned int bytes) {
+    unsigned long long address = (unsigned long long) buffer;
+    unsigned int first = NVME_PAGE_SIZE - (address & (NVME_PAGE_SIZE - 1));
+
+    command->prp1 = address;
+    command->prp2 = 0;
+
+    if (bytes <= first) {
+        return;
+    }
+
+    address += first;
+    bytes -= first;
+
+    // A second page fits in PRP2 itself
+    if (bytes <= NVME_PAGE_SIZE) {
+        command->prp2 = address;
+        return;
+    }
+
+    unsigned long long* list = queue->prp_lists + cid * NVME_PRP_LIST_ENTRIES;
+    unsigned int count = 0;
+
+    while (bytes > 0) {
+        list[count++] = address;
+        address += NVME_PAGE_SIZE;
+        bytes = bytes > NVME_PAGE_SIZE ? bytes - NVME_PAGE_SIZE : 0;
+    }
+
+    command->prp2 = (unsigned long long) list;
+}
+
+// Queue a request on an I/O queue (the caller commits it)
+static int nvme_queue_submit(nvme_queue_t* queue, storage_hw_request_t* request) {
+    nvme_controller_t* ctrl = queue->ctrl;
+
+    // Wait for a free slot, making the queued commands visible first
+    while (queue->free_count == 0 && !ctrl->failed) {
+        nvme_queue_commit(queue);
+        nvme_queue_poll(queue);
+    }
+
+    if (ctrl->failed) {
+        return -1;
+    }
+
+    unsigned short cid = queue->free_cids[--queue->free_count];
+
+    nvme_command_t command;
+    memset(&command, 0, sizeof(nvme_command_t));
+    command.cid = cid;
+    command.nsid = ctrl->nsid;
+
+    if (request->opcode == STORAGE_OP_FLUSH) {
+        command.opcode = NVME_CMD_FLUSH;
+    } else {
+        command.opcode = request->opcode == STORAGE_OP_WRITE ? NVME_CMD_WRITE : NVME_CMD_READ;
+        command.cdw10 = request->start_sector;
+        command.cdw11 = 0;
+        command.cdw12 = request->sector_count - 1;
+        nvme_build_prps(queue, cid, &command, request->buffer, request->sector_count * ctrl->sector_size);
+    }
+
+    if (queue->outstanding == 0) {
+        queue->last_progress = ktime_get_ns();
+    }
+
+    queue->requests[cid] = request;
+    queue->outstanding++;
+    nvme_queue_push(queue, &command);
+
+    return 0;
+}
+
+// Check a read or write against the namespace and transfer limits
+static int nvme_check_request(nvme_controller_t* ctrl, unsigned int start_sector, unsigned int sector_count) {
+    if (sector_count == 0 || (unsigned long long) start_sector + sector_count > ctrl->sectors) {
+        return -1;
+    }
+
+    return (unsigned long long) sector_count * ctrl->sector_size > ctrl->max_transfer ? -1 : 0;
+}
+
+// Finish one chunk of a synchronous request
+static void nvme_sync_done(storage_hw_request_t* request) {
+    nvme_sync_t* sync = (nvme_sync_t*) request->private_data;
+
+    if (request->result != 0) {
+        sync->error = 1;
+    }
+
+    sync->pending--;
+}
+
+// Read or write synchronously, splitting at the transfer limit
+static int nvme_rw(nvme_controller_t* ctrl, unsigned int opcode, unsigned int start_sector, unsigned int sector_count, void* buffer) {
+    if (ctrl->failed || (unsigned long long) start_sector + sector_count > ctrl->sectors) {
+        return -1;
+    }
+
+    nvme_queue_t* queue = nvme_current_queue(ctrl);
+    unsigned int chunk_sectors = ctrl->max_transfer / ctrl->sector_size;
+    unsigned char* data = (unsigned char*) buffer;
+    storage_hw_request_t requests[NVME_SYNC_BATCH];
+    nvme_sync_t sync;
+
+    sync.error = 0;
+
+    while (sector_count > 0 && !sync.error) {
+        sync.pending = 0;
+
+        for (unsigned int i = 0; i < NVME_SYNC_BATCH && sector_count > 0; i++) {
+            unsigned int count = sector_count < chunk_sectors ? sector_count : chunk_sectors;
+
+            requests[i].opcode = opcode;
+            requests[i].start_sector = start_sector;
+            requests[i].sector_count = count;
+            requests[i].buffer = data;
+            requests[i].result = 0;
+            requests[i].done = nvme_sync_done;
+            requests[i].private_data = &sync;
+
+            if (nvme_queue_submit(queue, &requests[i]) != 0) {
+                sync.error = 1;
+                break;
+            }
+
+            sync.pending++;
+            start_sector += count;
+            sector_count -= count;
+            data += count * ctrl->sector_size;
+        }
+
+        nvme_queue_commit(queue);
+
+        while (sync.pending > 0) {
+            nvme_queue_poll(queue);
+        }
+    }
+
+    return sync.error ? -1 : 0;
+}
+
+// NVMe device read function
+static int nvme_read_sectors(storage_device_t* dev, unsigned int start_sector, unsigned int sector_count, void* buffer) {
+    return nvme_rw((nvme_controller_t*) dev->private_data, STORAGE_OP_READ, start_sector, sector_count, buffer);
+}
+
+// NVMe device write function
+static int nvme_write_sectors(storage_device_t* dev, unsigned int start_sector, unsigned int sector_count, const void* buffer) {
+    return nvme_rw((nvme_controller_t*) dev->private_data, STORAGE_OP_WRITE, start_sector, sector_count, (void*) buffer);
+}
+
+// NVMe device flush function
+static int nvme_flush(storage_device_t* dev) {
+    nvme_controller_t* ctrl = (nvme_controller_t*) dev->private_data;
+
+    if (ctrl->failed) {
+        return -1;
+    }
+
+    nvme_queue_t* queue = nvme_current_queue(ctrl);
+    storage_hw_request_t request;
+    nvme_sync_t sync;
+
+    memset(&request, 0, sizeof(storage_hw_request_t));
+    request.opcode = STORAGE_OP_FLUSH;
+    request.done = nvme_sync_done;
+    request.private_data = &sync;
+    sync.pending = 1;
+    sync.error = 0;
+
+    if (nvme_queue_submit(queue, &request) != 0) {
+        return -1;
+    }
+
+    nvme_queue_commit(queue);
+
+    while (sync.pending > 0) {
+        nvme_queue_poll(queue);
+    }
+
+    return sync.error ? -1 : 0;
+}
+
+// Start a queued command on the current CPU's queue
+static int nvme_submit_request(storage_device_t* dev, storage_hw_request_t* request) {
+    nvme_controller_t* ctrl = (nvme_controller_t*) dev->private_data;
+
+    if (ctrl->failed) {
+        return -1;
+    }
+
+    // Oversized requests go through the synchronous path, which splits them
+    if (request->opcode != STORAGE_OP_FLUSH && nvme_check_request(ctrl, request->start_sector, request->sector_count) != 0) {
+        return -1;
+    }
+
+    return nvme_queue_submit(nvme_current_queue(ctrl), request);
+}
+
+// Ring the doorbell of every queue with commands queued since its last
+// commit; the caller may have moved to another CPU since it submitted them
+static void nvme_commit_requests(storage_device_t* dev) {
+    nvme_controller_t* ctrl = (nvme_controller_t*) dev->private_data;
+
+    for (unsigned int q = 0; q < ctrl->io_queue_count; q++) {
+        nvme_queue_commit(&ctrl->io[q]);
+    }
+}
+
+// Process completions on every I/O queue
+static int nvme_poll_completions(storage_device_t* dev) {
+    nvme_controller_t* ctrl = (nvme_controller_t*) dev->private_data;
+    int processed = 0;
+
+    for (unsigned int q = 0; q < ctrl->io_queue_count; q++) {
+        if (ctrl->io[q].outstanding > 0) {
+            processed += nvme_queue_poll(&ctrl->io[q]);
+        }
+    }
+
+    return processed;
+}
+
+// Run an admin command and wait for it; returns 0 and the result dword on success
+static int nvme_admin_command(nvme_controller_t* ctrl, nvme_command_t* command, unsigned int* result) {
+    nvme_queue_t* admin = &ctrl->admin;
+
+    // Admin commands run one at a time, so every command uses ID 0
+    command->cid = 0;
+    nvme_queue_push(admin, command);
+    nvme_queue_commit(admin);
+
+    unsigned long long deadline = ktime_get_ns() + NVME_ADMIN_TIMEOUT_NS;
+
+    while ((admin->cq[admin->cq_head].status & 1) != admin->phase) {
+        if (ktime_get_ns() > deadline) {
+            KLOG(&nvme_log, KLOG_ERR, "admin command 0x%x timed out\n", command->opcode);
+            return -1;
+        }
+    }
+
+    nvme_barrier();
+
+    unsigned short status = admin->cq[admin->cq_head].status >> 1;
+
+    if (result) {
+        *result = admin->cq[admin->cq_head].result;
+    }
+
+    admin->cq_head++;
+
+    if (admin->cq_head == admin->depth) {
+        admin->cq_head = 0;
+        admin->phase ^= 1;
+    }
+
+    *admin->cq_doorbell = admin->cq_head;
+
+    if (status != 0) {
+        KLOG(&nvme_log, KLOG_ERR, "admin command 0x%x failed (status 0x%x)\n", command->opcode, status);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Read an identify data structure
+static int nvme_identify(nvme_controller_t* ctrl, unsigned int cns, unsigned int nsid, void* buffer) {
+    nvme_command_t command;
+    memset(&command, 0, sizeof(nvme_command_t));
+    command.opcode = NVME_ADMIN_IDENTIFY;
+    command.nsid = nsid;
+    command.prp1 = (unsigned long long) buffer;
+    command.cdw10 = cns;
+
+    return nvme_admin_command(ctrl, &command, NULL);
+}
+
+// Create an I/O completion and submission queue pair
+static int nvme_create_io_queue(nvme_controller_t* ctrl, unsigned short id, unsigned short depth) {
+    unsigned char* memory = (unsigned char*) allocate_blocks(NVME_IO_QUEUE_BLOCKS);
+
+    if (!memory) {
+        return -1;
+    }
+
+    nvme_queue_t* queue = &ctrl->io[id - 1];
+    nvme_queue_init(ctrl, queue, id, depth, memory, 1);
+
+    // Physically contiguous completion queue, interrupts off (polled)
+    nvme_command_t command;
+    memset(&command, 0, sizeof(nvme_command_t));
+    command.opcode = NVME_ADMIN_CREATE_CQ;
+    command.prp1 = (unsigned long long) queue->cq;
+    command.cdw10 = ((unsigned int) (depth - 1) << 16) | id;
+    command.cdw11 = 1;
+
+    if (nvme_admin_command(ctrl, &command, NULL) != 0) {
+        free_blocks(memory, NVME_IO_QUEUE_BLOCKS);
+        return -1;
+    }
+
+    memset(&command, 0, sizeof(nvme_command_t));
+    command.opcode = NVME_ADMIN_CREATE_SQ;
+    command.prp1 = (unsigned long long) queue->sq;
+    command.cdw10 = ((unsigned int) (depth - 1) << 16) | id;
+    command.cdw11 = ((unsigned int) id << 16) | 1;
+
+    if (nvme_admin_command(ctrl, &command, NULL) != 0) {
+        // The completion queue stays allocated on the controller, so keep its memory
+        return -1;
+    }
+
+    return 0;
+}
+
+// Reset a controller and enable it with its admin queue pair
+static int nvme_enable(nvme_controller_t* ctrl, unsigned char* admin_memory, unsigned int max_entries) {
+    nvme_write32(ctrl, NVME_REG_CC, nvme_read32(ctrl, NVME_REG_CC) & ~NVME_CC_ENABLE);
+
+    if (nvme_wait_ready(ctrl, 0) != 0) {
+        terminal_write("Error: NVMe controller did not reset\n");
+        return -1;
+    }
+
+    unsigned short depth = max_entries < NVME_ADMIN_QUEUE_DEPTH ? max_entries : NVME_ADMIN_QUEUE_DEPTH;
+    nvme_queue_init(ctrl, &ctrl->admin, 0, depth, admin_memory, 0);
+
+    nvme_write32(ctrl, NVME_REG_AQA, ((unsigned int) (depth - 1) << 16) | (depth - 1));
+    nvme_write64(ctrl, NVME_REG_ASQ, (unsigned long long) ctrl->admin.sq);
+    nvme_write64(ctrl, NVME_REG_ACQ, (unsigned long long) ctrl->admin.cq);
+
+    // Completions are polled
+    nvme_write32(ctrl, NVME_REG_INTMS, 0xFFFFFFFF);
+    nvme_write32(ctrl, NVME_REG_CC, NVME_CC_ENABLE | NVME_CC_IOSQES | NVME_CC_IOCQES);
+
+    if (nvme_wait_ready(ctrl, 1) != 0) {
+        terminal_write("Error: NVMe controller did not become ready\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Read the transfer limit and the first namespace's geometry
+static int nvme_identify_namespace(nvme_controller_t* ctrl, unsigned char* identify) {
+    if (nvme_identify(ctrl, NVME_IDENTIFY_CONTROLLER, 0, identify) != 0) {
+        return -1;
+    }
+
+    // Transfer limit: MDTS (in units of the minimum page size), the PRP
+    // list size and the block layer's largest request
+    ctrl->max_transfer = NVME_PRP_LIST_ENTRIES * NVME_PAGE_SIZE;
+
+    if (ctrl->max_transfer > STORAGE_MAX_REQUEST_BYTES) {
+        ctrl->max_transfer = STORAGE_MAX_REQUEST_BYTES;
+    }
+
+    if (identify[77] != 0 && identify[77] < 20 && ((unsigned int) NVME_PAGE_SIZE << identify[77]) < ctrl->max_transfer) {
+        ctrl->max_transfer = (unsigned int) NVME_PAGE_SIZE << identify[77];
+    }
+
+    ctrl->nsid = 1;
+
+    if (nvme_identify(ctrl, NVME_IDENTIFY_NAMESPACE, ctrl->nsid, identify) != 0) {
+        return -1;
+    }
+
+    unsigned long long sectors = *(unsigned long long*) identify;
+    unsigned int format = identify[26] & 0xF;
+    unsigned int lba_shift = identify[128 + format * 4 + 2];
+
+    if (sectors == 0 || lba_shift < 9 || lba_shift > 12) {
+        terminal_write("Error: NVMe namespace 1 is missing or has an unsupported sector size\n");
+        return -1;
+    }
+
+    ctrl->sector_size = 1u << lba_shift;
+
+    // The block layer addresses sectors with 32 bits
+    ctrl->sectors = sectors > 0xFFFFFFFFull ? 0xFFFFFFFFull : sectors;
+
+    return 0;
+}
+
+// Create one I/O queue pair per CPU, as many as the controller grants
+static int nvme_create_io_queues(nvme_controller_t* ctrl, unsigned int max_entries) {
+    unsigned int wanted = cpu_count_limit();
+
+    if (wanted > NVME_MAX_IO_QUEUES) {
+        wanted = NVME_MAX_IO_QUEUES;
+    }
+
+    nvme_command_t command;
+    memset(&command, 0, sizeof(nvme_command_t));
+    command.opcode = NVME_ADMIN_SET_FEATURES;
+    command.cdw10 = NVME_FEATURE_NUM_QUEUES;
+    command.cdw11 = ((wanted - 1) << 16) | (wanted - 1);
+
+    unsigned int granted = 0;
+
+    if (nvme_admin_command(ctrl, &command, &granted) == 0) {
+        unsigned int submission = (granted & 0xFFFF) + 1;
+        unsigned int completion = (granted >> 16) + 1;
+
+        if (submission < wanted) {
+            wanted = submission;
+        }
+
+        if (completion < wanted) {
+            wanted = completion;
+        }
+    } else {
+        wanted = 1;
+    }
+
+    unsigned short depth = max_entries < NVME_IO_QUEUE_DEPTH ? max_entries : NVME_IO_QUEUE_DEPTH;
+
+    for (unsigned int i = 1; i <= wanted; i++) {
+        if (nvme_create_io_queue(ctrl, i, depth) != 0) {
+            break;
+        }
+
+        ctrl->io_queue_count++;
+    }
+
+    if (ctrl->io_queue_count == 0) {
+        terminal_write("Error: Failed to create NVMe I/O queues\n");
+        return -1;
+    }
+
+    // CPUs take the queues in turn
+    for (unsigned int cpu = 0; cpu < CPU_MAX_CPUS; cpu++) {
+        ctrl->cpu_queues[cpu] = (unsigned char) (cpu % ctrl->io_queue_count);
+    }
+
+    return 0;
+}
+
+// Stop a controller that failed to come up and free its memory
+static void nvme_destroy(nvme_controller_t* ctrl) {
+    // Queues the controller knows about must stay allocated while it is
+    // enabled, so disable it before freeing anything
+    nvme_write32(ctrl, NVME_REG_CC, nvme_read32(ctrl, NVME_REG_CC) & ~NVME_CC_ENABLE);
+
+    if (nvme_wait_ready(ctrl, 0) != 0) {
+        return;
+    }
+
+    for (unsigned int i = 0; i < ctrl->io_queue_count; i++) {
+        free_blocks(ctrl->io[i].sq, NVME_IO_QUEUE_BLOCKS);
+    }
+
+    if (ctrl->admin.sq) {
+        free_blocks(ctrl->admin.sq, NVME_ADMIN_QUEUE_BLOCKS);
+    }
+
+    free_blocks(ctrl, NVME_CONTROLLER_BLOCKS);
+}
+
+// Bring up a controller and register its first namespace
+static int nvme_probe(const pci_device_t* pci) {
+    int is_io = 0;
+    unsigned long long bar = pci_get_bar(pci, 0, &is_io);
+
+    if (is_io || bar == 0) {
+        terminal_write("Error: NVMe controller has no memory BAR\n");
+        return -1;
+    }
+
+    nvme_controller_t* ctrl = (nvme_controller_t*) allocate_blocks(NVME_CONTROLLER_BLOCKS);
+
+    if (!ctrl) {
+        terminal_write("Error: Failed to allocate memory for NVMe controller\n");
+        return -1;
+    }
+
+    memset(ctrl, 0, sizeof(nvme_controller_t));
+    ctrl->pci = *pci;
+    ctrl->regs = (volatile unsigned char*) bar;
+
+    pci_enable(pci, PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER | PCI_COMMAND_INTX_DISABLE);
+
+    unsigned long long cap = nvme_read64(ctrl, NVME_REG_CAP);
+    unsigned int max_entries = (unsigned int) (cap & 0xFFFF) + 1;
+
+    ctrl->doorbell_stride = 4u << ((cap >> 32) & 0xF);
+    ctrl->timeout_ms = (unsigned int) ((cap >> 24) & 0xFF) * 500;
+
+    if (((cap >> 48) & 0xF) != 0 || !((cap >> 37) & 1)) {
+        terminal_write("Error: NVMe controller does not support 4 KB pages or the NVM command set\n");
+        free_blocks(ctrl, NVME_CONTROLLER_BLOCKS);
+        return -1;
+    }
+
+    unsigned char* admin_memory = (unsigned char*) allocate_blocks(NVME_ADMIN_QUEUE_BLOCKS);
+    unsigned char* identify = (unsigned char*) allocate_block();
+
+    if (!admin_memory || !identify) {
+        terminal_write("Error: Failed to allocate memory for NVMe controller\n");
+
+        if (admin_memory) {
+            free_blocks(admin_memory, NVME_ADMIN_QUEUE_BLOCKS);
+        }
+
+        if (identify) {
+            free_block(identify);
+        }
+
+        free_blocks(ctrl, NVME_CONTROLLER_BLOCKS);
+        return -1;
+    }
+
+    if (nvme_enable(ctrl, admin_memory, max_entries) != 0 ||
+        nvme_identify_namespace(ctrl, identify) != 0 ||
+        nvme_create_io_queues(ctrl, max_entries) != 0) {
+        free_block(identify);
+
+        // Admin memory not yet handed to the queue is freed here
+        if (!ctrl->admin.sq) {
+            free_blocks(admin_memory, NVME_ADMIN_QUEUE_BLOCKS);
+        }
+
+        nvme_destroy(ctrl);
+        return -1;
+    }
+
+    free_block(identify);
+
+    storage_device_t device;
+    memset(&device, 0, sizeof(storage_device_t));
+
+    strcpy(device.name, "nvme0n1");
+    device.name[4] = '0' + nvme_controller_count;
+    device.type = STORAGE_TYPE_NVME;
+    device.size = ctrl->sectors * ctrl->sector_size;
+    device.sector_size = ctrl->sector_size;
+    device.read_only = 0;
+    device.removable = 0;
+    device.read_sectors = nvme_read_sectors;
+    device.write_sectors = nvme_write_sectors;
+    device.flush = nvme_flush;
+    device.submit_request = nvme_submit_request;
+    device.commit_requests = nvme_commit_requests;
+    device.poll_completions = nvme_poll_completions;
+    device.private_data = ctrl;
+
+    if (storage_register_device(&device) != 0) {
+        nvme_destroy(ctrl);
+        return -1;
+    }
+
+    KLOG(&nvme_log, KLOG_INFO, "controller %u:%u.%u: %u I/O queues, %u-byte sectors, %u KB max transfer\n",
+         pci->bus, pci->device, pci->function, ctrl->io_queue_count, ctrl->sector_size, ctrl->max_transfer / 1024);
+
+    nvme_controllers[nvme_controller_count++] = ctrl;
+    return 0;
+}
+
+// Find and initialize NVMe controllers; returns the number registered
+int nvme_init() {
+    pci_device_t devices[NVME_MAX_CONTROLLERS];
+    int found = pci_find_class(NVME_PCI_CLASS, NVME_PCI_SUBCLASS, devices, NVME_MAX_CONTROLLERS);
+
+    for (int i = 0; i < found && nvme_controller_count < NVME_MAX_CONTROLLERS; i++) {
+        // Programming interface 2 is NVM Express
+        if (devices[i].prog_if != 0x02) {
+            continue;
+        }
+
+        nvme_probe(&devices[i]);
+    }
+
+    return nvme_controller_count;
+}
+
+// Get the number of initialized controllers
+unsigned int nvme_get_controller_count() {
+    return nvme_controller_count;
+}
+
+// Get an initialized controller
+nvme_controller_t* nvme_get_controller(unsigned int index) {
+    return index < nvme_controller_count ? nvme_controllers[index] : NULL;
+}
@@ -0,0 +1,150 @@
+/**
+ * LightOS Drivers
+ * NVMe driver header
+ */
+
+#ifndef NVME_H
+#define NVME_H
+
+#include "pci.h"
+#include "storage.h"
+#include "../kernel/cpu.h"
+
+// PCI class of NVMe controllers (mass storage, non-volatile memory)
+#define NVME_PCI_CLASS    0x01
+#define NVME_PCI_SUBCLASS 0x08
+
+// Controller registers
+#define NVME_REG_CAP   0x00
+#define NVME_REG_VS    0x08
+#define NVME_REG_INTMS 0x0C
+#define NVME_REG_CC    0x14
+#define NVME_REG_CSTS  0x1C
+#define NVME_REG_AQA   0x24
+#define NVME_REG_ASQ   0x28
+#define NVME_REG_ACQ   0x30
+#define NVME_DOORBELL_BASE 0x1000
+
+// Controller configuration and status bits
+#define NVME_CC_ENABLE  0x00000001
+#define NVME_CC_IOSQES  (6 << 16)       // 64-byte submission entries
+#define NVME_CC_IOCQES  (4 << 20)       // 16-byte completion entries
+#define NVME_CSTS_READY 0x00000001
+#define NVME_CSTS_FATAL 0x00000002
+
+// Admin commands
+#define NVME_ADMIN_CREATE_SQ    0x01
+#define NVME_ADMIN_CREATE_CQ    0x05
+#define NVME_ADMIN_IDENTIFY     0x06
+#define NVME_ADMIN_SET_FEATURES 0x09
+
+// Identify data structures and features
+#define NVME_IDENTIFY_NAMESPACE  0x00
+#define NVME_IDENTIFY_CONTROLLER 0x01
+#define NVME_FEATURE_NUM_QUEUES  0x07
+
+// I/O commands
+#define NVME_CMD_FLUSH 0x00
+#define NVME_CMD_WRITE 0x01
+#define NVME_CMD_READ  0x02
+
+// Queue sizes (entries)
+#define NVME_ADMIN_QUEUE_DEPTH 16
+#define NVME_IO_QUEUE_DEPTH    64
+
+// I/O queue pairs per controller (one per CPU, up to this many)
+#define NVME_MAX_IO_QUEUES 16
+
+// Maximum number of controllers
+#define NVME_MAX_CONTROLLERS 4
+
+// PRP list entries per command (a 512-byte slot, so lists never cross a page)
+#define NVME_PRP_LIST_ENTRIES 64
+
+// Controller page size (CC.MPS = 0)
+#define NVME_PAGE_SIZE 4096
+
+// Time allowed for an admin command, and for an I/O queue to make progress
+#define NVME_ADMIN_TIMEOUT_NS 2000000000ULL
+#define NVME_IO_TIMEOUT_NS    30000000000ULL
+
+// Submission queue entry
+typedef struct {
+    unsigned char opcode;
+    unsigned char flags;
+    unsigned short cid;
+    unsigned int nsid;
+    unsigned long long reserved;
+    unsigned long long metadata;
+    unsigned long long prp1;
+    unsigned long long prp2;
+    unsigned int cdw10;
+    unsigned int cdw11;
+    unsigned int cdw12;
+    unsigned int cdw13;
+    unsigned int cdw14;
+    unsigned int cdw15;
+} nvme_command_t;
+
+// Completion queue entry
+typedef struct {
+    unsigned int result;
+    unsigned int reserved;
+    unsigned short sq_head;
+    unsigned short sq_id;
+    unsigned short cid;
+    unsigned short status;              // Bit 0 is the phase tag
+} nvme_completion_t;
+
+struct nvme_controller;
+
+// Submission/completion queue pair
+//
+// Commands are identified by their slot (command ID). Each slot has its own
+// PRP list, and the request it carries until the completion arrives.
+typedef struct {
+    struct nvme_controller* ctrl;
+    nvme_command_t* sq;
+    volatile nvme_completion_t* cq;
+    volatile unsigned int* sq_doorbell;
+    volatile unsigned int* cq_doorbell;
+    unsigned long long* prp_lists;
+    unsigned short id;
+    unsigned short depth;
+    unsigned short sq_tail;             // Next free submission slot
+    unsigned short sq_doorbell_tail;    // Tail last written to the doorbell
+    unsigned short sq_head;             // Last head reported by the controller
+    unsigned short cq_head;
+    unsigned char phase;
+    unsigned int outstanding;
+    unsigned int free_count;
+    unsigned short free_cids[NVME_IO_QUEUE_DEPTH];
+    storage_hw_request_t* requests[NVME_IO_QUEUE_DEPTH];
+    unsigned long long last_progress;   // Time of the last completion or idle submit
+    unsigned long long submitted;
+    unsigned long long completed;
+} nvme_queue_t;
+
+// Controller state
+typedef struct nvme_controller {
+    pci_device_t pci;
+    volatile unsigned char* regs;
+    unsigned int doorbell_stride;       // Bytes between doorbells
+    unsigned int timeout_ms;            // CAP.TO, for enable/disable
+    unsigned int nsid;
+    unsigned int sector_size;
+    unsigned long long sectors;
+    unsigned int max_transfer;          // Bytes per command
+    unsigned int io_queue_count;
+    int failed;
+    unsigned char cpu_queues[CPU_MAX_CPUS]; // I/O queue of each CPU index
+    nvme_queue_t admin;
+    nvme_queue_t io[NVME_MAX_IO_QUEUES];
+} nvme_controller_t;
+
+// NVMe driver functions
+int nvme_init();
+unsigned int nvme_get_controller_count();
+nvme_controller_t* nvme_get_controller(unsigned int index);
+
+#endif /* NVME_H */
@@ -0,0 +1,167 @@
+/**
+ * LightOS Drivers
+ * PCI configuration space implementation
+ *
+ * Uses configuration mechanism #1 (ports 0xCF8/0xCFC), which reaches the
+ * first 256 bytes of every function's configuration space.
+ */
+
+#include "pci.h"
+#include "../kernel/io.h"
+
+// Build a configuration address
+static unsigned int pci_address(unsigned int bus, unsigned int device, unsigned int function, unsigned int offset) {
+    return 0x80000000u | (bus << 16) | (device << 11) | (function << 8) | (offset & 0xFC);
+}
+
+// Read a configuration double word by location
+static unsigned int pci_read(unsigned int bus, unsigned int device, unsigned int function, unsigned int offset) {
+    outl(PCI_CONFIG_ADDRESS, pci_address(bus, device, function, offset));
+    return inl(PCI_CONFIG_DATA);
+}
+
+// Read a configuration double word
+unsigned int pci_read_config(const pci_device_t* dev, unsigned int offset) {
+    return pci_read(dev->bus, dev->device, dev->function, offset);
+}
+
+// Read a configuration word
+unsigned short pci_read_config16(const pci_device_t* dev, unsigned int offset) {
+    return (unsigned short) (pci_read_config(dev, offset) >> ((offset & 2) * 8));
+}
+
+// Read a configuration byte
+unsigned char pci_read_config8(const pci_device_t* dev, unsigned int offset) {
+    return (unsigned char) (pci_read_config(dev, offset) >> ((offset & 3) * 8));
+}
+
+// Write a configuration double word
+void pci_write_config(const pci_device_t* dev, unsigned int offset, unsigned int value) {
+    outl(PCI_CONFIG_ADDRESS, pci_address(dev->bus, dev->device, dev->function, offset));
+    outl(PCI_CONFIG_DATA, value);
+}
+
+// Write a configuration word
+void pci_write_config16(const pci_device_t* dev, unsigned int offset, unsigned short value) {
+    unsigned int shift = (offset & 2) * 8;
+    unsigned int dword = pci_read_config(dev, offset);
+
+    dword = (dword & ~(0xFFFFu << shift)) | ((unsigned int) value << shift);
+    pci_write_config(dev, offset, dword);
+}
+
+// Scan every bus for functions accepted by a filter
+static int pci_scan(int (*match)(const pci_device_t* dev, unsigned int a, unsigned int b), unsigned int a, unsigned int b, pci_device_t* devices, int max) {
+    int found = 0;
+
+    for (unsigned int bus = 0; bus < 256; bus++) {
+        for (unsigned int device = 0; device < 32; device++) {
+            unsigned int functions = 1;
+
+            for (unsigned int function = 0; function < functions; function++) {
+                unsigned int id = pci_read(bus, device, function, PCI_VENDOR_ID);
+
+                if ((id & 0xFFFF) == 0xFFFF) {
+                    continue;
+                }
+
+                // Only multi-function devices have functions 1-7
+                if (function == 0 && (pci_read(bus, device, 0, PCI_HEADER_TYPE) >> 16) & 0x80) {
+                    functions = 8;
+                }
+
+                unsigned int class_revision = pci_read(bus, device, function, PCI_CLASS_REVISION);
+
+                pci_device_t dev;
+                dev.bus = bus;
+                dev.device = device;
+                dev.function = function;
+                dev.vendor_id = id & 0xFFFF;
+                dev.device_id = id >> 16;
+                dev.class_code = class_revision >> 24;
+                dev.subclass = (class_revision >> 16) & 0xFF;
+                dev.prog_if = (class_revision >> 8) & 0xFF;
+
+                if (match(&dev, a, b) && found < max) {
+                    devices[found++] = dev;
+                }
+            }
+        }
+    }
+
+    return found;
+}
+
+// Match a class and subclass
+static int pci_match_class(const pci_device_t* dev, unsigned int class_code, unsigned int subclass) {
+    return dev->class_code == class_code && dev->subclass == subclass;
+}
+
+// Match a vendor and device ID
+static int pci_match_id(const pci_device_t* dev, unsigned int vendor_id, unsigned int device_id) {
+    return dev->vendor_id == vendor_id && dev->device_id == device_id;
+}
+
+// Find functions of a class; returns the number found
+int pci_find_class(unsigned char class_code, unsigned char subclass, pci_device_t* devices, int max) {
+    return pci_scan(pci_match_class, class_code, subclass, devices, max);
+}
+
+// Find functions by vendor and device ID; returns the number found
+int pci_find_device(unsigned short vendor_id, unsigned short device_id, pci_device_t* devices, int max) {
+    return pci_scan(pci_match_id, vendor_id, device_id, devices, max);
+}
+
+// Get a base address register's address (64-bit BARs span two registers)
+unsigned long long pci_get_bar(const pci_device_t* dev, int bar, int* is_io) {
+    unsigned int low = pci_read_config(dev, PCI_BAR0 + bar * 4);
+
+    if (low & 1) {
+        if (is_io) {
+            *is_io = 1;
+        }
+
+        return low & ~3u;
+    }
+
+    if (is_io) {
+        *is_io = 0;
+    }
+
+    unsigned long long address = low & ~15u;
+
+    if (((low >> 1) & 3) == 2 && bar < 5) {
+        address |= (unsigned long long) pci_read_config(dev, PCI_BAR0 + (bar + 1) * 4) << 32;
+    }
+
+    return address;
+}
+
+// Set command register bits (memory/I/O decoding, bus mastering)
+void pci_enable(const pci_device_t* dev, unsigned short flags) {
+    unsigned short command = pci_read_config16(dev, PCI_COMMAND);
+    pci_write_config16(dev, PCI_COMMAND, command | flags);
+}
+
+// Find a capability, starting after the one at start (0 for the first);
+// returns its configuration space offset or 0
+unsigned int pci_find_capability(const pci_device_t* dev, unsigned char id, unsigned int start) {
+    if (!(pci_read_config16(dev, PCI_STATUS) & PCI_STATUS_CAPABILITIES)) {
+        return 0;
+    }
+
+    unsigned int offset = start ? pci_read_config8(dev, start + 1) : pci_read_config8(dev, PCI_CAPABILITIES);
+
+    // The list lives in the first 256 bytes; bound the walk in case it loops
+    for (int i = 0; i < 48 && offset >= 0x40; i++) {
+        offset &= 0xFC;
+
+        if (pci_read_config8(dev, offset) == id) {
+            return offset;
+        }
+
+        offset = pci_read_config8(dev, offset + 1);
+    }
+
+    return 0;
+}
@@ -0,0 +1,65 @@
+/**
+ * LightOS Drivers
+ * PCI configuration space header
+ */
+
+#ifndef PCI_H
+#define PCI_H
+
+// Configuration mechanism #1 ports
+#define PCI_CONFIG_ADDRESS 0xCF8
+#define PCI_CONFIG_DATA    0xCFC
+
+// Configuration space registers
+#define PCI_VENDOR_ID      0x00
+#define PCI_DEVICE_ID      0x02
+#define PCI_COMMAND        0x04
+#define PCI_STATUS         0x06
+#define PCI_CLASS_REVISION 0x08
+#define PCI_HEADER_TYPE    0x0E
+#define PCI_BAR0           0x10
+#define PCI_SUBSYSTEM_ID   0x2E
+#define PCI_CAPABILITIES   0x34
+
+// Command register bits
+#define PCI_COMMAND_IO           0x0001
+#define PCI_COMMAND_MEMORY       0x0002
+#define PCI_COMMAND_MASTER       0x0004
+#define PCI_COMMAND_INTX_DISABLE 0x0400
+
+// Status register bits
+#define PCI_STATUS_CAPABILITIES 0x0010
+
+// Capability IDs
+#define PCI_CAP_MSI    0x05
+#define PCI_CAP_VENDOR 0x09
+#define PCI_CAP_MSIX   0x11
+
+// Maximum number of functions returned by one scan
+#define PCI_MAX_DEVICES 32
+
+// PCI function
+typedef struct {
+    unsigned char bus;
+    unsigned char device;
+    unsigned char function;
+    unsigned short vendor_id;
+    unsigned short device_id;
+    unsigned char class_code;
+    unsigned char subclass;
+    unsigned char prog_if;
+} pci_device_t;
+
+// PCI functions
+unsigned int pci_read_config(const pci_device_t* dev, unsigned int offset);
+unsigned short pci_read_config16(const pci_device_t* dev, unsigned int offset);
+unsigned char pci_read_config8(const pci_device_t* dev, unsigned int offset);
+void pci_write_config(const pci_device_t* dev, unsigned int offset, unsigned int value);
+void pci_write_config16(const pci_device_t* dev, unsigned int offset, unsigned short value);
+int pci_find_class(unsigned char class_code, unsigned char subclass, pci_device_t* devices, int max);
+int pci_find_device(unsigned short vendor_id, unsigned short device_id, pci_device_t* devices, int max);
+unsigned long long pci_get_bar(const pci_device_t* dev, int bar, int* is_io);
+void pci_enable(const pci_device_t* dev, unsigned short flags);
+unsigned int pci_find_capability(const pci_device_t* dev, unsigned char id, unsigned int start);
+
+#endif /* PCI_H */
@@ -0,0 +1,285 @@
+/**
+ * LightOS Drivers
+ * 16550 UART serial console driver implementation
+ *
+ * Output is queued in a software ring and moved to the UART in batches of
+ * up to one hardware FIFO (16 bytes) at a time, so writers never wait for
+ * the line. Once the IRQ is wired up (serial_enable_interrupts), refills
+ * happen from the transmitter-empty interrupt; before that the ring is
+ * drained whenever the FIFO has room on a write or on serial_poll().
+ */
+
+#include "serial.h"
+#include "keyboard.h"
+#include "../kernel/io.h"
+
+// UART register offsets
+#define UART_DATA         0     // Receive buffer / transmit holding (DLAB=0)
+#define UART_IER          1     // Interrupt enable (DLAB=0)
+#define UART_DIVISOR_LOW  0     // Divisor latch low (DLAB=1)
+#define UART_DIVISOR_HIGH 1     // Divisor latch high (DLAB=1)
+#define UART_IIR          2     // Interrupt identification (read)
+#define UART_FCR          2     // FIFO control (write)
+#define UART_LCR          3     // Line control
+#define UART_MCR          4     // Modem control
+#define UART_LSR          5     // Line status
+#define UART_MSR          6     // Modem status
+
+// Interrupt enable bits
+#define UART_IER_RX       0x01
+#define UART_IER_THRE     0x02
+#define UART_IER_LSR      0x04
+
+// Line status bits
+#define UART_LSR_DATA     0x01
+#define UART_LSR_THRE     0x20
+
+// Hardware transmit FIFO depth
+#define UART_FIFO_SIZE 16
+
+#define SERIAL_TX_MASK (SERIAL_TX_BUFFER_SIZE - 1)
+
+// Port state
+static unsigned short serial_port = 0;
+static int serial_present = 0;
+static int serial_irq_enabled = 0;
+
+// Transmit ring (written by serial_write, drained by serial_fill_fifo)
+static char serial_tx_buffer[SERIAL_TX_BUFFER_SIZE];
+static volatile unsigned int serial_tx_head = 0;
+static volatile unsigned int serial_tx_tail = 0;
+
+// Statistics
+static serial_stats_t serial_stats;
+
+// Initialize a serial port; returns 0 if a working UART was found
+int serial_init(unsigned short port, unsigned int baud) {
+    unsigned int divisor = 115200 / (baud ? baud : SERIAL_DEFAULT_BAUD);
+
+    if (divisor == 0) {
+        divisor = 1;
+    }
+
+    serial_port = port;
+    serial_present = 0;
+    serial_irq_enabled = 0;
+    serial_tx_head = 0;
+    serial_tx_tail = 0;
+
+    serial_stats.tx_bytes = 0;
+    serial_stats.rx_bytes = 0;
+    serial_stats.tx_dropped = 0;
+    serial_stats.interrupts = 0;
+    serial_stats.fifo_fills = 0;
+
+    outb(port + UART_IER, 0x00);                        // Disable interrupts
+    outb(port + UART_LCR, 0x80);                        // Enable DLAB
+    outb(port + UART_DIVISOR_LOW, divisor & 0xFF);
+    outb(port + UART_DIVISOR_HIGH, (divisor >> 8) & 0xFF);
+    outb(port + UART_LCR, 0x03);                        // 8N1, DLAB off
+    outb(port + UART_FCR, 0xC7);                        // Enable and clear FIFOs, 14-byte RX threshold
+
+    // Check the UART with a loopback test
+    outb(port + UART_MCR, 0x1E);
+    outb(port + UART_DATA, 0xAE);
+
+    if (inb(port + UART_DATA) != 0xAE) {
+        return -1;
+    }
+
+    // Normal operation: DTR, RTS and OUT2 (routes the IRQ to the PIC)
+    outb(port + UART_MCR, 0x0B);
+
+    serial_present = 1;
+    return 0;
+}
+
+// Check if a serial console is available
+int serial_is_present() {
+    return serial_present;
+}
+
+// Move queued bytes into the hardware FIFO if the transmitter is empty
+static void serial_fill_fifo() {
+    if (!(inb(serial_port + UART_LSR) & UART_LSR_THRE)) {
+        return;
+    }
+
+    unsigned int count = 0;
+
+    while (serial_tx_tail != serial_tx_head && count < UART_FIFO_SIZE) {
+        outb(serial_port + UART_DATA, serial_tx_buffer[serial_tx_tail]);
+        serial_tx_tail = (serial_tx_tail + 1) & SERIAL_TX_MASK;
+        count++;
+    }
+
+    if (count) {
+        serial_stats.tx_bytes += count;
+        serial_stats.fifo_fills++;
+    }
+
+    // Nothing left to send: stop transmitter-empty interrupts
+    if (serial_irq_enabled && serial_tx_tail == serial_tx_head) {
+        outb(serial_port + UART_IER, UART_IER_RX | UART_IER_LSR);
+    }
+}
+
+// Switch from polled to interrupt-driven operation
+void serial_enable_interrupts() {
+    if (!serial_present) {
+        return;
+    }
+
+    serial_irq_enabled = 1;
+    outb(serial_port + UART_IER, UART_IER_RX | UART_IER_LSR | UART_IER_THRE);
+}
+
+// Start transmission of newly queued data
+static void serial_kick() {
+    if (serial_irq_enabled) {
+        // Enabling THRE raises an interrupt as soon as the FIFO is empty
+        outb(serial_port + UART_IER, UART_IER_RX | UART_IER_LSR | UART_IER_THRE);
+    } else {
+        serial_fill_fifo();
+    }
+}
+
+// Queue one byte
+static void serial_queue(char c) {
+    unsigned int next = (serial_tx_head + 1) & SERIAL_TX_MASK;
+
+    if (next == serial_tx_tail) {
+        if (serial_irq_enabled) {
+            // Never stall the kernel on a slow line
+            serial_stats.tx_dropped++;
+            return;
+        }
+
+        // Polled mode: nothing else will drain the ring
+        while (next == serial_tx_tail) {
+            serial_fill_fifo();
+        }
+    }
+
+    serial_tx_buffer[serial_tx_head] = c;
+    serial_tx_head = next;
+}
+
+// Write a buffer to the serial port
+void serial_write_buffer(const char* data, unsigned int length) {
+    if (!serial_present || !data) {
+        return;
+    }
+
+    for (unsigned int i = 0; i < length; i++) {
+        if (data[i] == '\n') {
+            serial_queue('\r');
+        }
+
+        serial_queue(data[i]);
+    }
+
+    serial_kick();
+}
+
+// Write a string to the serial port
+void serial_write(const char* data) {
+    if (!serial_present || !data) {
+        return;
+    }
+
+    for (int i = 0; data[i] != '\0'; i++) {
+        if (data[i] == '\n') {
+            serial_queue('\r');
+        }
+
+        serial_queue(data[i]);
+    }
+
+    serial_kick();
+}
+
+// Write a character to the serial port
+void serial_put_char(char c) {
+    serial_write_buffer(&c, 1);
+}
+
+// Pass received bytes to the keyboard buffer
+static void serial_receive() {
+    while (inb(serial_port + UART_LSR) & UART_LSR_DATA) {
+        char c = (char) inb(serial_port + UART_DATA);
+        serial_stats.rx_bytes++;
+
+        // Map terminal conventions to what the CLI expects
+        if (c == '\r') {
+            c = '\n';
+        } else if (c == 0x7F) {
+            c = '\b';
+        }
+
+        keyboard_buffer_put(c);
+    }
+}
+
+// Service the port without interrupts (idle loops, early boot)
+void serial_poll() {
+    if (!serial_present) {
+        return;
+    }
+
+    serial_receive();
+    serial_fill_fifo();
+}
+
+// Wait until all queued output has been handed to the UART
+void serial_flush() {
+    if (!serial_present) {
+        return;
+    }
+
+    while (serial_tx_tail != serial_tx_head) {
+        serial_fill_fifo();
+    }
+}
+
+// Handle a serial port interrupt (IRQ 4 for COM1/COM3)
+void serial_interrupt_handler() {
+    if (!serial_present) {
+        return;
+    }
+
+    serial_stats.interrupts++;
+
+    unsigned char iir;
+
+    while (!((iir = inb(serial_port + UART_IIR)) & 0x01)) {
+        switch ((iir >> 1) & 0x07) {
+            case 0: // Modem status
+                inb(serial_port + UART_MSR);
+                break;
+
+            case 1: // Transmitter holding register empty
+                serial_fill_fifo();
+                break;
+
+            case 2: // Received data available
+            case 6: // Character timeout
+                serial_receive();
+                break;
+
+            case 3: // Line status
+                inb(serial_port + UART_LSR);
+                break;
+
+            default:
+                return;
+        }
+    }
+}
+
+// Get serial port statistics
+void serial_get_stats(serial_stats_t* stats) {
+    if (stats) {
+        *stats = serial_stats;
+    }
+}
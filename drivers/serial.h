@@ -0,0 +1,42 @@
+/**
+ * LightOS Drivers
+ * 16550 UART serial console driver header
+ */
+
+#ifndef SERIAL_H
+#define SERIAL_H
+
+// Standard PC serial port base addresses
+#define SERIAL_COM1 0x3F8
+#define SERIAL_COM2 0x2F8
+#define SERIAL_COM3 0x3E8
+#define SERIAL_COM4 0x2E8
+
+// Default console speed
+#define SERIAL_DEFAULT_BAUD 115200
+
+// Software transmit ring size (must be a power of two)
+#define SERIAL_TX_BUFFER_SIZE 8192
+
+// Serial port statistics
+typedef struct {
+    unsigned long long tx_bytes;
+    unsigned long long rx_bytes;
+    unsigned long long tx_dropped;
+    unsigned long long interrupts;
+    unsigned long long fifo_fills;
+} serial_stats_t;
+
+// Serial driver functions
+int serial_init(unsigned short port, unsigned int baud);
+int serial_is_present();
+void serial_enable_interrupts();
+void serial_put_char(char c);
+void serial_write(const char* data);
+void serial_write_buffer(const char* data, unsigned int length);
+void serial_poll();
+void serial_flush();
+void serial_interrupt_handler();
+void serial_get_stats(serial_stats_t* stats);
+
+#endif /* SERIAL_H */
@@ -5,16 +5,443 @@
 
 #include "storage.h"
 #include "../kernel/kernel.h"
+#include "../kernel/klog.h"
+#include "../kernel/ktime.h"
 #include "../kernel/memory.h"
+#include "../kernel/page_cache.h"
 #include "../libc/string.h"
+#include "../libc/hashmap.h"
+
+KLOG_SUBSYSTEM(storage_log, "storage");
 
 // Maximum number of storage devices
 #define MAX_STORAGE_DEVICES 16
 
+// Name lookup table size
+#define STORAGE_MAP_CAPACITY 32
+
 // Storage device array
 static storage_device_t* storage_devices[MAX_STORAGE_DEVICES];
 static int storage_device_count = 0;
 
+// Storage device name index
+static hashmap_entry_t storage_map_entries[STORAGE_MAP_CAPACITY];
+static hashmap_t storage_map;
+
+// Memory blocks for a request queue and its dispatch buffer
+#define STORAGE_QUEUE_BLOCKS ((sizeof(storage_queue_t) + MEMORY_BLOCK_SIZE - 1) / MEMORY_BLOCK_SIZE)
+#define STORAGE_DISPATCH_BLOCKS (STORAGE_MAX_REQUEST_BYTES / MEMORY_BLOCK_SIZE)
+
+// Plug nesting depth; while plugged, writes are queued instead of issued
+static unsigned int storage_plug_depth = 0;
+
+// Width of the bars in latency histograms
+#define STORAGE_HISTOGRAM_WIDTH 40
+
+// Account a command being issued to a device; returns the time
+static unsigned long long storage_io_start(storage_device_t* device) {
+    unsigned long long now = ktime_get_ns();
+    
+    if (device->io.in_flight++ == 0) {
+        device->busy_since = now;
+    }
+    
+    return now;
+}
+
+// Get the latency histogram bucket for a time
+static unsigned int storage_latency_bucket(unsigned long long ns) {
+    unsigned long long us = ns / 1000;
+    unsigned int bucket = us ? 64 - __builtin_clzll(us) : 0;
+    
+    return bucket < STORAGE_LATENCY_BUCKETS ? bucket : STORAGE_LATENCY_BUCKETS - 1;
+}
+
+// Account a finished command
+//
+// queue_ns is how long it waited in the request queue before it was
+// issued at the given time.
+static void storage_io_done(storage_device_t* device, unsigned int op, unsigned int sector_count,
+                            unsigned long long queue_ns, unsigned long long issued, int result) {
+    storage_io_stats_t* io = &device->io;
+    unsigned long long now = ktime_get_ns();
+    unsigned long long latency = queue_ns + (now - issued);
+    
+    if (io->in_flight > 0 && --io->in_flight == 0) {
+        io->busy_ns += now - device->busy_since;
+    }
+    
+    if (result != 0) {
+        io->errors[op]++;
+        return;
+    }
+    
+    io->ios[op]++;
+    io->sectors[op] += sector_count;
+    io->queue_ns[op] += queue_ns;
+    io->service_ns[op] += now - issued;
+    io->latency[op][storage_latency_bucket(latency)]++;
+    
+    if (latency > io->max_ns[op]) {
+        io->max_ns[op] = latency;
+    }
+}
+
+// Copy a device's I/O accounting, counting the busy period under way
+static void storage_io_snapshot(storage_device_t* device, storage_io_stats_t* stats) {
+    *stats = device->io;
+    
+    if (stats->in_flight > 0) {
+        stats->busy_ns += ktime_get_ns() - device->busy_since;
+    }
+}
+
+// Create an empty request queue
+static storage_queue_t* storage_queue_create() {
+    storage_queue_t* queue = (storage_queue_t*)allocate_blocks(STORAGE_QUEUE_BLOCKS);
+    
+    if (!queue) {
+        return NULL;
+    }
+    
+    memset(queue, 0, sizeof(storage_queue_t));
+    
+    for (int i = STORAGE_QUEUE_DEPTH - 1; i >= 0; i--) {
+        queue->requests[i].sort_next = queue->free_list;
+        queue->free_list = &queue->requests[i];
+    }
+    
+    return queue;
+}
+
+// Check if any queued request touches a sector range
+static int storage_queue_overlaps(storage_queue_t* queue, unsigned int start_sector, unsigned int sector_count) {
+    for (storage_request_t* request = queue->sorted; request; request = request->sort_next) {
+        if (start_sector < request->start_sector + request->sector_count &&
+            request->start_sector < start_sector + sector_count) {
+            return 1;
+        }
+    }
+    
+    return 0;
+}
+
+// Choose the next request to dispatch
+//
+// Expired requests go first; otherwise requests are taken in ascending
+// sector order from where the last one ended, wrapping around (C-SCAN).
+static storage_request_t* storage_queue_pick(storage_queue_t* queue) {
+    if (queue->fifo_head && queue->fifo_head->deadline <= ktime_get_ns()) {
+        queue->stats.expired++;
+        return queue->fifo_head;
+    }
+    
+    for (storage_request_t* request = queue->sorted; request; request = request->sort_next) {
+        if (request->start_sector >= queue->head_sector) {
+            return request;
+        }
+    }
+    
+    return queue->sorted;
+}
+
+// Remove a request from the queue and return it to the pool
+static void storage_queue_remove(storage_queue_t* queue, storage_request_t* request) {
+    storage_request_t** link = &queue->sorted;
+    
+    while (*link && *link != request) {
+        link = &(*link)->sort_next;
+    }
+    
+    if (*link) {
+        *link = request->sort_next;
+    }
+    
+    if (request->fifo_prev) {
+        request->fifo_prev->fifo_next = request->fifo_next;
+    } else {
+        queue->fifo_head = request->fifo_next;
+    }
+    
+    if (request->fifo_next) {
+        request->fifo_next->fifo_prev = request->fifo_prev;
+    } else {
+        queue->fifo_tail = request->fifo_prev;
+    }
+    
+    for (unsigned int i = 0; i < request->segment_count; i++) {
+        free_blocks(request->segments[i].buffer, request->segments[i].blocks);
+    }
+    
+    queue->count--;
+    queue->queued_sectors -= request->sector_count;
+    
+    request->segment_count = 0;
+    request->sort_next = queue->free_list;
+    queue->free_list = request;
+}
+
+// Issue a request to the device as one command where possible
+static int storage_dispatch(storage_device_t* device, storage_request_t* request) {
+    storage_queue_t* queue = device->queue;
+    unsigned long long issued = storage_io_start(device);
+    int result = 0;
+    
+    if (request->segment_count > 1 && !queue->dispatch_buffer) {
+        queue->dispatch_buffer = (unsigned char*)allocate_blocks(STORAGE_DISPATCH_BLOCKS);
+    }
+    
+    if (request->segment_count == 1 || queue->dispatch_buffer) {
+        const void* data = request->segments[0].buffer;
+        
+        // Gather merged segments into one buffer
+        if (request->segment_count > 1) {
+            unsigned int offset = 0;
+            
+            for (unsigned int i = 0; i < request->segment_count; i++) {
+                unsigned int bytes = request->segments[i].sector_count * device->sector_size;
+                memcpy(queue->dispatch_buffer + offset, request->segments[i].buffer, bytes);
+                offset += bytes;
+            }
+            
+            data = queue->dispatch_buffer;
+        }
+        
+        queue->stats.dispatched++;
+        queue->stats.dispatched_sectors += request->sector_count;
+        
+        result = device->write_sectors(device, request->start_sector, request->sector_count, data);
+    } else {
+        // No gather buffer: fall back to one command per segment
+        unsigned int sector = request->start_sector;
+        
+        for (unsigned int i = 0; i < request->segment_count; i++) {
+            if (device->write_sectors(device, sector, request->segments[i].sector_count, request->segments[i].buffer) != 0) {
+                result = -1;
+            }
+            
+            queue->stats.dispatched++;
+            queue->stats.dispatched_sectors += request->segments[i].sector_count;
+            sector += request->segments[i].sector_count;
+        }
+    }
+    
+    // Accounted as one command, however many it took
+    storage_io_done(device, STORAGE_OP_WRITE, request->sector_count, issued - request->queued, issued, result);
+    
+    return result;
+}
+
+// Dispatch every queued request; failures are kept in queue->error
+static void storage_queue_run(storage_device_t* device) {
+    storage_queue_t* queue = device->queue;
+    
+    while (queue->sorted) {
+        storage_request_t* request = storage_queue_pick(queue);
+        
+        if (storage_dispatch(device, request) != 0) {
+            KLOG(&storage_log, KLOG_ERR, "Write of %u sectors at %u failed\n", request->sector_count, request->start_sector);
+            queue->stats.errors++;
+            queue->error = -1;
+        }
+        
+        queue->head_sector = request->start_sector + request->sector_count;
+        storage_queue_remove(queue, request);
+    }
+}
+
+// Dispatch only the queued requests that touch a sector range
+static void storage_queue_run_range(storage_device_t* device, unsigned int start_sector, unsigned int sector_count) {
+    storage_queue_t* queue = device->queue;
+    storage_request_t* request = queue->sorted;
+    
+    while (request) {
+        storage_request_t* next = request->sort_next;
+        
+        if (start_sector < request->start_sector + request->sector_count &&
+            request->start_sector < start_sector + sector_count) {
+            if (storage_dispatch(device, request) != 0) {
+                KLOG(&storage_log, KLOG_ERR, "Write of %u sectors at %u failed\n", request->sector_count, request->start_sector);
+                queue->stats.errors++;
+                queue->error = -1;
+            }
+            
+            storage_queue_remove(queue, request);
+        }
+        
+        request = next;
+    }
+}
+
+// Copy a write into a queued request that already covers its sectors
+static int storage_queue_absorb(storage_device_t* device, unsigned int start_sector, unsigned int sector_count, const void* buffer) {
+    for (storage_request_t* request = device->queue->sorted; request; request = request->sort_next) {
+        if (start_sector < request->start_sector ||
+            start_sector + sector_count > request->start_sector + request->sector_count) {
+            continue;
+        }
+        
+        // Walk the segments, copying the overlapping part of each
+        const unsigned char* data = (const unsigned char*)buffer;
+        unsigned int sector = request->start_sector;
+        unsigned int end = start_sector + sector_count;
+        
+        for (unsigned int i = 0; i < request->segment_count; i++) {
+            storage_segment_t* segment = &request->segments[i];
+            unsigned int segment_end = sector + segment->sector_count;
+            unsigned int from = start_sector > sector ? start_sector : sector;
+            unsigned int to = end < segment_end ? end : segment_end;
+            
+            if (from < to) {
+                memcpy((unsigned char*)segment->buffer + (from - sector) * device->sector_size,
+                       data + (from - start_sector) * device->sector_size,
+                       (to - from) * device->sector_size);
+            }
+            
+            sector = segment_end;
+        }
+        
+        return 1;
+    }
+    
+    return 0;
+}
+
+// Run a device's queue and collect any deferred write error
+static int storage_queue_sync(storage_device_t* device) {
+    if (!device->queue) {
+        return 0;
+    }
+    
+    storage_queue_run(device);
+    
+    int result = device->queue->error;
+    device->queue->error = 0;
+    
+    return result;
+}
+
+// Queue a write, merging it with a neighbouring request when possible
+//
+// Returns -1 if the write could not be queued and must be issued directly.
+static int storage_queue_write(storage_device_t* device, unsigned int start_sector, unsigned int sector_count, const void* buffer) {
+    storage_queue_t* queue = device->queue;
+    unsigned int bytes = sector_count * device->sector_size;
+    unsigned int max_sectors = STORAGE_MAX_REQUEST_BYTES / device->sector_size;
+    
+    if (sector_count == 0 || sector_count > max_sectors) {
+        if (storage_queue_overlaps(queue, start_sector, sector_count)) {
+            storage_queue_run(device);
+        }
+        
+        return -1;
+    }
+    
+    // Rewrites of queued sectors update the queued data in place
+    if (storage_queue_absorb(device, start_sector, sector_count, buffer)) {
+        queue->stats.requests++;
+        return 0;
+    }
+    
+    // Older writes to these sectors must reach the device first
+    storage_queue_run_range(device, start_sector, sector_count);
+    
+    unsigned int blocks = (bytes + MEMORY_BLOCK_SIZE - 1) / MEMORY_BLOCK_SIZE;
+    void* data = allocate_blocks(blocks);
+    
+    if (!data) {
+        storage_queue_run(device);
+        return -1;
+    }
+    
+    memcpy(data, buffer, bytes);
+    queue->stats.requests++;
+    
+    // Back and front merges
+    storage_request_t* request;
+    
+    for (request = queue->sorted; request; request = request->sort_next) {
+        if (request->segment_count >= STORAGE_MAX_SEGMENTS || request->sector_count + sector_count > max_sectors) {
+            continue;
+        }
+        
+        if (request->start_sector + request->sector_count == start_sector) {
+            storage_segment_t* segment = &request->segments[request->segment_count++];
+            segment->buffer = data;
+            segment->sector_count = sector_count;
+            segment->blocks = blocks;
+            request->sector_count += sector_count;
+            queue->stats.back_merges++;
+            break;
+        }
+        
+        if (start_sector + sector_count == request->start_sector) {
+            for (unsigned int i = request->segment_count; i > 0; i--) {
+                request->segments[i] = request->segments[i - 1];
+            }
+            
+            request->segment_count++;
+            request->segments[0].buffer = data;
+            request->segments[0].sector_count = sector_count;
+            request->segments[0].blocks = blocks;
+            request->start_sector = start_sector;
+            request->sector_count += sector_count;
+            queue->stats.front_merges++;
+            break;
+        }
+    }
+    
+    if (!request) {
+        if (!queue->free_list) {
+            storage_queue_run(device);
+        }
+        
+        request = queue->free_list;
+        queue->free_list = request->sort_next;
+        
+        request->start_sector = start_sector;
+        request->sector_count = sector_count;
+        request->queued = ktime_get_ns();
+        request->deadline = request->queued + STORAGE_WRITE_EXPIRE_NS;
+        request->segment_count = 1;
+        request->segments[0].buffer = data;
+        request->segments[0].sector_count = sector_count;
+        request->segments[0].blocks = blocks;
+        
+        // Insert in sector order
+        storage_request_t** link = &queue->sorted;
+        
+        while (*link && (*link)->start_sector < start_sector) {
+            link = &(*link)->sort_next;
+        }
+        
+        request->sort_next = *link;
+        *link = request;
+        
+        // Append in submission order
+        request->fifo_next = NULL;
+        request->fifo_prev = queue->fifo_tail;
+        
+        if (queue->fifo_tail) {
+            queue->fifo_tail->fifo_next = request;
+        } else {
+            queue->fifo_head = request;
+        }
+        
+        queue->fifo_tail = request;
+        queue->count++;
+    }
+    
+    queue->queued_sectors += sector_count;
+    
+    // Bound the memory held by the queue and the age of its oldest write
+    if (queue->queued_sectors >= STORAGE_QUEUE_MAX_SECTORS || queue->fifo_head->deadline <= ktime_get_ns()) {
+        storage_queue_run(device);
+    }
+    
+    return 0;
+}
+
 // Initialize storage subsystem
 void storage_init() {
     terminal_write("Initializing storage subsystem...\n");
@@ -25,10 +452,12 @@ void storage_init() {
     }
     
     storage_device_count = 0;
+    hashmap_init(&storage_map, storage_map_entries, STORAGE_MAP_CAPACITY);
     
     // Detect storage devices
     detect_ata_devices();
     detect_nvme_devices();
+    detect_virtio_devices();
     detect_usb_storage_devices();
     detect_sd_devices();
     
@@ -75,13 +504,11 @@ int storage_register_device(storage_device_t* device) {
     }
     
     // Check if a device with the same name already exists
-    for (int i = 0; i < storage_device_count; i++) {
-        if (strcmp(storage_devices[i]->name, device->name) == 0) {
-            terminal_write("Error: Storage device with name '");
-            terminal_write(device->name);
-            terminal_write("' already exists\n");
-            return -1;
-        }
+    if (hashmap_get(&storage_map, device->name)) {
+        terminal_write("Error: Storage device with name '");
+        terminal_write(device->name);
+        terminal_write("' already exists\n");
+        return -1;
     }
     
     // Allocate memory for the device
@@ -95,6 +522,27 @@ int storage_register_device(storage_device_t* device) {
     // Copy the device data
     memcpy(new_device, device, sizeof(storage_device_t));
     
+    // Without a queue, writes are simply issued one by one
+    new_device->queue = storage_queue_create();
+    new_device->open_count = 0;
+    
+    // I/O accounting starts now
+    memset(&new_device->io, 0, sizeof(storage_io_stats_t));
+    new_device->io.since = ktime_get_ns();
+    new_device->busy_since = 0;
+    
+    // Index the device by name
+    if (hashmap_insert(&storage_map, new_device->name, new_device) != 0) {
+        terminal_write("Error: Failed to index storage device\n");
+        
+        if (new_device->queue) {
+            free_blocks(new_device->queue, STORAGE_QUEUE_BLOCKS);
+        }
+        
+        free_block(new_device);
+        return -1;
+    }
+    
     // Add the device to the array
     storage_devices[storage_device_count++] = new_device;
     
@@ -114,8 +562,34 @@ int storage_unregister_device(const char* name) {
     // Find the device
     for (int i = 0; i < storage_device_count; i++) {
         if (strcmp(storage_devices[i]->name, name) == 0) {
-            // Free the device memory
-            free_block(storage_devices[i]);
+            storage_device_t* device = storage_devices[i];
+            
+            // Open handles point at the device
+            if (device->open_count > 0) {
+                terminal_write("Error: Storage device '");
+                terminal_write(name);
+                terminal_write("' is in use\n");
+                return -1;
+            }
+            
+            // Cached sectors must not outlive the device: the next one
+            // registered may get the same memory
+            page_cache_drop_owner(device);
+            
+            // Write out anything still queued
+            if (device->queue) {
+                storage_queue_run(device);
+                
+                if (device->queue->dispatch_buffer) {
+                    free_blocks(device->queue->dispatch_buffer, STORAGE_DISPATCH_BLOCKS);
+                }
+                
+                free_blocks(device->queue, STORAGE_QUEUE_BLOCKS);
+            }
+            
+            // Drop the name index entry and free the device memory
+            hashmap_remove(&storage_map, name);
+            free_block(device);
             
             // Remove the device from the array by shifting all subsequent devices
             for (int j = i; j < storage_device_count - 1; j++) {
@@ -145,14 +619,189 @@ storage_device_t* storage_get_device(const char* name) {
         return NULL;
     }
     
-    // Find the device
-    for (int i = 0; i < storage_device_count; i++) {
-        if (strcmp(storage_devices[i]->name, name) == 0) {
-            return storage_devices[i];
-        }
+    return (storage_device_t*)hashmap_get(&storage_map, name);
+}
+
+// Open a storage device for I/O
+block_dev_t* storage_open(const char* name) {
+    storage_device_t* device = storage_get_device(name);
+    
+    if (!device) {
+        terminal_write("Error: Storage device '");
+        terminal_write(name ? name : "");
+        terminal_write("' not found\n");
+        return NULL;
     }
     
-    return NULL;
+    device->open_count++;
+    
+    return device;
+}
+
+// Close a storage device handle
+void storage_close(block_dev_t* bdev) {
+    if (bdev && bdev->open_count > 0) {
+        bdev->open_count--;
+    }
+}
+
+// Read sectors from an open storage device
+int bdev_read_sectors(block_dev_t* bdev, unsigned int start_sector, unsigned int sector_count, void* buffer) {
+    if (!bdev) {
+        return -1;
+    }
+    
+    if (!bdev->read_sectors) {
+        terminal_write("Error: Storage device '");
+        terminal_write(bdev->name);
+        terminal_write("' does not support reading\n");
+        return -1;
+    }
+    
+    // Queued writes to these sectors must land before they are read
+    if (bdev->queue && storage_queue_overlaps(bdev->queue, start_sector, sector_count)) {
+        storage_queue_run(bdev);
+    }
+    
+    unsigned long long issued = storage_io_start(bdev);
+    int result = bdev->read_sectors(bdev, start_sector, sector_count, buffer);
+    storage_io_done(bdev, STORAGE_OP_READ, sector_count, 0, issued, result);
+    
+    return result;
+}
+
+// Write sectors to an open storage device
+int bdev_write_sectors(block_dev_t* bdev, unsigned int start_sector, unsigned int sector_count, const void* buffer) {
+    if (!bdev) {
+        return -1;
+    }
+    
+    if (bdev->read_only) {
+        terminal_write("Error: Storage device '");
+        terminal_write(bdev->name);
+        terminal_write("' is read-only\n");
+        return -1;
+    }
+    
+    if (!bdev->write_sectors) {
+        terminal_write("Error: Storage device '");
+        terminal_write(bdev->name);
+        terminal_write("' does not support writing\n");
+        return -1;
+    }
+    
+    int result = -1;
+    
+    // While plugged, writes wait in the queue to be merged and sorted
+    if (storage_plug_depth > 0 && bdev->queue) {
+        result = storage_queue_write(bdev, start_sector, sector_count, buffer);
+    }
+    
+    if (result != 0) {
+        unsigned long long issued = storage_io_start(bdev);
+        result = bdev->write_sectors(bdev, start_sector, sector_count, buffer);
+        storage_io_done(bdev, STORAGE_OP_WRITE, sector_count, 0, issued, result);
+    }
+    
+    // Keep the block device cache coherent with direct writes
+    if (result == 0) {
+        page_cache_device_written(bdev, start_sector, sector_count);
+    }
+    
+    return result;
+}
+
+// Flush an open storage device's cache
+int bdev_flush(block_dev_t* bdev) {
+    if (!bdev) {
+        return -1;
+    }
+    
+    // Queued writes (and their errors) come first
+    int result = storage_queue_sync(bdev);
+    
+    if (!bdev->flush) {
+        // If the device doesn't support flushing, just return its queue status
+        return result;
+    }
+    
+    unsigned long long issued = storage_io_start(bdev);
+    int flushed = bdev->flush(bdev);
+    storage_io_done(bdev, STORAGE_OP_FLUSH, 0, 0, issued, flushed);
+    
+    if (flushed != 0) {
+        return -1;
+    }
+    
+    return result;
+}
+
+// Account a finished hardware queue command, then hand it to its submitter
+static void storage_hw_done(storage_hw_request_t* request) {
+    unsigned int sector_count = request->opcode == STORAGE_OP_FLUSH ? 0 : request->sector_count;
+    
+    request->done = request->end_io;
+    storage_io_done(request->device, request->opcode, sector_count, 0, request->issued, request->result);
+    request->done(request);
+}
+
+// Start a command on a device with hardware queues
+//
+// Returns 0 once the command is queued (it finishes later through
+// bdev_poll) or -1 if the device has no queued interface or rejects it.
+int bdev_submit(block_dev_t* bdev, storage_hw_request_t* request) {
+    if (!bdev || !request || !bdev->submit_request) {
+        return -1;
+    }
+    
+    if (request->opcode == STORAGE_OP_WRITE && bdev->read_only) {
+        terminal_write("Error: Storage device '");
+        terminal_write(bdev->name);
+        terminal_write("' is read-only\n");
+        return -1;
+    }
+    
+    // Queued writes to these sectors must land first
+    if (request->opcode != STORAGE_OP_FLUSH && bdev->queue &&
+        storage_queue_overlaps(bdev->queue, request->start_sector, request->sector_count)) {
+        storage_queue_run(bdev);
+    }
+    
+    // Completion goes through the accounting first
+    request->device = bdev;
+    request->end_io = request->done;
+    request->done = storage_hw_done;
+    
+    if (bdev->submit_request(bdev, request) != 0) {
+        request->done = request->end_io;
+        return -1;
+    }
+    
+    // Drivers only complete commands from bdev_poll, so this comes in time
+    request->issued = storage_io_start(bdev);
+    
+    // Cached device pages are stale from the moment the write is issued
+    if (request->opcode == STORAGE_OP_WRITE) {
+        page_cache_device_written(bdev, request->start_sector, request->sector_count);
+    }
+    
+    return 0;
+}
+
+// Make submitted commands visible to the device
+void bdev_commit(block_dev_t* bdev) {
+    if (bdev && bdev->commit_requests) {
+        bdev->commit_requests(bdev);
+    }
+}
+
+// Finish completed commands; returns the number finished
+int bdev_poll(block_dev_t* bdev) {
+    if (!bdev || !bdev->poll_completions) {
+        return 0;
+    }
+    
+    return bdev->poll_completions(bdev);
 }
 
 // Read sectors from a storage device
@@ -166,18 +815,25 @@ int storage_read_sectors(const char* device_name, unsigned int start_sector, uns
         return -1;
     }
     
-    if (!device->read_sectors) {
+    return bdev_read_sectors(device, start_sector, sector_count, buffer);
+}
+
+// Write sectors to a storage device
+int storage_write_sectors(const char* device_name, unsigned int start_sector, unsigned int sector_count, const void* buffer) {
+    storage_device_t* device = storage_get_device(device_name);
+    
+    if (!device) {
         terminal_write("Error: Storage device '");
         terminal_write(device_name);
-        terminal_write("' does not support reading\n");
+        terminal_write("' not found\n");
         return -1;
     }
     
-    return device->read_sectors(device, start_sector, sector_count, buffer);
+    return bdev_write_sectors(device, start_sector, sector_count, buffer);
 }
 
-// Write sectors to a storage device
-int storage_write_sectors(const char* device_name, unsigned int start_sector, unsigned int sector_count, const void* buffer) {
+// Flush a storage device's cache
+int storage_flush(const char* device_name) {
     storage_device_t* device = storage_get_device(device_name);
     
     if (!device) {
@@ -187,40 +843,293 @@ int storage_write_sectors(const char* device_name, unsigned int start_sector, un
         return -1;
     }
     
-    if (device->read_only) {
-        terminal_write("Error: Storage device '");
-        terminal_write(device_name);
-        terminal_write("' is read-only\n");
+    return bdev_flush(device);
+}
+
+// Start batching writes on all devices (calls nest)
+void storage_plug() {
+    storage_plug_depth++;
+}
+
+// End a batch; the outermost call dispatches every queued write
+int storage_unplug() {
+    if (storage_plug_depth == 0 || --storage_plug_depth > 0) {
+        return 0;
+    }
+    
+    int result = 0;
+    
+    for (int i = 0; i < storage_device_count; i++) {
+        if (storage_queue_sync(storage_devices[i]) != 0) {
+            result = -1;
+        }
+    }
+    
+    return result;
+}
+
+// Get a device's request queue statistics
+int storage_get_queue_stats(const char* device_name, storage_queue_stats_t* stats) {
+    storage_device_t* device = storage_get_device(device_name);
+    
+    if (!device || !device->queue || !stats) {
         return -1;
     }
     
-    if (!device->write_sectors) {
-        terminal_write("Error: Storage device '");
-        terminal_write(device_name);
-        terminal_write("' does not support writing\n");
+    *stats = device->queue->stats;
+    
+    return 0;
+}
+
+// Get a device's I/O accounting
+int storage_get_io_stats(const char* device_name, storage_io_stats_t* stats) {
+    storage_device_t* device = storage_get_device(device_name);
+    
+    if (!device || !stats) {
         return -1;
     }
     
-    return device->write_sectors(device, start_sector, sector_count, buffer);
+    storage_io_snapshot(device, stats);
+    
+    return 0;
 }
 
-// Flush a storage device's cache
-int storage_flush(const char* device_name) {
+// Sum the I/O accounting of every device
+//
+// Busy time is summed too, so it can exceed the time since the earliest
+// counters started when devices were busy at once.
+void storage_get_io_totals(storage_io_stats_t* stats) {
+    if (!stats) {
+        return;
+    }
+    
+    memset(stats, 0, sizeof(storage_io_stats_t));
+    
+    for (int i = 0; i < storage_device_count; i++) {
+        storage_io_stats_t device_stats;
+        storage_io_snapshot(storage_devices[i], &device_stats);
+        
+        for (int op = 0; op < STORAGE_OP_COUNT; op++) {
+            stats->ios[op] += device_stats.ios[op];
+            stats->sectors[op] += device_stats.sectors[op];
+            stats->errors[op] += device_stats.errors[op];
+            stats->queue_ns[op] += device_stats.queue_ns[op];
+            stats->service_ns[op] += device_stats.service_ns[op];
+            
+            if (device_stats.max_ns[op] > stats->max_ns[op]) {
+                stats->max_ns[op] = device_stats.max_ns[op];
+            }
+            
+            for (int bucket = 0; bucket < STORAGE_LATENCY_BUCKETS; bucket++) {
+                stats->latency[op][bucket] += device_stats.latency[op][bucket];
+            }
+        }
+        
+        stats->in_flight += device_stats.in_flight;
+        stats->busy_ns += device_stats.busy_ns;
+        
+        if (i == 0 || device_stats.since < stats->since) {
+            stats->since = device_stats.since;
+        }
+    }
+}
+
+// Restart the I/O accounting of a device, or of every device if no name is given
+//
+// Commands still in flight stay counted so their completions balance.
+void storage_reset_io_stats(const char* device_name) {
+    unsigned long long now = ktime_get_ns();
+    
+    for (int i = 0; i < storage_device_count; i++) {
+        storage_device_t* device = storage_devices[i];
+        
+        if (device_name && strcmp(device->name, device_name) != 0) {
+            continue;
+        }
+        
+        unsigned int in_flight = device->io.in_flight;
+        
+        memset(&device->io, 0, sizeof(storage_io_stats_t));
+        device->io.in_flight = in_flight;
+        device->io.since = now;
+        device->busy_since = now;
+    }
+}
+
+// Write a number right-aligned in a column
+static void storage_write_number(unsigned long long value, int width) {
+    char buffer[24];
+    int idx = 0;
+    
+    do {
+        buffer[idx++] = '0' + (value % 10);
+        value /= 10;
+    } while (value > 0);
+    
+    for (int pad = idx; pad < width; pad++) {
+        terminal_write(" ");
+    }
+    
+    // Digits were produced last first
+    char digits[24];
+    
+    for (int j = 0; j < idx; j++) {
+        digits[j] = buffer[idx - j - 1];
+    }
+    
+    digits[idx] = '\0';
+    terminal_write(digits);
+}
+
+// Write text left-aligned in a column
+static void storage_write_padded(const char* text, int width) {
+    terminal_write(text);
+    
+    for (int pad = strlen(text); pad < width; pad++) {
+        terminal_write(" ");
+    }
+}
+
+// Get the mean latency of a kind of command in microseconds
+static unsigned long long storage_io_await(const storage_io_stats_t* stats, int op) {
+    if (stats->ios[op] == 0) {
+        return 0;
+    }
+    
+    return (stats->queue_ns[op] + stats->service_ns[op]) / stats->ios[op] / 1000;
+}
+
+// Get the share of time a device had commands in flight, in percent
+static unsigned long long storage_io_utilization(const storage_io_stats_t* stats) {
+    unsigned long long elapsed = ktime_get_ns() - stats->since;
+    
+    return elapsed ? stats->busy_ns * 100 / elapsed : 0;
+}
+
+// List the I/O accounting of every device, one line each
+void storage_list_io_stats() {
+    terminal_write("Device          reads   writes  flushes     kB_read     kB_wrtn r_await w_await inflight  util\n");
+    
+    for (int i = 0; i < storage_device_count; i++) {
+        storage_device_t* device = storage_devices[i];
+        storage_io_stats_t stats;
+        
+        storage_io_snapshot(device, &stats);
+        
+        storage_write_padded(device->name, 12);
+        storage_write_number(stats.ios[STORAGE_OP_READ], 9);
+        storage_write_number(stats.ios[STORAGE_OP_WRITE], 9);
+        storage_write_number(stats.ios[STORAGE_OP_FLUSH], 9);
+        storage_write_number(stats.sectors[STORAGE_OP_READ] * device->sector_size / 1024, 12);
+        storage_write_number(stats.sectors[STORAGE_OP_WRITE] * device->sector_size / 1024, 12);
+        storage_write_number(storage_io_await(&stats, STORAGE_OP_READ), 8);
+        storage_write_number(storage_io_await(&stats, STORAGE_OP_WRITE), 8);
+        storage_write_number(stats.in_flight, 9);
+        storage_write_number(storage_io_utilization(&stats), 5);
+        terminal_write("%\n");
+    }
+    
+    terminal_write("(await in microseconds, since the counters started)\n");
+}
+
+// Print one kind of command's counters and latency histogram
+static void storage_print_io_op(const storage_io_stats_t* stats, int op, const char* name) {
+    terminal_write("  ");
+    storage_write_padded(name, 10);
+    storage_write_number(stats->ios[op], 0);
+    terminal_write(" commands, ");
+    
+    if (op != STORAGE_OP_FLUSH) {
+        storage_write_number(stats->sectors[op], 0);
+        terminal_write(" sectors, ");
+    }
+    
+    storage_write_number(stats->errors[op], 0);
+    terminal_write(" errors\n");
+    
+    if (stats->ios[op] == 0) {
+        return;
+    }
+    
+    terminal_write("    queue ");
+    storage_write_number(stats->queue_ns[op] / stats->ios[op] / 1000, 0);
+    terminal_write(" us, service ");
+    storage_write_number(stats->service_ns[op] / stats->ios[op] / 1000, 0);
+    terminal_write(" us, max ");
+    storage_write_number(stats->max_ns[op] / 1000, 0);
+    terminal_write(" us\n");
+    
+    // Only the range of buckets in use
+    int first = 0;
+    int last = STORAGE_LATENCY_BUCKETS - 1;
+    unsigned long long peak = 0;
+    
+    while (stats->latency[op][first] == 0) {
+        first++;
+    }
+    
+    while (stats->latency[op][last] == 0) {
+        last--;
+    }
+    
+    for (int bucket = first; bucket <= last; bucket++) {
+        if (stats->latency[op][bucket] > peak) {
+            peak = stats->latency[op][bucket];
+        }
+    }
+    
+    for (int bucket = first; bucket <= last; bucket++) {
+        unsigned long long count = stats->latency[op][bucket];
+        unsigned long long bar = count * STORAGE_HISTOGRAM_WIDTH / peak;
+        
+        if (bucket == STORAGE_LATENCY_BUCKETS - 1) {
+            terminal_write("    >=");
+            storage_write_number(1ULL << (bucket - 1), 7);
+        } else {
+            terminal_write("    < ");
+            storage_write_number(1ULL << bucket, 7);
+        }
+        
+        terminal_write(" us");
+        storage_write_number(count, 10);
+        terminal_write(" ");
+        
+        for (unsigned long long j = 0; j < bar || (j == 0 && count > 0); j++) {
+            terminal_write("#");
+        }
+        
+        terminal_write("\n");
+    }
+}
+
+// Print a device's I/O accounting with latency histograms
+int storage_print_io_stats(const char* device_name) {
     storage_device_t* device = storage_get_device(device_name);
     
     if (!device) {
         terminal_write("Error: Storage device '");
-        terminal_write(device_name);
+        terminal_write(device_name ? device_name : "");
         terminal_write("' not found\n");
         return -1;
     }
     
-    if (!device->flush) {
-        // If the device doesn't support flushing, just return success
-        return 0;
-    }
+    storage_io_stats_t stats;
+    storage_io_snapshot(device, &stats);
+    
+    terminal_write(device->name);
+    terminal_write(": ");
+    storage_write_number(stats.in_flight, 0);
+    terminal_write(" in flight, ");
+    storage_write_number(storage_io_utilization(&stats), 0);
+    terminal_write("% busy over ");
+    storage_write_number((ktime_get_ns() - stats.since) / 1000000000ULL, 0);
+    terminal_write(" s\n");
+    
+    storage_print_io_op(&stats, STORAGE_OP_READ, "Reads:");
+    storage_print_io_op(&stats, STORAGE_OP_WRITE, "Writes:");
+    storage_print_io_op(&stats, STORAGE_OP_FLUSH, "Flushes:");
     
-    return device->flush(device);
+    return 0;
 }
 
 // List all storage devices
@@ -18,8 +18,73 @@ typedef enum {
     STORAGE_TYPE_FLOPPY
 } storage_type_t;
 
-// Storage device structure
+// Maximum number of queued requests per device
+#define STORAGE_QUEUE_DEPTH 32
+
+// Maximum number of merged writes in one request
+#define STORAGE_MAX_SEGMENTS 16
+
+// Largest request built by merging (in bytes)
+#define STORAGE_MAX_REQUEST_BYTES (128 * 1024)
+
+// Queued sectors that force the queue to run while plugged
+#define STORAGE_QUEUE_MAX_SECTORS 2048
+
+// Time a queued write may wait before it is dispatched ahead of the elevator
+#define STORAGE_WRITE_EXPIRE_NS 5000000000ULL
+
+// Block I/O operations
+#define STORAGE_OP_READ  0
+#define STORAGE_OP_WRITE 1
+#define STORAGE_OP_FLUSH 2
+#define STORAGE_OP_COUNT 3
+
+// I/O latency histogram buckets: bucket 0 counts commands under 1 us and
+// bucket i those from 2^(i-1) to 2^i us; the last takes everything slower
+#define STORAGE_LATENCY_BUCKETS 24
+
+struct storage_queue;
+
+// Command for devices with hardware queues
+//
+// The driver calls done() once the command has finished, from its
+// poll_completions callback.
+typedef struct storage_hw_request {
+    unsigned int opcode;
+    unsigned int start_sector;
+    unsigned int sector_count;
+    void* buffer;
+    int result;                       // 0 on success, -1 on error
+    void (*done)(struct storage_hw_request* request);
+    void* private_data;               // Owned by the submitter
+    
+    // Accounting state (set by bdev_submit, which routes done through it)
+    struct storage_device* device;
+    unsigned long long issued;        // Time the command was issued
+    void (*end_io)(struct storage_hw_request* request);
+} storage_hw_request_t;
+
+// Per-device I/O accounting
+//
+// Counters are indexed by STORAGE_OP_* and count device commands, so
+// writes merged in the request queue count once. Queue time is how long
+// writes waited in the request queue before being issued; service time
+// runs from issue to completion. Latencies in the histograms cover both.
 typedef struct {
+    unsigned long long ios[STORAGE_OP_COUNT];         // Commands completed
+    unsigned long long sectors[STORAGE_OP_COUNT];
+    unsigned long long errors[STORAGE_OP_COUNT];
+    unsigned long long queue_ns[STORAGE_OP_COUNT];
+    unsigned long long service_ns[STORAGE_OP_COUNT];
+    unsigned long long max_ns[STORAGE_OP_COUNT];      // Slowest command
+    unsigned long long latency[STORAGE_OP_COUNT][STORAGE_LATENCY_BUCKETS];
+    unsigned int in_flight;                           // Commands issued, not completed
+    unsigned long long busy_ns;                       // Time with commands in flight
+    unsigned long long since;                         // Time the counters started
+} storage_io_stats_t;
+
+// Storage device structure
+typedef struct storage_device {
     char name[32];
     storage_type_t type;
     unsigned long long size;          // Size in bytes
@@ -32,23 +97,114 @@ typedef struct {
     int (*write_sectors)(struct storage_device* dev, unsigned int start_sector, unsigned int sector_count, const void* buffer);
     int (*flush)(struct storage_device* dev);
     
+    // Optional queued operations: submit_request starts a command and
+    // returns at once, commit_requests makes submitted commands visible to
+    // the device, and poll_completions finishes completed commands and
+    // returns how many it finished
+    int (*submit_request)(struct storage_device* dev, storage_hw_request_t* request);
+    void (*commit_requests)(struct storage_device* dev);
+    int (*poll_completions)(struct storage_device* dev);
+    
     // Private data for the driver
     void* private_data;
+    
+    // Request queue (set up by storage_register_device)
+    struct storage_queue* queue;
+    
+    // Number of open handles
+    unsigned int open_count;
+    
+    // I/O accounting (reset by storage_register_device)
+    storage_io_stats_t io;
+    unsigned long long busy_since;    // Time in_flight last rose from 0
 } storage_device_t;
 
+// Opened block device handle
+//
+// A handle is the registered device itself: storage_open() resolves the
+// name once and takes a reference that keeps the device registered until
+// storage_close().
+typedef storage_device_t block_dev_t;
+
+// Block I/O segment (the data of one queued write)
+typedef struct {
+    void* buffer;
+    unsigned int sector_count;
+    unsigned int blocks;              // Memory blocks backing the buffer
+} storage_segment_t;
+
+// Block I/O request
+//
+// A request covers a contiguous run of sectors; writes to neighbouring
+// sectors are merged into it as extra segments.
+typedef struct storage_request {
+    unsigned int start_sector;
+    unsigned int sector_count;
+    unsigned long long deadline;      // Dispatch ahead of the elevator after this time
+    unsigned long long queued;        // Time the first write was queued
+    unsigned int segment_count;
+    storage_segment_t segments[STORAGE_MAX_SEGMENTS];
+    struct storage_request* sort_next; // Sector order
+    struct storage_request* fifo_prev; // Submission order
+    struct storage_request* fifo_next;
+} storage_request_t;
+
+// Request queue statistics
+typedef struct {
+    unsigned long long requests;      // Writes submitted to the queue
+    unsigned long long back_merges;
+    unsigned long long front_merges;
+    unsigned long long dispatched;    // Device commands issued
+    unsigned long long dispatched_sectors;
+    unsigned long long expired;       // Requests dispatched by deadline
+    unsigned long long errors;
+} storage_queue_stats_t;
+
+// Per-device request queue
+typedef struct storage_queue {
+    storage_request_t requests[STORAGE_QUEUE_DEPTH];
+    storage_request_t* free_list;
+    storage_request_t* sorted;        // Pending requests by start sector
+    storage_request_t* fifo_head;     // Pending requests by age
+    storage_request_t* fifo_tail;
+    unsigned int count;
+    unsigned int queued_sectors;
+    unsigned int head_sector;         // Where the last dispatch ended
+    int error;                        // Deferred write error, reported by flush
+    unsigned char* dispatch_buffer;   // Gathers merged segments
+    storage_queue_stats_t stats;
+} storage_queue_t;
+
 // Storage driver functions
 void storage_init();
 int storage_register_device(storage_device_t* device);
 int storage_unregister_device(const char* name);
 storage_device_t* storage_get_device(const char* name);
+block_dev_t* storage_open(const char* name);
+void storage_close(block_dev_t* bdev);
+int bdev_read_sectors(block_dev_t* bdev, unsigned int start_sector, unsigned int sector_count, void* buffer);
+int bdev_write_sectors(block_dev_t* bdev, unsigned int start_sector, unsigned int sector_count, const void* buffer);
+int bdev_flush(block_dev_t* bdev);
+int bdev_submit(block_dev_t* bdev, storage_hw_request_t* request);
+void bdev_commit(block_dev_t* bdev);
+int bdev_poll(block_dev_t* bdev);
 int storage_read_sectors(const char* device_name, unsigned int start_sector, unsigned int sector_count, void* buffer);
 int storage_write_sectors(const char* device_name, unsigned int start_sector, unsigned int sector_count, const void* buffer);
 int storage_flush(const char* device_name);
+void storage_plug();
+int storage_unplug();
+int storage_get_queue_stats(const char* device_name, storage_queue_stats_t* stats);
+int storage_get_io_stats(const char* device_name, storage_io_stats_t* stats);
+void storage_get_io_totals(storage_io_stats_t* stats);
+void storage_reset_io_stats(const char* device_name);
 void storage_list_devices();
+void storage_list_io_stats();
+int storage_print_io_stats(const char* device_name);
 
 // Specific storage device detection
 int detect_ata_devices();
 int detect_nvme_devices();
+int detect_virtio_devices();
 int detect_usb_storage_devices();
 int detect_sd_devices();
 
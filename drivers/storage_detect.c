@@ -4,6 +4,8 @@
  */
 
 #include "storage.h"
+#include "nvme.h"
+#include "virtio_blk.h"
 #include "../kernel/kernel.h"
 #include "../libc/string.h"
 
@@ -125,6 +127,7 @@ int detect_ata_devices() {
     // For now, just simulate finding a hard drive
     
     storage_device_t device;
+    memset(&device, 0, sizeof(storage_device_t));
     
     // Primary master
     strcpy(device.name, "hda");
@@ -159,10 +162,17 @@ int detect_ata_devices() {
 
 // Detect NVMe devices
 int detect_nvme_devices() {
-    // In a real system, this would scan the PCI bus for NVMe controllers
-    // For now, just simulate finding an NVMe SSD
+    // Drive real controllers found on the PCI bus
+    int count = nvme_init();
+    
+    if (count > 0) {
+        return count;
+    }
+    
+    // Otherwise simulate an NVMe SSD
     
     storage_device_t device;
+    memset(&device, 0, sizeof(storage_device_t));
     
     strcpy(device.name, "nvme0n1");
     device.type = STORAGE_TYPE_NVME;
@@ -180,12 +190,19 @@ int detect_nvme_devices() {
     return 1; // Found 1 device
 }
 
+// Detect virtio block devices (paravirtualized disks under a hypervisor)
+int detect_virtio_devices() {
+    // Only real devices; there is nothing to simulate without a hypervisor
+    return virtio_blk_init();
+}
+
 // Detect USB storage devices
 int detect_usb_storage_devices() {
     // In a real system, this would scan the USB bus for mass storage devices
     // For now, just simulate finding a USB flash drive
     
     storage_device_t device;
+    memset(&device, 0, sizeof(storage_device_t));
     
     strcpy(device.name, "sda");
     device.type = STORAGE_TYPE_USB;
@@ -209,6 +226,7 @@ int detect_sd_devices() {
     // For now, just simulate finding an SD card
     
     storage_device_t device;
+    memset(&device, 0, sizeof(storage_device_t));
     
     strcpy(device.name, "mmcblk0");
     device.type = STORAGE_TYPE_SD;
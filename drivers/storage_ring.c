@@ -0,0 +1,545 @@
+/**
+ * LightOS Drivers
+ * Batched block I/O submission ring implementation
+ *
+ * Callers queue many requests and submit them in one call. Each batch is
+ * split at flushes and sorted by device and sector. Devices with hardware
+ * queues get every request as its own command and complete them later;
+ * for other devices, contiguous requests of the same kind are merged into
+ * single commands and completed before storage_ring_submit() returns.
+ */
+
+#include "storage_ring.h"
+#include "../kernel/kernel.h"
+#include "../kernel/klog.h"
+#include "../libc/string.h"
+
+KLOG_SUBSYSTEM(ring_log, "storage_ring");
+
+// Memory blocks needed for a ring's queues
+static unsigned int storage_ring_blocks(unsigned int entries) {
+    unsigned int bytes = entries * (sizeof(storage_sqe_t) + sizeof(storage_cqe_t) + sizeof(storage_ring_cmd_t) + sizeof(unsigned int));
+    return (bytes + MEMORY_BLOCK_SIZE - 1) / MEMORY_BLOCK_SIZE;
+}
+
+// Post a completion (space was reserved by storage_ring_submit)
+static void storage_ring_complete(storage_ring_t* ring, const storage_sqe_t* sqe, int result) {
+    storage_cqe_t* cqe = &ring->cq[ring->cq_tail & (ring->entries - 1)];
+
+    cqe->user_data = sqe->user_data;
+    cqe->result = result;
+    ring->cq_tail++;
+}
+
+// Finish a hardware queue command (called by the driver from bdev_poll)
+static void storage_ring_hw_done(storage_hw_request_t* request) {
+    storage_ring_cmd_t* command = (storage_ring_cmd_t*) request;
+    storage_ring_t* ring = command->ring;
+    storage_cqe_t* cqe = &ring->cq[ring->cq_tail & (ring->entries - 1)];
+
+    cqe->user_data = command->user_data;
+    cqe->result = request->result;
+    ring->cq_tail++;
+
+    ring->device_inflight[command->device]--;
+    ring->hw_inflight--;
+
+    command->next_free = ring->free_command;
+    ring->free_command = command - ring->commands;
+}
+
+// Get a device's slot in the ring's device table, adding it if needed
+static int storage_ring_device_slot(storage_ring_t* ring, block_dev_t* bdev) {
+    for (unsigned int i = 0; i < ring->device_count; i++) {
+        if (ring->devices[i] == bdev) {
+            return i;
+        }
+    }
+
+    // Forget devices with nothing outstanding to make room
+    if (ring->device_count == STORAGE_RING_MAX_DEVICES) {
+        unsigned int kept = 0;
+
+        for (unsigned int i = 0; i < ring->device_count; i++) {
+            if (ring->device_inflight[i] > 0) {
+                ring->devices[kept] = ring->devices[i];
+                ring->device_inflight[kept] = ring->device_inflight[i];
+                kept++;
+            }
+        }
+
+        // Outstanding commands refer to their slot, so only compact when idle
+        if (kept != ring->device_count && ring->hw_inflight == 0) {
+            ring->device_count = kept;
+        }
+
+        if (ring->device_count == STORAGE_RING_MAX_DEVICES) {
+            return -1;
+        }
+    }
+
+    ring->devices[ring->device_count] = bdev;
+    ring->device_inflight[ring->device_count] = 0;
+
+    return ring->device_count++;
+}
+
+// Send an entry to a device's hardware queue; returns -1 if the entry has
+// to go the synchronous way instead
+static int storage_ring_queue(storage_ring_t* ring, storage_sqe_t* sqe) {
+    if (ring->free_command >= ring->entries) {
+        return -1;
+    }
+
+    int slot = storage_ring_device_slot(ring, sqe->bdev);
+
+    if (slot < 0) {
+        return -1;
+    }
+
+    storage_ring_cmd_t* command = &ring->commands[ring->free_command];
+
+    command->request.opcode = sqe->opcode;
+    command->request.start_sector = sqe->start_sector;
+    command->request.sector_count = sqe->sector_count;
+    command->request.buffer = sqe->buffer;
+    command->request.result = 0;
+    command->request.done = storage_ring_hw_done;
+    command->request.private_data = NULL;
+    command->ring = ring;
+    command->user_data = sqe->user_data;
+    command->device = slot;
+
+    if (bdev_submit(sqe->bdev, &command->request) != 0) {
+        return -1;
+    }
+
+    ring->free_command = command->next_free;
+    ring->device_inflight[slot]++;
+    ring->hw_inflight++;
+    ring->stats.commands++;
+    ring->stats.queued++;
+
+    return 0;
+}
+
+// Let devices start the commands queued so far
+static void storage_ring_commit(storage_ring_t* ring) {
+    for (unsigned int i = 0; i < ring->device_count; i++) {
+        if (ring->device_inflight[i] > 0) {
+            bdev_commit(ring->devices[i]);
+        }
+    }
+}
+
+// Wait for every hardware queue command to finish
+static void storage_ring_drain(storage_ring_t* ring) {
+    storage_ring_commit(ring);
+
+    while (ring->hw_inflight > 0) {
+        storage_ring_poll(ring);
+    }
+}
+
+// Check whether an entry describes a valid read or write
+static int storage_ring_valid(const storage_sqe_t* sqe) {
+    if (sqe->opcode != STORAGE_OP_READ && sqe->opcode != STORAGE_OP_WRITE) {
+        return 0;
+    }
+
+    return sqe->bdev && sqe->buffer && sqe->sector_count > 0 && sqe->bdev->sector_size > 0;
+}
+
+// Order two entries by device, operation and start sector
+static int storage_ring_before(const storage_sqe_t* a, const storage_sqe_t* b) {
+    if (a->bdev != b->bdev) {
+        return (unsigned long long) a->bdev < (unsigned long long) b->bdev;
+    }
+
+    if (a->opcode != b->opcode) {
+        return a->opcode < b->opcode;
+    }
+
+    return a->start_sector < b->start_sector;
+}
+
+// Sort a range of submission indices (insertion sort; batches from
+// sequential streams arrive nearly sorted)
+static void storage_ring_sort(storage_ring_t* ring, unsigned int* order, unsigned int count) {
+    unsigned int mask = ring->entries - 1;
+
+    for (unsigned int i = 1; i < count; i++) {
+        unsigned int index = order[i];
+        unsigned int j = i;
+
+        while (j > 0 && storage_ring_before(&ring->sq[index & mask], &ring->sq[order[j - 1] & mask])) {
+            order[j] = order[j - 1];
+            j--;
+        }
+
+        order[j] = index;
+    }
+}
+
+// Issue one merged run of entries as a single device command
+static int storage_ring_issue(storage_ring_t* ring, unsigned int* order, unsigned int count, unsigned int sector_count) {
+    unsigned int mask = ring->entries - 1;
+    storage_sqe_t* first = &ring->sq[order[0] & mask];
+    block_dev_t* bdev = first->bdev;
+    unsigned int sector_size = bdev->sector_size;
+
+    ring->stats.commands++;
+    ring->stats.merged += count - 1;
+
+    // Buffers that are already laid out back to back need no copying
+    int contiguous = 1;
+    unsigned char* expected = (unsigned char*) first->buffer;
+
+    for (unsigned int i = 0; i < count; i++) {
+        storage_sqe_t* sqe = &ring->sq[order[i] & mask];
+
+        if ((unsigned char*) sqe->buffer != expected) {
+            contiguous = 0;
+            break;
+        }
+
+        expected += sqe->sector_count * sector_size;
+    }
+
+    if (contiguous) {
+        if (first->opcode == STORAGE_OP_READ) {
+            return bdev_read_sectors(bdev, first->start_sector, sector_count, first->buffer);
+        }
+
+        return bdev_write_sectors(bdev, first->start_sector, sector_count, first->buffer);
+    }
+
+    unsigned char* bounce = ring->bounce_buffer;
+    int result = 0;
+
+    if (first->opcode == STORAGE_OP_WRITE) {
+        // Gather, then write once
+        unsigned int offset = 0;
+
+        for (unsigned int i = 0; i < count; i++) {
+            storage_sqe_t* sqe = &ring->sq[order[i] & mask];
+            memcpy(bounce + offset, sqe->buffer, sqe->sector_count * sector_size);
+            offset += sqe->sector_count * sector_size;
+        }
+
+        result = bdev_write_sectors(bdev, first->start_sector, sector_count, bounce);
+    } else {
+        // Read once, then scatter
+        result = bdev_read_sectors(bdev, first->start_sector, sector_count, bounce);
+
+        if (result == 0) {
+            unsigned int offset = 0;
+
+            for (unsigned int i = 0; i < count; i++) {
+                storage_sqe_t* sqe = &ring->sq[order[i] & mask];
+                memcpy(sqe->buffer, bounce + offset, sqe->sector_count * sector_size);
+                offset += sqe->sector_count * sector_size;
+            }
+        }
+    }
+
+    return result;
+}
+
+// Dispatch the reads and writes between two flushes
+static void storage_ring_dispatch(storage_ring_t* ring, unsigned int* order, unsigned int count) {
+    unsigned int mask = ring->entries - 1;
+
+    storage_ring_sort(ring, order, count);
+
+    unsigned int i = 0;
+
+    while (i < count) {
+        storage_sqe_t* first = &ring->sq[order[i] & mask];
+
+        if (!storage_ring_valid(first)) {
+            KLOG(&ring_log, KLOG_WARNING, "invalid request (opcode %u, %u sectors)\n", first->opcode, first->sector_count);
+            storage_ring_complete(ring, first, -1);
+            i++;
+            continue;
+        }
+
+        if (first->bdev->submit_request && storage_ring_queue(ring, first) == 0) {
+            i++;
+            continue;
+        }
+
+        // Extend the run while requests continue where the previous one ended
+        unsigned int sector_size = first->bdev->sector_size;
+        unsigned int sector_count = first->sector_count;
+        unsigned int run = 1;
+
+        while (ring->bounce_buffer && i + run < count) {
+            storage_sqe_t* next = &ring->sq[order[i + run] & mask];
+
+            if (!storage_ring_valid(next) || next->bdev != first->bdev || next->opcode != first->opcode ||
+                next->start_sector != first->start_sector + sector_count ||
+                (unsigned long long) (sector_count + next->sector_count) * sector_size > STORAGE_MAX_REQUEST_BYTES) {
+                break;
+            }
+
+            sector_count += next->sector_count;
+            run++;
+        }
+
+        int result = storage_ring_issue(ring, &order[i], run, sector_count);
+
+        if (result != 0) {
+            KLOG(&ring_log, KLOG_ERR, "%s: %s of %u sectors at %u failed\n", first->bdev->name,
+                 first->opcode == STORAGE_OP_READ ? "read" : "write", sector_count, first->start_sector);
+        }
+
+        for (unsigned int j = 0; j < run; j++) {
+            storage_ring_complete(ring, &ring->sq[order[i + j] & mask], result);
+        }
+
+        i += run;
+    }
+}
+
+// Initialize a ring with room for the given number of entries
+int storage_ring_init(storage_ring_t* ring, unsigned int entries, storage_ring_callback_t callback, void* context) {
+    if (!ring || entries == 0 || entries > STORAGE_RING_MAX_ENTRIES) {
+        terminal_write("Error: Invalid storage ring size\n");
+        return -1;
+    }
+
+    // Round up to a power of two so indices can be masked
+    unsigned int size = 1;
+
+    while (size < entries) {
+        size <<= 1;
+    }
+
+    unsigned int blocks = storage_ring_blocks(size);
+    unsigned char* memory = (unsigned char*) allocate_blocks(blocks);
+
+    if (!memory) {
+        terminal_write("Error: Failed to allocate storage ring\n");
+        return -1;
+    }
+
+    memset(ring, 0, sizeof(storage_ring_t));
+    ring->sq = (storage_sqe_t*) memory;
+    ring->cq = (storage_cqe_t*) (memory + size * sizeof(storage_sqe_t));
+    ring->commands = (storage_ring_cmd_t*) (memory + size * (sizeof(storage_sqe_t) + sizeof(storage_cqe_t)));
+    ring->order = (unsigned int*) (ring->commands + size);
+    ring->entries = size;
+
+    for (unsigned int i = 0; i < size; i++) {
+        ring->commands[i].next_free = i + 1;
+    }
+
+    ring->free_command = 0;
+    ring->blocks = blocks;
+    ring->callback = callback;
+    ring->context = context;
+
+    // Without a bounce buffer, only memory-contiguous requests are merged
+    ring->bounce_buffer = (unsigned char*) allocate_blocks(STORAGE_RING_BOUNCE_BLOCKS);
+
+    return 0;
+}
+
+// Release a ring's memory (queued entries are dropped; commands already on
+// a device are waited for)
+void storage_ring_destroy(storage_ring_t* ring) {
+    if (!ring || !ring->sq) {
+        return;
+    }
+
+    storage_ring_drain(ring);
+
+    if (ring->bounce_buffer) {
+        free_blocks(ring->bounce_buffer, STORAGE_RING_BOUNCE_BLOCKS);
+    }
+
+    free_blocks(ring->sq, ring->blocks);
+    memset(ring, 0, sizeof(storage_ring_t));
+}
+
+// Get a free submission entry, or NULL if the submission queue is full
+storage_sqe_t* storage_ring_get_sqe(storage_ring_t* ring) {
+    if (!ring || !ring->sq || ring->sq_tail - ring->sq_head >= ring->entries) {
+        return NULL;
+    }
+
+    storage_sqe_t* sqe = &ring->sq[ring->sq_tail & (ring->entries - 1)];
+    ring->sq_tail++;
+
+    memset(sqe, 0, sizeof(storage_sqe_t));
+    return sqe;
+}
+
+// Prepare a read
+void storage_ring_prep_read(storage_sqe_t* sqe, block_dev_t* bdev, unsigned int start_sector, unsigned int sector_count, void* buffer, void* user_data) {
+    sqe->opcode = STORAGE_OP_READ;
+    sqe->bdev = bdev;
+    sqe->start_sector = start_sector;
+    sqe->sector_count = sector_count;
+    sqe->buffer = buffer;
+    sqe->user_data = user_data;
+}
+
+// Prepare a write
+void storage_ring_prep_write(storage_sqe_t* sqe, block_dev_t* bdev, unsigned int start_sector, unsigned int sector_count, const void* buffer, void* user_data) {
+    sqe->opcode = STORAGE_OP_WRITE;
+    sqe->bdev = bdev;
+    sqe->start_sector = start_sector;
+    sqe->sector_count = sector_count;
+    sqe->buffer = (void*) buffer;
+    sqe->user_data = user_data;
+}
+
+// Prepare a flush (ordered after every entry submitted before it)
+void storage_ring_prep_flush(storage_sqe_t* sqe, block_dev_t* bdev, void* user_data) {
+    sqe->opcode = STORAGE_OP_FLUSH;
+    sqe->bdev = bdev;
+    sqe->start_sector = 0;
+    sqe->sector_count = 0;
+    sqe->buffer = NULL;
+    sqe->user_data = user_data;
+}
+
+// Submit queued entries; returns the number submitted
+//
+// Entries that would overflow the completion queue (counting commands
+// still outstanding on devices) stay queued until completions are reaped.
+int storage_ring_submit(storage_ring_t* ring) {
+    if (!ring || !ring->sq) {
+        return -1;
+    }
+
+    unsigned int pending = ring->sq_tail - ring->sq_head;
+    unsigned int space = ring->entries - (ring->cq_tail - ring->cq_head) - ring->hw_inflight;
+    unsigned int count = pending < space ? pending : space;
+
+    if (count == 0) {
+        return 0;
+    }
+
+    unsigned int mask = ring->entries - 1;
+    unsigned int batch = 0;
+
+    for (unsigned int i = 0; i < count; i++) {
+        unsigned int index = ring->sq_head + i;
+        storage_sqe_t* sqe = &ring->sq[index & mask];
+
+        if (sqe->opcode != STORAGE_OP_FLUSH) {
+            ring->order[batch++] = index;
+            continue;
+        }
+
+        // Everything before the flush finishes first
+        storage_ring_dispatch(ring, ring->order, batch);
+        storage_ring_drain(ring);
+        batch = 0;
+
+        int result = sqe->bdev ? bdev_flush(sqe->bdev) : -1;
+        ring->stats.commands++;
+        storage_ring_complete(ring, sqe, result);
+    }
+
+    storage_ring_dispatch(ring, ring->order, batch);
+    storage_ring_commit(ring);
+
+    ring->sq_head += count;
+    ring->stats.submitted += count;
+    ring->stats.batches++;
+
+    return count;
+}
+
+// Collect finished hardware queue commands; returns the number finished
+int storage_ring_poll(storage_ring_t* ring) {
+    if (!ring || ring->hw_inflight == 0) {
+        return 0;
+    }
+
+    int finished = 0;
+
+    for (unsigned int i = 0; i < ring->device_count; i++) {
+        if (ring->device_inflight[i] > 0) {
+            finished += bdev_poll(ring->devices[i]);
+        }
+    }
+
+    return finished;
+}
+
+// Reap up to max completions into cqes (which may be NULL), calling the
+// ring's callback for each; returns the number reaped
+unsigned int storage_ring_reap(storage_ring_t* ring, storage_cqe_t* cqes, unsigned int max) {
+    if (!ring || !ring->cq) {
+        return 0;
+    }
+
+    unsigned int reaped = 0;
+
+    storage_ring_poll(ring);
+
+    while (reaped < max && ring->cq_head != ring->cq_tail) {
+        // Copy first: the callback may submit more entries
+        storage_cqe_t cqe = ring->cq[ring->cq_head & (ring->entries - 1)];
+        ring->cq_head++;
+        ring->stats.completed++;
+
+        if (cqes) {
+            cqes[reaped] = cqe;
+        }
+
+        reaped++;
+
+        if (ring->callback) {
+            ring->callback(ring, &cqe);
+        }
+    }
+
+    return reaped;
+}
+
+// Submit pending entries and wait until at least min_complete completions
+// are ready; returns the number ready, or -1 if that many can never arrive
+int storage_ring_wait(storage_ring_t* ring, unsigned int min_complete) {
+    if (!ring || !ring->sq) {
+        return -1;
+    }
+
+    if (storage_ring_submit(ring) < 0) {
+        return -1;
+    }
+
+    unsigned int ready = ring->cq_tail - ring->cq_head;
+
+    while (ready < min_complete && ring->hw_inflight > 0) {
+        storage_ring_poll(ring);
+        ready = ring->cq_tail - ring->cq_head;
+    }
+
+    if (ready < min_complete) {
+        return -1;
+    }
+
+    return ready;
+}
+
+// Get the number of entries submitted or queued but not yet reaped
+unsigned int storage_ring_inflight(const storage_ring_t* ring) {
+    if (!ring || !ring->sq) {
+        return 0;
+    }
+
+    return (ring->sq_tail - ring->sq_head) + ring->hw_inflight + (ring->cq_tail - ring->cq_head);
+}
+
+// Get ring statistics
+void storage_ring_get_stats(const storage_ring_t* ring, storage_ring_stats_t* stats) {
+    if (ring && stats) {
+        *stats = ring->stats;
+    }
+}
@@ -0,0 +1,110 @@
+/**
+ * LightOS Drivers
+ * Batched block I/O submission ring header
+ */
+
+#ifndef STORAGE_RING_H
+#define STORAGE_RING_H
+
+#include "storage.h"
+#include "../kernel/memory.h"
+
+// Maximum ring size (entries)
+#define STORAGE_RING_MAX_ENTRIES 1024
+
+// Bounce buffer size (memory blocks) for merging non-contiguous buffers
+#define STORAGE_RING_BOUNCE_BLOCKS (STORAGE_MAX_REQUEST_BYTES / MEMORY_BLOCK_SIZE)
+
+// Devices with hardware queues a ring can have commands outstanding on
+#define STORAGE_RING_MAX_DEVICES 8
+
+struct storage_ring;
+
+// Submission queue entry
+typedef struct {
+    unsigned int opcode;
+    block_dev_t* bdev;
+    unsigned int start_sector;
+    unsigned int sector_count;
+    void* buffer;
+    void* user_data;                    // Returned in the completion
+} storage_sqe_t;
+
+// Completion queue entry
+typedef struct {
+    void* user_data;
+    int result;                         // 0 on success, -1 on error
+} storage_cqe_t;
+
+// Completion callback (called from storage_ring_reap)
+typedef void (*storage_ring_callback_t)(struct storage_ring* ring, const storage_cqe_t* cqe);
+
+// Command outstanding on a device with hardware queues
+typedef struct {
+    storage_hw_request_t request;       // Must be first
+    struct storage_ring* ring;
+    void* user_data;
+    unsigned int device;                // Index in the ring's device table
+    unsigned int next_free;
+} storage_ring_cmd_t;
+
+// Ring statistics
+typedef struct {
+    unsigned long long submitted;       // Entries submitted
+    unsigned long long completed;       // Completions reaped
+    unsigned long long batches;         // storage_ring_submit calls that did work
+    unsigned long long commands;        // Device commands issued
+    unsigned long long merged;          // Entries merged into a neighbour's command
+    unsigned long long queued;          // Entries sent to hardware queues
+} storage_ring_stats_t;
+
+// Submission/completion ring
+//
+// Entries are filled with storage_ring_get_sqe() and the prep helpers and
+// handed to the device layer in one storage_ring_submit() call; results are
+// collected from the completion queue with storage_ring_reap() or
+// storage_ring_wait(). Head and tail indices run freely and are masked by
+// the (power of two) entry count. Entries between two flushes may complete
+// in any order; a flush orders the I/O around it.
+//
+// Devices with hardware queues (submit_request) get one command per entry
+// and complete them while the caller carries on; storage_ring_reap() and
+// storage_ring_wait() poll them. Other devices are driven synchronously
+// from storage_ring_submit(), with contiguous entries merged.
+typedef struct storage_ring {
+    storage_sqe_t* sq;
+    storage_cqe_t* cq;
+    unsigned int entries;
+    unsigned int sq_head;               // Next entry to submit
+    unsigned int sq_tail;               // Next free entry
+    unsigned int cq_head;               // Next completion to reap
+    unsigned int cq_tail;               // Next completion slot
+    unsigned int* order;                // Submission order scratch space
+    storage_ring_cmd_t* commands;       // Hardware queue commands
+    unsigned int free_command;          // Head of the free command list
+    unsigned int hw_inflight;           // Commands outstanding on devices
+    block_dev_t* devices[STORAGE_RING_MAX_DEVICES];
+    unsigned int device_inflight[STORAGE_RING_MAX_DEVICES];
+    unsigned int device_count;
+    unsigned int blocks;                // Memory blocks holding the queues
+    unsigned char* bounce_buffer;       // Gathers merged commands
+    storage_ring_callback_t callback;
+    void* context;
+    storage_ring_stats_t stats;
+} storage_ring_t;
+
+// Ring functions
+int storage_ring_init(storage_ring_t* ring, unsigned int entries, storage_ring_callback_t callback, void* context);
+void storage_ring_destroy(storage_ring_t* ring);
+storage_sqe_t* storage_ring_get_sqe(storage_ring_t* ring);
+void storage_ring_prep_read(storage_sqe_t* sqe, block_dev_t* bdev, unsigned int start_sector, unsigned int sector_count, void* buffer, void* user_data);
+void storage_ring_prep_write(storage_sqe_t* sqe, block_dev_t* bdev, unsigned int start_sector, unsigned int sector_count, const void* buffer, void* user_data);
+void storage_ring_prep_flush(storage_sqe_t* sqe, block_dev_t* bdev, void* user_data);
+int storage_ring_submit(storage_ring_t* ring);
+int storage_ring_poll(storage_ring_t* ring);
+unsigned int storage_ring_reap(storage_ring_t* ring, storage_cqe_t* cqes, unsigned int max);
+int storage_ring_wait(storage_ring_t* ring, unsigned int min_complete);
+unsigned int storage_ring_inflight(const storage_ring_t* ring);
+void storage_ring_get_stats(const storage_ring_t* ring, storage_ring_stats_t* stats);
+
+#endif /* STORAGE_RING_H */
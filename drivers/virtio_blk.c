@@ -0,0 +1,762 @@
+/**
+ * LightOS Drivers
+ * virtio-blk driver implementation
+ *
+ * Drives virtio block devices through the virtio 1.0 PCI transport. Each
+ * request takes a single ring descriptor pointing at an indirect table
+ * (header, data, status) when the device supports it, so the whole queue
+ * can be in flight at once. The device is notified once per batch, and
+ * only when it has asked for notifications. Completions are polled from
+ * the used ring with device interrupts suppressed.
+ */
+
+#include "virtio_blk.h"
+#include "../kernel/kernel.h"
+#include "../kernel/klog.h"
+#include "../kernel/ktime.h"
+#include "../kernel/memory.h"
+#include "../libc/string.h"
+
+KLOG_SUBSYSTEM(virtio_log, "virtio_blk");
+
+// Queue memory: descriptors and available ring in one block, used ring in another
+#define VIRTIO_BLK_QUEUE_BLOCKS 2
+#define VIRTIO_BLK_SLOT_BLOCKS ((VIRTIO_BLK_QUEUE_MAX * sizeof(virtio_blk_slot_t) + MEMORY_BLOCK_SIZE - 1) / MEMORY_BLOCK_SIZE)
+#define VIRTIO_BLK_DEVICE_BLOCKS ((sizeof(virtio_blk_t) + MEMORY_BLOCK_SIZE - 1) / MEMORY_BLOCK_SIZE)
+
+// Chunks a synchronous request keeps in flight at once
+#define VIRTIO_BLK_SYNC_BATCH 8
+
+// Features the driver accepts
+#define VIRTIO_BLK_FEATURES ((1ULL << VIRTIO_BLK_F_SIZE_MAX) | (1ULL << VIRTIO_BLK_F_SEG_MAX) | \
+                             (1ULL << VIRTIO_BLK_F_RO) | (1ULL << VIRTIO_BLK_F_BLK_SIZE) | \
+                             (1ULL << VIRTIO_BLK_F_FLUSH) | (1ULL << VIRTIO_RING_F_INDIRECT_DESC) | \
+                             (1ULL << VIRTIO_RING_F_EVENT_IDX) | (1ULL << VIRTIO_F_VERSION_1))
+
+// State shared by the chunks of one synchronous request
+typedef struct {
+    unsigned int pending;
+    int error;
+} virtio_blk_sync_t;
+
+static virtio_blk_t* virtio_blk_devices[VIRTIO_BLK_MAX_DEVICES];
+static unsigned int virtio_blk_device_count = 0;
+
+// Keep the compiler from moving memory accesses across ring updates
+static inline void virtio_barrier() {
+    __asm__ __volatile__("" : : : "memory");
+}
+
+// Order ring stores before the loads that decide whether to notify
+static inline void virtio_full_barrier() {
+    __asm__ __volatile__("mfence" : : : "memory");
+}
+
+// Common configuration accessors
+static inline unsigned char virtio_read8(virtio_blk_t* vblk, unsigned int reg) {
+    return *(volatile unsigned char*) (vblk->common + reg);
+}
+
+static inline unsigned short virtio_read16(virtio_blk_t* vblk, unsigned int reg) {
+    return *(volatile unsigned short*) (vblk->common + reg);
+}
+
+static inline unsigned int virtio_read32(virtio_blk_t* vblk, unsigned int reg) {
+    return *(volatile unsigned int*) (vblk->common + reg);
+}
+
+static inline void virtio_write8(virtio_blk_t* vblk, unsigned int reg, unsigned char value) {
+    *(volatile unsigned char*) (vblk->common + reg) = value;
+}
+
+static inline void virtio_write16(virtio_blk_t* vblk, unsigned int reg, unsigned short value) {
+    *(volatile unsigned short*) (vblk->common + reg) = value;
+}
+
+static inline void virtio_write32(virtio_blk_t* vblk, unsigned int reg, unsigned int value) {
+    *(volatile unsigned int*) (vblk->common + reg) = value;
+}
+
+static inline void virtio_write64(virtio_blk_t* vblk, unsigned int reg, unsigned long long value) {
+    virtio_write32(vblk, reg, (unsigned int) value);
+    virtio_write32(vblk, reg + 4, (unsigned int) (value >> 32));
+}
+
+// Read a 32-bit device configuration field
+static inline unsigned int virtio_config32(virtio_blk_t* vblk, unsigned int offset) {
+    return *(volatile unsigned int*) (vblk->device_cfg + offset);
+}
+
+// Check whether a feature was negotiated
+static inline int virtio_has_feature(virtio_blk_t* vblk, unsigned int bit) {
+    return (vblk->features >> bit) & 1;
+}
+
+// Check whether the device wants a notification for the new avail entries
+// (event index: it asked to be told once avail_idx passes avail_event)
+static int virtio_need_notify(virtio_blk_t* vblk) {
+    if (virtio_has_feature(vblk, VIRTIO_RING_F_EVENT_IDX)) {
+        unsigned short event = *vblk->avail_event;
+        return (unsigned short) (vblk->avail_idx - event - 1) < (unsigned short) (vblk->avail_idx - vblk->kicked_idx);
+    }
+
+    return !(vblk->used->flags & VIRTQ_USED_F_NO_NOTIFY);
+}
+
+// Notify the device of avail entries published since the last notification
+static void virtio_blk_kick(virtio_blk_t* vblk) {
+    if (vblk->avail_idx == vblk->kicked_idx) {
+        return;
+    }
+
+    virtio_full_barrier();
+
+    if (virtio_need_notify(vblk)) {
+        *vblk->notify = 0;
+        vblk->notifications++;
+    } else {
+        vblk->suppressed++;
+    }
+
+    vblk->kicked_idx = vblk->avail_idx;
+}
+
+// Return a request's descriptors to the free list
+static void virtio_blk_free_chain(virtio_blk_t* vblk, unsigned short head) {
+    unsigned short last = head;
+
+    for (unsigned short i = 1; i < vblk->chain_length[head]; i++) {
+        last = vblk->desc[last].next;
+    }
+
+    vblk->desc[last].next = vblk->free_head;
+    vblk->free_head = head;
+    vblk->free_count += vblk->chain_length[head];
+}
+
+// Fail every outstanding request and mark the device broken
+static void virtio_blk_fail(virtio_blk_t* vblk) {
+    if (vblk->failed) {
+        return;
+    }
+
+    vblk->failed = 1;
+    KLOG(&virtio_log, KLOG_ERR, "device %u:%u.%u stopped responding\n", vblk->pci.bus, vblk->pci.device, vblk->pci.function);
+
+    virtio_write8(vblk, VIRTIO_COMMON_STATUS, virtio_read8(vblk, VIRTIO_COMMON_STATUS) | VIRTIO_STATUS_FAILED);
+
+    for (unsigned short head = 0; head < vblk->size; head++) {
+        storage_hw_request_t* request = vblk->requests[head];
+
+        if (!request) {
+            continue;
+        }
+
+        vblk->requests[head] = NULL;
+        vblk->outstanding--;
+
+        request->result = -1;
+        request->done(request);
+    }
+}
+
+// Process new used ring entries; returns the number processed
+static int virtio_blk_poll(virtio_blk_t* vblk) {
+    int processed = 0;
+
+    while (vblk->last_used != vblk->used->idx) {
+        virtio_barrier();
+
+        volatile virtq_used_elem_t* elem = &vblk->used->ring[vblk->last_used & (vblk->size - 1)];
+        unsigned int head = elem->id;
+
+        vblk->last_used++;
+
+        if (head >= vblk->size || !vblk->requests[head]) {
+            KLOG(&virtio_log, KLOG_WARNING, "completion for unknown descriptor %u\n", head);
+            continue;
+        }
+
+        storage_hw_request_t* request = vblk->requests[head];
+        unsigned char status = vblk->slots[head].status;
+
+        vblk->requests[head] = NULL;
+        vblk->outstanding--;
+        virtio_blk_free_chain(vblk, head);
+        processed++;
+
+        if (status != VIRTIO_BLK_S_OK) {
+            KLOG(&virtio_log, KLOG_ERR, "request at sector %u failed (status %u)\n", request->start_sector, status);
+            request->result = -1;
+        } else {
+            request->result = 0;
+        }
+
+        request->done(request);
+    }
+
+    if (processed > 0) {
+        // Keep the interrupt threshold out of reach while polling
+        if (virtio_has_feature(vblk, VIRTIO_RING_F_EVENT_IDX)) {
+            vblk->avail->ring[vblk->size] = vblk->last_used + 0x8000;
+        }
+
+        vblk->last_progress = ktime_get_ns();
+    } else if (vblk->outstanding > 0 && ktime_get_ns() - vblk->last_progress > VIRTIO_BLK_TIMEOUT_NS) {
+        virtio_blk_fail(vblk);
+    }
+
+    return processed;
+}
+
+// Take a chain of free descriptors; returns the head
+static unsigned short virtio_blk_alloc_chain(virtio_blk_t* vblk, unsigned short count) {
+    unsigned short head = vblk->free_head;
+    unsigned short last = head;
+
+    for (unsigned short i = 1; i < count; i++) {
+        last = vblk->desc[last].next;
+    }
+
+    vblk->free_head = vblk->desc[last].next;
+    vblk->free_count -= count;
+    vblk->chain_length[head] = count;
+
+    return head;
+}
+
+// Fill a request's descriptors: header, data segments, status
+static unsigned int virtio_blk_build(virtio_blk_t* vblk, virtio_blk_slot_t* slot, virtq_desc_t* table, storage_hw_request_t* request) {
+    unsigned int count = 0;
+
+    table[count].addr = (unsigned long long) &slot->header;
+    table[count].len = sizeof(virtio_blk_header_t);
+    table[count].flags = 0;
+    count++;
+
+    if (request->opcode != STORAGE_OP_FLUSH) {
+        unsigned long long address = (unsigned long long) request->buffer;
+        unsigned int bytes = request->sector_count * vblk->sector_size;
+        unsigned short flags = request->opcode == STORAGE_OP_READ ? VIRTQ_DESC_F_WRITE : 0;
+
+        while (bytes > 0) {
+            unsigned int length = bytes < vblk->segment_size ? bytes : vblk->segment_size;
+
+            table[count].addr = address;
+            table[count].len = length;
+            table[count].flags = flags;
+            count++;
+
+            address += length;
+            bytes -= length;
+        }
+    }
+
+    table[count].addr = (unsigned long long) &slot->status;
+    table[count].len = 1;
+    table[count].flags = VIRTQ_DESC_F_WRITE;
+    count++;
+
+    return count;
+}
+
+// Queue a request and publish it in the available ring (the caller kicks)
+static int virtio_blk_submit(virtio_blk_t* vblk, storage_hw_request_t* request) {
+    unsigned int segments = 0;
+
+    if (request->opcode != STORAGE_OP_FLUSH) {
+        unsigned int bytes = request->sector_count * vblk->sector_size;
+        segments = (bytes + vblk->segment_size - 1) / vblk->segment_size;
+    }
+
+    int indirect = virtio_has_feature(vblk, VIRTIO_RING_F_INDIRECT_DESC);
+    unsigned short needed = indirect ? 1 : segments + 2;
+
+    // Wait for descriptors, letting the device see what is queued first
+    while (vblk->free_count < needed && !vblk->failed) {
+        virtio_blk_kick(vblk);
+        virtio_blk_poll(vblk);
+    }
+
+    if (vblk->failed) {
+        return -1;
+    }
+
+    unsigned short head = virtio_blk_alloc_chain(vblk, needed);
+    virtio_blk_slot_t* slot = &vblk->slots[head];
+
+    if (request->opcode == STORAGE_OP_FLUSH) {
+        slot->header.type = VIRTIO_BLK_T_FLUSH;
+        slot->header.sector = 0;
+    } else {
+        slot->header.type = request->opcode == STORAGE_OP_WRITE ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+        slot->header.sector = (unsigned long long) request->start_sector * (vblk->sector_size / 512);
+    }
+
+    slot->header.reserved = 0;
+    slot->status = 0xFF;
+
+    if (indirect) {
+        unsigned int count = virtio_blk_build(vblk, slot, slot->table, request);
+
+        for (unsigned int i = 0; i + 1 < count; i++) {
+            slot->table[i].flags |= VIRTQ_DESC_F_NEXT;
+            slot->table[i].next = i + 1;
+        }
+
+        vblk->desc[head].addr = (unsigned long long) slot->table;
+        vblk->desc[head].len = count * sizeof(virtq_desc_t);
+        vblk->desc[head].flags = VIRTQ_DESC_F_INDIRECT;
+    } else {
+        // Build in the slot's table, then copy along the ring chain
+        unsigned int count = virtio_blk_build(vblk, slot, slot->table, request);
+        unsigned short index = head;
+
+        for (unsigned int i = 0; i < count; i++) {
+            unsigned short next = vblk->desc[index].next;
+
+            vblk->desc[index].addr = slot->table[i].addr;
+            vblk->desc[index].len = slot->table[i].len;
+            vblk->desc[index].flags = slot->table[i].flags | (i + 1 < count ? VIRTQ_DESC_F_NEXT : 0);
+
+            index = next;
+        }
+    }
+
+    if (vblk->outstanding == 0) {
+        vblk->last_progress = ktime_get_ns();
+    }
+
+    vblk->requests[head] = request;
+    vblk->outstanding++;
+
+    vblk->avail->ring[vblk->avail_idx & (vblk->size - 1)] = head;
+    virtio_barrier();
+    vblk->avail_idx++;
+    vblk->avail->idx = vblk->avail_idx;
+
+    return 0;
+}
+
+// Check a read or write against the capacity and transfer limit
+static int virtio_blk_check(virtio_blk_t* vblk, unsigned int start_sector, unsigned int sector_count) {
+    unsigned long long sectors = vblk->capacity / (vblk->sector_size / 512);
+
+    if (sector_count == 0 || (unsigned long long) start_sector + sector_count > sectors) {
+        return -1;
+    }
+
+    return (unsigned long long) sector_count * vblk->sector_size > vblk->max_transfer ? -1 : 0;
+}
+
+// Finish one chunk of a synchronous request
+static void virtio_blk_sync_done(storage_hw_request_t* request) {
+    virtio_blk_sync_t* sync = (virtio_blk_sync_t*) request->private_data;
+
+    if (request->result != 0) {
+        sync->error = 1;
+    }
+
+    sync->pending--;
+}
+
+// Run requests synchronously, splitting reads and writes at the transfer limit
+static int virtio_blk_rw(virtio_blk_t* vblk, unsigned int opcode, unsigned int start_sector, unsigned int sector_count, void* buffer) {
+    if (vblk->failed) {
+        return -1;
+    }
+
+    if (opcode != STORAGE_OP_FLUSH && (unsigned long long) start_sector + sector_count > vblk->capacity / (vblk->sector_size / 512)) {
+        return -1;
+    }
+
+    unsigned int chunk_sectors = vblk->max_transfer / vblk->sector_size;
+    unsigned char* data = (unsigned char*) buffer;
+    storage_hw_request_t requests[VIRTIO_BLK_SYNC_BATCH];
+    virtio_blk_sync_t sync;
+    int first = 1;
+
+    sync.error = 0;
+
+    while ((sector_count > 0 || first) && !sync.error) {
+        sync.pending = 0;
+
+        for (unsigned int i = 0; i < VIRTIO_BLK_SYNC_BATCH && (sector_count > 0 || first); i++) {
+            unsigned int count = sector_count < chunk_sectors ? sector_count : chunk_sectors;
+
+            requests[i].opcode = opcode;
+            requests[i].start_sector = start_sector;
+            requests[i].sector_count = count;
+            requests[i].buffer = data;
+            requests[i].result = 0;
+            requests[i].done = virtio_blk_sync_done;
+            requests[i].private_data = &sync;
+            first = 0;
+
+            if (virtio_blk_submit(vblk, &requests[i]) != 0) {
+                sync.error = 1;
+                break;
+            }
+
+            sync.pending++;
+            start_sector += count;
+            sector_count -= count;
+            data += count * vblk->sector_size;
+        }
+
+        virtio_blk_kick(vblk);
+
+        while (sync.pending > 0) {
+            virtio_blk_poll(vblk);
+        }
+    }
+
+    return sync.error ? -1 : 0;
+}
+
+// virtio-blk device read function
+static int virtio_blk_read_sectors(storage_device_t* dev, unsigned int start_sector, unsigned int sector_count, void* buffer) {
+    if (sector_count == 0) {
+        return 0;
+    }
+
+    return virtio_blk_rw((virtio_blk_t*) dev->private_data, STORAGE_OP_READ, start_sector, sector_count, buffer);
+}
+
+// virtio-blk device write function
+static int virtio_blk_write_sectors(storage_device_t* dev, unsigned int start_sector, unsigned int sector_count, const void* buffer) {
+    if (sector_count == 0) {
+        return 0;
+    }
+
+    return virtio_blk_rw((virtio_blk_t*) dev->private_data, STORAGE_OP_WRITE, start_sector, sector_count, (void*) buffer);
+}
+
+// virtio-blk device flush function
+static int virtio_blk_flush(storage_device_t* dev) {
+    virtio_blk_t* vblk = (virtio_blk_t*) dev->private_data;
+
+    // Without a volatile write cache there is nothing to flush
+    if (!virtio_has_feature(vblk, VIRTIO_BLK_F_FLUSH)) {
+        return 0;
+    }
+
+    return virtio_blk_rw(vblk, STORAGE_OP_FLUSH, 0, 0, NULL);
+}
+
+// Start a queued request
+static int virtio_blk_submit_request(storage_device_t* dev, storage_hw_request_t* request) {
+    virtio_blk_t* vblk = (virtio_blk_t*) dev->private_data;
+
+    if (vblk->failed) {
+        return -1;
+    }
+
+    if (request->opcode == STORAGE_OP_FLUSH) {
+        if (!virtio_has_feature(vblk, VIRTIO_BLK_F_FLUSH)) {
+            return -1;
+        }
+    } else if (virtio_blk_check(vblk, request->start_sector, request->sector_count) != 0) {
+        // Oversized requests go through the synchronous path, which splits them
+        return -1;
+    }
+
+    return virtio_blk_submit(vblk, request);
+}
+
+// Notify the device of the requests queued so far
+static void virtio_blk_commit_requests(storage_device_t* dev) {
+    virtio_blk_kick((virtio_blk_t*) dev->private_data);
+}
+
+// Process completed requests
+static int virtio_blk_poll_completions(storage_device_t* dev) {
+    return virtio_blk_poll((virtio_blk_t*) dev->private_data);
+}
+
+// Locate the common, notify and device configuration structures
+static int virtio_blk_find_config(virtio_blk_t* vblk) {
+    unsigned int notify_multiplier = 0;
+    volatile unsigned char* notify_base = NULL;
+
+    for (unsigned int cap = pci_find_capability(&vblk->pci, PCI_CAP_VENDOR, 0); cap;
+         cap = pci_find_capability(&vblk->pci, PCI_CAP_VENDOR, cap)) {
+        unsigned char type = pci_read_config8(&vblk->pci, cap + 3);
+        unsigned char bar = pci_read_config8(&vblk->pci, cap + 4);
+        unsigned int offset = pci_read_config(&vblk->pci, cap + 8);
+
+        if (bar > 5) {
+            continue;
+        }
+
+        int is_io = 0;
+        unsigned long long base = pci_get_bar(&vblk->pci, bar, &is_io);
+
+        if (is_io || base == 0) {
+            continue;
+        }
+
+        volatile unsigned char* address = (volatile unsigned char*) (base + offset);
+
+        if (type == VIRTIO_PCI_CAP_COMMON_CFG && !vblk->common) {
+            vblk->common = address;
+        } else if (type == VIRTIO_PCI_CAP_NOTIFY_CFG && !notify_base) {
+            notify_base = address;
+            notify_multiplier = pci_read_config(&vblk->pci, cap + 16);
+        } else if (type == VIRTIO_PCI_CAP_DEVICE_CFG && !vblk->device_cfg) {
+            vblk->device_cfg = address;
+        }
+    }
+
+    if (!vblk->common || !notify_base || !vblk->device_cfg) {
+        return -1;
+    }
+
+    // The queue's notify offset is read once the queue is selected
+    vblk->notify = (volatile unsigned short*) notify_base;
+    vblk->notify_multiplier = notify_multiplier;
+
+    return 0;
+}
+
+// Negotiate features and read the device geometry
+static int virtio_blk_configure(virtio_blk_t* vblk) {
+    // Reset, then announce the driver
+    virtio_write8(vblk, VIRTIO_COMMON_STATUS, 0);
+
+    while (virtio_read8(vblk, VIRTIO_COMMON_STATUS) != 0) {
+    }
+
+    virtio_write8(vblk, VIRTIO_COMMON_STATUS, VIRTIO_STATUS_ACKNOWLEDGE);
+    virtio_write8(vblk, VIRTIO_COMMON_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+
+    virtio_write32(vblk, VIRTIO_COMMON_DFSELECT, 0);
+    unsigned long long features = virtio_read32(vblk, VIRTIO_COMMON_DF);
+    virtio_write32(vblk, VIRTIO_COMMON_DFSELECT, 1);
+    features |= (unsigned long long) virtio_read32(vblk, VIRTIO_COMMON_DF) << 32;
+
+    if (!((features >> VIRTIO_F_VERSION_1) & 1)) {
+        terminal_write("Error: virtio-blk device does not support virtio 1.0\n");
+        return -1;
+    }
+
+    vblk->features = features & VIRTIO_BLK_FEATURES;
+
+    virtio_write32(vblk, VIRTIO_COMMON_GFSELECT, 0);
+    virtio_write32(vblk, VIRTIO_COMMON_GF, (unsigned int) vblk->features);
+    virtio_write32(vblk, VIRTIO_COMMON_GFSELECT, 1);
+    virtio_write32(vblk, VIRTIO_COMMON_GF, (unsigned int) (vblk->features >> 32));
+
+    virtio_write8(vblk, VIRTIO_COMMON_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_FEATURES_OK);
+
+    if (!(virtio_read8(vblk, VIRTIO_COMMON_STATUS) & VIRTIO_STATUS_FEATURES_OK)) {
+        terminal_write("Error: virtio-blk device rejected the driver's features\n");
+        return -1;
+    }
+
+    vblk->capacity = virtio_config32(vblk, 0) | ((unsigned long long) virtio_config32(vblk, 4) << 32);
+    vblk->sector_size = 512;
+
+    if (virtio_has_feature(vblk, VIRTIO_BLK_F_BLK_SIZE)) {
+        unsigned int block_size = virtio_config32(vblk, 20);
+
+        if (block_size >= 512 && block_size <= 4096 && (block_size & (block_size - 1)) == 0) {
+            vblk->sector_size = block_size;
+        }
+    }
+
+    // Data descriptors are limited by size_max, requests by seg_max
+    vblk->segment_size = STORAGE_MAX_REQUEST_BYTES;
+
+    if (virtio_has_feature(vblk, VIRTIO_BLK_F_SIZE_MAX)) {
+        unsigned int size_max = virtio_config32(vblk, 8);
+
+        if (size_max >= vblk->sector_size && size_max < vblk->segment_size) {
+            vblk->segment_size = size_max & ~(vblk->sector_size - 1);
+        }
+    }
+
+    unsigned int segments = VIRTIO_BLK_MAX_SEGMENTS;
+
+    if (virtio_has_feature(vblk, VIRTIO_BLK_F_SEG_MAX)) {
+        unsigned int seg_max = virtio_config32(vblk, 12);
+
+        if (seg_max > 0 && seg_max < segments) {
+            segments = seg_max;
+        }
+    }
+
+    unsigned long long max_transfer = (unsigned long long) vblk->segment_size * segments;
+    vblk->max_transfer = max_transfer < STORAGE_MAX_REQUEST_BYTES ? (unsigned int) max_transfer : STORAGE_MAX_REQUEST_BYTES;
+    vblk->max_transfer &= ~(vblk->sector_size - 1);
+
+    // The block layer addresses sectors with 32 bits
+    unsigned long long limit = 0xFFFFFFFFull * (vblk->sector_size / 512);
+
+    if (vblk->capacity > limit) {
+        vblk->capacity = limit;
+    }
+
+    return vblk->capacity >= vblk->sector_size / 512 && vblk->max_transfer >= vblk->sector_size ? 0 : -1;
+}
+
+// Set up the request queue and tell the device the driver is ready
+static int virtio_blk_setup_queue(virtio_blk_t* vblk) {
+    virtio_write16(vblk, VIRTIO_COMMON_Q_SELECT, 0);
+
+    unsigned short size = virtio_read16(vblk, VIRTIO_COMMON_Q_SIZE);
+
+    if (size == 0) {
+        terminal_write("Error: virtio-blk request queue is not available\n");
+        return -1;
+    }
+
+    // Split queues are a power of two in size
+    unsigned short queue_size = VIRTIO_BLK_QUEUE_MAX;
+
+    while (queue_size > size) {
+        queue_size >>= 1;
+    }
+
+    unsigned char* queue_memory = (unsigned char*) allocate_blocks(VIRTIO_BLK_QUEUE_BLOCKS);
+    vblk->slots = (virtio_blk_slot_t*) allocate_blocks(VIRTIO_BLK_SLOT_BLOCKS);
+
+    if (!queue_memory || !vblk->slots) {
+        terminal_write("Error: Failed to allocate memory for virtio-blk queue\n");
+
+        if (queue_memory) {
+            free_blocks(queue_memory, VIRTIO_BLK_QUEUE_BLOCKS);
+        }
+
+        if (vblk->slots) {
+            free_blocks(vblk->slots, VIRTIO_BLK_SLOT_BLOCKS);
+            vblk->slots = NULL;
+        }
+
+        return -1;
+    }
+
+    memset(queue_memory, 0, VIRTIO_BLK_QUEUE_BLOCKS * MEMORY_BLOCK_SIZE);
+
+    vblk->desc = (virtq_desc_t*) queue_memory;
+    vblk->avail = (volatile virtq_avail_t*) (queue_memory + VIRTIO_BLK_QUEUE_MAX * sizeof(virtq_desc_t));
+    vblk->used = (volatile virtq_used_t*) (queue_memory + MEMORY_BLOCK_SIZE);
+    vblk->size = queue_size;
+    vblk->avail_event = (volatile unsigned short*) (queue_memory + MEMORY_BLOCK_SIZE + sizeof(virtq_used_t) + queue_size * sizeof(virtq_used_elem_t));
+
+    for (unsigned short i = 0; i < queue_size; i++) {
+        vblk->desc[i].next = i + 1;
+    }
+
+    vblk->free_head = 0;
+    vblk->free_count = queue_size;
+
+    // Completions are polled, so ask the device not to interrupt
+    if (virtio_has_feature(vblk, VIRTIO_RING_F_EVENT_IDX)) {
+        vblk->avail->ring[queue_size] = 0x8000;
+    } else {
+        vblk->avail->flags = VIRTQ_AVAIL_F_NO_INTERRUPT;
+    }
+
+    virtio_write16(vblk, VIRTIO_COMMON_Q_SIZE, queue_size);
+    virtio_write16(vblk, VIRTIO_COMMON_Q_MSIX, VIRTIO_MSI_NO_VECTOR);
+    virtio_write64(vblk, VIRTIO_COMMON_Q_DESC, (unsigned long long) vblk->desc);
+    virtio_write64(vblk, VIRTIO_COMMON_Q_AVAIL, (unsigned long long) vblk->avail);
+    virtio_write64(vblk, VIRTIO_COMMON_Q_USED, (unsigned long long) vblk->used);
+
+    unsigned short notify_offset = virtio_read16(vblk, VIRTIO_COMMON_Q_NOFF);
+    vblk->notify = (volatile unsigned short*) ((volatile unsigned char*) vblk->notify + notify_offset * vblk->notify_multiplier);
+
+    virtio_write16(vblk, VIRTIO_COMMON_Q_ENABLE, 1);
+    virtio_write8(vblk, VIRTIO_COMMON_STATUS, virtio_read8(vblk, VIRTIO_COMMON_STATUS) | VIRTIO_STATUS_DRIVER_OK);
+
+    return 0;
+}
+
+// Bring up a virtio-blk device and register it
+static int virtio_blk_probe(const pci_device_t* pci) {
+    virtio_blk_t* vblk = (virtio_blk_t*) allocate_blocks(VIRTIO_BLK_DEVICE_BLOCKS);
+
+    if (!vblk) {
+        terminal_write("Error: Failed to allocate memory for virtio-blk device\n");
+        return -1;
+    }
+
+    memset(vblk, 0, sizeof(virtio_blk_t));
+    vblk->pci = *pci;
+
+    pci_enable(pci, PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER | PCI_COMMAND_INTX_DISABLE);
+
+    if (virtio_blk_find_config(vblk) != 0) {
+        terminal_write("Error: virtio-blk device has no virtio 1.0 configuration\n");
+        free_blocks(vblk, VIRTIO_BLK_DEVICE_BLOCKS);
+        return -1;
+    }
+
+    if (virtio_blk_configure(vblk) != 0 || virtio_blk_setup_queue(vblk) != 0) {
+        virtio_write8(vblk, VIRTIO_COMMON_STATUS, VIRTIO_STATUS_FAILED);
+        free_blocks(vblk, VIRTIO_BLK_DEVICE_BLOCKS);
+        return -1;
+    }
+
+    storage_device_t device;
+    memset(&device, 0, sizeof(storage_device_t));
+
+    strcpy(device.name, "vda");
+    device.name[2] = 'a' + virtio_blk_device_count;
+    device.type = STORAGE_TYPE_SSD;
+    device.size = vblk->capacity * 512;
+    device.sector_size = vblk->sector_size;
+    device.read_only = virtio_has_feature(vblk, VIRTIO_BLK_F_RO);
+    device.removable = 0;
+    device.read_sectors = virtio_blk_read_sectors;
+    device.write_sectors = virtio_blk_write_sectors;
+    device.flush = virtio_blk_flush;
+    device.submit_request = virtio_blk_submit_request;
+    device.commit_requests = virtio_blk_commit_requests;
+    device.poll_completions = virtio_blk_poll_completions;
+    device.private_data = vblk;
+
+    if (storage_register_device(&device) != 0) {
+        // Reset the device so it lets go of the queue memory
+        virtio_write8(vblk, VIRTIO_COMMON_STATUS, 0);
+        free_blocks(vblk->desc, VIRTIO_BLK_QUEUE_BLOCKS);
+        free_blocks(vblk->slots, VIRTIO_BLK_SLOT_BLOCKS);
+        free_blocks(vblk, VIRTIO_BLK_DEVICE_BLOCKS);
+        return -1;
+    }
+
+    KLOG(&virtio_log, KLOG_INFO, "%u:%u.%u: %u-entry queue%s, %u-byte sectors, %u KB max transfer\n",
+         pci->bus, pci->device, pci->function, vblk->size,
+         virtio_has_feature(vblk, VIRTIO_RING_F_INDIRECT_DESC) ? " (indirect)" : "",
+         vblk->sector_size, vblk->max_transfer / 1024);
+
+    virtio_blk_devices[virtio_blk_device_count++] = vblk;
+    return 0;
+}
+
+// Find and initialize virtio-blk devices; returns the number registered
+int virtio_blk_init() {
+    pci_device_t devices[VIRTIO_BLK_MAX_DEVICES];
+    unsigned short ids[2] = { VIRTIO_PCI_BLK_TRANSITIONAL, VIRTIO_PCI_BLK_MODERN };
+
+    for (int i = 0; i < 2; i++) {
+        int found = pci_find_device(VIRTIO_PCI_VENDOR, ids[i], devices, VIRTIO_BLK_MAX_DEVICES);
+
+        for (int j = 0; j < found && virtio_blk_device_count < VIRTIO_BLK_MAX_DEVICES; j++) {
+            virtio_blk_probe(&devices[j]);
+        }
+    }
+
+    return virtio_blk_device_count;
+}
+
+// Get the number of initialized devices
+unsigned int virtio_blk_get_device_count() {
+    return virtio_blk_device_count;
+}
+
+// Get an initialized device
+virtio_blk_t* virtio_blk_get_device(unsigned int index) {
+    return index < virtio_blk_device_count ? virtio_blk_devices[index] : NULL;
+}
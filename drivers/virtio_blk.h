@@ -0,0 +1,174 @@
+/**
+ * LightOS Drivers
+ * virtio-blk driver header
+ */
+
+#ifndef VIRTIO_BLK_H
+#define VIRTIO_BLK_H
+
+#include "pci.h"
+#include "storage.h"
+
+// PCI IDs (transitional and modern block devices)
+#define VIRTIO_PCI_VENDOR           0x1AF4
+#define VIRTIO_PCI_BLK_TRANSITIONAL 0x1001
+#define VIRTIO_PCI_BLK_MODERN       0x1042
+
+// Vendor capability types
+#define VIRTIO_PCI_CAP_COMMON_CFG 1
+#define VIRTIO_PCI_CAP_NOTIFY_CFG 2
+#define VIRTIO_PCI_CAP_ISR_CFG    3
+#define VIRTIO_PCI_CAP_DEVICE_CFG 4
+
+// Common configuration registers
+#define VIRTIO_COMMON_DFSELECT    0x00
+#define VIRTIO_COMMON_DF          0x04
+#define VIRTIO_COMMON_GFSELECT    0x08
+#define VIRTIO_COMMON_GF          0x0C
+#define VIRTIO_COMMON_MSIX        0x10
+#define VIRTIO_COMMON_NUMQ        0x12
+#define VIRTIO_COMMON_STATUS      0x14
+#define VIRTIO_COMMON_CFGGEN      0x15
+#define VIRTIO_COMMON_Q_SELECT    0x16
+#define VIRTIO_COMMON_Q_SIZE      0x18
+#define VIRTIO_COMMON_Q_MSIX      0x1A
+#define VIRTIO_COMMON_Q_ENABLE    0x1C
+#define VIRTIO_COMMON_Q_NOFF      0x1E
+#define VIRTIO_COMMON_Q_DESC      0x20
+#define VIRTIO_COMMON_Q_AVAIL     0x28
+#define VIRTIO_COMMON_Q_USED      0x30
+
+// Device status bits
+#define VIRTIO_STATUS_ACKNOWLEDGE 0x01
+#define VIRTIO_STATUS_DRIVER      0x02
+#define VIRTIO_STATUS_DRIVER_OK   0x04
+#define VIRTIO_STATUS_FEATURES_OK 0x08
+#define VIRTIO_STATUS_FAILED      0x80
+
+// No MSI-X vector
+#define VIRTIO_MSI_NO_VECTOR 0xFFFF
+
+// Feature bits
+#define VIRTIO_BLK_F_SIZE_MAX      1
+#define VIRTIO_BLK_F_SEG_MAX       2
+#define VIRTIO_BLK_F_RO            5
+#define VIRTIO_BLK_F_BLK_SIZE      6
+#define VIRTIO_BLK_F_FLUSH         9
+#define VIRTIO_RING_F_INDIRECT_DESC 28
+#define VIRTIO_RING_F_EVENT_IDX    29
+#define VIRTIO_F_VERSION_1         32
+
+// Request types and status
+#define VIRTIO_BLK_T_IN    0
+#define VIRTIO_BLK_T_OUT   1
+#define VIRTIO_BLK_T_FLUSH 4
+#define VIRTIO_BLK_S_OK    0
+
+// Descriptor flags
+#define VIRTQ_DESC_F_NEXT     1
+#define VIRTQ_DESC_F_WRITE    2
+#define VIRTQ_DESC_F_INDIRECT 4
+
+// Ring flags
+#define VIRTQ_AVAIL_F_NO_INTERRUPT 1
+#define VIRTQ_USED_F_NO_NOTIFY     1
+
+// Largest queue used (entries, a power of two)
+#define VIRTIO_BLK_QUEUE_MAX 128
+
+// Data descriptors per request (each at most the device's size_max)
+#define VIRTIO_BLK_MAX_SEGMENTS 32
+
+// Maximum number of devices
+#define VIRTIO_BLK_MAX_DEVICES 4
+
+// Time a queue may go without completing anything while requests are outstanding
+#define VIRTIO_BLK_TIMEOUT_NS 30000000000ULL
+
+// Virtqueue descriptor
+typedef struct {
+    unsigned long long addr;
+    unsigned int len;
+    unsigned short flags;
+    unsigned short next;
+} virtq_desc_t;
+
+// Available ring (used_event follows the ring)
+typedef struct {
+    unsigned short flags;
+    unsigned short idx;
+    unsigned short ring[];
+} virtq_avail_t;
+
+// Used ring element
+typedef struct {
+    unsigned int id;
+    unsigned int len;
+} virtq_used_elem_t;
+
+// Used ring (avail_event follows the ring)
+typedef struct {
+    unsigned short flags;
+    unsigned short idx;
+    virtq_used_elem_t ring[];
+} virtq_used_t;
+
+// Request header
+typedef struct {
+    unsigned int type;
+    unsigned int reserved;
+    unsigned long long sector;          // Always in 512-byte units
+} virtio_blk_header_t;
+
+// Per-request memory: header, status byte and indirect descriptor table
+typedef struct {
+    virtio_blk_header_t header;
+    unsigned char status;
+    unsigned char reserved[15];
+    virtq_desc_t table[VIRTIO_BLK_MAX_SEGMENTS + 2];
+} virtio_blk_slot_t;
+
+// Device state
+//
+// Requests are identified by their head descriptor, which also selects the
+// request's slot.
+typedef struct {
+    pci_device_t pci;
+    volatile unsigned char* common;
+    volatile unsigned char* device_cfg;
+    volatile unsigned short* notify;
+    unsigned long long features;
+    unsigned long long capacity;        // In 512-byte sectors
+    unsigned int sector_size;
+    unsigned int segment_size;          // Largest data descriptor
+    unsigned int max_transfer;          // Bytes per request
+
+    // Split virtqueue
+    virtq_desc_t* desc;
+    volatile virtq_avail_t* avail;
+    volatile virtq_used_t* used;
+    volatile unsigned short* avail_event;   // Follows the used ring
+    unsigned short size;
+    unsigned short free_head;
+    unsigned short free_count;
+    unsigned short avail_idx;           // Next avail index to publish
+    unsigned short kicked_idx;          // Avail index at the last notification
+    unsigned short last_used;
+    unsigned int notify_multiplier;     // Bytes between queue notify addresses
+
+    virtio_blk_slot_t* slots;
+    storage_hw_request_t* requests[VIRTIO_BLK_QUEUE_MAX];
+    unsigned short chain_length[VIRTIO_BLK_QUEUE_MAX];
+    unsigned int outstanding;
+    unsigned long long last_progress;
+    unsigned long long notifications;
+    unsigned long long suppressed;      // Kicks skipped because the device was busy
+    int failed;
+} virtio_blk_t;
+
+// virtio-blk driver functions
+int virtio_blk_init();
+unsigned int virtio_blk_get_device_count();
+virtio_blk_t* virtio_blk_get_device(unsigned int index);
+
+#endif /* VIRTIO_BLK_H */
@@ -7,6 +7,7 @@
 #include "../kernel/kernel.h"
 #include "../kernel/memory.h"
 #include "../libc/string.h"
+#include "../libc/hashmap.h"
 #include "protocols/mqtt_support.h"
 #include "protocols/coap_support.h"
 #include "protocols/zigbee_support.h"
@@ -14,10 +15,17 @@
 // Maximum number of IoT devices
 #define MAX_IOT_DEVICES 100
 
+// Name lookup table size
+#define IOT_MAP_CAPACITY 128
+
 // IoT device array
 static iot_device_t* iot_devices[MAX_IOT_DEVICES];
 static unsigned int iot_device_count = 0;
 
+// IoT device name index
+static hashmap_entry_t iot_map_entries[IOT_MAP_CAPACITY];
+static hashmap_t iot_map;
+
 // Initialize the IoT manager
 void iot_manager_init() {
     terminal_write("Initializing IoT manager...\n");
@@ -28,6 +36,7 @@ void iot_manager_init() {
     }
     
     iot_device_count = 0;
+    hashmap_init(&iot_map, iot_map_entries, IOT_MAP_CAPACITY);
     
     // Initialize IoT protocols
     mqtt_init();
@@ -45,13 +54,11 @@ int iot_add_device(const char* name, iot_device_type_t type, iot_protocol_t prot
     }
     
     // Check if a device with the same name already exists
-    for (unsigned int i = 0; i < iot_device_count; i++) {
-        if (strcmp(iot_devices[i]->name, name) == 0) {
-            terminal_write("Error: Device with name '");
-            terminal_write(name);
-            terminal_write("' already exists\n");
-            return -1;
-        }
+    if (hashmap_get(&iot_map, name)) {
+        terminal_write("Error: Device with name '");
+        terminal_write(name);
+        terminal_write("' already exists\n");
+        return -1;
     }
     
     // Check if we have room for another device
@@ -90,8 +97,9 @@ int iot_add_device(const char* name, iot_device_type_t type, iot_protocol_t prot
     device->topic_count = 0;
     device->private_data = NULL;
     
-    // Add the device to the array
+    // Add the device to the array and the name index
     iot_devices[iot_device_count++] = device;
+    hashmap_insert(&iot_map, device->name, device);
     
     terminal_write("Added IoT device '");
     terminal_write(name);
@@ -135,7 +143,8 @@ int iot_remove_device(const char* name) {
         free_blocks(device->topics, (device->topic_count * sizeof(char*) + MEMORY_BLOCK_SIZE - 1) / MEMORY_BLOCK_SIZE);
     }
     
-    // Remove the device from the array
+    // Remove the device from the name index and the array
+    hashmap_remove(&iot_map, device->name);
     free_block(device);
     
     for (unsigned int i = index; i < iot_device_count - 1; i++) {
@@ -266,13 +275,7 @@ iot_device_t* iot_get_device(const char* name) {
         return NULL;
     }
     
-    for (unsigned int i = 0; i < iot_device_count; i++) {
-        if (strcmp(iot_devices[i]->name, name) == 0) {
-            return iot_devices[i];
-        }
-    }
-    
-    return NULL;
+    return (iot_device_t*)hashmap_get(&iot_map, name);
 }
 
 // Get the connection state of an IoT device
@@ -0,0 +1,121 @@
+/**
+ * LightOS Kernel
+ * Per-CPU index implementation
+ *
+ * Each CPU is given a dense index (0, 1, ...) once, when it comes up, and
+ * the index is stored in its IA32_TSC_AUX register. Reading it back is a
+ * single RDPID or RDTSCP, neither of which leaves a virtual machine, so
+ * drivers can pick per-CPU resources on every request without CPUID or a
+ * table search.
+ */
+
+#include "cpu.h"
+#include "klog.h"
+
+KLOG_SUBSYSTEM(cpu_log, "cpu");
+
+// How cpu_index() reads the index (chosen by the first cpu_init call)
+static cpu_index_source_t cpu_index_source = CPU_INDEX_NONE;
+
+// Index given to the next CPU to call cpu_init
+static unsigned int cpu_next_index = 0;
+
+// Index of every CPU when there is no per-CPU register to keep it in
+static unsigned int cpu_shared_index = 0;
+
+// Execute CPUID
+static inline void cpu_cpuid(unsigned int leaf, unsigned int* a, unsigned int* b, unsigned int* c, unsigned int* d) {
+    __asm__ __volatile__("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "a"(leaf), "c"(0));
+}
+
+// Find the fastest instruction that reads IA32_TSC_AUX
+static cpu_index_source_t cpu_detect_source() {
+    unsigned int a, b, c, d;
+
+    cpu_cpuid(0, &a, &b, &c, &d);
+
+    if (a >= 7) {
+        cpu_cpuid(7, &a, &b, &c, &d);
+
+        if ((c >> 22) & 1) {
+            return CPU_INDEX_RDPID;
+        }
+    }
+
+    cpu_cpuid(0x80000000, &a, &b, &c, &d);
+
+    if (a >= 0x80000001) {
+        cpu_cpuid(0x80000001, &a, &b, &c, &d);
+
+        if ((d >> 27) & 1) {
+            return CPU_INDEX_RDTSCP;
+        }
+    }
+
+    return CPU_INDEX_NONE;
+}
+
+// Give the calling CPU the next index; run once on each CPU as it comes up
+void cpu_init() {
+    if (cpu_next_index == 0) {
+        cpu_index_source = cpu_detect_source();
+    }
+
+    unsigned int index = __atomic_fetch_add(&cpu_next_index, 1, __ATOMIC_RELAXED);
+
+    if (index >= CPU_MAX_CPUS) {
+        KLOG(&cpu_log, KLOG_WARNING, "more than %u CPUs; sharing the last index\n", CPU_MAX_CPUS);
+        index = CPU_MAX_CPUS - 1;
+    }
+
+    cpu_set_index(index);
+}
+
+// Store the calling CPU's index
+void cpu_set_index(unsigned int index) {
+    if (cpu_index_source == CPU_INDEX_NONE) {
+        cpu_shared_index = index;
+        return;
+    }
+
+    __asm__ __volatile__("wrmsr" : : "c"(CPU_MSR_TSC_AUX), "a"(index), "d"(0));
+}
+
+// Get the calling CPU's index
+unsigned int cpu_index() {
+    unsigned long long value;
+    unsigned int low, high, aux;
+
+    switch (cpu_index_source) {
+        case CPU_INDEX_RDPID:
+            __asm__ __volatile__("rdpid %0" : "=r"(value));
+            return (unsigned int) value;
+
+        case CPU_INDEX_RDTSCP:
+            __asm__ __volatile__("rdtscp" : "=a"(low), "=d"(high), "=c"(aux));
+            (void) low;
+            (void) high;
+            return aux;
+
+        default:
+            return cpu_shared_index;
+    }
+}
+
+// Get an upper bound on the number of logical CPUs in the package
+//
+// CPUID reports how many APIC IDs the package reserves, which can be more
+// than the CPUs that are actually present.
+unsigned int cpu_count_limit() {
+    unsigned int a, b, c, d;
+
+    cpu_cpuid(1, &a, &b, &c, &d);
+
+    // The field is only valid when hyper-threading/multi-core is reported
+    if (!(d & (1 << 28))) {
+        return 1;
+    }
+
+    unsigned int count = (b >> 16) & 0xFF;
+    return count ? count : 1;
+}
@@ -0,0 +1,28 @@
+/**
+ * LightOS Kernel
+ * Per-CPU index header
+ */
+
+#ifndef CPU_H
+#define CPU_H
+
+// CPUs that can be given an index (indices are always below this)
+#define CPU_MAX_CPUS 256
+
+// IA32_TSC_AUX, which holds the index for RDPID and RDTSCP to read
+#define CPU_MSR_TSC_AUX 0xC0000103
+
+// Instruction that reads the current CPU's index
+typedef enum {
+    CPU_INDEX_NONE,                     // Neither: one index for all CPUs
+    CPU_INDEX_RDTSCP,
+    CPU_INDEX_RDPID
+} cpu_index_source_t;
+
+// Per-CPU index functions
+void cpu_init();
+void cpu_set_index(unsigned int index);
+unsigned int cpu_index();
+unsigned int cpu_count_limit();
+
+#endif /* CPU_H */
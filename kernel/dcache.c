@@ -0,0 +1,333 @@
+/**
+ * LightOS Kernel
+ * Directory entry cache implementation
+ *
+ * Entries live in a fixed pool, are chained into hash buckets keyed by
+ * (parent, name) and kept on an LRU list; when the pool is exhausted the
+ * least recently used entry is recycled.
+ */
+
+#include "dcache.h"
+#include "../libc/string.h"
+#include "../libc/hashmap.h"
+
+#define DCACHE_BUCKET_MASK (DCACHE_BUCKETS - 1)
+
+// Entry pool
+static dentry_t dcache_entries[DCACHE_SIZE];
+
+// Hash buckets
+static dentry_t* dcache_buckets[DCACHE_BUCKETS];
+
+// LRU list (head is most recently used) and free list
+static dentry_t* dcache_lru_head = NULL;
+static dentry_t* dcache_lru_tail = NULL;
+static dentry_t* dcache_free_list = NULL;
+
+// Bumped whenever an entry is invalidated; whole-path entries from an
+// older generation are stale
+static unsigned int dcache_generation = 1;
+
+// Statistics
+static dcache_stats_t dcache_stats;
+
+// Hash a (parent, name) pair (the library's name hash, mixed with the parent)
+static unsigned int dcache_hash(fs_node_t* parent, const char* name, unsigned int length) {
+    unsigned long long address = (unsigned long long) parent;
+    return hashmap_hash_bytes(name, length) ^ (unsigned int) (address >> 4) * 0x9E3779B1u;
+}
+
+// Remove an entry from the LRU list
+static void dcache_lru_unlink(dentry_t* entry) {
+    if (entry->lru_prev) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        dcache_lru_head = entry->lru_next;
+    }
+
+    if (entry->lru_next) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        dcache_lru_tail = entry->lru_prev;
+    }
+
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+}
+
+// Add an entry at the head of the LRU list
+static void dcache_lru_push(dentry_t* entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = dcache_lru_head;
+
+    if (dcache_lru_head) {
+        dcache_lru_head->lru_prev = entry;
+    } else {
+        dcache_lru_tail = entry;
+    }
+
+    dcache_lru_head = entry;
+}
+
+// Remove an entry from its hash chain
+static void dcache_hash_unlink(dentry_t* entry) {
+    dentry_t** link = &dcache_buckets[entry->hash & DCACHE_BUCKET_MASK];
+
+    while (*link) {
+        if (*link == entry) {
+            *link = entry->hash_next;
+            break;
+        }
+
+        link = &(*link)->hash_next;
+    }
+
+    entry->hash_next = NULL;
+}
+
+// Drop an entry and return it to the free list
+static void dcache_release(dentry_t* entry) {
+    dcache_hash_unlink(entry);
+    dcache_lru_unlink(entry);
+
+    entry->parent = NULL;
+    entry->node = NULL;
+    entry->hash_next = dcache_free_list;
+    dcache_free_list = entry;
+    dcache_stats.entries--;
+}
+
+// Find an entry
+static dentry_t* dcache_find(fs_node_t* parent, const char* name, unsigned int length, unsigned int hash) {
+    for (dentry_t* entry = dcache_buckets[hash & DCACHE_BUCKET_MASK]; entry; entry = entry->hash_next) {
+        if (entry->hash == hash && entry->parent == parent &&
+            memcmp(entry->name, name, length) == 0 && entry->name[length] == '\0') {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+// Get an unused entry, evicting the least recently used one if needed
+static dentry_t* dcache_alloc() {
+    dentry_t* entry = dcache_free_list;
+
+    if (entry) {
+        dcache_free_list = entry->hash_next;
+        entry->hash_next = NULL;
+        dcache_stats.entries++;
+        return entry;
+    }
+
+    entry = dcache_lru_tail;
+
+    if (!entry) {
+        return NULL;
+    }
+
+    dcache_hash_unlink(entry);
+    dcache_lru_unlink(entry);
+    dcache_stats.evictions++;
+
+    return entry;
+}
+
+// Add or update an entry
+static void dcache_store(fs_node_t* parent, const char* name, unsigned int length, fs_node_t* node, unsigned int generation) {
+    if (!parent || !name || length == 0 || length >= DCACHE_NAME_LEN) {
+        return;
+    }
+
+    unsigned int hash = dcache_hash(parent, name, length);
+    dentry_t* entry = dcache_find(parent, name, length, hash);
+
+    if (entry) {
+        entry->node = node;
+        entry->generation = generation;
+        dcache_lru_unlink(entry);
+        dcache_lru_push(entry);
+        return;
+    }
+
+    entry = dcache_alloc();
+
+    if (!entry) {
+        return;
+    }
+
+    entry->parent = parent;
+    entry->node = node;
+    entry->hash = hash;
+    entry->generation = generation;
+    memcpy(entry->name, name, length);
+    entry->name[length] = '\0';
+
+    entry->hash_next = dcache_buckets[hash & DCACHE_BUCKET_MASK];
+    dcache_buckets[hash & DCACHE_BUCKET_MASK] = entry;
+    dcache_lru_push(entry);
+}
+
+// Initialize the directory entry cache
+void dcache_init() {
+    for (int i = 0; i < DCACHE_BUCKETS; i++) {
+        dcache_buckets[i] = NULL;
+    }
+
+    dcache_free_list = NULL;
+
+    for (int i = DCACHE_SIZE - 1; i >= 0; i--) {
+        dcache_entries[i].parent = NULL;
+        dcache_entries[i].node = NULL;
+        dcache_entries[i].lru_prev = NULL;
+        dcache_entries[i].lru_next = NULL;
+        dcache_entries[i].hash_next = dcache_free_list;
+        dcache_free_list = &dcache_entries[i];
+    }
+
+    dcache_lru_head = NULL;
+    dcache_lru_tail = NULL;
+    dcache_generation = 1;
+
+    dcache_stats.hits = 0;
+    dcache_stats.negative_hits = 0;
+    dcache_stats.path_hits = 0;
+    dcache_stats.misses = 0;
+    dcache_stats.evictions = 0;
+    dcache_stats.entries = 0;
+}
+
+// Look up a name (not necessarily terminated) in a directory
+//
+// Sets *found if the cache knows the answer; the result is then the node,
+// or NULL if the name is known not to exist.
+fs_node_t* dcache_lookup(fs_node_t* parent, const char* name, unsigned int length, int* found) {
+    *found = 0;
+
+    if (!parent || !name || length == 0 || length >= DCACHE_NAME_LEN) {
+        return NULL;
+    }
+
+    dentry_t* entry = dcache_find(parent, name, length, dcache_hash(parent, name, length));
+
+    if (!entry) {
+        dcache_stats.misses++;
+        return NULL;
+    }
+
+    dcache_lru_unlink(entry);
+    dcache_lru_push(entry);
+
+    *found = 1;
+
+    if (entry->node) {
+        dcache_stats.hits++;
+    } else {
+        dcache_stats.negative_hits++;
+    }
+
+    return entry->node;
+}
+
+// Cache the result of a directory lookup (node may be NULL)
+void dcache_insert(fs_node_t* parent, const char* name, unsigned int length, fs_node_t* node) {
+    dcache_store(parent, name, length, node, 0);
+}
+
+// Look up a whole path relative to the root
+fs_node_t* dcache_lookup_path(fs_node_t* root, const char* path) {
+    if (!root || !path) {
+        return NULL;
+    }
+
+    unsigned int length = strlen(path);
+
+    if (length == 0 || length >= DCACHE_NAME_LEN) {
+        return NULL;
+    }
+
+    dentry_t* entry = dcache_find(root, path, length, dcache_hash(root, path, length));
+
+    if (!entry || entry->generation != dcache_generation || !entry->node) {
+        return NULL;
+    }
+
+    dcache_lru_unlink(entry);
+    dcache_lru_push(entry);
+    dcache_stats.path_hits++;
+
+    return entry->node;
+}
+
+// Cache a resolved multi-component path
+void dcache_insert_path(fs_node_t* root, const char* path, fs_node_t* node) {
+    if (!root || !path || !node) {
+        return;
+    }
+
+    // Single components are already cached by dcache_insert
+    int has_separator = 0;
+
+    for (const char* p = path; *p; p++) {
+        if (*p == '/') {
+            has_separator = 1;
+            break;
+        }
+    }
+
+    if (has_separator) {
+        dcache_store(root, path, strlen(path), node, dcache_generation);
+    }
+}
+
+// Forget a name in a directory (after it is created, removed or renamed)
+void dcache_invalidate(fs_node_t* parent, const char* name) {
+    if (!parent || !name) {
+        return;
+    }
+
+    unsigned int length = strlen(name);
+    dentry_t* entry = dcache_find(parent, name, length, dcache_hash(parent, name, length));
+
+    if (entry) {
+        dcache_release(entry);
+    }
+
+    // Any cached path may have gone through this name
+    dcache_generation++;
+}
+
+// Forget every entry that refers to a node (before the node is freed)
+void dcache_invalidate_node(fs_node_t* node) {
+    if (!node) {
+        return;
+    }
+
+    for (int i = 0; i < DCACHE_SIZE; i++) {
+        dentry_t* entry = &dcache_entries[i];
+
+        if (entry->parent && (entry->parent == node || entry->node == node)) {
+            dcache_release(entry);
+        }
+    }
+
+    dcache_generation++;
+}
+
+// Drop all entries (e.g. when the mount table changes)
+void dcache_flush() {
+    for (int i = 0; i < DCACHE_SIZE; i++) {
+        if (dcache_entries[i].parent) {
+            dcache_release(&dcache_entries[i]);
+        }
+    }
+
+    dcache_generation++;
+}
+
+// Get directory entry cache statistics
+void dcache_get_stats(dcache_stats_t* stats) {
+    if (stats) {
+        *stats = dcache_stats;
+    }
+}
@@ -0,0 +1,63 @@
+/**
+ * LightOS Kernel
+ * Directory entry cache header
+ */
+
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#include "filesystem.h"
+
+// Number of cached entries
+#define DCACHE_SIZE 512
+
+// Number of hash buckets (must be a power of two)
+#define DCACHE_BUCKETS 1024
+
+// Maximum cached name or path length (including the terminator)
+#define DCACHE_NAME_LEN 256
+
+// Directory entry structure
+//
+// An entry maps (parent, name) to the node that fs_finddir() returned for
+// it. A NULL node is a negative entry: the name is known not to exist.
+// Whole-path entries use the root as parent and the path (which contains
+// '/', so it can never clash with a component name) as name; they are only
+// valid while their generation matches the cache's.
+//
+// File systems report every name they create, remove or rename through
+// fs_invalidate_name(), which drops the name's entry and bumps the
+// generation.
+typedef struct dentry {
+    fs_node_t* parent;
+    fs_node_t* node;
+    unsigned int hash;
+    unsigned int generation;
+    struct dentry* hash_next;
+    struct dentry* lru_prev;
+    struct dentry* lru_next;
+    char name[DCACHE_NAME_LEN];
+} dentry_t;
+
+// Directory entry cache statistics
+typedef struct {
+    unsigned long long hits;
+    unsigned long long negative_hits;
+    unsigned long long path_hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+    unsigned int entries;
+} dcache_stats_t;
+
+// Directory entry cache functions
+void dcache_init();
+fs_node_t* dcache_lookup(fs_node_t* parent, const char* name, unsigned int length, int* found);
+void dcache_insert(fs_node_t* parent, const char* name, unsigned int length, fs_node_t* node);
+fs_node_t* dcache_lookup_path(fs_node_t* root, const char* path);
+void dcache_insert_path(fs_node_t* root, const char* path, fs_node_t* node);
+void dcache_invalidate(fs_node_t* parent, const char* name);
+void dcache_invalidate_node(fs_node_t* node);
+void dcache_flush();
+void dcache_get_stats(dcache_stats_t* stats);
+
+#endif /* DCACHE_H */
@@ -6,24 +6,181 @@
 #include "filesystem.h"
 #include "memory.h"
 #include "kernel.h"
-
-// Maximum number of open files
-#define MAX_OPEN_FILES 64
+#include "filesystem_ext.h"
+#include "dcache.h"
+#include "icache.h"
+#include "page_cache.h"
+#include "process.h"
+#include "../libc/string.h"
 
 // File system root node
 static fs_node_t* fs_root = NULL;
 
-// Open file table
-static file_descriptor_t open_files[MAX_OPEN_FILES];
+// Descriptor table used before processes exist
+static fd_table_t* kernel_files = NULL;
+
+// Unused descriptors (chained through their table field)
+static file_descriptor_t* free_descriptors = NULL;
+
+// Memory blocks needed for a table of max_fds descriptors
+static unsigned int fd_table_blocks(unsigned int max_fds) {
+    unsigned int open_words = max_fds / 64;
+    unsigned int full_words = (open_words + 63) / 64;
+    unsigned int bytes = max_fds * sizeof(file_descriptor_t*) + (open_words + full_words) * sizeof(unsigned long long);
+    
+    return (bytes + MEMORY_BLOCK_SIZE - 1) / MEMORY_BLOCK_SIZE;
+}
+
+// Point a table at new arrays for max_fds descriptors
+static int fd_table_resize(fd_table_t* table, unsigned int max_fds) {
+    unsigned int blocks = fd_table_blocks(max_fds);
+    unsigned char* memory = (unsigned char*) allocate_blocks(blocks);
+    
+    if (!memory) {
+        return -1;
+    }
+    
+    memset(memory, 0, blocks * MEMORY_BLOCK_SIZE);
+    
+    file_descriptor_t** fds = (file_descriptor_t**) memory;
+    unsigned long long* open_bits = (unsigned long long*) (memory + max_fds * sizeof(file_descriptor_t*));
+    unsigned long long* full_bits = open_bits + max_fds / 64;
+    
+    // Carry over the old contents (the new words past them start empty, so not full)
+    if (table->fds) {
+        unsigned int open_words = table->max_fds / 64;
+        
+        memcpy(fds, table->fds, table->max_fds * sizeof(file_descriptor_t*));
+        memcpy(open_bits, table->open_bits, open_words * sizeof(unsigned long long));
+        memcpy(full_bits, table->full_bits, ((open_words + 63) / 64) * sizeof(unsigned long long));
+        free_blocks(table->fds, table->blocks);
+    }
+    
+    table->fds = fds;
+    table->open_bits = open_bits;
+    table->full_bits = full_bits;
+    table->max_fds = max_fds;
+    table->blocks = blocks;
+    
+    return 0;
+}
+
+// Create an empty descriptor table
+static fd_table_t* fd_table_create() {
+    fd_table_t* table = (fd_table_t*) allocate_block();
+    
+    if (!table) {
+        return NULL;
+    }
+    
+    memset(table, 0, sizeof(fd_table_t));
+    
+    if (fd_table_resize(table, FD_TABLE_INITIAL) != 0) {
+        free_block(table);
+        return NULL;
+    }
+    
+    return table;
+}
+
+// Get the calling process's descriptor table, creating it on first use
+static fd_table_t* fd_table_current() {
+    process_t* process = process_current();
+    fd_table_t** files = process ? &process->files : &kernel_files;
+    
+    if (!*files) {
+        *files = fd_table_create();
+    }
+    
+    return *files;
+}
+
+// Find the lowest free descriptor in a table, growing it if it is full
+static int fd_table_alloc(fd_table_t* table) {
+    if (table->count == table->max_fds) {
+        if (table->max_fds >= FD_TABLE_MAX || fd_table_resize(table, table->max_fds * 2) != 0) {
+            return -1;
+        }
+    }
+    
+    // Skip whole words of open descriptors using the full bitmap
+    unsigned int open_words = table->max_fds / 64;
+    unsigned int word = table->next_fd / 64;
+    
+    while (word < open_words && (table->full_bits[word / 64] & (1ULL << (word % 64)))) {
+        unsigned long long free = ~table->full_bits[word / 64] & (~0ULL << (word % 64));
+        word = (word & ~63u) + (free ? (unsigned int) __builtin_ctzll(free) : 64);
+    }
+    
+    if (word >= open_words) {
+        return -1;
+    }
+    
+    int fd = word * 64 + __builtin_ctzll(~table->open_bits[word]);
+    
+    table->open_bits[word] |= 1ULL << (fd % 64);
+    
+    if (table->open_bits[word] == ~0ULL) {
+        table->full_bits[word / 64] |= 1ULL << (word % 64);
+    }
+    
+    table->count++;
+    table->next_fd = fd + 1;
+    
+    return fd;
+}
+
+// Return a descriptor number to its table
+static void fd_table_free(fd_table_t* table, int fd) {
+    unsigned int word = fd / 64;
+    
+    table->fds[fd] = NULL;
+    table->open_bits[word] &= ~(1ULL << (fd % 64));
+    table->full_bits[word / 64] &= ~(1ULL << (word % 64));
+    table->count--;
+    
+    if ((unsigned int) fd < table->next_fd) {
+        table->next_fd = fd;
+    }
+}
+
+// Allocate a descriptor object
+static file_descriptor_t* fs_alloc_descriptor() {
+    if (!free_descriptors) {
+        file_descriptor_t* block = (file_descriptor_t*) allocate_block();
+        
+        if (!block) {
+            return NULL;
+        }
+        
+        for (unsigned int i = 0; i < MEMORY_BLOCK_SIZE / sizeof(file_descriptor_t); i++) {
+            block[i].node = NULL;
+            block[i].table = (fd_table_t*) free_descriptors;
+            free_descriptors = &block[i];
+        }
+    }
+    
+    file_descriptor_t* descriptor = free_descriptors;
+    free_descriptors = (file_descriptor_t*) descriptor->table;
+    
+    return descriptor;
+}
+
+// Return a descriptor object to the free list
+static void fs_free_descriptor(file_descriptor_t* descriptor) {
+    descriptor->node = NULL;
+    descriptor->offset = 0;
+    descriptor->flags = 0;
+    descriptor->table = (fd_table_t*) free_descriptors;
+    free_descriptors = descriptor;
+}
 
 // Initialize the file system
 void fs_init() {
-    // Clear the open file table
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        open_files[i].node = NULL;
-        open_files[i].offset = 0;
-        open_files[i].flags = 0;
-    }
+    // Start with empty directory entry, inode and page caches
+    dcache_init();
+    icache_init();
+    page_cache_init();
     
     // Create a root directory node (in-memory file system for now)
     fs_root = (fs_node_t*) allocate_block();
@@ -40,8 +197,12 @@ void fs_init() {
         fs_root->write = NULL;
         fs_root->open = NULL;
         fs_root->close = NULL;
-        fs_root->readdir = fs_readdir;
-        fs_root->finddir = fs_finddir;
+        fs_root->get_mapping = NULL;
+        
+        // The in-memory root has no entries of its own (fs_readdir and
+        // fs_finddir call these, so they cannot point back at them)
+        fs_root->readdir = NULL;
+        fs_root->finddir = NULL;
         
         // Initialize the root directory contents
         fs_root->impl = NULL; // No implementation-specific data yet
@@ -54,33 +215,99 @@ unsigned int fs_read(file_descriptor_t* fd, unsigned int size, unsigned char* bu
         return 0;
     }
     
+    unsigned int bytes_read = fs_pread(fd, size, buffer, fd->offset);
+    fd->offset += bytes_read;
+    
+    return bytes_read;
+}
+
+// Write data to a file
+unsigned int fs_write(file_descriptor_t* fd, unsigned int size, unsigned char* buffer) {
+    if (!fd || !fd->node || !buffer) {
+        return 0;
+    }
+    
+    unsigned int bytes_written = fs_pwrite(fd, size, buffer, fd->offset);
+    fd->offset += bytes_written;
+    
+    return bytes_written;
+}
+
+// Read data from a file at an offset, leaving the file offset alone
+unsigned int fs_pread(file_descriptor_t* fd, unsigned int size, unsigned char* buffer, unsigned long long offset) {
+    if (!fd || !fd->node || !buffer) {
+        return 0;
+    }
+    
     // Check if the node has a read function
     if (fd->node->read) {
-        unsigned int bytes_read = fd->node->read(fd->node, fd->offset, size, buffer);
-        fd->offset += bytes_read;
-        return bytes_read;
+        return fd->node->read(fd->node, offset, size, buffer);
     }
     
     return 0;
 }
 
-// Write data to a file
-unsigned int fs_write(file_descriptor_t* fd, unsigned int size, unsigned char* buffer) {
+// Write data to a file at an offset, leaving the file offset alone
+unsigned int fs_pwrite(file_descriptor_t* fd, unsigned int size, unsigned char* buffer, unsigned long long offset) {
     if (!fd || !fd->node || !buffer) {
         return 0;
     }
     
     // Check if the node has a write function
     if (fd->node->write) {
-        unsigned int bytes_written = fd->node->write(fd->node, fd->offset, size, buffer);
-        fd->offset += bytes_written;
-        return bytes_written;
+        return fd->node->write(fd->node, offset, size, buffer);
     }
     
     return 0;
 }
 
+// Read data from a file into several buffers in turn
+//
+// Stops at the first short read, as at the end of the file.
+unsigned int fs_readv(file_descriptor_t* fd, const struct iovec* iov, unsigned int count) {
+    if (!fd || !fd->node || !iov) {
+        return 0;
+    }
+    
+    unsigned int total = 0;
+    
+    for (unsigned int i = 0; i < count; i++) {
+        unsigned int bytes_read = fs_pread(fd, iov[i].iov_len, (unsigned char*) iov[i].iov_base, fd->offset);
+        fd->offset += bytes_read;
+        total += bytes_read;
+        
+        if (bytes_read < iov[i].iov_len) {
+            break;
+        }
+    }
+    
+    return total;
+}
+
+// Write data to a file from several buffers in turn
+unsigned int fs_writev(file_descriptor_t* fd, const struct iovec* iov, unsigned int count) {
+    if (!fd || !fd->node || !iov) {
+        return 0;
+    }
+    
+    unsigned int total = 0;
+    
+    for (unsigned int i = 0; i < count; i++) {
+        unsigned int bytes_written = fs_pwrite(fd, iov[i].iov_len, (unsigned char*) iov[i].iov_base, fd->offset);
+        fd->offset += bytes_written;
+        total += bytes_written;
+        
+        if (bytes_written < iov[i].iov_len) {
+            break;
+        }
+    }
+    
+    return total;
+}
+
 // Open a file
+//
+// The descriptor gets the lowest free number in the calling process's table.
 file_descriptor_t* fs_open(const char* path, unsigned int flags) {
     // Find the file node
     fs_node_t* node = fs_namei(path);
@@ -89,22 +316,38 @@ file_descriptor_t* fs_open(const char* path, unsigned int flags) {
         return NULL; // File not found
     }
     
+    fd_table_t* table = fd_table_current();
+    
+    if (!table) {
+        return NULL;
+    }
+    
+    file_descriptor_t* descriptor = fs_alloc_descriptor();
+    
+    if (!descriptor) {
+        return NULL;
+    }
+    
+    int fd = fd_table_alloc(table);
+    
+    if (fd < 0) {
+        fs_free_descriptor(descriptor);
+        return NULL; // No free file descriptors
+    }
+    
     // Call the node's open function if it exists
     if (node->open) {
         node->open(node);
     }
     
-    // Find a free file descriptor
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        if (open_files[i].node == NULL) {
-            open_files[i].node = node;
-            open_files[i].offset = 0;
-            open_files[i].flags = flags;
-            return &open_files[i];
-        }
-    }
+    descriptor->node = node;
+    descriptor->offset = 0;
+    descriptor->flags = flags;
+    descriptor->fd = fd;
+    descriptor->table = table;
+    table->fds[fd] = descriptor;
     
-    return NULL; // No free file descriptors
+    return descriptor;
 }
 
 // Close a file
@@ -118,10 +361,39 @@ void fs_close(file_descriptor_t* fd) {
         fd->node->close(fd->node);
     }
     
-    // Clear the file descriptor
-    fd->node = NULL;
-    fd->offset = 0;
-    fd->flags = 0;
+    fd_table_free(fd->table, fd->fd);
+    fs_free_descriptor(fd);
+}
+
+// Look up a descriptor number in the calling process's table
+file_descriptor_t* fs_get_fd(int fd) {
+    fd_table_t* table = fd_table_current();
+    
+    if (!table || fd < 0 || (unsigned int) fd >= table->max_fds) {
+        return NULL;
+    }
+    
+    return table->fds[fd];
+}
+
+// Close every file in a table and free it (when a process terminates)
+void fs_release_files(fd_table_t* files) {
+    if (!files) {
+        return;
+    }
+    
+    for (unsigned int fd = 0; fd < files->max_fds && files->count > 0; fd++) {
+        if (files->fds[fd]) {
+            fs_close(files->fds[fd]);
+        }
+    }
+    
+    if (files == kernel_files) {
+        kernel_files = NULL;
+    }
+    
+    free_blocks(files->fds, files->blocks);
+    free_block(files);
 }
 
 // Read directory entries
@@ -155,47 +427,93 @@ fs_node_t* fs_finddir(fs_node_t* node, const char* name) {
 }
 
 // Resolve a path to a file node
+//
+// Each component is looked up in the directory entry cache first, and only
+// misses go to fs_finddir(). Fully resolved multi-component paths are also
+// cached, so a repeated lookup of the same path takes a single probe.
+//
+// The walk follows the mount trie alongside: a component that is a mount
+// point switches to the root node of the file system mounted there, and
+// once the path leaves the trie no further components are checked.
 fs_node_t* fs_namei(const char* path) {
     if (!path || !fs_root) {
         return NULL;
     }
     
-    // Start at the root directory
-    fs_node_t* current = fs_root;
-    
     // Handle absolute paths
     if (path[0] == '/') {
         path++;
     }
     
-    // Parse the path components
-    char component[256];
-    int i = 0;
+    // Try the whole path first
+    fs_node_t* current = dcache_lookup_path(fs_root, path);
+    
+    if (current) {
+        return current;
+    }
+    
+    // Start at the root directory
+    const char* full_path = path;
+    current = fs_root;
+    mount_node_t* mounts = fs_mount_walk_start(&current);
     
+    // Parse the path components
     while (*path) {
-        // Extract the next path component
-        i = 0;
+        // Find the end of the next path component
+        const char* start = path;
         while (*path && *path != '/') {
-            component[i++] = *path++;
+            path++;
         }
-        component[i] = '\0';
+        
+        unsigned int length = path - start;
         
         // Skip empty components
-        if (i == 0) {
+        if (length == 0) {
             if (*path) path++;
             continue;
         }
         
+        if (length >= DCACHE_NAME_LEN) {
+            return NULL; // Component name too long
+        }
+        
+        // A mount point hides the directory it is mounted on
+        fs_node_t* next = NULL;
+        
+        if (mounts) {
+            mounts = fs_mount_walk_step(mounts, start, length, &next);
+        }
+        
         // Find the component in the current directory
-        current = fs_finddir(current, component);
+        int cached = next != NULL;
+        
+        if (!cached) {
+            next = dcache_lookup(current, start, length, &cached);
+        }
         
-        if (!current) {
+        if (!cached) {
+            char component[DCACHE_NAME_LEN];
+            memcpy(component, start, length);
+            component[length] = '\0';
+            
+            next = fs_finddir(current, component);
+            
+            // Remember misses too, so repeated lookups of missing names are
+            // cheap; the file systems invalidate a name when they create it
+            dcache_insert(current, component, length, next);
+        }
+        
+        if (!next) {
             return NULL; // Component not found
         }
         
+        current = next;
+        
         // Skip the separator
         if (*path) path++;
     }
     
+    dcache_insert_path(fs_root, full_path, current);
+    
     return current;
 }
@@ -24,6 +24,10 @@
 #define O_TRUNC     0x10
 #define O_EXCL      0x20
 
+// Descriptors in a new process's table, and the most it may grow to
+#define FD_TABLE_INITIAL 256
+#define FD_TABLE_MAX     65536
+
 // Directory entry structure
 struct dirent {
     char name[256];
@@ -33,20 +37,24 @@ struct dirent {
 // Forward declaration for fs_node_t
 typedef struct fs_node fs_node_t;
 
+// Page cache mapping holding a file's contents (see page_cache.h)
+struct page_mapping;
+
 // Function types for file operations
-typedef unsigned int (*read_type_t)(struct fs_node*, unsigned int, unsigned int, unsigned char*);
-typedef unsigned int (*write_type_t)(struct fs_node*, unsigned int, unsigned int, unsigned char*);
+typedef unsigned int (*read_type_t)(struct fs_node*, unsigned long long, unsigned int, unsigned char*);
+typedef unsigned int (*write_type_t)(struct fs_node*, unsigned long long, unsigned int, unsigned char*);
 typedef void (*open_type_t)(struct fs_node*);
 typedef void (*close_type_t)(struct fs_node*);
 typedef struct dirent* (*readdir_type_t)(struct fs_node*, unsigned int);
 typedef struct fs_node* (*finddir_type_t)(struct fs_node*, const char*);
+typedef struct page_mapping* (*get_mapping_type_t)(struct fs_node*);
 
 // File system node structure
 struct fs_node {
     char name[256];
     unsigned int flags;
     unsigned int inode;
-    unsigned int length;
+    unsigned long long length;
     
     // File operations
     read_type_t read;
@@ -55,6 +63,7 @@ struct fs_node {
     close_type_t close;
     readdir_type_t readdir;
     finddir_type_t finddir;
+    get_mapping_type_t get_mapping;     // Referenced mapping for fs_mmap(), if cached
     
     // Implementation-specific data
     void* impl;
@@ -63,16 +72,45 @@ struct fs_node {
 // File descriptor structure
 typedef struct {
     fs_node_t* node;
-    unsigned int offset;
+    unsigned long long offset;
     unsigned int flags;
+    int fd;                             // Number in the owning table
+    struct fd_table* table;
 } file_descriptor_t;
 
+// Per-process file descriptor table
+//
+// One bit per descriptor marks it in use, and one bit per word of those
+// marks the word full, so the lowest free descriptor is found by scanning
+// a few words of the second bitmap. The table doubles when it fills up.
+typedef struct fd_table {
+    file_descriptor_t** fds;
+    unsigned long long* open_bits;
+    unsigned long long* full_bits;
+    unsigned int max_fds;
+    unsigned int count;
+    unsigned int next_fd;               // No free descriptor below this
+    unsigned int blocks;                // Memory blocks holding the arrays
+} fd_table_t;
+
+// Buffer for vectored I/O
+struct iovec {
+    void* iov_base;
+    unsigned int iov_len;
+};
+
 // File system functions
 void fs_init();
 unsigned int fs_read(file_descriptor_t* fd, unsigned int size, unsigned char* buffer);
 unsigned int fs_write(file_descriptor_t* fd, unsigned int size, unsigned char* buffer);
+unsigned int fs_pread(file_descriptor_t* fd, unsigned int size, unsigned char* buffer, unsigned long long offset);
+unsigned int fs_pwrite(file_descriptor_t* fd, unsigned int size, unsigned char* buffer, unsigned long long offset);
+unsigned int fs_readv(file_descriptor_t* fd, const struct iovec* iov, unsigned int count);
+unsigned int fs_writev(file_descriptor_t* fd, const struct iovec* iov, unsigned int count);
 file_descriptor_t* fs_open(const char* path, unsigned int flags);
 void fs_close(file_descriptor_t* fd);
+file_descriptor_t* fs_get_fd(int fd);
+void fs_release_files(fd_table_t* files);
 struct dirent* fs_readdir(fs_node_t* node, unsigned int index);
 fs_node_t* fs_finddir(fs_node_t* node, const char* name);
 fs_node_t* fs_namei(const char* path);
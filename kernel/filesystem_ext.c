@@ -6,29 +6,79 @@
 #include "filesystem_ext.h"
 #include "kernel.h"
 #include "memory.h"
+#include "klog.h"
+#include "dcache.h"
+#include "icache.h"
+#include "page_cache.h"
+#include "mmap.h"
 #include "../libc/string.h"
+#include "../libc/hashmap.h"
 
 // Maximum number of file systems
 #define MAX_FILESYSTEMS 16
 
-// Maximum number of mount points
-#define MAX_MOUNTS 32
+// Name lookup table size
+#define FILESYSTEM_MAP_CAPACITY 32
+
+// Mount trie hash buckets (must be a power of two)
+#define MOUNT_HASH_BUCKETS 256
+
+// Longest mount point (including the terminator)
+#define MOUNT_PATH_LEN 256
+
+// Longest mount point path component (including the terminator)
+#define MOUNT_NAME_LEN 256
 
 // File system array
 static filesystem_t* filesystems[MAX_FILESYSTEMS];
 static int filesystem_count = 0;
 
-// Mount point array
-typedef struct {
+// File system name index
+static hashmap_entry_t filesystem_map_entries[FILESYSTEM_MAP_CAPACITY];
+static hashmap_t filesystem_map;
+
+// Mount point
+typedef struct mount {
     char device[32];
-    char mount_point[256];
+    char mount_point[MOUNT_PATH_LEN];
     filesystem_t* fs;
+    fs_node_t* root;                // Root node of the file system, if it has one
     unsigned int flags;
+    struct mount_node* node;
+    struct mount* next;             // Mount list, oldest first
+    struct mount* prev;
 } mount_t;
 
-static mount_t mounts[MAX_MOUNTS];
+// Node of the mount trie, one per path component leading to a mount point
+//
+// Children are found through a hash table keyed by (parent, name), so
+// resolving a path costs one probe per component however many file systems
+// are mounted.
+struct mount_node {
+    struct mount_node* parent;
+    struct mount_node* hash_next;
+    mount_t* mount;                 // File system mounted here, if any
+    unsigned int hash;
+    unsigned int children;
+    unsigned int length;
+    char name[MOUNT_NAME_LEN];
+};
+
+// Mount trie ("/" is the root node)
+static mount_node_t mount_root;
+static mount_node_t* mount_buckets[MOUNT_HASH_BUCKETS];
+
+// Mount list
+static mount_t* mount_head = NULL;
+static mount_t* mount_tail = NULL;
 static int mount_count = 0;
 
+// Unused mounts and trie nodes (chained through their first word)
+static void* free_mounts = NULL;
+static void* free_mount_nodes = NULL;
+
+KLOG_SUBSYSTEM(fs_log, "fs");
+
 // Initialize the file system manager
 void fs_manager_init() {
     terminal_write("Initializing file system manager...\n");
@@ -39,15 +89,13 @@ void fs_manager_init() {
     }
     
     filesystem_count = 0;
+    hashmap_init(&filesystem_map, filesystem_map_entries, FILESYSTEM_MAP_CAPACITY);
     
-    // Clear the mount array
-    for (int i = 0; i < MAX_MOUNTS; i++) {
-        mounts[i].device[0] = '\0';
-        mounts[i].mount_point[0] = '\0';
-        mounts[i].fs = NULL;
-        mounts[i].flags = 0;
-    }
-    
+    // Start with an empty mount trie
+    memset(&mount_root, 0, sizeof(mount_node_t));
+    memset(mount_buckets, 0, sizeof(mount_buckets));
+    mount_head = NULL;
+    mount_tail = NULL;
     mount_count = 0;
     
     // Register built-in file systems
@@ -106,13 +154,11 @@ int fs_register_filesystem(filesystem_t* fs) {
     }
     
     // Check if a file system with the same name already exists
-    for (int i = 0; i < filesystem_count; i++) {
-        if (strcmp(filesystems[i]->name, fs->name) == 0) {
-            terminal_write("Error: File system with name '");
-            terminal_write(fs->name);
-            terminal_write("' already exists\n");
-            return -1;
-        }
+    if (hashmap_get(&filesystem_map, fs->name)) {
+        terminal_write("Error: File system with name '");
+        terminal_write(fs->name);
+        terminal_write("' already exists\n");
+        return -1;
     }
     
     // Allocate memory for the file system
@@ -126,12 +172,17 @@ int fs_register_filesystem(filesystem_t* fs) {
     // Copy the file system data
     memcpy(new_fs, fs, sizeof(filesystem_t));
     
+    // Index the file system by name
+    if (hashmap_insert(&filesystem_map, new_fs->name, new_fs) != 0) {
+        terminal_write("Error: Failed to index file system\n");
+        free_block(new_fs);
+        return -1;
+    }
+    
     // Add the file system to the array
     filesystems[filesystem_count++] = new_fs;
     
-    terminal_write("Registered file system: ");
-    terminal_write(fs->name);
-    terminal_write("\n");
+    KLOG(&fs_log, KLOG_INFO, "Registered file system: %s\n", new_fs->name);
     
     return 0;
 }
@@ -146,8 +197,8 @@ int fs_unregister_filesystem(const char* name) {
     for (int i = 0; i < filesystem_count; i++) {
         if (strcmp(filesystems[i]->name, name) == 0) {
             // Check if the file system is mounted
-            for (int j = 0; j < mount_count; j++) {
-                if (mounts[j].fs == filesystems[i]) {
+            for (mount_t* mount = mount_head; mount; mount = mount->next) {
+                if (mount->fs == filesystems[i]) {
                     terminal_write("Error: Cannot unregister file system '");
                     terminal_write(name);
                     terminal_write("' because it is mounted\n");
@@ -155,7 +206,8 @@ int fs_unregister_filesystem(const char* name) {
                 }
             }
             
-            // Free the file system memory
+            // Drop the name index entry and free the file system memory
+            hashmap_remove(&filesystem_map, name);
             free_block(filesystems[i]);
             
             // Remove the file system from the array by shifting all subsequent file systems
@@ -165,9 +217,7 @@ int fs_unregister_filesystem(const char* name) {
             
             filesystems[--filesystem_count] = NULL;
             
-            terminal_write("Unregistered file system: ");
-            terminal_write(name);
-            terminal_write("\n");
+            KLOG(&fs_log, KLOG_INFO, "Unregistered file system\n");
             
             return 0;
         }
@@ -186,36 +236,180 @@ filesystem_t* fs_get_filesystem(const char* name) {
         return NULL;
     }
     
-    // Find the file system
-    for (int i = 0; i < filesystem_count; i++) {
-        if (strcmp(filesystems[i]->name, name) == 0) {
-            return filesystems[i];
+    return (filesystem_t*)hashmap_get(&filesystem_map, name);
+}
+
+// Get the name of a file system type
+static const char* fs_type_name(fs_type_t type) {
+    switch (type) {
+        case FS_TYPE_EXT2:
+            return "ext2";
+        case FS_TYPE_EXT3:
+            return "ext3";
+        case FS_TYPE_EXT4:
+            return "ext4";
+        case FS_TYPE_FAT16:
+            return "fat16";
+        case FS_TYPE_FAT32:
+            return "fat32";
+        case FS_TYPE_NTFS:
+            return "ntfs";
+        case FS_TYPE_ISO9660:
+            return "iso9660";
+        case FS_TYPE_BTRFS:
+            return "btrfs";
+        case FS_TYPE_XFS:
+            return "xfs";
+        case FS_TYPE_ZFS:
+            return "zfs";
+        case FS_TYPE_TMPFS:
+            return "tmpfs";
+        default:
+            return "unknown";
+    }
+}
+
+// Allocate an object from a free list, carving a new block if it is empty
+static void* mount_alloc(void** free_list, unsigned int size) {
+    if (!*free_list) {
+        unsigned char* block = (unsigned char*) allocate_block();
+        
+        if (!block) {
+            return NULL;
+        }
+        
+        for (unsigned int offset = 0; offset + size <= MEMORY_BLOCK_SIZE; offset += size) {
+            *(void**) (block + offset) = *free_list;
+            *free_list = block + offset;
+        }
+    }
+    
+    void* object = *free_list;
+    *free_list = *(void**) object;
+    memset(object, 0, size);
+    
+    return object;
+}
+
+// Return an object to its free list
+static void mount_free(void** free_list, void* object) {
+    *(void**) object = *free_list;
+    *free_list = object;
+}
+
+// Hash a (parent, name) pair (the library's name hash, mixed with the parent)
+static unsigned int mount_hash(mount_node_t* parent, const char* name, unsigned int length) {
+    unsigned long long address = (unsigned long long) parent;
+    return hashmap_hash_bytes(name, length) ^ (unsigned int) (address >> 4) * 0x9E3779B1u;
+}
+
+// Find a child of a trie node
+static mount_node_t* mount_node_child(mount_node_t* parent, const char* name, unsigned int length) {
+    unsigned int hash = mount_hash(parent, name, length);
+    
+    for (mount_node_t* node = mount_buckets[hash & (MOUNT_HASH_BUCKETS - 1)]; node; node = node->hash_next) {
+        if (node->hash == hash && node->parent == parent && node->length == length && memcmp(node->name, name, length) == 0) {
+            return node;
         }
     }
     
     return NULL;
 }
 
+// Get the next component of a path, skipping separators
+static const char* mount_next_component(const char* path, unsigned int* length) {
+    while (*path == '/') {
+        path++;
+    }
+    
+    *length = 0;
+    
+    while (path[*length] && path[*length] != '/') {
+        (*length)++;
+    }
+    
+    return path;
+}
+
+// Free trie nodes that no longer lead to a mount point, from a node upwards
+static void mount_node_prune(mount_node_t* node) {
+    while (node != &mount_root && !node->mount && node->children == 0) {
+        mount_node_t* parent = node->parent;
+        mount_node_t** link = &mount_buckets[node->hash & (MOUNT_HASH_BUCKETS - 1)];
+        
+        while (*link != node) {
+            link = &(*link)->hash_next;
+        }
+        
+        *link = node->hash_next;
+        parent->children--;
+        mount_free(&free_mount_nodes, node);
+        node = parent;
+    }
+}
+
+// Find the trie node for a mount point, creating missing nodes if create is set
+static mount_node_t* mount_node_lookup(const char* mount_point, int create) {
+    mount_node_t* node = &mount_root;
+    unsigned int length;
+    const char* name = mount_next_component(mount_point, &length);
+    
+    while (length > 0) {
+        mount_node_t* child = length < MOUNT_NAME_LEN ? mount_node_child(node, name, length) : NULL;
+        
+        if (!child) {
+            if (!create) {
+                return NULL;
+            }
+            
+            child = length < MOUNT_NAME_LEN ? (mount_node_t*) mount_alloc(&free_mount_nodes, sizeof(mount_node_t)) : NULL;
+            
+            // Drop the nodes created so far
+            if (!child) {
+                mount_node_prune(node);
+                return NULL;
+            }
+            
+            child->parent = node;
+            child->hash = mount_hash(node, name, length);
+            child->length = length;
+            memcpy(child->name, name, length);
+            child->name[length] = '\0';
+            
+            unsigned int bucket = child->hash & (MOUNT_HASH_BUCKETS - 1);
+            child->hash_next = mount_buckets[bucket];
+            mount_buckets[bucket] = child;
+            node->children++;
+        }
+        
+        node = child;
+        name = mount_next_component(name + length, &length);
+    }
+    
+    return node;
+}
+
 // Mount a file system
 int fs_mount(const char* fs_name, const char* device, const char* mount_point, unsigned int flags) {
     if (!fs_name || !device || !mount_point) {
         return -1;
     }
     
-    // Check if we have room for another mount
-    if (mount_count >= MAX_MOUNTS) {
-        terminal_write("Error: Maximum number of mounts reached\n");
+    if (mount_point[0] != '/' || strlen(mount_point) >= MOUNT_PATH_LEN) {
+        terminal_write("Error: Invalid mount point '");
+        terminal_write(mount_point);
+        terminal_write("'\n");
         return -1;
     }
     
     // Check if the mount point is already in use
-    for (int i = 0; i < mount_count; i++) {
-        if (strcmp(mounts[i].mount_point, mount_point) == 0) {
-            terminal_write("Error: Mount point '");
-            terminal_write(mount_point);
-            terminal_write("' is already in use\n");
-            return -1;
-        }
+    mount_node_t* node = mount_node_lookup(mount_point, 0);
+    
+    if (node && node->mount) {
+        terminal_write("Error: Mount point '");
+        terminal_write(mount_point);
+        terminal_write("' is already in use\n");
+        return -1;
     }
     
     // Find the file system
@@ -236,6 +430,19 @@ int fs_mount(const char* fs_name, const char* device, const char* mount_point, u
         return -1;
     }
     
+    mount_t* mount = (mount_t*) mount_alloc(&free_mounts, sizeof(mount_t));
+    node = mount ? mount_node_lookup(mount_point, 1) : NULL;
+    
+    if (!node) {
+        terminal_write("Error: Failed to allocate memory for the mount\n");
+        
+        if (mount) {
+            mount_free(&free_mounts, mount);
+        }
+        
+        return -1;
+    }
+    
     int result = fs->mount(fs, device, mount_point, flags);
     
     if (result != 0) {
@@ -244,16 +451,34 @@ int fs_mount(const char* fs_name, const char* device, const char* mount_point, u
         terminal_write("' on '");
         terminal_write(mount_point);
         terminal_write("'\n");
+        mount_free(&free_mounts, mount);
+        mount_node_prune(node);
         return -1;
     }
     
-    // Add the mount to the array
-    strcpy(mounts[mount_count].device, device);
-    strcpy(mounts[mount_count].mount_point, mount_point);
-    mounts[mount_count].fs = fs;
-    mounts[mount_count].flags = flags;
+    // Attach the mount to its trie node and the end of the mount list
+    strcpy(mount->device, device);
+    strcpy(mount->mount_point, mount_point);
+    mount->fs = fs;
+    mount->root = fs->root ? fs->root(fs) : NULL;
+    mount->flags = flags;
+    mount->node = node;
+    node->mount = mount;
+    
+    mount->prev = mount_tail;
+    
+    if (mount_tail) {
+        mount_tail->next = mount;
+    } else {
+        mount_head = mount;
+    }
+    
+    mount_tail = mount;
     mount_count++;
     
+    // Paths under the mount point now resolve differently
+    dcache_flush();
+    
     terminal_write("Mounted '");
     terminal_write(device);
     terminal_write("' on '");
@@ -272,44 +497,64 @@ int fs_unmount(const char* mount_point) {
     }
     
     // Find the mount
-    for (int i = 0; i < mount_count; i++) {
-        if (strcmp(mounts[i].mount_point, mount_point) == 0) {
-            // Unmount the file system
-            if (!mounts[i].fs->unmount) {
-                terminal_write("Error: File system '");
-                terminal_write(mounts[i].fs->name);
-                terminal_write("' does not support unmounting\n");
-                return -1;
-            }
-            
-            int result = mounts[i].fs->unmount(mounts[i].fs);
-            
-            if (result != 0) {
-                terminal_write("Error: Failed to unmount '");
-                terminal_write(mount_point);
-                terminal_write("'\n");
-                return -1;
-            }
-            
-            // Remove the mount from the array by shifting all subsequent mounts
-            for (int j = i; j < mount_count - 1; j++) {
-                strcpy(mounts[j].device, mounts[j + 1].device);
-                strcpy(mounts[j].mount_point, mounts[j + 1].mount_point);
-                mounts[j].fs = mounts[j + 1].fs;
-                mounts[j].flags = mounts[j + 1].flags;
-            }
-            
-            mounts[--mount_count].device[0] = '\0';
-            mounts[mount_count].mount_point[0] = '\0';
-            mounts[mount_count].fs = NULL;
-            mounts[mount_count].flags = 0;
-            
-            terminal_write("Unmounted '");
+    mount_node_t* node = mount_node_lookup(mount_point, 0);
+    mount_t* mount = node ? node->mount : NULL;
+    
+    if (mount) {
+        // Unmount the file system
+        if (!mount->fs->unmount) {
+            terminal_write("Error: File system '");
+            terminal_write(mount->fs->name);
+            terminal_write("' does not support unmounting\n");
+            return -1;
+        }
+        
+        // Mapped files keep their pages in the cache
+        if (mmap_owner_busy(mount->fs)) {
+            terminal_write("Error: Files on '");
+            terminal_write(mount_point);
+            terminal_write("' are still mapped\n");
+            return -1;
+        }
+        
+        // Write back and drop the file system's cached inodes and pages
+        icache_drop_owner(mount->fs);
+        page_cache_drop_owner(mount->fs);
+        
+        int result = mount->fs->unmount(mount->fs);
+        
+        if (result != 0) {
+            terminal_write("Error: Failed to unmount '");
             terminal_write(mount_point);
             terminal_write("'\n");
-            
-            return 0;
+            return -1;
+        }
+        
+        // Remove the mount from the list and the trie
+        if (mount->prev) {
+            mount->prev->next = mount->next;
+        } else {
+            mount_head = mount->next;
+        }
+        
+        if (mount->next) {
+            mount->next->prev = mount->prev;
+        } else {
+            mount_tail = mount->prev;
         }
+        
+        mount_count--;
+        node->mount = NULL;
+        mount_node_prune(node);
+        mount_free(&free_mounts, mount);
+        
+        dcache_flush();
+        
+        terminal_write("Unmounted '");
+        terminal_write(mount_point);
+        terminal_write("'\n");
+        
+        return 0;
     }
     
     terminal_write("Error: Mount point '");
@@ -319,6 +564,173 @@ int fs_unmount(const char* mount_point) {
     return -1;
 }
 
+// Find the mount holding a path and the path relative to it
+//
+// The path is walked down the mount trie one component at a time, keeping
+// the deepest node with a file system mounted on it.
+static mount_t* fs_find_mount(const char* path, const char** relative) {
+    mount_node_t* node = &mount_root;
+    mount_t* best = mount_root.mount;
+    const char* best_end = path;
+    unsigned int length;
+    const char* name = mount_next_component(path, &length);
+    
+    while (length > 0 && length < MOUNT_NAME_LEN) {
+        node = mount_node_child(node, name, length);
+        
+        if (!node) {
+            break;
+        }
+        
+        if (node->mount) {
+            best = node->mount;
+            best_end = name + length;
+        }
+        
+        name = mount_next_component(name + length, &length);
+    }
+    
+    if (best) {
+        // The root mount sees the path as it is
+        if (best == mount_root.mount) {
+            *relative = path[0] ? path : "/";
+        } else {
+            *relative = *best_end ? best_end : "/";
+        }
+    }
+    
+    return best;
+}
+
+// Start a path walk at the root of the mount trie
+//
+// If a file system with a root node is mounted on "/", *root is set to
+// that node; otherwise it is left alone.
+mount_node_t* fs_mount_walk_start(fs_node_t** root) {
+    if (mount_root.mount && mount_root.mount->root) {
+        *root = mount_root.mount->root;
+    }
+    
+    return &mount_root;
+}
+
+// Step a path walk into the next component
+//
+// Returns the component's trie node, or NULL once no mount point lies
+// below the path, so the walk can stop checking. If a file system with a
+// root node is mounted on the component, *root is set to that node.
+mount_node_t* fs_mount_walk_step(mount_node_t* node, const char* name, unsigned int length, fs_node_t** root) {
+    mount_node_t* child = length < MOUNT_NAME_LEN ? mount_node_child(node, name, length) : NULL;
+    
+    if (child && child->mount && child->mount->root) {
+        *root = child->mount->root;
+    }
+    
+    return child;
+}
+
+// Drop what the directory entry cache knows about a name that a mounted
+// file system created, removed or renamed (path is relative to the mount)
+//
+// A rename calls this for both names. A name that held a node also drops
+// every entry of that node, including the names cached below a directory.
+void fs_invalidate_name(filesystem_t* fs, const char* path) {
+    if (!fs || !path) {
+        return;
+    }
+    
+    char full[MOUNT_PATH_LEN * 2];
+    unsigned int length = strlen(fs->mount_point);
+    
+    if (length + strlen(path) + 2 > sizeof(full)) {
+        return;
+    }
+    
+    strcpy(full, fs->mount_point);
+    full[length] = '/';
+    strcpy(full + length + 1, path);
+    
+    // Split off the last component, ignoring trailing separators
+    length = strlen(full);
+    
+    while (length > 0 && full[length - 1] == '/') {
+        length--;
+    }
+    
+    full[length] = '\0';
+    unsigned int start = length;
+    
+    while (start > 0 && full[start - 1] != '/') {
+        start--;
+    }
+    
+    if (start == length) {
+        return;
+    }
+    
+    full[start - 1] = '\0';
+    fs_node_t* parent = fs_namei(full);
+    const char* name = full + start;
+    
+    if (!parent) {
+        return;
+    }
+    
+    int found;
+    fs_node_t* node = dcache_lookup(parent, name, length - start, &found);
+    
+    if (node) {
+        dcache_invalidate_node(node);
+    }
+    
+    dcache_invalidate(parent, name);
+}
+
+// Write back all cached data of every mounted file system
+int fs_sync() {
+    int result = 0;
+    
+    for (mount_t* mount = mount_head; mount; mount = mount->next) {
+        // Inodes go to their blocks first, so the sync covers them
+        if (icache_sync(mount->fs) != 0) {
+            result = -1;
+        }
+        
+        if (mount->fs->sync && mount->fs->sync(mount->fs) != 0) {
+            KLOG(&fs_log, KLOG_ERR, "Sync of %s (%s) failed\n", mount->mount_point, fs_type_name(mount->fs->type));
+            result = -1;
+        }
+    }
+    
+    // Raw device data and file systems without a sync operation
+    if (page_cache_sync(NULL) != 0) {
+        result = -1;
+    }
+    
+    return result;
+}
+
+// Write back the cached data of one file and make it durable
+int fs_fsync(const char* path) {
+    if (!path) {
+        return -1;
+    }
+    
+    const char* relative;
+    mount_t* mount = fs_find_mount(path, &relative);
+    
+    if (!mount) {
+        return -1;
+    }
+    
+    if (mount->fs->fsync) {
+        return mount->fs->fsync(mount->fs, relative);
+    }
+    
+    // Without a per-file operation, sync the whole file system
+    return mount->fs->sync ? mount->fs->sync(mount->fs) : page_cache_sync_owner(mount->fs);
+}
+
 // List all registered file systems
 void fs_list_filesystems() {
     terminal_write("Registered File Systems:\n");
@@ -334,44 +746,7 @@ void fs_list_filesystems() {
         terminal_write(" (");
         
         // Print file system type
-        switch (filesystems[i]->type) {
-            case FS_TYPE_EXT2:
-                terminal_write("ext2");
-                break;
-            case FS_TYPE_EXT3:
-                terminal_write("ext3");
-                break;
-            case FS_TYPE_EXT4:
-                terminal_write("ext4");
-                break;
-            case FS_TYPE_FAT16:
-                terminal_write("fat16");
-                break;
-            case FS_TYPE_FAT32:
-                terminal_write("fat32");
-                break;
-            case FS_TYPE_NTFS:
-                terminal_write("ntfs");
-                break;
-            case FS_TYPE_ISO9660:
-                terminal_write("iso9660");
-                break;
-            case FS_TYPE_BTRFS:
-                terminal_write("btrfs");
-                break;
-            case FS_TYPE_XFS:
-                terminal_write("xfs");
-                break;
-            case FS_TYPE_ZFS:
-                terminal_write("zfs");
-                break;
-            case FS_TYPE_TMPFS:
-                terminal_write("tmpfs");
-                break;
-            default:
-                terminal_write("unknown");
-                break;
-        }
+        terminal_write(fs_type_name(filesystems[i]->type));
         
         terminal_write(")\n");
     }
@@ -387,12 +762,12 @@ void fs_list_mounts() {
         return;
     }
     
-    for (int i = 0; i < mount_count; i++) {
-        terminal_write(mounts[i].device);
+    for (mount_t* mount = mount_head; mount; mount = mount->next) {
+        terminal_write(mount->device);
         terminal_write(" on ");
-        terminal_write(mounts[i].mount_point);
+        terminal_write(mount->mount_point);
         terminal_write(" type ");
-        terminal_write(mounts[i].fs->name);
+        terminal_write(mount->fs->name);
         terminal_write("\n");
     }
 }
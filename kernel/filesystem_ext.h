@@ -24,8 +24,19 @@ typedef enum {
     FS_TYPE_TMPFS
 } fs_type_t;
 
-// File system structure
+// File status returned by stat
 typedef struct {
+    unsigned long long size;
+    unsigned int mode;
+    unsigned int uid;
+    unsigned int gid;
+    unsigned int atime;
+    unsigned int mtime;
+    unsigned int ctime;
+} fs_stat_t;
+
+// File system structure
+typedef struct filesystem {
     char name[32];
     fs_type_t type;
     char device[32];
@@ -50,11 +61,16 @@ typedef struct {
     int (*chown)(struct filesystem* fs, const char* path, unsigned int uid, unsigned int gid);
     int (*truncate)(struct filesystem* fs, const char* path, unsigned int size);
     int (*sync)(struct filesystem* fs);
+    int (*fsync)(struct filesystem* fs, const char* path);
+    fs_node_t* (*root)(struct filesystem* fs);      // Root node for fs_namei(), if the file system has nodes
     
     // Private data for the file system
     void* private_data;
 } filesystem_t;
 
+// Node of the mount trie (see filesystem_ext.c)
+typedef struct mount_node mount_node_t;
+
 // File system manager functions
 void fs_manager_init();
 int fs_register_filesystem(filesystem_t* fs);
@@ -62,6 +78,11 @@ int fs_unregister_filesystem(const char* name);
 filesystem_t* fs_get_filesystem(const char* name);
 int fs_mount(const char* fs_name, const char* device, const char* mount_point, unsigned int flags);
 int fs_unmount(const char* mount_point);
+int fs_sync();
+int fs_fsync(const char* path);
+void fs_invalidate_name(filesystem_t* fs, const char* path);
+mount_node_t* fs_mount_walk_start(fs_node_t** root);
+mount_node_t* fs_mount_walk_step(mount_node_t* node, const char* name, unsigned int length, fs_node_t** root);
 void fs_list_filesystems();
 void fs_list_mounts();
 
@@ -5,10 +5,143 @@
 
 #include "filesystem_ext.h"
 #include "kernel.h"
+#include "icache.h"
+#include "jbd2.h"
+#include "klog.h"
+#include "ktime.h"
 #include "memory.h"
+#include "page_cache.h"
 #include "../libc/string.h"
+#include "../libc/hashmap.h"
 #include "../drivers/storage.h"
 
+KLOG_SUBSYSTEM(ext4_log, "ext4");
+
+// Superblock magic number
+#define EXT4_SUPER_MAGIC 0xEF53
+
+// Incompatible feature flags
+#define EXT4_FEATURE_INCOMPAT_COMPRESSION 0x00001
+#define EXT4_FEATURE_INCOMPAT_FILETYPE    0x00002
+#define EXT4_FEATURE_INCOMPAT_RECOVER     0x00004
+#define EXT4_FEATURE_INCOMPAT_JOURNAL_DEV 0x00008
+#define EXT4_FEATURE_INCOMPAT_META_BG     0x00010
+#define EXT4_FEATURE_INCOMPAT_EXTENTS     0x00040
+#define EXT4_FEATURE_INCOMPAT_64BIT       0x00080
+#define EXT4_FEATURE_INCOMPAT_INLINE_DATA 0x08000
+#define EXT4_FEATURE_INCOMPAT_ENCRYPT     0x10000
+
+// Incompatible features the read path cannot handle
+#define EXT4_FEATURE_INCOMPAT_UNSUPPORTED (EXT4_FEATURE_INCOMPAT_COMPRESSION | \
+                                           EXT4_FEATURE_INCOMPAT_JOURNAL_DEV | \
+                                           EXT4_FEATURE_INCOMPAT_META_BG | \
+                                           EXT4_FEATURE_INCOMPAT_INLINE_DATA | \
+                                           EXT4_FEATURE_INCOMPAT_ENCRYPT)
+
+// Compatible feature flags
+#define EXT4_FEATURE_COMPAT_HAS_JOURNAL   0x00004
+#define EXT4_FEATURE_COMPAT_DIR_INDEX     0x00020
+
+// Largest directories may use a third htree level
+#define EXT4_FEATURE_INCOMPAT_LARGEDIR    0x04000
+
+// Read-only compatible feature flags
+#define EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER 0x0001
+#define EXT4_FEATURE_RO_COMPAT_LARGE_FILE   0x0002
+#define EXT4_FEATURE_RO_COMPAT_HUGE_FILE    0x0008
+#define EXT4_FEATURE_RO_COMPAT_GDT_CSUM     0x0010
+#define EXT4_FEATURE_RO_COMPAT_DIR_NLINK    0x0020
+#define EXT4_FEATURE_RO_COMPAT_EXTRA_ISIZE  0x0040
+
+// Read-only compatible features the write path keeps consistent; with any
+// other (metadata checksums, bigalloc, quotas, ...) the file system is only read
+#define EXT4_FEATURE_RO_COMPAT_WRITABLE (EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER | \
+                                         EXT4_FEATURE_RO_COMPAT_LARGE_FILE | \
+                                         EXT4_FEATURE_RO_COMPAT_HUGE_FILE | \
+                                         EXT4_FEATURE_RO_COMPAT_GDT_CSUM | \
+                                         EXT4_FEATURE_RO_COMPAT_DIR_NLINK | \
+                                         EXT4_FEATURE_RO_COMPAT_EXTRA_ISIZE)
+
+// Superblock flags
+#define EXT4_FLAGS_SIGNED_HASH   0x0001
+#define EXT4_FLAGS_UNSIGNED_HASH 0x0002
+
+// Inode flags
+#define EXT4_INDEX_FL     0x01000
+#define EXT4_HUGE_FILE_FL 0x40000
+#define EXT4_EXTENTS_FL   0x80000
+
+// Block group flags
+#define EXT4_BG_BLOCK_UNINIT 0x0002
+
+// Inode mode file types
+#define EXT4_S_IFMT  0xF000
+#define EXT4_S_IFDIR 0x4000
+#define EXT4_S_IFREG 0x8000
+
+// Root directory inode
+#define EXT4_ROOT_INO 2
+
+// Number of direct block pointers in a block-mapped inode
+#define EXT4_NDIR_BLOCKS 12
+
+// Hashed directory (htree) parameters
+#define EXT4_DX_ROOT_INFO_OFFSET 24
+#define EXT4_DX_BLOCK_MASK 0x0FFFFFFF
+#define EXT4_DX_HASH_HALF_MD4 1
+#define EXT4_DX_HASH_HALF_MD4_UNSIGNED 4
+#define EXT4_HTREE_MAX_LEVELS 3
+#define EXT4_HTREE_EOF 0x7FFFFFFFu
+
+// Extent tree header magic number
+#define EXT4_EXTENT_MAGIC 0xF30A
+
+// Extents longer than this are uninitialized (preallocated, reads as zeros)
+#define EXT4_EXTENT_INIT_MAX 32768
+
+// Deepest extent tree the write path grows
+#define EXT4_EXTENT_MAX_DEPTH 5
+
+// Number of extents remembered per open file
+#define EXT4_EXTENT_CACHE_SIZE 4
+
+// Maximum number of cached files and directories per mount
+#define EXT4_MAX_FILES 64
+
+// Path index slots (must be a power of two, at least twice EXT4_MAX_FILES)
+#define EXT4_FILE_MAP_CAPACITY 128
+
+// Readahead window sizes (in pages)
+#define EXT4_READAHEAD_INITIAL 4
+#define EXT4_READAHEAD_MAX 32
+
+// Open file descriptors are slot numbers offset past stdin/stdout/stderr
+#define EXT4_FD_BASE 3
+
+// Orders of free chunks the block allocator tracks (up to 2^15 = 32768 blocks)
+#define EXT4_MB_ORDERS 16
+
+// Free chunks looked at per group and order before taking the best one seen
+#define EXT4_MB_SCAN_CHUNKS 32
+
+// No free chunk found
+#define EXT4_MB_NONE 0xFFFFFFFF
+
+// Allocator group flag: the block bitmap disagrees with the descriptor
+#define EXT4_MB_GROUP_CORRUPT 0x01
+
+// Blocks delayed allocation keeps back for extent tree nodes
+#define EXT4_DA_METADATA_RESERVE 64
+
+// Dirty pages written back together with the one being written back
+#define EXT4_WRITEBACK_MAX_PAGES 256
+
+// Extents allocated by one writeback
+#define EXT4_WRITEBACK_MAX_EXTENTS 16
+
+// Metadata blocks one update may change when there is no journal
+#define EXT4_HANDLE_MAX_BLOCKS 32
+
 // EXT4 superblock structure
 typedef struct {
     unsigned int inodes_count;
@@ -36,51 +169,2698 @@ typedef struct {
     unsigned int rev_level;
     unsigned short def_resuid;
     unsigned short def_resgid;
+    // Dynamic revision fields
+    unsigned int first_ino;
+    unsigned short inode_size;
+    unsigned short block_group_nr;
+    unsigned int feature_compat;
+    unsigned int feature_incompat;
+    unsigned int feature_ro_compat;
+    unsigned char uuid[16];
+    char volume_name[16];
+    char last_mounted[64];
+    unsigned int algorithm_usage_bitmap;
+    unsigned char prealloc_blocks;
+    unsigned char prealloc_dir_blocks;
+    unsigned short reserved_gdt_blocks;
+    // Journaling fields
+    unsigned char journal_uuid[16];
+    unsigned int journal_inum;
+    unsigned int journal_dev;
+    unsigned int last_orphan;
+    unsigned int hash_seed[4];
+    unsigned char def_hash_version;
+    unsigned char jnl_backup_type;
+    unsigned short desc_size;
+    unsigned int default_mount_opts;
+    unsigned int first_meta_bg;
+    unsigned int mkfs_time;
+    unsigned int jnl_blocks[17];
+    // 64-bit fields
+    unsigned int blocks_count_hi;
+    unsigned int reserved_blocks_count_hi;
+    unsigned int free_blocks_count_hi;
+    unsigned short min_extra_isize;
+    unsigned short want_extra_isize;
+    unsigned int flags;
     // ... more fields ...
 } ext4_superblock_t;
 
-// EXT4 inode structure
-typedef struct {
-    unsigned short mode;
-    unsigned short uid;
-    unsigned int size;
-    unsigned int atime;
-    unsigned int ctime;
-    unsigned int mtime;
-    unsigned int dtime;
-    unsigned short gid;
-    unsigned short links_count;
-    unsigned int blocks;
-    unsigned int flags;
-    unsigned int osd1;
-    unsigned int block[15];
-    unsigned int generation;
-    unsigned int file_acl;
-    unsigned int dir_acl;
-    unsigned int faddr;
-    unsigned int osd2[3];
-} ext4_inode_t;
+// EXT4 block group descriptor structure
+typedef struct {
+    unsigned int block_bitmap_lo;
+    unsigned int inode_bitmap_lo;
+    unsigned int inode_table_lo;
+    unsigned short free_blocks_count_lo;
+    unsigned short free_inodes_count_lo;
+    unsigned short used_dirs_count_lo;
+    unsigned short flags;
+    unsigned int exclude_bitmap_lo;
+    unsigned short block_bitmap_csum_lo;
+    unsigned short inode_bitmap_csum_lo;
+    unsigned short itable_unused_lo;
+    unsigned short checksum;
+    // Only present when desc_size >= 64 (64-bit file systems)
+    unsigned int block_bitmap_hi;
+    unsigned int inode_bitmap_hi;
+    unsigned int inode_table_hi;
+    unsigned short free_blocks_count_hi;
+    unsigned short free_inodes_count_hi;
+    unsigned short used_dirs_count_hi;
+    unsigned short itable_unused_hi;
+    unsigned int exclude_bitmap_hi;
+    unsigned short block_bitmap_csum_hi;
+    unsigned short inode_bitmap_csum_hi;
+    unsigned int reserved;
+} ext4_group_desc_t;
+
+// EXT4 inode structure
+typedef struct {
+    unsigned short mode;
+    unsigned short uid;
+    unsigned int size;
+    unsigned int atime;
+    unsigned int ctime;
+    unsigned int mtime;
+    unsigned int dtime;
+    unsigned short gid;
+    unsigned short links_count;
+    unsigned int blocks;
+    unsigned int flags;
+    unsigned int osd1;
+    unsigned int block[15];         // Block map, or extent tree root if EXT4_EXTENTS_FL
+    unsigned int generation;
+    unsigned int file_acl;
+    unsigned int size_high;
+    unsigned int faddr;
+    unsigned int osd2[3];
+} ext4_inode_t;
+
+// EXT4 extent tree node header
+typedef struct {
+    unsigned short magic;
+    unsigned short entries;
+    unsigned short max;
+    unsigned short depth;           // 0 for leaves
+    unsigned int generation;
+} ext4_extent_header_t;
+
+// EXT4 extent (leaf entry)
+typedef struct {
+    unsigned int block;             // First logical block
+    unsigned short len;
+    unsigned short start_hi;
+    unsigned int start_lo;          // First physical block
+} ext4_extent_t;
+
+// EXT4 extent index (interior entry)
+typedef struct {
+    unsigned int block;             // First logical block covered
+    unsigned int leaf_lo;           // Child node block
+    unsigned short leaf_hi;
+    unsigned short unused;
+} ext4_extent_idx_t;
+
+// EXT4 directory entry structure
+typedef struct {
+    unsigned int inode;
+    unsigned short rec_len;
+    unsigned char name_len;
+    unsigned char file_type;
+    char name[256];
+} ext4_dir_entry_t;
+
+// EXT4 htree root information (follows the "." and ".." entries)
+typedef struct {
+    unsigned int reserved_zero;
+    unsigned char hash_version;
+    unsigned char info_length;
+    unsigned char indirect_levels;
+    unsigned char unused_flags;
+} ext4_dx_root_info_t;
+
+// EXT4 htree index entry
+typedef struct {
+    unsigned int hash;              // Lowest hash in the block
+    unsigned int block;             // Logical block in the directory
+} ext4_dx_entry_t;
+
+// EXT4 htree index header (overlays the hash of entry 0)
+typedef struct {
+    unsigned short limit;
+    unsigned short count;
+    unsigned int block;
+} ext4_dx_countlimit_t;
+
+// Cached extent (physical 0 means a hole)
+typedef struct {
+    unsigned int logical;
+    unsigned int length;            // 0 = unused slot
+    unsigned long long physical;
+} ext4_extent_cache_t;
+
+struct ext4_fs_data;
+
+// EXT4 cached file or directory
+//
+// Files stay in the table after their last close so that repeated lookups
+// and reads keep their inode, extent cache and readahead state; entries with
+// a zero refcount are recycled least recently used first.
+typedef struct {
+    char path[256];
+    unsigned int ino;
+    ext4_inode_t inode;
+    unsigned long long size;
+    unsigned int refcount;          // Open file descriptors
+    unsigned int last_used;
+    page_mapping_t* mapping;        // Cached file contents
+    struct ext4_fs_data* data;
+    ext4_extent_cache_t extent_cache[EXT4_EXTENT_CACHE_SIZE];
+    unsigned int extent_cache_next;
+    unsigned int ra_next;           // Page expected next if the reader is sequential
+    unsigned int ra_start;          // Current readahead window
+    unsigned int ra_size;
+    unsigned int tid;               // Last journal transaction that changed the inode
+    int inode_dirty;                // The inode changed since it was last written
+    int writing;                    // Its pages are being written back
+} ext4_file_t;
+
+// Block allocator state of a block group
+//
+// The buddy has one bitmap per order: bit i of order k is set when the 2^k
+// blocks starting at block i << k of the group are all free. It is built
+// from the block bitmap the first time the group is searched and kept in
+// step with every allocation after that, so groups without a free chunk
+// as large as a request are passed over without looking at their bitmaps.
+typedef struct {
+    unsigned char* buddy;           // NULL until loaded
+    unsigned int free;              // Free blocks
+    unsigned int flags;
+    unsigned short chunks[EXT4_MB_ORDERS]; // Free aligned chunks of each order
+} ext4_group_info_t;
+
+// Metadata update in progress
+//
+// With a journal this is a jbd2 handle. Without one, the blocks changed are
+// pinned in the device cache until the update ends, then left dirty.
+typedef struct {
+    jbd2_handle_t journal;
+    page_t* pages[EXT4_HANDLE_MAX_BLOCKS];
+    unsigned int nr_pages;
+} ext4_handle_t;
+
+// EXT4 file system private data
+typedef struct ext4_fs_data {
+    ext4_superblock_t superblock;
+    block_dev_t* dev;               // Open device handle
+    filesystem_t* fs;
+    unsigned int block_size;
+    unsigned int sectors_per_block;
+    unsigned int blocks_per_page;
+    unsigned int inodes_per_group;
+    unsigned int blocks_per_group;
+    unsigned int groups_count;
+    unsigned int inodes_count;
+    unsigned long long blocks_count;
+    unsigned int inode_size;
+    unsigned int desc_size;
+    page_mapping_t* bdev;           // Cached view of the device
+    jbd2_journal_t* journal;        // NULL for a clean file system mounted without it
+    unsigned char* readahead_buffer; // Bounce buffer for batched readahead
+    unsigned int clock;             // Use counter for file table recycling
+    ext4_group_info_t* groups;      // Block allocator; NULL if mounted read-only
+    unsigned int groups_blocks;     // Memory blocks holding it
+    unsigned int mb_orders;
+    unsigned int mb_offsets[EXT4_MB_ORDERS]; // Byte offset of each order in a buddy
+    unsigned int mb_buddy_blocks;   // Memory blocks per buddy
+    unsigned long long free_blocks; // Blocks the allocator has not handed out
+    unsigned long long dirty_blocks; // Blocks reserved for delayed allocation
+    ext4_file_t* files[EXT4_MAX_FILES];
+    hashmap_t file_map;             // Path -> ext4_file_t
+    hashmap_entry_t file_map_entries[EXT4_FILE_MAP_CAPACITY];
+} ext4_fs_data_t;
+
+// Memory blocks needed for the private data
+#define EXT4_FS_DATA_BLOCKS ((sizeof(ext4_fs_data_t) + MEMORY_BLOCK_SIZE - 1) / MEMORY_BLOCK_SIZE)
+
+static int ext4_readpage(page_mapping_t* mapping, unsigned int index, void* buffer);
+static int ext4_writepage(page_mapping_t* mapping, unsigned int index, const void* buffer);
+static int ext4_icache_write(void* sb, unsigned int ino, const void* raw);
+
+// File contents are filled by mapping file blocks to device blocks, and
+// written back by allocating the blocks first if needed
+static const page_mapping_ops_t ext4_file_ops = {
+    ext4_readpage,
+    ext4_writepage
+};
+
+// Get a pointer to a metadata block in the device page cache
+//
+// The pointer is only valid until the next page cache call.
+static unsigned char* ext4_get_block(ext4_fs_data_t* data, unsigned long long block) {
+    if (block >= data->blocks_count) {
+        KLOG(&ext4_log, KLOG_ERR, "Block %llu out of range\n", block);
+        return NULL;
+    }
+
+    unsigned long long offset = block * data->block_size;
+    page_t* page = page_cache_get_page(data->bdev, (unsigned int) (offset / PAGE_CACHE_PAGE_SIZE));
+
+    if (!page) {
+        return NULL;
+    }
+
+    return (unsigned char*) page->data + (offset % PAGE_CACHE_PAGE_SIZE);
+}
+
+// Read contiguous blocks straight from the device
+static int ext4_read_blocks(ext4_fs_data_t* data, unsigned long long block, unsigned int count, void* buffer) {
+    unsigned long long sector = block * data->sectors_per_block;
+
+    if (block + count > data->blocks_count || sector + (unsigned long long) count * data->sectors_per_block > 0xFFFFFFFFULL) {
+        return -1;
+    }
+
+    return bdev_read_sectors(data->dev, (unsigned int) sector, count * data->sectors_per_block, buffer);
+}
+
+// Get the block holding a block group descriptor, and its offset in it
+static unsigned long long ext4_desc_block(ext4_fs_data_t* data, unsigned int group, unsigned int* offset) {
+    unsigned long long desc_offset = (unsigned long long) group * data->desc_size;
+
+    *offset = desc_offset % data->block_size;
+
+    return data->superblock.first_data_block + 1 + desc_offset / data->block_size;
+}
+
+// Read a copy of a block group descriptor
+static int ext4_read_group_desc(ext4_fs_data_t* data, unsigned int group, ext4_group_desc_t* desc) {
+    unsigned int offset;
+    unsigned char* block = ext4_get_block(data, ext4_desc_block(data, group, &offset));
+
+    if (!block) {
+        return -1;
+    }
+
+    // Short descriptors have no high halves
+    memset(desc, 0, sizeof(ext4_group_desc_t));
+    memcpy(desc, block + offset, data->desc_size < sizeof(ext4_group_desc_t) ? data->desc_size : sizeof(ext4_group_desc_t));
+
+    return 0;
+}
+
+// Find an inode in the inode table
+static int ext4_inode_location(ext4_fs_data_t* data, unsigned int ino, unsigned long long* block, unsigned int* offset) {
+    if (ino == 0 || ino > data->inodes_count) {
+        return -1;
+    }
+
+    unsigned int group = (ino - 1) / data->inodes_per_group;
+    unsigned int index = (ino - 1) % data->inodes_per_group;
+    ext4_group_desc_t desc;
+
+    if (ext4_read_group_desc(data, group, &desc) != 0) {
+        return -1;
+    }
+
+    unsigned long long inode_table = desc.inode_table_lo | (unsigned long long) desc.inode_table_hi << 32;
+    unsigned long long inode_offset = (unsigned long long) index * data->inode_size;
+
+    *block = inode_table + inode_offset / data->block_size;
+    *offset = inode_offset % data->block_size;
+
+    return 0;
+}
+
+// Read an inode from the inode table
+static int ext4_read_inode(ext4_fs_data_t* data, unsigned int ino, ext4_inode_t* inode) {
+    unsigned long long block;
+    unsigned int offset;
+
+    if (ext4_inode_location(data, ino, &block, &offset) != 0) {
+        return -1;
+    }
+
+    unsigned char* buffer = ext4_get_block(data, block);
+
+    if (!buffer) {
+        return -1;
+    }
+
+    // Copy the base inode; the extra fields beyond it are not used
+    memcpy(inode, buffer + offset, sizeof(ext4_inode_t));
+
+    return 0;
+}
+
+// Fill an inode cache entry (sb is the filesystem_t)
+static int ext4_icache_read(void* sb, unsigned int ino, void* raw) {
+    return ext4_read_inode((ext4_fs_data_t*) ((filesystem_t*) sb)->private_data, ino, (ext4_inode_t*) raw);
+}
+
+// Inodes are cached as read from the inode table
+static const icache_ops_t ext4_inode_ops = {
+    ext4_icache_read,
+    ext4_icache_write
+};
+
+// Map a logical block through the extent tree
+static int ext4_map_extent(ext4_fs_data_t* data, ext4_file_t* file, unsigned int logical, unsigned long long* physical, unsigned int* run) {
+    // Check the extent cache first
+    for (int i = 0; i < EXT4_EXTENT_CACHE_SIZE; i++) {
+        ext4_extent_cache_t* cached = &file->extent_cache[i];
+
+        if (cached->length && logical >= cached->logical && logical - cached->logical < cached->length) {
+            unsigned int delta = logical - cached->logical;
+            *physical = cached->physical ? cached->physical + delta : 0;
+            *run = cached->length - delta;
+            return 0;
+        }
+    }
+
+    const unsigned char* node = (const unsigned char*) file->inode.block;
+    const ext4_extent_header_t* header = (const ext4_extent_header_t*) node;
+    unsigned int limit = 0xFFFFFFFF;    // First logical block past this subtree
+    unsigned int depth = header->depth;
+
+    // Walk down the index nodes
+    while (1) {
+        header = (const ext4_extent_header_t*) node;
+
+        if (header->magic != EXT4_EXTENT_MAGIC || header->depth != depth) {
+            KLOG(&ext4_log, KLOG_ERR, "Corrupt extent tree in inode %u\n", file->ino);
+            return -1;
+        }
+
+        if (depth == 0) {
+            break;
+        }
+
+        const ext4_extent_idx_t* index = (const ext4_extent_idx_t*) (node + sizeof(ext4_extent_header_t));
+        unsigned int entries = header->entries;
+
+        if (entries == 0) {
+            return -1;
+        }
+
+        // Binary search for the last index starting at or before the block
+        unsigned int low = 0;
+        unsigned int high = entries;
+
+        while (high - low > 1) {
+            unsigned int middle = (low + high) / 2;
+
+            if (index[middle].block <= logical) {
+                low = middle;
+            } else {
+                high = middle;
+            }
+        }
+
+        if (low + 1 < entries && index[low + 1].block < limit) {
+            limit = index[low + 1].block;
+        }
+
+        node = ext4_get_block(data, index[low].leaf_lo | ((unsigned long long) index[low].leaf_hi << 32));
+
+        if (!node) {
+            return -1;
+        }
+
+        depth--;
+    }
+
+    const ext4_extent_t* extent = (const ext4_extent_t*) (node + sizeof(ext4_extent_header_t));
+    unsigned int entries = header->entries;
+
+    // A hole before the first extent of the leaf (or an empty leaf)
+    if (entries == 0 || extent[0].block > logical) {
+        unsigned int end = entries ? extent[0].block : limit;
+        *physical = 0;
+        *run = (end < limit ? end : limit) - logical;
+        return 0;
+    }
+
+    // Binary search for the last extent starting at or before the block
+    unsigned int low = 0;
+    unsigned int high = entries;
+
+    while (high - low > 1) {
+        unsigned int middle = (low + high) / 2;
+
+        if (extent[middle].block <= logical) {
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+
+    const ext4_extent_t* found = &extent[low];
+    unsigned int length = found->len;
+    int uninitialized = 0;
+
+    if (length > EXT4_EXTENT_INIT_MAX) {
+        length -= EXT4_EXTENT_INIT_MAX;
+        uninitialized = 1;
+    }
+
+    if (logical - found->block >= length) {
+        // A hole between this extent and the next
+        unsigned int end = low + 1 < entries ? extent[low + 1].block : limit;
+        *physical = 0;
+        *run = (end < limit ? end : limit) - logical;
+        return 0;
+    }
+
+    unsigned long long start = found->start_lo | ((unsigned long long) found->start_hi << 32);
+
+    // Remember the extent, replacing slots round-robin
+    ext4_extent_cache_t* cached = &file->extent_cache[file->extent_cache_next];
+    file->extent_cache_next = (file->extent_cache_next + 1) % EXT4_EXTENT_CACHE_SIZE;
+    cached->logical = found->block;
+    cached->length = length;
+    cached->physical = uninitialized ? 0 : start;
+
+    unsigned int delta = logical - found->block;
+    *physical = uninitialized ? 0 : start + delta;
+    *run = length - delta;
+
+    return 0;
+}
+
+// Look up a block map entry and count how many following entries continue
+// it contiguously (or are holes too)
+static unsigned int ext4_block_run(const unsigned int* table, unsigned int index, unsigned int count, unsigned int* run) {
+    unsigned int block = table[index];
+    unsigned int length = 1;
+
+    while (index + length < count) {
+        unsigned int next = table[index + length];
+
+        if (block ? next != block + length : next != 0) {
+            break;
+        }
+
+        length++;
+    }
+
+    *run = length;
+
+    return block;
+}
+
+// Map a logical block through the direct and indirect block maps
+static int ext4_map_indirect(ext4_fs_data_t* data, ext4_file_t* file, unsigned int logical, unsigned long long* physical, unsigned int* run) {
+    unsigned int per_block = data->block_size / sizeof(unsigned int);
+    unsigned int block;
+    unsigned int levels;
+
+    if (logical < EXT4_NDIR_BLOCKS) {
+        *physical = ext4_block_run(file->inode.block, logical, EXT4_NDIR_BLOCKS, run);
+        return 0;
+    }
+
+    logical -= EXT4_NDIR_BLOCKS;
+
+    if (logical < per_block) {
+        block = file->inode.block[12];
+        levels = 1;
+    } else if (logical - per_block < per_block * per_block) {
+        logical -= per_block;
+        block = file->inode.block[13];
+        levels = 2;
+    } else {
+        logical -= per_block + per_block * per_block;
+        block = file->inode.block[14];
+        levels = 3;
+    }
+
+    *run = 1;
+
+    while (levels > 0 && block) {
+        levels--;
+
+        unsigned int divisor = 1;
+
+        for (unsigned int i = 0; i < levels; i++) {
+            divisor *= per_block;
+        }
+
+        const unsigned int* table = (const unsigned int*) ext4_get_block(data, block);
+
+        if (!table) {
+            return -1;
+        }
+
+        if (levels == 0) {
+            block = ext4_block_run(table, logical % per_block, per_block, run);
+        } else {
+            block = table[(logical / divisor) % per_block];
+        }
+    }
+
+    *physical = block;
+
+    return 0;
+}
+
+// Map a logical file block to a device block (0 for a hole)
+//
+// On success *run is the number of blocks, starting at the given one, that
+// are physically contiguous (or all holes).
+static int ext4_map_block(ext4_fs_data_t* data, ext4_file_t* file, unsigned int logical, unsigned long long* physical, unsigned int* run) {
+    if (file->inode.flags & EXT4_EXTENTS_FL) {
+        return ext4_map_extent(data, file, logical, physical, run);
+    }
+
+    return ext4_map_indirect(data, file, logical, physical, run);
+}
+
+// Fill a page of a file (called by the page cache on a miss)
+static int ext4_readpage(page_mapping_t* mapping, unsigned int index, void* buffer) {
+    ext4_file_t* file = (ext4_file_t*) mapping->private_data;
+    ext4_fs_data_t* data = file->data;
+    unsigned char* out = (unsigned char*) buffer;
+    unsigned int first = index * data->blocks_per_page;
+    unsigned int block = 0;
+
+    while (block < data->blocks_per_page) {
+        unsigned int logical = first + block;
+
+        // Blocks past the end of the file read as zeros
+        if ((unsigned long long) logical * data->block_size >= file->size) {
+            memset(out + block * data->block_size, 0, (data->blocks_per_page - block) * data->block_size);
+            break;
+        }
+
+        unsigned long long physical;
+        unsigned int run;
+
+        if (ext4_map_block(data, file, logical, &physical, &run) != 0) {
+            return -1;
+        }
+
+        unsigned int count = data->blocks_per_page - block;
+
+        if (run < count) {
+            count = run;
+        }
+
+        if (physical == 0) {
+            memset(out + block * data->block_size, 0, count * data->block_size);
+        } else if (ext4_read_blocks(data, physical, count, out + block * data->block_size) != 0) {
+            return -1;
+        }
+
+        block += count;
+    }
+
+    return 0;
+}
+
+// Read pages [start, end) of a file that are not cached yet, batching
+// physically contiguous pages into single device reads
+static void ext4_readahead_pages(ext4_fs_data_t* data, ext4_file_t* file, unsigned int start, unsigned int end) {
+    unsigned int page = start;
+
+    while (page < end) {
+        if (page_cache_find_page(file->mapping, page)) {
+            page++;
+            continue;
+        }
+
+        unsigned long long physical = 0;
+        unsigned int run = 0;
+        unsigned int count = 0;
+
+        if (data->readahead_buffer &&
+            ext4_map_block(data, file, page * data->blocks_per_page, &physical, &run) == 0 && physical) {
+            while (page + count < end && count < EXT4_READAHEAD_MAX &&
+                   (count + 1) * data->blocks_per_page <= run &&
+                   !page_cache_find_page(file->mapping, page + count)) {
+                count++;
+            }
+        }
+
+        if (count == 0) {
+            // Holes and fragmented pages go through readpage
+            if (!page_cache_get_page(file->mapping, page)) {
+                return;
+            }
+
+            page++;
+            continue;
+        }
+
+        if (ext4_read_blocks(data, physical, count * data->blocks_per_page, data->readahead_buffer) != 0) {
+            return;
+        }
+
+        for (unsigned int i = 0; i < count; i++) {
+            page_cache_add_data(file->mapping, page + i, data->readahead_buffer + i * PAGE_CACHE_PAGE_SIZE);
+        }
+
+        page += count;
+    }
+}
+
+// Detect sequential access and keep a growing readahead window ahead of it
+static void ext4_readahead(ext4_fs_data_t* data, ext4_file_t* file, unsigned int first, unsigned int last) {
+    unsigned int file_pages = (unsigned int) ((file->size + PAGE_CACHE_PAGE_SIZE - 1) / PAGE_CACHE_PAGE_SIZE);
+    // Unaligned sequential reads start in the page the last one ended in
+    int sequential = (first == file->ra_next || first + 1 == file->ra_next);
+
+    file->ra_next = last + 1;
+
+    if (!sequential) {
+        // Random access: drop the window; a read from the start begins a
+        // new stream, anything else reads only what was asked for
+        file->ra_start = first;
+        file->ra_size = 0;
+
+        if (first != 0) {
+            return;
+        }
+    }
+
+    // Start the next window once the reader is into the last quarter of this one
+    if (file->ra_size && last < file->ra_start + file->ra_size - file->ra_size / 4) {
+        return;
+    }
+
+    unsigned int start;
+    unsigned int size;
+
+    if (file->ra_size == 0) {
+        start = first;
+        size = (last - first + 1) * 2;
+
+        if (size < EXT4_READAHEAD_INITIAL) {
+            size = EXT4_READAHEAD_INITIAL;
+        }
+    } else {
+        start = file->ra_start + file->ra_size;
+        size = file->ra_size * 2;
+
+        if (start < first) {
+            start = first;
+        }
+    }
+
+    if (size > EXT4_READAHEAD_MAX) {
+        size = EXT4_READAHEAD_MAX;
+    }
+
+    file->ra_start = start;
+    file->ra_size = size;
+
+    // The window always covers the request itself
+    unsigned int end = start + size;
+
+    if (end <= last) {
+        end = last + 1;
+    }
+
+    if (end > file_pages) {
+        end = file_pages;
+    }
+
+    ext4_readahead_pages(data, file, first < start ? first : start, end);
+}
+
+// Write contiguous file blocks straight to the device
+//
+// Cached device pages holding any of the blocks are patched as well, so
+// writing back metadata sharing their page does not put old data back.
+static int ext4_write_blocks(ext4_fs_data_t* data, unsigned long long block, unsigned int count, const void* buffer) {
+    unsigned long long sector = block * data->sectors_per_block;
+
+    if (block + count > data->blocks_count || sector + (unsigned long long) count * data->sectors_per_block > 0xFFFFFFFFULL) {
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < count; i++) {
+        unsigned long long offset = (block + i) * data->block_size;
+        page_t* page = page_cache_find_page(data->bdev, (unsigned int) (offset / PAGE_CACHE_PAGE_SIZE));
+
+        if (page) {
+            memcpy((unsigned char*) page->data + offset % PAGE_CACHE_PAGE_SIZE, (const unsigned char*) buffer + i * data->block_size, data->block_size);
+        }
+    }
+
+    return bdev_write_sectors(data->dev, (unsigned int) sector, count * data->sectors_per_block, buffer);
+}
+
+// Report the space neither allocated nor reserved for dirty pages
+static void ext4_update_free_size(ext4_fs_data_t* data) {
+    unsigned long long free = data->free_blocks > data->dirty_blocks ? data->free_blocks - data->dirty_blocks : 0;
+
+    data->fs->free_size = free * data->block_size;
+}
+
+// Start an update of at most credits metadata blocks
+static int ext4_start(ext4_fs_data_t* data, unsigned int credits, ext4_handle_t* handle) {
+    handle->nr_pages = 0;
+
+    if (data->journal) {
+        return jbd2_start(data->journal, credits, &handle->journal);
+    }
+
+    return 0;
+}
+
+// Get a metadata block for modification under a handle
+//
+// The pointer stays valid until the handle is stopped.
+static unsigned char* ext4_get_write_access(ext4_fs_data_t* data, ext4_handle_t* handle, unsigned long long block) {
+    if (data->journal) {
+        return jbd2_get_write_access(&handle->journal, block);
+    }
+
+    if (block >= data->blocks_count) {
+        KLOG(&ext4_log, KLOG_ERR, "Block %llu out of range\n", block);
+        return NULL;
+    }
+
+    unsigned long long offset = block * data->block_size;
+    page_t* page = page_cache_get_page(data->bdev, (unsigned int) (offset / PAGE_CACHE_PAGE_SIZE));
+
+    if (!page) {
+        return NULL;
+    }
+
+    unsigned int i = 0;
+
+    while (i < handle->nr_pages && handle->pages[i] != page) {
+        i++;
+    }
+
+    if (i == handle->nr_pages) {
+        if (handle->nr_pages == EXT4_HANDLE_MAX_BLOCKS) {
+            KLOG(&ext4_log, KLOG_ERR, "Too many blocks in one update\n");
+            return NULL;
+        }
+
+        page_cache_pin(page);
+        handle->pages[handle->nr_pages++] = page;
+    }
+
+    return (unsigned char*) page->data + offset % PAGE_CACHE_PAGE_SIZE;
+}
+
+// Finish an update
+static int ext4_stop(ext4_fs_data_t* data, ext4_handle_t* handle) {
+    if (data->journal) {
+        return jbd2_stop(&handle->journal);
+    }
+
+    // Dirty every page before unpinning any, as marking one dirty may
+    // start writeback that evicts clean unpinned pages
+    for (unsigned int i = 0; i < handle->nr_pages; i++) {
+        page_cache_mark_dirty(handle->pages[i]);
+    }
+
+    for (unsigned int i = 0; i < handle->nr_pages; i++) {
+        page_cache_unpin(handle->pages[i]);
+    }
+
+    handle->nr_pages = 0;
+
+    return 0;
+}
+
+// Write the in-memory superblock under a handle
+static int ext4_write_superblock(ext4_fs_data_t* data, ext4_handle_t* handle) {
+    unsigned char* block = ext4_get_write_access(data, handle, 1024 / data->block_size);
+
+    if (!block) {
+        return -1;
+    }
+
+    memcpy(block + 1024 % data->block_size, &data->superblock, sizeof(ext4_superblock_t));
+
+    return 0;
+}
+
+// Keep the inode cache in step with a file's in-memory inode, dirty until
+// the inode is written
+static void ext4_icache_update(ext4_fs_data_t* data, ext4_file_t* file) {
+    inode_t* cached = icache_get(data->fs, file->ino, NULL);
+
+    if (cached) {
+        memcpy(cached->raw, &file->inode, sizeof(ext4_inode_t));
+
+        if (file->inode_dirty) {
+            icache_mark_dirty(cached);
+        } else {
+            icache_mark_clean(cached);
+        }
+
+        icache_put(cached);
+    }
+}
+
+// Write a file's inode to the inode table under a handle
+static int ext4_write_inode(ext4_fs_data_t* data, ext4_handle_t* handle, ext4_file_t* file) {
+    unsigned long long block;
+    unsigned int offset;
+
+    if (ext4_inode_location(data, file->ino, &block, &offset) != 0) {
+        return -1;
+    }
+
+    unsigned char* buffer = ext4_get_write_access(data, handle, block);
+
+    if (!buffer) {
+        return -1;
+    }
+
+    // Only the base inode is written; the extra fields stay as they are
+    memcpy(buffer + offset, &file->inode, sizeof(ext4_inode_t));
+    file->inode_dirty = 0;
+
+    if (data->journal) {
+        file->tid = handle->journal.tid;
+    }
+
+    ext4_icache_update(data, file);
+
+    return 0;
+}
+
+// Write a file's inode if it changed since it was last written
+static int ext4_sync_inode(ext4_fs_data_t* data, ext4_file_t* file) {
+    ext4_handle_t handle;
+
+    if (!file->inode_dirty) {
+        return 0;
+    }
+
+    if (ext4_start(data, 1, &handle) != 0) {
+        return -1;
+    }
+
+    int result = ext4_write_inode(data, &handle, file);
+
+    if (ext4_stop(data, &handle) != 0) {
+        result = -1;
+    }
+
+    return result;
+}
+
+// Write an inode cache entry back (sb is the filesystem_t)
+//
+// An open file's own inode is at least as new as the cached copy, so that
+// is what gets written.
+static int ext4_icache_write(void* sb, unsigned int ino, const void* raw) {
+    ext4_fs_data_t* data = (ext4_fs_data_t*) ((filesystem_t*) sb)->private_data;
+
+    for (int i = 0; i < EXT4_MAX_FILES; i++) {
+        if (data->files[i] && data->files[i]->ino == ino) {
+            return ext4_sync_inode(data, data->files[i]);
+        }
+    }
+
+    unsigned long long block;
+    unsigned int offset;
+    ext4_handle_t handle;
+
+    if (ext4_inode_location(data, ino, &block, &offset) != 0 || ext4_start(data, 1, &handle) != 0) {
+        return -1;
+    }
+
+    unsigned char* buffer = ext4_get_write_access(data, &handle, block);
+    int result = -1;
+
+    if (buffer) {
+        memcpy(buffer + offset, raw, sizeof(ext4_inode_t));
+        result = 0;
+    }
+
+    if (ext4_stop(data, &handle) != 0) {
+        result = -1;
+    }
+
+    return result;
+}
+
+// Update the CRC16 of a block group descriptor (gdt_csum file systems)
+static void ext4_desc_checksum(ext4_fs_data_t* data, unsigned int group, unsigned char* desc) {
+    if (!(data->superblock.feature_ro_compat & EXT4_FEATURE_RO_COMPAT_GDT_CSUM)) {
+        return;
+    }
+
+    // CRC16 of the UUID, the little-endian group number and the descriptor
+    // without the checksum field
+    unsigned char number[4] = { group, group >> 8, group >> 16, group >> 24 };
+    unsigned short crc = 0xFFFF;
+
+    for (unsigned int i = 0; i < 16 + 4 + data->desc_size; i++) {
+        unsigned char byte;
+
+        if (i < 16) {
+            byte = data->superblock.uuid[i];
+        } else if (i < 20) {
+            byte = number[i - 16];
+        } else if (i - 20 == 30 || i - 20 == 31) {
+            continue;
+        } else {
+            byte = desc[i - 20];
+        }
+
+        crc ^= byte;
+
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+        }
+    }
+
+    ((ext4_group_desc_t*) desc)->checksum = crc;
+}
+
+// Get the first block of a block group
+static unsigned long long ext4_group_first_block(ext4_fs_data_t* data, unsigned int group) {
+    return data->superblock.first_data_block + (unsigned long long) group * data->blocks_per_group;
+}
+
+// Get the number of blocks in a block group (the last one may be short)
+static unsigned int ext4_group_blocks(ext4_fs_data_t* data, unsigned int group) {
+    unsigned long long left = data->blocks_count - ext4_group_first_block(data, group);
+
+    return left < data->blocks_per_group ? (unsigned int) left : data->blocks_per_group;
+}
+
+// Check if a block group holds a backup of the superblock and descriptors
+static int ext4_group_has_super(ext4_fs_data_t* data, unsigned int group) {
+    if (group <= 1 || !(data->superblock.feature_ro_compat & EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER)) {
+        return 1;
+    }
+
+    // Sparse superblocks: only in powers of 3, 5 and 7
+    for (unsigned int base = 3; base <= 7; base += 2) {
+        unsigned int power = base;
+
+        while (power < group) {
+            power *= base;
+        }
+
+        if (power == group) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Bitmap helpers (bit 0 is the lowest bit of the first byte)
+static int ext4_test_bit(const unsigned char* map, unsigned int bit) {
+    return (map[bit / 8] >> (bit % 8)) & 1;
+}
+
+static void ext4_set_bit(unsigned char* map, unsigned int bit) {
+    map[bit / 8] |= 1 << (bit % 8);
+}
+
+static void ext4_clear_bit(unsigned char* map, unsigned int bit) {
+    map[bit / 8] &= ~(1 << (bit % 8));
+}
+
+// Mark the blocks of [start, start + count) that lie in a group used in its bitmap
+static void ext4_bitmap_mark(unsigned char* bitmap, unsigned long long first, unsigned int blocks, unsigned long long start, unsigned int count) {
+    unsigned long long end = start + count;
+
+    if (start < first) {
+        start = first;
+    }
+
+    if (end > first + blocks) {
+        end = first + blocks;
+    }
+
+    for (; start < end; start++) {
+        ext4_set_bit(bitmap, (unsigned int) (start - first));
+    }
+}
+
+// Build the block bitmap of a group mkfs left uninitialized (BLOCK_UNINIT)
+//
+// Only the superblock backup and the group metadata placed in the group
+// (with flex_bg, possibly that of other groups) are in use.
+static int ext4_init_block_bitmap(ext4_fs_data_t* data, unsigned int group, unsigned char* bitmap) {
+    unsigned long long first = ext4_group_first_block(data, group);
+    unsigned int blocks = ext4_group_blocks(data, group);
+    unsigned int table_blocks = (data->inodes_per_group * data->inode_size + data->block_size - 1) / data->block_size;
+
+    memset(bitmap, 0, data->block_size);
+
+    // Bits past the end of the group count as used
+    for (unsigned int bit = blocks; bit < data->block_size * 8; bit++) {
+        ext4_set_bit(bitmap, bit);
+    }
+
+    if (ext4_group_has_super(data, group)) {
+        unsigned int desc_blocks = (data->groups_count * data->desc_size + data->block_size - 1) / data->block_size;
+        ext4_bitmap_mark(bitmap, first, blocks, first, 1 + desc_blocks + data->superblock.reserved_gdt_blocks);
+    }
+
+    for (unsigned int other = 0; other < data->groups_count; other++) {
+        ext4_group_desc_t desc;
+
+        if (ext4_read_group_desc(data, other, &desc) != 0) {
+            return -1;
+        }
+
+        ext4_bitmap_mark(bitmap, first, blocks, desc.block_bitmap_lo | (unsigned long long) desc.block_bitmap_hi << 32, 1);
+        ext4_bitmap_mark(bitmap, first, blocks, desc.inode_bitmap_lo | (unsigned long long) desc.inode_bitmap_hi << 32, 1);
+        ext4_bitmap_mark(bitmap, first, blocks, desc.inode_table_lo | (unsigned long long) desc.inode_table_hi << 32, table_blocks);
+    }
+
+    return 0;
+}
+
+// Check if a group's block bitmap was never initialized
+static int ext4_block_uninit(ext4_fs_data_t* data, unsigned short flags) {
+    return (flags & EXT4_BG_BLOCK_UNINIT) && (data->superblock.feature_ro_compat & EXT4_FEATURE_RO_COMPAT_GDT_CSUM);
+}
+
+// Mark blocks of a loaded group used or free in its buddy
+static void ext4_mb_mark(ext4_fs_data_t* data, unsigned int group, unsigned int bit, unsigned int count, int used) {
+    ext4_group_info_t* info = &data->groups[group];
+    unsigned int blocks = ext4_group_blocks(data, group);
+
+    // Each order is derived from the one below, so they go upwards
+    for (unsigned int order = 0; order < data->mb_orders; order++) {
+        unsigned char* map = info->buddy + data->mb_offsets[order];
+        const unsigned char* below = info->buddy + data->mb_offsets[order > 0 ? order - 1 : 0];
+        unsigned int chunk = bit >> order;
+        unsigned int last = (bit + count - 1) >> order;
+        unsigned int chunks = blocks >> order;
+
+        for (; chunk <= last && chunk < chunks; chunk++) {
+            if (used) {
+                if (ext4_test_bit(map, chunk)) {
+                    ext4_clear_bit(map, chunk);
+                    info->chunks[order]--;
+                }
+            } else if (!ext4_test_bit(map, chunk) &&
+                       (order == 0 || (ext4_test_bit(below, 2 * chunk) && ext4_test_bit(below, 2 * chunk + 1)))) {
+                ext4_set_bit(map, chunk);
+                info->chunks[order]++;
+            }
+        }
+    }
+
+    info->free = used ? info->free - count : info->free + count;
+}
+
+// Get a group's allocator state, building its buddy from the block bitmap
+// on first use; returns NULL if nothing can be allocated from the group
+static ext4_group_info_t* ext4_mb_load(ext4_fs_data_t* data, unsigned int group) {
+    ext4_group_info_t* info = &data->groups[group];
+
+    if (info->buddy) {
+        return info;
+    }
+
+    if (info->flags & EXT4_MB_GROUP_CORRUPT) {
+        return NULL;
+    }
+
+    unsigned char* bitmap = (unsigned char*) allocate_block();
+    unsigned char* buddy = (unsigned char*) allocate_blocks(data->mb_buddy_blocks);
+    ext4_group_desc_t desc;
+    int result = -1;
+
+    if (bitmap && buddy && ext4_read_group_desc(data, group, &desc) == 0) {
+        if (ext4_block_uninit(data, desc.flags)) {
+            result = ext4_init_block_bitmap(data, group, bitmap);
+        } else {
+            const unsigned char* block = ext4_get_block(data, desc.block_bitmap_lo | (unsigned long long) desc.block_bitmap_hi << 32);
+
+            if (block) {
+                memcpy(bitmap, block, data->block_size);
+                result = 0;
+            }
+        }
+    }
+
+    if (result != 0) {
+        if (bitmap) {
+            free_block(bitmap);
+        }
+
+        if (buddy) {
+            free_blocks(buddy, data->mb_buddy_blocks);
+        }
+
+        return NULL;
+    }
+
+    unsigned int expected = info->free;
+    unsigned int blocks = ext4_group_blocks(data, group);
+    unsigned int bit = 0;
+
+    memset(buddy, 0, data->mb_buddy_blocks * MEMORY_BLOCK_SIZE);
+    memset(info->chunks, 0, sizeof(info->chunks));
+    info->buddy = buddy;
+    info->free = 0;
+
+    // Add the free runs of the bitmap
+    while (bit < blocks) {
+        if (ext4_test_bit(bitmap, bit)) {
+            bit++;
+            continue;
+        }
+
+        unsigned int start = bit;
+
+        while (bit < blocks && !ext4_test_bit(bitmap, bit)) {
+            bit++;
+        }
+
+        ext4_mb_mark(data, group, start, bit - start, 0);
+    }
+
+    free_block(bitmap);
+
+    // Allocating from a group whose bitmap and descriptor disagree could
+    // hand out blocks in use, so it is left alone
+    if (info->free != expected) {
+        KLOG(&ext4_log, KLOG_ERR, "Block group %u has %u free blocks in its bitmap, %u in its descriptor\n", group, info->free, expected);
+        free_blocks(buddy, data->mb_buddy_blocks);
+        info->buddy = NULL;
+        info->free = 0;
+        info->flags |= EXT4_MB_GROUP_CORRUPT;
+        data->free_blocks -= expected;
+        return NULL;
+    }
+
+    return info;
+}
+
+// Count the free blocks of a loaded group from a bit on, up to length
+static unsigned int ext4_mb_free_run(ext4_fs_data_t* data, ext4_group_info_t* info, unsigned int blocks, unsigned int bit, unsigned int length) {
+    unsigned int run = 0;
+
+    while (run < length && bit + run < blocks) {
+        unsigned int position = bit + run;
+        unsigned int order = data->mb_orders - 1;
+
+        // Step over the largest free chunk starting here
+        while (order > 0 && ((position & ((1u << order) - 1)) || !ext4_test_bit(info->buddy + data->mb_offsets[order], position >> order))) {
+            order--;
+        }
+
+        if (order == 0 && !ext4_test_bit(info->buddy, position)) {
+            break;
+        }
+
+        run += 1u << order;
+    }
+
+    return run < length ? run : length;
+}
+
+// Find the first free chunk of an order at or after a chunk number
+static unsigned int ext4_mb_find_chunk(ext4_fs_data_t* data, ext4_group_info_t* info, unsigned int order, unsigned int chunk, unsigned int chunks) {
+    const unsigned char* map = info->buddy + data->mb_offsets[order];
+
+    while (chunk < chunks) {
+        if (chunk % 8 == 0 && map[chunk / 8] == 0) {
+            chunk += 8;
+            continue;
+        }
+
+        if (ext4_test_bit(map, chunk)) {
+            return chunk;
+        }
+
+        chunk++;
+    }
+
+    return EXT4_MB_NONE;
+}
+
+// Take blocks of a loaded group from the allocator
+static unsigned long long ext4_mb_take(ext4_fs_data_t* data, unsigned int group, unsigned int bit, unsigned int count) {
+    ext4_mb_mark(data, group, bit, count, 1);
+    data->free_blocks -= count;
+
+    return ext4_group_first_block(data, group) + bit;
+}
+
+// Give blocks taken with ext4_mb_new_blocks() back before they are recorded
+static void ext4_mb_release(ext4_fs_data_t* data, unsigned long long start, unsigned int count) {
+    unsigned long long offset = start - data->superblock.first_data_block;
+
+    ext4_mb_mark(data, (unsigned int) (offset / data->blocks_per_group), (unsigned int) (offset % data->blocks_per_group), count, 0);
+    data->free_blocks += count;
+}
+
+// Allocate up to length contiguous blocks near a goal block
+//
+// Returns the first block (0 if the file system is full) with the number
+// allocated in *count. The goal is taken if enough blocks are free there;
+// otherwise groups are searched from the goal's on for a free chunk of the
+// largest order the request fills, falling back to smaller orders only
+// when no group has one. The blocks are only taken from the buddy here;
+// ext4_mb_record() puts them in the on-disk bitmap.
+static unsigned long long ext4_mb_new_blocks(ext4_fs_data_t* data, unsigned long long goal, unsigned int length, unsigned int* count) {
+    unsigned long long first_block = data->superblock.first_data_block;
+    unsigned int best_group = 0;
+    unsigned int best_bit = 0;
+    unsigned int best_length = 0;
+
+    if (length > EXT4_EXTENT_INIT_MAX) {
+        length = EXT4_EXTENT_INIT_MAX;
+    }
+
+    if (length > data->blocks_per_group) {
+        length = data->blocks_per_group;
+    }
+
+    if (goal < first_block || goal >= data->blocks_count) {
+        goal = first_block;
+    }
+
+    unsigned int goal_group = (unsigned int) ((goal - first_block) / data->blocks_per_group);
+    unsigned int goal_bit = (unsigned int) ((goal - first_block) % data->blocks_per_group);
+    ext4_group_info_t* info = ext4_mb_load(data, goal_group);
+
+    if (info) {
+        best_group = goal_group;
+        best_bit = goal_bit;
+        best_length = ext4_mb_free_run(data, info, ext4_group_blocks(data, goal_group), goal_bit, length);
+
+        if (best_length == length) {
+            *count = length;
+            return ext4_mb_take(data, goal_group, goal_bit, length);
+        }
+    }
+
+    unsigned int order = 0;
+
+    while (order + 1 < data->mb_orders && (2u << order) <= length) {
+        order++;
+    }
+
+    while (1) {
+        for (unsigned int i = 0; i < data->groups_count; i++) {
+            unsigned int group = (goal_group + i) % data->groups_count;
+            info = &data->groups[group];
+
+            if (info->free < (1u << order) || !ext4_mb_load(data, group) || info->chunks[order] == 0) {
+                continue;
+            }
+
+            unsigned int blocks = ext4_group_blocks(data, group);
+            unsigned int chunks = blocks >> order;
+            unsigned int chunk = ext4_mb_find_chunk(data, info, order, group == goal_group ? goal_bit >> order : 0, chunks);
+
+            if (chunk == EXT4_MB_NONE) {
+                chunk = ext4_mb_find_chunk(data, info, order, 0, chunks);
+            }
+
+            for (unsigned int scanned = 0; chunk != EXT4_MB_NONE && scanned < EXT4_MB_SCAN_CHUNKS; scanned++) {
+                unsigned int run = ext4_mb_free_run(data, info, blocks, chunk << order, length);
+
+                if (run == length) {
+                    *count = length;
+                    return ext4_mb_take(data, group, chunk << order, length);
+                }
+
+                if (run > best_length) {
+                    best_group = group;
+                    best_bit = chunk << order;
+                    best_length = run;
+                }
+
+                chunk = ext4_mb_find_chunk(data, info, order, chunk + 1, chunks);
+            }
+        }
+
+        if (best_length >= (1u << order)) {
+            *count = best_length;
+            return ext4_mb_take(data, best_group, best_bit, best_length);
+        }
+
+        if (order == 0) {
+            return 0;
+        }
+
+        order--;
+    }
+}
+
+// Record blocks taken from the allocator in the on-disk bitmap, the
+// group descriptor and the superblock
+static int ext4_mb_record(ext4_fs_data_t* data, ext4_handle_t* handle, unsigned long long start, unsigned int count) {
+    unsigned long long offset = start - data->superblock.first_data_block;
+    unsigned int group = (unsigned int) (offset / data->blocks_per_group);
+    unsigned int bit = (unsigned int) (offset % data->blocks_per_group);
+    ext4_group_desc_t copy;
+    unsigned int desc_offset;
+
+    if (ext4_read_group_desc(data, group, &copy) != 0) {
+        return -1;
+    }
+
+    unsigned char* block = ext4_get_write_access(data, handle, ext4_desc_block(data, group, &desc_offset));
+    unsigned char* bitmap = ext4_get_write_access(data, handle, copy.block_bitmap_lo | (unsigned long long) copy.block_bitmap_hi << 32);
+
+    if (!block || !bitmap) {
+        return -1;
+    }
+
+    ext4_group_desc_t* desc = (ext4_group_desc_t*) (block + desc_offset);
+
+    if (ext4_block_uninit(data, desc->flags)) {
+        if (ext4_init_block_bitmap(data, group, bitmap) != 0) {
+            return -1;
+        }
+
+        desc->flags &= ~EXT4_BG_BLOCK_UNINIT;
+    }
+
+    for (unsigned int i = 0; i < count; i++) {
+        if (ext4_test_bit(bitmap, bit + i)) {
+            KLOG(&ext4_log, KLOG_ERR, "Allocated block %llu is already in use\n", start + i);
+            return -1;
+        }
+
+        ext4_set_bit(bitmap, bit + i);
+    }
+
+    // The high halves are only there in 64-byte descriptors
+    unsigned int free = desc->free_blocks_count_lo;
+
+    if (data->desc_size >= 64) {
+        free |= (unsigned int) desc->free_blocks_count_hi << 16;
+    }
+
+    free -= count;
+    desc->free_blocks_count_lo = (unsigned short) free;
+
+    if (data->desc_size >= 64) {
+        desc->free_blocks_count_hi = (unsigned short) (free >> 16);
+    }
+
+    ext4_desc_checksum(data, group, (unsigned char*) desc);
+
+    unsigned long long total = data->superblock.free_blocks_count;
+
+    if (data->superblock.feature_incompat & EXT4_FEATURE_INCOMPAT_64BIT) {
+        total |= (unsigned long long) data->superblock.free_blocks_count_hi << 32;
+        data->superblock.free_blocks_count_hi = (unsigned int) ((total - count) >> 32);
+    }
+
+    data->superblock.free_blocks_count = (unsigned int) (total - count);
+
+    return ext4_write_superblock(data, handle);
+}
+
+// Add blocks to a file's block count (in 512-byte units unless huge)
+static void ext4_inode_add_blocks(ext4_fs_data_t* data, ext4_file_t* file, unsigned int count) {
+    unsigned long long blocks = file->inode.blocks | (unsigned long long) (file->inode.osd2[0] & 0xFFFF) << 32;
+
+    blocks += (file->inode.flags & EXT4_HUGE_FILE_FL) ? count : (unsigned long long) count * (data->block_size / 512);
+    file->inode.blocks = (unsigned int) blocks;
+    file->inode.osd2[0] = (file->inode.osd2[0] & 0xFFFF0000) | (unsigned int) ((blocks >> 32) & 0xFFFF);
+}
+
+// Get the first physical block of an extent
+static unsigned long long ext4_extent_start(const ext4_extent_t* extent) {
+    return extent->start_lo | (unsigned long long) extent->start_hi << 32;
+}
+
+// Set the first physical block of an extent
+static void ext4_extent_set_start(ext4_extent_t* extent, unsigned long long start) {
+    extent->start_lo = (unsigned int) start;
+    extent->start_hi = (unsigned short) (start >> 32);
+}
+
+// Get the number of blocks an extent covers, initialized or not
+static unsigned int ext4_extent_length(const ext4_extent_t* extent) {
+    return extent->len > EXT4_EXTENT_INIT_MAX ? extent->len - EXT4_EXTENT_INIT_MAX : extent->len;
+}
+
+// Point an index entry at a node
+static void ext4_extent_idx_set(ext4_extent_idx_t* index, unsigned int logical, unsigned long long block) {
+    index->block = logical;
+    index->leaf_lo = (unsigned int) block;
+    index->leaf_hi = (unsigned short) (block >> 32);
+    index->unused = 0;
+}
+
+// Node on the way from the extent tree root to a leaf
+typedef struct {
+    unsigned char* node;
+    unsigned int index;             // Entry followed, or in a leaf where a new extent goes
+} ext4_extent_path_t;
+
+// Metadata blocks one extent insert may change: the bitmap and descriptor
+// of the data blocks, the superblock, the inode, the nodes on the path,
+// and for each level split or added a new node with its bitmap and descriptor
+static unsigned int ext4_extent_credits(ext4_file_t* file) {
+    unsigned int depth = ((const ext4_extent_header_t*) file->inode.block)->depth;
+
+    return 4 + depth + 3 * (depth + 2);
+}
+
+// Walk the extent tree towards a logical block, getting write access to
+// every node; returns the depth of the tree or -1
+static int ext4_extent_find(ext4_fs_data_t* data, ext4_handle_t* handle, ext4_file_t* file, unsigned int logical, ext4_extent_path_t* path) {
+    unsigned char* node = (unsigned char*) file->inode.block;
+    int depth = ((const ext4_extent_header_t*) node)->depth;
+
+    for (int level = 0; ; level++) {
+        ext4_extent_header_t* header = (ext4_extent_header_t*) node;
+        unsigned int position = 0;
+
+        if (header->magic != EXT4_EXTENT_MAGIC || header->depth != depth - level || depth > EXT4_EXTENT_MAX_DEPTH) {
+            KLOG(&ext4_log, KLOG_ERR, "Corrupt extent tree in inode %u\n", file->ino);
+            return -1;
+        }
+
+        path[level].node = node;
+
+        if (level == depth) {
+            const ext4_extent_t* extent = (const ext4_extent_t*) (header + 1);
+
+            while (position < header->entries && extent[position].block <= logical) {
+                position++;
+            }
+
+            path[level].index = position;
+            return depth;
+        }
+
+        const ext4_extent_idx_t* index = (const ext4_extent_idx_t*) (header + 1);
+
+        if (header->entries == 0) {
+            KLOG(&ext4_log, KLOG_ERR, "Corrupt extent tree in inode %u\n", file->ino);
+            return -1;
+        }
+
+        while (position + 1 < header->entries && index[position + 1].block <= logical) {
+            position++;
+        }
+
+        path[level].index = position;
+        node = ext4_get_write_access(data, handle, index[position].leaf_lo | (unsigned long long) index[position].leaf_hi << 32);
+
+        if (!node) {
+            return -1;
+        }
+    }
+}
+
+// Allocate and record an empty extent tree node
+static unsigned char* ext4_extent_new_node(ext4_fs_data_t* data, ext4_handle_t* handle, ext4_file_t* file, unsigned int depth, unsigned long long* block) {
+    unsigned int count;
+
+    // Tree nodes go near the inode, out of the way of the data
+    *block = ext4_mb_new_blocks(data, ext4_group_first_block(data, (file->ino - 1) / data->inodes_per_group), 1, &count);
+
+    if (*block == 0) {
+        KLOG(&ext4_log, KLOG_ERR, "No space for the extent tree of inode %u\n", file->ino);
+        return NULL;
+    }
+
+    if (ext4_mb_record(data, handle, *block, 1) != 0) {
+        return NULL;
+    }
+
+    unsigned char* node = ext4_get_write_access(data, handle, *block);
+
+    if (!node) {
+        return NULL;
+    }
+
+    memset(node, 0, data->block_size);
+
+    ext4_extent_header_t* header = (ext4_extent_header_t*) node;
+    header->magic = EXT4_EXTENT_MAGIC;
+    header->max = (data->block_size - sizeof(ext4_extent_header_t)) / sizeof(ext4_extent_t);
+    header->depth = depth;
+
+    ext4_inode_add_blocks(data, file, 1);
+
+    return node;
+}
+
+// Add a level to the extent tree: the root's entries move to a new node,
+// which becomes the root's only child
+static int ext4_extent_grow(ext4_fs_data_t* data, ext4_handle_t* handle, ext4_file_t* file) {
+    ext4_extent_header_t* root = (ext4_extent_header_t*) file->inode.block;
+    unsigned long long block;
+
+    if (root->depth >= EXT4_EXTENT_MAX_DEPTH) {
+        KLOG(&ext4_log, KLOG_ERR, "Extent tree of inode %u is too deep\n", file->ino);
+        return -1;
+    }
+
+    unsigned char* node = ext4_extent_new_node(data, handle, file, root->depth, &block);
+
+    if (!node) {
+        return -1;
+    }
+
+    ext4_extent_header_t* child = (ext4_extent_header_t*) node;
+
+    memcpy(child + 1, root + 1, root->entries * sizeof(ext4_extent_t));
+    child->entries = root->entries;
+
+    ext4_extent_idx_set((ext4_extent_idx_t*) (root + 1), ((const ext4_extent_t*) (child + 1))->block, block);
+    root->entries = 1;
+    root->depth++;
+
+    return 0;
+}
+
+// Split a full node of the extent tree whose parent has room
+//
+// Appends at the right edge of the tree start a new node with little or
+// nothing in it, so files written in order keep full nodes; anything else
+// splits the node in half.
+static int ext4_extent_split(ext4_fs_data_t* data, ext4_handle_t* handle, ext4_file_t* file, ext4_extent_path_t* path, int level, int depth, unsigned int logical, int appending) {
+    ext4_extent_header_t* header = (ext4_extent_header_t*) path[level].node;
+    unsigned int entries = header->entries;
+    unsigned int split = entries / 2;
+    unsigned long long block;
+
+    if (appending) {
+        split = level == depth ? entries : entries - 1;
+    }
+
+    unsigned char* node = ext4_extent_new_node(data, handle, file, depth - level, &block);
+
+    if (!node) {
+        return -1;
+    }
+
+    ext4_extent_header_t* sibling = (ext4_extent_header_t*) node;
+
+    memcpy(sibling + 1, (unsigned char*) (header + 1) + split * sizeof(ext4_extent_t), (entries - split) * sizeof(ext4_extent_t));
+    sibling->entries = entries - split;
+    header->entries = split;
+
+    // Extents and index entries both start with their first logical block
+    unsigned int key = sibling->entries > 0 ? ((const ext4_extent_t*) (sibling + 1))->block : logical;
+
+    ext4_extent_header_t* parent = (ext4_extent_header_t*) path[level - 1].node;
+    ext4_extent_idx_t* index = (ext4_extent_idx_t*) (parent + 1);
+    unsigned int position = path[level - 1].index + 1;
+
+    memmove(&index[position + 1], &index[position], (parent->entries - position) * sizeof(ext4_extent_idx_t));
+    ext4_extent_idx_set(&index[position], key, block);
+    parent->entries++;
+
+    return 0;
+}
+
+// Lower the index keys above a leaf whose first extent now starts earlier
+static void ext4_extent_update_keys(ext4_extent_path_t* path, int depth, unsigned int logical) {
+    for (int level = depth - 1; level >= 0; level--) {
+        ext4_extent_idx_t* index = (ext4_extent_idx_t*) (path[level].node + sizeof(ext4_extent_header_t)) + path[level].index;
+
+        if (index->block <= logical) {
+            return;
+        }
+
+        index->block = logical;
+
+        if (path[level].index != 0) {
+            return;
+        }
+    }
+}
+
+// Add newly allocated blocks to a file's extent tree, extending a
+// neighbouring extent when they continue it
+static int ext4_extent_insert(ext4_fs_data_t* data, ext4_handle_t* handle, ext4_file_t* file, unsigned int logical, unsigned long long physical, unsigned int length) {
+    ext4_extent_path_t path[EXT4_EXTENT_MAX_DEPTH + 1];
+
+    while (1) {
+        int depth = ext4_extent_find(data, handle, file, logical, path);
+
+        if (depth < 0) {
+            return -1;
+        }
+
+        ext4_extent_header_t* header = (ext4_extent_header_t*) path[depth].node;
+        ext4_extent_t* extent = (ext4_extent_t*) (header + 1);
+        unsigned int position = path[depth].index;
+
+        // Blocks are only ever allocated for holes (uninitialized extents
+        // map to no blocks, but are not holes)
+        if ((position > 0 && extent[position - 1].block + ext4_extent_length(&extent[position - 1]) > logical) ||
+            (position < header->entries && extent[position].block < logical + length)) {
+            KLOG(&ext4_log, KLOG_ERR, "Block %u of inode %u is already mapped\n", logical, file->ino);
+            return -1;
+        }
+
+        if (position > 0) {
+            ext4_extent_t* before = &extent[position - 1];
+
+            if (before->len + length <= EXT4_EXTENT_INIT_MAX && before->block + before->len == logical &&
+                ext4_extent_start(before) + before->len == physical) {
+                before->len += length;
+                return 0;
+            }
+        }
+
+        if (position < header->entries) {
+            ext4_extent_t* after = &extent[position];
+
+            if (after->len + length <= EXT4_EXTENT_INIT_MAX && logical + length == after->block &&
+                physical + length == ext4_extent_start(after)) {
+                after->block = logical;
+                after->len += length;
+                ext4_extent_set_start(after, physical);
+
+                if (position == 0) {
+                    ext4_extent_update_keys(path, depth, logical);
+                }
+
+                return 0;
+            }
+        }
+
+        if (header->entries < header->max) {
+            memmove(&extent[position + 1], &extent[position], (header->entries - position) * sizeof(ext4_extent_t));
+            extent[position].block = logical;
+            extent[position].len = length;
+            ext4_extent_set_start(&extent[position], physical);
+            header->entries++;
+
+            if (position == 0) {
+                ext4_extent_update_keys(path, depth, logical);
+            }
+
+            return 0;
+        }
+
+        // The leaf is full: split the highest full node below one with
+        // room, or add a level if the root is full too, then try again
+        int level = depth;
+        int appending = position == header->entries;
+
+        while (level > 0 && ((const ext4_extent_header_t*) path[level - 1].node)->entries == ((const ext4_extent_header_t*) path[level - 1].node)->max) {
+            level--;
+        }
+
+        for (int i = 0; i < depth; i++) {
+            if (path[i].index + 1 != ((const ext4_extent_header_t*) path[i].node)->entries) {
+                appending = 0;
+            }
+        }
+
+        if (level == 0 ? ext4_extent_grow(data, handle, file) != 0 :
+                         ext4_extent_split(data, handle, file, path, level, depth, logical, appending) != 0) {
+            return -1;
+        }
+    }
+}
+
+// Count the blocks of a page not backed by a device block
+static int ext4_page_holes(ext4_fs_data_t* data, ext4_file_t* file, unsigned int index) {
+    unsigned int first = index * data->blocks_per_page;
+    unsigned int block = 0;
+    int holes = 0;
+
+    while (block < data->blocks_per_page) {
+        unsigned long long physical;
+        unsigned int run;
+
+        if (ext4_map_block(data, file, first + block, &physical, &run) != 0) {
+            return -1;
+        }
+
+        if (run == 0 || run > data->blocks_per_page - block) {
+            run = data->blocks_per_page - block;
+        }
+
+        if (!physical) {
+            // Cached extents without a physical start are preallocated ones
+            for (int i = 0; i < EXT4_EXTENT_CACHE_SIZE; i++) {
+                ext4_extent_cache_t* cached = &file->extent_cache[i];
+
+                if (cached->length && !cached->physical && first + block - cached->logical < cached->length) {
+                    KLOG(&ext4_log, KLOG_ERR, "Writing to preallocated blocks of inode %u is not supported\n", file->ino);
+                    return -1;
+                }
+            }
+
+            holes += run;
+        }
+
+        block += run;
+    }
+
+    return holes;
+}
+
+// Pick the block to allocate for a file block: right after the block
+// before it if that is allocated, else the start of the inode's group
+static unsigned long long ext4_alloc_goal(ext4_fs_data_t* data, ext4_file_t* file, unsigned int logical) {
+    unsigned long long physical = 0;
+    unsigned int run;
+
+    if (logical > 0 && ext4_map_block(data, file, logical - 1, &physical, &run) == 0 && physical) {
+        return physical + 1;
+    }
+
+    return ext4_group_first_block(data, (file->ino - 1) / data->inodes_per_group);
+}
+
+// Map a file block at writeback, trying the blocks just allocated first
+//
+// Holes are reported one block at a time, as part of one may be allocated.
+static int ext4_writeback_map(ext4_fs_data_t* data, ext4_file_t* file, const ext4_extent_cache_t* allocated, unsigned int nr_allocated,
+                              unsigned int logical, unsigned long long* physical, unsigned int* run) {
+    for (unsigned int i = 0; i < nr_allocated; i++) {
+        if (logical >= allocated[i].logical && logical - allocated[i].logical < allocated[i].length) {
+            *physical = allocated[i].physical + (logical - allocated[i].logical);
+            *run = allocated[i].length - (logical - allocated[i].logical);
+            return 0;
+        }
+    }
+
+    if (ext4_map_block(data, file, logical, physical, run) != 0) {
+        return -1;
+    }
+
+    if (*physical == 0) {
+        *run = 1;
+    }
+
+    return 0;
+}
+
+// Write a page of a file back (called by the page cache)
+//
+// This is where delayed allocation happens. A page with blocks that were
+// never allocated gets them here, together with the dirty pages after it,
+// so a file written in one go ends up in a few large extents. All those
+// pages are written before the extent tree and bitmaps pointing at their
+// blocks change, so the metadata never refers to blocks with stale data.
+static int ext4_writepage(page_mapping_t* mapping, unsigned int index, const void* buffer) {
+    ext4_file_t* file = (ext4_file_t*) mapping->private_data;
+    ext4_fs_data_t* data = file->data;
+    unsigned int blocks_per_page = data->blocks_per_page;
+    unsigned long long file_blocks = (file->size + data->block_size - 1) / data->block_size;
+    unsigned int first = index * blocks_per_page;
+
+    // Writeback started while changing the file's metadata has to wait
+    if (file->writing || !data->groups) {
+        return -1;
+    }
+
+    if (first >= file_blocks) {
+        return 0;
+    }
+
+    page_t* pages[EXT4_WRITEBACK_MAX_PAGES];
+    unsigned char holes[EXT4_WRITEBACK_MAX_PAGES];
+    unsigned int nr_pages = 1;
+    int page_holes = ext4_page_holes(data, file, index);
+
+    if (page_holes < 0) {
+        return -1;
+    }
+
+    // The pages stay pinned so that eviction for the metadata read below
+    // does not try to write them back in the middle of this
+    pages[0] = page_cache_find_page(mapping, index);
+    page_cache_pin(pages[0]);
+    holes[0] = page_holes;
+    file->writing = 1;
+
+    // Take the dirty pages that follow along
+    while (holes[0] > 0 && nr_pages < EXT4_WRITEBACK_MAX_PAGES && (unsigned long long) (first + nr_pages * blocks_per_page) < file_blocks) {
+        page_t* page = page_cache_find_page(mapping, index + nr_pages);
+
+        if (!page || !(page->flags & PAGE_DIRTY) || page->pins > 0 || (page_holes = ext4_page_holes(data, file, index + nr_pages)) < 0) {
+            break;
+        }
+
+        page_cache_pin(page);
+        pages[nr_pages] = page;
+        holes[nr_pages++] = page_holes;
+    }
+
+    unsigned long long end = (unsigned long long) (first + nr_pages * blocks_per_page) < file_blocks ? first + nr_pages * blocks_per_page : file_blocks;
+    ext4_extent_cache_t allocated[EXT4_WRITEBACK_MAX_EXTENTS];
+    unsigned int nr_allocated = 0;
+    unsigned int logical = holes[0] > 0 ? first : (unsigned int) end;
+
+    // Allocate the holes, in as few extents as free space allows
+    while (logical < end && (file->inode.flags & EXT4_EXTENTS_FL)) {
+        unsigned long long physical;
+        unsigned int run;
+
+        if (ext4_map_block(data, file, logical, &physical, &run) != 0) {
+            break;
+        }
+
+        if (run == 0 || run > end - logical) {
+            run = (unsigned int) (end - logical);
+        }
+
+        if (physical) {
+            logical += run;
+            continue;
+        }
+
+        ext4_extent_cache_t* last = nr_allocated > 0 ? &allocated[nr_allocated - 1] : NULL;
+        int follows = last && last->logical + last->length == logical;
+        unsigned int count;
+        unsigned long long start = ext4_mb_new_blocks(data, follows ? last->physical + last->length : ext4_alloc_goal(data, file, logical), run, &count);
+
+        if (!start) {
+            KLOG(&ext4_log, KLOG_ERR, "No space left to write inode %u\n", file->ino);
+            break;
+        }
+
+        if (follows && last->physical + last->length == start && last->length + count <= EXT4_EXTENT_INIT_MAX) {
+            last->length += count;
+        } else if (nr_allocated < EXT4_WRITEBACK_MAX_EXTENTS) {
+            allocated[nr_allocated].logical = logical;
+            allocated[nr_allocated].length = count;
+            allocated[nr_allocated].physical = start;
+            nr_allocated++;
+        } else {
+            ext4_mb_release(data, start, count);
+            break;
+        }
+
+        logical += count;
+    }
+
+    // Only pages whose blocks are all allocated are written
+    unsigned int done = 0;
+
+    while (done < nr_pages && (unsigned long long) (first + (done + 1) * blocks_per_page) <= logical) {
+        done++;
+    }
+
+    if (done < nr_pages && logical >= end) {
+        done++;
+    }
+
+    unsigned int limit = first + done * blocks_per_page;
+
+    for (unsigned int i = 0; i < nr_allocated; i++) {
+        if (allocated[i].logical >= limit) {
+            ext4_mb_release(data, allocated[i].physical, allocated[i].length);
+            allocated[i].length = 0;
+        } else if (allocated[i].logical + allocated[i].length > limit) {
+            ext4_mb_release(data, allocated[i].physical + (limit - allocated[i].logical), allocated[i].logical + allocated[i].length - limit);
+            allocated[i].length = limit - allocated[i].logical;
+        }
+    }
+
+    // The data first
+    int result = done > 0 ? 0 : -1;
+
+    for (unsigned int page = 0; page < done && result == 0; page++) {
+        const unsigned char* contents = (const unsigned char*) buffer;
+        unsigned int block = 0;
+        unsigned int blocks = blocks_per_page;
+
+        if (page > 0) {
+            contents = (const unsigned char*) pages[page]->data;
+        }
+
+        if (first + (page + 1) * blocks_per_page > file_blocks) {
+            blocks = (unsigned int) (file_blocks - (first + page * blocks_per_page));
+        }
+
+        while (block < blocks) {
+            unsigned long long physical;
+            unsigned int run;
+
+            if (ext4_writeback_map(data, file, allocated, nr_allocated, first + page * blocks_per_page + block, &physical, &run) != 0) {
+                result = -1;
+                break;
+            }
+
+            if (run > blocks - block) {
+                run = blocks - block;
+            }
+
+            if (physical && ext4_write_blocks(data, physical, run, contents + block * data->block_size) != 0) {
+                result = -1;
+                break;
+            }
+
+            block += run;
+        }
+    }
+
+    // Then the metadata pointing at it; the extent goes in first, as that
+    // fails without changing anything if the blocks are mapped already
+    unsigned int recorded = 0;
+
+    while (result == 0 && recorded < nr_allocated) {
+        ext4_extent_cache_t* extent = &allocated[recorded++];
+        ext4_handle_t handle;
+
+        if (extent->length == 0) {
+            continue;
+        }
+
+        if (ext4_start(data, ext4_extent_credits(file), &handle) != 0) {
+            result = -1;
+            recorded--;
+            break;
+        }
+
+        if (ext4_extent_insert(data, &handle, file, extent->logical, extent->physical, extent->length) != 0) {
+            // Nothing points at the blocks, so they go back with the rest
+            KLOG(&ext4_log, KLOG_ERR, "Failed to map blocks for inode %u\n", file->ino);
+            result = -1;
+            recorded--;
+        } else if (ext4_mb_record(data, &handle, extent->physical, extent->length) != 0) {
+            KLOG(&ext4_log, KLOG_ERR, "Failed to allocate blocks for inode %u\n", file->ino);
+            result = -1;
+        } else {
+            ext4_inode_add_blocks(data, file, extent->length);
+
+            if (ext4_write_inode(data, &handle, file) != 0) {
+                result = -1;
+            }
+        }
+
+        if (ext4_stop(data, &handle) != 0) {
+            result = -1;
+        }
+    }
+
+    for (unsigned int i = recorded; i < nr_allocated; i++) {
+        if (allocated[i].length > 0) {
+            ext4_mb_release(data, allocated[i].physical, allocated[i].length);
+        }
+    }
+
+    // A size or time change with no new blocks
+    if (result == 0 && ext4_sync_inode(data, file) != 0) {
+        result = -1;
+    }
+
+    // The pages written along with this one are clean now, and their
+    // reservations are used up
+    for (unsigned int page = 0; page < nr_pages; page++) {
+        page_cache_unpin(pages[page]);
+
+        if (result == 0 && page < done) {
+            unsigned long long reserved = holes[page];
+
+            if (page > 0) {
+                page_cache_mark_clean(pages[page]);
+            }
+
+            data->dirty_blocks -= reserved < data->dirty_blocks ? reserved : data->dirty_blocks;
+        }
+    }
+
+    ext4_update_free_size(data);
+    file->writing = 0;
+
+    return result;
+}
+
+// Free the block allocator
+static void ext4_free_allocator(ext4_fs_data_t* data) {
+    if (!data->groups) {
+        return;
+    }
+
+    for (unsigned int group = 0; group < data->groups_count; group++) {
+        if (data->groups[group].buddy) {
+            free_blocks(data->groups[group].buddy, data->mb_buddy_blocks);
+        }
+    }
+
+    free_blocks(data->groups, data->groups_blocks);
+    data->groups = NULL;
+}
+
+// Set up the block allocator, which writes need
+//
+// Returns -1 if the file system can only be read.
+static int ext4_init_allocator(ext4_fs_data_t* data) {
+    unsigned int unsupported = data->superblock.feature_ro_compat & ~EXT4_FEATURE_RO_COMPAT_WRITABLE;
+
+    if (unsupported) {
+        KLOG(&ext4_log, KLOG_INFO, "Read-only compatible features 0x%x are not supported for writing\n", unsupported);
+        return -1;
+    }
+
+    if (data->blocks_per_group > data->block_size * 8 || data->blocks_per_group > (1u << (EXT4_MB_ORDERS - 1)) * 2 - 1) {
+        return -1;
+    }
+
+    unsigned int offset = 0;
+
+    data->mb_orders = 0;
+
+    while (data->mb_orders < EXT4_MB_ORDERS && (data->blocks_per_group >> data->mb_orders) > 0) {
+        data->mb_offsets[data->mb_orders++] = offset;
+        offset += ((data->blocks_per_group >> (data->mb_orders - 1)) + 7) / 8;
+    }
+
+    data->mb_buddy_blocks = (offset + MEMORY_BLOCK_SIZE - 1) / MEMORY_BLOCK_SIZE;
+    data->groups_blocks = (data->groups_count * sizeof(ext4_group_info_t) + MEMORY_BLOCK_SIZE - 1) / MEMORY_BLOCK_SIZE;
+    data->groups = (ext4_group_info_t*) allocate_blocks(data->groups_blocks);
+
+    if (!data->groups) {
+        return -1;
+    }
+
+    memset(data->groups, 0, data->groups_blocks * MEMORY_BLOCK_SIZE);
+    data->free_blocks = 0;
+    data->dirty_blocks = 0;
+
+    // Buddies are built as groups are searched; until then the descriptors
+    // give the free counts
+    for (unsigned int group = 0; group < data->groups_count; group++) {
+        ext4_group_desc_t desc;
+
+        if (ext4_read_group_desc(data, group, &desc) != 0) {
+            ext4_free_allocator(data);
+            return -1;
+        }
+
+        data->groups[group].free = desc.free_blocks_count_lo | (unsigned int) desc.free_blocks_count_hi << 16;
+        data->free_blocks += data->groups[group].free;
+    }
+
+    return 0;
+}
+
+// Drop a cached file
+static void ext4_file_free(ext4_fs_data_t* data, int slot) {
+    ext4_file_t* file = data->files[slot];
+
+    // Dirty pages are written back while the file can still allocate for them
+    if ((file->mapping->nr_dirty > 0 && page_cache_sync(file->mapping) != 0) || ext4_sync_inode(data, file) != 0) {
+        KLOG(&ext4_log, KLOG_ERR, "Lost unwritten data of inode %u\n", file->ino);
+        page_cache_invalidate(file->mapping);
+    }
+
+    hashmap_remove(&data->file_map, file->path);
+    page_cache_release_mapping(file->mapping);
+    free_block(file);
+    data->files[slot] = NULL;
+}
+
+// Add a file to the file table, recycling the least recently used unopened entry
+static ext4_file_t* ext4_file_create(ext4_fs_data_t* data, const char* path, unsigned int ino) {
+    int slot = -1;
+
+    for (int i = 0; i < EXT4_MAX_FILES; i++) {
+        if (!data->files[i]) {
+            slot = i;
+            break;
+        }
+
+        if (data->files[i]->refcount == 0 &&
+            (slot < 0 || data->files[i]->last_used < data->files[slot]->last_used)) {
+            slot = i;
+        }
+    }
+
+    if (slot < 0) {
+        KLOG(&ext4_log, KLOG_WARNING, "File table full\n");
+        return NULL;
+    }
+
+    if (data->files[slot]) {
+        ext4_file_free(data, slot);
+    }
+
+    ext4_file_t* file = (ext4_file_t*) allocate_block();
+
+    if (!file) {
+        return NULL;
+    }
+
+    memset(file, 0, sizeof(ext4_file_t));
+    strcpy(file->path, path);
+    file->ino = ino;
+    file->data = data;
+
+    // Other paths to the same inode, and entries recycled from the table,
+    // find it in the inode cache
+    inode_t* cached = icache_get(data->fs, ino, &ext4_inode_ops);
+
+    if (!cached) {
+        free_block(file);
+        return NULL;
+    }
+
+    memcpy(&file->inode, cached->raw, sizeof(ext4_inode_t));
+    icache_put(cached);
+
+    file->size = file->inode.size;
+
+    if ((file->inode.mode & EXT4_S_IFMT) == EXT4_S_IFREG) {
+        file->size |= (unsigned long long) file->inode.size_high << 32;
+    }
+
+    // Nothing about the inode is waiting for a commit yet
+    file->tid = data->journal ? jbd2_running_tid(data->journal) - 1 : 0;
+
+    // Pages may still be cached from an earlier entry for the same inode
+    file->mapping = page_cache_get_mapping(data->fs, ino, &ext4_file_ops, file);
+
+    if (!file->mapping) {
+        free_block(file);
+        return NULL;
+    }
+
+    file->mapping->private_data = file;
+    file->mapping->size = file->size;
+
+    data->files[slot] = file;
+    hashmap_insert(&data->file_map, file->path, file);
+
+    return file;
+}
+
+// Search one directory block for a name
+//
+// Returns 0 with *ino set (0 if the name is not in the block), or -1 on error.
+static int ext4_search_dir_block(ext4_fs_data_t* data, ext4_file_t* dir, unsigned int logical, const char* name, unsigned int length, unsigned int* ino) {
+    unsigned long long physical;
+    unsigned int run;
+
+    *ino = 0;
+
+    if (ext4_map_block(data, dir, logical, &physical, &run) != 0) {
+        return -1;
+    }
+
+    if (physical == 0) {
+        return 0;
+    }
+
+    const unsigned char* block = ext4_get_block(data, physical);
+
+    if (!block) {
+        return -1;
+    }
+
+    unsigned int offset = 0;
+
+    while (offset + 8 <= data->block_size) {
+        const ext4_dir_entry_t* entry = (const ext4_dir_entry_t*) (block + offset);
+
+        if (entry->rec_len < 8 || offset + entry->rec_len > data->block_size) {
+            KLOG(&ext4_log, KLOG_ERR, "Corrupt directory entry in inode %u\n", dir->ino);
+            return -1;
+        }
+
+        if (entry->inode && entry->name_len == length && memcmp(entry->name, name, length) == 0) {
+            *ino = entry->inode;
+            return 0;
+        }
+
+        offset += entry->rec_len;
+    }
+
+    return 0;
+}
+
+// Pack a name into the hash input words, padding with the length
+static void ext4_str2hashbuf(const char* name, unsigned int length, unsigned int* buffer, int words, int unsigned_chars) {
+    unsigned int pad = length | (length << 8);
+    pad |= pad << 16;
+
+    unsigned int value = pad;
+
+    if (length > (unsigned int) words * 4) {
+        length = words * 4;
+    }
+
+    for (unsigned int i = 0; i < length; i++) {
+        int c = unsigned_chars ? (int) (unsigned char) name[i] : (int) (signed char) name[i];
+        value = (unsigned int) c + (value << 8);
+
+        if (i % 4 == 3) {
+            *buffer++ = value;
+            value = pad;
+            words--;
+        }
+    }
+
+    if (--words >= 0) {
+        *buffer++ = value;
+    }
+
+    while (--words >= 0) {
+        *buffer++ = pad;
+    }
+}
+
+#define EXT4_ROL32(x, s) (((x) << (s)) | ((x) >> (32 - (s))))
+#define EXT4_MD4_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define EXT4_MD4_G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define EXT4_MD4_H(x, y, z) ((x) ^ (y) ^ (z))
+#define EXT4_MD4_ROUND(f, a, b, c, d, x, s) ((a) += f((b), (c), (d)) + (x), (a) = EXT4_ROL32((a), (s)))
+#define EXT4_MD4_K2 0x5A827999
+#define EXT4_MD4_K3 0x6ED9EBA1
+
+// Half-MD4 compression of eight input words into the hash state
+static void ext4_half_md4_transform(unsigned int state[4], const unsigned int in[8]) {
+    unsigned int a = state[0];
+    unsigned int b = state[1];
+    unsigned int c = state[2];
+    unsigned int d = state[3];
+
+    // Round 1
+    EXT4_MD4_ROUND(EXT4_MD4_F, a, b, c, d, in[0], 3);
+    EXT4_MD4_ROUND(EXT4_MD4_F, d, a, b, c, in[1], 7);
+    EXT4_MD4_ROUND(EXT4_MD4_F, c, d, a, b, in[2], 11);
+    EXT4_MD4_ROUND(EXT4_MD4_F, b, c, d, a, in[3], 19);
+    EXT4_MD4_ROUND(EXT4_MD4_F, a, b, c, d, in[4], 3);
+    EXT4_MD4_ROUND(EXT4_MD4_F, d, a, b, c, in[5], 7);
+    EXT4_MD4_ROUND(EXT4_MD4_F, c, d, a, b, in[6], 11);
+    EXT4_MD4_ROUND(EXT4_MD4_F, b, c, d, a, in[7], 19);
+
+    // Round 2
+    EXT4_MD4_ROUND(EXT4_MD4_G, a, b, c, d, in[1] + EXT4_MD4_K2, 3);
+    EXT4_MD4_ROUND(EXT4_MD4_G, d, a, b, c, in[3] + EXT4_MD4_K2, 5);
+    EXT4_MD4_ROUND(EXT4_MD4_G, c, d, a, b, in[5] + EXT4_MD4_K2, 9);
+    EXT4_MD4_ROUND(EXT4_MD4_G, b, c, d, a, in[7] + EXT4_MD4_K2, 13);
+    EXT4_MD4_ROUND(EXT4_MD4_G, a, b, c, d, in[0] + EXT4_MD4_K2, 3);
+    EXT4_MD4_ROUND(EXT4_MD4_G, d, a, b, c, in[2] + EXT4_MD4_K2, 5);
+    EXT4_MD4_ROUND(EXT4_MD4_G, c, d, a, b, in[4] + EXT4_MD4_K2, 9);
+    EXT4_MD4_ROUND(EXT4_MD4_G, b, c, d, a, in[6] + EXT4_MD4_K2, 13);
+
+    // Round 3
+    EXT4_MD4_ROUND(EXT4_MD4_H, a, b, c, d, in[3] + EXT4_MD4_K3, 3);
+    EXT4_MD4_ROUND(EXT4_MD4_H, d, a, b, c, in[7] + EXT4_MD4_K3, 9);
+    EXT4_MD4_ROUND(EXT4_MD4_H, c, d, a, b, in[2] + EXT4_MD4_K3, 11);
+    EXT4_MD4_ROUND(EXT4_MD4_H, b, c, d, a, in[6] + EXT4_MD4_K3, 15);
+    EXT4_MD4_ROUND(EXT4_MD4_H, a, b, c, d, in[1] + EXT4_MD4_K3, 3);
+    EXT4_MD4_ROUND(EXT4_MD4_H, d, a, b, c, in[5] + EXT4_MD4_K3, 9);
+    EXT4_MD4_ROUND(EXT4_MD4_H, c, d, a, b, in[0] + EXT4_MD4_K3, 11);
+    EXT4_MD4_ROUND(EXT4_MD4_H, b, c, d, a, in[4] + EXT4_MD4_K3, 15);
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+}
+
+// Compute the half-MD4 directory hash of a name
+static unsigned int ext4_dx_hash(ext4_fs_data_t* data, const char* name, unsigned int length, int unsigned_chars) {
+    unsigned int state[4] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476 };
+    const unsigned int* seed = data->superblock.hash_seed;
+
+    if (seed[0] || seed[1] || seed[2] || seed[3]) {
+        memcpy(state, seed, sizeof(state));
+    }
+
+    unsigned int in[8];
+
+    while (1) {
+        ext4_str2hashbuf(name, length, in, 8, unsigned_chars);
+        ext4_half_md4_transform(state, in);
+
+        if (length <= 32) {
+            break;
+        }
+
+        name += 32;
+        length -= 32;
+    }
+
+    // The low bit marks hash collisions continued in the next block
+    unsigned int hash = state[1] & ~1u;
+
+    if (hash == (EXT4_HTREE_EOF << 1)) {
+        hash = (EXT4_HTREE_EOF - 1) << 1;
+    }
+
+    return hash;
+}
+
+// Get the entries of an htree index block (NULL if the block is not valid)
+static const ext4_dx_entry_t* ext4_dx_entries(ext4_fs_data_t* data, ext4_file_t* dir, unsigned int logical, int level, unsigned int* count) {
+    unsigned long long physical;
+    unsigned int run;
+
+    if (ext4_map_block(data, dir, logical, &physical, &run) != 0 || physical == 0) {
+        return NULL;
+    }
+
+    const unsigned char* block = ext4_get_block(data, physical);
+
+    if (!block) {
+        return NULL;
+    }
+
+    // The root follows "." and ".." and the root info; other nodes follow
+    // an empty directory entry spanning the block
+    unsigned int offset = 8;
+
+    if (level == 0) {
+        const ext4_dx_root_info_t* info = (const ext4_dx_root_info_t*) (block + EXT4_DX_ROOT_INFO_OFFSET);
+        offset = EXT4_DX_ROOT_INFO_OFFSET + info->info_length;
+    }
+
+    const ext4_dx_countlimit_t* countlimit = (const ext4_dx_countlimit_t*) (block + offset);
+
+    if (countlimit->count == 0 || countlimit->count > countlimit->limit ||
+        offset + countlimit->limit * sizeof(ext4_dx_entry_t) > data->block_size) {
+        return NULL;
+    }
+
+    *count = countlimit->count;
+
+    return (const ext4_dx_entry_t*) countlimit;
+}
+
+// Look a name up through the directory's htree index
+//
+// Returns 0 with *ino set (0 if not found), or -1 if the index cannot be
+// used and the caller should fall back to a linear scan.
+static int ext4_dx_find_entry(ext4_fs_data_t* data, ext4_file_t* dir, const char* name, unsigned int length, unsigned int* ino) {
+    unsigned long long physical;
+    unsigned int run;
+
+    if (ext4_map_block(data, dir, 0, &physical, &run) != 0 || physical == 0) {
+        return -1;
+    }
+
+    const unsigned char* root = ext4_get_block(data, physical);
+
+    if (!root) {
+        return -1;
+    }
+
+    const ext4_dx_root_info_t* info = (const ext4_dx_root_info_t*) (root + EXT4_DX_ROOT_INFO_OFFSET);
+    unsigned int max_levels = (data->superblock.feature_incompat & EXT4_FEATURE_INCOMPAT_LARGEDIR) ? EXT4_HTREE_MAX_LEVELS : EXT4_HTREE_MAX_LEVELS - 1;
+    unsigned int hash_version = info->hash_version;
+
+    if (info->reserved_zero != 0 || info->info_length != 8 || info->indirect_levels >= max_levels) {
+        KLOG(&ext4_log, KLOG_WARNING, "Invalid htree root in inode %u\n", dir->ino);
+        return -1;
+    }
+
+    // Signed and unsigned hashes differ for names with high-bit characters
+    if ((hash_version == EXT4_DX_HASH_HALF_MD4 || hash_version == EXT4_DX_HASH_HALF_MD4_UNSIGNED) &&
+        (data->superblock.flags & EXT4_FLAGS_UNSIGNED_HASH) && !(data->superblock.flags & EXT4_FLAGS_SIGNED_HASH)) {
+        hash_version = EXT4_DX_HASH_HALF_MD4_UNSIGNED;
+    }
+
+    if (hash_version != EXT4_DX_HASH_HALF_MD4 && hash_version != EXT4_DX_HASH_HALF_MD4_UNSIGNED) {
+        return -1;
+    }
+
+    unsigned int hash = ext4_dx_hash(data, name, length, hash_version == EXT4_DX_HASH_HALF_MD4_UNSIGNED);
+    unsigned int levels = info->indirect_levels + 1;
+
+    // Path through the index: block, chosen entry and entry count per level
+    unsigned int frame_block[EXT4_HTREE_MAX_LEVELS];
+    unsigned int frame_at[EXT4_HTREE_MAX_LEVELS];
+    unsigned int frame_count[EXT4_HTREE_MAX_LEVELS];
+    unsigned int block = 0;
+
+    for (unsigned int level = 0; level < levels; level++) {
+        unsigned int count;
+        const ext4_dx_entry_t* entries = ext4_dx_entries(data, dir, block, level, &count);
+
+        if (!entries) {
+            KLOG(&ext4_log, KLOG_WARNING, "Invalid htree node in inode %u\n", dir->ino);
+            return -1;
+        }
+
+        // Binary search for the last entry whose hash is at or below ours
+        // (entry 0 holds the count and covers the lowest hashes)
+        unsigned int low = 1;
+        unsigned int high = count;
+
+        while (low < high) {
+            unsigned int middle = (low + high) / 2;
+
+            if (entries[middle].hash > hash) {
+                high = middle;
+            } else {
+                low = middle + 1;
+            }
+        }
+
+        frame_block[level] = block;
+        frame_at[level] = low - 1;
+        frame_count[level] = count;
+        block = entries[low - 1].block & EXT4_DX_BLOCK_MASK;
+    }
+
+    while (1) {
+        if (ext4_search_dir_block(data, dir, block, name, length, ino) != 0) {
+            return -1;
+        }
+
+        if (*ino) {
+            return 0;
+        }
+
+        // Names with the same hash may continue in the next leaf
+        int level = levels - 1;
+
+        while (level >= 0 && frame_at[level] + 1 >= frame_count[level]) {
+            level--;
+        }
+
+        if (level < 0) {
+            return 0;
+        }
+
+        unsigned int count;
+        const ext4_dx_entry_t* entries = ext4_dx_entries(data, dir, frame_block[level], level, &count);
+
+        if (!entries) {
+            return -1;
+        }
+
+        frame_at[level]++;
+
+        unsigned int next_hash = entries[frame_at[level]].hash;
+
+        if (!(next_hash & 1) || (next_hash & ~1u) != hash) {
+            return 0;
+        }
+
+        block = entries[frame_at[level]].block & EXT4_DX_BLOCK_MASK;
+
+        // Descend along the first entries to the next leaf
+        for (unsigned int lower = (unsigned int) level + 1; lower < levels; lower++) {
+            entries = ext4_dx_entries(data, dir, block, lower, &count);
+
+            if (!entries) {
+                return -1;
+            }
+
+            frame_block[lower] = block;
+            frame_at[lower] = 0;
+            frame_count[lower] = count;
+            block = entries[0].block & EXT4_DX_BLOCK_MASK;
+        }
+    }
+}
+
+// Find a name in a directory, returning its inode number (0 if not found)
+static unsigned int ext4_find_entry(ext4_fs_data_t* data, ext4_file_t* dir, const char* name, unsigned int length) {
+    unsigned int ino = 0;
+
+    // Indexed directories need only a few block reads
+    if ((dir->inode.flags & EXT4_INDEX_FL) && (data->superblock.feature_compat & EXT4_FEATURE_COMPAT_DIR_INDEX) &&
+        ext4_dx_find_entry(data, dir, name, length, &ino) == 0) {
+        return ino;
+    }
+
+    unsigned int blocks = (unsigned int) ((dir->size + data->block_size - 1) / data->block_size);
+
+    for (unsigned int logical = 0; logical < blocks; logical++) {
+        if (ext4_search_dir_block(data, dir, logical, name, length, &ino) != 0 || ino) {
+            return ino;
+        }
+    }
+
+    return 0;
+}
+
+// Resolve a path to a cached file
+static ext4_file_t* ext4_lookup(ext4_fs_data_t* data, const char* path) {
+    ext4_file_t* file = (ext4_file_t*) hashmap_get(&data->file_map, path);
+
+    if (file) {
+        file->last_used = ++data->clock;
+        return file;
+    }
+
+    // Walk from the root, caching every directory on the way
+    char prefix[256] = "/";
+    unsigned int prefix_length = 0;
+
+    file = (ext4_file_t*) hashmap_get(&data->file_map, prefix);
+
+    if (!file) {
+        file = ext4_file_create(data, prefix, EXT4_ROOT_INO);
 
-// EXT4 directory entry structure
-typedef struct {
-    unsigned int inode;
-    unsigned short rec_len;
-    unsigned char name_len;
-    unsigned char file_type;
-    char name[256];
-} ext4_dir_entry_t;
+        if (!file) {
+            return NULL;
+        }
+    }
 
-// EXT4 file system private data
-typedef struct {
-    ext4_superblock_t superblock;
-    char device[32];
-    unsigned int block_size;
-    unsigned int inodes_per_group;
-    unsigned int blocks_per_group;
-    unsigned int groups_count;
-    unsigned int inodes_count;
-    unsigned int blocks_count;
-} ext4_fs_data_t;
+    while (*path) {
+        while (*path == '/') {
+            path++;
+        }
+
+        const char* name = path;
+
+        while (*path && *path != '/') {
+            path++;
+        }
+
+        unsigned int length = path - name;
+
+        if (length == 0) {
+            break;
+        }
+
+        if ((file->inode.mode & EXT4_S_IFMT) != EXT4_S_IFDIR || prefix_length + 1 + length >= sizeof(prefix)) {
+            return NULL;
+        }
+
+        prefix[prefix_length++] = '/';
+        memcpy(prefix + prefix_length, name, length);
+        prefix_length += length;
+        prefix[prefix_length] = '\0';
+
+        ext4_file_t* next = (ext4_file_t*) hashmap_get(&data->file_map, prefix);
+
+        if (!next) {
+            // Pin the directory so creating its child cannot recycle it
+            file->refcount++;
+
+            unsigned int ino = ext4_find_entry(data, file, name, length);
+            next = ino ? ext4_file_create(data, prefix, ino) : NULL;
+
+            file->refcount--;
+
+            if (!next) {
+                return NULL;
+            }
+        }
+
+        file = next;
+        file->last_used = ++data->clock;
+    }
+
+    file->last_used = ++data->clock;
+
+    return file;
+}
+
+// Map a journal block for jbd2 (the context is the journal inode)
+static int ext4_journal_bmap(void* context, unsigned int logical, unsigned long long* physical, unsigned int* run) {
+    ext4_file_t* journal = (ext4_file_t*) context;
+
+    return ext4_map_block(journal->data, journal, logical, physical, run);
+}
+
+// Write the in-memory superblock through the journal
+static int ext4_journal_superblock(ext4_fs_data_t* data) {
+    unsigned long long block = 1024 / data->block_size;
+    jbd2_handle_t handle;
+
+    if (jbd2_start(data->journal, 1, &handle) != 0) {
+        return -1;
+    }
+
+    unsigned char* buffer = jbd2_get_write_access(&handle, block);
+
+    if (buffer) {
+        memcpy(buffer + 1024 % data->block_size, &data->superblock, sizeof(ext4_superblock_t));
+    }
+
+    if (jbd2_stop(&handle) != 0 || !buffer) {
+        return -1;
+    }
+
+    return 0;
+}
+
+// Load the journal, replaying it if the file system was not unmounted cleanly
+static int ext4_load_journal(ext4_fs_data_t* data) {
+    int needs_recovery = (data->superblock.feature_incompat & EXT4_FEATURE_INCOMPAT_RECOVER) != 0;
+
+    // A clean file system on a read-only device is used without its journal
+    if (data->dev->read_only && !needs_recovery) {
+        return 0;
+    }
+
+    ext4_file_t* file = (ext4_file_t*) allocate_block();
+
+    if (!file) {
+        return -1;
+    }
+
+    memset(file, 0, sizeof(ext4_file_t));
+    file->ino = data->superblock.journal_inum;
+    file->data = data;
+
+    if (ext4_read_inode(data, file->ino, &file->inode) != 0) {
+        terminal_write("Error: Failed to read ext4 journal inode\n");
+        free_block(file);
+        return -1;
+    }
+
+    unsigned long long size = file->inode.size | (unsigned long long) file->inode.size_high << 32;
+    data->journal = jbd2_load(data->dev, data->bdev, data->block_size, ext4_journal_bmap, file, (unsigned int) (size / data->block_size));
+    free_block(file);
+
+    if (!data->journal) {
+        if (needs_recovery) {
+            return -1;
+        }
+
+        KLOG(&ext4_log, KLOG_WARNING, "Journal not usable, mounting without it\n");
+        return 0;
+    }
+
+    // Recovery may have replayed a newer superblock
+    if (needs_recovery && page_cache_read(data->bdev, 1024, &data->superblock, sizeof(ext4_superblock_t)) != sizeof(ext4_superblock_t)) {
+        return -1;
+    }
+
+    if (data->dev->read_only) {
+        return 0;
+    }
+
+    // Until unmount, a crash leaves the journal to be replayed. The flag is
+    // written home at once: a journalled copy only gets there at the first
+    // checkpoint, and e2fsck (or Linux) discards a log the superblock does
+    // not say needs recovery
+    data->superblock.feature_incompat |= EXT4_FEATURE_INCOMPAT_RECOVER;
+    data->superblock.mount_count++;
+    data->superblock.mount_time = (unsigned int) (ktime_get_real() / NSEC_PER_SEC);
+
+    if (page_cache_write(data->bdev, 1024, &data->superblock, sizeof(ext4_superblock_t)) != sizeof(ext4_superblock_t) ||
+        page_cache_sync(data->bdev) != 0 || bdev_flush(data->dev) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
 
 // EXT4 mount function
 static int ext4_mount(filesystem_t* fs, const char* device, const char* mount_point, unsigned int flags) {
@@ -95,32 +2875,51 @@ static int ext4_mount(filesystem_t* fs, const char* device, const char* mount_po
     terminal_write("'...\n");
     
     // Allocate private data
-    ext4_fs_data_t* data = (ext4_fs_data_t*)allocate_block();
+    ext4_fs_data_t* data = (ext4_fs_data_t*)allocate_blocks(EXT4_FS_DATA_BLOCKS);
     
     if (!data) {
         terminal_write("Error: Failed to allocate memory for ext4 file system data\n");
         return -1;
     }
     
-    // Copy the device name
-    strcpy(data->device, device);
+    memset(data, 0, sizeof(ext4_fs_data_t));
     
-    // Read the superblock (located at offset 1024 bytes)
-    unsigned char buffer[1024];
+    data->fs = fs;
+    hashmap_init(&data->file_map, data->file_map_entries, EXT4_FILE_MAP_CAPACITY);
     
-    if (storage_read_sectors(device, 2, 2, buffer) != 0) {
-        terminal_write("Error: Failed to read ext4 superblock\n");
-        free_block(data);
+    // Open the device once for the lifetime of the mount
+    data->dev = storage_open(device);
+    
+    if (!data->dev) {
+        free_blocks(data, EXT4_FS_DATA_BLOCKS);
+        return -1;
+    }
+    
+    // All metadata reads go through the device's page cache
+    data->bdev = page_cache_get_device(data->dev);
+    
+    if (!data->bdev) {
+        terminal_write("Error: Failed to open ext4 device\n");
+        storage_close(data->dev);
+        free_blocks(data, EXT4_FS_DATA_BLOCKS);
         return -1;
     }
     
-    // Copy the superblock data
-    memcpy(&data->superblock, buffer, sizeof(ext4_superblock_t));
+    // Read the superblock (located at offset 1024 bytes)
+    if (page_cache_read(data->bdev, 1024, &data->superblock, sizeof(ext4_superblock_t)) != sizeof(ext4_superblock_t)) {
+        terminal_write("Error: Failed to read ext4 superblock\n");
+        page_cache_release_mapping(data->bdev);
+        storage_close(data->dev);
+        free_blocks(data, EXT4_FS_DATA_BLOCKS);
+        return -1;
+    }
     
     // Check the magic number
-    if (data->superblock.magic != 0xEF53) {
+    if (data->superblock.magic != EXT4_SUPER_MAGIC) {
         terminal_write("Error: Invalid ext4 superblock magic number\n");
-        free_block(data);
+        page_cache_release_mapping(data->bdev);
+        storage_close(data->dev);
+        free_blocks(data, EXT4_FS_DATA_BLOCKS);
         return -1;
     }
     
@@ -128,9 +2927,65 @@ static int ext4_mount(filesystem_t* fs, const char* device, const char* mount_po
     data->block_size = 1024 << data->superblock.log_block_size;
     data->inodes_per_group = data->superblock.inodes_per_group;
     data->blocks_per_group = data->superblock.blocks_per_group;
-    data->groups_count = (data->superblock.blocks_count + data->blocks_per_group - 1) / data->blocks_per_group;
     data->inodes_count = data->superblock.inodes_count;
     data->blocks_count = data->superblock.blocks_count;
+    data->inode_size = data->superblock.rev_level == 0 ? 128 : data->superblock.inode_size;
+    data->desc_size = 32;
+    
+    if (data->superblock.feature_incompat & EXT4_FEATURE_INCOMPAT_64BIT) {
+        data->blocks_count |= (unsigned long long)data->superblock.blocks_count_hi << 32;
+        
+        if (data->superblock.desc_size >= 64) {
+            data->desc_size = data->superblock.desc_size;
+        }
+    }
+    
+    // Check that the read path can handle this file system
+    if (data->superblock.log_block_size > 2 || data->block_size > PAGE_CACHE_PAGE_SIZE ||
+        data->block_size % data->dev->sector_size != 0 || data->blocks_per_group == 0 ||
+        data->inodes_per_group == 0 || data->inode_size < 128 || data->inode_size > data->block_size) {
+        terminal_write("Error: Unsupported ext4 geometry\n");
+        page_cache_release_mapping(data->bdev);
+        storage_close(data->dev);
+        free_blocks(data, EXT4_FS_DATA_BLOCKS);
+        return -1;
+    }
+    
+    if (data->superblock.feature_incompat & EXT4_FEATURE_INCOMPAT_UNSUPPORTED) {
+        terminal_write("Error: Unsupported ext4 features\n");
+        page_cache_release_mapping(data->bdev);
+        storage_close(data->dev);
+        free_blocks(data, EXT4_FS_DATA_BLOCKS);
+        return -1;
+    }
+    
+    data->sectors_per_block = data->block_size / data->dev->sector_size;
+    data->blocks_per_page = PAGE_CACHE_PAGE_SIZE / data->block_size;
+    data->groups_count = (data->blocks_count - data->superblock.first_data_block + data->blocks_per_group - 1) / data->blocks_per_group;
+    
+    // Replay the journal before anything else reads the metadata
+    if ((data->superblock.feature_compat & EXT4_FEATURE_COMPAT_HAS_JOURNAL) && ext4_load_journal(data) != 0) {
+        terminal_write("Error: Failed to load ext4 journal\n");
+        
+        if (data->journal) {
+            jbd2_destroy(data->journal);
+        }
+        
+        page_cache_release_mapping(data->bdev);
+        storage_close(data->dev);
+        free_blocks(data, EXT4_FS_DATA_BLOCKS);
+        return -1;
+    }
+    
+    // Readahead is batched through a bounce buffer; without one it falls
+    // back to reading a page at a time
+    data->readahead_buffer = (unsigned char*)allocate_blocks(EXT4_READAHEAD_MAX);
+    
+    // Writes need the block allocator; a journaled file system is only
+    // written through its journal
+    if (!data->dev->read_only && (data->journal || !(data->superblock.feature_compat & EXT4_FEATURE_COMPAT_HAS_JOURNAL))) {
+        ext4_init_allocator(data);
+    }
     
     // Set the file system private data
     fs->private_data = data;
@@ -143,8 +2998,13 @@ static int ext4_mount(filesystem_t* fs, const char* device, const char* mount_po
     fs->flags = flags;
     
     // Set the file system size information
-    fs->total_size = (unsigned long long)data->blocks_count * data->block_size;
-    fs->free_size = (unsigned long long)data->superblock.free_blocks_count * data->block_size;
+    fs->total_size = data->blocks_count * data->block_size;
+    
+    if (data->groups) {
+        ext4_update_free_size(data);
+    } else {
+        fs->free_size = (unsigned long long)data->superblock.free_blocks_count * data->block_size;
+    }
     
     terminal_write("Mounted ext4 file system successfully\n");
     
@@ -163,7 +3023,31 @@ static int ext4_unmount(filesystem_t* fs) {
     
     // Free the private data
     if (fs->private_data) {
-        free_block(fs->private_data);
+        ext4_fs_data_t* data = (ext4_fs_data_t*)fs->private_data;
+        
+        for (int i = 0; i < EXT4_MAX_FILES; i++) {
+            if (data->files[i]) {
+                ext4_file_free(data, i);
+            }
+        }
+        
+        if (data->readahead_buffer) {
+            free_blocks(data->readahead_buffer, EXT4_READAHEAD_MAX);
+        }
+        
+        ext4_free_allocator(data);
+        
+        // Mark the file system clean, then commit and checkpoint everything
+        if (data->journal) {
+            data->superblock.feature_incompat &= ~EXT4_FEATURE_INCOMPAT_RECOVER;
+            ext4_journal_superblock(data);
+            jbd2_destroy(data->journal);
+        }
+        
+        page_cache_sync(data->bdev);
+        page_cache_release_mapping(data->bdev);
+        storage_close(data->dev);
+        free_blocks(fs->private_data, EXT4_FS_DATA_BLOCKS);
         fs->private_data = NULL;
     }
     
@@ -174,60 +3058,227 @@ static int ext4_unmount(filesystem_t* fs) {
 
 // EXT4 read function
 static int ext4_read(filesystem_t* fs, const char* path, void* buffer, unsigned int size, unsigned int offset) {
-    // In a real system, this would:
-    // 1. Find the inode for the path
-    // 2. Read the data blocks
-    // 3. Copy the data to the buffer
+    if (!fs || !fs->private_data || !path || !buffer) {
+        return -1;
+    }
+    
+    ext4_fs_data_t* data = (ext4_fs_data_t*)fs->private_data;
+    ext4_file_t* file = ext4_lookup(data, path);
+    
+    if (!file || (file->inode.mode & EXT4_S_IFMT) == EXT4_S_IFDIR) {
+        return -1;
+    }
+    
+    if (offset >= file->size || size == 0) {
+        return 0;
+    }
+    
+    if (size > file->size - offset) {
+        size = file->size - offset;
+    }
+    
+    // Keep the readahead window ahead of sequential readers
+    ext4_readahead(data, file, offset / PAGE_CACHE_PAGE_SIZE, (offset + size - 1) / PAGE_CACHE_PAGE_SIZE);
     
-    // For now, just simulate a successful read
-    return size;
+    return page_cache_read(file->mapping, offset, buffer, size);
+}
+
+// Reserve blocks for the holes of a page about to be dirtied
+//
+// Blocks are only allocated when the page is written back, so the space is
+// promised here, with some to spare for extent tree nodes. Returns the
+// number of blocks reserved, or -1 if there is no space.
+static int ext4_reserve_page(ext4_fs_data_t* data, ext4_file_t* file, unsigned int index) {
+    page_t* page = page_cache_find_page(file->mapping, index);
+
+    // A dirty page holds its reservation until written back
+    if (page && (page->flags & PAGE_DIRTY)) {
+        return 0;
+    }
+
+    int holes = ext4_page_holes(data, file, index);
+
+    if (holes <= 0) {
+        return holes;
+    }
+
+    if (!(file->inode.flags & EXT4_EXTENTS_FL)) {
+        KLOG(&ext4_log, KLOG_ERR, "Cannot allocate blocks for block-mapped inode %u\n", file->ino);
+        return -1;
+    }
+
+    if (data->free_blocks < data->dirty_blocks + holes + EXT4_DA_METADATA_RESERVE) {
+        return -1;
+    }
+
+    data->dirty_blocks += holes;
+
+    return holes;
+}
+
+// Set the size of a file
+static void ext4_set_size(ext4_file_t* file, unsigned long long size) {
+    file->size = size;
+    file->inode.size = (unsigned int) size;
+    file->inode.size_high = (unsigned int) (size >> 32);
 }
 
-// EXT4 write function
+// EXT4 write function; returns the number of bytes written
+//
+// Data only goes to the page cache here. Blocks for it are reserved, and
+// allocated when the pages are written back (delayed allocation).
 static int ext4_write(filesystem_t* fs, const char* path, const void* buffer, unsigned int size, unsigned int offset) {
-    // In a real system, this would:
-    // 1. Find the inode for the path
-    // 2. Allocate data blocks if needed
-    // 3. Write the data to the blocks
-    
-    // For now, just simulate a successful write
-    return size;
+    if (!fs || !fs->private_data || !path || !buffer) {
+        return -1;
+    }
+
+    ext4_fs_data_t* data = (ext4_fs_data_t*) fs->private_data;
+    ext4_file_t* file = ext4_lookup(data, path);
+
+    if (!file || (file->inode.mode & EXT4_S_IFMT) != EXT4_S_IFREG || !data->groups) {
+        return -1;
+    }
+
+    if (size == 0) {
+        return 0;
+    }
+
+    // The rest of the old last page may hold stale bytes that would now be
+    // inside the file
+    if (offset > file->size && file->size % PAGE_CACHE_PAGE_SIZE != 0) {
+        unsigned int index = (unsigned int) (file->size / PAGE_CACHE_PAGE_SIZE);
+        unsigned long long page_end = (unsigned long long) (index + 1) * PAGE_CACHE_PAGE_SIZE;
+        int reserved = ext4_reserve_page(data, file, index);
+        page_t* page = reserved < 0 ? NULL : page_cache_get_page(file->mapping, index);
+
+        if (!page) {
+            data->dirty_blocks -= reserved > 0 ? reserved : 0;
+            return -1;
+        }
+
+        memset((unsigned char*) page->data + file->size % PAGE_CACHE_PAGE_SIZE, 0, (offset < page_end ? offset : page_end) - file->size);
+        page_cache_mark_dirty(page);
+    }
+
+    const unsigned char* in = (const unsigned char*) buffer;
+    unsigned int done = 0;
+
+    while (done < size) {
+        unsigned long long position = (unsigned long long) offset + done;
+        unsigned int chunk = PAGE_CACHE_PAGE_SIZE - position % PAGE_CACHE_PAGE_SIZE;
+
+        if (chunk > size - done) {
+            chunk = size - done;
+        }
+
+        int reserved = ext4_reserve_page(data, file, (unsigned int) (position / PAGE_CACHE_PAGE_SIZE));
+
+        if (reserved < 0) {
+            break;
+        }
+
+        // The size grows first: writeback started by the page cache write
+        // would skip a dirty page past the end of the file
+        unsigned long long size = file->size;
+
+        if (position + chunk > size) {
+            ext4_set_size(file, position + chunk);
+        }
+
+        if (page_cache_write(file->mapping, position, in + done, chunk) != (int) chunk) {
+            data->dirty_blocks -= reserved;
+            ext4_set_size(file, size);
+            break;
+        }
+
+        done += chunk;
+    }
+
+    if (done == 0) {
+        KLOG(&ext4_log, KLOG_WARNING, "No space left to write inode %u\n", file->ino);
+        ext4_update_free_size(data);
+        return -1;
+    }
+
+    // The inode goes out with the pages, or at the next sync
+    unsigned int now = (unsigned int) (ktime_get_real() / NSEC_PER_SEC);
+
+    file->inode.mtime = now;
+    file->inode.ctime = now;
+    file->inode_dirty = 1;
+
+    if (file->size > 0x7FFFFFFFULL) {
+        data->superblock.feature_ro_compat |= EXT4_FEATURE_RO_COMPAT_LARGE_FILE;
+    }
+
+    ext4_icache_update(data, file);
+    ext4_update_free_size(data);
+
+    return done;
 }
 
 // EXT4 open function
 static int ext4_open(filesystem_t* fs, const char* path, unsigned int flags) {
-    // In a real system, this would:
-    // 1. Find the inode for the path
-    // 2. Check permissions
-    // 3. Create a file descriptor
+    (void) flags;
+    
+    if (!fs || !fs->private_data || !path) {
+        return -1;
+    }
+    
+    ext4_fs_data_t* data = (ext4_fs_data_t*)fs->private_data;
+    ext4_file_t* file = ext4_lookup(data, path);
+    
+    if (!file) {
+        return -1;
+    }
+    
+    // Open files keep their table slot until closed
+    file->refcount++;
+    
+    for (int i = 0; i < EXT4_MAX_FILES; i++) {
+        if (data->files[i] == file) {
+            return EXT4_FD_BASE + i;
+        }
+    }
     
-    // For now, just simulate a successful open
-    return 3; // Return a dummy file descriptor
+    return -1;
 }
 
 // EXT4 close function
 static int ext4_close(filesystem_t* fs, int fd) {
-    // In a real system, this would:
-    // 1. Find the file descriptor
-    // 2. Close the file
+    if (!fs || !fs->private_data) {
+        return -1;
+    }
+    
+    ext4_fs_data_t* data = (ext4_fs_data_t*)fs->private_data;
+    int slot = fd - EXT4_FD_BASE;
+    
+    if (slot < 0 || slot >= EXT4_MAX_FILES || !data->files[slot] || data->files[slot]->refcount == 0) {
+        return -1;
+    }
+    
+    data->files[slot]->refcount--;
     
-    // For now, just simulate a successful close
     return 0;
 }
 
 // EXT4 mkdir function
 static int ext4_mkdir(filesystem_t* fs, const char* path, unsigned int mode) {
+    (void) mode;
+    
     // In a real system, this would:
     // 1. Find the parent directory
     // 2. Create a new directory entry
     // 3. Allocate an inode
     
     // For now, just simulate a successful mkdir
+    fs_invalidate_name(fs, path);
     return 0;
 }
 
 // EXT4 rmdir function
 static int ext4_rmdir(filesystem_t* fs, const char* path) {
+
     // In a real system, this would:
     // 1. Find the directory
     // 2. Check if it's empty
@@ -235,11 +3286,13 @@ static int ext4_rmdir(filesystem_t* fs, const char* path) {
     // 4. Free the inode
     
     // For now, just simulate a successful rmdir
+    fs_invalidate_name(fs, path);
     return 0;
 }
 
 // EXT4 unlink function
 static int ext4_unlink(filesystem_t* fs, const char* path) {
+
     // In a real system, this would:
     // 1. Find the file
     // 2. Remove the directory entry
@@ -247,42 +3300,53 @@ static int ext4_unlink(filesystem_t* fs, const char* path) {
     // 4. Free the inode if the link count is 0
     
     // For now, just simulate a successful unlink
+    fs_invalidate_name(fs, path);
     return 0;
 }
 
 // EXT4 rename function
 static int ext4_rename(filesystem_t* fs, const char* old_path, const char* new_path) {
+
     // In a real system, this would:
     // 1. Find the file
     // 2. Create a new directory entry
     // 3. Remove the old directory entry
     
     // For now, just simulate a successful rename
+    fs_invalidate_name(fs, old_path);
+    fs_invalidate_name(fs, new_path);
     return 0;
 }
 
 // EXT4 stat function
 static int ext4_stat(filesystem_t* fs, const char* path, fs_stat_t* stat) {
-    // In a real system, this would:
-    // 1. Find the inode for the path
-    // 2. Fill in the stat structure
+    if (!fs || !fs->private_data || !path || !stat) {
+        return -1;
+    }
+    
+    ext4_file_t* file = ext4_lookup((ext4_fs_data_t*)fs->private_data, path);
     
-    // For now, just simulate a successful stat
-    if (stat) {
-        stat->size = 1024;
-        stat->mode = 0644;
-        stat->uid = 0;
-        stat->gid = 0;
-        stat->atime = 0;
-        stat->mtime = 0;
-        stat->ctime = 0;
+    if (!file) {
+        return -1;
     }
     
+    stat->size = file->size;
+    stat->mode = file->inode.mode;
+    stat->uid = file->inode.uid;
+    stat->gid = file->inode.gid;
+    stat->atime = file->inode.atime;
+    stat->mtime = file->inode.mtime;
+    stat->ctime = file->inode.ctime;
+    
     return 0;
 }
 
 // EXT4 chmod function
 static int ext4_chmod(filesystem_t* fs, const char* path, unsigned int mode) {
+    (void) fs;
+    (void) path;
+    (void) mode;
+    
     // In a real system, this would:
     // 1. Find the inode for the path
     // 2. Change the mode
@@ -293,6 +3357,11 @@ static int ext4_chmod(filesystem_t* fs, const char* path, unsigned int mode) {
 
 // EXT4 chown function
 static int ext4_chown(filesystem_t* fs, const char* path, unsigned int uid, unsigned int gid) {
+    (void) fs;
+    (void) path;
+    (void) uid;
+    (void) gid;
+    
     // In a real system, this would:
     // 1. Find the inode for the path
     // 2. Change the owner and group
@@ -303,6 +3372,10 @@ static int ext4_chown(filesystem_t* fs, const char* path, unsigned int uid, unsi
 
 // EXT4 truncate function
 static int ext4_truncate(filesystem_t* fs, const char* path, unsigned int size) {
+    (void) fs;
+    (void) path;
+    (void) size;
+    
     // In a real system, this would:
     // 1. Find the inode for the path
     // 2. Truncate the file
@@ -313,10 +3386,71 @@ static int ext4_truncate(filesystem_t* fs, const char* path, unsigned int size)
 
 // EXT4 sync function
 static int ext4_sync(filesystem_t* fs) {
-    // In a real system, this would:
-    // 1. Flush all cached data to disk
+    if (!fs || !fs->private_data) {
+        return -1;
+    }
+    
+    ext4_fs_data_t* data = (ext4_fs_data_t*)fs->private_data;
+    
+    // Write back cached file data, then the metadata it depends on
+    if (page_cache_sync_owner(data->fs) != 0) {
+        return -1;
+    }
+    
+    for (int i = 0; i < EXT4_MAX_FILES; i++) {
+        if (data->files[i] && ext4_sync_inode(data, data->files[i]) != 0) {
+            return -1;
+        }
+    }
+    
+    // Journaled metadata is durable once committed; it goes home at checkpoint
+    if (data->journal ? jbd2_commit(data->journal) != 0 : page_cache_sync(data->bdev) != 0) {
+        return -1;
+    }
+    
+    return bdev_flush(data->dev);
+}
+
+// EXT4 fsync function
+static int ext4_fsync(filesystem_t* fs, const char* path) {
+    if (!fs || !fs->private_data || !path) {
+        return -1;
+    }
+    
+    ext4_fs_data_t* data = (ext4_fs_data_t*)fs->private_data;
+    ext4_file_t* file = ext4_lookup(data, path);
+    
+    if (!file) {
+        return -1;
+    }
+    
+    unsigned int dirty = file->mapping->nr_dirty;
+    
+    // The file's data, then the metadata it depends on
+    if (page_cache_sync(file->mapping) != 0 || ext4_sync_inode(data, file) != 0) {
+        return -1;
+    }
+    
+    if (!data->journal) {
+        if (page_cache_sync(data->bdev) != 0) {
+            return -1;
+        }
+        
+        return bdev_flush(data->dev);
+    }
+    
+    // Group commit: if an earlier commit already covered the inode there is
+    // no journal write, and a commit flushes the data written above with it
+    unsigned long long commits = data->journal->stats.commits;
+    
+    if (jbd2_commit_tid(data->journal, file->tid) != 0) {
+        return -1;
+    }
+    
+    if (data->journal->stats.commits == commits && dirty > 0) {
+        return bdev_flush(data->dev);
+    }
     
-    // For now, just simulate a successful sync
     return 0;
 }
 
@@ -346,6 +3480,8 @@ int ext4_init() {
     fs.chown = ext4_chown;
     fs.truncate = ext4_truncate;
     fs.sync = ext4_sync;
+    fs.fsync = ext4_fsync;
+    fs.root = NULL;
     fs.private_data = NULL;
     
     return fs_register_filesystem(&fs);
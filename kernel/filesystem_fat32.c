@@ -0,0 +1,2405 @@
+/**
+ * LightOS Kernel
+ * FAT32 file system implementation
+ *
+ * Metadata and file data all go through the page cache of the device, so
+ * FAT sectors stay cached once read and changes are written back like any
+ * other dirty page. Each cached file keeps an extent map of the runs of
+ * contiguous clusters in its chain: seeking to an offset is a lookup in
+ * the map instead of a walk along the FAT, and a file written in one go is
+ * a single run. Free clusters are tracked in a bitmap built from the FAT
+ * at mount time, and files grow into the clusters right after their last
+ * one whenever those are free.
+ */
+
+#include "filesystem_ext.h"
+#include "kernel.h"
+#include "klog.h"
+#include "ktime.h"
+#include "memory.h"
+#include "page_cache.h"
+#include "../libc/string.h"
+#include "../libc/hashmap.h"
+#include "../drivers/storage.h"
+
+KLOG_SUBSYSTEM(fat32_log, "fat32");
+
+// FAT entry values (the top four bits of an entry are reserved)
+#define FAT32_ENTRY_MASK   0x0FFFFFFF
+#define FAT32_END_OF_CHAIN 0x0FFFFFF8   // Lowest end of chain marker
+#define FAT32_EOC_MARK     0x0FFFFFFF
+
+// First data cluster
+#define FAT32_FIRST_CLUSTER 2
+
+// Directory entry attributes
+#define FAT32_ATTR_READ_ONLY 0x01
+#define FAT32_ATTR_VOLUME_ID 0x08
+#define FAT32_ATTR_DIRECTORY 0x10
+#define FAT32_ATTR_ARCHIVE   0x20
+#define FAT32_ATTR_LONG_NAME 0x0F
+#define FAT32_ATTR_MASK      0x3F
+
+// First name byte markers
+#define FAT32_DIRENT_END     0x00
+#define FAT32_DIRENT_DELETED 0xE5
+#define FAT32_DIRENT_KANJI   0x05       // Stands for a leading 0xE5
+
+// Case flags of 8.3 names whose parts are all lower case
+#define FAT32_CASE_LOWER_BASE 0x08
+#define FAT32_CASE_LOWER_EXT  0x10
+
+// Long name entries
+#define FAT32_LFN_LAST      0x40
+#define FAT32_LFN_ORDER     0x1F
+#define FAT32_LFN_CHARS     13
+#define FAT32_LFN_MAX_SLOTS 20
+
+// Longest name in a directory
+#define FAT32_NAME_MAX 255
+
+// Most entries in a directory
+#define FAT32_DIR_MAX_ENTRIES 65536
+
+// Most numbered aliases tried for one long name
+#define FAT32_MAX_ALIASES 99999
+
+// FSInfo sector signatures and fields
+#define FAT32_FSINFO_LEAD_SIG   0x41615252
+#define FAT32_FSINFO_STRUCT_SIG 0x61417272
+#define FAT32_FSINFO_STRUCT     484
+#define FAT32_FSINFO_FREE       488
+#define FAT32_FSINFO_NEXT       492
+
+// Extended flags: FAT mirroring disabled, with the active FAT in the low bits
+#define FAT32_EXT_NO_MIRROR  0x0080
+#define FAT32_EXT_ACTIVE_FAT 0x000F
+
+// Largest supported cluster
+#define FAT32_MAX_CLUSTER_SIZE 65536
+
+// Cached files per mount
+#define FAT32_MAX_FILES 64
+
+// Path index slots (must be a power of two, at least twice FAT32_MAX_FILES)
+#define FAT32_FILE_MAP_CAPACITY 128
+
+// Base of the file descriptors returned by open
+#define FAT32_FD_BASE 3
+
+// Extent map runs kept in the file itself before the map needs blocks of its own
+#define FAT32_INLINE_RUNS 128
+
+// Largest file (sizes are 32 bits)
+#define FAT32_MAX_FILE_SIZE 0xFFFFFFFFULL
+
+// Mode file types reported by stat
+#define FAT32_S_IFDIR 0x4000
+#define FAT32_S_IFREG 0x8000
+
+// Directory entry (8.3 name)
+typedef struct {
+    unsigned char name[11];
+    unsigned char attr;
+    unsigned char case_flags;
+    unsigned char create_tenths;
+    unsigned short create_time;
+    unsigned short create_date;
+    unsigned short access_date;
+    unsigned short cluster_high;
+    unsigned short write_time;
+    unsigned short write_date;
+    unsigned short cluster_low;
+    unsigned int size;
+} fat32_dirent_t;
+
+// Run of contiguous clusters in a chain
+typedef struct {
+    unsigned int logical;           // First cluster index in the file
+    unsigned int cluster;           // First cluster on the volume
+    unsigned int length;
+} fat32_run_t;
+
+// FAT32 cached file or directory
+//
+// As for ext4, files stay in the table after their last close. They are
+// keyed by path with names folded to upper case, since FAT names ignore
+// case. The extent map covers the whole chain and is kept in step as
+// clusters are added and freed.
+typedef struct {
+    char path[256];
+    unsigned int first_cluster;     // 0 for an empty file
+    unsigned int size;              // Directories have none; their chain sets it
+    unsigned char attr;
+    unsigned long long entry_offset; // Device offset of the 8.3 entry (0 for the root)
+    unsigned int refcount;          // Open file descriptors and pins
+    unsigned int last_used;
+    unsigned int nr_clusters;
+    fat32_run_t* runs;
+    unsigned int nr_runs;
+    unsigned int max_runs;
+    unsigned int run_blocks;        // Blocks of a map grown out of inline_runs
+    unsigned int last_run;          // Run of the last lookup, tried first
+    fat32_run_t inline_runs[FAT32_INLINE_RUNS];
+} fat32_file_t;
+
+// FAT32 file system private data
+typedef struct {
+    block_dev_t* dev;               // Open device handle
+    filesystem_t* fs;
+    page_mapping_t* bdev;           // Cached view of the device
+    unsigned int cluster_size;
+    unsigned int fat_count;
+    unsigned int active_fat;        // FAT read from
+    int mirror;                     // FAT changes go to every copy
+    unsigned long long fat_offset;  // Device offset of the first FAT
+    unsigned long long fat_bytes;   // Size of one FAT
+    unsigned long long data_offset; // Device offset of the first data cluster
+    unsigned int cluster_count;     // Data clusters, numbered from FAT32_FIRST_CLUSTER
+    unsigned int root_cluster;
+    unsigned long long fsinfo_offset; // 0 without an FSInfo sector
+    unsigned int* bitmap;           // Used clusters, indexed by cluster number
+    unsigned int bitmap_blocks;
+    unsigned int free_count;
+    unsigned int next_free;         // Where the search for a free cluster starts
+    int read_only;
+    unsigned char* zero_block;      // Zeros for clearing clusters
+    unsigned int clock;             // Use counter for file table recycling
+    fat32_file_t* files[FAT32_MAX_FILES];
+    hashmap_t file_map;             // Path -> fat32_file_t
+    hashmap_entry_t file_map_entries[FAT32_FILE_MAP_CAPACITY];
+} fat32_fs_data_t;
+
+// Memory blocks needed for the private data
+#define FAT32_FS_DATA_BLOCKS ((sizeof(fat32_fs_data_t) + MEMORY_BLOCK_SIZE - 1) / MEMORY_BLOCK_SIZE)
+
+// Position of a name in a directory
+typedef struct {
+    fat32_dirent_t entry;           // The 8.3 entry
+    unsigned int index;             // Its index in the directory
+    unsigned int first;             // Index of its first long name entry (index without one)
+} fat32_slot_t;
+
+// Byte offsets of the 13 name characters in a long name entry
+static const unsigned char fat32_lfn_offsets[FAT32_LFN_CHARS] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+
+// Read a little-endian 16-bit value
+static unsigned int fat32_le16(const unsigned char* p) {
+    return p[0] | (p[1] << 8);
+}
+
+// Read a little-endian 32-bit value
+static unsigned int fat32_le32(const unsigned char* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int) p[3] << 24);
+}
+
+// Convert a FAT date and time to seconds since the epoch
+static unsigned int fat32_to_unix(unsigned int date, unsigned int time) {
+    rtc_time_t rtc;
+
+    rtc.year = 1980 + (date >> 9);
+    rtc.month = (date >> 5) & 0xF;
+    rtc.day = date & 0x1F;
+    rtc.hour = time >> 11;
+    rtc.minute = (time >> 5) & 0x3F;
+    rtc.second = (time & 0x1F) * 2;
+
+    if (rtc.month < 1 || rtc.month > 12 || rtc.day == 0) {
+        return 0;
+    }
+
+    return (unsigned int) (ktime_from_date(&rtc) / NSEC_PER_SEC);
+}
+
+// Get the current FAT date and time
+static void fat32_now(unsigned short* date, unsigned short* time) {
+    rtc_time_t rtc;
+
+    ktime_to_date(ktime_get_real(), &rtc);
+
+    // FAT dates run from 1980 to 2107
+    if (rtc.year < 1980) {
+        *date = (1 << 5) | 1;
+        *time = 0;
+        return;
+    }
+
+    if (rtc.year > 2107) {
+        rtc.year = 2107;
+    }
+
+    *date = (unsigned short) (((rtc.year - 1980) << 9) | (rtc.month << 5) | rtc.day);
+    *time = (unsigned short) ((rtc.hour << 11) | (rtc.minute << 5) | (rtc.second / 2));
+}
+
+// Get the device offset of a cluster
+static unsigned long long fat32_cluster_offset(fat32_fs_data_t* data, unsigned int cluster) {
+    return data->data_offset + (unsigned long long) (cluster - FAT32_FIRST_CLUSTER) * data->cluster_size;
+}
+
+// Check if a cluster number names a data cluster
+static int fat32_valid_cluster(fat32_fs_data_t* data, unsigned int cluster) {
+    return cluster >= FAT32_FIRST_CLUSTER && cluster - FAT32_FIRST_CLUSTER < data->cluster_count;
+}
+
+// Get the first cluster of a directory entry
+static unsigned int fat32_entry_cluster(const fat32_dirent_t* entry) {
+    return ((unsigned int) entry->cluster_high << 16) | entry->cluster_low;
+}
+
+// Set the first cluster of a directory entry
+static void fat32_set_entry_cluster(fat32_dirent_t* entry, unsigned int cluster) {
+    entry->cluster_high = (unsigned short) (cluster >> 16);
+    entry->cluster_low = (unsigned short) cluster;
+}
+
+// Read a FAT entry
+static int fat32_get_fat(fat32_fs_data_t* data, unsigned int cluster, unsigned int* value) {
+    unsigned long long offset = data->fat_offset + data->active_fat * data->fat_bytes + (unsigned long long) cluster * 4;
+    unsigned char raw[4];
+
+    if (page_cache_read(data->bdev, offset, raw, 4) != 4) {
+        KLOG(&fat32_log, KLOG_ERR, "Failed to read FAT entry %u\n", cluster);
+        return -1;
+    }
+
+    *value = fat32_le32(raw) & FAT32_ENTRY_MASK;
+
+    return 0;
+}
+
+// Write a FAT entry to every FAT in use
+static int fat32_set_fat(fat32_fs_data_t* data, unsigned int cluster, unsigned int value) {
+    for (unsigned int i = 0; i < data->fat_count; i++) {
+        if (!data->mirror && i != data->active_fat) {
+            continue;
+        }
+
+        unsigned long long offset = data->fat_offset + i * data->fat_bytes + (unsigned long long) cluster * 4;
+        unsigned char raw[4];
+
+        if (page_cache_read(data->bdev, offset, raw, 4) != 4) {
+            return -1;
+        }
+
+        // The reserved top bits keep their value
+        value = (fat32_le32(raw) & ~FAT32_ENTRY_MASK) | (value & FAT32_ENTRY_MASK);
+        raw[0] = (unsigned char) value;
+        raw[1] = (unsigned char) (value >> 8);
+        raw[2] = (unsigned char) (value >> 16);
+        raw[3] = (unsigned char) (value >> 24);
+
+        if (page_cache_write(data->bdev, offset, raw, 4) != 4) {
+            KLOG(&fat32_log, KLOG_ERR, "Failed to write FAT entry %u\n", cluster);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Check if a cluster is in use
+static int fat32_cluster_used(fat32_fs_data_t* data, unsigned int cluster) {
+    return (data->bitmap[cluster / 32] >> (cluster % 32)) & 1;
+}
+
+// Build the free cluster bitmap from the FAT
+static int fat32_build_bitmap(fat32_fs_data_t* data) {
+    unsigned int limit = FAT32_FIRST_CLUSTER + data->cluster_count;
+    unsigned int words = (limit + 31) / 32;
+
+    data->bitmap_blocks = (words * sizeof(unsigned int) + MEMORY_BLOCK_SIZE - 1) / MEMORY_BLOCK_SIZE;
+    data->bitmap = (unsigned int*) allocate_blocks(data->bitmap_blocks);
+
+    if (!data->bitmap) {
+        return -1;
+    }
+
+    // Clusters past the end of the volume count as used
+    memset(data->bitmap, 0xFF, data->bitmap_blocks * MEMORY_BLOCK_SIZE);
+    data->free_count = 0;
+
+    unsigned long long start = data->fat_offset + data->active_fat * data->fat_bytes;
+    unsigned int cluster = FAT32_FIRST_CLUSTER;
+
+    // Scan the FAT a cached page at a time
+    while (cluster < limit) {
+        unsigned long long offset = start + (unsigned long long) cluster * 4;
+        page_t* page = page_cache_get_page(data->bdev, (unsigned int) (offset / PAGE_CACHE_PAGE_SIZE));
+
+        if (!page) {
+            free_blocks(data->bitmap, data->bitmap_blocks);
+            data->bitmap = NULL;
+            return -1;
+        }
+
+        const unsigned char* entries = (const unsigned char*) page->data + offset % PAGE_CACHE_PAGE_SIZE;
+        unsigned int count = (PAGE_CACHE_PAGE_SIZE - offset % PAGE_CACHE_PAGE_SIZE) / 4;
+
+        if (count > limit - cluster) {
+            count = limit - cluster;
+        }
+
+        for (unsigned int i = 0; i < count; i++, cluster++) {
+            if ((fat32_le32(entries + i * 4) & FAT32_ENTRY_MASK) == 0) {
+                data->bitmap[cluster / 32] &= ~(1u << (cluster % 32));
+                data->free_count++;
+            }
+        }
+    }
+
+    return 0;
+}
+
+// Find a free cluster, searching from a starting point; returns 0 if there is none
+static unsigned int fat32_find_free(fat32_fs_data_t* data, unsigned int start) {
+    unsigned int words = (FAT32_FIRST_CLUSTER + data->cluster_count + 31) / 32;
+    unsigned int word = fat32_valid_cluster(data, start) ? start / 32 : 0;
+
+    for (unsigned int n = 0; n < words; n++) {
+        unsigned int bits = data->bitmap[word];
+
+        if (bits != 0xFFFFFFFF) {
+            unsigned int bit = 0;
+
+            while (bits & (1u << bit)) {
+                bit++;
+            }
+
+            return word * 32 + bit;
+        }
+
+        if (++word == words) {
+            word = 0;
+        }
+    }
+
+    return 0;
+}
+
+// Allocate a cluster as the end of a chain, preferring the goal
+//
+// Returns the cluster, or 0 if the volume is full.
+static unsigned int fat32_alloc_cluster(fat32_fs_data_t* data, unsigned int goal) {
+    if (data->free_count == 0) {
+        return 0;
+    }
+
+    unsigned int cluster = goal;
+
+    if (!fat32_valid_cluster(data, cluster) || fat32_cluster_used(data, cluster)) {
+        cluster = fat32_find_free(data, data->next_free);
+    }
+
+    if (!cluster || fat32_set_fat(data, cluster, FAT32_EOC_MARK) != 0) {
+        return 0;
+    }
+
+    data->bitmap[cluster / 32] |= 1u << (cluster % 32);
+    data->free_count--;
+    data->next_free = fat32_valid_cluster(data, cluster + 1) ? cluster + 1 : FAT32_FIRST_CLUSTER;
+
+    return cluster;
+}
+
+// Free a cluster
+static void fat32_free_cluster(fat32_fs_data_t* data, unsigned int cluster) {
+    if (!fat32_valid_cluster(data, cluster) || !fat32_cluster_used(data, cluster)) {
+        return;
+    }
+
+    fat32_set_fat(data, cluster, 0);
+    data->bitmap[cluster / 32] &= ~(1u << (cluster % 32));
+    data->free_count++;
+}
+
+// Update the free space reported for the mount
+static void fat32_update_free(fat32_fs_data_t* data) {
+    data->fs->free_size = (unsigned long long) data->free_count * data->cluster_size;
+}
+
+// Add a cluster to the end of a file's extent map
+static int fat32_run_append(fat32_file_t* file, unsigned int cluster) {
+    if (file->nr_runs > 0) {
+        fat32_run_t* last = &file->runs[file->nr_runs - 1];
+
+        if (last->cluster + last->length == cluster) {
+            last->length++;
+            file->nr_clusters++;
+            return 0;
+        }
+    }
+
+    if (file->nr_runs == file->max_runs) {
+        unsigned int blocks = file->run_blocks ? file->run_blocks * 2 :
+                              (2 * FAT32_INLINE_RUNS * sizeof(fat32_run_t) + MEMORY_BLOCK_SIZE - 1) / MEMORY_BLOCK_SIZE;
+        fat32_run_t* runs = (fat32_run_t*) allocate_blocks(blocks);
+
+        if (!runs) {
+            return -1;
+        }
+
+        memcpy(runs, file->runs, file->nr_runs * sizeof(fat32_run_t));
+
+        if (file->run_blocks) {
+            free_blocks(file->runs, file->run_blocks);
+        }
+
+        file->runs = runs;
+        file->run_blocks = blocks;
+        file->max_runs = blocks * MEMORY_BLOCK_SIZE / sizeof(fat32_run_t);
+    }
+
+    fat32_run_t* run = &file->runs[file->nr_runs++];
+
+    run->logical = file->nr_clusters++;
+    run->cluster = cluster;
+    run->length = 1;
+
+    return 0;
+}
+
+// Map a cluster index in a file to a cluster on the volume
+//
+// Returns 0 past the end of the chain. If run is given, it is set to the
+// number of contiguous clusters from there on.
+static unsigned int fat32_map(fat32_file_t* file, unsigned int index, unsigned int* run) {
+    if (index >= file->nr_clusters) {
+        return 0;
+    }
+
+    fat32_run_t* current = &file->runs[file->last_run];
+
+    if (index < current->logical || index - current->logical >= current->length) {
+        unsigned int low = 0;
+        unsigned int high = file->nr_runs - 1;
+
+        while (low < high) {
+            unsigned int middle = (low + high + 1) / 2;
+
+            if (file->runs[middle].logical <= index) {
+                low = middle;
+            } else {
+                high = middle - 1;
+            }
+        }
+
+        file->last_run = low;
+        current = &file->runs[low];
+    }
+
+    if (run) {
+        *run = current->logical + current->length - index;
+    }
+
+    return current->cluster + (index - current->logical);
+}
+
+// Build the extent map of a file by walking its chain
+static int fat32_load_runs(fat32_fs_data_t* data, fat32_file_t* file) {
+    unsigned int cluster = file->first_cluster;
+
+    if (cluster == 0) {
+        return 0;
+    }
+
+    while (fat32_valid_cluster(data, cluster)) {
+        // A chain longer than the volume loops
+        if (file->nr_clusters >= data->cluster_count || fat32_run_append(file, cluster) != 0) {
+            break;
+        }
+
+        unsigned int next;
+
+        if (fat32_get_fat(data, cluster, &next) != 0) {
+            return -1;
+        }
+
+        if (next >= FAT32_END_OF_CHAIN) {
+            return 0;
+        }
+
+        cluster = next;
+    }
+
+    KLOG(&fat32_log, KLOG_ERR, "Broken cluster chain in %s at cluster %u\n", file->path, file->first_cluster);
+
+    return -1;
+}
+
+// Grow a file's chain to a number of clusters
+//
+// New clusters follow the last one where they are free, so a file written
+// sequentially stays in one run. Returns -1 if the volume fills up first.
+static int fat32_extend(fat32_fs_data_t* data, fat32_file_t* file, unsigned int clusters) {
+    while (file->nr_clusters < clusters) {
+        unsigned int last = file->nr_clusters ? fat32_map(file, file->nr_clusters - 1, NULL) : 0;
+        unsigned int cluster = fat32_alloc_cluster(data, last ? last + 1 : data->next_free);
+
+        if (!cluster) {
+            return -1;
+        }
+
+        if (fat32_run_append(file, cluster) != 0) {
+            fat32_free_cluster(data, cluster);
+            return -1;
+        }
+
+        if (last) {
+            fat32_set_fat(data, last, cluster);
+        } else {
+            file->first_cluster = cluster;
+        }
+    }
+
+    return 0;
+}
+
+// Shrink a file's chain to a number of clusters, freeing the rest
+static void fat32_shrink(fat32_fs_data_t* data, fat32_file_t* file, unsigned int clusters) {
+    if (clusters >= file->nr_clusters) {
+        return;
+    }
+
+    while (file->nr_runs > 0) {
+        fat32_run_t* run = &file->runs[file->nr_runs - 1];
+        unsigned int keep = run->logical < clusters ? clusters - run->logical : 0;
+
+        for (unsigned int i = keep; i < run->length; i++) {
+            fat32_free_cluster(data, run->cluster + i);
+        }
+
+        if (keep > 0) {
+            run->length = keep;
+            break;
+        }
+
+        file->nr_runs--;
+    }
+
+    file->nr_clusters = clusters;
+    file->last_run = 0;
+
+    if (clusters == 0) {
+        file->first_cluster = 0;
+    } else {
+        fat32_set_fat(data, fat32_map(file, clusters - 1, NULL), FAT32_EOC_MARK);
+    }
+}
+
+// Read or write file contents through the device cache, a run at a time
+static int fat32_file_io(fat32_fs_data_t* data, fat32_file_t* file, void* buffer, unsigned int size, unsigned int offset, int write) {
+    unsigned char* p = (unsigned char*) buffer;
+    unsigned int done = 0;
+
+    while (done < size) {
+        unsigned long long position = (unsigned long long) offset + done;
+        unsigned int within = position % data->cluster_size;
+        unsigned int run;
+        unsigned int cluster = fat32_map(file, (unsigned int) (position / data->cluster_size), &run);
+
+        if (!cluster) {
+            break;
+        }
+
+        unsigned long long bytes = (unsigned long long) run * data->cluster_size - within;
+        unsigned int chunk = bytes < size - done ? (unsigned int) bytes : size - done;
+        unsigned long long device_offset = fat32_cluster_offset(data, cluster) + within;
+        int result = write ? page_cache_write(data->bdev, device_offset, p + done, chunk) :
+                             page_cache_read(data->bdev, device_offset, p + done, chunk);
+
+        if (result <= 0) {
+            break;
+        }
+
+        done += result;
+
+        if ((unsigned int) result < chunk) {
+            break;
+        }
+    }
+
+    return done > 0 || size == 0 ? (int) done : -1;
+}
+
+// Fill a byte range of a file with zeros (FAT files have no holes)
+static int fat32_zero(fat32_fs_data_t* data, fat32_file_t* file, unsigned int start, unsigned int end) {
+    while (start < end) {
+        unsigned int chunk = end - start < MEMORY_BLOCK_SIZE ? end - start : MEMORY_BLOCK_SIZE;
+
+        if (fat32_file_io(data, file, data->zero_block, chunk, start, 1) != (int) chunk) {
+            return -1;
+        }
+
+        start += chunk;
+    }
+
+    return 0;
+}
+
+// Write a file's size and first cluster back to its directory entry
+static int fat32_update_entry(fat32_fs_data_t* data, fat32_file_t* file, int modified) {
+    if (file->entry_offset == 0) {
+        return 0;
+    }
+
+    fat32_dirent_t entry;
+
+    if (page_cache_read(data->bdev, file->entry_offset, &entry, sizeof(fat32_dirent_t)) != sizeof(fat32_dirent_t)) {
+        return -1;
+    }
+
+    fat32_set_entry_cluster(&entry, file->first_cluster);
+    entry.size = (file->attr & FAT32_ATTR_DIRECTORY) ? 0 : file->size;
+    entry.attr = file->attr;
+
+    if (modified) {
+        fat32_now(&entry.write_date, &entry.write_time);
+        entry.access_date = entry.write_date;
+        entry.attr |= FAT32_ATTR_ARCHIVE;
+        file->attr = entry.attr;
+    }
+
+    return page_cache_write(data->bdev, file->entry_offset, &entry, sizeof(fat32_dirent_t)) == sizeof(fat32_dirent_t) ? 0 : -1;
+}
+
+// Compute the checksum of an 8.3 name that its long name entries carry
+static unsigned char fat32_lfn_checksum(const unsigned char* name) {
+    unsigned char sum = 0;
+
+    for (int i = 0; i < 11; i++) {
+        sum = (unsigned char) (((sum & 1) << 7) + (sum >> 1) + name[i]);
+    }
+
+    return sum;
+}
+
+// Format an 8.3 entry's name as NAME.EXT; returns its length
+static unsigned int fat32_short_to_name(const fat32_dirent_t* entry, char* name) {
+    unsigned int length = 0;
+    int base_end = 8;
+    int ext_end = 11;
+
+    while (base_end > 0 && entry->name[base_end - 1] == ' ') {
+        base_end--;
+    }
+
+    while (ext_end > 8 && entry->name[ext_end - 1] == ' ') {
+        ext_end--;
+    }
+
+    for (int i = 0; i < base_end; i++) {
+        char c = (char) entry->name[i];
+
+        if (i == 0 && entry->name[0] == FAT32_DIRENT_KANJI) {
+            c = (char) FAT32_DIRENT_DELETED;
+        } else if ((entry->case_flags & FAT32_CASE_LOWER_BASE) && c >= 'A' && c <= 'Z') {
+            c += 'a' - 'A';
+        }
+
+        name[length++] = c;
+    }
+
+    if (ext_end > 8) {
+        name[length++] = '.';
+
+        for (int i = 8; i < ext_end; i++) {
+            char c = (char) entry->name[i];
+
+            if ((entry->case_flags & FAT32_CASE_LOWER_EXT) && c >= 'A' && c <= 'Z') {
+                c += 'a' - 'A';
+            }
+
+            name[length++] = c;
+        }
+    }
+
+    name[length] = '\0';
+
+    return length;
+}
+
+// Convert a long name to UTF-8; returns its length, or -1 if it does not fit
+static int fat32_lfn_to_utf8(const unsigned short* units, unsigned int count, char* name) {
+    unsigned int length = 0;
+
+    for (unsigned int i = 0; i < count && units[i] != 0; i++) {
+        unsigned int c = units[i];
+
+        // Characters outside the basic plane are not decoded
+        if (c >= 0xD800 && c <= 0xDFFF) {
+            c = '?';
+        }
+
+        unsigned int bytes = c < 0x80 ? 1 : c < 0x800 ? 2 : 3;
+
+        if (length + bytes > FAT32_NAME_MAX) {
+            return -1;
+        }
+
+        if (bytes == 1) {
+            name[length++] = (char) c;
+        } else if (bytes == 2) {
+            name[length++] = (char) (0xC0 | (c >> 6));
+            name[length++] = (char) (0x80 | (c & 0x3F));
+        } else {
+            name[length++] = (char) (0xE0 | (c >> 12));
+            name[length++] = (char) (0x80 | ((c >> 6) & 0x3F));
+            name[length++] = (char) (0x80 | (c & 0x3F));
+        }
+    }
+
+    name[length] = '\0';
+
+    return length;
+}
+
+// Convert a UTF-8 name to long name characters; returns the count, or -1
+static int fat32_utf8_to_lfn(const char* name, unsigned int length, unsigned short* units) {
+    const unsigned char* p = (const unsigned char*) name;
+    unsigned int count = 0;
+    unsigned int i = 0;
+
+    while (i < length) {
+        unsigned int c = p[i];
+        unsigned int extra = 0;
+
+        if (c >= 0xE0 && c < 0xF0) {
+            c &= 0x0F;
+            extra = 2;
+        } else if (c >= 0xC0 && c < 0xE0) {
+            c &= 0x1F;
+            extra = 1;
+        } else if (c >= 0x80) {
+            return -1;
+        }
+
+        if (extra > 0 && i + extra >= length) {
+            return -1;
+        }
+
+        for (unsigned int j = 1; j <= extra; j++) {
+            if ((p[i + j] & 0xC0) != 0x80) {
+                return -1;
+            }
+
+            c = (c << 6) | (p[i + j] & 0x3F);
+        }
+
+        if (count == FAT32_NAME_MAX || (c >= 0xD800 && c <= 0xDFFF)) {
+            return -1;
+        }
+
+        units[count++] = (unsigned short) c;
+        i += extra + 1;
+    }
+
+    return count;
+}
+
+// Compare two names, ignoring ASCII case
+static int fat32_name_equal(const char* a, unsigned int a_length, const char* b, unsigned int b_length) {
+    if (a_length != b_length) {
+        return 0;
+    }
+
+    for (unsigned int i = 0; i < a_length; i++) {
+        char x = a[i];
+        char y = b[i];
+
+        if (x >= 'a' && x <= 'z') {
+            x -= 'a' - 'A';
+        }
+
+        if (y >= 'a' && y <= 'z') {
+            y -= 'a' - 'A';
+        }
+
+        if (x != y) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// Check if a character may appear in an 8.3 name (after folding to upper case)
+static int fat32_short_char(char c) {
+    if ((c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')) {
+        return 1;
+    }
+
+    const char* allowed = "!#$%&'()-@^_`{}~";
+
+    for (int i = 0; allowed[i]; i++) {
+        if (c == allowed[i]) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Build the 8.3 name for a new entry
+//
+// Returns 1 if the name fits 8.3 as it stands, with the case of each part
+// kept in *case_flags. Otherwise short is filled with the basis of a
+// numbered alias (which needs a long name) and 0 is returned.
+static int fat32_make_short_name(const char* name, unsigned int length, unsigned char* short_name, unsigned char* case_flags) {
+    int dot = -1;
+    int fits = 1;
+
+    // The extension follows the last dot, unless the name only starts with one
+    for (unsigned int i = 1; i < length; i++) {
+        if (name[i] == '.') {
+            dot = i;
+        }
+    }
+
+    unsigned int base_length = dot >= 0 ? (unsigned int) dot : length;
+    unsigned int ext_length = dot >= 0 ? length - dot - 1 : 0;
+
+    if (base_length == 0 || base_length > 8 || ext_length > 3 || (dot >= 0 && ext_length == 0)) {
+        fits = 0;
+    }
+
+    memset(short_name, ' ', 11);
+    *case_flags = 0;
+
+    for (int part = 0; part < 2; part++) {
+        unsigned int start = part == 0 ? 0 : base_length + 1;
+        unsigned int end = part == 0 ? base_length : length;
+        unsigned int limit = part == 0 ? 8 : 11;
+        unsigned int out = part == 0 ? 0 : 8;
+        int lower = 0;
+        int upper = 0;
+
+        for (unsigned int i = start; i < end; i++) {
+            char c = name[i];
+
+            // One replacement character stands for a whole UTF-8 sequence
+            if (((unsigned char) c & 0xC0) == 0x80) {
+                continue;
+            }
+
+            if (c == '.' || c == ' ') {
+                // Dots and spaces are dropped from aliases
+                fits = 0;
+                continue;
+            }
+
+            if (c >= 'a' && c <= 'z') {
+                lower = 1;
+                c -= 'a' - 'A';
+            } else if (c >= 'A' && c <= 'Z') {
+                upper = 1;
+            }
+
+            if (!fat32_short_char(c)) {
+                fits = 0;
+                c = '_';
+            }
+
+            if (out < limit) {
+                short_name[out++] = (unsigned char) c;
+            }
+        }
+
+        // A part in mixed case needs a long name to keep it
+        if (lower && upper) {
+            fits = 0;
+        } else if (lower) {
+            *case_flags |= part == 0 ? FAT32_CASE_LOWER_BASE : FAT32_CASE_LOWER_EXT;
+        }
+    }
+
+    if (short_name[0] == ' ') {
+        short_name[0] = '_';
+    }
+
+    if (short_name[0] == FAT32_DIRENT_DELETED) {
+        short_name[0] = FAT32_DIRENT_KANJI;
+    }
+
+    if (!fits) {
+        *case_flags = 0;
+    }
+
+    return fits;
+}
+
+// Put a numbered tail (~N) into the base of an alias
+static void fat32_short_tail(const unsigned char* basis, unsigned int number, unsigned char* short_name) {
+    char digits[8];
+    unsigned int count = 0;
+
+    while (number > 0) {
+        digits[count++] = (char) ('0' + number % 10);
+        number /= 10;
+    }
+
+    unsigned int base_length = 0;
+
+    while (base_length < 8 && basis[base_length] != ' ') {
+        base_length++;
+    }
+
+    unsigned int keep = base_length < 7 - count ? base_length : 7 - count;
+
+    memcpy(short_name, basis, 11);
+    short_name[keep++] = '~';
+
+    while (count > 0) {
+        short_name[keep++] = (unsigned char) digits[--count];
+    }
+
+    while (keep < 8) {
+        short_name[keep++] = ' ';
+    }
+}
+
+// Check if a name may be created in a directory
+static int fat32_valid_name(const char* name, unsigned int length) {
+    if (length == 0 || length > FAT32_NAME_MAX || (length == 1 && name[0] == '.') ||
+        (length == 2 && name[0] == '.' && name[1] == '.')) {
+        return 0;
+    }
+
+    for (unsigned int i = 0; i < length; i++) {
+        unsigned char c = (unsigned char) name[i];
+
+        if (c < 0x20 || c == '"' || c == '*' || c == '/' || c == ':' || c == '<' ||
+            c == '>' || c == '?' || c == '\\' || c == '|') {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// Get the number of entries a directory has room for
+static unsigned int fat32_dir_entries(fat32_fs_data_t* data, fat32_file_t* dir) {
+    unsigned long long entries = (unsigned long long) dir->nr_clusters * data->cluster_size / sizeof(fat32_dirent_t);
+
+    return entries < FAT32_DIR_MAX_ENTRIES ? (unsigned int) entries : FAT32_DIR_MAX_ENTRIES;
+}
+
+// Get the device offset of a directory entry; returns 0 past the end
+static unsigned long long fat32_dir_offset(fat32_fs_data_t* data, fat32_file_t* dir, unsigned int index) {
+    unsigned long long position = (unsigned long long) index * sizeof(fat32_dirent_t);
+    unsigned int cluster = fat32_map(dir, (unsigned int) (position / data->cluster_size), NULL);
+
+    if (!cluster) {
+        return 0;
+    }
+
+    return fat32_cluster_offset(data, cluster) + position % data->cluster_size;
+}
+
+// Read a directory entry
+static int fat32_dir_read(fat32_fs_data_t* data, fat32_file_t* dir, unsigned int index, fat32_dirent_t* entry) {
+    unsigned long long offset = fat32_dir_offset(data, dir, index);
+
+    if (!offset || page_cache_read(data->bdev, offset, entry, sizeof(fat32_dirent_t)) != sizeof(fat32_dirent_t)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+// Write a directory entry
+static int fat32_dir_write(fat32_fs_data_t* data, fat32_file_t* dir, unsigned int index, const void* entry) {
+    unsigned long long offset = fat32_dir_offset(data, dir, index);
+
+    if (!offset || page_cache_write(data->bdev, offset, entry, sizeof(fat32_dirent_t)) != sizeof(fat32_dirent_t)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+// Find a name in a directory
+//
+// Long names and 8.3 names both match, ignoring case. If short_name is
+// given, the exact 8.3 name is looked for instead. Returns 1 with *slot
+// filled in if found, 0 if not, or -1 on an I/O error.
+static int fat32_dir_scan(fat32_fs_data_t* data, fat32_file_t* dir, const char* name, unsigned int length, const unsigned char* short_name, fat32_slot_t* slot) {
+    unsigned int count = fat32_dir_entries(data, dir);
+    unsigned short units[FAT32_LFN_MAX_SLOTS * FAT32_LFN_CHARS];
+    char entry_name[FAT32_NAME_MAX + 1];
+    unsigned int lfn_slots = 0;
+    unsigned int lfn_next = 0;      // Order of the long name entry expected next
+    unsigned int lfn_first = 0;
+    unsigned char lfn_sum = 0;
+    int lfn_complete = 0;
+
+    for (unsigned int i = 0; i < count; i++) {
+        fat32_dirent_t entry;
+
+        if (fat32_dir_read(data, dir, i, &entry) != 0) {
+            return -1;
+        }
+
+        const unsigned char* raw = (const unsigned char*) &entry;
+
+        if (raw[0] == FAT32_DIRENT_END) {
+            return 0;
+        }
+
+        if (raw[0] == FAT32_DIRENT_DELETED) {
+            lfn_next = 0;
+            lfn_complete = 0;
+            continue;
+        }
+
+        if ((entry.attr & FAT32_ATTR_MASK) == FAT32_ATTR_LONG_NAME) {
+            unsigned int order = raw[0] & FAT32_LFN_ORDER;
+
+            // Long names are stored last part first
+            if (raw[0] & FAT32_LFN_LAST) {
+                lfn_slots = order;
+                lfn_next = order;
+                lfn_first = i;
+                lfn_sum = raw[13];
+            }
+
+            lfn_complete = 0;
+
+            if (order == 0 || order > FAT32_LFN_MAX_SLOTS || order != lfn_next || raw[13] != lfn_sum) {
+                lfn_next = 0;
+                continue;
+            }
+
+            for (int j = 0; j < FAT32_LFN_CHARS; j++) {
+                units[(order - 1) * FAT32_LFN_CHARS + j] = (unsigned short) fat32_le16(raw + fat32_lfn_offsets[j]);
+            }
+
+            lfn_next--;
+            lfn_complete = lfn_next == 0;
+            continue;
+        }
+
+        int has_lfn = lfn_complete && fat32_lfn_checksum(entry.name) == lfn_sum;
+
+        lfn_next = 0;
+        lfn_complete = 0;
+
+        if (entry.attr & FAT32_ATTR_VOLUME_ID) {
+            continue;
+        }
+
+        int match;
+
+        if (short_name) {
+            match = memcmp(entry.name, short_name, 11) == 0;
+        } else {
+            int n = has_lfn ? fat32_lfn_to_utf8(units, lfn_slots * FAT32_LFN_CHARS, entry_name) : -1;
+
+            match = n >= 0 && fat32_name_equal(entry_name, n, name, length);
+
+            // A long name can also be reached through its alias
+            if (!match) {
+                n = fat32_short_to_name(&entry, entry_name);
+                match = fat32_name_equal(entry_name, n, name, length);
+            }
+        }
+
+        if (match) {
+            slot->entry = entry;
+            slot->index = i;
+            slot->first = has_lfn ? lfn_first : i;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Check if a directory holds nothing but its dot entries
+static int fat32_dir_empty(fat32_fs_data_t* data, fat32_file_t* dir) {
+    unsigned int count = fat32_dir_entries(data, dir);
+
+    for (unsigned int i = 0; i < count; i++) {
+        fat32_dirent_t entry;
+
+        if (fat32_dir_read(data, dir, i, &entry) != 0) {
+            return 0;
+        }
+
+        if (entry.name[0] == FAT32_DIRENT_END) {
+            return 1;
+        }
+
+        if (entry.name[0] == FAT32_DIRENT_DELETED || (entry.attr & FAT32_ATTR_MASK) == FAT32_ATTR_LONG_NAME ||
+            (entry.attr & FAT32_ATTR_VOLUME_ID)) {
+            continue;
+        }
+
+        if (memcmp(entry.name, ".          ", 11) != 0 && memcmp(entry.name, "..         ", 11) != 0) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// Fill a cluster with zeros
+static int fat32_zero_cluster(fat32_fs_data_t* data, unsigned int cluster) {
+    unsigned long long offset = fat32_cluster_offset(data, cluster);
+
+    for (unsigned int done = 0; done < data->cluster_size; done += MEMORY_BLOCK_SIZE) {
+        unsigned int chunk = data->cluster_size - done < MEMORY_BLOCK_SIZE ? data->cluster_size - done : MEMORY_BLOCK_SIZE;
+
+        if (page_cache_write(data->bdev, offset + done, data->zero_block, chunk) != (int) chunk) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Find a run of free entries in a directory, growing it if needed
+//
+// Returns the index of the first entry of the run, or -1.
+static int fat32_dir_reserve(fat32_fs_data_t* data, fat32_file_t* dir, unsigned int needed) {
+    unsigned int count = fat32_dir_entries(data, dir);
+    unsigned int start = 0;
+    unsigned int run = 0;
+
+    for (unsigned int i = 0; i < count; i++) {
+        fat32_dirent_t entry;
+
+        if (fat32_dir_read(data, dir, i, &entry) != 0) {
+            return -1;
+        }
+
+        if (entry.name[0] == FAT32_DIRENT_END) {
+            // Everything after the end marker is free
+            if (run == 0) {
+                start = i;
+            }
+
+            run += count - i;
+            break;
+        }
+
+        if (entry.name[0] != FAT32_DIRENT_DELETED) {
+            run = 0;
+            continue;
+        }
+
+        if (run++ == 0) {
+            start = i;
+        }
+
+        if (run == needed) {
+            return start;
+        }
+    }
+
+    if (run >= needed) {
+        return start;
+    }
+
+    if (run == 0) {
+        start = count;
+    }
+
+    // Add zeroed clusters to the end of the directory
+    unsigned int entries_per_cluster = data->cluster_size / sizeof(fat32_dirent_t);
+    unsigned int clusters = (needed - run + entries_per_cluster - 1) / entries_per_cluster;
+    unsigned int old_clusters = dir->nr_clusters;
+
+    if (start + needed > FAT32_DIR_MAX_ENTRIES) {
+        return -1;
+    }
+
+    if (fat32_extend(data, dir, old_clusters + clusters) != 0) {
+        fat32_shrink(data, dir, old_clusters);
+        return -1;
+    }
+
+    for (unsigned int i = old_clusters; i < dir->nr_clusters; i++) {
+        if (fat32_zero_cluster(data, fat32_map(dir, i, NULL)) != 0) {
+            return -1;
+        }
+    }
+
+    return start;
+}
+
+// Add a name to a directory
+//
+// entry is the 8.3 entry to store; its name is filled in here, along with
+// the long name entries if the name needs them. The index of the 8.3 entry
+// is returned in *index.
+static int fat32_dir_add(fat32_fs_data_t* data, fat32_file_t* dir, const char* name, unsigned int length, fat32_dirent_t* entry, unsigned int* index) {
+    unsigned short units[FAT32_NAME_MAX];
+    int unit_count = fat32_utf8_to_lfn(name, length, units);
+
+    if (unit_count <= 0) {
+        return -1;
+    }
+
+    unsigned int lfn_slots = 0;
+
+    if (!fat32_make_short_name(name, length, entry->name, &entry->case_flags)) {
+        unsigned char basis[11];
+        fat32_slot_t existing;
+        unsigned int number = 1;
+
+        memcpy(basis, entry->name, 11);
+
+        // Take the first numbered alias not in use
+        while (1) {
+            if (number > FAT32_MAX_ALIASES) {
+                return -1;
+            }
+
+            fat32_short_tail(basis, number++, entry->name);
+
+            int found = fat32_dir_scan(data, dir, NULL, 0, entry->name, &existing);
+
+            if (found < 0) {
+                return -1;
+            }
+
+            if (!found) {
+                break;
+            }
+        }
+
+        lfn_slots = (unit_count + FAT32_LFN_CHARS - 1) / FAT32_LFN_CHARS;
+    }
+
+    int start = fat32_dir_reserve(data, dir, lfn_slots + 1);
+
+    if (start < 0) {
+        return -1;
+    }
+
+    unsigned char sum = fat32_lfn_checksum(entry->name);
+
+    for (unsigned int i = 0; i < lfn_slots; i++) {
+        unsigned int order = lfn_slots - i;
+        unsigned char raw[sizeof(fat32_dirent_t)];
+
+        memset(raw, 0, sizeof(raw));
+        raw[0] = (unsigned char) (order | (i == 0 ? FAT32_LFN_LAST : 0));
+        raw[11] = FAT32_ATTR_LONG_NAME;
+        raw[13] = sum;
+
+        // The name ends with a zero, then the rest of the last part is padding
+        for (int j = 0; j < FAT32_LFN_CHARS; j++) {
+            unsigned int position = (order - 1) * FAT32_LFN_CHARS + j;
+            unsigned int unit = position < (unsigned int) unit_count ? units[position] :
+                                position == (unsigned int) unit_count ? 0x0000 : 0xFFFF;
+
+            raw[fat32_lfn_offsets[j]] = (unsigned char) unit;
+            raw[fat32_lfn_offsets[j] + 1] = (unsigned char) (unit >> 8);
+        }
+
+        if (fat32_dir_write(data, dir, start + i, raw) != 0) {
+            return -1;
+        }
+    }
+
+    if (fat32_dir_write(data, dir, start + lfn_slots, entry) != 0) {
+        return -1;
+    }
+
+    *index = start + lfn_slots;
+
+    return 0;
+}
+
+// Remove a name from a directory, with its long name entries
+static int fat32_dir_remove(fat32_fs_data_t* data, fat32_file_t* dir, const fat32_slot_t* slot) {
+    for (unsigned int i = slot->first; i <= slot->index; i++) {
+        fat32_dirent_t entry;
+
+        if (fat32_dir_read(data, dir, i, &entry) != 0) {
+            return -1;
+        }
+
+        entry.name[0] = FAT32_DIRENT_DELETED;
+
+        if (fat32_dir_write(data, dir, i, &entry) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Drop a cached file
+static void fat32_file_free(fat32_fs_data_t* data, int slot) {
+    fat32_file_t* file = data->files[slot];
+
+    hashmap_remove(&data->file_map, file->path);
+
+    if (file->run_blocks) {
+        free_blocks(file->runs, file->run_blocks);
+    }
+
+    free_block(file);
+    data->files[slot] = NULL;
+}
+
+// Drop a file from the file table, if it is in it
+static void fat32_file_forget(fat32_fs_data_t* data, fat32_file_t* file) {
+    for (int i = 0; i < FAT32_MAX_FILES; i++) {
+        if (data->files[i] == file) {
+            fat32_file_free(data, i);
+            return;
+        }
+    }
+}
+
+// Add a file to the file table, recycling the least recently used unopened entry
+//
+// A NULL entry stands for the root directory.
+static fat32_file_t* fat32_file_create(fat32_fs_data_t* data, const char* path, const fat32_dirent_t* entry, unsigned long long entry_offset) {
+    int slot = -1;
+
+    for (int i = 0; i < FAT32_MAX_FILES; i++) {
+        if (!data->files[i]) {
+            slot = i;
+            break;
+        }
+
+        if (data->files[i]->refcount == 0 &&
+            (slot < 0 || data->files[i]->last_used < data->files[slot]->last_used)) {
+            slot = i;
+        }
+    }
+
+    if (slot < 0) {
+        KLOG(&fat32_log, KLOG_WARNING, "File table full\n");
+        return NULL;
+    }
+
+    if (data->files[slot]) {
+        fat32_file_free(data, slot);
+    }
+
+    fat32_file_t* file = (fat32_file_t*) allocate_block();
+
+    if (!file) {
+        return NULL;
+    }
+
+    memset(file, 0, sizeof(fat32_file_t));
+    strcpy(file->path, path);
+    file->runs = file->inline_runs;
+    file->max_runs = FAT32_INLINE_RUNS;
+
+    if (entry) {
+        file->first_cluster = fat32_entry_cluster(entry);
+        file->attr = entry->attr;
+        file->size = (entry->attr & FAT32_ATTR_DIRECTORY) ? 0 : entry->size;
+        file->entry_offset = entry_offset;
+    } else {
+        file->first_cluster = data->root_cluster;
+        file->attr = FAT32_ATTR_DIRECTORY;
+    }
+
+    if (fat32_load_runs(data, file) != 0) {
+        if (file->run_blocks) {
+            free_blocks(file->runs, file->run_blocks);
+        }
+
+        free_block(file);
+        return NULL;
+    }
+
+    // Never read past the chain of a damaged file
+    if ((unsigned long long) file->size > (unsigned long long) file->nr_clusters * data->cluster_size) {
+        KLOG(&fat32_log, KLOG_WARNING, "%s is shorter than its size\n", path);
+        file->size = file->nr_clusters * data->cluster_size;
+    }
+
+    data->files[slot] = file;
+    hashmap_insert(&data->file_map, file->path, file);
+
+    return file;
+}
+
+// Put a path in the form used as the file table key
+//
+// "." and ".." components are resolved and names are folded to upper case.
+static int fat32_canonical_path(const char* path, char* canonical) {
+    unsigned int length = 0;
+
+    while (*path) {
+        while (*path == '/') {
+            path++;
+        }
+
+        const char* name = path;
+
+        while (*path && *path != '/') {
+            path++;
+        }
+
+        unsigned int n = path - name;
+
+        if (n == 0 || (n == 1 && name[0] == '.')) {
+            continue;
+        }
+
+        if (n == 2 && name[0] == '.' && name[1] == '.') {
+            while (length > 0 && canonical[--length] != '/');
+            continue;
+        }
+
+        if (length + 1 + n >= 256) {
+            return -1;
+        }
+
+        canonical[length++] = '/';
+
+        for (unsigned int i = 0; i < n; i++) {
+            char c = name[i];
+            canonical[length++] = c >= 'a' && c <= 'z' ? c - ('a' - 'A') : c;
+        }
+    }
+
+    if (length == 0) {
+        canonical[length++] = '/';
+    }
+
+    canonical[length] = '\0';
+
+    return 0;
+}
+
+// Find the cached file or directory for a path, reading it in if needed
+static fat32_file_t* fat32_lookup(fat32_fs_data_t* data, const char* path) {
+    char canonical[256];
+
+    if (fat32_canonical_path(path, canonical) != 0) {
+        return NULL;
+    }
+
+    fat32_file_t* file = (fat32_file_t*) hashmap_get(&data->file_map, canonical);
+
+    if (file) {
+        file->last_used = ++data->clock;
+        return file;
+    }
+
+    // Walk from the root, caching every directory on the way
+    char prefix[256] = "/";
+    unsigned int prefix_length = 0;
+    const char* p = canonical;
+
+    file = (fat32_file_t*) hashmap_get(&data->file_map, prefix);
+
+    if (!file) {
+        file = fat32_file_create(data, prefix, NULL, 0);
+
+        if (!file) {
+            return NULL;
+        }
+    }
+
+    while (*p) {
+        const char* name = ++p;
+
+        while (*p && *p != '/') {
+            p++;
+        }
+
+        unsigned int length = p - name;
+
+        if (length == 0) {
+            break;
+        }
+
+        if (!(file->attr & FAT32_ATTR_DIRECTORY)) {
+            return NULL;
+        }
+
+        prefix[prefix_length++] = '/';
+        memcpy(prefix + prefix_length, name, length);
+        prefix_length += length;
+        prefix[prefix_length] = '\0';
+
+        fat32_file_t* next = (fat32_file_t*) hashmap_get(&data->file_map, prefix);
+
+        if (!next) {
+            fat32_slot_t slot;
+
+            // Pin the directory so creating its child cannot recycle it
+            file->refcount++;
+
+            if (fat32_dir_scan(data, file, name, length, NULL, &slot) == 1) {
+                next = fat32_file_create(data, prefix, &slot.entry, fat32_dir_offset(data, file, slot.index));
+            }
+
+            file->refcount--;
+
+            if (!next) {
+                return NULL;
+            }
+        }
+
+        file = next;
+        file->last_used = ++data->clock;
+    }
+
+    return file;
+}
+
+// Split a path into the directory holding its final component and the component
+//
+// The final component may not be "." or "..".
+static int fat32_split_path(const char* path, char* parent, const char** name, unsigned int* length) {
+    unsigned int end = strlen(path);
+
+    while (end > 0 && path[end - 1] == '/') {
+        end--;
+    }
+
+    unsigned int start = end;
+
+    while (start > 0 && path[start - 1] != '/') {
+        start--;
+    }
+
+    if (start == end || start >= 256 || !fat32_valid_name(path + start, end - start)) {
+        return -1;
+    }
+
+    memcpy(parent, path, start);
+    parent[start] = '\0';
+
+    *name = path + start;
+    *length = end - start;
+
+    return 0;
+}
+
+// Look up the directory holding a path's final component, and pin it
+static fat32_file_t* fat32_lookup_parent(fat32_fs_data_t* data, const char* path, const char** name, unsigned int* length) {
+    char parent[256];
+
+    if (fat32_split_path(path, parent, name, length) != 0) {
+        return NULL;
+    }
+
+    fat32_file_t* dir = fat32_lookup(data, parent);
+
+    if (!dir || !(dir->attr & FAT32_ATTR_DIRECTORY)) {
+        return NULL;
+    }
+
+    dir->refcount++;
+
+    return dir;
+}
+
+// Fill in a new directory's first cluster: zeros, then its dot entries
+static int fat32_init_dir(fat32_fs_data_t* data, unsigned int cluster, fat32_file_t* parent, const fat32_dirent_t* entry) {
+    unsigned long long offset = fat32_cluster_offset(data, cluster);
+    fat32_dirent_t dot = *entry;
+
+    if (fat32_zero_cluster(data, cluster) != 0) {
+        return -1;
+    }
+
+    memcpy(dot.name, ".          ", 11);
+    fat32_set_entry_cluster(&dot, cluster);
+
+    if (page_cache_write(data->bdev, offset, &dot, sizeof(fat32_dirent_t)) != sizeof(fat32_dirent_t)) {
+        return -1;
+    }
+
+    // ".." of a directory in the root points at cluster 0
+    memcpy(dot.name, "..         ", 11);
+    fat32_set_entry_cluster(&dot, parent->first_cluster == data->root_cluster ? 0 : parent->first_cluster);
+
+    if (page_cache_write(data->bdev, offset + sizeof(fat32_dirent_t), &dot, sizeof(fat32_dirent_t)) != sizeof(fat32_dirent_t)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+// Create a file or directory
+static fat32_file_t* fat32_create(fat32_fs_data_t* data, const char* path, unsigned char attr) {
+    const char* name;
+    unsigned int length;
+    fat32_file_t* dir = fat32_lookup_parent(data, path, &name, &length);
+
+    if (!dir) {
+        return NULL;
+    }
+
+    fat32_slot_t slot;
+    fat32_dirent_t entry;
+    unsigned int cluster = 0;
+    unsigned int index;
+
+    memset(&entry, 0, sizeof(fat32_dirent_t));
+    entry.attr = attr;
+    fat32_now(&entry.create_date, &entry.create_time);
+    entry.write_date = entry.access_date = entry.create_date;
+    entry.write_time = entry.create_time;
+
+    int result = fat32_dir_scan(data, dir, name, length, NULL, &slot) == 0 ? 0 : -1;
+
+    // A directory starts with one cluster holding its dot entries
+    if (result == 0 && (attr & FAT32_ATTR_DIRECTORY)) {
+        cluster = fat32_alloc_cluster(data, data->next_free);
+        result = cluster ? fat32_init_dir(data, cluster, dir, &entry) : -1;
+        fat32_set_entry_cluster(&entry, cluster);
+    }
+
+    if (result == 0) {
+        result = fat32_dir_add(data, dir, name, length, &entry, &index);
+    }
+
+    if (result != 0 && cluster) {
+        fat32_free_cluster(data, cluster);
+    }
+
+    dir->refcount--;
+    fat32_update_free(data);
+
+    return result == 0 ? fat32_lookup(data, path) : NULL;
+}
+
+// Write the free cluster count and allocation hint to the FSInfo sector
+static int fat32_write_fsinfo(fat32_fs_data_t* data) {
+    if (!data->fsinfo_offset || data->read_only) {
+        return 0;
+    }
+
+    unsigned int values[2] = { data->free_count, data->next_free };
+
+    if (page_cache_write(data->bdev, data->fsinfo_offset + FAT32_FSINFO_FREE, values, sizeof(values)) != sizeof(values)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+// Write back everything changed on the volume
+static int fat32_flush(fat32_fs_data_t* data) {
+    if (data->read_only) {
+        return 0;
+    }
+
+    int result = fat32_write_fsinfo(data);
+
+    if (page_cache_sync(data->bdev) != 0) {
+        result = -1;
+    }
+
+    if (bdev_flush(data->dev) != 0) {
+        result = -1;
+    }
+
+    return result;
+}
+
+// Free the private data of a mount
+static void fat32_free_data(fat32_fs_data_t* data) {
+    for (int i = 0; i < FAT32_MAX_FILES; i++) {
+        if (data->files[i]) {
+            fat32_file_free(data, i);
+        }
+    }
+
+    if (data->bitmap) {
+        free_blocks(data->bitmap, data->bitmap_blocks);
+    }
+
+    if (data->zero_block) {
+        free_block(data->zero_block);
+    }
+
+    page_cache_release_mapping(data->bdev);
+    storage_close(data->dev);
+    free_blocks(data, FAT32_FS_DATA_BLOCKS);
+}
+
+// FAT32 mount function
+static int fat32_mount(filesystem_t* fs, const char* device, const char* mount_point, unsigned int flags) {
+    if (!fs || !device || !mount_point) {
+        return -1;
+    }
+
+    fat32_fs_data_t* data = (fat32_fs_data_t*) allocate_blocks(FAT32_FS_DATA_BLOCKS);
+
+    if (!data) {
+        terminal_write("Error: Failed to allocate memory for FAT32 file system data\n");
+        return -1;
+    }
+
+    memset(data, 0, sizeof(fat32_fs_data_t));
+
+    data->fs = fs;
+    hashmap_init(&data->file_map, data->file_map_entries, FAT32_FILE_MAP_CAPACITY);
+
+    // Open the device once for the lifetime of the mount
+    data->dev = storage_open(device);
+
+    if (!data->dev) {
+        free_blocks(data, FAT32_FS_DATA_BLOCKS);
+        return -1;
+    }
+
+    // Everything on the volume is read through the device's page cache
+    data->bdev = page_cache_get_device(data->dev);
+
+    if (!data->bdev) {
+        terminal_write("Error: Failed to open FAT32 device\n");
+        storage_close(data->dev);
+        free_blocks(data, FAT32_FS_DATA_BLOCKS);
+        return -1;
+    }
+
+    unsigned char boot[512];
+
+    if (page_cache_read(data->bdev, 0, boot, sizeof(boot)) != sizeof(boot)) {
+        terminal_write("Error: Failed to read FAT32 boot sector\n");
+        fat32_free_data(data);
+        return -1;
+    }
+
+    unsigned int bytes_per_sector = fat32_le16(boot + 11);
+    unsigned int sectors_per_cluster = boot[13];
+    unsigned int reserved_sectors = fat32_le16(boot + 14);
+    unsigned int root_entries = fat32_le16(boot + 17);
+    unsigned int total_sectors = fat32_le16(boot + 19);
+    unsigned int fat_size_16 = fat32_le16(boot + 22);
+    unsigned int fat_size = fat32_le32(boot + 36);
+    unsigned int ext_flags = fat32_le16(boot + 40);
+    unsigned int fsinfo_sector = fat32_le16(boot + 48);
+
+    if (total_sectors == 0) {
+        total_sectors = fat32_le32(boot + 32);
+    }
+
+    data->fat_count = boot[16];
+    data->root_cluster = fat32_le32(boot + 44);
+
+    // A FAT32 BPB has no FAT12/16 FAT size and no fixed root directory
+    if (boot[510] != 0x55 || boot[511] != 0xAA || fat_size_16 != 0 || root_entries != 0 || fat_size == 0) {
+        terminal_write("Error: Not a FAT32 file system\n");
+        fat32_free_data(data);
+        return -1;
+    }
+
+    unsigned long long first_data_sector = reserved_sectors + (unsigned long long) data->fat_count * fat_size;
+
+    if (bytes_per_sector < 512 || bytes_per_sector > 4096 || (bytes_per_sector & (bytes_per_sector - 1)) ||
+        sectors_per_cluster == 0 || (sectors_per_cluster & (sectors_per_cluster - 1)) ||
+        bytes_per_sector * sectors_per_cluster > FAT32_MAX_CLUSTER_SIZE || reserved_sectors == 0 ||
+        data->fat_count == 0 || total_sectors <= first_data_sector) {
+        terminal_write("Error: Unsupported FAT32 geometry\n");
+        fat32_free_data(data);
+        return -1;
+    }
+
+    data->cluster_size = bytes_per_sector * sectors_per_cluster;
+    data->fat_offset = (unsigned long long) reserved_sectors * bytes_per_sector;
+    data->fat_bytes = (unsigned long long) fat_size * bytes_per_sector;
+    data->data_offset = first_data_sector * bytes_per_sector;
+    data->cluster_count = (unsigned int) ((total_sectors - first_data_sector) / sectors_per_cluster);
+    data->mirror = !(ext_flags & FAT32_EXT_NO_MIRROR);
+    data->active_fat = data->mirror ? 0 : ext_flags & FAT32_EXT_ACTIVE_FAT;
+    data->read_only = data->dev->read_only;
+
+    // Clusters the FAT has no entries for, or past the end of the device, are unusable
+    if (data->cluster_count > data->fat_bytes / 4 - FAT32_FIRST_CLUSTER) {
+        data->cluster_count = (unsigned int) (data->fat_bytes / 4 - FAT32_FIRST_CLUSTER);
+    }
+
+    if (data->data_offset + (unsigned long long) data->cluster_count * data->cluster_size > data->dev->size) {
+        data->cluster_count = data->dev->size > data->data_offset ? (unsigned int) ((data->dev->size - data->data_offset) / data->cluster_size) : 0;
+    }
+
+    if (data->active_fat >= data->fat_count || !fat32_valid_cluster(data, data->root_cluster)) {
+        terminal_write("Error: Invalid FAT32 file system\n");
+        fat32_free_data(data);
+        return -1;
+    }
+
+    data->zero_block = (unsigned char*) allocate_block();
+
+    if (!data->zero_block || fat32_build_bitmap(data) != 0) {
+        terminal_write("Error: Failed to read the FAT\n");
+        fat32_free_data(data);
+        return -1;
+    }
+
+    memset(data->zero_block, 0, MEMORY_BLOCK_SIZE);
+    data->next_free = FAT32_FIRST_CLUSTER;
+
+    // The FSInfo sector only keeps hints; the bitmap has the real free count
+    if (fsinfo_sector > 0 && fsinfo_sector < reserved_sectors) {
+        unsigned char fsinfo[512];
+        unsigned long long offset = (unsigned long long) fsinfo_sector * bytes_per_sector;
+
+        if (page_cache_read(data->bdev, offset, fsinfo, sizeof(fsinfo)) == sizeof(fsinfo) &&
+            fat32_le32(fsinfo) == FAT32_FSINFO_LEAD_SIG &&
+            fat32_le32(fsinfo + FAT32_FSINFO_STRUCT) == FAT32_FSINFO_STRUCT_SIG) {
+            data->fsinfo_offset = offset;
+
+            if (fat32_valid_cluster(data, fat32_le32(fsinfo + FAT32_FSINFO_NEXT))) {
+                data->next_free = fat32_le32(fsinfo + FAT32_FSINFO_NEXT);
+            }
+        }
+    }
+
+    fs->private_data = data;
+    strcpy(fs->device, device);
+    strcpy(fs->mount_point, mount_point);
+    fs->flags = flags;
+    fs->total_size = (unsigned long long) data->cluster_count * data->cluster_size;
+    fat32_update_free(data);
+
+    KLOG(&fat32_log, KLOG_INFO, "Mounted %s on %s: %u clusters of %u bytes, %u free\n",
+         device, mount_point, data->cluster_count, data->cluster_size, data->free_count);
+
+    return 0;
+}
+
+// FAT32 unmount function
+static int fat32_unmount(filesystem_t* fs) {
+    if (!fs || !fs->private_data) {
+        return -1;
+    }
+
+    fat32_fs_data_t* data = (fat32_fs_data_t*) fs->private_data;
+
+    if (fat32_flush(data) != 0) {
+        KLOG(&fat32_log, KLOG_ERR, "Write back failed while unmounting %s\n", fs->mount_point);
+    }
+
+    fat32_free_data(data);
+    fs->private_data = NULL;
+
+    return 0;
+}
+
+// FAT32 read function
+static int fat32_read(filesystem_t* fs, const char* path, void* buffer, unsigned int size, unsigned int offset) {
+    if (!fs || !fs->private_data || !path || !buffer) {
+        return -1;
+    }
+
+    fat32_fs_data_t* data = (fat32_fs_data_t*) fs->private_data;
+    fat32_file_t* file = fat32_lookup(data, path);
+
+    if (!file || (file->attr & FAT32_ATTR_DIRECTORY)) {
+        return -1;
+    }
+
+    if (offset >= file->size || size == 0) {
+        return 0;
+    }
+
+    if (size > file->size - offset) {
+        size = file->size - offset;
+    }
+
+    return fat32_file_io(data, file, buffer, size, offset, 0);
+}
+
+// FAT32 write function; returns the number of bytes written
+static int fat32_write(filesystem_t* fs, const char* path, const void* buffer, unsigned int size, unsigned int offset) {
+    if (!fs || !fs->private_data || !path || !buffer) {
+        return -1;
+    }
+
+    fat32_fs_data_t* data = (fat32_fs_data_t*) fs->private_data;
+    fat32_file_t* file = fat32_lookup(data, path);
+
+    if (!file || (file->attr & (FAT32_ATTR_DIRECTORY | FAT32_ATTR_READ_ONLY)) || data->read_only) {
+        return -1;
+    }
+
+    if (size == 0) {
+        return 0;
+    }
+
+    if ((unsigned long long) offset + size > FAT32_MAX_FILE_SIZE) {
+        size = (unsigned int) (FAT32_MAX_FILE_SIZE - offset);
+
+        if (size == 0) {
+            return -1;
+        }
+    }
+
+    unsigned long long end = (unsigned long long) offset + size;
+
+    if (end > file->size) {
+        unsigned int clusters = (unsigned int) ((end + data->cluster_size - 1) / data->cluster_size);
+
+        // Write as much as fits on a full volume
+        if (fat32_extend(data, file, clusters) != 0) {
+            unsigned long long capacity = (unsigned long long) file->nr_clusters * data->cluster_size;
+
+            if (capacity <= offset) {
+                fat32_update_entry(data, file, 0);
+                fat32_update_free(data);
+                return -1;
+            }
+
+            if (capacity < end) {
+                size = (unsigned int) (capacity - offset);
+            }
+        }
+
+        // Whatever lies between the old end and the new data reads as zeros
+        if (offset > file->size && fat32_zero(data, file, file->size, offset) != 0) {
+            fat32_update_free(data);
+            return -1;
+        }
+    }
+
+    int written = fat32_file_io(data, file, (void*) buffer, size, offset, 1);
+
+    if (written > 0 && offset + (unsigned int) written > file->size) {
+        file->size = offset + written;
+    }
+
+    fat32_update_entry(data, file, 1);
+    fat32_update_free(data);
+
+    return written;
+}
+
+// FAT32 open function
+static int fat32_open(filesystem_t* fs, const char* path, unsigned int flags) {
+    if (!fs || !fs->private_data || !path) {
+        return -1;
+    }
+
+    fat32_fs_data_t* data = (fat32_fs_data_t*) fs->private_data;
+    fat32_file_t* file = fat32_lookup(data, path);
+
+    if (file && (flags & O_CREAT) && (flags & O_EXCL)) {
+        return -1;
+    }
+
+    if (!file && (flags & O_CREAT) && !data->read_only) {
+        file = fat32_create(data, path, FAT32_ATTR_ARCHIVE);
+
+        if (file) {
+            fs_invalidate_name(fs, path);
+        }
+    }
+
+    if (!file) {
+        return -1;
+    }
+
+    if ((flags & O_TRUNC) && !(file->attr & FAT32_ATTR_DIRECTORY) && file->nr_clusters > 0) {
+        if (data->read_only || (file->attr & FAT32_ATTR_READ_ONLY)) {
+            return -1;
+        }
+
+        fat32_shrink(data, file, 0);
+        file->size = 0;
+        fat32_update_entry(data, file, 1);
+        fat32_update_free(data);
+    }
+
+    // Open files keep their table slot until closed
+    for (int i = 0; i < FAT32_MAX_FILES; i++) {
+        if (data->files[i] == file) {
+            file->refcount++;
+            return FAT32_FD_BASE + i;
+        }
+    }
+
+    return -1;
+}
+
+// FAT32 close function
+static int fat32_close(filesystem_t* fs, int fd) {
+    if (!fs || !fs->private_data) {
+        return -1;
+    }
+
+    fat32_fs_data_t* data = (fat32_fs_data_t*) fs->private_data;
+    int slot = fd - FAT32_FD_BASE;
+
+    if (slot < 0 || slot >= FAT32_MAX_FILES || !data->files[slot] || data->files[slot]->refcount == 0) {
+        return -1;
+    }
+
+    data->files[slot]->refcount--;
+
+    return 0;
+}
+
+// FAT32 mkdir function (FAT has no permission bits, so the mode is unused)
+static int fat32_mkdir(filesystem_t* fs, const char* path, unsigned int mode) {
+    (void) mode;
+
+    if (!fs || !fs->private_data || !path) {
+        return -1;
+    }
+
+    fat32_fs_data_t* data = (fat32_fs_data_t*) fs->private_data;
+
+    if (data->read_only) {
+        return -1;
+    }
+
+    if (!fat32_create(data, path, FAT32_ATTR_DIRECTORY)) {
+        return -1;
+    }
+
+    fs_invalidate_name(fs, path);
+
+    return 0;
+}
+
+// Remove a file or an empty directory
+static int fat32_remove(filesystem_t* fs, const char* path, int directory) {
+    if (!fs || !fs->private_data || !path) {
+        return -1;
+    }
+
+    fat32_fs_data_t* data = (fat32_fs_data_t*) fs->private_data;
+
+    if (data->read_only) {
+        return -1;
+    }
+
+    const char* name;
+    unsigned int length;
+    fat32_file_t* dir = fat32_lookup_parent(data, path, &name, &length);
+
+    if (!dir) {
+        return -1;
+    }
+
+    fat32_file_t* file = fat32_lookup(data, path);
+    fat32_slot_t slot;
+    int result = -1;
+
+    // FAT cannot keep the clusters of an open file once its entry is gone
+    if (file && file->refcount == 0 && !(file->attr & FAT32_ATTR_DIRECTORY) == !directory &&
+        (!directory || fat32_dir_empty(data, file)) &&
+        fat32_dir_scan(data, dir, name, length, NULL, &slot) == 1 &&
+        fat32_dir_remove(data, dir, &slot) == 0) {
+        fat32_shrink(data, file, 0);
+        fat32_file_forget(data, file);
+        fat32_update_free(data);
+        result = 0;
+    }
+
+    dir->refcount--;
+
+    if (result == 0) {
+        fs_invalidate_name(fs, path);
+    }
+
+    return result;
+}
+
+// FAT32 rmdir function
+static int fat32_rmdir(filesystem_t* fs, const char* path) {
+    return fat32_remove(fs, path, 1);
+}
+
+// FAT32 unlink function
+static int fat32_unlink(filesystem_t* fs, const char* path) {
+    return fat32_remove(fs, path, 0);
+}
+
+// Check if a path lies inside a directory
+static int fat32_path_under(const char* path, const char* dir) {
+    unsigned int length = strlen(dir);
+
+    return memcmp(path, dir, length) == 0 && path[length] == '/';
+}
+
+// Move a file's entry to a new name, possibly in another directory
+static int fat32_move(fat32_fs_data_t* data, fat32_file_t* file, fat32_file_t* old_dir, const fat32_slot_t* slot,
+                      fat32_file_t* new_dir, const char* name, unsigned int length, const char* canonical) {
+    fat32_dirent_t entry = slot->entry;
+    unsigned int index;
+
+    if (fat32_dir_add(data, new_dir, name, length, &entry, &index) != 0 || fat32_dir_remove(data, old_dir, slot) != 0) {
+        return -1;
+    }
+
+    // A moved directory's ".." follows it
+    if ((file->attr & FAT32_ATTR_DIRECTORY) && old_dir != new_dir) {
+        fat32_dirent_t dotdot;
+
+        if (fat32_dir_read(data, file, 1, &dotdot) == 0 && memcmp(dotdot.name, "..         ", 11) == 0) {
+            fat32_set_entry_cluster(&dotdot, new_dir->first_cluster == data->root_cluster ? 0 : new_dir->first_cluster);
+            fat32_dir_write(data, file, 1, &dotdot);
+        }
+    }
+
+    file->entry_offset = fat32_dir_offset(data, new_dir, index);
+    hashmap_remove(&data->file_map, file->path);
+    strcpy(file->path, canonical);
+    hashmap_insert(&data->file_map, file->path, file);
+
+    return 0;
+}
+
+// FAT32 rename function (the new path must not exist)
+static int fat32_rename(filesystem_t* fs, const char* old_path, const char* new_path) {
+    if (!fs || !fs->private_data || !old_path || !new_path) {
+        return -1;
+    }
+
+    fat32_fs_data_t* data = (fat32_fs_data_t*) fs->private_data;
+    char old_canonical[256];
+    char new_canonical[256];
+
+    if (data->read_only || fat32_canonical_path(old_path, old_canonical) != 0 ||
+        fat32_canonical_path(new_path, new_canonical) != 0) {
+        return -1;
+    }
+
+    // Only the case differs, which the 8.3 name cannot tell apart anyway
+    if (strcmp(old_canonical, new_canonical) == 0) {
+        return fat32_lookup(data, old_path) ? 0 : -1;
+    }
+
+    // A directory cannot move into itself
+    if (fat32_path_under(new_canonical, old_canonical)) {
+        return -1;
+    }
+
+    const char* old_name;
+    const char* new_name;
+    unsigned int old_length;
+    unsigned int new_length;
+    fat32_file_t* old_dir = fat32_lookup_parent(data, old_path, &old_name, &old_length);
+
+    if (!old_dir) {
+        return -1;
+    }
+
+    fat32_file_t* new_dir = fat32_lookup_parent(data, new_path, &new_name, &new_length);
+
+    if (!new_dir) {
+        old_dir->refcount--;
+        return -1;
+    }
+
+    fat32_file_t* file = fat32_lookup(data, old_path);
+    fat32_slot_t slot;
+    fat32_slot_t existing;
+    int result = -1;
+
+    if (file && fat32_dir_scan(data, new_dir, new_name, new_length, NULL, &existing) == 0 &&
+        fat32_dir_scan(data, old_dir, old_name, old_length, NULL, &slot) == 1) {
+        result = 0;
+
+        // Cached paths below a directory go stale, so none may be in use
+        for (int i = 0; i < FAT32_MAX_FILES; i++) {
+            if (data->files[i] && data->files[i]->refcount > 0 && fat32_path_under(data->files[i]->path, old_canonical)) {
+                result = -1;
+            }
+        }
+    }
+
+    if (result == 0) {
+        for (int i = 0; i < FAT32_MAX_FILES; i++) {
+            if (data->files[i] && fat32_path_under(data->files[i]->path, old_canonical)) {
+                fat32_file_free(data, i);
+            }
+        }
+
+        file->refcount++;
+        result = fat32_move(data, file, old_dir, &slot, new_dir, new_name, new_length, new_canonical);
+        file->refcount--;
+        fat32_update_free(data);
+    }
+
+    old_dir->refcount--;
+    new_dir->refcount--;
+
+    if (result == 0) {
+        fs_invalidate_name(fs, old_path);
+        fs_invalidate_name(fs, new_path);
+    }
+
+    return result;
+}
+
+// FAT32 stat function
+static int fat32_stat(filesystem_t* fs, const char* path, fs_stat_t* stat) {
+    if (!fs || !fs->private_data || !path || !stat) {
+        return -1;
+    }
+
+    fat32_fs_data_t* data = (fat32_fs_data_t*) fs->private_data;
+    fat32_file_t* file = fat32_lookup(data, path);
+    fat32_dirent_t entry;
+
+    if (!file) {
+        return -1;
+    }
+
+    memset(&entry, 0, sizeof(fat32_dirent_t));
+
+    if (file->entry_offset &&
+        page_cache_read(data->bdev, file->entry_offset, &entry, sizeof(fat32_dirent_t)) != sizeof(fat32_dirent_t)) {
+        return -1;
+    }
+
+    if (file->attr & FAT32_ATTR_DIRECTORY) {
+        stat->size = (unsigned long long) file->nr_clusters * data->cluster_size;
+        stat->mode = FAT32_S_IFDIR | 0755;
+    } else {
+        stat->size = file->size;
+        stat->mode = FAT32_S_IFREG | 0644;
+    }
+
+    // Read-only files have no write permission for anyone
+    if (file->attr & FAT32_ATTR_READ_ONLY) {
+        stat->mode &= ~0222;
+    }
+
+    stat->uid = 0;
+    stat->gid = 0;
+    stat->atime = fat32_to_unix(entry.access_date, 0);
+    stat->mtime = fat32_to_unix(entry.write_date, entry.write_time);
+    stat->ctime = fat32_to_unix(entry.create_date, entry.create_time);
+
+    return 0;
+}
+
+// FAT32 chmod function (only the owner write bit maps to the read-only attribute)
+static int fat32_chmod(filesystem_t* fs, const char* path, unsigned int mode) {
+    if (!fs || !fs->private_data || !path) {
+        return -1;
+    }
+
+    fat32_fs_data_t* data = (fat32_fs_data_t*) fs->private_data;
+    fat32_file_t* file = fat32_lookup(data, path);
+
+    if (!file || data->read_only) {
+        return -1;
+    }
+
+    if (mode & 0200) {
+        file->attr &= ~FAT32_ATTR_READ_ONLY;
+    } else {
+        file->attr |= FAT32_ATTR_READ_ONLY;
+    }
+
+    return fat32_update_entry(data, file, 0);
+}
+
+// FAT32 chown function (FAT has no owners)
+static int fat32_chown(filesystem_t* fs, const char* path, unsigned int uid, unsigned int gid) {
+    (void) fs;
+    (void) path;
+    (void) uid;
+    (void) gid;
+
+    return -1;
+}
+
+// FAT32 truncate function (growing a file fills it with zeros)
+static int fat32_truncate(filesystem_t* fs, const char* path, unsigned int size) {
+    if (!fs || !fs->private_data || !path) {
+        return -1;
+    }
+
+    fat32_fs_data_t* data = (fat32_fs_data_t*) fs->private_data;
+    fat32_file_t* file = fat32_lookup(data, path);
+
+    if (!file || (file->attr & (FAT32_ATTR_DIRECTORY | FAT32_ATTR_READ_ONLY)) || data->read_only) {
+        return -1;
+    }
+
+    unsigned int clusters = (unsigned int) (((unsigned long long) size + data->cluster_size - 1) / data->cluster_size);
+    int result = 0;
+
+    if (size < file->size) {
+        fat32_shrink(data, file, clusters);
+        file->size = size;
+    } else if (size > file->size) {
+        if (fat32_extend(data, file, clusters) != 0 || fat32_zero(data, file, file->size, size) != 0) {
+            fat32_shrink(data, file, (unsigned int) (((unsigned long long) file->size + data->cluster_size - 1) / data->cluster_size));
+            result = -1;
+        } else {
+            file->size = size;
+        }
+    }
+
+    fat32_update_entry(data, file, result == 0);
+    fat32_update_free(data);
+
+    return result;
+}
+
+// FAT32 sync function
+static int fat32_sync(filesystem_t* fs) {
+    if (!fs || !fs->private_data) {
+        return -1;
+    }
+
+    return fat32_flush((fat32_fs_data_t*) fs->private_data);
+}
+
+// FAT32 fsync function
+//
+// A file's data, its entry and the FAT all live in the device cache, so
+// the whole volume is written back.
+static int fat32_fsync(filesystem_t* fs, const char* path) {
+    if (!fs || !fs->private_data || !path) {
+        return -1;
+    }
+
+    fat32_fs_data_t* data = (fat32_fs_data_t*) fs->private_data;
+
+    if (!fat32_lookup(data, path)) {
+        return -1;
+    }
+
+    return fat32_flush(data);
+}
+
+// Initialize the FAT32 file system
+int fat32_init() {
+    filesystem_t fs;
+
+    strcpy(fs.name, "fat32");
+    fs.type = FS_TYPE_FAT32;
+    fs.device[0] = '\0';
+    fs.mount_point[0] = '\0';
+    fs.flags = 0;
+    fs.total_size = 0;
+    fs.free_size = 0;
+    fs.mount = fat32_mount;
+    fs.unmount = fat32_unmount;
+    fs.read = fat32_read;
+    fs.write = fat32_write;
+    fs.open = fat32_open;
+    fs.close = fat32_close;
+    fs.mkdir = fat32_mkdir;
+    fs.rmdir = fat32_rmdir;
+    fs.unlink = fat32_unlink;
+    fs.rename = fat32_rename;
+    fs.stat = fat32_stat;
+    fs.chmod = fat32_chmod;
+    fs.chown = fat32_chown;
+    fs.truncate = fat32_truncate;
+    fs.sync = fat32_sync;
+    fs.fsync = fat32_fsync;
+    fs.root = NULL;
+    fs.private_data = NULL;
+
+    return fs_register_filesystem(&fs);
+}
@@ -0,0 +1,1163 @@
+/**
+ * LightOS Kernel
+ * tmpfs file system implementation
+ *
+ * Files live entirely in memory: each inode keeps its data in a radix tree
+ * of pages from the block allocator, with absent pages read as zeros, so
+ * sparse files only use memory for what was written. Directory entries are
+ * kept in one hash table per mount keyed by (parent, name), which grows
+ * with the number of entries to keep lookups O(1).
+ */
+
+#include "filesystem_ext.h"
+#include "kernel.h"
+#include "klog.h"
+#include "ktime.h"
+#include "memory.h"
+#include "../libc/string.h"
+
+KLOG_SUBSYSTEM(tmpfs_log, "tmpfs");
+
+// Radix tree geometry (six levels of 64 slots cover any 32-bit page index)
+#define TMPFS_RADIX_SHIFT 6
+#define TMPFS_RADIX_SLOTS (1 << TMPFS_RADIX_SHIFT)
+#define TMPFS_RADIX_MASK  (TMPFS_RADIX_SLOTS - 1)
+#define TMPFS_RADIX_MAX_HEIGHT 6
+
+// Default limits: half of the memory free at mount time, and one inode per
+// two pages of that
+#define TMPFS_DEFAULT_SIZE_DIVISOR   2
+#define TMPFS_DEFAULT_INODES_DIVISOR 2
+
+// Longest name in a directory
+#define TMPFS_NAME_MAX 255
+
+// Open files per mount
+#define TMPFS_MAX_OPEN 64
+
+// Base of the file descriptors returned by open
+#define TMPFS_FD_BASE 3
+
+// Mode file types
+#define TMPFS_S_IFMT  0xF000
+#define TMPFS_S_IFDIR 0x4000
+#define TMPFS_S_IFREG 0x8000
+
+// Directory entry size classes (bytes, including the header)
+#define TMPFS_DIRENT_CLASSES 4
+
+static const unsigned int tmpfs_dirent_sizes[TMPFS_DIRENT_CLASSES] = { 64, 128, 256, 320 };
+
+// Radix tree node (interior slots point to nodes, leaf slots to pages)
+typedef struct {
+    void* slots[TMPFS_RADIX_SLOTS];
+} tmpfs_radix_node_t;
+
+// tmpfs inode
+typedef struct tmpfs_inode {
+    unsigned int ino;
+    unsigned int mode;
+    unsigned int uid;
+    unsigned int gid;
+    unsigned int nlink;
+    unsigned int open_count;
+    unsigned long long size;
+    unsigned int atime;
+    unsigned int mtime;
+    unsigned int ctime;
+    tmpfs_radix_node_t* root;       // File pages
+    unsigned int height;
+    unsigned int nr_pages;
+    unsigned int nr_entries;        // Directory entries
+    struct tmpfs_inode* parent;     // Directory holding a directory
+} tmpfs_inode_t;
+
+// Directory entry
+typedef struct tmpfs_dirent {
+    struct tmpfs_dirent* hash_next;
+    tmpfs_inode_t* parent;
+    tmpfs_inode_t* inode;
+    unsigned int hash;
+    unsigned short length;
+    unsigned short size_class;
+    char name[];
+} tmpfs_dirent_t;
+
+// Pool of equally sized objects carved from memory blocks
+//
+// Free objects are chained through their first word. Carved blocks are
+// chained through their last word so they can all be freed at unmount.
+typedef struct {
+    unsigned int size;
+    void* free;
+} tmpfs_pool_t;
+
+// tmpfs private data
+typedef struct {
+    tmpfs_inode_t* root;
+    unsigned long long max_pages;
+    unsigned long long nr_pages;
+    unsigned int max_inodes;
+    unsigned int nr_inodes;
+    unsigned int next_ino;
+    tmpfs_dirent_t** buckets;       // (parent, name) -> entry
+    unsigned int bucket_count;      // A power of two
+    unsigned int bucket_blocks;
+    unsigned int nr_dirents;
+    tmpfs_pool_t inode_pool;
+    tmpfs_pool_t node_pool;
+    tmpfs_pool_t dirent_pools[TMPFS_DIRENT_CLASSES];
+    void* pool_blocks;
+    tmpfs_inode_t* open[TMPFS_MAX_OPEN];
+} tmpfs_data_t;
+
+// Memory blocks needed for the private data
+#define TMPFS_DATA_BLOCKS ((sizeof(tmpfs_data_t) + MEMORY_BLOCK_SIZE - 1) / MEMORY_BLOCK_SIZE)
+
+// Current time for inode timestamps
+static unsigned int tmpfs_now() {
+    return (unsigned int) (ktime_get_real() / NSEC_PER_SEC);
+}
+
+// Allocate an object from a pool
+static void* tmpfs_pool_alloc(tmpfs_data_t* data, tmpfs_pool_t* pool) {
+    if (!pool->free) {
+        unsigned char* block = (unsigned char*) allocate_block();
+
+        if (!block) {
+            return NULL;
+        }
+
+        unsigned int end = MEMORY_BLOCK_SIZE - sizeof(void*);
+
+        *(void**) (block + end) = data->pool_blocks;
+        data->pool_blocks = block;
+
+        for (unsigned int offset = 0; offset + pool->size <= end; offset += pool->size) {
+            *(void**) (block + offset) = pool->free;
+            pool->free = block + offset;
+        }
+    }
+
+    void* object = pool->free;
+    pool->free = *(void**) object;
+    memset(object, 0, pool->size);
+
+    return object;
+}
+
+// Return an object to its pool
+static void tmpfs_pool_free(tmpfs_pool_t* pool, void* object) {
+    *(void**) object = pool->free;
+    pool->free = object;
+}
+
+// Hash a (parent, name) pair (FNV-1a over the name, mixed with the parent)
+static unsigned int tmpfs_hash(tmpfs_inode_t* parent, const char* name, unsigned int length) {
+    unsigned int hash = 2166136261u;
+
+    for (unsigned int i = 0; i < length; i++) {
+        hash ^= (unsigned char) name[i];
+        hash *= 16777619u;
+    }
+
+    return hash ^ parent->ino * 0x9E3779B1u;
+}
+
+// Find a directory entry
+static tmpfs_dirent_t* tmpfs_find(tmpfs_data_t* data, tmpfs_inode_t* dir, const char* name, unsigned int length) {
+    unsigned int hash = tmpfs_hash(dir, name, length);
+
+    for (tmpfs_dirent_t* entry = data->buckets[hash & (data->bucket_count - 1)]; entry; entry = entry->hash_next) {
+        if (entry->hash == hash && entry->parent == dir && entry->length == length && memcmp(entry->name, name, length) == 0) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+// Double the hash table once it holds more entries than buckets
+//
+// If memory is short the table stays as it is, with longer chains.
+static void tmpfs_grow_buckets(tmpfs_data_t* data) {
+    unsigned int blocks = data->bucket_blocks * 2;
+    tmpfs_dirent_t** buckets = (tmpfs_dirent_t**) allocate_blocks(blocks);
+
+    if (!buckets) {
+        return;
+    }
+
+    unsigned int count = blocks * MEMORY_BLOCK_SIZE / sizeof(tmpfs_dirent_t*);
+    memset(buckets, 0, blocks * MEMORY_BLOCK_SIZE);
+
+    for (unsigned int i = 0; i < data->bucket_count; i++) {
+        tmpfs_dirent_t* entry = data->buckets[i];
+
+        while (entry) {
+            tmpfs_dirent_t* next = entry->hash_next;
+            entry->hash_next = buckets[entry->hash & (count - 1)];
+            buckets[entry->hash & (count - 1)] = entry;
+            entry = next;
+        }
+    }
+
+    free_blocks(data->buckets, data->bucket_blocks);
+    data->buckets = buckets;
+    data->bucket_count = count;
+    data->bucket_blocks = blocks;
+}
+
+// Add a directory entry
+static int tmpfs_add_entry(tmpfs_data_t* data, tmpfs_inode_t* dir, const char* name, unsigned int length, tmpfs_inode_t* inode) {
+    unsigned int size_class = 0;
+
+    while (sizeof(tmpfs_dirent_t) + length + 1 > tmpfs_dirent_sizes[size_class]) {
+        size_class++;
+    }
+
+    tmpfs_dirent_t* entry = (tmpfs_dirent_t*) tmpfs_pool_alloc(data, &data->dirent_pools[size_class]);
+
+    if (!entry) {
+        return -1;
+    }
+
+    entry->parent = dir;
+    entry->inode = inode;
+    entry->hash = tmpfs_hash(dir, name, length);
+    entry->length = length;
+    entry->size_class = size_class;
+    memcpy(entry->name, name, length);
+    entry->name[length] = '\0';
+
+    tmpfs_dirent_t** bucket = &data->buckets[entry->hash & (data->bucket_count - 1)];
+    entry->hash_next = *bucket;
+    *bucket = entry;
+
+    dir->nr_entries++;
+    dir->mtime = dir->ctime = tmpfs_now();
+
+    if (++data->nr_dirents > data->bucket_count) {
+        tmpfs_grow_buckets(data);
+    }
+
+    return 0;
+}
+
+// Remove a directory entry (the inode it names is left alone)
+static void tmpfs_remove_entry(tmpfs_data_t* data, tmpfs_dirent_t* entry) {
+    tmpfs_dirent_t** link = &data->buckets[entry->hash & (data->bucket_count - 1)];
+
+    while (*link != entry) {
+        link = &(*link)->hash_next;
+    }
+
+    *link = entry->hash_next;
+    entry->parent->nr_entries--;
+    entry->parent->mtime = entry->parent->ctime = tmpfs_now();
+    data->nr_dirents--;
+
+    tmpfs_pool_free(&data->dirent_pools[entry->size_class], entry);
+}
+
+// Find a page of a file, creating it (zeroed) if create is set
+static unsigned char* tmpfs_get_page(tmpfs_data_t* data, tmpfs_inode_t* inode, unsigned int index, int create) {
+    if (!inode->root) {
+        if (!create) {
+            return NULL;
+        }
+
+        inode->root = (tmpfs_radix_node_t*) tmpfs_pool_alloc(data, &data->node_pool);
+
+        if (!inode->root) {
+            return NULL;
+        }
+
+        inode->height = 1;
+    }
+
+    // Add levels on top until the index fits
+    while (inode->height < TMPFS_RADIX_MAX_HEIGHT && ((unsigned long long) index >> (TMPFS_RADIX_SHIFT * inode->height)) != 0) {
+        if (!create) {
+            return NULL;
+        }
+
+        tmpfs_radix_node_t* root = (tmpfs_radix_node_t*) tmpfs_pool_alloc(data, &data->node_pool);
+
+        if (!root) {
+            return NULL;
+        }
+
+        root->slots[0] = inode->root;
+        inode->root = root;
+        inode->height++;
+    }
+
+    tmpfs_radix_node_t* node = inode->root;
+
+    for (unsigned int height = inode->height; height > 1; height--) {
+        unsigned int slot = (index >> (TMPFS_RADIX_SHIFT * (height - 1))) & TMPFS_RADIX_MASK;
+
+        if (!node->slots[slot]) {
+            if (!create) {
+                return NULL;
+            }
+
+            node->slots[slot] = tmpfs_pool_alloc(data, &data->node_pool);
+
+            if (!node->slots[slot]) {
+                return NULL;
+            }
+        }
+
+        node = (tmpfs_radix_node_t*) node->slots[slot];
+    }
+
+    unsigned int slot = index & TMPFS_RADIX_MASK;
+
+    if (node->slots[slot] || !create) {
+        return (unsigned char*) node->slots[slot];
+    }
+
+    if (data->nr_pages >= data->max_pages) {
+        KLOG(&tmpfs_log, KLOG_WARNING, "File system full (%llu pages)\n", data->max_pages);
+        return NULL;
+    }
+
+    unsigned char* page = (unsigned char*) allocate_block();
+
+    if (!page) {
+        return NULL;
+    }
+
+    memset(page, 0, MEMORY_BLOCK_SIZE);
+    node->slots[slot] = page;
+    inode->nr_pages++;
+    data->nr_pages++;
+
+    return page;
+}
+
+// Free the pages at or after first under a node
+//
+// Returns 1 if the node is left empty (the caller then frees it).
+static int tmpfs_truncate_node(tmpfs_data_t* data, tmpfs_inode_t* inode, tmpfs_radix_node_t* node, unsigned int height, unsigned long long base, unsigned long long first) {
+    unsigned long long span = 1ULL << (TMPFS_RADIX_SHIFT * (height - 1));
+    int empty = 1;
+
+    for (unsigned int slot = 0; slot < TMPFS_RADIX_SLOTS; slot++) {
+        unsigned long long start = base + slot * span;
+
+        if (!node->slots[slot]) {
+            continue;
+        }
+
+        if (start + span <= first) {
+            empty = 0;
+            continue;
+        }
+
+        if (height == 1) {
+            free_block(node->slots[slot]);
+            inode->nr_pages--;
+            data->nr_pages--;
+        } else if (tmpfs_truncate_node(data, inode, (tmpfs_radix_node_t*) node->slots[slot], height - 1, start, first)) {
+            tmpfs_pool_free(&data->node_pool, node->slots[slot]);
+        } else {
+            empty = 0;
+            continue;
+        }
+
+        node->slots[slot] = NULL;
+    }
+
+    return empty;
+}
+
+// Change a file's size, freeing pages past the new end
+static void tmpfs_resize(tmpfs_data_t* data, tmpfs_inode_t* inode, unsigned long long size) {
+    if (size < inode->size) {
+        unsigned long long first = (size + MEMORY_BLOCK_SIZE - 1) / MEMORY_BLOCK_SIZE;
+
+        if (inode->root && tmpfs_truncate_node(data, inode, inode->root, inode->height, 0, first)) {
+            tmpfs_pool_free(&data->node_pool, inode->root);
+            inode->root = NULL;
+            inode->height = 0;
+        }
+
+        // Bytes past the end of a page must read as zeros if the file grows again
+        if (size % MEMORY_BLOCK_SIZE) {
+            unsigned char* page = tmpfs_get_page(data, inode, (unsigned int) (size / MEMORY_BLOCK_SIZE), 0);
+
+            if (page) {
+                memset(page + size % MEMORY_BLOCK_SIZE, 0, MEMORY_BLOCK_SIZE - size % MEMORY_BLOCK_SIZE);
+            }
+        }
+    }
+
+    inode->size = size;
+    inode->mtime = inode->ctime = tmpfs_now();
+}
+
+// Create an inode
+static tmpfs_inode_t* tmpfs_new_inode(tmpfs_data_t* data, unsigned int mode) {
+    if (data->nr_inodes >= data->max_inodes) {
+        KLOG(&tmpfs_log, KLOG_WARNING, "Out of inodes (%u)\n", data->max_inodes);
+        return NULL;
+    }
+
+    tmpfs_inode_t* inode = (tmpfs_inode_t*) tmpfs_pool_alloc(data, &data->inode_pool);
+
+    if (!inode) {
+        return NULL;
+    }
+
+    inode->ino = data->next_ino++;
+    inode->mode = mode;
+    inode->nlink = (mode & TMPFS_S_IFMT) == TMPFS_S_IFDIR ? 2 : 1;
+    inode->atime = inode->mtime = inode->ctime = tmpfs_now();
+    data->nr_inodes++;
+
+    return inode;
+}
+
+// Free an inode once it has no names and is not open
+static void tmpfs_put_inode(tmpfs_data_t* data, tmpfs_inode_t* inode) {
+    if (inode->nlink > 0 || inode->open_count > 0) {
+        return;
+    }
+
+    tmpfs_resize(data, inode, 0);
+    tmpfs_pool_free(&data->inode_pool, inode);
+    data->nr_inodes--;
+}
+
+// Check if an inode is a directory
+static int tmpfs_is_dir(tmpfs_inode_t* inode) {
+    return (inode->mode & TMPFS_S_IFMT) == TMPFS_S_IFDIR;
+}
+
+// Walk a path from the root
+//
+// If last is given, the walk stops before the final component: the
+// directory holding it is returned and *last and *length name it.
+static tmpfs_inode_t* tmpfs_walk(tmpfs_data_t* data, const char* path, const char** last, unsigned int* length) {
+    tmpfs_inode_t* inode = data->root;
+    const char* p = path;
+
+    while (1) {
+        while (*p == '/') {
+            p++;
+        }
+
+        if (!*p) {
+            // The root has no final component
+            return last ? NULL : inode;
+        }
+
+        const char* name = p;
+        unsigned int n = 0;
+
+        while (name[n] && name[n] != '/') {
+            n++;
+        }
+
+        p += n;
+
+        if (!tmpfs_is_dir(inode) || n > TMPFS_NAME_MAX) {
+            return NULL;
+        }
+
+        const char* rest = p;
+
+        while (*rest == '/') {
+            rest++;
+        }
+
+        if (last && !*rest) {
+            *last = name;
+            *length = n;
+            return inode;
+        }
+
+        if (n == 1 && name[0] == '.') {
+            continue;
+        }
+
+        if (n == 2 && name[0] == '.' && name[1] == '.') {
+            inode = inode->parent;
+            continue;
+        }
+
+        tmpfs_dirent_t* entry = tmpfs_find(data, inode, name, n);
+
+        if (!entry) {
+            return NULL;
+        }
+
+        inode = entry->inode;
+    }
+}
+
+// Look up the entry a path names, with its directory
+static tmpfs_dirent_t* tmpfs_lookup_entry(tmpfs_data_t* data, const char* path) {
+    const char* name;
+    unsigned int length;
+    tmpfs_inode_t* dir = tmpfs_walk(data, path, &name, &length);
+
+    if (!dir) {
+        return NULL;
+    }
+
+    return tmpfs_find(data, dir, name, length);
+}
+
+// Check if a final path component may be created
+static int tmpfs_valid_name(const char* name, unsigned int length) {
+    if (length == 0 || (length == 1 && name[0] == '.') || (length == 2 && name[0] == '.' && name[1] == '.')) {
+        return 0;
+    }
+
+    return 1;
+}
+
+// Create a file or directory
+static tmpfs_inode_t* tmpfs_create(tmpfs_data_t* data, const char* path, unsigned int mode) {
+    const char* name;
+    unsigned int length;
+    tmpfs_inode_t* dir = tmpfs_walk(data, path, &name, &length);
+
+    if (!dir || !tmpfs_is_dir(dir) || !tmpfs_valid_name(name, length) || tmpfs_find(data, dir, name, length)) {
+        return NULL;
+    }
+
+    tmpfs_inode_t* inode = tmpfs_new_inode(data, mode);
+
+    if (!inode) {
+        return NULL;
+    }
+
+    if (tmpfs_add_entry(data, dir, name, length, inode) != 0) {
+        inode->nlink = 0;
+        tmpfs_put_inode(data, inode);
+        return NULL;
+    }
+
+    if (tmpfs_is_dir(inode)) {
+        inode->parent = dir;
+        dir->nlink++;
+    }
+
+    return inode;
+}
+
+// Parse a size with an optional k, m or g suffix
+static unsigned long long tmpfs_parse_size(const char* p, unsigned int length) {
+    unsigned long long value = 0;
+    unsigned int i = 0;
+
+    while (i < length && p[i] >= '0' && p[i] <= '9') {
+        value = value * 10 + (p[i++] - '0');
+    }
+
+    if (i < length) {
+        switch (p[i]) {
+            case 'k': case 'K': value <<= 10; break;
+            case 'm': case 'M': value <<= 20; break;
+            case 'g': case 'G': value <<= 30; break;
+        }
+    }
+
+    return value;
+}
+
+// Apply mount options given as the device ("size=64m,nr_inodes=4096")
+//
+// Anything else in the device string (usually "tmpfs" or "none") is ignored.
+static void tmpfs_parse_options(tmpfs_data_t* data, const char* options) {
+    const char* p = options;
+
+    while (*p) {
+        unsigned int length = 0;
+
+        while (p[length] && p[length] != ',') {
+            length++;
+        }
+
+        if (length > 5 && memcmp(p, "size=", 5) == 0) {
+            data->max_pages = (tmpfs_parse_size(p + 5, length - 5) + MEMORY_BLOCK_SIZE - 1) / MEMORY_BLOCK_SIZE;
+        } else if (length > 10 && memcmp(p, "nr_inodes=", 10) == 0) {
+            data->max_inodes = (unsigned int) tmpfs_parse_size(p + 10, length - 10);
+        }
+
+        p += length;
+
+        if (*p == ',') {
+            p++;
+        }
+    }
+}
+
+// Free all pool blocks of a mount
+static void tmpfs_free_pools(tmpfs_data_t* data) {
+    while (data->pool_blocks) {
+        unsigned char* block = (unsigned char*) data->pool_blocks;
+        data->pool_blocks = *(void**) (block + MEMORY_BLOCK_SIZE - sizeof(void*));
+        free_block(block);
+    }
+}
+
+// Get the inode of an open file descriptor
+static tmpfs_inode_t* tmpfs_get_open(tmpfs_data_t* data, int fd) {
+    int slot = fd - TMPFS_FD_BASE;
+
+    if (slot < 0 || slot >= TMPFS_MAX_OPEN) {
+        return NULL;
+    }
+
+    return data->open[slot];
+}
+
+// Update the free space reported for a mount
+static void tmpfs_update_free(filesystem_t* fs) {
+    tmpfs_data_t* data = (tmpfs_data_t*) fs->private_data;
+
+    fs->free_size = (data->max_pages - data->nr_pages) * MEMORY_BLOCK_SIZE;
+}
+
+// tmpfs mount function
+static int tmpfs_mount(filesystem_t* fs, const char* device, const char* mount_point, unsigned int flags) {
+    if (!fs || !device || !mount_point) {
+        return -1;
+    }
+
+    tmpfs_data_t* data = (tmpfs_data_t*) allocate_blocks(TMPFS_DATA_BLOCKS);
+
+    if (!data) {
+        terminal_write("Error: Failed to allocate memory for tmpfs data\n");
+        return -1;
+    }
+
+    memset(data, 0, sizeof(tmpfs_data_t));
+
+    unsigned int free_memory;
+    memory_stats(NULL, NULL, &free_memory);
+
+    data->max_pages = free_memory / MEMORY_BLOCK_SIZE / TMPFS_DEFAULT_SIZE_DIVISOR;
+    data->max_inodes = (unsigned int) (data->max_pages / TMPFS_DEFAULT_INODES_DIVISOR);
+    tmpfs_parse_options(data, device);
+
+    data->next_ino = 1;
+    data->inode_pool.size = sizeof(tmpfs_inode_t);
+    data->node_pool.size = sizeof(tmpfs_radix_node_t);
+
+    for (int i = 0; i < TMPFS_DIRENT_CLASSES; i++) {
+        data->dirent_pools[i].size = tmpfs_dirent_sizes[i];
+    }
+
+    data->bucket_blocks = 1;
+    data->bucket_count = MEMORY_BLOCK_SIZE / sizeof(tmpfs_dirent_t*);
+    data->buckets = (tmpfs_dirent_t**) allocate_block();
+
+    // The root counts against the inode limit like any other directory
+    if (data->max_inodes == 0) {
+        data->max_inodes = 1;
+    }
+
+    if (data->buckets) {
+        memset(data->buckets, 0, MEMORY_BLOCK_SIZE);
+        data->root = tmpfs_new_inode(data, TMPFS_S_IFDIR | 0777);
+    }
+
+    if (!data->root) {
+        terminal_write("Error: Failed to create tmpfs root\n");
+
+        if (data->buckets) {
+            free_block(data->buckets);
+        }
+
+        tmpfs_free_pools(data);
+        free_blocks(data, TMPFS_DATA_BLOCKS);
+        return -1;
+    }
+
+    data->root->parent = data->root;
+
+    fs->private_data = data;
+    strcpy(fs->device, device);
+    strcpy(fs->mount_point, mount_point);
+    fs->flags = flags;
+    fs->total_size = data->max_pages * MEMORY_BLOCK_SIZE;
+    fs->free_size = fs->total_size;
+
+    KLOG(&tmpfs_log, KLOG_INFO, "Mounted on %s: %llu pages, %u inodes\n", mount_point, data->max_pages, data->max_inodes);
+
+    return 0;
+}
+
+// tmpfs unmount function (everything in it is lost)
+static int tmpfs_unmount(filesystem_t* fs) {
+    if (!fs || !fs->private_data) {
+        return -1;
+    }
+
+    tmpfs_data_t* data = (tmpfs_data_t*) fs->private_data;
+
+    // File pages come from the block allocator; everything else from the pools
+    for (unsigned int i = 0; i < data->bucket_count; i++) {
+        for (tmpfs_dirent_t* entry = data->buckets[i]; entry; entry = entry->hash_next) {
+            tmpfs_resize(data, entry->inode, 0);
+        }
+    }
+
+    for (int i = 0; i < TMPFS_MAX_OPEN; i++) {
+        if (data->open[i] && data->open[i]->nlink == 0) {
+            tmpfs_resize(data, data->open[i], 0);
+        }
+    }
+
+    free_blocks(data->buckets, data->bucket_blocks);
+    tmpfs_free_pools(data);
+    free_blocks(data, TMPFS_DATA_BLOCKS);
+    fs->private_data = NULL;
+
+    return 0;
+}
+
+// tmpfs read function
+static int tmpfs_read(filesystem_t* fs, const char* path, void* buffer, unsigned int size, unsigned int offset) {
+    if (!fs || !fs->private_data || !path || !buffer) {
+        return -1;
+    }
+
+    tmpfs_data_t* data = (tmpfs_data_t*) fs->private_data;
+    tmpfs_inode_t* inode = tmpfs_walk(data, path, NULL, NULL);
+
+    if (!inode || tmpfs_is_dir(inode)) {
+        return -1;
+    }
+
+    if (offset >= inode->size || size == 0) {
+        return 0;
+    }
+
+    if (size > inode->size - offset) {
+        size = (unsigned int) (inode->size - offset);
+    }
+
+    unsigned char* out = (unsigned char*) buffer;
+    unsigned int done = 0;
+
+    while (done < size) {
+        unsigned long long position = (unsigned long long) offset + done;
+        unsigned int page_offset = position % MEMORY_BLOCK_SIZE;
+        unsigned int chunk = MEMORY_BLOCK_SIZE - page_offset;
+
+        if (chunk > size - done) {
+            chunk = size - done;
+        }
+
+        unsigned char* page = tmpfs_get_page(data, inode, (unsigned int) (position / MEMORY_BLOCK_SIZE), 0);
+
+        // Holes read as zeros
+        if (page) {
+            memcpy(out + done, page + page_offset, chunk);
+        } else {
+            memset(out + done, 0, chunk);
+        }
+
+        done += chunk;
+    }
+
+    return done;
+}
+
+// tmpfs write function; returns the number of bytes written
+static int tmpfs_write(filesystem_t* fs, const char* path, const void* buffer, unsigned int size, unsigned int offset) {
+    if (!fs || !fs->private_data || !path || !buffer) {
+        return -1;
+    }
+
+    tmpfs_data_t* data = (tmpfs_data_t*) fs->private_data;
+    tmpfs_inode_t* inode = tmpfs_walk(data, path, NULL, NULL);
+
+    if (!inode || tmpfs_is_dir(inode)) {
+        return -1;
+    }
+
+    const unsigned char* in = (const unsigned char*) buffer;
+    unsigned int done = 0;
+
+    while (done < size) {
+        unsigned long long position = (unsigned long long) offset + done;
+        unsigned int page_offset = position % MEMORY_BLOCK_SIZE;
+        unsigned int chunk = MEMORY_BLOCK_SIZE - page_offset;
+
+        if (chunk > size - done) {
+            chunk = size - done;
+        }
+
+        unsigned char* page = tmpfs_get_page(data, inode, (unsigned int) (position / MEMORY_BLOCK_SIZE), 1);
+
+        if (!page) {
+            break;
+        }
+
+        memcpy(page + page_offset, in + done, chunk);
+        done += chunk;
+    }
+
+    if (done == 0 && size > 0) {
+        return -1;
+    }
+
+    if ((unsigned long long) offset + done > inode->size) {
+        inode->size = (unsigned long long) offset + done;
+    }
+
+    inode->mtime = inode->ctime = tmpfs_now();
+    tmpfs_update_free(fs);
+
+    return done;
+}
+
+// tmpfs open function
+static int tmpfs_open(filesystem_t* fs, const char* path, unsigned int flags) {
+    if (!fs || !fs->private_data || !path) {
+        return -1;
+    }
+
+    tmpfs_data_t* data = (tmpfs_data_t*) fs->private_data;
+    int slot = -1;
+
+    for (int i = 0; i < TMPFS_MAX_OPEN; i++) {
+        if (!data->open[i]) {
+            slot = i;
+            break;
+        }
+    }
+
+    if (slot < 0) {
+        KLOG(&tmpfs_log, KLOG_WARNING, "Too many open files\n");
+        return -1;
+    }
+
+    tmpfs_inode_t* inode = tmpfs_walk(data, path, NULL, NULL);
+
+    if (inode && (flags & O_CREAT) && (flags & O_EXCL)) {
+        return -1;
+    }
+
+    if (!inode && (flags & O_CREAT)) {
+        inode = tmpfs_create(data, path, TMPFS_S_IFREG | 0644);
+
+        if (inode) {
+            fs_invalidate_name(fs, path);
+        }
+    }
+
+    if (!inode) {
+        return -1;
+    }
+
+    if ((flags & O_TRUNC) && !tmpfs_is_dir(inode)) {
+        tmpfs_resize(data, inode, 0);
+    }
+
+    inode->open_count++;
+    data->open[slot] = inode;
+
+    return TMPFS_FD_BASE + slot;
+}
+
+// tmpfs close function
+static int tmpfs_close(filesystem_t* fs, int fd) {
+    if (!fs || !fs->private_data) {
+        return -1;
+    }
+
+    tmpfs_data_t* data = (tmpfs_data_t*) fs->private_data;
+    tmpfs_inode_t* inode = tmpfs_get_open(data, fd);
+
+    if (!inode) {
+        return -1;
+    }
+
+    data->open[fd - TMPFS_FD_BASE] = NULL;
+    inode->open_count--;
+
+    // Unlinked files go away with their last descriptor
+    tmpfs_put_inode(data, inode);
+    tmpfs_update_free(fs);
+
+    return 0;
+}
+
+// tmpfs mkdir function
+static int tmpfs_mkdir(filesystem_t* fs, const char* path, unsigned int mode) {
+    if (!fs || !fs->private_data || !path) {
+        return -1;
+    }
+
+    if (!tmpfs_create((tmpfs_data_t*) fs->private_data, path, TMPFS_S_IFDIR | (mode & 07777))) {
+        return -1;
+    }
+
+    fs_invalidate_name(fs, path);
+
+    return 0;
+}
+
+// tmpfs rmdir function
+static int tmpfs_rmdir(filesystem_t* fs, const char* path) {
+    if (!fs || !fs->private_data || !path) {
+        return -1;
+    }
+
+    tmpfs_data_t* data = (tmpfs_data_t*) fs->private_data;
+    tmpfs_dirent_t* entry = tmpfs_lookup_entry(data, path);
+
+    if (!entry || !tmpfs_is_dir(entry->inode) || entry->inode->nr_entries > 0) {
+        return -1;
+    }
+
+    tmpfs_inode_t* dir = entry->inode;
+    tmpfs_inode_t* parent = entry->parent;
+
+    tmpfs_remove_entry(data, entry);
+    parent->nlink--;
+    dir->nlink = 0;
+    tmpfs_put_inode(data, dir);
+    fs_invalidate_name(fs, path);
+
+    return 0;
+}
+
+// tmpfs unlink function
+static int tmpfs_unlink(filesystem_t* fs, const char* path) {
+    if (!fs || !fs->private_data || !path) {
+        return -1;
+    }
+
+    tmpfs_data_t* data = (tmpfs_data_t*) fs->private_data;
+    tmpfs_dirent_t* entry = tmpfs_lookup_entry(data, path);
+
+    if (!entry || tmpfs_is_dir(entry->inode)) {
+        return -1;
+    }
+
+    tmpfs_inode_t* inode = entry->inode;
+
+    tmpfs_remove_entry(data, entry);
+    inode->nlink--;
+    inode->ctime = tmpfs_now();
+    tmpfs_put_inode(data, inode);
+    tmpfs_update_free(fs);
+    fs_invalidate_name(fs, path);
+
+    return 0;
+}
+
+// tmpfs rename function (replaces an existing file or empty directory)
+static int tmpfs_rename(filesystem_t* fs, const char* old_path, const char* new_path) {
+    if (!fs || !fs->private_data || !old_path || !new_path) {
+        return -1;
+    }
+
+    tmpfs_data_t* data = (tmpfs_data_t*) fs->private_data;
+    tmpfs_dirent_t* entry = tmpfs_lookup_entry(data, old_path);
+    const char* name;
+    unsigned int length;
+    tmpfs_inode_t* dir = tmpfs_walk(data, new_path, &name, &length);
+
+    if (!entry || !dir || !tmpfs_is_dir(dir) || !tmpfs_valid_name(name, length)) {
+        return -1;
+    }
+
+    tmpfs_inode_t* inode = entry->inode;
+    int is_dir = tmpfs_is_dir(inode);
+
+    // A directory cannot move below itself
+    if (is_dir) {
+        for (tmpfs_inode_t* ancestor = dir; ; ancestor = ancestor->parent) {
+            if (ancestor == inode) {
+                return -1;
+            }
+
+            if (ancestor == data->root) {
+                break;
+            }
+        }
+    }
+
+    tmpfs_dirent_t* target = tmpfs_find(data, dir, name, length);
+
+    if (target == entry) {
+        return 0;
+    }
+
+    if (target && (tmpfs_is_dir(target->inode) != is_dir || (is_dir && target->inode->nr_entries > 0))) {
+        return -1;
+    }
+
+    tmpfs_inode_t* old_dir = entry->parent;
+
+    if (tmpfs_add_entry(data, dir, name, length, inode) != 0) {
+        return -1;
+    }
+
+    // The table may have been rehashed, but entries themselves do not move
+    tmpfs_remove_entry(data, entry);
+
+    if (target) {
+        tmpfs_inode_t* replaced = target->inode;
+
+        tmpfs_remove_entry(data, target);
+        replaced->nlink = is_dir ? 0 : replaced->nlink - 1;
+
+        if (is_dir) {
+            dir->nlink--;
+        }
+
+        tmpfs_put_inode(data, replaced);
+        tmpfs_update_free(fs);
+    }
+
+    if (is_dir && old_dir != dir) {
+        old_dir->nlink--;
+        dir->nlink++;
+        inode->parent = dir;
+    }
+
+    inode->ctime = tmpfs_now();
+    fs_invalidate_name(fs, old_path);
+    fs_invalidate_name(fs, new_path);
+
+    return 0;
+}
+
+// tmpfs stat function
+static int tmpfs_stat(filesystem_t* fs, const char* path, fs_stat_t* stat) {
+    if (!fs || !fs->private_data || !path || !stat) {
+        return -1;
+    }
+
+    tmpfs_inode_t* inode = tmpfs_walk((tmpfs_data_t*) fs->private_data, path, NULL, NULL);
+
+    if (!inode) {
+        return -1;
+    }
+
+    stat->size = inode->size;
+    stat->mode = inode->mode;
+    stat->uid = inode->uid;
+    stat->gid = inode->gid;
+    stat->atime = inode->atime;
+    stat->mtime = inode->mtime;
+    stat->ctime = inode->ctime;
+
+    return 0;
+}
+
+// tmpfs chmod function
+static int tmpfs_chmod(filesystem_t* fs, const char* path, unsigned int mode) {
+    if (!fs || !fs->private_data || !path) {
+        return -1;
+    }
+
+    tmpfs_inode_t* inode = tmpfs_walk((tmpfs_data_t*) fs->private_data, path, NULL, NULL);
+
+    if (!inode) {
+        return -1;
+    }
+
+    inode->mode = (inode->mode & TMPFS_S_IFMT) | (mode & 07777);
+    inode->ctime = tmpfs_now();
+
+    return 0;
+}
+
+// tmpfs chown function
+static int tmpfs_chown(filesystem_t* fs, const char* path, unsigned int uid, unsigned int gid) {
+    if (!fs || !fs->private_data || !path) {
+        return -1;
+    }
+
+    tmpfs_inode_t* inode = tmpfs_walk((tmpfs_data_t*) fs->private_data, path, NULL, NULL);
+
+    if (!inode) {
+        return -1;
+    }
+
+    inode->uid = uid;
+    inode->gid = gid;
+    inode->ctime = tmpfs_now();
+
+    return 0;
+}
+
+// tmpfs truncate function (growing a file leaves a hole)
+static int tmpfs_truncate(filesystem_t* fs, const char* path, unsigned int size) {
+    if (!fs || !fs->private_data || !path) {
+        return -1;
+    }
+
+    tmpfs_data_t* data = (tmpfs_data_t*) fs->private_data;
+    tmpfs_inode_t* inode = tmpfs_walk(data, path, NULL, NULL);
+
+    if (!inode || tmpfs_is_dir(inode)) {
+        return -1;
+    }
+
+    tmpfs_resize(data, inode, size);
+    tmpfs_update_free(fs);
+
+    return 0;
+}
+
+// tmpfs sync function (there is nothing to write back)
+static int tmpfs_sync(filesystem_t* fs) {
+    return fs && fs->private_data ? 0 : -1;
+}
+
+// tmpfs fsync function
+static int tmpfs_fsync(filesystem_t* fs, const char* path) {
+    if (!fs || !fs->private_data || !path) {
+        return -1;
+    }
+
+    return tmpfs_walk((tmpfs_data_t*) fs->private_data, path, NULL, NULL) ? 0 : -1;
+}
+
+// Initialize the tmpfs file system
+int tmpfs_init() {
+    filesystem_t fs;
+
+    strcpy(fs.name, "tmpfs");
+    fs.type = FS_TYPE_TMPFS;
+    fs.device[0] = '\0';
+    fs.mount_point[0] = '\0';
+    fs.flags = 0;
+    fs.total_size = 0;
+    fs.free_size = 0;
+    fs.mount = tmpfs_mount;
+    fs.unmount = tmpfs_unmount;
+    fs.read = tmpfs_read;
+    fs.write = tmpfs_write;
+    fs.open = tmpfs_open;
+    fs.close = tmpfs_close;
+    fs.mkdir = tmpfs_mkdir;
+    fs.rmdir = tmpfs_rmdir;
+    fs.unlink = tmpfs_unlink;
+    fs.rename = tmpfs_rename;
+    fs.stat = tmpfs_stat;
+    fs.chmod = tmpfs_chmod;
+    fs.chown = tmpfs_chown;
+    fs.truncate = tmpfs_truncate;
+    fs.sync = tmpfs_sync;
+    fs.fsync = tmpfs_fsync;
+    fs.root = NULL;
+    fs.private_data = NULL;
+
+    return fs_register_filesystem(&fs);
+}
@@ -0,0 +1,477 @@
+/**
+ * LightOS Kernel
+ * Inode cache implementation
+ *
+ * In-memory inodes are chained into hash buckets keyed by (sb, ino). They
+ * live in slabs: memory blocks carved into inode slots, with a block given
+ * back to the allocator as soon as its last inode is freed, so shrinking
+ * the cache really returns memory.
+ */
+
+#include "icache.h"
+#include "kernel.h"
+#include "klog.h"
+#include "memory.h"
+#include "../libc/string.h"
+
+KLOG_SUBSYSTEM(icache_log, "icache");
+
+#define ICACHE_BUCKET_MASK (ICACHE_BUCKETS - 1)
+
+// Slab header at the start of each block of inodes
+typedef struct icache_slab {
+    struct icache_slab* next;       // Slabs with free slots
+    struct icache_slab* prev;
+    unsigned int used;
+    inode_t* free;                  // Free slots (chained through hash_next)
+} icache_slab_t;
+
+// Inode slots per slab
+#define ICACHE_SLAB_INODES ((MEMORY_BLOCK_SIZE - sizeof(icache_slab_t)) / sizeof(inode_t))
+
+// Hash buckets
+static inode_t* icache_buckets[ICACHE_BUCKETS];
+
+// Unused inodes, most recently used first
+static inode_t* icache_lru_head = NULL;
+static inode_t* icache_lru_tail = NULL;
+
+// Dirty inodes, in the order they were dirtied
+static inode_t* icache_dirty_head = NULL;
+static inode_t* icache_dirty_tail = NULL;
+
+// Slabs with free slots
+static icache_slab_t* icache_partial = NULL;
+
+// Slabs given back to the allocator so far
+static unsigned int icache_slabs_freed = 0;
+
+// Statistics
+static icache_stats_t icache_stats;
+
+// Hash an (sb, ino) pair
+static unsigned int icache_bucket(void* sb, unsigned int ino) {
+    unsigned long long address = (unsigned long long) sb;
+    return ((unsigned int) (address >> 4) * 0x9E3779B1u ^ ino * 0x85EBCA6Bu) & ICACHE_BUCKET_MASK;
+}
+
+// Get the slab an inode lives in
+static icache_slab_t* icache_slab_of(inode_t* inode) {
+    return (icache_slab_t*) ((unsigned long) inode & ~(unsigned long) (MEMORY_BLOCK_SIZE - 1));
+}
+
+// Link a slab into the list of slabs with free slots
+static void icache_partial_link(icache_slab_t* slab) {
+    slab->prev = NULL;
+    slab->next = icache_partial;
+
+    if (icache_partial) {
+        icache_partial->prev = slab;
+    }
+
+    icache_partial = slab;
+}
+
+// Take a slab off the list of slabs with free slots
+static void icache_partial_unlink(icache_slab_t* slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        icache_partial = slab->next;
+    }
+
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+}
+
+// Allocate an inode slot
+static inode_t* icache_alloc() {
+    if (!icache_partial) {
+        icache_slab_t* slab = (icache_slab_t*) allocate_block();
+
+        if (!slab) {
+            return NULL;
+        }
+
+        slab->used = 0;
+        slab->free = NULL;
+
+        inode_t* slots = (inode_t*) (slab + 1);
+
+        for (int i = ICACHE_SLAB_INODES - 1; i >= 0; i--) {
+            slots[i].hash_next = slab->free;
+            slab->free = &slots[i];
+        }
+
+        icache_partial_link(slab);
+    }
+
+    icache_slab_t* slab = icache_partial;
+    inode_t* inode = slab->free;
+
+    slab->free = inode->hash_next;
+    slab->used++;
+
+    if (!slab->free) {
+        icache_partial_unlink(slab);
+    }
+
+    memset(inode, 0, sizeof(inode_t));
+    icache_stats.inodes++;
+
+    return inode;
+}
+
+// Free an inode slot, and its slab once the slab is empty
+static void icache_free(inode_t* inode) {
+    icache_slab_t* slab = icache_slab_of(inode);
+
+    if (!slab->free) {
+        icache_partial_link(slab);
+    }
+
+    inode->hash_next = slab->free;
+    slab->free = inode;
+    slab->used--;
+    icache_stats.inodes--;
+
+    if (slab->used == 0) {
+        icache_partial_unlink(slab);
+        free_block(slab);
+        icache_slabs_freed++;
+    }
+}
+
+// Remove an inode from the LRU list
+static void icache_lru_unlink(inode_t* inode) {
+    if (inode->lru_prev) {
+        inode->lru_prev->lru_next = inode->lru_next;
+    } else {
+        icache_lru_head = inode->lru_next;
+    }
+
+    if (inode->lru_next) {
+        inode->lru_next->lru_prev = inode->lru_prev;
+    } else {
+        icache_lru_tail = inode->lru_prev;
+    }
+
+    inode->lru_prev = NULL;
+    inode->lru_next = NULL;
+    icache_stats.unused--;
+}
+
+// Put an unused inode at the head of the LRU list
+static void icache_lru_push(inode_t* inode) {
+    inode->lru_prev = NULL;
+    inode->lru_next = icache_lru_head;
+
+    if (icache_lru_head) {
+        icache_lru_head->lru_prev = inode;
+    } else {
+        icache_lru_tail = inode;
+    }
+
+    icache_lru_head = inode;
+    icache_stats.unused++;
+}
+
+// Mark an inode clean, taking it off the dirty list
+static void icache_clear_dirty(inode_t* inode) {
+    if (!(inode->state & ICACHE_DIRTY)) {
+        return;
+    }
+
+    if (inode->dirty_prev) {
+        inode->dirty_prev->dirty_next = inode->dirty_next;
+    } else {
+        icache_dirty_head = inode->dirty_next;
+    }
+
+    if (inode->dirty_next) {
+        inode->dirty_next->dirty_prev = inode->dirty_prev;
+    } else {
+        icache_dirty_tail = inode->dirty_prev;
+    }
+
+    inode->dirty_prev = NULL;
+    inode->dirty_next = NULL;
+    inode->state &= ~ICACHE_DIRTY;
+    icache_stats.dirty--;
+}
+
+// Remove an unused inode from the cache (the caller has dealt with dirty data)
+static void icache_remove(inode_t* inode) {
+    inode_t** link = &icache_buckets[icache_bucket(inode->sb, inode->ino)];
+
+    while (*link != inode) {
+        link = &(*link)->hash_next;
+    }
+
+    *link = inode->hash_next;
+
+    icache_clear_dirty(inode);
+    icache_lru_unlink(inode);
+    icache_free(inode);
+}
+
+// Evict the least recently used clean unused inode; returns 0 on success
+//
+// Recently used inodes get a second chance. Dirty ones are skipped: this
+// runs from inside allocations, so it must not call into a file system, and
+// they go once icache_sync has written them back.
+static int icache_evict_one() {
+    unsigned int budget = 2 * icache_stats.unused;
+
+    while (icache_lru_tail && budget-- > 0) {
+        inode_t* inode = icache_lru_tail;
+
+        if (inode->state & ICACHE_REFERENCED) {
+            inode->state &= ~ICACHE_REFERENCED;
+            icache_lru_unlink(inode);
+            icache_lru_push(inode);
+            continue;
+        }
+
+        if (inode->state & ICACHE_DIRTY) {
+            icache_lru_unlink(inode);
+            icache_lru_push(inode);
+            continue;
+        }
+
+        icache_remove(inode);
+        icache_stats.evictions++;
+        return 0;
+    }
+
+    return -1;
+}
+
+// Initialize the inode cache
+void icache_init() {
+    for (int i = 0; i < ICACHE_BUCKETS; i++) {
+        icache_buckets[i] = NULL;
+    }
+
+    icache_lru_head = NULL;
+    icache_lru_tail = NULL;
+    icache_dirty_head = NULL;
+    icache_dirty_tail = NULL;
+    icache_partial = NULL;
+    icache_slabs_freed = 0;
+    memset(&icache_stats, 0, sizeof(icache_stats_t));
+
+    // Unused inodes go when the block allocator runs dry
+    memory_register_shrinker(icache_shrink);
+}
+
+// Get an inode, reading it in on a miss, and take a reference to it
+inode_t* icache_get(void* sb, unsigned int ino, const icache_ops_t* ops) {
+    if (!sb) {
+        return NULL;
+    }
+
+    unsigned int bucket = icache_bucket(sb, ino);
+
+    for (inode_t* inode = icache_buckets[bucket]; inode; inode = inode->hash_next) {
+        if (inode->sb == sb && inode->ino == ino && !(inode->state & ICACHE_FREEING)) {
+            if (inode->refcount++ == 0) {
+                icache_lru_unlink(inode);
+            }
+
+            inode->state |= ICACHE_REFERENCED;
+            icache_stats.hits++;
+            return inode;
+        }
+    }
+
+    icache_stats.misses++;
+
+    if (!ops || !ops->read_inode) {
+        return NULL;
+    }
+
+    if (icache_stats.inodes >= ICACHE_MAX_INODES) {
+        icache_evict_one();
+    }
+
+    inode_t* inode = icache_alloc();
+
+    if (!inode) {
+        return NULL;
+    }
+
+    inode->sb = sb;
+    inode->ino = ino;
+    inode->ops = ops;
+
+    if (ops->read_inode(sb, ino, inode->raw) != 0) {
+        icache_free(inode);
+        return NULL;
+    }
+
+    inode->refcount = 1;
+    inode->hash_next = icache_buckets[bucket];
+    icache_buckets[bucket] = inode;
+
+    return inode;
+}
+
+// Drop a reference to an inode; it stays cached until recycled, unless it
+// was invalidated while in use
+void icache_put(inode_t* inode) {
+    if (!inode || inode->refcount == 0) {
+        return;
+    }
+
+    if (--inode->refcount == 0) {
+        icache_lru_push(inode);
+
+        if (inode->state & ICACHE_FREEING) {
+            icache_remove(inode);
+        }
+    }
+}
+
+// Mark an inode as changed in memory
+void icache_mark_dirty(inode_t* inode) {
+    if (!inode || (inode->state & (ICACHE_DIRTY | ICACHE_FREEING))) {
+        return;
+    }
+
+    inode->state |= ICACHE_DIRTY;
+    inode->dirty_next = NULL;
+    inode->dirty_prev = icache_dirty_tail;
+
+    if (icache_dirty_tail) {
+        icache_dirty_tail->dirty_next = inode;
+    } else {
+        icache_dirty_head = inode;
+    }
+
+    icache_dirty_tail = inode;
+    icache_stats.dirty++;
+}
+
+// Mark an inode as matching what is on disk (e.g. after the file system
+// wrote it itself)
+void icache_mark_clean(inode_t* inode) {
+    if (inode) {
+        icache_clear_dirty(inode);
+    }
+}
+
+// Write a dirty inode back through its file system
+int icache_write_inode(inode_t* inode) {
+    if (!inode || !(inode->state & ICACHE_DIRTY)) {
+        return 0;
+    }
+
+    if (!inode->ops->write_inode) {
+        return -1;
+    }
+
+    // The file system may allocate, and reclaim must not come back here
+    memory_noreclaim_begin();
+    int result = inode->ops->write_inode(inode->sb, inode->ino, inode->raw);
+    memory_noreclaim_end();
+
+    if (result != 0) {
+        KLOG(&icache_log, KLOG_ERR, "Writeback of inode %u failed\n", inode->ino);
+        return -1;
+    }
+
+    icache_clear_dirty(inode);
+    icache_stats.writebacks++;
+
+    return 0;
+}
+
+// Write back the dirty inodes of a file system (all of them if sb is NULL)
+int icache_sync(void* sb) {
+    int result = 0;
+    inode_t* inode = icache_dirty_head;
+
+    while (inode) {
+        inode_t* next = inode->dirty_next;
+
+        if ((!sb || inode->sb == sb) && icache_write_inode(inode) != 0) {
+            result = -1;
+        }
+
+        inode = next;
+    }
+
+    return result;
+}
+
+// Forget a cached inode without writing it back (e.g. once it is deleted)
+//
+// An inode still referenced is marked clean and freeing: lookups no longer
+// find it, and it goes with its last put.
+void icache_invalidate(void* sb, unsigned int ino) {
+    for (inode_t* inode = icache_buckets[icache_bucket(sb, ino)]; inode; inode = inode->hash_next) {
+        if (inode->sb == sb && inode->ino == ino && !(inode->state & ICACHE_FREEING)) {
+            icache_clear_dirty(inode);
+
+            if (inode->refcount == 0) {
+                icache_remove(inode);
+            } else {
+                inode->state |= ICACHE_FREEING;
+            }
+
+            return;
+        }
+    }
+}
+
+// Write back and drop everything cached for a file system (e.g. on unmount)
+void icache_drop_owner(void* sb) {
+    icache_sync(sb);
+
+    for (int i = 0; i < ICACHE_BUCKETS; i++) {
+        inode_t* inode = icache_buckets[i];
+
+        while (inode) {
+            inode_t* next = inode->hash_next;
+
+            if (inode->sb == sb) {
+                if (inode->refcount > 0) {
+                    KLOG(&icache_log, KLOG_WARNING, "Inode %u still in use\n", inode->ino);
+                    inode->refcount = 0;
+                    icache_lru_push(inode);
+                }
+
+                icache_clear_dirty(inode);
+                icache_remove(inode);
+            }
+
+            inode = next;
+        }
+    }
+}
+
+// Evict clean unused inodes until count slabs have gone back to the
+// allocator (the memory shrinker); returns the number of blocks freed
+unsigned int icache_shrink(unsigned int count) {
+    unsigned int start = icache_slabs_freed;
+
+    while (icache_slabs_freed - start < count) {
+        if (icache_evict_one() != 0) {
+            break;
+        }
+    }
+
+    unsigned int freed = icache_slabs_freed - start;
+    icache_stats.shrunk += freed;
+
+    return freed;
+}
+
+// Get inode cache statistics
+void icache_get_stats(icache_stats_t* stats) {
+    if (stats) {
+        *stats = icache_stats;
+    }
+}
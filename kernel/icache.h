@@ -0,0 +1,78 @@
+/**
+ * LightOS Kernel
+ * Inode cache header
+ */
+
+#ifndef ICACHE_H
+#define ICACHE_H
+
+// Bytes of file system specific inode data kept per inode
+#define ICACHE_INODE_SIZE 256
+
+// Inodes above which unused ones are recycled before new ones are allocated
+#define ICACHE_MAX_INODES 4096
+
+// Number of hash buckets (must be a power of two)
+#define ICACHE_BUCKETS 1024
+
+// Inode state flags
+#define ICACHE_DIRTY      0x01
+#define ICACHE_REFERENCED 0x02
+#define ICACHE_FREEING    0x04        // Invalidated; freed with its last reference
+
+struct inode;
+
+// Operations used to fill and write back inodes of one file system
+typedef struct {
+    int (*read_inode)(void* sb, unsigned int ino, void* raw);
+    int (*write_inode)(void* sb, unsigned int ino, const void* raw);
+} icache_ops_t;
+
+// Cached inode
+//
+// Inodes are identified by (sb, ino), where sb is the filesystem_t the
+// inode belongs to. raw holds the file system's own inode structure, read
+// in by ops->read_inode on a miss. Inodes nobody holds a reference to stay
+// cached on an LRU list until they are recycled or shrunk away; dirty ones
+// are also on a dirty list and stay cached until icache_sync writes them
+// back.
+typedef struct inode {
+    void* sb;
+    unsigned int ino;
+    unsigned int refcount;
+    unsigned int state;
+    const icache_ops_t* ops;
+    struct inode* hash_next;
+    struct inode* lru_prev;
+    struct inode* lru_next;
+    struct inode* dirty_prev;
+    struct inode* dirty_next;
+    unsigned char raw[ICACHE_INODE_SIZE];
+} inode_t;
+
+// Inode cache statistics
+typedef struct {
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+    unsigned long long writebacks;
+    unsigned long long shrunk;          // Slabs freed for the memory shrinker
+    unsigned int inodes;
+    unsigned int unused;
+    unsigned int dirty;
+} icache_stats_t;
+
+// Inode cache functions
+void icache_init();
+inode_t* icache_get(void* sb, unsigned int ino, const icache_ops_t* ops);
+void icache_put(inode_t* inode);
+void icache_mark_dirty(inode_t* inode);
+void icache_mark_clean(inode_t* inode);
+int icache_write_inode(inode_t* inode);
+int icache_sync(void* sb);
+void icache_invalidate(void* sb, unsigned int ino);
+void icache_drop_owner(void* sb);
+unsigned int icache_shrink(unsigned int count);
+void icache_get_stats(icache_stats_t* stats);
+
+#endif /* ICACHE_H */
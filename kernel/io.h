@@ -0,0 +1,50 @@
+/**
+ * LightOS Kernel
+ * Port I/O header
+ */
+
+#ifndef IO_H
+#define IO_H
+
+// Write a byte to an I/O port
+static inline void outb(unsigned short port, unsigned char value) {
+    __asm__ __volatile__("outb %0, %1" : : "a"(value), "Nd"(port));
+}
+
+// Read a byte from an I/O port
+static inline unsigned char inb(unsigned short port) {
+    unsigned char value;
+    __asm__ __volatile__("inb %1, %0" : "=a"(value) : "Nd"(port));
+    return value;
+}
+
+// Write a word to an I/O port
+static inline void outw(unsigned short port, unsigned short value) {
+    __asm__ __volatile__("outw %0, %1" : : "a"(value), "Nd"(port));
+}
+
+// Read a word from an I/O port
+static inline unsigned short inw(unsigned short port) {
+    unsigned short value;
+    __asm__ __volatile__("inw %1, %0" : "=a"(value) : "Nd"(port));
+    return value;
+}
+
+// Write a double word to an I/O port
+static inline void outl(unsigned short port, unsigned int value) {
+    __asm__ __volatile__("outl %0, %1" : : "a"(value), "Nd"(port));
+}
+
+// Read a double word from an I/O port
+static inline unsigned int inl(unsigned short port) {
+    unsigned int value;
+    __asm__ __volatile__("inl %1, %0" : "=a"(value) : "Nd"(port));
+    return value;
+}
+
+// Short delay by writing to an unused port
+static inline void io_wait() {
+    outb(0x80, 0);
+}
+
+#endif /* IO_H */
@@ -0,0 +1,1166 @@
+/**
+ * LightOS Kernel
+ * JBD2 journal implementation
+ */
+
+#include "jbd2.h"
+#include "kernel.h"
+#include "klog.h"
+#include "ktime.h"
+#include "memory.h"
+#include "../libc/string.h"
+
+KLOG_SUBSYSTEM(jbd2_log, "jbd2");
+
+// Block header field offsets
+#define JBD2_HEADER_MAGIC     0x00
+#define JBD2_HEADER_BLOCKTYPE 0x04
+#define JBD2_HEADER_SEQUENCE  0x08
+#define JBD2_HEADER_SIZE      12
+
+// Superblock field offsets
+#define JBD2_SB_BLOCKSIZE 0x0C
+#define JBD2_SB_MAXLEN    0x10
+#define JBD2_SB_FIRST     0x14
+#define JBD2_SB_SEQUENCE  0x18
+#define JBD2_SB_START     0x1C
+#define JBD2_SB_INCOMPAT  0x28
+#define JBD2_SB_UUID      0x30
+
+// Commit block timestamp offsets
+#define JBD2_COMMIT_SEC  0x30
+#define JBD2_COMMIT_NSEC 0x38
+
+// Revoke block fields (the count includes the header)
+#define JBD2_REVOKE_COUNT  0x0C
+#define JBD2_REVOKE_HEADER 16
+
+// Smallest usable log
+#define JBD2_MIN_LOG_BLOCKS 64
+
+// Recovery passes
+#define JBD2_PASS_SCAN   0
+#define JBD2_PASS_REVOKE 1
+#define JBD2_PASS_REPLAY 2
+
+// Revoke record used during recovery (hashed by block)
+typedef struct {
+    unsigned long long block;
+    unsigned int sequence;
+    unsigned int used;
+} jbd2_revoke_record_t;
+
+// Memory blocks needed for the recovery revoke table
+#define JBD2_REVOKE_TABLE_BLOCKS ((JBD2_MAX_RECOVERY_REVOKES * sizeof(jbd2_revoke_record_t) + MEMORY_BLOCK_SIZE - 1) / MEMORY_BLOCK_SIZE)
+
+// Loaded journals, visited by the background work
+static jbd2_journal_t* jbd2_journals[JBD2_MAX_JOURNALS];
+
+// Read a big-endian 32-bit value
+static unsigned int jbd2_get_be32(const unsigned char* p) {
+    return ((unsigned int) p[0] << 24) | ((unsigned int) p[1] << 16) | ((unsigned int) p[2] << 8) | p[3];
+}
+
+// Read a big-endian 16-bit value
+static unsigned short jbd2_get_be16(const unsigned char* p) {
+    return (unsigned short) ((p[0] << 8) | p[1]);
+}
+
+// Write a big-endian 32-bit value
+static void jbd2_put_be32(unsigned char* p, unsigned int value) {
+    p[0] = (unsigned char) (value >> 24);
+    p[1] = (unsigned char) (value >> 16);
+    p[2] = (unsigned char) (value >> 8);
+    p[3] = (unsigned char) value;
+}
+
+// Write a big-endian 16-bit value
+static void jbd2_put_be16(unsigned char* p, unsigned short value) {
+    p[0] = (unsigned char) (value >> 8);
+    p[1] = (unsigned char) value;
+}
+
+// Check if transaction a is b or later, allowing for wrap-around
+static int jbd2_tid_geq(unsigned int a, unsigned int b) {
+    return (int) (a - b) >= 0;
+}
+
+// Fill in a block header
+static void jbd2_put_header(unsigned char* block, unsigned int type, unsigned int sequence) {
+    jbd2_put_be32(block + JBD2_HEADER_MAGIC, JBD2_MAGIC);
+    jbd2_put_be32(block + JBD2_HEADER_BLOCKTYPE, type);
+    jbd2_put_be32(block + JBD2_HEADER_SEQUENCE, sequence);
+}
+
+// Advance a log position, wrapping at the end of the log
+static unsigned int jbd2_next(jbd2_journal_t* journal, unsigned int position) {
+    return ++position == journal->last ? journal->first : position;
+}
+
+// Number of log blocks holding committed transactions
+static unsigned int jbd2_log_used(jbd2_journal_t* journal) {
+    if (journal->head >= journal->tail) {
+        return journal->head - journal->tail;
+    }
+
+    return journal->last - journal->first - (journal->tail - journal->head);
+}
+
+// Number of free log blocks (one is kept back so a full log differs from an empty one)
+static unsigned int jbd2_log_free(jbd2_journal_t* journal) {
+    return journal->last - journal->first - jbd2_log_used(journal) - 1;
+}
+
+// Find the device sector of a journal block
+static int jbd2_log_sector(jbd2_journal_t* journal, unsigned int block, unsigned int* sector) {
+    for (unsigned int i = 0; i < journal->extent_count; i++) {
+        jbd2_extent_t* extent = &journal->extents[i];
+
+        if (block >= extent->logical && block - extent->logical < extent->length) {
+            unsigned long long start = (extent->physical + (block - extent->logical)) * journal->sectors_per_block;
+
+            if (start + journal->sectors_per_block > 0xFFFFFFFFULL) {
+                return -1;
+            }
+
+            *sector = (unsigned int) start;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+// Read a journal block
+static int jbd2_read_log(jbd2_journal_t* journal, unsigned int block, void* buffer) {
+    unsigned int sector;
+
+    if (jbd2_log_sector(journal, block, &sector) != 0) {
+        return -1;
+    }
+
+    return bdev_read_sectors(journal->dev, sector, journal->sectors_per_block, buffer);
+}
+
+// Write a journal block (queued while the caller has storage plugged)
+static int jbd2_write_log(jbd2_journal_t* journal, unsigned int block, const void* buffer) {
+    unsigned int sector;
+
+    if (jbd2_log_sector(journal, block, &sector) != 0) {
+        return -1;
+    }
+
+    return bdev_write_sectors(journal->dev, sector, journal->sectors_per_block, buffer);
+}
+
+// Write a metadata block to its home location
+static int jbd2_write_home(jbd2_journal_t* journal, unsigned long long block, const void* buffer) {
+    unsigned long long sector = block * journal->sectors_per_block;
+
+    if (sector + journal->sectors_per_block > 0xFFFFFFFFULL) {
+        return -1;
+    }
+
+    return bdev_write_sectors(journal->dev, (unsigned int) sector, journal->sectors_per_block, buffer);
+}
+
+// Record the log start and sequence in the journal superblock
+static int jbd2_write_superblock(jbd2_journal_t* journal, unsigned int start, unsigned int sequence) {
+    jbd2_put_be32(journal->superblock + JBD2_SB_START, start);
+    jbd2_put_be32(journal->superblock + JBD2_SB_SEQUENCE, sequence);
+    journal->sb_start = start;
+
+    return jbd2_write_log(journal, 0, journal->superblock);
+}
+
+// Map the journal's blocks to device extents
+static int jbd2_map_extents(jbd2_journal_t* journal, jbd2_bmap_t bmap, void* context, unsigned int blocks) {
+    unsigned int logical = 0;
+
+    while (logical < blocks) {
+        unsigned long long physical;
+        unsigned int run;
+
+        if (bmap(context, logical, &physical, &run) != 0 || physical == 0 || run == 0) {
+            KLOG(&jbd2_log, KLOG_ERR, "Journal block %u is not mapped\n", logical);
+            return -1;
+        }
+
+        if (run > blocks - logical) {
+            run = blocks - logical;
+        }
+
+        jbd2_extent_t* previous = journal->extent_count > 0 ? &journal->extents[journal->extent_count - 1] : NULL;
+
+        if (previous && previous->physical + previous->length == physical) {
+            previous->length += run;
+        } else if (journal->extent_count < JBD2_MAX_EXTENTS) {
+            jbd2_extent_t* extent = &journal->extents[journal->extent_count++];
+            extent->logical = logical;
+            extent->length = run;
+            extent->physical = physical;
+        } else {
+            KLOG(&jbd2_log, KLOG_ERR, "Journal is split into more than %u extents\n", JBD2_MAX_EXTENTS);
+            return -1;
+        }
+
+        logical += run;
+    }
+
+    return 0;
+}
+
+// Add a revoke record found by recovery, keeping the newest sequence
+static int jbd2_revoke_add(jbd2_revoke_record_t* table, unsigned int* count, unsigned long long block, unsigned int sequence) {
+    unsigned int slot = (unsigned int) ((block * 2654435761ULL) % JBD2_MAX_RECOVERY_REVOKES);
+
+    while (table[slot].used) {
+        if (table[slot].block == block) {
+            if (jbd2_tid_geq(sequence, table[slot].sequence)) {
+                table[slot].sequence = sequence;
+            }
+
+            return 0;
+        }
+
+        slot = (slot + 1) % JBD2_MAX_RECOVERY_REVOKES;
+    }
+
+    // Keep one slot free so lookups always terminate
+    if (*count + 1 >= JBD2_MAX_RECOVERY_REVOKES) {
+        return -1;
+    }
+
+    table[slot].block = block;
+    table[slot].sequence = sequence;
+    table[slot].used = 1;
+    (*count)++;
+
+    return 0;
+}
+
+// Check if a block copy logged by a transaction was revoked by it or a later one
+static int jbd2_revoke_test(jbd2_revoke_record_t* table, unsigned long long block, unsigned int sequence) {
+    unsigned int slot = (unsigned int) ((block * 2654435761ULL) % JBD2_MAX_RECOVERY_REVOKES);
+
+    while (table[slot].used) {
+        if (table[slot].block == block) {
+            return jbd2_tid_geq(table[slot].sequence, sequence);
+        }
+
+        slot = (slot + 1) % JBD2_MAX_RECOVERY_REVOKES;
+    }
+
+    return 0;
+}
+
+// Walk the log from its recorded start for one recovery pass
+//
+// The scan pass finds the sequence number following the last transaction
+// with a commit block; the revoke and replay passes stop there.
+static int jbd2_recovery_pass(jbd2_journal_t* journal, int pass, unsigned int* end_sequence, jbd2_revoke_record_t* revokes, unsigned int* revoke_count) {
+    unsigned int position = journal->sb_start;
+    unsigned int sequence = jbd2_get_be32(journal->superblock + JBD2_SB_SEQUENCE);
+    unsigned int size = journal->last - journal->first;
+    unsigned int walked = 0;
+    unsigned int record_size = (journal->incompat & JBD2_FEATURE_INCOMPAT_64BIT) ? 8 : 4;
+    unsigned char* block = journal->buffer;
+
+    while (pass == JBD2_PASS_SCAN || sequence != *end_sequence) {
+        if (walked++ >= size) {
+            break;
+        }
+
+        if (jbd2_read_log(journal, position, block) != 0) {
+            KLOG(&jbd2_log, KLOG_ERR, "Failed to read journal block %u\n", position);
+            return -1;
+        }
+
+        unsigned int type = jbd2_get_be32(block + JBD2_HEADER_BLOCKTYPE);
+
+        if (jbd2_get_be32(block + JBD2_HEADER_MAGIC) != JBD2_MAGIC ||
+            jbd2_get_be32(block + JBD2_HEADER_SEQUENCE) != sequence ||
+            (type != JBD2_DESCRIPTOR_BLOCK && type != JBD2_COMMIT_BLOCK && type != JBD2_REVOKE_BLOCK)) {
+            if (pass == JBD2_PASS_SCAN) {
+                break;
+            }
+
+            KLOG(&jbd2_log, KLOG_ERR, "Journal block %u changed during recovery\n", position);
+            return -1;
+        }
+
+        position = jbd2_next(journal, position);
+
+        if (type == JBD2_COMMIT_BLOCK) {
+            sequence++;
+        } else if (type == JBD2_REVOKE_BLOCK) {
+            if (pass != JBD2_PASS_REVOKE) {
+                continue;
+            }
+
+            unsigned int count = jbd2_get_be32(block + JBD2_REVOKE_COUNT);
+
+            for (unsigned int offset = JBD2_REVOKE_HEADER; offset + record_size <= count && offset + record_size <= journal->block_size; offset += record_size) {
+                unsigned long long revoked = jbd2_get_be32(block + offset);
+
+                if (record_size == 8) {
+                    revoked = (revoked << 32) | jbd2_get_be32(block + offset + 4);
+                }
+
+                if (jbd2_revoke_add(revokes, revoke_count, revoked, sequence) != 0) {
+                    KLOG(&jbd2_log, KLOG_ERR, "Too many revoked blocks to recover\n");
+                    return -1;
+                }
+            }
+        } else {
+            // Descriptor: each tag names the home of the next block in the log
+            unsigned int offset = JBD2_HEADER_SIZE;
+
+            while (offset + journal->tag_bytes <= journal->block_size) {
+                unsigned char* tag = block + offset;
+                unsigned long long home = jbd2_get_be32(tag);
+                unsigned short flags = jbd2_get_be16(tag + 6);
+
+                if (journal->incompat & JBD2_FEATURE_INCOMPAT_64BIT) {
+                    home |= (unsigned long long) jbd2_get_be32(tag + 8) << 32;
+                }
+
+                offset += journal->tag_bytes;
+
+                if (!(flags & JBD2_FLAG_SAME_UUID)) {
+                    offset += 16;
+                }
+
+                if (pass == JBD2_PASS_REPLAY && !jbd2_revoke_test(revokes, home, sequence)) {
+                    if (jbd2_read_log(journal, position, journal->data_buffer) != 0) {
+                        KLOG(&jbd2_log, KLOG_ERR, "Failed to read journal block %u\n", position);
+                        return -1;
+                    }
+
+                    if (flags & JBD2_FLAG_ESCAPE) {
+                        jbd2_put_be32(journal->data_buffer, JBD2_MAGIC);
+                    }
+
+                    if (jbd2_write_home(journal, home, journal->data_buffer) != 0) {
+                        KLOG(&jbd2_log, KLOG_ERR, "Failed to replay block %llu\n", home);
+                        return -1;
+                    }
+
+                    journal->stats.replayed++;
+                }
+
+                position = jbd2_next(journal, position);
+                walked++;
+
+                if (flags & JBD2_FLAG_LAST_TAG) {
+                    break;
+                }
+            }
+        }
+    }
+
+    if (pass == JBD2_PASS_SCAN) {
+        *end_sequence = sequence;
+    }
+
+    return 0;
+}
+
+// Replay the committed transactions of a journal that was not shut down cleanly
+static int jbd2_recover(jbd2_journal_t* journal) {
+    unsigned int start_sequence = jbd2_get_be32(journal->superblock + JBD2_SB_SEQUENCE);
+    unsigned int end_sequence = start_sequence;
+    unsigned int revoke_count = 0;
+
+    if (journal->dev->read_only) {
+        terminal_write("Error: Journal needs recovery but the device is read-only\n");
+        return -1;
+    }
+
+    jbd2_revoke_record_t* revokes = (jbd2_revoke_record_t*) allocate_blocks(JBD2_REVOKE_TABLE_BLOCKS);
+
+    if (!revokes) {
+        terminal_write("Error: Failed to allocate memory for journal recovery\n");
+        return -1;
+    }
+
+    memset(revokes, 0, JBD2_REVOKE_TABLE_BLOCKS * MEMORY_BLOCK_SIZE);
+
+    int result = jbd2_recovery_pass(journal, JBD2_PASS_SCAN, &end_sequence, revokes, &revoke_count);
+
+    if (result == 0) {
+        result = jbd2_recovery_pass(journal, JBD2_PASS_REVOKE, &end_sequence, revokes, &revoke_count);
+    }
+
+    if (result == 0) {
+        storage_plug();
+        result = jbd2_recovery_pass(journal, JBD2_PASS_REPLAY, &end_sequence, revokes, &revoke_count);
+
+        if (storage_unplug() != 0) {
+            result = -1;
+        }
+    }
+
+    free_blocks(revokes, JBD2_REVOKE_TABLE_BLOCKS);
+
+    // The replayed blocks must be stable before the log is marked empty
+    if (result != 0 || bdev_flush(journal->dev) != 0 ||
+        jbd2_write_superblock(journal, 0, end_sequence) != 0 || bdev_flush(journal->dev) != 0) {
+        terminal_write("Error: Journal recovery failed\n");
+        return -1;
+    }
+
+    KLOG(&jbd2_log, KLOG_INFO, "Recovered %u transactions, %llu blocks replayed, %u revoked\n",
+         end_sequence - start_sequence, journal->stats.replayed, revoke_count);
+
+    return 0;
+}
+
+// Release a journal's memory
+static void jbd2_free(jbd2_journal_t* journal) {
+    if (journal->superblock) {
+        free_block(journal->superblock);
+    }
+
+    if (journal->buffer) {
+        free_block(journal->buffer);
+    }
+
+    if (journal->data_buffer) {
+        free_block(journal->data_buffer);
+    }
+
+    if (journal->running) {
+        free_blocks(journal->running, JBD2_TRANSACTION_BLOCKS);
+    }
+
+    if (journal->checkpoint) {
+        free_blocks(journal->checkpoint, JBD2_CHECKPOINT_BLOCKS);
+    }
+
+    free_block(journal);
+}
+
+// Abort the journal after an I/O error
+//
+// Changes in the running transaction are dropped from the journal; their
+// pages stay cached but are never written home, as the file system is no
+// longer consistent on disk.
+static void jbd2_abort(jbd2_journal_t* journal) {
+    jbd2_transaction_t* transaction = journal->running;
+
+    KLOG(&jbd2_log, KLOG_ERR, "Aborting journal in transaction %u\n", transaction->tid);
+
+    for (unsigned int i = 0; i < transaction->nr_buffers; i++) {
+        page_cache_unpin(transaction->buffers[i].page);
+    }
+
+    transaction->nr_buffers = 0;
+    transaction->nr_revokes = 0;
+    transaction->nr_ordered = 0;
+    journal->failed = 1;
+}
+
+// Write committed blocks to their home locations and empty the log
+static int jbd2_do_checkpoint(jbd2_journal_t* journal) {
+    int result = 0;
+
+    if (journal->nr_checkpoint == 0 && journal->sb_start == 0) {
+        return 0;
+    }
+
+    storage_plug();
+
+    // Pages pinned by the running transaction already hold newer contents,
+    // so the committed version is written home from its log copy
+    for (unsigned int i = 0; i < journal->nr_checkpoint; i++) {
+        jbd2_checkpoint_t* entry = &journal->checkpoint[i];
+
+        if (entry->log_block == 0) {
+            continue;
+        }
+
+        page_t* page = page_cache_find_page(journal->cache, (unsigned int) (entry->block * journal->block_size / PAGE_CACHE_PAGE_SIZE));
+
+        if (!page || page->pins == 0) {
+            continue;
+        }
+
+        if (jbd2_read_log(journal, entry->log_block, journal->data_buffer) != 0) {
+            result = -1;
+            continue;
+        }
+
+        if (entry->escaped) {
+            jbd2_put_be32(journal->data_buffer, JBD2_MAGIC);
+        }
+
+        if (jbd2_write_home(journal, entry->block, journal->data_buffer) != 0) {
+            result = -1;
+        }
+    }
+
+    // Everything else is in the cache, or was written home when evicted
+    if (page_cache_sync(journal->cache) != 0) {
+        result = -1;
+    }
+
+    if (storage_unplug() != 0) {
+        result = -1;
+    }
+
+    if (result != 0 || bdev_flush(journal->dev) != 0) {
+        KLOG(&jbd2_log, KLOG_ERR, "Checkpoint failed\n");
+        return -1;
+    }
+
+    if (jbd2_write_superblock(journal, 0, journal->running->tid) != 0 || bdev_flush(journal->dev) != 0) {
+        KLOG(&jbd2_log, KLOG_ERR, "Failed to update journal superblock\n");
+        return -1;
+    }
+
+    journal->tail = journal->head;
+    journal->nr_checkpoint = 0;
+    journal->stats.checkpoints++;
+
+    return 0;
+}
+
+// Commit the running transaction
+//
+// The descriptor, revoke and block copies are written and flushed before
+// the commit block, which is flushed in turn; only then are the pages
+// released to be written home.
+static int jbd2_commit_transaction(jbd2_journal_t* journal) {
+    jbd2_transaction_t* transaction = journal->running;
+    unsigned int block_size = journal->block_size;
+    unsigned int record_size = (journal->incompat & JBD2_FEATURE_INCOMPAT_64BIT) ? 8 : 4;
+    unsigned int tags_per_block = (block_size - JBD2_HEADER_SIZE - 16) / journal->tag_bytes;
+    unsigned int revokes_per_block = (block_size - JBD2_REVOKE_HEADER) / record_size;
+    unsigned char* block = journal->buffer;
+
+    // Ordered data reaches the device before the metadata that refers to it
+    for (unsigned int i = 0; i < transaction->nr_ordered; i++) {
+        if (page_cache_sync(transaction->ordered[i]) != 0) {
+            jbd2_abort(journal);
+            return -1;
+        }
+    }
+
+    transaction->nr_ordered = 0;
+
+    if (transaction->nr_buffers == 0 && transaction->nr_revokes == 0) {
+        return 0;
+    }
+
+    unsigned int needed = transaction->nr_buffers + (transaction->nr_buffers + tags_per_block - 1) / tags_per_block +
+                          (transaction->nr_revokes + revokes_per_block - 1) / revokes_per_block + 1;
+
+    if (needed > jbd2_log_free(journal) || journal->nr_checkpoint + transaction->nr_buffers > JBD2_MAX_CHECKPOINT) {
+        if (jbd2_do_checkpoint(journal) != 0 || needed > jbd2_log_free(journal)) {
+            jbd2_abort(journal);
+            return -1;
+        }
+    }
+
+    int result = 0;
+
+    storage_plug();
+
+    // Recovery starts from the first transaction written after the log was empty
+    if (journal->sb_start == 0 && jbd2_write_superblock(journal, journal->head, transaction->tid) != 0) {
+        result = -1;
+    }
+
+    // Revoke records
+    unsigned int index = 0;
+
+    while (result == 0 && index < transaction->nr_revokes) {
+        unsigned int offset = JBD2_REVOKE_HEADER;
+
+        memset(block, 0, block_size);
+        jbd2_put_header(block, JBD2_REVOKE_BLOCK, transaction->tid);
+
+        while (index < transaction->nr_revokes && offset + record_size <= block_size) {
+            unsigned long long revoked = transaction->revokes[index++];
+
+            if (record_size == 8) {
+                jbd2_put_be32(block + offset, (unsigned int) (revoked >> 32));
+                jbd2_put_be32(block + offset + 4, (unsigned int) revoked);
+            } else {
+                jbd2_put_be32(block + offset, (unsigned int) revoked);
+            }
+
+            offset += record_size;
+        }
+
+        jbd2_put_be32(block + JBD2_REVOKE_COUNT, offset);
+
+        if (jbd2_write_log(journal, journal->head, block) != 0) {
+            result = -1;
+        }
+
+        journal->head = jbd2_next(journal, journal->head);
+    }
+
+    // Descriptor blocks, each followed by the copies it describes
+    index = 0;
+
+    while (result == 0 && index < transaction->nr_buffers) {
+        unsigned int count = transaction->nr_buffers - index;
+        unsigned int descriptor = journal->head;
+        unsigned int offset = JBD2_HEADER_SIZE;
+
+        if (count > tags_per_block) {
+            count = tags_per_block;
+        }
+
+        memset(block, 0, block_size);
+        jbd2_put_header(block, JBD2_DESCRIPTOR_BLOCK, transaction->tid);
+        journal->head = jbd2_next(journal, journal->head);
+
+        for (unsigned int i = 0; i < count && result == 0; i++) {
+            jbd2_buffer_t* buffer = &transaction->buffers[index + i];
+            unsigned long long offset_in_cache = buffer->block * block_size;
+            unsigned short flags = 0;
+
+            if (buffer->block > 0xFFFFFFFFULL && !(journal->incompat & JBD2_FEATURE_INCOMPAT_64BIT)) {
+                KLOG(&jbd2_log, KLOG_ERR, "Block %llu needs a 64-bit journal\n", buffer->block);
+                result = -1;
+                break;
+            }
+
+            // A copy must not look like a journal block to recovery
+            memcpy(journal->data_buffer, (unsigned char*) buffer->page->data + offset_in_cache % PAGE_CACHE_PAGE_SIZE, block_size);
+
+            if (jbd2_get_be32(journal->data_buffer) == JBD2_MAGIC) {
+                jbd2_put_be32(journal->data_buffer, 0);
+                flags |= JBD2_FLAG_ESCAPE;
+            }
+
+            if (i > 0) {
+                flags |= JBD2_FLAG_SAME_UUID;
+            }
+
+            if (i == count - 1) {
+                flags |= JBD2_FLAG_LAST_TAG;
+            }
+
+            jbd2_put_be32(block + offset, (unsigned int) buffer->block);
+            jbd2_put_be16(block + offset + 6, flags);
+
+            if (journal->incompat & JBD2_FEATURE_INCOMPAT_64BIT) {
+                jbd2_put_be32(block + offset + 8, (unsigned int) (buffer->block >> 32));
+            }
+
+            offset += journal->tag_bytes;
+
+            if (i == 0) {
+                memcpy(block + offset, journal->superblock + JBD2_SB_UUID, 16);
+                offset += 16;
+            }
+
+            if (jbd2_write_log(journal, journal->head, journal->data_buffer) != 0) {
+                result = -1;
+            }
+
+            jbd2_checkpoint_t* entry = &journal->checkpoint[journal->nr_checkpoint++];
+            entry->block = buffer->block;
+            entry->log_block = journal->head;
+            entry->escaped = (flags & JBD2_FLAG_ESCAPE) != 0;
+
+            journal->head = jbd2_next(journal, journal->head);
+        }
+
+        if (result == 0 && jbd2_write_log(journal, descriptor, block) != 0) {
+            result = -1;
+        }
+
+        index += count;
+    }
+
+    if (storage_unplug() != 0 || result != 0 || bdev_flush(journal->dev) != 0) {
+        jbd2_abort(journal);
+        return -1;
+    }
+
+    // The commit block makes the transaction durable
+    unsigned long long now = ktime_get_real();
+
+    memset(block, 0, block_size);
+    jbd2_put_header(block, JBD2_COMMIT_BLOCK, transaction->tid);
+    jbd2_put_be32(block + JBD2_COMMIT_SEC, (unsigned int) ((now / NSEC_PER_SEC) >> 32));
+    jbd2_put_be32(block + JBD2_COMMIT_SEC + 4, (unsigned int) (now / NSEC_PER_SEC));
+    jbd2_put_be32(block + JBD2_COMMIT_NSEC, (unsigned int) (now % NSEC_PER_SEC));
+
+    if (jbd2_write_log(journal, journal->head, block) != 0 || bdev_flush(journal->dev) != 0) {
+        jbd2_abort(journal);
+        return -1;
+    }
+
+    journal->head = jbd2_next(journal, journal->head);
+
+    // The metadata may now be written home by the page cache
+    for (unsigned int i = 0; i < transaction->nr_buffers; i++) {
+        page_cache_unpin(transaction->buffers[i].page);
+        page_cache_mark_dirty(transaction->buffers[i].page);
+    }
+
+    journal->stats.commits++;
+    journal->stats.blocks_logged += transaction->nr_buffers;
+    journal->committed_tid = transaction->tid;
+    journal->last_commit = ktime_get_ns();
+
+    transaction->tid++;
+    transaction->nr_buffers = 0;
+    transaction->nr_revokes = 0;
+    transaction->started = 0;
+
+    return 0;
+}
+
+// Load a journal stored in the given journal blocks, recovering it if needed
+//
+// The journal uses the same block size as the file system whose metadata
+// it protects; cache is that file system's view of the device.
+jbd2_journal_t* jbd2_load(block_dev_t* dev, page_mapping_t* cache, unsigned int block_size, jbd2_bmap_t bmap, void* context, unsigned int blocks) {
+    if (!dev || !cache || !bmap || block_size == 0 || block_size > PAGE_CACHE_PAGE_SIZE || block_size % dev->sector_size != 0) {
+        return NULL;
+    }
+
+    int slot = -1;
+
+    for (int i = 0; i < JBD2_MAX_JOURNALS; i++) {
+        if (!jbd2_journals[i]) {
+            slot = i;
+            break;
+        }
+    }
+
+    if (slot < 0) {
+        terminal_write("Error: Too many journals loaded\n");
+        return NULL;
+    }
+
+    jbd2_journal_t* journal = (jbd2_journal_t*) allocate_block();
+
+    if (!journal) {
+        terminal_write("Error: Failed to allocate memory for journal\n");
+        return NULL;
+    }
+
+    memset(journal, 0, sizeof(jbd2_journal_t));
+    journal->dev = dev;
+    journal->cache = cache;
+    journal->block_size = block_size;
+    journal->sectors_per_block = block_size / dev->sector_size;
+    journal->superblock = (unsigned char*) allocate_block();
+    journal->buffer = (unsigned char*) allocate_block();
+    journal->data_buffer = (unsigned char*) allocate_block();
+    journal->running = (jbd2_transaction_t*) allocate_blocks(JBD2_TRANSACTION_BLOCKS);
+    journal->checkpoint = (jbd2_checkpoint_t*) allocate_blocks(JBD2_CHECKPOINT_BLOCKS);
+
+    if (!journal->superblock || !journal->buffer || !journal->data_buffer || !journal->running || !journal->checkpoint) {
+        terminal_write("Error: Failed to allocate memory for journal\n");
+        jbd2_free(journal);
+        return NULL;
+    }
+
+    memset(journal->running, 0, sizeof(jbd2_transaction_t));
+
+    if (jbd2_map_extents(journal, bmap, context, blocks) != 0 || jbd2_read_log(journal, 0, journal->superblock) != 0) {
+        terminal_write("Error: Failed to read journal superblock\n");
+        jbd2_free(journal);
+        return NULL;
+    }
+
+    unsigned char* sb = journal->superblock;
+    unsigned int type = jbd2_get_be32(sb + JBD2_HEADER_BLOCKTYPE);
+    unsigned int maxlen = jbd2_get_be32(sb + JBD2_SB_MAXLEN);
+    unsigned int first = jbd2_get_be32(sb + JBD2_SB_FIRST);
+
+    if (jbd2_get_be32(sb + JBD2_HEADER_MAGIC) != JBD2_MAGIC ||
+        (type != JBD2_SUPERBLOCK_V1 && type != JBD2_SUPERBLOCK_V2)) {
+        terminal_write("Error: Invalid journal superblock\n");
+        jbd2_free(journal);
+        return NULL;
+    }
+
+    if (jbd2_get_be32(sb + JBD2_SB_BLOCKSIZE) != block_size || maxlen > blocks || first == 0 ||
+        first >= maxlen || maxlen - first < JBD2_MIN_LOG_BLOCKS) {
+        terminal_write("Error: Unsupported journal geometry\n");
+        jbd2_free(journal);
+        return NULL;
+    }
+
+    journal->incompat = type == JBD2_SUPERBLOCK_V2 ? jbd2_get_be32(sb + JBD2_SB_INCOMPAT) : 0;
+
+    // Checksummed and fast-commit journals cannot be replayed or extended here
+    if (journal->incompat & ~JBD2_FEATURE_INCOMPAT_SUPPORTED) {
+        terminal_write("Error: Unsupported journal features\n");
+        jbd2_free(journal);
+        return NULL;
+    }
+
+    journal->tag_bytes = (journal->incompat & JBD2_FEATURE_INCOMPAT_64BIT) ? 12 : 8;
+    journal->first = first;
+    journal->last = maxlen;
+    journal->sb_start = jbd2_get_be32(sb + JBD2_SB_START);
+    journal->max_transaction = (maxlen - first) / 4;
+
+    if (journal->max_transaction > JBD2_MAX_TRANSACTION_BLOCKS) {
+        journal->max_transaction = JBD2_MAX_TRANSACTION_BLOCKS;
+    }
+
+    if (journal->sb_start != 0 && (journal->sb_start < first || journal->sb_start >= maxlen)) {
+        terminal_write("Error: Invalid journal start\n");
+        jbd2_free(journal);
+        return NULL;
+    }
+
+    if (journal->sb_start != 0 && jbd2_recover(journal) != 0) {
+        jbd2_free(journal);
+        return NULL;
+    }
+
+    // New transactions follow the last one recorded in the log
+    journal->head = first;
+    journal->tail = first;
+    journal->running->tid = jbd2_get_be32(sb + JBD2_SB_SEQUENCE);
+    journal->committed_tid = journal->running->tid - 1;
+    journal->last_commit = ktime_get_ns();
+
+    jbd2_journals[slot] = journal;
+
+    return journal;
+}
+
+// Commit and checkpoint everything, then release the journal
+int jbd2_destroy(jbd2_journal_t* journal) {
+    if (!journal) {
+        return -1;
+    }
+
+    int result = 0;
+
+    if (journal->running->updates > 0) {
+        KLOG(&jbd2_log, KLOG_WARNING, "Releasing journal with %u open handles\n", journal->running->updates);
+    }
+
+    if (journal->failed || jbd2_commit_transaction(journal) != 0 || jbd2_do_checkpoint(journal) != 0) {
+        result = -1;
+    }
+
+    // Anything left belongs to a failed journal and is dropped
+    for (unsigned int i = 0; i < journal->running->nr_buffers; i++) {
+        page_cache_unpin(journal->running->buffers[i].page);
+    }
+
+    for (int i = 0; i < JBD2_MAX_JOURNALS; i++) {
+        if (jbd2_journals[i] == journal) {
+            jbd2_journals[i] = NULL;
+        }
+    }
+
+    jbd2_free(journal);
+
+    return result;
+}
+
+// Start an atomic update that changes at most credits metadata blocks
+//
+// Updates accumulate in the running transaction, which is committed when
+// full, when old enough, or when someone needs it on disk.
+int jbd2_start(jbd2_journal_t* journal, unsigned int credits, jbd2_handle_t* handle) {
+    if (!journal || !handle || journal->failed) {
+        return -1;
+    }
+
+    if (credits > journal->max_transaction) {
+        KLOG(&jbd2_log, KLOG_ERR, "Handle needs %u blocks, transactions hold %u\n", credits, journal->max_transaction);
+        return -1;
+    }
+
+    jbd2_transaction_t* transaction = journal->running;
+    unsigned int needed = transaction->nr_buffers + transaction->reserved + credits;
+
+    if (needed > journal->max_transaction && transaction->updates == 0) {
+        if (jbd2_commit_transaction(journal) != 0) {
+            return -1;
+        }
+    } else if (needed > 2 * journal->max_transaction || needed > JBD2_MAX_TRANSACTION_BLOCKS) {
+        // Nested handles may overrun the soft limit, as long as the commit still fits the log
+        KLOG(&jbd2_log, KLOG_ERR, "Transaction %u is full\n", transaction->tid);
+        return -1;
+    }
+
+    transaction->updates++;
+    transaction->reserved += credits;
+
+    handle->journal = journal;
+    handle->tid = transaction->tid;
+    handle->credits = credits;
+    journal->stats.handles++;
+
+    return 0;
+}
+
+// Get a metadata block for modification under a handle
+//
+// Returns a pointer to the block in the page cache. The block is pinned
+// until its transaction commits, so the pointer stays valid for the life
+// of the handle and changes made through it never reach the home location
+// before the journal copy.
+unsigned char* jbd2_get_write_access(jbd2_handle_t* handle, unsigned long long block) {
+    if (!handle || !handle->journal || handle->journal->failed) {
+        return NULL;
+    }
+
+    jbd2_journal_t* journal = handle->journal;
+    jbd2_transaction_t* transaction = journal->running;
+    unsigned long long offset = block * journal->block_size;
+    unsigned int page_offset = (unsigned int) (offset % PAGE_CACHE_PAGE_SIZE);
+
+    for (unsigned int i = 0; i < transaction->nr_buffers; i++) {
+        if (transaction->buffers[i].block == block) {
+            return (unsigned char*) transaction->buffers[i].page->data + page_offset;
+        }
+    }
+
+    if (handle->credits == 0 || transaction->nr_buffers >= JBD2_MAX_TRANSACTION_BLOCKS) {
+        KLOG(&jbd2_log, KLOG_ERR, "Handle has no credits left for block %llu\n", block);
+        return NULL;
+    }
+
+    page_t* page = page_cache_get_page(journal->cache, (unsigned int) (offset / PAGE_CACHE_PAGE_SIZE));
+
+    if (!page) {
+        return NULL;
+    }
+
+    page_cache_pin(page);
+
+    // A block journaled again is no longer revoked
+    for (unsigned int i = 0; i < transaction->nr_revokes; i++) {
+        if (transaction->revokes[i] == block) {
+            transaction->revokes[i] = transaction->revokes[--transaction->nr_revokes];
+            break;
+        }
+    }
+
+    if (transaction->nr_buffers == 0 && transaction->nr_revokes == 0) {
+        transaction->started = ktime_get_ns();
+    }
+
+    transaction->buffers[transaction->nr_buffers].block = block;
+    transaction->buffers[transaction->nr_buffers].page = page;
+    transaction->nr_buffers++;
+    transaction->reserved--;
+    handle->credits--;
+
+    return (unsigned char*) page->data + page_offset;
+}
+
+// Revoke a freed metadata block so recovery does not replay older copies
+// over whatever the block is used for next
+int jbd2_revoke(jbd2_handle_t* handle, unsigned long long block) {
+    if (!handle || !handle->journal || handle->journal->failed) {
+        return -1;
+    }
+
+    jbd2_journal_t* journal = handle->journal;
+    jbd2_transaction_t* transaction = journal->running;
+
+    // Changes to the block in this transaction no longer matter
+    for (unsigned int i = 0; i < transaction->nr_buffers; i++) {
+        if (transaction->buffers[i].block == block) {
+            page_cache_unpin(transaction->buffers[i].page);
+            transaction->buffers[i] = transaction->buffers[--transaction->nr_buffers];
+            break;
+        }
+    }
+
+    for (unsigned int i = 0; i < journal->nr_checkpoint; i++) {
+        if (journal->checkpoint[i].block == block) {
+            journal->checkpoint[i].log_block = 0;
+        }
+    }
+
+    for (unsigned int i = 0; i < transaction->nr_revokes; i++) {
+        if (transaction->revokes[i] == block) {
+            return 0;
+        }
+    }
+
+    if (transaction->nr_revokes >= JBD2_MAX_REVOKES) {
+        KLOG(&jbd2_log, KLOG_ERR, "Too many revoked blocks in transaction %u\n", transaction->tid);
+        return -1;
+    }
+
+    // Older journals may not have revoke records enabled yet
+    if (!(journal->incompat & JBD2_FEATURE_INCOMPAT_REVOKE)) {
+        journal->incompat |= JBD2_FEATURE_INCOMPAT_REVOKE;
+        jbd2_put_be32(journal->superblock + JBD2_HEADER_BLOCKTYPE, JBD2_SUPERBLOCK_V2);
+        jbd2_put_be32(journal->superblock + JBD2_SB_INCOMPAT, journal->incompat);
+
+        if (jbd2_write_superblock(journal, journal->sb_start, jbd2_get_be32(journal->superblock + JBD2_SB_SEQUENCE)) != 0) {
+            return -1;
+        }
+    }
+
+    if (transaction->nr_buffers == 0 && transaction->nr_revokes == 0) {
+        transaction->started = ktime_get_ns();
+    }
+
+    transaction->revokes[transaction->nr_revokes++] = block;
+
+    return 0;
+}
+
+// Have a file's dirty data written before the running transaction commits
+// (data=ordered), so committed metadata never points at stale blocks
+int jbd2_add_ordered(jbd2_handle_t* handle, page_mapping_t* mapping) {
+    if (!handle || !handle->journal || !mapping) {
+        return -1;
+    }
+
+    jbd2_transaction_t* transaction = handle->journal->running;
+
+    for (unsigned int i = 0; i < transaction->nr_ordered; i++) {
+        if (transaction->ordered[i] == mapping) {
+            return 0;
+        }
+    }
+
+    // Without room to defer it, the data is written now
+    if (transaction->nr_ordered >= JBD2_MAX_ORDERED) {
+        return page_cache_sync(mapping);
+    }
+
+    transaction->ordered[transaction->nr_ordered++] = mapping;
+
+    return 0;
+}
+
+// Finish an update started with jbd2_start()
+int jbd2_stop(jbd2_handle_t* handle) {
+    if (!handle || !handle->journal) {
+        return -1;
+    }
+
+    jbd2_journal_t* journal = handle->journal;
+    jbd2_transaction_t* transaction = journal->running;
+
+    transaction->reserved -= handle->credits;
+    transaction->updates--;
+    handle->journal = NULL;
+
+    if (journal->failed || transaction->updates > 0 || transaction->nr_buffers == 0) {
+        return journal->failed ? -1 : 0;
+    }
+
+    // Commit early once the transaction is nearly full or has been open long enough
+    if (transaction->nr_buffers >= journal->max_transaction * 3 / 4 ||
+        ktime_get_ns() - transaction->started >= JBD2_COMMIT_INTERVAL_NS) {
+        return jbd2_commit_transaction(journal);
+    }
+
+    return 0;
+}
+
+// Get the ID of the running transaction
+//
+// File systems record it when changing an inode, so a later fsync knows
+// which transaction has to be on disk.
+unsigned int jbd2_running_tid(jbd2_journal_t* journal) {
+    return journal ? journal->running->tid : 0;
+}
+
+// Make sure a transaction is on disk (used by fsync)
+//
+// This is the group commit: a commit covers every update made since the
+// previous one, so later requests for a transaction that has already
+// committed return at once without another journal write or flush.
+int jbd2_commit_tid(jbd2_journal_t* journal, unsigned int tid) {
+    if (!journal || journal->failed) {
+        return -1;
+    }
+
+    journal->stats.commit_requests++;
+
+    if (jbd2_tid_geq(journal->committed_tid, tid)) {
+        journal->stats.requests_batched++;
+        return 0;
+    }
+
+    return jbd2_commit(journal);
+}
+
+// Commit the running transaction now
+int jbd2_commit(jbd2_journal_t* journal) {
+    if (!journal || journal->failed) {
+        return -1;
+    }
+
+    if (journal->running->updates > 0) {
+        KLOG(&jbd2_log, KLOG_ERR, "Cannot commit transaction %u with open handles\n", journal->running->tid);
+        return -1;
+    }
+
+    return jbd2_commit_transaction(journal);
+}
+
+// Write all committed metadata home and empty the log
+int jbd2_checkpoint(jbd2_journal_t* journal) {
+    if (!journal || journal->failed) {
+        return -1;
+    }
+
+    return jbd2_do_checkpoint(journal);
+}
+
+// Run the journals' background work
+//
+// Called from the idle loop. Commits transactions that have been open for
+// JBD2_COMMIT_INTERVAL_NS, and checkpoints once half the log or most of the
+// checkpoint list is in use, or the journal has been idle for
+// JBD2_CHECKPOINT_INTERVAL_NS.
+void jbd2_background_run() {
+    unsigned long long now = ktime_get_ns();
+
+    for (int i = 0; i < JBD2_MAX_JOURNALS; i++) {
+        jbd2_journal_t* journal = jbd2_journals[i];
+
+        if (!journal || journal->failed || journal->running->updates > 0) {
+            continue;
+        }
+
+        jbd2_transaction_t* transaction = journal->running;
+
+        if ((transaction->nr_buffers > 0 || transaction->nr_revokes > 0) &&
+            now - transaction->started >= JBD2_COMMIT_INTERVAL_NS) {
+            jbd2_commit_transaction(journal);
+        }
+
+        if (journal->nr_checkpoint == 0) {
+            continue;
+        }
+
+        if (jbd2_log_used(journal) > (journal->last - journal->first) / 2 ||
+            journal->nr_checkpoint > JBD2_MAX_CHECKPOINT * 3 / 4 ||
+            now - journal->last_commit >= JBD2_CHECKPOINT_INTERVAL_NS) {
+            jbd2_do_checkpoint(journal);
+        }
+    }
+}
+
+// Get journal statistics
+void jbd2_get_stats(jbd2_journal_t* journal, jbd2_stats_t* stats) {
+    if (!journal || !stats) {
+        return;
+    }
+
+    *stats = journal->stats;
+    stats->log_used = jbd2_log_used(journal);
+    stats->log_size = journal->last - journal->first;
+}
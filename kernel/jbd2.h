@@ -0,0 +1,183 @@
+/**
+ * LightOS Kernel
+ * JBD2 journal header
+ */
+
+#ifndef JBD2_H
+#define JBD2_H
+
+#include "page_cache.h"
+#include "../drivers/storage.h"
+
+// Journal block header magic
+#define JBD2_MAGIC 0xC03B3998
+
+// Journal block types
+#define JBD2_DESCRIPTOR_BLOCK 1
+#define JBD2_COMMIT_BLOCK     2
+#define JBD2_SUPERBLOCK_V1    3
+#define JBD2_SUPERBLOCK_V2    4
+#define JBD2_REVOKE_BLOCK     5
+
+// Descriptor tag flags
+#define JBD2_FLAG_ESCAPE    1       // First word of the block was the magic
+#define JBD2_FLAG_SAME_UUID 2       // No UUID follows the tag
+#define JBD2_FLAG_DELETED   4
+#define JBD2_FLAG_LAST_TAG  8
+
+// Incompatible journal features
+#define JBD2_FEATURE_INCOMPAT_REVOKE       0x01
+#define JBD2_FEATURE_INCOMPAT_64BIT        0x02
+#define JBD2_FEATURE_INCOMPAT_ASYNC_COMMIT 0x04
+#define JBD2_FEATURE_INCOMPAT_CSUM_V2      0x08
+#define JBD2_FEATURE_INCOMPAT_CSUM_V3      0x10
+#define JBD2_FEATURE_INCOMPAT_FAST_COMMIT  0x20
+
+// Incompatible features this implementation understands
+#define JBD2_FEATURE_INCOMPAT_SUPPORTED (JBD2_FEATURE_INCOMPAT_REVOKE | \
+                                         JBD2_FEATURE_INCOMPAT_64BIT | \
+                                         JBD2_FEATURE_INCOMPAT_ASYNC_COMMIT)
+
+// Maximum number of extents the journal may be split into
+#define JBD2_MAX_EXTENTS 16
+
+// Maximum number of metadata blocks in one transaction
+#define JBD2_MAX_TRANSACTION_BLOCKS 256
+
+// Maximum number of revoked blocks in one transaction
+#define JBD2_MAX_REVOKES 256
+
+// Maximum number of mappings whose data a transaction orders before its commit
+#define JBD2_MAX_ORDERED 32
+
+// Maximum number of committed blocks awaiting checkpoint
+#define JBD2_MAX_CHECKPOINT 4096
+
+// Maximum number of revoke records recovery can track
+#define JBD2_MAX_RECOVERY_REVOKES 4096
+
+// Maximum number of loaded journals
+#define JBD2_MAX_JOURNALS 8
+
+// Age at which the running transaction is committed in the background
+#define JBD2_COMMIT_INTERVAL_NS 5000000000ULL
+
+// Idle time after which committed blocks are checkpointed in the background
+#define JBD2_CHECKPOINT_INTERVAL_NS 30000000000ULL
+
+// Map a journal block to a device block, as for a file (0 for a hole)
+//
+// On success *run is the number of blocks, starting at the given one, that
+// are physically contiguous.
+typedef int (*jbd2_bmap_t)(void* context, unsigned int logical, unsigned long long* physical, unsigned int* run);
+
+// Contiguous run of journal blocks on the device
+typedef struct {
+    unsigned int logical;
+    unsigned int length;
+    unsigned long long physical;
+} jbd2_extent_t;
+
+// Metadata block in the running transaction (its page is pinned)
+typedef struct {
+    unsigned long long block;
+    page_t* page;
+} jbd2_buffer_t;
+
+// Committed block whose home location may still be stale
+typedef struct {
+    unsigned long long block;
+    unsigned int log_block;         // Where its newest copy is in the log
+    unsigned int escaped;
+} jbd2_checkpoint_t;
+
+// Running transaction
+typedef struct {
+    unsigned int tid;
+    unsigned int updates;           // Open handles
+    unsigned int reserved;          // Credits held by open handles
+    unsigned long long started;     // When the first block was added
+    unsigned int nr_buffers;
+    jbd2_buffer_t buffers[JBD2_MAX_TRANSACTION_BLOCKS];
+    unsigned int nr_revokes;
+    unsigned long long revokes[JBD2_MAX_REVOKES];
+    unsigned int nr_ordered;
+    page_mapping_t* ordered[JBD2_MAX_ORDERED];
+} jbd2_transaction_t;
+
+// Memory blocks needed for a transaction
+#define JBD2_TRANSACTION_BLOCKS ((sizeof(jbd2_transaction_t) + MEMORY_BLOCK_SIZE - 1) / MEMORY_BLOCK_SIZE)
+
+// Memory blocks needed for the checkpoint list
+#define JBD2_CHECKPOINT_BLOCKS ((JBD2_MAX_CHECKPOINT * sizeof(jbd2_checkpoint_t) + MEMORY_BLOCK_SIZE - 1) / MEMORY_BLOCK_SIZE)
+
+// Journal statistics
+typedef struct {
+    unsigned long long handles;
+    unsigned long long commits;
+    unsigned long long blocks_logged;
+    unsigned long long commit_requests; // fsync and sync calls
+    unsigned long long requests_batched; // Requests an earlier commit already covered
+    unsigned long long checkpoints;
+    unsigned long long replayed;        // Blocks restored by recovery
+    unsigned int log_used;
+    unsigned int log_size;
+} jbd2_stats_t;
+
+// Journal state
+//
+// The log is the circular range [first, last) of journal blocks. Committed
+// transactions occupy [tail, head); the on-disk superblock only records a
+// start while that range is not empty.
+typedef struct jbd2_journal {
+    block_dev_t* dev;
+    page_mapping_t* cache;          // Cached view of the device holding the metadata
+    unsigned int block_size;
+    unsigned int sectors_per_block;
+    jbd2_extent_t extents[JBD2_MAX_EXTENTS];
+    unsigned int extent_count;
+
+    unsigned char* superblock;      // Copy of journal block 0
+    unsigned int incompat;
+    unsigned int tag_bytes;
+    unsigned int first;
+    unsigned int last;
+    unsigned int max_transaction;   // Blocks, including descriptors
+    unsigned int sb_start;          // Log start recorded on disk (0 = clean)
+
+    unsigned int head;              // Next log block to write
+    unsigned int tail;              // Oldest log block still needed
+    unsigned int committed_tid;
+    unsigned long long last_commit;
+    jbd2_transaction_t* running;
+    jbd2_checkpoint_t* checkpoint;
+    unsigned int nr_checkpoint;
+    unsigned char* buffer;          // Block-sized scratch buffers
+    unsigned char* data_buffer;
+    int failed;                     // Set after an I/O error aborts the journal
+    jbd2_stats_t stats;
+} jbd2_journal_t;
+
+// Reservation for one atomic metadata update
+typedef struct {
+    jbd2_journal_t* journal;
+    unsigned int tid;
+    unsigned int credits;           // Blocks it may still add
+} jbd2_handle_t;
+
+// Journal functions
+jbd2_journal_t* jbd2_load(block_dev_t* dev, page_mapping_t* cache, unsigned int block_size, jbd2_bmap_t bmap, void* context, unsigned int blocks);
+int jbd2_destroy(jbd2_journal_t* journal);
+int jbd2_start(jbd2_journal_t* journal, unsigned int credits, jbd2_handle_t* handle);
+unsigned char* jbd2_get_write_access(jbd2_handle_t* handle, unsigned long long block);
+int jbd2_revoke(jbd2_handle_t* handle, unsigned long long block);
+int jbd2_add_ordered(jbd2_handle_t* handle, page_mapping_t* mapping);
+int jbd2_stop(jbd2_handle_t* handle);
+unsigned int jbd2_running_tid(jbd2_journal_t* journal);
+int jbd2_commit_tid(jbd2_journal_t* journal, unsigned int tid);
+int jbd2_commit(jbd2_journal_t* journal);
+int jbd2_checkpoint(jbd2_journal_t* journal);
+void jbd2_background_run();
+void jbd2_get_stats(jbd2_journal_t* journal, jbd2_stats_t* stats);
+
+#endif /* JBD2_H */
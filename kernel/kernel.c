@@ -7,7 +7,15 @@
  */
 
 #include "kernel.h"
+#include "cpu.h"
+#include "io.h"
+#include "klog.h"
+#include "ktime.h"
+#include "jbd2.h"
+#include "page_cache.h"
 #include "../init/init.h"
+#include "../drivers/serial.h"
+#include "../libc/string.h"
 
 // Video memory address (standard VGA text mode)
 #define VIDEO_MEMORY 0xB8000
@@ -41,6 +49,22 @@ static int cursor_y = 0;
 // Current text color
 static unsigned char current_color = 0;
 
+// Shadow copy of the screen; all drawing goes here and is copied to video
+// memory by terminal_flush()
+static unsigned short terminal_buffer[VGA_WIDTH * VGA_HEIGHT];
+// One bit per screen line that differs from video memory
+static unsigned int terminal_dirty_lines = 0;
+
+#define TERMINAL_ALL_LINES ((1U << VGA_HEIGHT) - 1)
+
+// Primary console selected at build time (CONSOLE_VGA, CONSOLE_SERIAL or both)
+#ifndef KERNEL_CONSOLE
+#define KERNEL_CONSOLE CONSOLE_VGA
+#endif
+
+// Active console outputs; serial is added once the UART is up
+static unsigned int terminal_outputs = CONSOLE_VGA;
+
 // Create a VGA color byte from foreground and background colors
 static inline unsigned char vga_entry_color(enum vga_color fg, enum vga_color bg) {
     return fg | bg << 4;
@@ -51,23 +75,55 @@ static inline unsigned short vga_entry(unsigned char c, unsigned char color) {
     return (unsigned short) c | (unsigned short) color << 8;
 }
 
+// Move the hardware cursor to the current cursor position
+static void terminal_update_cursor() {
+    unsigned short position = (unsigned short) (cursor_y * VGA_WIDTH + cursor_x);
+
+    outb(0x3D4, 0x0F);
+    outb(0x3D5, (unsigned char) (position & 0xFF));
+    outb(0x3D4, 0x0E);
+    outb(0x3D5, (unsigned char) ((position >> 8) & 0xFF));
+}
+
+// Copy dirty lines from the shadow buffer to video memory
+void terminal_flush() {
+    if (!(terminal_outputs & CONSOLE_VGA)) {
+        return;
+    }
+
+    unsigned short* video_memory = (unsigned short*) VIDEO_MEMORY;
+
+    if (terminal_dirty_lines == TERMINAL_ALL_LINES) {
+        // Whole screen changed (scroll or clear): one bulk copy
+        memcpy(video_memory, terminal_buffer, sizeof(terminal_buffer));
+    } else {
+        for (int y = 0; terminal_dirty_lines && y < VGA_HEIGHT; y++) {
+            if (terminal_dirty_lines & (1U << y)) {
+                memcpy(&video_memory[y * VGA_WIDTH], &terminal_buffer[y * VGA_WIDTH], VGA_WIDTH * sizeof(unsigned short));
+            }
+        }
+    }
+
+    terminal_dirty_lines = 0;
+    terminal_update_cursor();
+}
+
 // Initialize the terminal
 void terminal_initialize() {
     // Set default color (light grey on black)
     current_color = vga_entry_color(VGA_COLOR_LIGHT_GREY, VGA_COLOR_BLACK);
 
     // Clear the screen
-    unsigned short* video_memory = (unsigned short*) VIDEO_MEMORY;
-    for (int y = 0; y < VGA_HEIGHT; y++) {
-        for (int x = 0; x < VGA_WIDTH; x++) {
-            const int index = y * VGA_WIDTH + x;
-            video_memory[index] = vga_entry(' ', current_color);
-        }
+    for (int i = 0; i < VGA_WIDTH * VGA_HEIGHT; i++) {
+        terminal_buffer[i] = vga_entry(' ', current_color);
     }
 
     // Reset cursor position
     cursor_x = 0;
     cursor_y = 0;
+
+    terminal_dirty_lines = TERMINAL_ALL_LINES;
+    terminal_flush();
 }
 
 // Set the text color
@@ -75,35 +131,29 @@ void terminal_set_color(enum vga_color fg, enum vga_color bg) {
     current_color = vga_entry_color(fg, bg);
 }
 
-// Put a character at a specific position
+// Put a character at a specific position (buffered until the next flush)
 void terminal_put_char_at(char c, unsigned char color, int x, int y) {
     const int index = y * VGA_WIDTH + x;
-    unsigned short* video_memory = (unsigned short*) VIDEO_MEMORY;
-    video_memory[index] = vga_entry(c, color);
+    terminal_buffer[index] = vga_entry(c, color);
+    terminal_dirty_lines |= 1U << y;
 }
 
 // Scroll the terminal up one line
 void terminal_scroll() {
-    unsigned short* video_memory = (unsigned short*) VIDEO_MEMORY;
-
-    // Move each line up one position
-    for (int y = 0; y < VGA_HEIGHT - 1; y++) {
-        for (int x = 0; x < VGA_WIDTH; x++) {
-            const int current_index = y * VGA_WIDTH + x;
-            const int next_index = (y + 1) * VGA_WIDTH + x;
-            video_memory[current_index] = video_memory[next_index];
-        }
-    }
+    // Move all lines up in a single bulk move
+    memmove(terminal_buffer, &terminal_buffer[VGA_WIDTH], (VGA_HEIGHT - 1) * VGA_WIDTH * sizeof(unsigned short));
 
     // Clear the last line
     for (int x = 0; x < VGA_WIDTH; x++) {
         const int index = (VGA_HEIGHT - 1) * VGA_WIDTH + x;
-        video_memory[index] = vga_entry(' ', current_color);
+        terminal_buffer[index] = vga_entry(' ', current_color);
     }
+
+    terminal_dirty_lines = TERMINAL_ALL_LINES;
 }
 
-// Put a character at the current cursor position
-void terminal_put_char(char c) {
+// Put a character into the shadow buffer without flushing
+static void terminal_emit_char(char c) {
     // Handle special characters
     if (c == '\n') {
         cursor_x = 0;
@@ -113,7 +163,7 @@ void terminal_put_char(char c) {
     } else if (c == '\t') {
         // Tab is 4 spaces
         for (int i = 0; i < 4; i++) {
-            terminal_put_char(' ');
+            terminal_emit_char(' ');
         }
     } else {
         // Regular character
@@ -134,11 +184,33 @@ void terminal_put_char(char c) {
     }
 }
 
+// Put a character at the current cursor position
+void terminal_put_char(char c) {
+    if (terminal_outputs & CONSOLE_SERIAL) {
+        serial_put_char(c);
+    }
+
+    if (terminal_outputs & CONSOLE_VGA) {
+        terminal_emit_char(c);
+        terminal_flush();
+    }
+}
+
 // Write a string to the terminal
 void terminal_write(const char* data) {
+    if (terminal_outputs & CONSOLE_SERIAL) {
+        serial_write(data);
+    }
+
+    if (!(terminal_outputs & CONSOLE_VGA)) {
+        return;
+    }
+
     for (int i = 0; data[i] != '\0'; i++) {
-        terminal_put_char(data[i]);
+        terminal_emit_char(data[i]);
     }
+
+    terminal_flush();
 }
 
 // Write a string with a specific color
@@ -151,14 +223,67 @@ void terminal_write_color(const char* data, enum vga_color fg, enum vga_color bg
 
 // Clear the terminal
 void terminal_clear() {
+    if (terminal_outputs & CONSOLE_SERIAL) {
+        // ANSI clear screen and home cursor
+        serial_write("\033[2J\033[H");
+    }
+
     terminal_initialize();
 }
 
+// Select the console outputs
+void terminal_set_outputs(unsigned int outputs) {
+    if (!serial_is_present()) {
+        outputs &= ~CONSOLE_SERIAL;
+    }
+
+    // Never end up without a console
+    if (!outputs) {
+        outputs = CONSOLE_VGA;
+    }
+
+    if ((outputs & CONSOLE_VGA) && !(terminal_outputs & CONSOLE_VGA)) {
+        // The shadow buffer was not kept up to date while VGA was off
+        terminal_outputs = outputs;
+        terminal_initialize();
+        return;
+    }
+
+    terminal_outputs = outputs;
+}
+
+// Get the active console outputs
+unsigned int terminal_get_outputs() {
+    return terminal_outputs;
+}
+
+// Run deferred kernel work; called whenever the CPU is waiting for input
+void kernel_idle() {
+    // Commit old journal transactions, then let the page cache flusher
+    // write back old dirty data
+    jbd2_background_run();
+    page_cache_flusher_run();
+}
+
 // Main kernel function
 void kernel_main() {
     // Initialize terminal
     terminal_initialize();
 
+    // Bring up the serial console and switch to the configured outputs
+    if (serial_init(SERIAL_COM1, SERIAL_DEFAULT_BAUD) == 0) {
+        terminal_set_outputs(KERNEL_CONSOLE);
+    }
+
+    // Initialize the kernel log
+    klog_init();
+
+    // Give the boot CPU its index
+    cpu_init();
+
+    // Calibrate the clocksource and read the RTC
+    ktime_init();
+
     // Display welcome message
     terminal_write_color("LightOS Kernel\n", VGA_COLOR_LIGHT_GREEN, VGA_COLOR_BLACK);
     terminal_write_color("----------------\n", VGA_COLOR_LIGHT_GREEN, VGA_COLOR_BLACK);
@@ -176,5 +301,6 @@ void kernel_main() {
     // Enter kernel main loop as a fallback
     while (1) {
         // This is where we would handle interrupts, schedule processes, etc.
+        kernel_idle();
     }
 }
@@ -26,6 +26,10 @@ enum vga_color {
     VGA_COLOR_WHITE,
 };
 
+// Console outputs
+#define CONSOLE_VGA    0x01
+#define CONSOLE_SERIAL 0x02
+
 // Terminal functions
 void terminal_initialize();
 void terminal_set_color(enum vga_color fg, enum vga_color bg);
@@ -34,8 +38,14 @@ void terminal_put_char(char c);
 void terminal_write(const char* data);
 void terminal_write_color(const char* data, enum vga_color fg, enum vga_color bg);
 void terminal_clear();
+void terminal_flush();
+void terminal_set_outputs(unsigned int outputs);
+unsigned int terminal_get_outputs();
 
 // Kernel main function
 void kernel_main();
 
+// Background work (journal commits, writeback) run while the kernel waits
+void kernel_idle();
+
 #endif /* KERNEL_H */
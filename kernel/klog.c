@@ -0,0 +1,476 @@
+/**
+ * LightOS Kernel
+ * Kernel log ring buffer implementation
+ *
+ * Producers reserve a slot with an atomic increment of the head sequence,
+ * fill it, and publish it by storing the sequence number last. Readers copy
+ * a record and re-check its sequence number, so a record overwritten while
+ * being read is detected and skipped instead of returning torn data. When
+ * the ring is full the oldest records are overwritten.
+ */
+
+#include "klog.h"
+#include "kernel.h"
+#include "ktime.h"
+#include "../libc/string.h"
+
+#define KLOG_RING_MASK (KLOG_RING_SIZE - 1)
+
+// Marker stored in a slot while it is being written
+#define KLOG_SEQ_BUSY 0xFFFFFFFFFFFFFFFFULL
+
+// Record ring
+static klog_record_t klog_ring[KLOG_RING_SIZE];
+
+// Next sequence number to be handed out
+static unsigned long long klog_head = 0;
+
+// Oldest sequence number still of interest (advanced by klog_clear)
+static unsigned long long klog_tail = 0;
+
+// Records at or below this level are stored in the ring
+volatile klog_level_t klog_record_level = KLOG_DEBUG;
+
+// Records at or below this level are also echoed to the console
+volatile klog_level_t klog_console_level = KLOG_NOTICE;
+
+// Subsystem used for records logged without one
+static klog_subsystem_t klog_kernel_subsystem = { "kernel", 0, 0, 0, 0, 0 };
+
+// Level names
+static const char* klog_level_names[] = {
+    "emerg", "alert", "crit", "err", "warning", "notice", "info", "debug"
+};
+
+// Initialize the kernel log
+void klog_init() {
+    for (int i = 0; i < KLOG_RING_SIZE; i++) {
+        klog_ring[i].seq = KLOG_SEQ_BUSY;
+    }
+
+    klog_head = 0;
+    klog_tail = 0;
+    klog_record_level = KLOG_DEBUG;
+    klog_console_level = KLOG_NOTICE;
+}
+
+// Check the subsystem rate limit; returns 1 if the record may be logged
+static int klog_ratelimit(klog_subsystem_t* subsys, unsigned long long now, unsigned int* suppressed) {
+    *suppressed = 0;
+
+    if (subsys->burst == 0) {
+        return 1; // Not rate limited
+    }
+
+    if (now - subsys->window_start >= subsys->interval) {
+        // New window: report what was dropped in the previous one
+        *suppressed = subsys->suppressed;
+        subsys->window_start = now;
+        subsys->printed = 0;
+        subsys->suppressed = 0;
+    }
+
+    if (__atomic_fetch_add(&subsys->printed, 1, __ATOMIC_RELAXED) < subsys->burst) {
+        return 1;
+    }
+
+    __atomic_fetch_add(&subsys->suppressed, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Copy a %s argument into a record's string area; returns its offset
+static unsigned int klog_copy_string(char* strings, unsigned int* used, const char* str) {
+    if (!str) {
+        str = "(null)";
+    }
+
+    // Once the area is full, later strings share its final terminator
+    if (*used >= KLOG_STRING_SIZE) {
+        return KLOG_STRING_SIZE - 1;
+    }
+
+    unsigned int offset = *used;
+
+    while (*str && *used < KLOG_STRING_SIZE - 1) {
+        strings[(*used)++] = *str++;
+    }
+
+    strings[(*used)++] = '\0';
+    return offset;
+}
+
+// Reserve, fill and publish one record
+static void klog_store(const char* subsystem, klog_level_t level, unsigned long long timestamp, const char* fmt, const unsigned long long* args, int arg_count, const char* strings, unsigned int strings_size) {
+    unsigned long long seq = __atomic_fetch_add(&klog_head, 1, __ATOMIC_RELAXED);
+    klog_record_t* record = &klog_ring[seq & KLOG_RING_MASK];
+
+    __atomic_store_n(&record->seq, KLOG_SEQ_BUSY, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    record->timestamp = timestamp;
+    record->subsystem = subsystem;
+    record->fmt = fmt;
+    record->level = level;
+
+    for (int i = 0; i < KLOG_MAX_ARGS; i++) {
+        record->args[i] = i < arg_count ? args[i] : 0;
+    }
+
+    memcpy(record->strings, strings, strings_size);
+
+    __atomic_store_n(&record->seq, seq, __ATOMIC_RELEASE);
+}
+
+// Echo a record to the console
+static void klog_echo(const klog_record_t* record) {
+    char line[KLOG_LINE_SIZE];
+
+    klog_format(record, line, sizeof(line));
+
+    if (record->level <= KLOG_ERR) {
+        terminal_write_color(line, VGA_COLOR_LIGHT_RED, VGA_COLOR_BLACK);
+    } else if (record->level == KLOG_WARNING) {
+        terminal_write_color(line, VGA_COLOR_LIGHT_BROWN, VGA_COLOR_BLACK);
+    } else {
+        terminal_write(line);
+    }
+}
+
+// Log a record
+void klog(klog_subsystem_t* subsys, klog_level_t level, const char* fmt, ...) {
+    if (!fmt || level > klog_record_level) {
+        return;
+    }
+
+    if (!subsys) {
+        subsys = &klog_kernel_subsystem;
+    }
+
+    unsigned long long now = ktime_get_ns();
+    unsigned int suppressed = 0;
+
+    if (!klog_ratelimit(subsys, now, &suppressed)) {
+        return;
+    }
+
+    if (suppressed) {
+        unsigned long long count = suppressed;
+        klog_store(subsys->name, KLOG_WARNING, now, "%u messages suppressed\n", &count, 1, "", 1);
+    }
+
+    // Capture the raw arguments; only the conversion types are inspected.
+    // Strings are copied, since the caller may free them before the record
+    // is read.
+    unsigned long long args[KLOG_MAX_ARGS];
+    char strings[KLOG_STRING_SIZE];
+    unsigned int strings_used = 0;
+    strings[0] = '\0';
+    int arg_count = 0;
+    __builtin_va_list ap;
+    __builtin_va_start(ap, fmt);
+
+    for (const char* p = fmt; *p && arg_count < KLOG_MAX_ARGS; p++) {
+        if (*p != '%') {
+            continue;
+        }
+
+        p++;
+
+        int is_long = 0;
+        while (*p == 'l') {
+            is_long = 1;
+            p++;
+        }
+
+        if (*p == 's') {
+            args[arg_count++] = klog_copy_string(strings, &strings_used, __builtin_va_arg(ap, const char*));
+        } else if (*p == 'p') {
+            args[arg_count++] = (unsigned long long) (unsigned long) __builtin_va_arg(ap, const void*);
+        } else if (*p == 'd' || *p == 'u' || *p == 'x' || *p == 'c') {
+            if (is_long) {
+                args[arg_count++] = __builtin_va_arg(ap, unsigned long long);
+            } else if (*p == 'd') {
+                args[arg_count++] = (unsigned long long) (long long) __builtin_va_arg(ap, int);
+            } else {
+                args[arg_count++] = __builtin_va_arg(ap, unsigned int);
+            }
+        } else if (*p == '\0') {
+            break;
+        }
+    }
+
+    __builtin_va_end(ap);
+
+    // Copy at least the terminator an unused string area starts with
+    unsigned int strings_size = strings_used > 0 ? strings_used : 1;
+    klog_store(subsys->name, level, now, fmt, args, arg_count, strings, strings_size);
+
+    if (level <= klog_console_level) {
+        klog_record_t record;
+        record.seq = 0;
+        record.timestamp = now;
+        record.subsystem = subsys->name;
+        record.fmt = fmt;
+        record.level = level;
+        memcpy(record.args, args, sizeof(args));
+        memcpy(record.strings, strings, strings_size);
+        klog_echo(&record);
+    }
+}
+
+// Read the record with the given sequence number (or the next surviving
+// one); returns 1 and advances *seq on success, 0 if there is nothing newer
+int klog_read(unsigned long long* seq, klog_record_t* record) {
+    if (!seq || !record) {
+        return 0;
+    }
+
+    while (1) {
+        unsigned long long head = __atomic_load_n(&klog_head, __ATOMIC_ACQUIRE);
+
+        // Skip records that were cleared or already overwritten
+        if (*seq < klog_tail) {
+            *seq = klog_tail;
+        }
+
+        if (head > KLOG_RING_SIZE && *seq < head - KLOG_RING_SIZE) {
+            *seq = head - KLOG_RING_SIZE;
+        }
+
+        if (*seq >= head) {
+            return 0;
+        }
+
+        klog_record_t* slot = &klog_ring[*seq & KLOG_RING_MASK];
+        unsigned long long before = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+        if (before == *seq) {
+            memcpy(record, slot, sizeof(klog_record_t));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+            if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == before) {
+                (*seq)++;
+                return 1;
+            }
+        } else if (before == KLOG_SEQ_BUSY || before < *seq) {
+            // Still being written; report it on the next call
+            return 0;
+        }
+
+        // Overwritten by a newer record; move on
+        (*seq)++;
+    }
+}
+
+// Get the oldest sequence number available to readers
+unsigned long long klog_first_seq() {
+    unsigned long long head = __atomic_load_n(&klog_head, __ATOMIC_ACQUIRE);
+    unsigned long long first = head > KLOG_RING_SIZE ? head - KLOG_RING_SIZE : 0;
+    return first > klog_tail ? first : klog_tail;
+}
+
+// Get the sequence number the next record will receive
+unsigned long long klog_next_seq() {
+    return __atomic_load_n(&klog_head, __ATOMIC_ACQUIRE);
+}
+
+// Discard all records logged so far
+void klog_clear() {
+    klog_tail = __atomic_load_n(&klog_head, __ATOMIC_ACQUIRE);
+}
+
+// Append a string to a bounded buffer
+static unsigned int klog_append(char* buffer, unsigned int size, unsigned int pos, const char* str) {
+    while (*str && pos + 1 < size) {
+        buffer[pos++] = *str++;
+    }
+
+    return pos;
+}
+
+// Append an unsigned number in the given base
+static unsigned int klog_append_number(char* buffer, unsigned int size, unsigned int pos, unsigned long long value, unsigned int base, unsigned int min_digits) {
+    char digits[24];
+    unsigned int count = 0;
+
+    do {
+        unsigned int digit = value % base;
+        digits[count++] = digit < 10 ? '0' + digit : 'a' + digit - 10;
+        value /= base;
+    } while (value > 0 && count < sizeof(digits));
+
+    while (count < min_digits && count < sizeof(digits)) {
+        digits[count++] = '0';
+    }
+
+    while (count > 0 && pos + 1 < size) {
+        buffer[pos++] = digits[--count];
+    }
+
+    return pos;
+}
+
+// Format a record's message (without timestamp or subsystem)
+unsigned int klog_format(const klog_record_t* record, char* buffer, unsigned int size) {
+    if (!record || !buffer || size == 0) {
+        return 0;
+    }
+
+    unsigned int pos = 0;
+    int arg = 0;
+
+    for (const char* p = record->fmt; *p && pos + 1 < size; p++) {
+        if (*p != '%') {
+            buffer[pos++] = *p;
+            continue;
+        }
+
+        p++;
+
+        int is_long = 0;
+        while (*p == 'l') {
+            is_long = 1;
+            p++;
+        }
+
+        unsigned long long value = arg < KLOG_MAX_ARGS ? record->args[arg] : 0;
+
+        switch (*p) {
+            case 's':
+                pos = klog_append(buffer, size, pos, value < KLOG_STRING_SIZE ? record->strings + value : "");
+                arg++;
+                break;
+
+            case 'd':
+                if ((long long) value < 0) {
+                    pos = klog_append(buffer, size, pos, "-");
+                    value = (unsigned long long) -(long long) value;
+                }
+                pos = klog_append_number(buffer, size, pos, value, 10, 1);
+                arg++;
+                break;
+
+            case 'u':
+                pos = klog_append_number(buffer, size, pos, is_long ? value : (unsigned int) value, 10, 1);
+                arg++;
+                break;
+
+            case 'x':
+                pos = klog_append_number(buffer, size, pos, is_long ? value : (unsigned int) value, 16, 1);
+                arg++;
+                break;
+
+            case 'p':
+                pos = klog_append(buffer, size, pos, "0x");
+                pos = klog_append_number(buffer, size, pos, value, 16, 1);
+                arg++;
+                break;
+
+            case 'c':
+                buffer[pos++] = (char) value;
+                arg++;
+                break;
+
+            case '%':
+                buffer[pos++] = '%';
+                break;
+
+            case '\0':
+                p--;
+                break;
+
+            default:
+                buffer[pos++] = '%';
+                if (pos + 1 < size) {
+                    buffer[pos++] = *p;
+                }
+                break;
+        }
+    }
+
+    buffer[pos] = '\0';
+    return pos;
+}
+
+// Format a record as a dmesg line: "[timestamp] subsystem: message"
+unsigned int klog_format_line(const klog_record_t* record, char* buffer, unsigned int size) {
+    if (!record || !buffer || size == 0) {
+        return 0;
+    }
+
+    unsigned int pos = 0;
+    pos = klog_append(buffer, size, pos, "[");
+    pos = klog_append_number(buffer, size, pos, record->timestamp / NSEC_PER_SEC, 10, 1);
+    pos = klog_append(buffer, size, pos, ".");
+    pos = klog_append_number(buffer, size, pos, (record->timestamp % NSEC_PER_SEC) / NSEC_PER_USEC, 10, 6);
+    pos = klog_append(buffer, size, pos, "] ");
+
+    if (record->subsystem) {
+        pos = klog_append(buffer, size, pos, record->subsystem);
+        pos = klog_append(buffer, size, pos, ": ");
+    }
+
+    pos += klog_format(record, buffer + pos, size - pos);
+
+    // Keep one record per line even if the message has no newline
+    if (pos > 0 && buffer[pos - 1] != '\n' && pos + 1 < size) {
+        buffer[pos++] = '\n';
+        buffer[pos] = '\0';
+    }
+
+    return pos;
+}
+
+// Set the console echo threshold
+void klog_set_console_level(klog_level_t level) {
+    klog_console_level = level;
+}
+
+// Set the recording threshold
+void klog_set_record_level(klog_level_t level) {
+    klog_record_level = level;
+}
+
+// Get the name of a level
+const char* klog_level_name(klog_level_t level) {
+    if ((unsigned int) level > KLOG_DEBUG) {
+        return "unknown";
+    }
+
+    return klog_level_names[level];
+}
+
+// Parse a level name or number; returns -1 if invalid
+int klog_parse_level(const char* name) {
+    if (!name || !*name) {
+        return -1;
+    }
+
+    if (name[0] >= '0' && name[0] <= '7' && name[1] == '\0') {
+        return name[0] - '0';
+    }
+
+    for (int i = 0; i <= KLOG_DEBUG; i++) {
+        if (strcmp(klog_level_names[i], name) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// Print all records at or below a level to the terminal
+void klog_dump(klog_level_t max_level) {
+    char line[KLOG_LINE_SIZE];
+    klog_record_t record;
+    unsigned long long seq = klog_first_seq();
+
+    while (klog_read(&seq, &record)) {
+        if (record.level > max_level) {
+            continue;
+        }
+
+        klog_format_line(&record, line, sizeof(line));
+        terminal_write(line);
+    }
+}
@@ -0,0 +1,95 @@
+/**
+ * LightOS Kernel
+ * Kernel log ring buffer header
+ */
+
+#ifndef KLOG_H
+#define KLOG_H
+
+// Log levels (lower is more severe)
+typedef enum {
+    KLOG_EMERG,
+    KLOG_ALERT,
+    KLOG_CRIT,
+    KLOG_ERR,
+    KLOG_WARNING,
+    KLOG_NOTICE,
+    KLOG_INFO,
+    KLOG_DEBUG
+} klog_level_t;
+
+// Ring buffer size (number of records, must be a power of two)
+#define KLOG_RING_SIZE 1024
+
+// Maximum number of arguments stored per record
+#define KLOG_MAX_ARGS 6
+
+// Maximum length of a formatted record
+#define KLOG_LINE_SIZE 256
+
+// Bytes per record for copies of %s arguments (longer strings are truncated)
+#define KLOG_STRING_SIZE 96
+
+// Default per-subsystem rate limit: burst records per interval (ns)
+#define KLOG_RATELIMIT_BURST 64
+#define KLOG_RATELIMIT_INTERVAL 5000000000ULL
+
+// Log record structure
+//
+// Records hold the unformatted format string and raw arguments; formatting
+// happens only when the record is read (dmesg) or echoed to the console.
+// Format strings are stored by pointer and must be literals. %s arguments
+// are copied into the record's string area when logged, and their argument
+// slot holds the copy's offset.
+typedef struct {
+    unsigned long long seq;             // Sequence number (commit marker)
+    unsigned long long timestamp;       // Nanoseconds since boot (ktime_get_ns)
+    const char* subsystem;
+    const char* fmt;
+    unsigned long long args[KLOG_MAX_ARGS];
+    klog_level_t level;
+    char strings[KLOG_STRING_SIZE];
+} klog_record_t;
+
+// Per-subsystem state (rate limiting)
+typedef struct {
+    const char* name;
+    unsigned int burst;
+    unsigned long long interval;        // Same units as record timestamps
+    unsigned long long window_start;
+    unsigned int printed;
+    unsigned int suppressed;
+} klog_subsystem_t;
+
+// Define a subsystem with the default rate limit
+#define KLOG_SUBSYSTEM(var, name) \
+    static klog_subsystem_t var = { name, KLOG_RATELIMIT_BURST, KLOG_RATELIMIT_INTERVAL, 0, 0, 0 }
+
+// Log only if the level is recorded; arguments are not evaluated otherwise
+#define KLOG(subsys, level, ...) \
+    do { \
+        if ((level) <= klog_record_level) { \
+            klog(subsys, level, __VA_ARGS__); \
+        } \
+    } while (0)
+
+// Current thresholds (read inline by KLOG)
+extern volatile klog_level_t klog_record_level;
+extern volatile klog_level_t klog_console_level;
+
+// Kernel log functions
+void klog_init();
+void klog(klog_subsystem_t* subsys, klog_level_t level, const char* fmt, ...);
+int klog_read(unsigned long long* seq, klog_record_t* record);
+unsigned long long klog_first_seq();
+unsigned long long klog_next_seq();
+void klog_clear();
+unsigned int klog_format(const klog_record_t* record, char* buffer, unsigned int size);
+unsigned int klog_format_line(const klog_record_t* record, char* buffer, unsigned int size);
+void klog_set_console_level(klog_level_t level);
+void klog_set_record_level(klog_level_t level);
+const char* klog_level_name(klog_level_t level);
+int klog_parse_level(const char* name);
+void klog_dump(klog_level_t max_level);
+
+#endif /* KLOG_H */
@@ -0,0 +1,383 @@
+/**
+ * LightOS Kernel
+ * Kernel time implementation
+ *
+ * The preferred clocksource is the invariant TSC, calibrated at boot
+ * against PIT channel 2. CPUs without an invariant TSC fall back to
+ * PIT channel 2 running free as a 16-bit down counter, which is extended
+ * to 64 bits on every read. The wall clock is the CMOS RTC time read at
+ * boot plus the monotonic time since then.
+ */
+
+#include "ktime.h"
+#include "kernel.h"
+#include "io.h"
+#include "klog.h"
+
+// PIT ports
+#define PIT_CHANNEL2 0x42
+#define PIT_COMMAND  0x43
+#define PIT_GATE     0x61
+
+// CMOS ports and RTC registers
+#define CMOS_ADDRESS 0x70
+#define CMOS_DATA    0x71
+#define RTC_SECONDS  0x00
+#define RTC_MINUTES  0x02
+#define RTC_HOURS    0x04
+#define RTC_DAY      0x07
+#define RTC_MONTH    0x08
+#define RTC_YEAR     0x09
+#define RTC_STATUS_A 0x0A
+#define RTC_STATUS_B 0x0B
+#define RTC_CENTURY  0x32
+
+// TSC calibration: count down 10 ms on the PIT, keep the fastest of a few runs
+#define KTIME_CALIBRATE_LATCH (KTIME_PIT_FREQUENCY / 100)
+#define KTIME_CALIBRATE_RUNS  3
+#define KTIME_CALIBRATE_LOOPS 10000000
+
+// Conversion precision
+#define KTIME_SHIFT 32
+
+// Clocksource state
+ktime_clocksource_t ktime_clock = { KTIME_SOURCE_NONE, 0, 0, 0, KTIME_SHIFT, 0 };
+
+// PIT fallback state
+static unsigned int ktime_pit_last = 0;
+static unsigned long long ktime_pit_ticks = 0;
+
+KLOG_SUBSYSTEM(time_log, "time");
+
+// Execute CPUID
+static inline void ktime_cpuid(unsigned int leaf, unsigned int* a, unsigned int* b, unsigned int* c, unsigned int* d) {
+    __asm__ __volatile__("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "a"(leaf), "c"(0));
+}
+
+// Check if the TSC runs at a constant rate in all power states
+static int ktime_has_invariant_tsc() {
+    unsigned int a, b, c, d;
+
+    ktime_cpuid(0x80000000, &a, &b, &c, &d);
+
+    if (a < 0x80000007) {
+        return 0;
+    }
+
+    ktime_cpuid(0x80000007, &a, &b, &c, &d);
+    return (d >> 8) & 1;
+}
+
+// Measure the TSC frequency against the PIT; returns 0 on failure
+static unsigned long long ktime_calibrate_tsc() {
+    unsigned long long best = 0;
+
+    for (int run = 0; run < KTIME_CALIBRATE_RUNS; run++) {
+        // Gate channel 2 on with the speaker off, one-shot countdown (mode 0)
+        outb(PIT_GATE, (inb(PIT_GATE) & ~0x02) | 0x01);
+        outb(PIT_COMMAND, 0xB0);
+        outb(PIT_CHANNEL2, KTIME_CALIBRATE_LATCH & 0xFF);
+        outb(PIT_CHANNEL2, (KTIME_CALIBRATE_LATCH >> 8) & 0xFF);
+
+        unsigned long long start = ktime_read_tsc();
+        unsigned int loops = 0;
+
+        // Wait for the channel 2 output to go high
+        while (!(inb(PIT_GATE) & 0x20)) {
+            if (++loops >= KTIME_CALIBRATE_LOOPS) {
+                return 0;
+            }
+        }
+
+        unsigned long long cycles = ktime_read_tsc() - start;
+
+        if (best == 0 || cycles < best) {
+            best = cycles;
+        }
+    }
+
+    return best * KTIME_PIT_FREQUENCY / KTIME_CALIBRATE_LATCH;
+}
+
+// Set up the conversion factors for a counter frequency
+static void ktime_set_frequency(unsigned long long frequency) {
+    ktime_clock.frequency = frequency;
+    ktime_clock.shift = KTIME_SHIFT;
+    ktime_clock.mult = (NSEC_PER_SEC << KTIME_SHIFT) / frequency;
+}
+
+// Start PIT channel 2 as a free-running counter (mode 2, full 16-bit range)
+static void ktime_pit_start() {
+    outb(PIT_GATE, (inb(PIT_GATE) & ~0x02) | 0x01);
+    outb(PIT_COMMAND, 0xB4);
+    outb(PIT_CHANNEL2, 0);
+    outb(PIT_CHANNEL2, 0);
+
+    ktime_pit_last = 0;
+    ktime_pit_ticks = 0;
+}
+
+// Read the PIT-based fallback clock
+//
+// The counter wraps every 55 ms, so it must be read at least that often
+// for the time to stay correct.
+unsigned long long ktime_pit_get_ns() {
+    if (ktime_clock.source != KTIME_SOURCE_PIT) {
+        return 0;
+    }
+
+    // Latch and read the channel 2 count
+    outb(PIT_COMMAND, 0x80);
+    unsigned int count = inb(PIT_CHANNEL2);
+    count |= (unsigned int) inb(PIT_CHANNEL2) << 8;
+
+    // The counter counts down
+    ktime_pit_ticks += (ktime_pit_last - count) & 0xFFFF;
+    ktime_pit_last = count;
+
+    return (unsigned long long) (((unsigned __int128) ktime_pit_ticks * ktime_clock.mult) >> ktime_clock.shift);
+}
+
+// Read a CMOS register
+static unsigned char ktime_cmos_read(unsigned char reg) {
+    outb(CMOS_ADDRESS, reg);
+    return inb(CMOS_DATA);
+}
+
+// Convert a BCD value to binary
+static unsigned int ktime_bcd_to_binary(unsigned char value) {
+    return (value & 0x0F) + (value >> 4) * 10;
+}
+
+// Read the raw RTC registers once the RTC is not updating
+static void ktime_read_rtc_raw(unsigned char* regs) {
+    unsigned int loops = 0;
+
+    while ((ktime_cmos_read(RTC_STATUS_A) & 0x80) && ++loops < KTIME_CALIBRATE_LOOPS) {
+        // Update in progress
+    }
+
+    regs[0] = ktime_cmos_read(RTC_SECONDS);
+    regs[1] = ktime_cmos_read(RTC_MINUTES);
+    regs[2] = ktime_cmos_read(RTC_HOURS);
+    regs[3] = ktime_cmos_read(RTC_DAY);
+    regs[4] = ktime_cmos_read(RTC_MONTH);
+    regs[5] = ktime_cmos_read(RTC_YEAR);
+    regs[6] = ktime_cmos_read(RTC_CENTURY);
+}
+
+// Read the date and time from the CMOS real-time clock
+int ktime_read_rtc(rtc_time_t* time) {
+    if (!time) {
+        return -1;
+    }
+
+    unsigned char regs[7];
+    unsigned char check[7];
+    int stable = 0;
+
+    // Read until two consecutive reads agree
+    ktime_read_rtc_raw(regs);
+
+    for (int attempt = 0; attempt < 5 && !stable; attempt++) {
+        ktime_read_rtc_raw(check);
+        stable = 1;
+
+        for (int i = 0; i < 7; i++) {
+            if (regs[i] != check[i]) {
+                stable = 0;
+            }
+
+            regs[i] = check[i];
+        }
+    }
+
+    unsigned char status_b = ktime_cmos_read(RTC_STATUS_B);
+    unsigned int pm = regs[2] & 0x80;
+    regs[2] &= 0x7F;
+
+    unsigned int values[7];
+
+    for (int i = 0; i < 7; i++) {
+        values[i] = (status_b & 0x04) ? regs[i] : ktime_bcd_to_binary(regs[i]);
+    }
+
+    // Convert 12-hour mode to 24-hour mode
+    if (!(status_b & 0x02)) {
+        if (values[2] == 12) {
+            values[2] = 0;
+        }
+
+        if (pm) {
+            values[2] += 12;
+        }
+    }
+
+    // The century register is not always implemented
+    unsigned int century = values[6];
+
+    if (century < 19 || century > 30) {
+        century = 20;
+    }
+
+    time->second = values[0];
+    time->minute = values[1];
+    time->hour = values[2];
+    time->day = values[3];
+    time->month = values[4];
+    time->year = century * 100 + values[5];
+
+    if (time->month < 1 || time->month > 12 || time->day < 1 || time->day > 31 ||
+        time->hour > 23 || time->minute > 59 || time->second > 59) {
+        return -1;
+    }
+
+    return 0;
+}
+
+// Convert a date to nanoseconds since 1970-01-01 00:00:00 UTC
+unsigned long long ktime_from_date(const rtc_time_t* time) {
+    if (!time || time->year < 1970) {
+        return 0;
+    }
+
+    // Days since the epoch (proleptic Gregorian calendar, March-based years)
+    long long year = time->year - (time->month <= 2);
+    long long era = year / 400;
+    long long year_of_era = year - era * 400;
+    long long month = time->month;
+    long long day_of_year = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + time->day - 1;
+    long long day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    long long days = era * 146097 + day_of_era - 719468;
+
+    unsigned long long seconds = (unsigned long long) days * 86400 + time->hour * 3600 + time->minute * 60 + time->second;
+    return seconds * NSEC_PER_SEC;
+}
+
+// Convert nanoseconds since 1970-01-01 00:00:00 UTC to a date
+void ktime_to_date(unsigned long long real_ns, rtc_time_t* time) {
+    if (!time) {
+        return;
+    }
+
+    unsigned long long seconds = real_ns / NSEC_PER_SEC;
+    unsigned long long days = seconds / 86400;
+    unsigned long long rest = seconds % 86400;
+
+    time->hour = rest / 3600;
+    time->minute = (rest / 60) % 60;
+    time->second = rest % 60;
+
+    // Inverse of the conversion in ktime_from_date
+    unsigned long long shifted = days + 719468;
+    unsigned long long era = shifted / 146097;
+    unsigned long long day_of_era = shifted - era * 146097;
+    unsigned long long year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+    unsigned long long day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+    unsigned long long month_index = (5 * day_of_year + 2) / 153;
+
+    time->day = day_of_year - (153 * month_index + 2) / 5 + 1;
+    time->month = month_index < 10 ? month_index + 3 : month_index - 9;
+    time->year = year_of_era + era * 400 + (time->month <= 2);
+}
+
+// Append a zero-padded number
+static unsigned int ktime_append_number(char* buffer, unsigned int size, unsigned int pos, unsigned int value, unsigned int digits) {
+    char temp[10];
+
+    for (unsigned int i = 0; i < digits; i++) {
+        temp[digits - 1 - i] = '0' + value % 10;
+        value /= 10;
+    }
+
+    for (unsigned int i = 0; i < digits && pos + 1 < size; i++) {
+        buffer[pos++] = temp[i];
+    }
+
+    return pos;
+}
+
+// Append a separator character
+static unsigned int ktime_append_char(char* buffer, unsigned int size, unsigned int pos, char c) {
+    if (pos + 1 < size) {
+        buffer[pos++] = c;
+    }
+
+    return pos;
+}
+
+// Format a date as "YYYY-MM-DD HH:MM:SS"
+unsigned int ktime_format_date(const rtc_time_t* time, char* buffer, unsigned int size) {
+    if (!time || !buffer || size == 0) {
+        return 0;
+    }
+
+    unsigned int pos = 0;
+    pos = ktime_append_number(buffer, size, pos, time->year, 4);
+    pos = ktime_append_char(buffer, size, pos, '-');
+    pos = ktime_append_number(buffer, size, pos, time->month, 2);
+    pos = ktime_append_char(buffer, size, pos, '-');
+    pos = ktime_append_number(buffer, size, pos, time->day, 2);
+    pos = ktime_append_char(buffer, size, pos, ' ');
+    pos = ktime_append_number(buffer, size, pos, time->hour, 2);
+    pos = ktime_append_char(buffer, size, pos, ':');
+    pos = ktime_append_number(buffer, size, pos, time->minute, 2);
+    pos = ktime_append_char(buffer, size, pos, ':');
+    pos = ktime_append_number(buffer, size, pos, time->second, 2);
+    buffer[pos] = '\0';
+
+    return pos;
+}
+
+// Format the current wall clock time as "YYYY-MM-DD HH:MM:SS"
+unsigned int ktime_format_now(char* buffer, unsigned int size) {
+    rtc_time_t time;
+    ktime_to_date(ktime_get_real(), &time);
+    return ktime_format_date(&time, buffer, size);
+}
+
+// Get the name of the active clocksource
+const char* ktime_source_name() {
+    switch (ktime_clock.source) {
+        case KTIME_SOURCE_TSC:
+            return "tsc";
+        case KTIME_SOURCE_PIT:
+            return "pit";
+        default:
+            return "none";
+    }
+}
+
+// Initialize kernel time
+void ktime_init() {
+    ktime_clock.source = KTIME_SOURCE_NONE;
+    ktime_clock.boot_real_ns = 0;
+
+    if (ktime_has_invariant_tsc()) {
+        unsigned long long frequency = ktime_calibrate_tsc();
+
+        if (frequency > 0) {
+            ktime_set_frequency(frequency);
+            ktime_clock.base_cycles = ktime_read_tsc();
+            ktime_clock.source = KTIME_SOURCE_TSC;
+        }
+    }
+
+    if (ktime_clock.source == KTIME_SOURCE_NONE) {
+        ktime_set_frequency(KTIME_PIT_FREQUENCY);
+        ktime_pit_start();
+        ktime_clock.source = KTIME_SOURCE_PIT;
+    }
+
+    KLOG(&time_log, KLOG_INFO, "Clocksource %s, %u kHz\n", ktime_source_name(),
+         (unsigned int) (ktime_clock.frequency / 1000));
+
+    // Anchor the wall clock to the RTC
+    rtc_time_t now;
+
+    if (ktime_read_rtc(&now) == 0) {
+        ktime_clock.boot_real_ns = ktime_from_date(&now) - ktime_get_ns();
+    } else {
+        KLOG(&time_log, KLOG_WARNING, "Invalid RTC time, wall clock starts at 1970\n");
+    }
+}
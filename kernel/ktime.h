@@ -0,0 +1,83 @@
+/**
+ * LightOS Kernel
+ * Kernel time (clocksource, monotonic and wall clock time) header
+ */
+
+#ifndef KTIME_H
+#define KTIME_H
+
+// Time unit conversions
+#define NSEC_PER_USEC 1000ULL
+#define NSEC_PER_MSEC 1000000ULL
+#define NSEC_PER_SEC  1000000000ULL
+
+// PIT input clock frequency (Hz)
+#define KTIME_PIT_FREQUENCY 1193182
+
+// Clock sources
+typedef enum {
+    KTIME_SOURCE_NONE,
+    KTIME_SOURCE_TSC,
+    KTIME_SOURCE_PIT
+} ktime_source_t;
+
+// Calendar date and time (UTC)
+typedef struct {
+    unsigned int year;
+    unsigned int month;
+    unsigned int day;
+    unsigned int hour;
+    unsigned int minute;
+    unsigned int second;
+} rtc_time_t;
+
+// Clocksource state
+//
+// Cycles are converted with ns = (cycles * mult) >> shift, so a reading
+// costs one counter read and one multiply.
+typedef struct {
+    ktime_source_t source;
+    unsigned long long frequency;       // Counter frequency (Hz)
+    unsigned long long base_cycles;     // Counter value at boot
+    unsigned long long mult;
+    unsigned int shift;
+    unsigned long long boot_real_ns;    // Wall clock time at boot (ns since 1970)
+} ktime_clocksource_t;
+
+extern ktime_clocksource_t ktime_clock;
+
+// Read the time stamp counter
+static inline unsigned long long ktime_read_tsc() {
+    unsigned int low, high;
+    __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high));
+    return ((unsigned long long) high << 32) | low;
+}
+
+// Read the PIT-based fallback clock (ns since boot)
+unsigned long long ktime_pit_get_ns();
+
+// Get monotonic time since boot in nanoseconds
+static inline unsigned long long ktime_get_ns() {
+    if (ktime_clock.source == KTIME_SOURCE_TSC) {
+        unsigned long long delta = ktime_read_tsc() - ktime_clock.base_cycles;
+        return (unsigned long long) (((unsigned __int128) delta * ktime_clock.mult) >> ktime_clock.shift);
+    }
+
+    return ktime_pit_get_ns();
+}
+
+// Get wall clock time in nanoseconds since 1970-01-01 00:00:00 UTC
+static inline unsigned long long ktime_get_real() {
+    return ktime_clock.boot_real_ns + ktime_get_ns();
+}
+
+// Kernel time functions
+void ktime_init();
+const char* ktime_source_name();
+int ktime_read_rtc(rtc_time_t* time);
+unsigned long long ktime_from_date(const rtc_time_t* time);
+void ktime_to_date(unsigned long long real_ns, rtc_time_t* time);
+unsigned int ktime_format_date(const rtc_time_t* time, char* buffer, unsigned int size);
+unsigned int ktime_format_now(char* buffer, unsigned int size);
+
+#endif /* KTIME_H */
@@ -19,6 +19,13 @@ static unsigned int* physical_memory_bitmap = 0;
 static unsigned int total_memory_blocks = 0;
 static unsigned int used_memory_blocks = 0;
 
+// Caches that can give memory back when an allocation fails
+static memory_shrinker_t shrinkers[MEMORY_MAX_SHRINKERS];
+static int shrinker_count = 0;
+
+// Nesting depth of sections that must not reclaim (shrinkers included)
+static unsigned int noreclaim_depth = 0;
+
 // Initialize memory management
 void memory_init(unsigned int memory_size) {
     // Calculate the number of blocks needed to represent all memory
@@ -113,6 +120,11 @@ int find_free_blocks(unsigned int count) {
 void* allocate_block() {
     int block = find_first_free_block();
     
+    // Out of memory: let the caches give some back and try again
+    if (block == -1 && memory_shrink(1) > 0) {
+        block = find_first_free_block();
+    }
+    
     if (block == -1) {
         return 0; // Out of memory
     }
@@ -126,6 +138,10 @@ void* allocate_block() {
 void* allocate_blocks(unsigned int count) {
     int starting_block = find_free_blocks(count);
     
+    if (starting_block == -1 && memory_shrink(count) > 0) {
+        starting_block = find_free_blocks(count);
+    }
+    
     if (starting_block == -1) {
         return 0; // Not enough contiguous memory
     }
@@ -137,6 +153,27 @@ void* allocate_blocks(unsigned int count) {
     return (void*) (starting_block * MEMORY_BLOCK_SIZE);
 }
 
+// Allocate a block without reclaiming from the caches
+//
+// For the caches themselves, and for code called back by them, whose
+// state a shrinker could change underneath them.
+void* allocate_block_noreclaim() {
+    memory_noreclaim_begin();
+    void* block = allocate_block();
+    memory_noreclaim_end();
+    
+    return block;
+}
+
+// Allocate contiguous blocks without reclaiming from the caches
+void* allocate_blocks_noreclaim(unsigned int count) {
+    memory_noreclaim_begin();
+    void* blocks = allocate_blocks(count);
+    memory_noreclaim_end();
+    
+    return blocks;
+}
+
 // Free a block of memory
 void free_block(void* address) {
     unsigned int block = ((unsigned int) address) / MEMORY_BLOCK_SIZE;
@@ -159,3 +196,65 @@ void memory_stats(unsigned int* total, unsigned int* used, unsigned int* free) {
     if (used) *used = used_memory_blocks * MEMORY_BLOCK_SIZE;
     if (free) *free = (total_memory_blocks - used_memory_blocks) * MEMORY_BLOCK_SIZE;
 }
+
+// Register a cache shrinker
+int memory_register_shrinker(memory_shrinker_t shrinker) {
+    for (int i = 0; i < shrinker_count; i++) {
+        if (shrinkers[i] == shrinker) {
+            return 0;
+        }
+    }
+    
+    if (!shrinker || shrinker_count >= MEMORY_MAX_SHRINKERS) {
+        return -1;
+    }
+    
+    shrinkers[shrinker_count++] = shrinker;
+    
+    return 0;
+}
+
+// Ask the registered caches to give back count memory blocks
+//
+// Returns the number of blocks that came back, counted from the bitmap
+// rather than taken from the shrinkers. Does nothing inside a no-reclaim
+// section, which shrinkers run in themselves.
+unsigned int memory_shrink(unsigned int count) {
+    if (noreclaim_depth > 0) {
+        return 0;
+    }
+    
+    memory_noreclaim_begin();
+    
+    unsigned int freed = 0;
+    
+    for (int i = 0; i < shrinker_count && freed < count; i++) {
+        unsigned int used = used_memory_blocks;
+        
+        shrinkers[i](count - freed);
+        
+        if (used_memory_blocks < used) {
+            freed += used - used_memory_blocks;
+        }
+    }
+    
+    memory_noreclaim_end();
+    
+    return freed;
+}
+
+// Start a section in which allocations do not reclaim from the caches
+//
+// Sections nest. The page cache runs file system writeback in one, so a
+// file system short of memory is never called back into from its own
+// allocation.
+void memory_noreclaim_begin() {
+    noreclaim_depth++;
+}
+
+// End a section started by memory_noreclaim_begin
+void memory_noreclaim_end() {
+    if (noreclaim_depth > 0) {
+        noreclaim_depth--;
+    }
+}
@@ -11,6 +11,16 @@
 #define MEMORY_BITMAP_ADDRESS 0x100000  // 1MB (temporary location)
 #define MEMORY_RESERVED_END 0x200000    // 2MB (reserved for kernel, etc.)
 
+// Maximum number of registered shrinkers
+#define MEMORY_MAX_SHRINKERS 8
+
+// Cache reclaim callback: gives back up to count memory blocks and returns
+// how many it gave back
+//
+// Shrinkers run from inside whatever allocation ran short, so they may only
+// drop clean objects nobody is using: no writeback, and no I/O.
+typedef unsigned int (*memory_shrinker_t)(unsigned int count);
+
 // Memory management functions
 void memory_init(unsigned int memory_size);
 void set_block(unsigned int block);
@@ -20,8 +30,14 @@ int find_first_free_block();
 int find_free_blocks(unsigned int count);
 void* allocate_block();
 void* allocate_blocks(unsigned int count);
+void* allocate_block_noreclaim();
+void* allocate_blocks_noreclaim(unsigned int count);
 void free_block(void* address);
 void free_blocks(void* address, unsigned int count);
 void memory_stats(unsigned int* total, unsigned int* used, unsigned int* free);
+int memory_register_shrinker(memory_shrinker_t shrinker);
+unsigned int memory_shrink(unsigned int count);
+void memory_noreclaim_begin();
+void memory_noreclaim_end();
 
 #endif /* MEMORY_H */
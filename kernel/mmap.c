@@ -0,0 +1,258 @@
+/**
+ * LightOS Kernel
+ * Memory-mapped file implementation
+ *
+ * The kernel runs without paging, so nothing traps on the first access to
+ * a mapped page. mmap_fault() is the fault path: it populates the page on
+ * first use and hands back a pointer into the page itself, with no copy.
+ * Shared mappings point straight at page cache pages, so every process
+ * mapping a file sees the same memory and written pages go back to the
+ * file through the page cache. Private mappings share the cached pages
+ * until the first write to each one, which copies it.
+ */
+
+#include "mmap.h"
+#include "kernel.h"
+#include "klog.h"
+#include "memory.h"
+#include "../libc/string.h"
+
+KLOG_SUBSYSTEM(mmap_log, "mmap");
+
+// All mappings (unused slots have no mapping)
+static vm_area_t areas[MMAP_MAX_AREAS];
+
+// Get the page cache page in a slot
+static page_t* mmap_slot_page(unsigned long slot) {
+    return (page_t*) (slot & ~(unsigned long) MMAP_SLOT_FLAGS);
+}
+
+// Get the memory a populated slot maps
+static unsigned char* mmap_slot_data(unsigned long slot) {
+    if (slot & MMAP_SLOT_PRIVATE) {
+        return (unsigned char*) (slot & ~(unsigned long) MMAP_SLOT_FLAGS);
+    }
+
+    return (unsigned char*) mmap_slot_page(slot)->data;
+}
+
+// Mark shared pages written through an area dirty again
+//
+// The page cache may have written a page back and cleaned it while the
+// mapping kept changing it, so every written page is dirtied once more.
+static void mmap_redirty(vm_area_t* area) {
+    for (unsigned int i = 0; i < area->nr_pages; i++) {
+        unsigned long slot = area->slots[i];
+
+        if ((slot & MMAP_SLOT_WRITTEN) && !(slot & MMAP_SLOT_PRIVATE)) {
+            page_cache_mark_dirty(mmap_slot_page(slot));
+            area->slots[i] = slot & ~(unsigned long) MMAP_SLOT_WRITTEN;
+        }
+    }
+}
+
+// Map part of a cached file
+//
+// The area takes over the caller's reference to the mapping. The offset
+// must be page aligned.
+vm_area_t* mmap_create(page_mapping_t* mapping, unsigned long long offset, unsigned int length, unsigned int prot, unsigned int flags) {
+    if (!mapping || length == 0 || offset % PAGE_CACHE_PAGE_SIZE != 0) {
+        return NULL;
+    }
+
+    if (flags != MAP_SHARED && flags != MAP_PRIVATE) {
+        return NULL;
+    }
+
+    vm_area_t* area = NULL;
+
+    for (int i = 0; i < MMAP_MAX_AREAS; i++) {
+        if (!areas[i].mapping) {
+            area = &areas[i];
+            break;
+        }
+    }
+
+    if (!area) {
+        KLOG(&mmap_log, KLOG_WARNING, "Maximum number of mappings reached\n");
+        return NULL;
+    }
+
+    unsigned int nr_pages = (unsigned int) (((unsigned long long) length + PAGE_CACHE_PAGE_SIZE - 1) / PAGE_CACHE_PAGE_SIZE);
+    unsigned int slot_blocks = (nr_pages * sizeof(unsigned long) + MEMORY_BLOCK_SIZE - 1) / MEMORY_BLOCK_SIZE;
+    unsigned long* slots = (unsigned long*) allocate_blocks(slot_blocks);
+
+    if (!slots) {
+        return NULL;
+    }
+
+    memset(slots, 0, slot_blocks * MEMORY_BLOCK_SIZE);
+
+    process_t* process = process_current();
+
+    area->pid = process ? process->pid : 0;
+    area->mapping = mapping;
+    area->offset = offset;
+    area->length = length;
+    area->prot = prot;
+    area->flags = flags;
+    area->nr_pages = nr_pages;
+    area->slots = slots;
+    area->slot_blocks = slot_blocks;
+
+    return area;
+}
+
+// Resolve an access to a mapping, faulting the page in if needed
+//
+// Returns a pointer to the byte at the given offset into the area. It stays
+// valid, for the rest of its page, until the area is unmapped or (for a
+// read of a private mapping) until the page is first written. Returns NULL
+// where a page fault would be fatal: past the end of the area or the file,
+// or on a write to a mapping without PROT_WRITE.
+void* mmap_fault(vm_area_t* area, unsigned int offset, int write) {
+    if (!area || !area->mapping || offset >= area->length) {
+        return NULL;
+    }
+
+    if (write ? !(area->prot & PROT_WRITE) : !(area->prot & (PROT_READ | PROT_WRITE))) {
+        return NULL;
+    }
+
+    unsigned int page_number = offset / PAGE_CACHE_PAGE_SIZE;
+    unsigned long slot = area->slots[page_number];
+
+    if (!slot) {
+        unsigned long long position = area->offset + (unsigned long long) page_number * PAGE_CACHE_PAGE_SIZE;
+
+        if (position >= area->mapping->size) {
+            return NULL;
+        }
+
+        page_t* page = page_cache_get_page(area->mapping, (unsigned int) (position / PAGE_CACHE_PAGE_SIZE));
+
+        if (!page) {
+            return NULL;
+        }
+
+        page->mapcount++;
+        slot = (unsigned long) page;
+    }
+
+    if (write && (area->flags & MAP_PRIVATE) && !(slot & MMAP_SLOT_PRIVATE)) {
+        // Copy on write: the cached page stays as the file has it
+        page_t* page = mmap_slot_page(slot);
+        void* copy = allocate_block();
+
+        if (!copy) {
+            area->slots[page_number] = slot;
+            return NULL;
+        }
+
+        memcpy(copy, page->data, PAGE_CACHE_PAGE_SIZE);
+        page->mapcount--;
+        slot = (unsigned long) copy | MMAP_SLOT_PRIVATE;
+    } else if (write && (area->flags & MAP_SHARED)) {
+        page_cache_mark_dirty(mmap_slot_page(slot));
+        slot |= MMAP_SLOT_WRITTEN;
+    }
+
+    area->slots[page_number] = slot;
+
+    return mmap_slot_data(slot) + offset % PAGE_CACHE_PAGE_SIZE;
+}
+
+// Map an open file
+vm_area_t* fs_mmap(file_descriptor_t* fd, unsigned int length, unsigned int prot, unsigned int flags, unsigned long long offset) {
+    if (!fd || !fd->node || !fd->node->get_mapping) {
+        return NULL;
+    }
+
+    // Reading needs a readable file, and writing back a writable one
+    if (!(fd->flags & O_RDONLY)) {
+        return NULL;
+    }
+
+    if ((flags & MAP_SHARED) && (prot & PROT_WRITE) && !(fd->flags & O_WRONLY)) {
+        return NULL;
+    }
+
+    page_mapping_t* mapping = fd->node->get_mapping(fd->node);
+
+    if (!mapping) {
+        return NULL;
+    }
+
+    vm_area_t* area = mmap_create(mapping, offset, length, prot, flags);
+
+    if (!area) {
+        page_cache_release_mapping(mapping);
+    }
+
+    return area;
+}
+
+// Write back everything written through a shared mapping
+int fs_msync(vm_area_t* area) {
+    if (!area || !area->mapping) {
+        return -1;
+    }
+
+    if (!(area->flags & MAP_SHARED)) {
+        return 0;
+    }
+
+    mmap_redirty(area);
+
+    return page_cache_sync(area->mapping);
+}
+
+// Unmap an area
+//
+// Written shared pages are left dirty for the flusher; use fs_msync() first
+// to wait for them.
+int fs_munmap(vm_area_t* area) {
+    if (!area || !area->mapping) {
+        return -1;
+    }
+
+    if (area->flags & MAP_SHARED) {
+        mmap_redirty(area);
+    }
+
+    for (unsigned int i = 0; i < area->nr_pages; i++) {
+        unsigned long slot = area->slots[i];
+
+        if (slot & MMAP_SLOT_PRIVATE) {
+            free_block(mmap_slot_data(slot));
+        } else if (slot) {
+            mmap_slot_page(slot)->mapcount--;
+        }
+    }
+
+    free_blocks(area->slots, area->slot_blocks);
+    page_cache_release_mapping(area->mapping);
+    memset(area, 0, sizeof(vm_area_t));
+
+    return 0;
+}
+
+// Unmap everything a terminating process mapped
+void mmap_release_process(pid_t pid) {
+    for (int i = 0; i < MMAP_MAX_AREAS; i++) {
+        if (areas[i].mapping && areas[i].pid == pid) {
+            fs_munmap(&areas[i]);
+        }
+    }
+}
+
+// Check if any file of an owner (a mounted file system) is mapped
+int mmap_owner_busy(void* owner) {
+    for (int i = 0; i < MMAP_MAX_AREAS; i++) {
+        if (areas[i].mapping && areas[i].mapping->owner == owner) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,56 @@
+/**
+ * LightOS Kernel
+ * Memory-mapped file header
+ */
+
+#ifndef MMAP_H
+#define MMAP_H
+
+#include "filesystem.h"
+#include "page_cache.h"
+#include "process.h"
+
+// Protection flags
+#define PROT_READ  0x01
+#define PROT_WRITE 0x02
+
+// Mapping flags (exactly one must be given)
+#define MAP_SHARED  0x01             // Writes go to the file through the page cache
+#define MAP_PRIVATE 0x02             // Writes go to private copies of the pages
+
+// Maximum number of mappings in the system
+#define MMAP_MAX_AREAS 64
+
+// Page slot states, kept in the low bits of the slot
+#define MMAP_SLOT_PRIVATE 0x1        // Slot holds a private copy instead of a page_t
+#define MMAP_SLOT_WRITTEN 0x2        // Shared page written through the mapping
+#define MMAP_SLOT_FLAGS   0x3
+
+// Mapped range of a file
+//
+// Each page of the range has a slot that is empty until the first access
+// faults the page in. A slot then points at the page cache page, which
+// stays cached while mapped, or (after a write to a private mapping) at a
+// private copy of it.
+typedef struct vm_area {
+    pid_t pid;                       // Owning process
+    page_mapping_t* mapping;         // Referenced while the area exists
+    unsigned long long offset;       // File offset of the first page
+    unsigned int length;
+    unsigned int prot;
+    unsigned int flags;
+    unsigned int nr_pages;
+    unsigned long* slots;
+    unsigned int slot_blocks;
+} vm_area_t;
+
+// Memory mapping functions
+vm_area_t* mmap_create(page_mapping_t* mapping, unsigned long long offset, unsigned int length, unsigned int prot, unsigned int flags);
+void* mmap_fault(vm_area_t* area, unsigned int offset, int write);
+vm_area_t* fs_mmap(file_descriptor_t* fd, unsigned int length, unsigned int prot, unsigned int flags, unsigned long long offset);
+int fs_msync(vm_area_t* area);
+int fs_munmap(vm_area_t* area);
+void mmap_release_process(pid_t pid);
+int mmap_owner_busy(void* owner);
+
+#endif /* MMAP_H */
@@ -0,0 +1,1190 @@
+/**
+ * LightOS Kernel
+ * Page cache implementation
+ *
+ * File and block device data is cached in page-sized memory blocks. Each
+ * mapping indexes its pages with a radix tree (64-way nodes carved out of
+ * memory blocks), so a lookup costs one pointer chase per 6 bits of page
+ * offset. All cached pages sit on one CLOCK list: an access sets the
+ * referenced bit, and the eviction hand gives referenced pages a second
+ * chance, and leaves dirty pages for a second sweep. Eviction runs when
+ * the cache is full or free memory falls below the low watermark. The
+ * memory shrinker, called from other allocations, only takes clean pages.
+ * The cache's own allocations and the file system callbacks it makes run
+ * without reclaim, so a shrinker never changes the cache mid-operation.
+ *
+ * Writes only dirty pages. The flusher, run from the idle loop, writes back
+ * mappings whose dirty data has expired, and the oldest mappings while
+ * dirty pages exceed the background threshold. A writer that pushes dirty
+ * pages past the limit writes back old data itself before returning. Each
+ * mapping is written back in page order under one storage plug, so the
+ * request queues can merge the writes.
+ */
+
+#include "page_cache.h"
+#include "kernel.h"
+#include "klog.h"
+#include "ktime.h"
+#include "../libc/string.h"
+#include "../drivers/storage.h"
+
+// Radix tree geometry
+#define RADIX_SHIFT 6
+#define RADIX_SLOTS (1 << RADIX_SHIFT)
+#define RADIX_MASK (RADIX_SLOTS - 1)
+#define RADIX_MAX_HEIGHT 6      // 36 bits, covers any 32-bit page index
+
+// Mapping hash buckets (must be a power of two)
+#define PAGE_CACHE_MAPPING_BUCKETS 128
+
+// Radix tree node structure
+typedef struct radix_node {
+    void* slots[RADIX_SLOTS];
+    struct radix_node* parent;
+    unsigned int offset;        // Slot index in the parent
+    unsigned int count;         // Number of used slots
+} radix_node_t;
+
+// Page descriptors
+static page_t pages[PAGE_CACHE_MAX_PAGES];
+static page_t* free_pages = NULL;
+
+// CLOCK list of cached pages and the eviction hand
+static page_t* clock_hand = NULL;
+
+// Mappings
+static page_mapping_t mappings[PAGE_CACHE_MAX_MAPPINGS];
+static page_mapping_t* free_mappings = NULL;
+static page_mapping_t* mapping_buckets[PAGE_CACHE_MAPPING_BUCKETS];
+
+// Free radix tree nodes
+static radix_node_t* free_nodes = NULL;
+
+// Mappings with dirty pages, oldest first
+static page_mapping_t* dirty_mappings_head = NULL;
+static page_mapping_t* dirty_mappings_tail = NULL;
+
+// Flusher state: a run is due at the interval or when requested early
+static unsigned long long page_cache_flusher_last = 0;
+static int page_cache_flusher_wanted = 0;
+
+// Set while dirty data is being written back, so writeback triggered by a
+// writepage callback does not start another
+static int page_cache_flushing = 0;
+
+// Set while a page is written back, so the device write is not mistaken
+// for a direct write that makes the cached copy stale
+static int page_cache_writing_back = 0;
+
+// Statistics
+static page_cache_stats_t page_cache_stats;
+
+KLOG_SUBSYSTEM(page_cache_log, "pagecache");
+
+// Allocate a zeroed radix tree node
+static radix_node_t* radix_node_alloc() {
+    if (!free_nodes) {
+        // Carve a memory block into nodes
+        unsigned char* block = (unsigned char*) allocate_block_noreclaim();
+
+        if (!block) {
+            return NULL;
+        }
+
+        for (unsigned int i = 0; i + sizeof(radix_node_t) <= MEMORY_BLOCK_SIZE; i += sizeof(radix_node_t)) {
+            radix_node_t* node = (radix_node_t*) (block + i);
+            node->parent = free_nodes;
+            free_nodes = node;
+        }
+    }
+
+    radix_node_t* node = free_nodes;
+    free_nodes = node->parent;
+    memset(node, 0, sizeof(radix_node_t));
+
+    return node;
+}
+
+// Return a radix tree node to the free list
+static void radix_node_free(radix_node_t* node) {
+    node->parent = free_nodes;
+    free_nodes = node;
+}
+
+// Look up a page in a mapping's radix tree
+static page_t* radix_lookup(page_mapping_t* mapping, unsigned int index) {
+    radix_node_t* node = mapping->root;
+    unsigned int height = mapping->height;
+
+    if (!node || ((unsigned long long) index >> (RADIX_SHIFT * height)) != 0) {
+        return NULL;
+    }
+
+    while (height > 1) {
+        height--;
+        node = (radix_node_t*) node->slots[(index >> (RADIX_SHIFT * height)) & RADIX_MASK];
+
+        if (!node) {
+            return NULL;
+        }
+    }
+
+    return (page_t*) node->slots[index & RADIX_MASK];
+}
+
+// Find the first page at or after *index, updating *index to its position
+static page_t* radix_next(page_mapping_t* mapping, unsigned long long* index) {
+    unsigned long long position = *index;
+
+    while (mapping->root && (position >> (RADIX_SHIFT * mapping->height)) == 0) {
+        radix_node_t* node = mapping->root;
+        unsigned int height = mapping->height;
+
+        while (node) {
+            unsigned int shift = RADIX_SHIFT * (height - 1);
+            unsigned int start = (position >> shift) & RADIX_MASK;
+            unsigned int slot = start;
+
+            while (slot < RADIX_SLOTS && !node->slots[slot]) {
+                slot++;
+            }
+
+            if (slot == RADIX_SLOTS) {
+                // Nothing left under this node; retry from the next one
+                position = ((position >> (shift + RADIX_SHIFT)) + 1) << (shift + RADIX_SHIFT);
+                break;
+            }
+
+            if (slot != start) {
+                position = (position & ~((1ULL << (shift + RADIX_SHIFT)) - 1)) | ((unsigned long long) slot << shift);
+            }
+
+            if (height == 1) {
+                *index = position;
+                return (page_t*) node->slots[slot];
+            }
+
+            node = (radix_node_t*) node->slots[slot];
+            height--;
+        }
+    }
+
+    return NULL;
+}
+
+// Insert a page into a mapping's radix tree
+static int radix_insert(page_mapping_t* mapping, unsigned int index, page_t* page) {
+    if (!mapping->root) {
+        mapping->root = radix_node_alloc();
+
+        if (!mapping->root) {
+            return -1;
+        }
+
+        mapping->height = 1;
+    }
+
+    // Add levels on top until the index fits
+    while (mapping->height < RADIX_MAX_HEIGHT && ((unsigned long long) index >> (RADIX_SHIFT * mapping->height)) != 0) {
+        radix_node_t* root = radix_node_alloc();
+
+        if (!root) {
+            return -1;
+        }
+
+        root->slots[0] = mapping->root;
+        root->count = 1;
+        mapping->root->parent = root;
+        mapping->root->offset = 0;
+        mapping->root = root;
+        mapping->height++;
+    }
+
+    radix_node_t* node = mapping->root;
+
+    for (unsigned int height = mapping->height; height > 1; height--) {
+        unsigned int slot = (index >> (RADIX_SHIFT * (height - 1))) & RADIX_MASK;
+
+        if (!node->slots[slot]) {
+            radix_node_t* child = radix_node_alloc();
+
+            if (!child) {
+                return -1;
+            }
+
+            child->parent = node;
+            child->offset = slot;
+            node->slots[slot] = child;
+            node->count++;
+        }
+
+        node = (radix_node_t*) node->slots[slot];
+    }
+
+    unsigned int slot = index & RADIX_MASK;
+
+    if (node->slots[slot]) {
+        return -1;
+    }
+
+    node->slots[slot] = page;
+    node->count++;
+
+    return 0;
+}
+
+// Remove a page from a mapping's radix tree, freeing emptied nodes
+static void radix_delete(page_mapping_t* mapping, unsigned int index) {
+    radix_node_t* node = mapping->root;
+    unsigned int height = mapping->height;
+
+    if (!node || ((unsigned long long) index >> (RADIX_SHIFT * height)) != 0) {
+        return;
+    }
+
+    while (height > 1) {
+        height--;
+        node = (radix_node_t*) node->slots[(index >> (RADIX_SHIFT * height)) & RADIX_MASK];
+
+        if (!node) {
+            return;
+        }
+    }
+
+    unsigned int slot = index & RADIX_MASK;
+
+    if (!node->slots[slot]) {
+        return;
+    }
+
+    node->slots[slot] = NULL;
+    node->count--;
+
+    while (node && node->count == 0) {
+        radix_node_t* parent = node->parent;
+
+        if (parent) {
+            parent->slots[node->offset] = NULL;
+            parent->count--;
+        } else {
+            mapping->root = NULL;
+            mapping->height = 0;
+        }
+
+        radix_node_free(node);
+        node = parent;
+    }
+}
+
+// Hash bucket for a mapping key
+static unsigned int page_cache_mapping_bucket(void* owner, unsigned int inode) {
+    unsigned long long key = (unsigned long long) owner ^ ((unsigned long long) inode * 0x9E3779B97F4A7C15ULL);
+    return (unsigned int) (key ^ (key >> 29)) & (PAGE_CACHE_MAPPING_BUCKETS - 1);
+}
+
+// Return an unused mapping to the free list
+static void page_cache_free_mapping(page_mapping_t* mapping) {
+    page_mapping_t** link = &mapping_buckets[page_cache_mapping_bucket(mapping->owner, mapping->inode)];
+
+    while (*link) {
+        if (*link == mapping) {
+            *link = mapping->hash_next;
+            break;
+        }
+
+        link = &(*link)->hash_next;
+    }
+
+    mapping->owner = NULL;
+    mapping->hash_next = free_mappings;
+    free_mappings = mapping;
+    page_cache_stats.mappings--;
+}
+
+// Mark a page dirty, putting its mapping on the dirty list if it was clean
+static void page_cache_set_dirty(page_t* page) {
+    page_mapping_t* mapping = page->mapping;
+
+    if (page->flags & PAGE_DIRTY) {
+        return;
+    }
+
+    page->flags |= PAGE_DIRTY;
+    page_cache_stats.dirty_pages++;
+
+    if (mapping->nr_dirty++ == 0) {
+        mapping->dirtied = ktime_get_ns();
+        mapping->dirty_next = NULL;
+        mapping->dirty_prev = dirty_mappings_tail;
+
+        if (dirty_mappings_tail) {
+            dirty_mappings_tail->dirty_next = mapping;
+        } else {
+            dirty_mappings_head = mapping;
+        }
+
+        dirty_mappings_tail = mapping;
+    }
+}
+
+// Mark a page clean, taking its mapping off the dirty list if it has no dirty pages left
+static void page_cache_clear_dirty(page_t* page) {
+    page_mapping_t* mapping = page->mapping;
+
+    if (!(page->flags & PAGE_DIRTY)) {
+        return;
+    }
+
+    page->flags &= ~PAGE_DIRTY;
+    page_cache_stats.dirty_pages--;
+
+    if (--mapping->nr_dirty == 0) {
+        if (mapping->dirty_prev) {
+            mapping->dirty_prev->dirty_next = mapping->dirty_next;
+        } else {
+            dirty_mappings_head = mapping->dirty_next;
+        }
+
+        if (mapping->dirty_next) {
+            mapping->dirty_next->dirty_prev = mapping->dirty_prev;
+        } else {
+            dirty_mappings_tail = mapping->dirty_prev;
+        }
+
+        mapping->dirty_prev = NULL;
+        mapping->dirty_next = NULL;
+    }
+}
+
+// Write a dirty page back through its mapping
+static int page_cache_writeback(page_t* page) {
+    page_mapping_t* mapping = page->mapping;
+
+    // Pinned pages hold changes that may not reach their home location yet
+    if (!(page->flags & PAGE_DIRTY) || page->pins > 0) {
+        return 0;
+    }
+
+    if (!mapping->ops || !mapping->ops->writepage) {
+        return -1;
+    }
+
+    page_cache_writing_back++;
+    memory_noreclaim_begin();
+    int result = mapping->ops->writepage(mapping, page->index, page->data);
+    memory_noreclaim_end();
+    page_cache_writing_back--;
+
+    if (result != 0) {
+        KLOG(&page_cache_log, KLOG_ERR, "Writeback of page %u of inode %u failed\n", page->index, mapping->inode);
+        return -1;
+    }
+
+    page_cache_clear_dirty(page);
+    page_cache_stats.writebacks++;
+
+    return 0;
+}
+
+// Remove a page from the cache (the caller has dealt with dirty data)
+static void page_cache_remove(page_t* page) {
+    page_mapping_t* mapping = page->mapping;
+
+    page_cache_clear_dirty(page);
+    radix_delete(mapping, page->index);
+    mapping->nr_pages--;
+
+    // Unlink from the CLOCK list
+    if (page->clock_next == page) {
+        clock_hand = NULL;
+    } else {
+        page->clock_prev->clock_next = page->clock_next;
+        page->clock_next->clock_prev = page->clock_prev;
+
+        if (clock_hand == page) {
+            clock_hand = page->clock_next;
+        }
+    }
+
+    free_block(page->data);
+    page->data = NULL;
+    page->mapping = NULL;
+    page->flags = 0;
+    page->pins = 0;
+    page->mapcount = 0;
+    page->clock_next = free_pages;
+    free_pages = page;
+    page_cache_stats.pages--;
+
+    // Unreferenced mappings live only as long as they cache something
+    if (mapping->refcount == 0 && mapping->nr_pages == 0) {
+        page_cache_free_mapping(mapping);
+    }
+}
+
+// Evict one page using the CLOCK algorithm; returns 0 on success
+//
+// Dirty pages are written back on the second sweep if may_write is set,
+// and never taken otherwise.
+static int page_cache_evict_one(int may_write) {
+    // Two sweeps: the first may only clear referenced bits
+    unsigned int budget = 2 * page_cache_stats.pages + 1;
+
+    while (clock_hand && budget-- > 0) {
+        page_t* page = clock_hand;
+        clock_hand = page->clock_next;
+
+        if (page->pins > 0 || page->mapcount > 0) {
+            continue;
+        }
+
+        if (page->flags & PAGE_REFERENCED) {
+            page->flags &= ~PAGE_REFERENCED;
+            continue;
+        }
+
+        // Prefer clean pages on the first sweep; the flusher handles dirty ones
+        if ((page->flags & PAGE_DIRTY) && (!may_write || budget > page_cache_stats.pages)) {
+            page_cache_flusher_wanted = 1;
+            continue;
+        }
+
+        if (page_cache_writeback(page) != 0) {
+            continue;
+        }
+
+        page_cache_remove(page);
+        page_cache_stats.evictions++;
+        return 0;
+    }
+
+    return -1;
+}
+
+// Check if the rest of the kernel is running short of memory
+static int page_cache_under_pressure() {
+    unsigned int free;
+    memory_stats(NULL, NULL, &free);
+    return free / MEMORY_BLOCK_SIZE < PAGE_CACHE_LOW_WATERMARK;
+}
+
+// Allocate a page descriptor and its data block, evicting as needed
+static page_t* page_cache_alloc_page() {
+    while (!free_pages || (page_cache_stats.pages > 0 && page_cache_under_pressure())) {
+        if (page_cache_evict_one(1) != 0) {
+            break;
+        }
+    }
+
+    if (!free_pages) {
+        return NULL;
+    }
+
+    void* data = allocate_block_noreclaim();
+
+    if (!data && page_cache_evict_one(1) == 0) {
+        data = allocate_block_noreclaim();
+    }
+
+    if (!data) {
+        return NULL;
+    }
+
+    page_t* page = free_pages;
+    free_pages = page->clock_next;
+    page->data = data;
+    page->flags = 0;
+    page->pins = 0;
+    page->mapcount = 0;
+
+    return page;
+}
+
+// Add a new page to a mapping and the CLOCK list
+static int page_cache_add(page_mapping_t* mapping, unsigned int index, page_t* page) {
+    page->mapping = mapping;
+    page->index = index;
+
+    if (radix_insert(mapping, index, page) != 0) {
+        return -1;
+    }
+
+    // Insert just behind the hand, so it is the last to be considered
+    if (clock_hand) {
+        page->clock_next = clock_hand;
+        page->clock_prev = clock_hand->clock_prev;
+        clock_hand->clock_prev->clock_next = page;
+        clock_hand->clock_prev = page;
+    } else {
+        page->clock_next = page;
+        page->clock_prev = page;
+        clock_hand = page;
+    }
+
+    mapping->nr_pages++;
+    page_cache_stats.pages++;
+
+    return 0;
+}
+
+// Release a page that could not be added
+static void page_cache_discard(page_t* page) {
+    free_block(page->data);
+    page->data = NULL;
+    page->mapping = NULL;
+    page->clock_next = free_pages;
+    free_pages = page;
+}
+
+// Find or create a page; if fill is set a new page is read in
+static page_t* page_cache_lookup(page_mapping_t* mapping, unsigned int index, int fill) {
+    page_t* page = radix_lookup(mapping, index);
+
+    if (page) {
+        page_cache_stats.hits++;
+        page->flags |= PAGE_REFERENCED;
+        return page;
+    }
+
+    page_cache_stats.misses++;
+    page = page_cache_alloc_page();
+
+    if (!page) {
+        return NULL;
+    }
+
+    if (fill && mapping->ops && mapping->ops->readpage) {
+        memory_noreclaim_begin();
+        int result = mapping->ops->readpage(mapping, index, page->data);
+        memory_noreclaim_end();
+
+        if (result != 0) {
+            page_cache_discard(page);
+            return NULL;
+        }
+    } else {
+        memset(page->data, 0, PAGE_CACHE_PAGE_SIZE);
+    }
+
+    page->flags = PAGE_UPTODATE | PAGE_REFERENCED;
+
+    if (page_cache_add(mapping, index, page) != 0) {
+        page_cache_discard(page);
+        return NULL;
+    }
+
+    return page;
+}
+
+// Read a page of a raw block device
+static int page_cache_device_readpage(page_mapping_t* mapping, unsigned int index, void* buffer) {
+    block_dev_t* device = (block_dev_t*) mapping->private_data;
+    unsigned int sectors_per_page = PAGE_CACHE_PAGE_SIZE / device->sector_size;
+    unsigned long long total_sectors = device->size / device->sector_size;
+    unsigned long long start = (unsigned long long) index * sectors_per_page;
+
+    if (start >= total_sectors) {
+        return -1;
+    }
+
+    unsigned int count = sectors_per_page;
+
+    // The last page of the device may be partial
+    if (start + count > total_sectors) {
+        count = total_sectors - start;
+        memset(buffer, 0, PAGE_CACHE_PAGE_SIZE);
+    }
+
+    return bdev_read_sectors(device, start, count, buffer) == 0 ? 0 : -1;
+}
+
+// Write a page of a raw block device
+static int page_cache_device_writepage(page_mapping_t* mapping, unsigned int index, const void* buffer) {
+    block_dev_t* device = (block_dev_t*) mapping->private_data;
+    unsigned int sectors_per_page = PAGE_CACHE_PAGE_SIZE / device->sector_size;
+    unsigned long long total_sectors = device->size / device->sector_size;
+    unsigned long long start = (unsigned long long) index * sectors_per_page;
+
+    if (start >= total_sectors) {
+        return -1;
+    }
+
+    unsigned int count = sectors_per_page;
+
+    if (start + count > total_sectors) {
+        count = total_sectors - start;
+    }
+
+    return bdev_write_sectors(device, start, count, buffer) == 0 ? 0 : -1;
+}
+
+// Block device mapping operations
+static const page_mapping_ops_t page_cache_device_ops = {
+    page_cache_device_readpage,
+    page_cache_device_writepage
+};
+
+// Initialize the page cache
+void page_cache_init() {
+    free_pages = NULL;
+
+    for (int i = PAGE_CACHE_MAX_PAGES - 1; i >= 0; i--) {
+        pages[i].mapping = NULL;
+        pages[i].data = NULL;
+        pages[i].flags = 0;
+        pages[i].clock_next = free_pages;
+        free_pages = &pages[i];
+    }
+
+    free_mappings = NULL;
+
+    for (int i = PAGE_CACHE_MAX_MAPPINGS - 1; i >= 0; i--) {
+        mappings[i].owner = NULL;
+        mappings[i].hash_next = free_mappings;
+        free_mappings = &mappings[i];
+    }
+
+    for (int i = 0; i < PAGE_CACHE_MAPPING_BUCKETS; i++) {
+        mapping_buckets[i] = NULL;
+    }
+
+    clock_hand = NULL;
+    free_nodes = NULL;
+    dirty_mappings_head = NULL;
+    dirty_mappings_tail = NULL;
+    page_cache_flusher_last = 0;
+    page_cache_flusher_wanted = 0;
+    page_cache_flushing = 0;
+
+    page_cache_stats.hits = 0;
+    page_cache_stats.misses = 0;
+    page_cache_stats.evictions = 0;
+    page_cache_stats.writebacks = 0;
+    page_cache_stats.flusher_runs = 0;
+    page_cache_stats.throttled = 0;
+    page_cache_stats.pages = 0;
+    page_cache_stats.dirty_pages = 0;
+    page_cache_stats.mappings = 0;
+
+    // Give clean pages back when the block allocator runs dry
+    memory_register_shrinker(page_cache_shrink);
+}
+
+// Find a mapping without taking a reference
+static page_mapping_t* page_cache_find_mapping(void* owner, unsigned int inode) {
+    for (page_mapping_t* mapping = mapping_buckets[page_cache_mapping_bucket(owner, inode)]; mapping; mapping = mapping->hash_next) {
+        if (mapping->owner == owner && mapping->inode == inode) {
+            return mapping;
+        }
+    }
+
+    return NULL;
+}
+
+// Free the unreferenced mapping caching the fewest pages
+static void page_cache_reclaim_mapping() {
+    page_mapping_t* victim = NULL;
+
+    for (int i = 0; i < PAGE_CACHE_MAX_MAPPINGS; i++) {
+        page_mapping_t* mapping = &mappings[i];
+
+        if (mapping->owner && mapping->refcount == 0 && (!victim || mapping->nr_pages < victim->nr_pages)) {
+            victim = mapping;
+        }
+    }
+
+    if (!victim || page_cache_sync(victim) != 0) {
+        return;
+    }
+
+    // Dropping the last page frees the mapping
+    page_cache_invalidate(victim);
+}
+
+// Get (or create) the mapping for an inode and take a reference to it
+page_mapping_t* page_cache_get_mapping(void* owner, unsigned int inode, const page_mapping_ops_t* ops, void* private_data) {
+    if (!owner) {
+        return NULL;
+    }
+
+    page_mapping_t* mapping = page_cache_find_mapping(owner, inode);
+
+    if (mapping) {
+        mapping->refcount++;
+        return mapping;
+    }
+
+    if (!free_mappings) {
+        page_cache_reclaim_mapping();
+    }
+
+    if (!free_mappings) {
+        KLOG(&page_cache_log, KLOG_WARNING, "Maximum number of mappings reached\n");
+        return NULL;
+    }
+
+    mapping = free_mappings;
+    free_mappings = mapping->hash_next;
+
+    mapping->owner = owner;
+    mapping->inode = inode;
+    mapping->ops = ops;
+    mapping->private_data = private_data;
+    mapping->size = 0;
+    mapping->root = NULL;
+    mapping->height = 0;
+    mapping->nr_pages = 0;
+    mapping->nr_dirty = 0;
+    mapping->dirtied = 0;
+    mapping->refcount = 1;
+    mapping->dirty_prev = NULL;
+    mapping->dirty_next = NULL;
+
+    unsigned int bucket = page_cache_mapping_bucket(owner, inode);
+    mapping->hash_next = mapping_buckets[bucket];
+    mapping_buckets[bucket] = mapping;
+    page_cache_stats.mappings++;
+
+    return mapping;
+}
+
+// Get the mapping that caches a raw block device
+page_mapping_t* page_cache_get_device(block_dev_t* device) {
+    if (!device || device->sector_size == 0 || device->sector_size > PAGE_CACHE_PAGE_SIZE) {
+        return NULL;
+    }
+
+    page_mapping_t* mapping = page_cache_get_mapping(device, 0, &page_cache_device_ops, device);
+
+    if (mapping) {
+        mapping->size = device->size;
+    }
+
+    return mapping;
+}
+
+// Drop a reference to a mapping; its pages stay cached until evicted
+void page_cache_release_mapping(page_mapping_t* mapping) {
+    if (!mapping || mapping->refcount == 0) {
+        return;
+    }
+
+    mapping->refcount--;
+
+    if (mapping->refcount == 0 && mapping->nr_pages == 0) {
+        page_cache_free_mapping(mapping);
+    }
+}
+
+// Get an up-to-date page of a mapping
+page_t* page_cache_get_page(page_mapping_t* mapping, unsigned int index) {
+    if (!mapping) {
+        return NULL;
+    }
+
+    return page_cache_lookup(mapping, index, 1);
+}
+
+// Check if a page is cached, without reading it in or counting a lookup
+page_t* page_cache_find_page(page_mapping_t* mapping, unsigned int index) {
+    if (!mapping) {
+        return NULL;
+    }
+
+    return radix_lookup(mapping, index);
+}
+
+// Add a page whose contents were read by the caller (e.g. readahead)
+//
+// Returns -1 if the page is already cached or no memory is available.
+int page_cache_add_data(page_mapping_t* mapping, unsigned int index, const void* data) {
+    if (!mapping || !data || radix_lookup(mapping, index)) {
+        return -1;
+    }
+
+    page_t* page = page_cache_alloc_page();
+
+    if (!page) {
+        return -1;
+    }
+
+    memcpy(page->data, data, PAGE_CACHE_PAGE_SIZE);
+
+    // Not referenced yet: unused readahead is the first to go
+    page->flags = PAGE_UPTODATE;
+
+    if (page_cache_add(mapping, index, page) != 0) {
+        page_cache_discard(page);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Read from a mapping through the cache; returns the number of bytes read
+int page_cache_read(page_mapping_t* mapping, unsigned long long offset, void* buffer, unsigned int size) {
+    if (!mapping || !buffer) {
+        return -1;
+    }
+
+    if (offset >= mapping->size) {
+        return 0;
+    }
+
+    if (size > mapping->size - offset) {
+        size = mapping->size - offset;
+    }
+
+    unsigned char* out = (unsigned char*) buffer;
+    unsigned int done = 0;
+
+    while (done < size) {
+        unsigned int index = (offset + done) / PAGE_CACHE_PAGE_SIZE;
+        unsigned int page_offset = (offset + done) % PAGE_CACHE_PAGE_SIZE;
+        unsigned int chunk = PAGE_CACHE_PAGE_SIZE - page_offset;
+
+        if (chunk > size - done) {
+            chunk = size - done;
+        }
+
+        page_t* page = page_cache_lookup(mapping, index, 1);
+
+        if (!page) {
+            return done > 0 ? (int) done : -1;
+        }
+
+        memcpy(out + done, (unsigned char*) page->data + page_offset, chunk);
+        done += chunk;
+    }
+
+    return done;
+}
+
+// Write back up to *budget dirty pages of a mapping in page order
+//
+// Returns -1 if any page could not be written back.
+static int page_cache_writeback_mapping(page_mapping_t* mapping, unsigned int* budget) {
+    unsigned long long index = 0;
+    int result = 0;
+
+    while (mapping->nr_dirty > 0 && *budget > 0) {
+        page_t* page = radix_next(mapping, &index);
+
+        if (!page) {
+            break;
+        }
+
+        if (page->flags & PAGE_DIRTY) {
+            if (page_cache_writeback(page) != 0) {
+                result = -1;
+            }
+
+            (*budget)--;
+        }
+
+        index++;
+    }
+
+    return result;
+}
+
+// Write back the oldest dirty mappings until at most target pages are
+// dirty, and every mapping dirtied before the expiry time
+static void page_cache_writeback_old(unsigned long long expired_before, unsigned int target) {
+    page_mapping_t* mapping = dirty_mappings_head;
+
+    page_cache_flushing = 1;
+    storage_plug();
+
+    while (mapping) {
+        page_mapping_t* next = mapping->dirty_next;
+        int expired = mapping->dirtied < expired_before;
+
+        // The list is in dirtying order, so nothing later has expired either
+        if (!expired && page_cache_stats.dirty_pages <= target) {
+            break;
+        }
+
+        unsigned int budget = expired ? mapping->nr_dirty : page_cache_stats.dirty_pages - target;
+        page_cache_writeback_mapping(mapping, &budget);
+        mapping = next;
+    }
+
+    storage_unplug();
+    page_cache_flushing = 0;
+}
+
+// Throttle a writer that has pushed dirty pages over the limit
+//
+// There is no other thread to wait for, so the writer does the writeback
+// itself, down to halfway between the background threshold and the limit.
+static void page_cache_balance_dirty() {
+    if (page_cache_stats.dirty_pages <= PAGE_CACHE_DIRTY_BACKGROUND) {
+        return;
+    }
+
+    page_cache_flusher_wanted = 1;
+
+    if (page_cache_stats.dirty_pages <= PAGE_CACHE_DIRTY_LIMIT || page_cache_flushing || page_cache_writing_back) {
+        return;
+    }
+
+    page_cache_stats.throttled++;
+    page_cache_writeback_old(0, (PAGE_CACHE_DIRTY_BACKGROUND + PAGE_CACHE_DIRTY_LIMIT) / 2);
+}
+
+// Mark a page dirty after changing its contents in place
+void page_cache_mark_dirty(page_t* page) {
+    if (!page || !page->mapping) {
+        return;
+    }
+
+    page_cache_set_dirty(page);
+    page_cache_balance_dirty();
+}
+
+// Mark a page clean after its owner wrote it back itself (e.g. together
+// with the page being written back)
+void page_cache_mark_clean(page_t* page) {
+    if (!page || !page->mapping || page->pins > 0 || !(page->flags & PAGE_DIRTY)) {
+        return;
+    }
+
+    page_cache_clear_dirty(page);
+    page_cache_stats.writebacks++;
+}
+
+// Keep a page in the cache and out of writeback until it is unpinned
+//
+// Used by the journal for metadata blocks whose changes are not committed
+// yet: the page may be neither evicted nor written to its home location.
+void page_cache_pin(page_t* page) {
+    if (page && page->mapping) {
+        page->pins++;
+    }
+}
+
+// Release a pin taken by page_cache_pin()
+void page_cache_unpin(page_t* page) {
+    if (page && page->pins > 0) {
+        page->pins--;
+    }
+}
+
+// Write to a mapping through the cache; returns the number of bytes written
+//
+// Pages are only marked dirty here and written back later by the flusher,
+// page_cache_sync() or eviction. A writer is only held up when dirty pages
+// exceed PAGE_CACHE_DIRTY_LIMIT.
+int page_cache_write(page_mapping_t* mapping, unsigned long long offset, const void* buffer, unsigned int size) {
+    if (!mapping || !buffer) {
+        return -1;
+    }
+
+    const unsigned char* in = (const unsigned char*) buffer;
+    unsigned int done = 0;
+
+    while (done < size) {
+        unsigned long long position = offset + done;
+        unsigned int index = position / PAGE_CACHE_PAGE_SIZE;
+        unsigned int page_offset = position % PAGE_CACHE_PAGE_SIZE;
+        unsigned int chunk = PAGE_CACHE_PAGE_SIZE - page_offset;
+
+        if (chunk > size - done) {
+            chunk = size - done;
+        }
+
+        // Whole pages and pages beyond the end need no read
+        int fill = chunk < PAGE_CACHE_PAGE_SIZE && (unsigned long long) index * PAGE_CACHE_PAGE_SIZE < mapping->size;
+        page_t* page = page_cache_lookup(mapping, index, fill);
+
+        if (!page) {
+            return done > 0 ? (int) done : -1;
+        }
+
+        memcpy((unsigned char*) page->data + page_offset, in + done, chunk);
+        page_cache_set_dirty(page);
+        done += chunk;
+
+        if (offset + done > mapping->size) {
+            mapping->size = offset + done;
+        }
+
+        page_cache_balance_dirty();
+    }
+
+    return done;
+}
+
+// Write back the dirty mappings of an owner (or of all owners if NULL)
+static int page_cache_sync_mappings(void* owner) {
+    page_mapping_t* mapping = dirty_mappings_head;
+    int result = 0;
+
+    // Batch the writeback so the request queues can merge and sort it
+    storage_plug();
+
+    while (mapping) {
+        page_mapping_t* next = mapping->dirty_next;
+
+        if (!owner || mapping->owner == owner) {
+            unsigned int budget = mapping->nr_dirty;
+
+            if (page_cache_writeback_mapping(mapping, &budget) != 0) {
+                result = -1;
+            }
+        }
+
+        mapping = next;
+    }
+
+    if (storage_unplug() != 0) {
+        result = -1;
+    }
+
+    return result;
+}
+
+// Write back dirty pages of a mapping (or of all mappings if NULL)
+int page_cache_sync(page_mapping_t* mapping) {
+    if (!mapping) {
+        return page_cache_sync_mappings(NULL);
+    }
+
+    unsigned int budget = mapping->nr_dirty;
+    int result = 0;
+
+    storage_plug();
+
+    if (page_cache_writeback_mapping(mapping, &budget) != 0) {
+        result = -1;
+    }
+
+    if (storage_unplug() != 0) {
+        result = -1;
+    }
+
+    return result;
+}
+
+// Write back dirty pages of every mapping of an owner (e.g. a file system)
+int page_cache_sync_owner(void* owner) {
+    if (!owner) {
+        return -1;
+    }
+
+    return page_cache_sync_mappings(owner);
+}
+
+// Run the background flusher if it is due
+//
+// Called from the idle loop. A run writes back mappings dirtied more than
+// PAGE_CACHE_DIRTY_EXPIRE_NS ago, then the oldest mappings until dirty
+// pages are back under the background threshold.
+void page_cache_flusher_run() {
+    unsigned long long now = ktime_get_ns();
+
+    if (page_cache_flushing || page_cache_writing_back) {
+        return;
+    }
+
+    if (!page_cache_flusher_wanted && now - page_cache_flusher_last < PAGE_CACHE_FLUSH_INTERVAL_NS) {
+        return;
+    }
+
+    page_cache_flusher_wanted = 0;
+    page_cache_flusher_last = now;
+
+    if (!dirty_mappings_head) {
+        return;
+    }
+
+    page_cache_stats.flusher_runs++;
+
+    unsigned long long expired_before = now > PAGE_CACHE_DIRTY_EXPIRE_NS ? now - PAGE_CACHE_DIRTY_EXPIRE_NS : 0;
+    page_cache_writeback_old(expired_before, PAGE_CACHE_DIRTY_BACKGROUND);
+}
+
+// Drop all cached pages of a mapping without writing them back
+//
+// Pages still mapped into memory are left in place.
+void page_cache_invalidate(page_mapping_t* mapping) {
+    if (!mapping) {
+        return;
+    }
+
+    // Keep the mapping alive while its last pages go
+    mapping->refcount++;
+
+    for (int i = 0; i < PAGE_CACHE_MAX_PAGES && mapping->nr_pages > 0; i++) {
+        if (pages[i].mapping == mapping && pages[i].mapcount == 0) {
+            page_cache_remove(&pages[i]);
+        }
+    }
+
+    page_cache_release_mapping(mapping);
+}
+
+// Write back and drop everything cached for an owner (e.g. on unmount)
+void page_cache_drop_owner(void* owner) {
+    for (int i = 0; i < PAGE_CACHE_MAX_PAGES; i++) {
+        page_t* page = &pages[i];
+
+        if (page->mapping && page->mapping->owner == owner) {
+            page_cache_writeback(page);
+            page_cache_remove(page);
+        }
+    }
+
+    for (int i = 0; i < PAGE_CACHE_MAX_MAPPINGS; i++) {
+        if (mappings[i].owner == owner && mappings[i].refcount == 0 && mappings[i].nr_pages == 0) {
+            page_cache_free_mapping(&mappings[i]);
+        }
+    }
+}
+
+// Drop cached device pages overwritten by a direct sector write
+void page_cache_device_written(void* device, unsigned long long start_sector, unsigned int sector_count) {
+    if (page_cache_writing_back) {
+        return;
+    }
+
+    page_mapping_t* mapping = page_cache_find_mapping(device, 0);
+
+    if (!mapping || mapping->nr_pages == 0 || sector_count == 0) {
+        return;
+    }
+
+    unsigned int sectors_per_page = PAGE_CACHE_PAGE_SIZE / ((storage_device_t*) device)->sector_size;
+    unsigned int first = start_sector / sectors_per_page;
+    unsigned int last = (start_sector + sector_count - 1) / sectors_per_page;
+
+    for (unsigned int index = first; index <= last && mapping->nr_pages > 0; index++) {
+        page_t* page = radix_lookup(mapping, index);
+
+        // A pinned page holds newer contents than anything written directly,
+        // and a mapped page must stay where its users can see it
+        if (page && page->pins == 0 && page->mapcount == 0) {
+            page_cache_remove(page);
+        }
+    }
+}
+
+// Evict up to count clean, unused pages (the memory shrinker); returns the
+// number evicted, each of which gave back a block
+unsigned int page_cache_shrink(unsigned int count) {
+    unsigned int evicted = 0;
+
+    while (evicted < count && page_cache_evict_one(0) == 0) {
+        evicted++;
+    }
+
+    return evicted;
+}
+
+// Get page cache statistics
+void page_cache_get_stats(page_cache_stats_t* stats) {
+    if (stats) {
+        *stats = page_cache_stats;
+    }
+}
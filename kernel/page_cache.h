@@ -0,0 +1,121 @@
+/**
+ * LightOS Kernel
+ * Page cache header
+ */
+
+#ifndef PAGE_CACHE_H
+#define PAGE_CACHE_H
+
+#include "memory.h"
+#include "../drivers/storage.h"
+
+// Cached page size (one memory block)
+#define PAGE_CACHE_PAGE_SIZE MEMORY_BLOCK_SIZE
+
+// Maximum number of cached pages (8 MB)
+#define PAGE_CACHE_MAX_PAGES 2048
+
+// Free memory blocks to leave for the rest of the kernel
+#define PAGE_CACHE_LOW_WATERMARK 256
+
+// Maximum number of mappings (cached files and devices)
+#define PAGE_CACHE_MAX_MAPPINGS 256
+
+// Dirty pages above which the flusher writes back old data (10%)
+#define PAGE_CACHE_DIRTY_BACKGROUND (PAGE_CACHE_MAX_PAGES / 10)
+
+// Dirty pages above which writers are throttled (20%)
+#define PAGE_CACHE_DIRTY_LIMIT (PAGE_CACHE_MAX_PAGES / 5)
+
+// Age at which dirty data is written back regardless of the thresholds
+#define PAGE_CACHE_DIRTY_EXPIRE_NS 30000000000ULL
+
+// Interval between flusher runs looking for expired data
+#define PAGE_CACHE_FLUSH_INTERVAL_NS 5000000000ULL
+
+// Page flags
+#define PAGE_UPTODATE   0x01
+#define PAGE_DIRTY      0x02
+#define PAGE_REFERENCED 0x04
+
+struct page_mapping;
+struct radix_node;
+
+// Operations used to fill and write back a mapping's pages
+typedef struct {
+    int (*readpage)(struct page_mapping* mapping, unsigned int index, void* buffer);
+    int (*writepage)(struct page_mapping* mapping, unsigned int index, const void* buffer);
+} page_mapping_ops_t;
+
+// Mapping structure (the cached contents of one inode or block device)
+//
+// Mappings are identified by (owner, inode), where the owner is the
+// filesystem_t (or block_dev_t for a raw device) the inode belongs to.
+// Pages are indexed by page offset in a radix tree. Mappings with dirty
+// pages are kept on a list in the order they were first dirtied.
+typedef struct page_mapping {
+    void* owner;
+    unsigned int inode;
+    const page_mapping_ops_t* ops;
+    void* private_data;
+    unsigned long long size;            // Size in bytes; reads stop here
+    struct radix_node* root;
+    unsigned int height;
+    unsigned int nr_pages;
+    unsigned int nr_dirty;
+    unsigned long long dirtied;         // When the mapping last went from clean to dirty
+    unsigned int refcount;
+    struct page_mapping* hash_next;
+    struct page_mapping* dirty_prev;
+    struct page_mapping* dirty_next;
+} page_mapping_t;
+
+// Cached page structure
+typedef struct page {
+    page_mapping_t* mapping;
+    unsigned int index;
+    unsigned int flags;
+    unsigned int pins;                  // Holders that keep the page cached and unwritten
+    unsigned int mapcount;              // Memory mappings using the page (keeps it cached)
+    void* data;
+    struct page* clock_prev;
+    struct page* clock_next;
+} page_t;
+
+// Page cache statistics
+typedef struct {
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+    unsigned long long writebacks;
+    unsigned long long flusher_runs;
+    unsigned long long throttled;       // Writes that had to write back first
+    unsigned int pages;
+    unsigned int dirty_pages;
+    unsigned int mappings;
+} page_cache_stats_t;
+
+// Page cache functions
+void page_cache_init();
+page_mapping_t* page_cache_get_mapping(void* owner, unsigned int inode, const page_mapping_ops_t* ops, void* private_data);
+page_mapping_t* page_cache_get_device(block_dev_t* device);
+void page_cache_release_mapping(page_mapping_t* mapping);
+page_t* page_cache_get_page(page_mapping_t* mapping, unsigned int index);
+page_t* page_cache_find_page(page_mapping_t* mapping, unsigned int index);
+int page_cache_add_data(page_mapping_t* mapping, unsigned int index, const void* data);
+int page_cache_read(page_mapping_t* mapping, unsigned long long offset, void* buffer, unsigned int size);
+int page_cache_write(page_mapping_t* mapping, unsigned long long offset, const void* buffer, unsigned int size);
+void page_cache_mark_dirty(page_t* page);
+void page_cache_mark_clean(page_t* page);
+void page_cache_pin(page_t* page);
+void page_cache_unpin(page_t* page);
+int page_cache_sync(page_mapping_t* mapping);
+int page_cache_sync_owner(void* owner);
+void page_cache_flusher_run();
+void page_cache_invalidate(page_mapping_t* mapping);
+void page_cache_drop_owner(void* owner);
+void page_cache_device_written(void* device, unsigned long long start_sector, unsigned int sector_count);
+unsigned int page_cache_shrink(unsigned int count);
+void page_cache_get_stats(page_cache_stats_t* stats);
+
+#endif /* PAGE_CACHE_H */
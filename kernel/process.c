@@ -5,6 +5,8 @@
 
 #include "process.h"
 #include "memory.h"
+#include "filesystem.h"
+#include "mmap.h"
 
 // Maximum number of processes
 #define MAX_PROCESSES 256
@@ -32,6 +34,7 @@ void process_init() {
     process_table[0].stack = 0; // Kernel has its own stack
     process_table[0].stack_size = 0;
     process_table[0].name = "kernel";
+    process_table[0].files = NULL;
     
     // Set the current process to the kernel process
     current_pid = 0;
@@ -72,6 +75,7 @@ pid_t process_create(const char* name, void* entry_point, int priority) {
     process_table[slot].stack_size = PROCESS_STACK_SIZE;
     process_table[slot].entry_point = entry_point;
     process_table[slot].name = name;
+    process_table[slot].files = NULL;
     
     // Initialize the process context
     // Stack grows downward, so we start at the top
@@ -112,6 +116,11 @@ void process_terminate(pid_t pid) {
         return; // Process not found
     }
     
+    // Drop the process's file mappings and close its files
+    mmap_release_process(pid);
+    fs_release_files(process_table[slot].files);
+    process_table[slot].files = NULL;
+    
     // Free the process stack
     if (process_table[slot].stack) {
         free_blocks(process_table[slot].stack, process_table[slot].stack_size / MEMORY_BLOCK_SIZE);
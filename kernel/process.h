@@ -26,6 +26,9 @@ typedef enum {
     PROCESS_PRIORITY_KERNEL
 } process_priority_t;
 
+// File descriptor table (see filesystem.h)
+struct fd_table;
+
 // Process context structure (CPU registers)
 typedef struct {
     unsigned int edi;
@@ -50,6 +53,7 @@ typedef struct {
     void* entry_point;
     const char* name;
     process_context_t context;
+    struct fd_table* files;             // Created on the first open
 } process_t;
 
 // Default stack size for processes (64KB)
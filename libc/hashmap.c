@@ -0,0 +1,203 @@
+/**
+ * LightOS C Library
+ * Open-addressing hash map implementation
+ *
+ * Robin Hood hashing with linear probing: on insert, an entry that is
+ * further from its home slot than the resident entry takes the slot, which
+ * keeps probe sequences short and lets lookups stop early. Deletion uses
+ * backward shifting, so no tombstones are ever left behind.
+ */
+
+#include "hashmap.h"
+#include "string.h"
+
+// Maximum load factor (7/8) before inserts are refused
+#define HASHMAP_MAX_LOAD(capacity) ((capacity) - ((capacity) >> 3))
+
+// Initialize a hash map over a caller-provided slot array
+void hashmap_init(hashmap_t* map, hashmap_entry_t* entries, unsigned int capacity) {
+    if (!map) {
+        return;
+    }
+
+    map->entries = entries;
+    map->capacity = capacity;
+    map->mask = capacity ? capacity - 1 : 0;
+    map->count = 0;
+
+    hashmap_clear(map);
+}
+
+// Remove all entries from a hash map
+void hashmap_clear(hashmap_t* map) {
+    if (!map || !map->entries) {
+        return;
+    }
+
+    for (unsigned int i = 0; i < map->capacity; i++) {
+        map->entries[i].hash = 0;
+        map->entries[i].distance = 0;
+        map->entries[i].key = 0;
+        map->entries[i].value = 0;
+    }
+
+    map->count = 0;
+}
+
+// Hash a string (FNV-1a), never returning the empty-slot marker 0
+unsigned int hashmap_hash_string(const char* str) {
+    return hashmap_hash_bytes(str, strlen(str));
+}
+
+// Hash the first length bytes of a name, as hashmap_hash_string would hash
+// them on their own
+unsigned int hashmap_hash_bytes(const char* data, unsigned int length) {
+    unsigned int hash = 2166136261u;
+
+    for (unsigned int i = 0; i < length; i++) {
+        hash ^= (unsigned char) data[i];
+        hash *= 16777619u;
+    }
+
+    return hash ? hash : 1;
+}
+
+// Insert a key with a precomputed hash
+int hashmap_insert_hashed(hashmap_t* map, unsigned int hash, const char* key, void* value) {
+    if (!map || !map->entries || !key) {
+        return -1;
+    }
+
+    if (map->count >= HASHMAP_MAX_LOAD(map->capacity)) {
+        return -1; // Map is full
+    }
+
+    hashmap_entry_t entry;
+    entry.hash = hash;
+    entry.distance = 0;
+    entry.key = key;
+    entry.value = value;
+
+    unsigned int index = hash & map->mask;
+    int checking = 1;
+
+    while (1) {
+        hashmap_entry_t* slot = &map->entries[index];
+
+        if (slot->hash == 0) {
+            *slot = entry;
+            map->count++;
+            return 0;
+        }
+
+        // Reject duplicates; a matching key can only sit before the first
+        // slot where the new entry would displace a resident
+        if (checking && slot->hash == entry.hash && strcmp(slot->key, entry.key) == 0) {
+            return -1;
+        }
+
+        if (slot->distance < entry.distance) {
+            hashmap_entry_t displaced = *slot;
+            *slot = entry;
+            entry = displaced;
+            checking = 0;
+        }
+
+        index = (index + 1) & map->mask;
+        entry.distance++;
+    }
+}
+
+// Insert a key
+int hashmap_insert(hashmap_t* map, const char* key, void* value) {
+    if (!key) {
+        return -1;
+    }
+
+    return hashmap_insert_hashed(map, hashmap_hash_string(key), key, value);
+}
+
+// Find the slot holding a key, or -1
+static int hashmap_find_slot(const hashmap_t* map, unsigned int hash, const char* key) {
+    if (!map || !map->entries || !key || map->count == 0) {
+        return -1;
+    }
+
+    unsigned int index = hash & map->mask;
+    unsigned int distance = 0;
+
+    while (1) {
+        const hashmap_entry_t* slot = &map->entries[index];
+
+        // An empty slot or a resident closer to home than we are ends the probe
+        if (slot->hash == 0 || slot->distance < distance) {
+            return -1;
+        }
+
+        if (slot->hash == hash && strcmp(slot->key, key) == 0) {
+            return (int)index;
+        }
+
+        index = (index + 1) & map->mask;
+        distance++;
+    }
+}
+
+// Look up a key with a precomputed hash
+void* hashmap_get_hashed(const hashmap_t* map, unsigned int hash, const char* key) {
+    int index = hashmap_find_slot(map, hash, key);
+
+    if (index < 0) {
+        return 0;
+    }
+
+    return map->entries[index].value;
+}
+
+// Look up a key
+void* hashmap_get(const hashmap_t* map, const char* key) {
+    if (!key) {
+        return 0;
+    }
+
+    return hashmap_get_hashed(map, hashmap_hash_string(key), key);
+}
+
+// Remove a key, returning its value
+void* hashmap_remove(hashmap_t* map, const char* key) {
+    if (!key) {
+        return 0;
+    }
+
+    int found = hashmap_find_slot(map, hashmap_hash_string(key), key);
+
+    if (found < 0) {
+        return 0;
+    }
+
+    unsigned int index = (unsigned int)found;
+    void* value = map->entries[index].value;
+
+    // Shift the following entries back until one is in its home slot
+    unsigned int next = (index + 1) & map->mask;
+
+    while (map->entries[next].hash != 0 && map->entries[next].distance > 0) {
+        map->entries[index] = map->entries[next];
+        map->entries[index].distance--;
+        index = next;
+        next = (next + 1) & map->mask;
+    }
+
+    map->entries[index].hash = 0;
+    map->entries[index].distance = 0;
+    map->entries[index].key = 0;
+    map->entries[index].value = 0;
+    map->count--;
+
+    return value;
+}
+
+// Get the number of entries in a hash map
+unsigned int hashmap_count(const hashmap_t* map) {
+    return map ? map->count : 0;
+}
@@ -0,0 +1,46 @@
+/**
+ * LightOS C Library
+ * Open-addressing hash map header
+ */
+
+#ifndef HASHMAP_H
+#define HASHMAP_H
+
+// Hash map entry (slot) structure
+//
+// Keys are not copied: the key pointer must stay valid for as long as the
+// entry is in the map (normally it points at the name field of the object
+// being indexed). A hash of 0 marks an empty slot.
+typedef struct {
+    unsigned int hash;          // Precomputed key hash (0 = empty slot)
+    unsigned int distance;      // Probe distance from the home slot
+    const char* key;
+    void* value;
+} hashmap_entry_t;
+
+// Hash map structure
+//
+// The slot array is supplied by the caller (usually a static array sized
+// for the owning manager's maximum), so inserts never allocate. Inserts are
+// refused above 7/8 load, so size it as a power of two above 8/7 of the
+// most entries the owner keeps (e.g. 32 slots for 16 devices).
+typedef struct {
+    hashmap_entry_t* entries;
+    unsigned int capacity;      // Number of slots, must be a power of two
+    unsigned int mask;          // capacity - 1
+    unsigned int count;         // Number of occupied slots
+} hashmap_t;
+
+// Hash map functions
+void hashmap_init(hashmap_t* map, hashmap_entry_t* entries, unsigned int capacity);
+void hashmap_clear(hashmap_t* map);
+unsigned int hashmap_hash_string(const char* str);
+unsigned int hashmap_hash_bytes(const char* data, unsigned int length);
+int hashmap_insert(hashmap_t* map, const char* key, void* value);
+int hashmap_insert_hashed(hashmap_t* map, unsigned int hash, const char* key, void* value);
+void* hashmap_get(const hashmap_t* map, const char* key);
+void* hashmap_get_hashed(const hashmap_t* map, unsigned int hash, const char* key);
+void* hashmap_remove(hashmap_t* map, const char* key);
+unsigned int hashmap_count(const hashmap_t* map);
+
+#endif /* HASHMAP_H */
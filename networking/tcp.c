@@ -6,6 +6,8 @@
 #include "tcp.h"
 #include "../kernel/kernel.h"
 #include "../kernel/memory.h"
+#include "../kernel/klog.h"
+#include "../kernel/ktime.h"
 #include "../libc/string.h"
 
 // TCP header structure
@@ -35,6 +37,11 @@ typedef struct {
 // Maximum number of TCP sockets
 #define MAX_TCP_SOCKETS 128
 
+// Retransmission timeout bounds (microseconds, RFC 6298)
+#define TCP_INITIAL_RTO 1000000
+#define TCP_MIN_RTO 200000
+#define TCP_MAX_RTO 60000000
+
 // TCP socket array
 static tcp_socket_t tcp_sockets[MAX_TCP_SOCKETS];
 static int tcp_socket_count = 0;
@@ -42,6 +49,8 @@ static int tcp_socket_count = 0;
 // Next socket ID
 static int next_socket_id = 1;
 
+KLOG_SUBSYSTEM(tcp_log, "tcp");
+
 // Initialize TCP
 void tcp_init() {
     terminal_write("Initializing TCP...\n");
@@ -62,7 +71,7 @@ void tcp_init() {
 int tcp_socket_create() {
     // Check if we have room for another socket
     if (tcp_socket_count >= MAX_TCP_SOCKETS) {
-        terminal_write("Error: Maximum number of TCP sockets reached\n");
+        KLOG(&tcp_log, KLOG_WARNING, "Maximum number of TCP sockets reached\n");
         return -1;
     }
     
@@ -76,7 +85,7 @@ int tcp_socket_create() {
     }
     
     if (index == -1) {
-        terminal_write("Error: No free TCP socket slots\n");
+        KLOG(&tcp_log, KLOG_WARNING, "No free TCP socket slots\n");
         return -1;
     }
     
@@ -91,8 +100,11 @@ int tcp_socket_create() {
     tcp_sockets[index].recv_seq = 0;
     tcp_sockets[index].send_window = 8192;
     tcp_sockets[index].recv_window = 8192;
-    tcp_sockets[index].rtt = 100; // 100 ms
-    tcp_sockets[index].rto = 200; // 200 ms
+    tcp_sockets[index].rtt = 0;
+    tcp_sockets[index].rttvar = 0;
+    tcp_sockets[index].rto = TCP_INITIAL_RTO;
+    tcp_sockets[index].rtt_timer = 0;
+    tcp_sockets[index].rtt_seq = 0;
     tcp_sockets[index].send_buffer = NULL;
     tcp_sockets[index].send_buffer_size = 0;
     tcp_sockets[index].recv_buffer = NULL;
@@ -106,6 +118,33 @@ int tcp_socket_create() {
     return tcp_sockets[index].socket_id;
 }
 
+// Update the RTT estimate and retransmission timeout with a new sample (RFC 6298)
+static void tcp_update_rtt(tcp_socket_t* socket, unsigned int sample) {
+    if (sample == 0) {
+        sample = 1;
+    }
+    
+    if (socket->rtt == 0) {
+        // First measurement
+        socket->rtt = sample;
+        socket->rttvar = sample / 2;
+    } else {
+        unsigned int delta = socket->rtt > sample ? socket->rtt - sample : sample - socket->rtt;
+        socket->rttvar = (3 * socket->rttvar + delta) / 4;
+        socket->rtt = (7 * socket->rtt + sample) / 8;
+    }
+    
+    unsigned long long rto = (unsigned long long) socket->rtt + 4ULL * socket->rttvar;
+    
+    if (rto < TCP_MIN_RTO) {
+        rto = TCP_MIN_RTO;
+    } else if (rto > TCP_MAX_RTO) {
+        rto = TCP_MAX_RTO;
+    }
+    
+    socket->rto = (unsigned int) rto;
+}
+
 // Find a TCP socket by ID
 static tcp_socket_t* tcp_find_socket(int socket_id) {
     for (int i = 0; i < MAX_TCP_SOCKETS; i++) {
@@ -151,12 +190,12 @@ int tcp_socket_bind(int socket_id, unsigned int ip, unsigned short port) {
     tcp_socket_t* socket = tcp_find_socket(socket_id);
     
     if (!socket) {
-        terminal_write("Error: Invalid TCP socket ID\n");
+        KLOG(&tcp_log, KLOG_DEBUG, "Invalid TCP socket ID %d\n", socket_id);
         return -1;
     }
     
     if (socket->state != TCP_STATE_CLOSED) {
-        terminal_write("Error: TCP socket is not in CLOSED state\n");
+        KLOG(&tcp_log, KLOG_DEBUG, "Socket %d is not in CLOSED state\n", socket_id);
         return -1;
     }
     
@@ -166,7 +205,7 @@ int tcp_socket_bind(int socket_id, unsigned int ip, unsigned short port) {
             tcp_sockets[i].socket_id != socket_id &&
             (tcp_sockets[i].local_ip == 0 || tcp_sockets[i].local_ip == ip) &&
             tcp_sockets[i].local_port == port) {
-            terminal_write("Error: TCP address already in use\n");
+            KLOG(&tcp_log, KLOG_DEBUG, "Socket %d: address already in use\n", socket_id);
             return -1;
         }
     }
@@ -182,17 +221,17 @@ int tcp_socket_listen(int socket_id, int backlog) {
     tcp_socket_t* socket = tcp_find_socket(socket_id);
     
     if (!socket) {
-        terminal_write("Error: Invalid TCP socket ID\n");
+        KLOG(&tcp_log, KLOG_DEBUG, "Invalid TCP socket ID %d\n", socket_id);
         return -1;
     }
     
     if (socket->state != TCP_STATE_CLOSED) {
-        terminal_write("Error: TCP socket is not in CLOSED state\n");
+        KLOG(&tcp_log, KLOG_DEBUG, "Socket %d is not in CLOSED state\n", socket_id);
         return -1;
     }
     
     if (socket->local_port == 0) {
-        terminal_write("Error: TCP socket is not bound\n");
+        KLOG(&tcp_log, KLOG_DEBUG, "Socket %d is not bound\n", socket_id);
         return -1;
     }
     
@@ -206,12 +245,12 @@ int tcp_socket_accept(int socket_id, unsigned int* remote_ip, unsigned short* re
     tcp_socket_t* socket = tcp_find_socket(socket_id);
     
     if (!socket) {
-        terminal_write("Error: Invalid TCP socket ID\n");
+        KLOG(&tcp_log, KLOG_DEBUG, "Invalid TCP socket ID %d\n", socket_id);
         return -1;
     }
     
     if (socket->state != TCP_STATE_LISTEN) {
-        terminal_write("Error: TCP socket is not in LISTEN state\n");
+        KLOG(&tcp_log, KLOG_DEBUG, "Socket %d is not in LISTEN state\n", socket_id);
         return -1;
     }
     
@@ -229,12 +268,12 @@ int tcp_socket_connect(int socket_id, unsigned int ip, unsigned short port) {
     tcp_socket_t* socket = tcp_find_socket(socket_id);
     
     if (!socket) {
-        terminal_write("Error: Invalid TCP socket ID\n");
+        KLOG(&tcp_log, KLOG_DEBUG, "Invalid TCP socket ID %d\n", socket_id);
         return -1;
     }
     
     if (socket->state != TCP_STATE_CLOSED) {
-        terminal_write("Error: TCP socket is not in CLOSED state\n");
+        KLOG(&tcp_log, KLOG_DEBUG, "Socket %d is not in CLOSED state\n", socket_id);
         return -1;
     }
     
@@ -268,12 +307,12 @@ int tcp_socket_send(int socket_id, const void* data, unsigned int length) {
     tcp_socket_t* socket = tcp_find_socket(socket_id);
     
     if (!socket) {
-        terminal_write("Error: Invalid TCP socket ID\n");
+        KLOG(&tcp_log, KLOG_DEBUG, "Invalid TCP socket ID %d\n", socket_id);
         return -1;
     }
     
     if (socket->state != TCP_STATE_ESTABLISHED) {
-        terminal_write("Error: TCP socket is not in ESTABLISHED state\n");
+        KLOG(&tcp_log, KLOG_DEBUG, "Socket %d is not in ESTABLISHED state\n", socket_id);
         return -1;
     }
     
@@ -282,6 +321,14 @@ int tcp_socket_send(int socket_id, const void* data, unsigned int length) {
     // 2. Send as many packets as allowed by the window
     // 3. Wait for ACKs
     
+    // Time one segment at a time; the ACK that covers it gives an RTT sample
+    if (socket->rtt_timer == 0 && length > 0) {
+        socket->rtt_timer = ktime_get_ns();
+        socket->rtt_seq = socket->send_seq + length;
+    }
+    
+    socket->send_seq += length;
+    
     // For now, just simulate a successful send
     return length;
 }
@@ -291,12 +338,12 @@ int tcp_socket_recv(int socket_id, void* buffer, unsigned int length) {
     tcp_socket_t* socket = tcp_find_socket(socket_id);
     
     if (!socket) {
-        terminal_write("Error: Invalid TCP socket ID\n");
+        KLOG(&tcp_log, KLOG_DEBUG, "Invalid TCP socket ID %d\n", socket_id);
         return -1;
     }
     
     if (socket->state != TCP_STATE_ESTABLISHED) {
-        terminal_write("Error: TCP socket is not in ESTABLISHED state\n");
+        KLOG(&tcp_log, KLOG_DEBUG, "Socket %d is not in ESTABLISHED state\n", socket_id);
         return -1;
     }
     
@@ -314,7 +361,7 @@ int tcp_socket_close(int socket_id) {
     tcp_socket_t* socket = tcp_find_socket(socket_id);
     
     if (!socket) {
-        terminal_write("Error: Invalid TCP socket ID\n");
+        KLOG(&tcp_log, KLOG_DEBUG, "Invalid TCP socket ID %d\n", socket_id);
         return -1;
     }
     
@@ -357,7 +404,7 @@ int tcp_socket_set_option(int socket_id, int option, const void* value, unsigned
     tcp_socket_t* socket = tcp_find_socket(socket_id);
     
     if (!socket) {
-        terminal_write("Error: Invalid TCP socket ID\n");
+        KLOG(&tcp_log, KLOG_DEBUG, "Invalid TCP socket ID %d\n", socket_id);
         return -1;
     }
     
@@ -371,7 +418,7 @@ int tcp_socket_get_option(int socket_id, int option, void* value, unsigned int*
     tcp_socket_t* socket = tcp_find_socket(socket_id);
     
     if (!socket) {
-        terminal_write("Error: Invalid TCP socket ID\n");
+        KLOG(&tcp_log, KLOG_DEBUG, "Invalid TCP socket ID %d\n", socket_id);
         return -1;
     }
     
@@ -385,7 +432,7 @@ int tcp_socket_set_callbacks(int socket_id, int (*on_connect)(tcp_socket_t*), in
     tcp_socket_t* socket = tcp_find_socket(socket_id);
     
     if (!socket) {
-        terminal_write("Error: Invalid TCP socket ID\n");
+        KLOG(&tcp_log, KLOG_DEBUG, "Invalid TCP socket ID %d\n", socket_id);
         return -1;
     }
     
@@ -441,6 +488,12 @@ void tcp_handle_packet(const unsigned char* packet, unsigned int length, unsigne
             break;
         
         case TCP_STATE_ESTABLISHED:
+            // Take an RTT sample when the timed segment is acknowledged
+            if ((header->flags & TCP_ACK) && socket->rtt_timer != 0 && (int) (header->ack_num - socket->rtt_seq) >= 0) {
+                tcp_update_rtt(socket, (unsigned int) ((ktime_get_ns() - socket->rtt_timer) / NSEC_PER_USEC));
+                socket->rtt_timer = 0;
+            }
+            
             // Handle data packets
             if (header->flags & TCP_PSH) {
                 unsigned int data_offset = (header->data_offset >> 4) * 4;
@@ -35,8 +35,11 @@ typedef struct {
     unsigned int recv_seq;
     unsigned int send_window;
     unsigned int recv_window;
-    unsigned int rtt;
-    unsigned int rto;
+    unsigned int rtt;                   // Smoothed round-trip time (us), 0 until measured
+    unsigned int rttvar;                // Round-trip time variation (us)
+    unsigned int rto;                   // Retransmission timeout (us)
+    unsigned long long rtt_timer;       // Send time of the timed segment (ns), 0 if none
+    unsigned int rtt_seq;               // Sequence number that ends the timed segment
     void* send_buffer;
     unsigned int send_buffer_size;
     void* recv_buffer;
@@ -7,6 +7,7 @@
 #include "../kernel/kernel.h"
 #include "../kernel/memory.h"
 #include "../libc/string.h"
+#include "../libc/hashmap.h"
 #include "../kernel/filesystem.h"
 #include "../networking/network.h"
 #include "../security/crypto/crypto.h"
@@ -14,6 +15,9 @@
 // Maximum number of packages
 #define MAX_PACKAGES 1000
 
+// Name lookup table size
+#define PACKAGE_MAP_CAPACITY 2048
+
 // Maximum number of repositories
 #define MAX_REPOSITORIES 100
 
@@ -21,6 +25,10 @@
 static package_t* packages[MAX_PACKAGES];
 static unsigned int package_count = 0;
 
+// Package name index (must be kept in sync with the package array)
+static hashmap_entry_t package_map_entries[PACKAGE_MAP_CAPACITY];
+static hashmap_t package_map;
+
 // Repository array
 static repository_t* repositories[MAX_REPOSITORIES];
 static unsigned int repository_count = 0;
@@ -66,6 +74,7 @@ void package_manager_init() {
     }
     
     package_count = 0;
+    hashmap_init(&package_map, package_map_entries, PACKAGE_MAP_CAPACITY);
     
     // Clear the repository array
     for (int i = 0; i < MAX_REPOSITORIES; i++) {
@@ -376,13 +385,7 @@ package_t* package_get(const char* name) {
         return NULL;
     }
     
-    for (unsigned int i = 0; i < package_count; i++) {
-        if (strcmp(packages[i]->name, name) == 0) {
-            return packages[i];
-        }
-    }
-    
-    return NULL;
+    return (package_t*)hashmap_get(&package_map, name);
 }
 
 // List all packages
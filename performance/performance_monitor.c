@@ -7,6 +7,9 @@
 #include "../kernel/kernel.h"
 #include "../kernel/memory.h"
 #include "../kernel/process.h"
+#include "../kernel/ktime.h"
+#include "../kernel/page_cache.h"
+#include "../drivers/storage.h"
 #include "../libc/string.h"
 
 // Maximum number of performance events
@@ -26,6 +29,9 @@ static performance_threshold_t thresholds[PERF_COUNTER_COUNT];
 // Performance monitor state
 static int monitor_running = 0;
 
+// Device commands counted at the last update
+static unsigned long long last_disk_ios = 0;
+
 // Initialize the performance monitor
 void performance_monitor_init() {
     terminal_write("Initializing performance monitor...\n");
@@ -38,6 +44,7 @@ void performance_monitor_init() {
     counters[PERF_COUNTER_CPU_USAGE].max = 0;
     counters[PERF_COUNTER_CPU_USAGE].total = 0;
     counters[PERF_COUNTER_CPU_USAGE].count = 0;
+    counters[PERF_COUNTER_CPU_USAGE].timestamp = 0;
     
     counters[PERF_COUNTER_MEMORY_USAGE].type = PERF_COUNTER_MEMORY_USAGE;
     strcpy(counters[PERF_COUNTER_MEMORY_USAGE].name, "Memory Usage");
@@ -46,6 +53,7 @@ void performance_monitor_init() {
     counters[PERF_COUNTER_MEMORY_USAGE].max = 0;
     counters[PERF_COUNTER_MEMORY_USAGE].total = 0;
     counters[PERF_COUNTER_MEMORY_USAGE].count = 0;
+    counters[PERF_COUNTER_MEMORY_USAGE].timestamp = 0;
     
     counters[PERF_COUNTER_DISK_IO].type = PERF_COUNTER_DISK_IO;
     strcpy(counters[PERF_COUNTER_DISK_IO].name, "Disk I/O");
@@ -54,6 +62,7 @@ void performance_monitor_init() {
     counters[PERF_COUNTER_DISK_IO].max = 0;
     counters[PERF_COUNTER_DISK_IO].total = 0;
     counters[PERF_COUNTER_DISK_IO].count = 0;
+    counters[PERF_COUNTER_DISK_IO].timestamp = 0;
     
     counters[PERF_COUNTER_NETWORK_IO].type = PERF_COUNTER_NETWORK_IO;
     strcpy(counters[PERF_COUNTER_NETWORK_IO].name, "Network I/O");
@@ -62,6 +71,7 @@ void performance_monitor_init() {
     counters[PERF_COUNTER_NETWORK_IO].max = 0;
     counters[PERF_COUNTER_NETWORK_IO].total = 0;
     counters[PERF_COUNTER_NETWORK_IO].count = 0;
+    counters[PERF_COUNTER_NETWORK_IO].timestamp = 0;
     
     counters[PERF_COUNTER_PROCESS_COUNT].type = PERF_COUNTER_PROCESS_COUNT;
     strcpy(counters[PERF_COUNTER_PROCESS_COUNT].name, "Process Count");
@@ -70,6 +80,7 @@ void performance_monitor_init() {
     counters[PERF_COUNTER_PROCESS_COUNT].max = 0;
     counters[PERF_COUNTER_PROCESS_COUNT].total = 0;
     counters[PERF_COUNTER_PROCESS_COUNT].count = 0;
+    counters[PERF_COUNTER_PROCESS_COUNT].timestamp = 0;
     
     counters[PERF_COUNTER_THREAD_COUNT].type = PERF_COUNTER_THREAD_COUNT;
     strcpy(counters[PERF_COUNTER_THREAD_COUNT].name, "Thread Count");
@@ -78,6 +89,7 @@ void performance_monitor_init() {
     counters[PERF_COUNTER_THREAD_COUNT].max = 0;
     counters[PERF_COUNTER_THREAD_COUNT].total = 0;
     counters[PERF_COUNTER_THREAD_COUNT].count = 0;
+    counters[PERF_COUNTER_THREAD_COUNT].timestamp = 0;
     
     counters[PERF_COUNTER_CONTEXT_SWITCHES].type = PERF_COUNTER_CONTEXT_SWITCHES;
     strcpy(counters[PERF_COUNTER_CONTEXT_SWITCHES].name, "Context Switches");
@@ -86,6 +98,7 @@ void performance_monitor_init() {
     counters[PERF_COUNTER_CONTEXT_SWITCHES].max = 0;
     counters[PERF_COUNTER_CONTEXT_SWITCHES].total = 0;
     counters[PERF_COUNTER_CONTEXT_SWITCHES].count = 0;
+    counters[PERF_COUNTER_CONTEXT_SWITCHES].timestamp = 0;
     
     counters[PERF_COUNTER_INTERRUPTS].type = PERF_COUNTER_INTERRUPTS;
     strcpy(counters[PERF_COUNTER_INTERRUPTS].name, "Interrupts");
@@ -94,6 +107,7 @@ void performance_monitor_init() {
     counters[PERF_COUNTER_INTERRUPTS].max = 0;
     counters[PERF_COUNTER_INTERRUPTS].total = 0;
     counters[PERF_COUNTER_INTERRUPTS].count = 0;
+    counters[PERF_COUNTER_INTERRUPTS].timestamp = 0;
     
     counters[PERF_COUNTER_SYSTEM_CALLS].type = PERF_COUNTER_SYSTEM_CALLS;
     strcpy(counters[PERF_COUNTER_SYSTEM_CALLS].name, "System Calls");
@@ -102,6 +116,7 @@ void performance_monitor_init() {
     counters[PERF_COUNTER_SYSTEM_CALLS].max = 0;
     counters[PERF_COUNTER_SYSTEM_CALLS].total = 0;
     counters[PERF_COUNTER_SYSTEM_CALLS].count = 0;
+    counters[PERF_COUNTER_SYSTEM_CALLS].timestamp = 0;
     
     counters[PERF_COUNTER_PAGE_FAULTS].type = PERF_COUNTER_PAGE_FAULTS;
     strcpy(counters[PERF_COUNTER_PAGE_FAULTS].name, "Page Faults");
@@ -110,6 +125,7 @@ void performance_monitor_init() {
     counters[PERF_COUNTER_PAGE_FAULTS].max = 0;
     counters[PERF_COUNTER_PAGE_FAULTS].total = 0;
     counters[PERF_COUNTER_PAGE_FAULTS].count = 0;
+    counters[PERF_COUNTER_PAGE_FAULTS].timestamp = 0;
     
     counters[PERF_COUNTER_CACHE_HITS].type = PERF_COUNTER_CACHE_HITS;
     strcpy(counters[PERF_COUNTER_CACHE_HITS].name, "Cache Hits");
@@ -118,6 +134,7 @@ void performance_monitor_init() {
     counters[PERF_COUNTER_CACHE_HITS].max = 0;
     counters[PERF_COUNTER_CACHE_HITS].total = 0;
     counters[PERF_COUNTER_CACHE_HITS].count = 0;
+    counters[PERF_COUNTER_CACHE_HITS].timestamp = 0;
     
     counters[PERF_COUNTER_CACHE_MISSES].type = PERF_COUNTER_CACHE_MISSES;
     strcpy(counters[PERF_COUNTER_CACHE_MISSES].name, "Cache Misses");
@@ -126,6 +143,7 @@ void performance_monitor_init() {
     counters[PERF_COUNTER_CACHE_MISSES].max = 0;
     counters[PERF_COUNTER_CACHE_MISSES].total = 0;
     counters[PERF_COUNTER_CACHE_MISSES].count = 0;
+    counters[PERF_COUNTER_CACHE_MISSES].timestamp = 0;
     
     // Initialize thresholds
     for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
@@ -209,11 +227,28 @@ void performance_monitor_update() {
     // In a real system, we would count the number of threads
     counters[PERF_COUNTER_THREAD_COUNT].value = 20;
     
+    // Update cache counters from the page cache
+    page_cache_stats_t cache_stats;
+    page_cache_get_stats(&cache_stats);
+    counters[PERF_COUNTER_CACHE_HITS].value = cache_stats.hits;
+    counters[PERF_COUNTER_CACHE_MISSES].value = cache_stats.misses;
+    
+    // Update disk I/O with the device commands finished since the last update
+    storage_io_stats_t io_stats;
+    storage_get_io_totals(&io_stats);
+    unsigned long long disk_ios = io_stats.ios[STORAGE_OP_READ] + io_stats.ios[STORAGE_OP_WRITE];
+    counters[PERF_COUNTER_DISK_IO].value = disk_ios >= last_disk_ios ? disk_ios - last_disk_ios : disk_ios;
+    last_disk_ios = disk_ios;
+    
     // Update other counters
     // ...
     
     // Update statistics for each counter
+    unsigned long long now = ktime_get_ns();
+
     for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+        counters[i].timestamp = now;
+
         // Update min
         if (counters[i].count == 0 || counters[i].value < counters[i].min) {
             counters[i].min = counters[i].value;
@@ -243,6 +278,7 @@ void performance_monitor_reset() {
         counters[i].max = 0;
         counters[i].total = 0;
         counters[i].count = 0;
+        counters[i].timestamp = 0;
     }
     
     event_count = 0;
@@ -317,6 +353,40 @@ void performance_monitor_print_counters() {
     }
 }
 
+// Print a timestamp as "[seconds.microseconds] "
+static void performance_monitor_write_timestamp(unsigned long long ns) {
+    char buffer[32];
+    int idx = 0;
+    unsigned long long usec = (ns / NSEC_PER_USEC) % 1000000;
+    unsigned long long sec = ns / NSEC_PER_SEC;
+    
+    // Digits are produced in reverse order
+    for (int j = 0; j < 6; j++) {
+        buffer[idx++] = '0' + (usec % 10);
+        usec /= 10;
+    }
+    
+    buffer[idx++] = '.';
+    
+    do {
+        buffer[idx++] = '0' + (sec % 10);
+        sec /= 10;
+    } while (sec > 0);
+    
+    buffer[idx] = '\0';
+    
+    // Reverse the string
+    for (int j = 0; j < idx / 2; j++) {
+        char tmp = buffer[j];
+        buffer[j] = buffer[idx - j - 1];
+        buffer[idx - j - 1] = tmp;
+    }
+    
+    terminal_write("[");
+    terminal_write(buffer);
+    terminal_write("] ");
+}
+
 // Print performance events
 void performance_monitor_print_events() {
     terminal_write("Performance Events:\n");
@@ -338,6 +408,9 @@ void performance_monitor_print_events() {
     for (int i = 0; i < count; i++) {
         int idx = (event_index - count + i + MAX_PERFORMANCE_EVENTS) % MAX_PERFORMANCE_EVENTS;
         
+        // Print the timestamp
+        performance_monitor_write_timestamp(events[idx].timestamp);
+        
         // Print event type
         switch (events[idx].type) {
             case PERF_EVENT_PROCESS_CREATED:
@@ -410,7 +483,7 @@ int performance_monitor_add_event(performance_event_type_t type, unsigned int pr
     events[event_index].type = type;
     events[event_index].process_id = process_id;
     events[event_index].thread_id = thread_id;
-    events[event_index].timestamp = 0; // In a real system, we would get the current time
+    events[event_index].timestamp = ktime_get_ns();
     events[event_index].value = value;
     
     if (description) {
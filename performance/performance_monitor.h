@@ -32,6 +32,7 @@ typedef struct {
     unsigned long long max;
     unsigned long long total;
     unsigned int count;
+    unsigned long long timestamp;       // Time of the last update (ns since boot)
 } performance_counter_t;
 
 // Performance event types
@@ -56,7 +57,7 @@ typedef struct {
     performance_event_type_t type;
     unsigned int process_id;
     unsigned int thread_id;
-    unsigned long long timestamp;
+    unsigned long long timestamp;       // Nanoseconds since boot
     unsigned long long value;
     char description[64];
 } performance_event_t;
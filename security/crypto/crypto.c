@@ -6,6 +6,8 @@
 #include "crypto.h"
 #include "../../kernel/kernel.h"
 #include "../../kernel/memory.h"
+#include "../../kernel/klog.h"
+#include "../../kernel/ktime.h"
 #include "../../libc/string.h"
 #include "../../kernel/filesystem.h"
 
@@ -23,6 +25,23 @@ static unsigned int key_count = 0;
 static certificate_t* certificates[MAX_CERTIFICATES];
 static unsigned int certificate_count = 0;
 
+KLOG_SUBSYSTEM(crypto_log, "crypto");
+
+// Set a new key's creation date to now and its expiration date one year later
+static void crypto_set_key_dates(key_t* key) {
+    rtc_time_t date;
+    ktime_to_date(ktime_get_real(), &date);
+    ktime_format_date(&date, key->creation_date, sizeof(key->creation_date));
+
+    date.year++;
+
+    if (date.month == 2 && date.day == 29) {
+        date.day = 28;
+    }
+
+    ktime_format_date(&date, key->expiration_date, sizeof(key->expiration_date));
+}
+
 // Configuration
 static char key_store[256] = "/etc/crypto/keys";
 static char certificate_store[256] = "/etc/crypto/certificates";
@@ -117,12 +136,8 @@ int crypto_generate_key(key_type_t type, encryption_algorithm_t algorithm, unsig
         return -1;
     }
     
-    // Set the creation date
-    // In a real system, we would get the current date and time
-    strcpy(key->creation_date, "2023-01-01 00:00:00");
-    
-    // Set the expiration date (1 year from creation)
-    strcpy(key->expiration_date, "2024-01-01 00:00:00");
+    // Set the creation and expiration dates (1 year from creation)
+    crypto_set_key_dates(key);
     
     key->revoked = 0;
     key->private_data = NULL;
@@ -179,12 +194,8 @@ int crypto_import_key(const char* data, unsigned int data_size, key_type_t type,
     memcpy(key->data, data, data_size);
     key->data_size = data_size;
     
-    // Set the creation date
-    // In a real system, we would get the current date and time
-    strcpy(key->creation_date, "2023-01-01 00:00:00");
-    
-    // Set the expiration date (1 year from creation)
-    strcpy(key->expiration_date, "2024-01-01 00:00:00");
+    // Set the creation and expiration dates (1 year from creation)
+    crypto_set_key_dates(key);
     
     key->revoked = 0;
     key->private_data = NULL;
@@ -335,9 +346,7 @@ int crypto_encrypt(const char* data, unsigned int data_size, const key_t* key, e
     memcpy(encrypted_data, data, data_size);
     *encrypted_data_size = data_size;
     
-    terminal_write("Encrypted data using key '");
-    terminal_write(key->name);
-    terminal_write("'\n");
+    KLOG(&crypto_log, KLOG_DEBUG, "Encrypted data using key '%s'\n", key->name);
     
     return 0;
 }
@@ -372,9 +381,7 @@ int crypto_decrypt(const char* encrypted_data, unsigned int encrypted_data_size,
     memcpy(data, encrypted_data, encrypted_data_size);
     *data_size = encrypted_data_size;
     
-    terminal_write("Decrypted data using key '");
-    terminal_write(key->name);
-    terminal_write("'\n");
+    KLOG(&crypto_log, KLOG_DEBUG, "Decrypted data using key '%s'\n", key->name);
     
     return 0;
 }
@@ -436,33 +443,7 @@ int crypto_hash(const char* data, unsigned int data_size, hash_algorithm_t algor
     
     *hash_size = required_hash_size;
     
-    terminal_write("Hashed data using algorithm ");
-    switch (algorithm) {
-        case HASH_ALGORITHM_MD5:
-            terminal_write("MD5");
-            break;
-        
-        case HASH_ALGORITHM_SHA1:
-            terminal_write("SHA1");
-            break;
-        
-        case HASH_ALGORITHM_SHA256:
-            terminal_write("SHA256");
-            break;
-        
-        case HASH_ALGORITHM_SHA512:
-            terminal_write("SHA512");
-            break;
-        
-        case HASH_ALGORITHM_CUSTOM:
-            terminal_write("custom");
-            break;
-        
-        default:
-            terminal_write("unknown");
-            break;
-    }
-    terminal_write("\n");
+    KLOG(&crypto_log, KLOG_DEBUG, "Hashed %u bytes using algorithm %u\n", data_size, (unsigned int)algorithm);
     
     return 0;
 }
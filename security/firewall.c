@@ -7,11 +7,15 @@
 #include "../kernel/kernel.h"
 #include "../kernel/memory.h"
 #include "../libc/string.h"
+#include "../libc/hashmap.h"
 #include "../networking/network.h"
 
 // Maximum number of chains
 #define MAX_CHAINS 10
 
+// Chain ID lookup table size
+#define CHAIN_MAP_CAPACITY 16
+
 // Maximum number of rules per chain
 #define MAX_RULES_PER_CHAIN 100
 
@@ -28,6 +32,10 @@
 static firewall_chain_t* chains[MAX_CHAINS];
 static unsigned int chain_count = 0;
 
+// Chain ID index
+static hashmap_entry_t chain_map_entries[CHAIN_MAP_CAPACITY];
+static hashmap_t chain_map;
+
 // Port forward array
 static char* port_forwards[MAX_PORT_FORWARDS];
 static unsigned int port_forward_count = 0;
@@ -62,6 +70,7 @@ void firewall_init() {
     }
     
     chain_count = 0;
+    hashmap_init(&chain_map, chain_map_entries, CHAIN_MAP_CAPACITY);
     
     // Clear the port forward array
     for (int i = 0; i < MAX_PORT_FORWARDS; i++) {
@@ -180,6 +189,16 @@ int firewall_add_chain(const char* name, const char* description, firewall_actio
         chain->rules[i] = NULL;
     }
     
+    // Index the chain by ID
+    if (hashmap_insert(&chain_map, chain->id, chain) != 0) {
+        terminal_write("Error: Chain ID '");
+        terminal_write(chain->id);
+        terminal_write("' is already in use\n");
+        free_blocks(chain->rules, (MAX_RULES_PER_CHAIN * sizeof(firewall_rule_t*) + MEMORY_BLOCK_SIZE - 1) / MEMORY_BLOCK_SIZE);
+        free_block(chain);
+        return -1;
+    }
+    
     // Add the chain to the array
     chains[chain_count++] = chain;
     
@@ -198,9 +217,10 @@ int firewall_remove_chain(const char* id) {
     }
     
     // Find the chain
+    firewall_chain_t* chain = firewall_get_chain(id);
     int index = -1;
-    for (unsigned int i = 0; i < chain_count; i++) {
-        if (strcmp(chains[i]->id, id) == 0) {
+    for (unsigned int i = 0; chain && i < chain_count; i++) {
+        if (chains[i] == chain) {
             index = i;
             break;
         }
@@ -251,6 +271,7 @@ int firewall_remove_chain(const char* id) {
     }
     
     // Free the chain
+    hashmap_remove(&chain_map, chains[index]->id);
     free_block(chains[index]);
     
     // Remove the chain from the array
@@ -325,13 +346,7 @@ firewall_chain_t* firewall_get_chain(const char* id) {
         return NULL;
     }
     
-    for (unsigned int i = 0; i < chain_count; i++) {
-        if (strcmp(chains[i]->id, id) == 0) {
-            return chains[i];
-        }
-    }
-    
-    return NULL;
+    return (firewall_chain_t*)hashmap_get(&chain_map, id);
 }
 
 // List all chains
@@ -8,10 +8,14 @@
 #include "../kernel/memory.h"
 #include "../kernel/filesystem.h"
 #include "../libc/string.h"
+#include "../libc/hashmap.h"
 
 // Maximum number of users
 #define MAX_USERS 64
 
+// Username lookup table size
+#define USER_MAP_CAPACITY 128
+
 // Maximum number of groups
 #define MAX_GROUPS 32
 
@@ -19,6 +23,10 @@
 static user_t* users = NULL;
 static int user_count = 0;
 
+// Username index into the user database
+static hashmap_entry_t user_map_entries[USER_MAP_CAPACITY];
+static hashmap_t user_map;
+
 // Group database
 static group_t* groups = NULL;
 static int group_count = 0;
@@ -123,6 +131,16 @@ void security_manager_init() {
     terminal_write(" groups\n");
 }
 
+// Rebuild the username index (entries point into the users array, so
+// this must run whenever users are moved within it)
+static void security_index_users() {
+    hashmap_init(&user_map, user_map_entries, USER_MAP_CAPACITY);
+    
+    for (int i = 0; i < user_count; i++) {
+        hashmap_insert(&user_map, users[i].username, &users[i]);
+    }
+}
+
 // Load user database
 static int security_load_users() {
     // In a real system, we would:
@@ -153,6 +171,8 @@ static int security_load_users() {
         user_count++;
     }
     
+    security_index_users();
+    
     return 0;
 }
 
@@ -217,13 +237,7 @@ static int security_save_groups() {
 
 // Find a user by username
 static user_t* security_find_user(const char* username) {
-    for (int i = 0; i < user_count; i++) {
-        if (strcmp(users[i].username, username) == 0) {
-            return &users[i];
-        }
-    }
-    
-    return NULL;
+    return (user_t*)hashmap_get(&user_map, username);
 }
 
 // Find a user by UID
@@ -352,6 +366,7 @@ int security_add_user(const char* username, const char* password, unsigned int u
     strcpy(users[user_count].home_directory, home_directory);
     strcpy(users[user_count].shell, shell);
     users[user_count].admin = admin;
+    hashmap_insert(&user_map, users[user_count].username, &users[user_count]);
     
     user_count++;
     
@@ -372,14 +387,8 @@ int security_remove_user(const char* username) {
     }
     
     // Find the user
-    int index = -1;
-    
-    for (int i = 0; i < user_count; i++) {
-        if (strcmp(users[i].username, username) == 0) {
-            index = i;
-            break;
-        }
-    }
+    user_t* user = security_find_user(username);
+    int index = user ? (int)(user - users) : -1;
     
     if (index == -1) {
         terminal_write("Error: User '");
@@ -411,6 +420,7 @@ int security_remove_user(const char* username) {
     }
     
     user_count--;
+    security_index_users();
     
     // Save the user database
     security_save_users();
@@ -0,0 +1,124 @@
+/**
+ * LightOS Testing
+ * Directory entry cache tests implementation
+ *
+ * The cache only compares node pointers, so the tests build a small tree
+ * of nodes of their own and drive the cache directly, without a file
+ * system behind it.
+ */
+
+#include "test_framework.h"
+#include "dcache_tests.h"
+#include "../kernel/kernel.h"
+#include "../kernel/dcache.h"
+#include "../libc/string.h"
+
+// Nodes of the test tree: root/dir/{sub/{f}, other}
+static fs_node_t dcache_test_root;
+static fs_node_t dcache_test_dir;
+static fs_node_t dcache_test_sub;
+static fs_node_t dcache_test_file;
+static fs_node_t dcache_test_other;
+
+// Look up a name; returns 1 if the cache knew the answer
+static int dcache_test_known(fs_node_t* parent, const char* name, fs_node_t** node) {
+    int found;
+    *node = dcache_lookup(parent, name, strlen(name), &found);
+    return found;
+}
+
+// Test that missing names are cached until they are invalidated
+test_result_t test_dcache_negative_entries() {
+    dcache_stats_t before;
+    dcache_stats_t after;
+    fs_node_t* node;
+    
+    dcache_flush();
+    dcache_get_stats(&before);
+    
+    dcache_insert(&dcache_test_dir, "missing", 7, NULL);
+    dcache_insert(&dcache_test_dir, "other", 5, &dcache_test_other);
+    
+    TEST_ASSERT(dcache_test_known(&dcache_test_dir, "missing", &node));
+    TEST_ASSERT_NULL(node);
+    
+    dcache_get_stats(&after);
+    TEST_ASSERT_EQUAL(1, (int) (after.negative_hits - before.negative_hits));
+    
+    // Creating the name drops the negative entry, and only that one
+    dcache_invalidate(&dcache_test_dir, "missing");
+    
+    TEST_ASSERT(!dcache_test_known(&dcache_test_dir, "missing", &node));
+    TEST_ASSERT(dcache_test_known(&dcache_test_dir, "other", &node));
+    TEST_ASSERT(node == &dcache_test_other);
+    
+    dcache_flush();
+    
+    return TEST_RESULT_PASS;
+}
+
+// Test that any invalidation makes cached whole paths stale
+test_result_t test_dcache_path_generation() {
+    fs_node_t* node;
+    
+    dcache_flush();
+    
+    dcache_insert(&dcache_test_root, "dir", 3, &dcache_test_dir);
+    dcache_insert_path(&dcache_test_root, "dir/other", &dcache_test_other);
+    TEST_ASSERT(dcache_lookup_path(&dcache_test_root, "dir/other") == &dcache_test_other);
+    
+    // The path did not go through the name, but the cache cannot tell
+    dcache_invalidate(&dcache_test_sub, "f");
+    
+    TEST_ASSERT_NULL(dcache_lookup_path(&dcache_test_root, "dir/other"));
+    TEST_ASSERT(dcache_test_known(&dcache_test_root, "dir", &node));
+    TEST_ASSERT(node == &dcache_test_dir);
+    
+    // A path cached after the invalidation is valid again
+    dcache_insert_path(&dcache_test_root, "dir/other", &dcache_test_other);
+    TEST_ASSERT(dcache_lookup_path(&dcache_test_root, "dir/other") == &dcache_test_other);
+    
+    dcache_flush();
+    
+    return TEST_RESULT_PASS;
+}
+
+// Test that dropping a node drops its own names and the names below it
+test_result_t test_dcache_invalidate_node() {
+    fs_node_t* node;
+    
+    dcache_flush();
+    
+    dcache_insert(&dcache_test_dir, "sub", 3, &dcache_test_sub);
+    dcache_insert(&dcache_test_dir, "other", 5, &dcache_test_other);
+    dcache_insert(&dcache_test_sub, "f", 1, &dcache_test_file);
+    dcache_insert(&dcache_test_sub, "g", 1, NULL);
+    
+    dcache_invalidate_node(&dcache_test_sub);
+    
+    TEST_ASSERT(!dcache_test_known(&dcache_test_dir, "sub", &node));
+    TEST_ASSERT(!dcache_test_known(&dcache_test_sub, "f", &node));
+    TEST_ASSERT(!dcache_test_known(&dcache_test_sub, "g", &node));
+    TEST_ASSERT(dcache_test_known(&dcache_test_dir, "other", &node));
+    TEST_ASSERT(node == &dcache_test_other);
+    
+    dcache_flush();
+    
+    return TEST_RESULT_PASS;
+}
+
+// Initialize directory entry cache tests
+void dcache_tests_init() {
+    // Add test suites
+    test_add_suite("dcache", "Directory entry cache invalidation");
+    
+    // Add test cases
+    test_add_case("dcache", "negative_entries", "Test caching and invalidating missing names", test_dcache_negative_entries);
+    test_add_case("dcache", "path_generation", "Test that invalidation makes whole paths stale", test_dcache_path_generation);
+    test_add_case("dcache", "invalidate_node", "Test dropping every entry of a node", test_dcache_invalidate_node);
+}
+
+// Run directory entry cache tests
+void dcache_tests_run() {
+    test_run_suite("dcache");
+}
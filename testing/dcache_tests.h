@@ -0,0 +1,13 @@
+/**
+ * LightOS Testing
+ * Directory entry cache tests header
+ */
+
+#ifndef DCACHE_TESTS_H
+#define DCACHE_TESTS_H
+
+// Directory entry cache test functions
+void dcache_tests_init();
+void dcache_tests_run();
+
+#endif /* DCACHE_TESTS_H */
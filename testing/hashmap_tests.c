@@ -0,0 +1,254 @@
+/**
+ * LightOS Testing
+ * Hash map tests implementation
+ *
+ * Checks the Robin Hood placement and backward-shift deletion of the
+ * library's hash map slot by slot. Colliding keys are found by hashing
+ * generated names, so the tests do not depend on particular hash values.
+ */
+
+#include "test_framework.h"
+#include "hashmap_tests.h"
+#include "../kernel/kernel.h"
+#include "../libc/hashmap.h"
+#include "../libc/string.h"
+
+#define HASHMAP_TEST_CAPACITY 16
+#define HASHMAP_TEST_NAMES 1000
+
+// Generated key names ("k0", "k1", ...)
+static char hashmap_test_names[HASHMAP_TEST_NAMES][8];
+
+// Slots of the map under test
+static hashmap_entry_t hashmap_test_entries[HASHMAP_TEST_CAPACITY];
+static hashmap_t hashmap_test_map;
+
+// Build the key names
+static void hashmap_test_make_names() {
+    for (unsigned int i = 0; i < HASHMAP_TEST_NAMES; i++) {
+        char digits[8];
+        unsigned int number = i;
+        unsigned int count = 0;
+    
+        do {
+            digits[count++] = '0' + number % 10;
+            number /= 10;
+        } while (number > 0);
+    
+        hashmap_test_names[i][0] = 'k';
+    
+        for (unsigned int j = 0; j < count; j++) {
+            hashmap_test_names[i][1 + j] = digits[count - 1 - j];
+        }
+    
+        hashmap_test_names[i][1 + count] = '\0';
+    }
+}
+
+// Home slot of a key in the map under test
+static unsigned int hashmap_test_home(const char* key) {
+    return hashmap_hash_string(key) & (HASHMAP_TEST_CAPACITY - 1);
+}
+
+// Find up to count names whose home slot is home; returns how many
+static unsigned int hashmap_test_find(unsigned int home, const char** keys, unsigned int count) {
+    unsigned int found = 0;
+    
+    for (unsigned int i = 0; i < HASHMAP_TEST_NAMES && found < count; i++) {
+        if (hashmap_test_home(hashmap_test_names[i]) == home) {
+            keys[found++] = hashmap_test_names[i];
+        }
+    }
+    
+    return found;
+}
+
+// Get the slot a number of places after home
+static hashmap_entry_t* hashmap_test_slot(unsigned int home, unsigned int offset) {
+    return &hashmap_test_entries[(home + offset) & (HASHMAP_TEST_CAPACITY - 1)];
+}
+
+// Fill the map with four keys homed at slot 3 (A) and one homed at 4 (B),
+// B inserted before the last A
+static test_result_t hashmap_test_fill(const char** a, const char** b) {
+    hashmap_test_make_names();
+    hashmap_init(&hashmap_test_map, hashmap_test_entries, HASHMAP_TEST_CAPACITY);
+    
+    TEST_ASSERT_EQUAL(4, (int) hashmap_test_find(3, a, 4));
+    TEST_ASSERT_EQUAL(1, (int) hashmap_test_find(4, b, 1));
+    
+    TEST_ASSERT_EQUAL(0, hashmap_insert(&hashmap_test_map, a[0], (void*) a[0]));
+    TEST_ASSERT_EQUAL(0, hashmap_insert(&hashmap_test_map, a[1], (void*) a[1]));
+    TEST_ASSERT_EQUAL(0, hashmap_insert(&hashmap_test_map, a[2], (void*) a[2]));
+    TEST_ASSERT_EQUAL(0, hashmap_insert(&hashmap_test_map, b[0], (void*) b[0]));
+    TEST_ASSERT_EQUAL(0, hashmap_insert(&hashmap_test_map, a[3], (void*) a[3]));
+    
+    return TEST_RESULT_PASS;
+}
+
+// Test that an insert takes the slot of a resident closer to its home
+test_result_t test_hashmap_robin_hood() {
+    const char* a[4];
+    const char* b[1];
+    
+    TEST_ASSERT_EQUAL(TEST_RESULT_PASS, hashmap_test_fill(a, b));
+    
+    // A0-A2 fill slots 3-5; B, homed at 4, went on to 6 (distance 2). A3
+    // reached 6 at distance 3, took it and pushed B to 7
+    TEST_ASSERT(hashmap_test_slot(3, 0)->key == a[0] && hashmap_test_slot(3, 0)->distance == 0);
+    TEST_ASSERT(hashmap_test_slot(3, 1)->key == a[1] && hashmap_test_slot(3, 1)->distance == 1);
+    TEST_ASSERT(hashmap_test_slot(3, 2)->key == a[2] && hashmap_test_slot(3, 2)->distance == 2);
+    TEST_ASSERT(hashmap_test_slot(3, 3)->key == a[3] && hashmap_test_slot(3, 3)->distance == 3);
+    TEST_ASSERT(hashmap_test_slot(3, 4)->key == b[0] && hashmap_test_slot(3, 4)->distance == 3);
+    TEST_ASSERT_EQUAL(5, (int) hashmap_count(&hashmap_test_map));
+    
+    for (unsigned int i = 0; i < 4; i++) {
+        TEST_ASSERT(hashmap_get(&hashmap_test_map, a[i]) == a[i]);
+    }
+    
+    TEST_ASSERT(hashmap_get(&hashmap_test_map, b[0]) == b[0]);
+    
+    // A missing key homed in the run stops at the first resident closer to home
+    const char* missing[5];
+    TEST_ASSERT_EQUAL(5, (int) hashmap_test_find(3, missing, 5));
+    TEST_ASSERT_NULL(hashmap_get(&hashmap_test_map, missing[4]));
+    
+    return TEST_RESULT_PASS;
+}
+
+// Test that a removal shifts the rest of the run back, leaving no tombstone
+test_result_t test_hashmap_backward_shift() {
+    const char* a[4];
+    const char* b[1];
+    
+    TEST_ASSERT_EQUAL(TEST_RESULT_PASS, hashmap_test_fill(a, b));
+    TEST_ASSERT(hashmap_remove(&hashmap_test_map, a[1]) == a[1]);
+    
+    TEST_ASSERT(hashmap_test_slot(3, 1)->key == a[2] && hashmap_test_slot(3, 1)->distance == 1);
+    TEST_ASSERT(hashmap_test_slot(3, 2)->key == a[3] && hashmap_test_slot(3, 2)->distance == 2);
+    TEST_ASSERT(hashmap_test_slot(3, 3)->key == b[0] && hashmap_test_slot(3, 3)->distance == 2);
+    TEST_ASSERT_EQUAL(0U, hashmap_test_slot(3, 4)->hash);
+    TEST_ASSERT_EQUAL(4, (int) hashmap_count(&hashmap_test_map));
+    TEST_ASSERT_NULL(hashmap_get(&hashmap_test_map, a[1]));
+    TEST_ASSERT_NULL(hashmap_remove(&hashmap_test_map, a[1]));
+    
+    // The shift stops at an entry in its home slot
+    TEST_ASSERT(hashmap_remove(&hashmap_test_map, a[0]) == a[0]);
+    TEST_ASSERT(hashmap_test_slot(3, 0)->key == a[2] && hashmap_test_slot(3, 0)->distance == 0);
+    TEST_ASSERT(hashmap_test_slot(3, 1)->key == a[3] && hashmap_test_slot(3, 1)->distance == 1);
+    TEST_ASSERT(hashmap_test_slot(3, 2)->key == b[0] && hashmap_test_slot(3, 2)->distance == 1);
+    TEST_ASSERT_EQUAL(0U, hashmap_test_slot(3, 3)->hash);
+    
+    TEST_ASSERT(hashmap_remove(&hashmap_test_map, b[0]) == b[0]);
+    TEST_ASSERT(hashmap_get(&hashmap_test_map, a[2]) == a[2]);
+    TEST_ASSERT(hashmap_get(&hashmap_test_map, a[3]) == a[3]);
+    TEST_ASSERT_EQUAL(2, (int) hashmap_count(&hashmap_test_map));
+    
+    return TEST_RESULT_PASS;
+}
+
+// Test that a key already in the map is refused, wherever it sits
+test_result_t test_hashmap_duplicates() {
+    const char* a[4];
+    const char* b[1];
+    char copy[8];
+    
+    TEST_ASSERT_EQUAL(TEST_RESULT_PASS, hashmap_test_fill(a, b));
+    
+    // Keys compare by content, not by pointer
+    for (unsigned int i = 0; i < 4; i++) {
+        strcpy(copy, a[i]);
+        TEST_ASSERT_EQUAL(-1, hashmap_insert(&hashmap_test_map, copy, copy));
+        TEST_ASSERT(hashmap_get(&hashmap_test_map, a[i]) == a[i]);
+    }
+    
+    strcpy(copy, b[0]);
+    TEST_ASSERT_EQUAL(-1, hashmap_insert(&hashmap_test_map, copy, copy));
+    TEST_ASSERT_EQUAL(5, (int) hashmap_count(&hashmap_test_map));
+    
+    // Once removed, a key can go back in
+    TEST_ASSERT(hashmap_remove(&hashmap_test_map, a[2]) == a[2]);
+    TEST_ASSERT_EQUAL(0, hashmap_insert(&hashmap_test_map, a[2], (void*) a[2]));
+    TEST_ASSERT(hashmap_get(&hashmap_test_map, a[2]) == a[2]);
+    
+    return TEST_RESULT_PASS;
+}
+
+// Test that inserts stop at 7/8 load and lookups still end
+test_result_t test_hashmap_full() {
+    hashmap_test_make_names();
+    hashmap_init(&hashmap_test_map, hashmap_test_entries, HASHMAP_TEST_CAPACITY);
+    
+    for (unsigned int i = 0; i < 14; i++) {
+        TEST_ASSERT_EQUAL(0, hashmap_insert(&hashmap_test_map, hashmap_test_names[i], hashmap_test_names[i]));
+    }
+    
+    TEST_ASSERT_EQUAL(-1, hashmap_insert(&hashmap_test_map, hashmap_test_names[14], hashmap_test_names[14]));
+    TEST_ASSERT_EQUAL(14, (int) hashmap_count(&hashmap_test_map));
+    
+    // Every resident is where its distance says it is
+    for (unsigned int i = 0; i < HASHMAP_TEST_CAPACITY; i++) {
+        hashmap_entry_t* entry = &hashmap_test_entries[i];
+    
+        if (entry->hash != 0) {
+            TEST_ASSERT_EQUAL(i, (hashmap_test_home(entry->key) + entry->distance) & (HASHMAP_TEST_CAPACITY - 1));
+        }
+    }
+    
+    for (unsigned int i = 0; i < 14; i++) {
+        TEST_ASSERT(hashmap_get(&hashmap_test_map, hashmap_test_names[i]) == hashmap_test_names[i]);
+    }
+    
+    for (unsigned int i = 14; i < HASHMAP_TEST_NAMES; i++) {
+        TEST_ASSERT_NULL(hashmap_get(&hashmap_test_map, hashmap_test_names[i]));
+    }
+    
+    // Removing one makes room for one more
+    TEST_ASSERT(hashmap_remove(&hashmap_test_map, hashmap_test_names[5]) == hashmap_test_names[5]);
+    TEST_ASSERT_EQUAL(0, hashmap_insert(&hashmap_test_map, hashmap_test_names[14], hashmap_test_names[14]));
+    TEST_ASSERT(hashmap_get(&hashmap_test_map, hashmap_test_names[14]) == hashmap_test_names[14]);
+    
+    hashmap_clear(&hashmap_test_map);
+    TEST_ASSERT_EQUAL(0, (int) hashmap_count(&hashmap_test_map));
+    TEST_ASSERT_NULL(hashmap_get(&hashmap_test_map, hashmap_test_names[0]));
+    
+    return TEST_RESULT_PASS;
+}
+
+// Test that a name hashes the same inside a longer path as on its own
+test_result_t test_hashmap_hash_bytes() {
+    hashmap_test_make_names();
+    
+    for (unsigned int i = 0; i < HASHMAP_TEST_NAMES; i++) {
+        char path[16];
+        unsigned int length = strlen(hashmap_test_names[i]);
+    
+        strcpy(path, hashmap_test_names[i]);
+        strcpy(path + length, "/x");
+    
+        TEST_ASSERT_EQUAL(hashmap_hash_string(hashmap_test_names[i]), hashmap_hash_bytes(path, length));
+    }
+    
+    // The empty-slot marker is never returned
+    TEST_ASSERT(hashmap_hash_bytes("", 0) != 0);
+    
+    return TEST_RESULT_PASS;
+}
+
+// Initialize hash map tests
+void hashmap_tests_init() {
+    // Add test suites
+    test_add_suite("hashmap", "Hash map placement and deletion");
+    
+    // Add test cases
+    test_add_case("hashmap", "robin_hood", "Test Robin Hood placement on insert", test_hashmap_robin_hood);
+    test_add_case("hashmap", "backward_shift", "Test backward-shift deletion", test_hashmap_backward_shift);
+    test_add_case("hashmap", "duplicates", "Test that duplicate keys are refused", test_hashmap_duplicates);
+    test_add_case("hashmap", "full", "Test a map at its load limit", test_hashmap_full);
+    test_add_case("hashmap", "hash_bytes", "Test hashing a name inside a path", test_hashmap_hash_bytes);
+}
+
+// Run hash map tests
+void hashmap_tests_run() {
+    test_run_suite("hashmap");
+}
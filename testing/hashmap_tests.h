@@ -0,0 +1,13 @@
+/**
+ * LightOS Testing
+ * Hash map tests header
+ */
+
+#ifndef HASHMAP_TESTS_H
+#define HASHMAP_TESTS_H
+
+// Hash map test functions
+void hashmap_tests_init();
+void hashmap_tests_run();
+
+#endif /* HASHMAP_TESTS_H */
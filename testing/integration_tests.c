@@ -4,6 +4,10 @@
  */
 
 #include "test_framework.h"
+#include "storage_tests.h"
+#include "hashmap_tests.h"
+#include "klog_tests.h"
+#include "dcache_tests.h"
 #include "../kernel/kernel.h"
 #include "../kernel/memory.h"
 #include "../kernel/filesystem.h"
@@ -12,6 +16,7 @@
 #include "../drivers/keyboard.h"
 #include "../drivers/mouse.h"
 #include "../drivers/storage.h"
+#include "../drivers/virtio_blk.h"
 #include "../drivers/network_driver.h"
 #include "../networking/network.h"
 #include "../networking/tcp.h"
@@ -120,6 +125,63 @@ test_result_t test_filesystem_integration() {
     return TEST_RESULT_PASS;
 }
 
+// Test ext4 integration
+test_result_t test_ext4_integration() {
+    fs_manager_init();
+    
+    // The disk is only checked if it holds an ext4 volume
+    if (fs_mount("ext4", "hda", "/mnt", 0) != 0) {
+        return TEST_RESULT_SKIP;
+    }
+    
+    filesystem_t* fs = fs_get_filesystem("ext4");
+    TEST_ASSERT_NOT_NULL(fs);
+    
+    // The root directory is found, but cannot be read as a file
+    fs_stat_t stat;
+    char buffer[16];
+    TEST_ASSERT_EQUAL(0, fs->stat(fs, "/", &stat));
+    TEST_ASSERT_EQUAL(-1, fs->read(fs, "/", buffer, sizeof(buffer), 0));
+    TEST_ASSERT_EQUAL(-1, fs->read(fs, "/no/such/file", buffer, sizeof(buffer), 0));
+    
+    TEST_ASSERT_EQUAL(0, fs_unmount("/mnt"));
+    
+    return TEST_RESULT_PASS;
+}
+
+// Test virtio-blk integration
+test_result_t test_virtio_integration() {
+    // Only checked when the machine has a virtio disk
+    block_dev_t* bdev = storage_open("vda");
+    
+    if (!bdev) {
+        return TEST_RESULT_SKIP;
+    }
+    
+    virtio_blk_t* vblk = virtio_blk_get_device(0);
+    TEST_ASSERT_NOT_NULL(vblk);
+    
+    // Read the first and last blocks, then flush; nothing is written
+    unsigned char* buffer = (unsigned char*) allocate_block();
+    TEST_ASSERT_NOT_NULL(buffer);
+    
+    unsigned int count = MEMORY_BLOCK_SIZE / vblk->sector_size;
+    unsigned int last = (unsigned int) (vblk->capacity / (vblk->sector_size / 512)) - count;
+    int first_result = bdev_read_sectors(bdev, 0, count, buffer);
+    int last_result = bdev_read_sectors(bdev, last, count, buffer);
+    int flush_result = bdev_flush(bdev);
+    
+    free_block(buffer);
+    storage_close(bdev);
+    
+    TEST_ASSERT_EQUAL(0, first_result);
+    TEST_ASSERT_EQUAL(0, last_result);
+    TEST_ASSERT_EQUAL(0, flush_result);
+    TEST_ASSERT_EQUAL(0, vblk->failed);
+    
+    return TEST_RESULT_PASS;
+}
+
 // Test networking integration
 test_result_t test_networking_integration() {
     // Initialize networking
@@ -328,16 +390,28 @@ void integration_tests_init() {
     test_add_case("integration", "storage_driver", "Test storage driver integration", test_storage_driver_integration);
     test_add_case("integration", "network_driver", "Test network driver integration", test_network_driver_integration);
     test_add_case("integration", "filesystem", "Test file system integration", test_filesystem_integration);
+    test_add_case("integration", "ext4", "Test ext4 integration", test_ext4_integration);
+    test_add_case("integration", "virtio", "Test virtio-blk integration", test_virtio_integration);
     test_add_case("integration", "networking", "Test networking integration", test_networking_integration);
     test_add_case("integration", "gui", "Test GUI integration", test_gui_integration);
     test_add_case("integration", "server", "Test server integration", test_server_integration);
     test_add_case("integration", "package_manager", "Test package manager integration", test_package_manager_integration);
     test_add_case("integration", "security", "Test security integration", test_security_integration);
     test_add_case("integration", "performance", "Test performance monitor integration", test_performance_integration);
+    
+    // Block layer tests run on a memory device of their own
+    storage_tests_init();
+    hashmap_tests_init();
+    klog_tests_init();
+    dcache_tests_init();
 }
 
 // Run integration tests
 void integration_tests_run() {
     // Run all integration tests
     test_run_suite("integration");
+    storage_tests_run();
+    hashmap_tests_run();
+    klog_tests_run();
+    dcache_tests_run();
 }
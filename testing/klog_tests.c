@@ -0,0 +1,126 @@
+/**
+ * LightOS Testing
+ * Kernel log tests implementation
+ *
+ * Records are formatted when they are read, long after the call that
+ * logged them. These tests log strings from a memory block, wipe and free
+ * the block, and only then read the records back.
+ */
+
+#include "test_framework.h"
+#include "klog_tests.h"
+#include "../kernel/kernel.h"
+#include "../kernel/klog.h"
+#include "../kernel/memory.h"
+#include "../libc/string.h"
+
+KLOG_SUBSYSTEM(klog_test_log, "klogtest");
+
+// Log level saved while a test records debug messages
+static klog_level_t klog_test_saved_level;
+
+// Record debug messages without echoing them
+static void klog_test_begin() {
+    klog_test_saved_level = klog_record_level;
+    klog_set_record_level(KLOG_DEBUG);
+}
+
+// Restore the recording threshold
+static void klog_test_end() {
+    klog_set_record_level(klog_test_saved_level);
+}
+
+// Find the next test record at or after *seq and format its message;
+// returns 1 if one was found
+static int klog_test_next(unsigned long long* seq, char* message, unsigned int size) {
+    klog_record_t record;
+    
+    while (klog_read(seq, &record)) {
+        if (record.subsystem == klog_test_log.name) {
+            klog_format(&record, message, size);
+            return 1;
+        }
+    }
+    
+    return 0;
+}
+
+// Test that %s arguments outlive the caller's buffer
+test_result_t test_klog_string_copy() {
+    char message[KLOG_LINE_SIZE];
+    unsigned long long seq = klog_next_seq();
+    char* name = (char*) allocate_block();
+    
+    TEST_ASSERT_NOT_NULL(name);
+    
+    klog_test_begin();
+    strcpy(name, "vda");
+    KLOG(&klog_test_log, KLOG_DEBUG, "%s: %u sectors\n", name, 2048);
+    strcpy(name, "/mnt/data");
+    KLOG(&klog_test_log, KLOG_DEBUG, "Mounted %s on %s (%d)\n", "ext4", name, -5);
+    KLOG(&klog_test_log, KLOG_DEBUG, "Missing %s\n", (const char*) NULL);
+    klog_test_end();
+    
+    memset(name, 'X', MEMORY_BLOCK_SIZE - 1);
+    name[MEMORY_BLOCK_SIZE - 1] = '\0';
+    free_block(name);
+    
+    TEST_ASSERT(klog_test_next(&seq, message, sizeof(message)));
+    TEST_ASSERT_STRING_EQUAL("vda: 2048 sectors\n", message);
+    TEST_ASSERT(klog_test_next(&seq, message, sizeof(message)));
+    TEST_ASSERT_STRING_EQUAL("Mounted ext4 on /mnt/data (-5)\n", message);
+    TEST_ASSERT(klog_test_next(&seq, message, sizeof(message)));
+    TEST_ASSERT_STRING_EQUAL("Missing (null)\n", message);
+    
+    return TEST_RESULT_PASS;
+}
+
+// Test that strings beyond the record's string area are cut short
+test_result_t test_klog_string_truncation() {
+    char message[KLOG_LINE_SIZE];
+    char expected[KLOG_LINE_SIZE];
+    unsigned long long seq = klog_next_seq();
+    char* path = (char*) allocate_block();
+    
+    TEST_ASSERT_NOT_NULL(path);
+    
+    memset(path, 'p', 2 * KLOG_STRING_SIZE);
+    path[2 * KLOG_STRING_SIZE] = '\0';
+    
+    klog_test_begin();
+    KLOG(&klog_test_log, KLOG_DEBUG, "<%s><%s><%u>\n", path, "after", 7);
+    klog_test_end();
+    
+    memset(path, 'X', 2 * KLOG_STRING_SIZE);
+    free_block(path);
+    
+    // The first string fills the area, so the second comes out empty
+    unsigned int pos = 0;
+    expected[pos++] = '<';
+    
+    for (unsigned int i = 0; i < KLOG_STRING_SIZE - 1; i++) {
+        expected[pos++] = 'p';
+    }
+    
+    strcpy(expected + pos, "><><7>\n");
+    
+    TEST_ASSERT(klog_test_next(&seq, message, sizeof(message)));
+    TEST_ASSERT_STRING_EQUAL(expected, message);
+    
+    return TEST_RESULT_PASS;
+}
+
+// Initialize kernel log tests
+void klog_tests_init() {
+    // Add test suites
+    test_add_suite("klog", "Kernel log record capture");
+    
+    // Add test cases
+    test_add_case("klog", "string_copy", "Test that logged strings are copied", test_klog_string_copy);
+    test_add_case("klog", "string_truncation", "Test truncation of long logged strings", test_klog_string_truncation);
+}
+
+// Run kernel log tests
+void klog_tests_run() {
+    test_run_suite("klog");
+}
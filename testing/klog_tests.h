@@ -0,0 +1,13 @@
+/**
+ * LightOS Testing
+ * Kernel log tests header
+ */
+
+#ifndef KLOG_TESTS_H
+#define KLOG_TESTS_H
+
+// Kernel log test functions
+void klog_tests_init();
+void klog_tests_run();
+
+#endif /* KLOG_TESTS_H */
@@ -0,0 +1,778 @@
+/**
+ * LightOS Testing
+ * Storage tests implementation
+ *
+ * Exercises the block layer, and the caches and journal above it, against
+ * a device kept in memory, whose contents are checked against a shadow
+ * copy. Nothing here needs hardware, so the suite runs in the kernel and in
+ * the host tests.
+ */
+
+#include "test_framework.h"
+#include "storage_tests.h"
+#include "../kernel/kernel.h"
+#include "../kernel/memory.h"
+#include "../kernel/jbd2.h"
+#include "../kernel/page_cache.h"
+#include "../kernel/klog.h"
+#include "../drivers/storage.h"
+#include "../drivers/storage_ring.h"
+#include "../libc/string.h"
+
+#define STORAGE_TEST_DEVICE "test0"
+#define STORAGE_TEST_SECTORS 1024
+#define STORAGE_TEST_BLOCKS (STORAGE_TEST_SECTORS * 512 / MEMORY_BLOCK_SIZE)
+
+// Memory device state
+static unsigned char* storage_test_disk = NULL;
+static unsigned char* storage_test_shadow = NULL;
+static unsigned int storage_test_commands = 0;
+static unsigned int storage_test_fail_sector = 0xFFFFFFFF;
+
+// Journal on the memory device, if a test has one loaded
+static jbd2_journal_t* storage_test_journal = NULL;
+static block_dev_t* storage_test_bdev = NULL;
+
+// Pseudo-random numbers (reproducible across runs)
+static unsigned int storage_test_seed = 1;
+
+static unsigned int storage_test_random() {
+    storage_test_seed = storage_test_seed * 1103515245 + 12345;
+    return storage_test_seed >> 8;
+}
+
+// Memory device read function (fails reads of the chosen sector)
+static int storage_test_read(storage_device_t* dev, unsigned int start_sector, unsigned int sector_count, void* buffer) {
+    (void) dev;
+    
+    if (storage_test_fail_sector - start_sector < sector_count) {
+        return -1;
+    }
+    
+    memcpy(buffer, storage_test_disk + start_sector * 512, sector_count * 512);
+    
+    return 0;
+}
+
+// Memory device write function (counts the commands that reach it)
+static int storage_test_write(storage_device_t* dev, unsigned int start_sector, unsigned int sector_count, const void* buffer) {
+    (void) dev;
+    
+    memcpy(storage_test_disk + start_sector * 512, buffer, sector_count * 512);
+    storage_test_commands++;
+    
+    return 0;
+}
+
+// Register the memory device over its current contents
+static int storage_test_register(unsigned int read_only) {
+    storage_device_t device;
+    memset(&device, 0, sizeof(storage_device_t));
+    strcpy(device.name, STORAGE_TEST_DEVICE);
+    device.type = STORAGE_TYPE_UNKNOWN;
+    device.size = STORAGE_TEST_SECTORS * 512;
+    device.sector_size = 512;
+    device.read_only = read_only;
+    device.read_sectors = storage_test_read;
+    device.write_sectors = storage_test_write;
+    
+    return storage_register_device(&device);
+}
+
+// Register the memory device, zeroed, with a matching shadow copy
+static int storage_test_setup() {
+    storage_test_disk = (unsigned char*) allocate_blocks(STORAGE_TEST_BLOCKS);
+    storage_test_shadow = (unsigned char*) allocate_blocks(STORAGE_TEST_BLOCKS);
+    
+    if (!storage_test_disk || !storage_test_shadow) {
+        return -1;
+    }
+    
+    memset(storage_test_disk, 0, STORAGE_TEST_SECTORS * 512);
+    memset(storage_test_shadow, 0, STORAGE_TEST_SECTORS * 512);
+    storage_test_commands = 0;
+    storage_test_seed = 1;
+    
+    return storage_test_register(0);
+}
+
+// Unregister the memory device and free its memory
+static void storage_test_teardown() {
+    if (storage_test_journal) {
+        jbd2_destroy(storage_test_journal);
+        storage_test_journal = NULL;
+    }
+    
+    if (storage_test_bdev) {
+        storage_close(storage_test_bdev);
+        storage_test_bdev = NULL;
+    }
+    
+    storage_unregister_device(STORAGE_TEST_DEVICE);
+    free_blocks(storage_test_disk, STORAGE_TEST_BLOCKS);
+    free_blocks(storage_test_shadow, STORAGE_TEST_BLOCKS);
+    storage_test_disk = NULL;
+    storage_test_shadow = NULL;
+}
+
+// Write sectors through the block layer and to the shadow copy
+static int storage_test_write_both(unsigned int start_sector, unsigned int sector_count, const void* buffer) {
+    memcpy(storage_test_shadow + start_sector * 512, buffer, sector_count * 512);
+    
+    return storage_write_sectors(STORAGE_TEST_DEVICE, start_sector, sector_count, buffer);
+}
+
+// Random plugged writes with reads in between
+static test_result_t storage_test_queue_shadow() {
+    unsigned char buffer[8 * 512];
+    unsigned char read_back[8 * 512];
+    
+    storage_plug();
+    
+    for (unsigned int i = 0; i < 3000; i++) {
+        unsigned int start = storage_test_random() % (STORAGE_TEST_SECTORS - 8);
+        unsigned int count = 1 + storage_test_random() % 8;
+    
+        for (unsigned int j = 0; j < count * 512; j++) {
+            buffer[j] = (unsigned char) storage_test_random();
+        }
+    
+        TEST_ASSERT_EQUAL(0, storage_test_write_both(start, count, buffer));
+    
+        // Reads see the queued writes they overlap
+        if (i % 100 == 0) {
+            start = storage_test_random() % (STORAGE_TEST_SECTORS - 8);
+            TEST_ASSERT_EQUAL(0, storage_read_sectors(STORAGE_TEST_DEVICE, start, 8, read_back));
+            TEST_ASSERT_EQUAL(0, memcmp(read_back, storage_test_shadow + start * 512, sizeof(read_back)));
+        }
+    }
+    
+    TEST_ASSERT_EQUAL(0, storage_unplug());
+    TEST_ASSERT_EQUAL(0, memcmp(storage_test_disk, storage_test_shadow, STORAGE_TEST_SECTORS * 512));
+    
+    // Merging and in-place rewrites leave far fewer commands than writes
+    storage_queue_stats_t stats;
+    TEST_ASSERT_EQUAL(0, storage_get_queue_stats(STORAGE_TEST_DEVICE, &stats));
+    TEST_ASSERT_EQUAL(3000ULL, stats.requests);
+    TEST_ASSERT(storage_test_commands < 3000);
+    TEST_ASSERT_EQUAL((unsigned long long) storage_test_commands, stats.dispatched);
+    
+    return TEST_RESULT_PASS;
+}
+
+// Test that plugged random writes reach the device intact
+test_result_t test_storage_queue_shadow() {
+    TEST_ASSERT_EQUAL(0, storage_test_setup());
+    
+    test_result_t result = storage_test_queue_shadow();
+    
+    storage_test_teardown();
+    
+    return result;
+}
+
+// Test that contiguous writes issued backwards are merged
+test_result_t test_storage_queue_merge() {
+    unsigned char buffer[4096];
+    
+    TEST_ASSERT_EQUAL(0, storage_test_setup());
+    
+    // 128 x 4K backwards, front-merged up to 128K per command
+    storage_plug();
+    
+    for (int i = 127; i >= 0; i--) {
+        memset(buffer, i, sizeof(buffer));
+        storage_test_write_both(i * 8, 8, buffer);
+    }
+    
+    int result = storage_unplug();
+    unsigned int commands = storage_test_commands;
+    
+    // Without a plug, a write goes straight to the device
+    memset(buffer, 0xFF, sizeof(buffer));
+    storage_test_write_both(1000, 1, buffer);
+    unsigned int direct = storage_test_commands - commands;
+    
+    int same = memcmp(storage_test_disk, storage_test_shadow, STORAGE_TEST_SECTORS * 512) == 0;
+    
+    storage_test_teardown();
+    
+    TEST_ASSERT_EQUAL(0, result);
+    TEST_ASSERT(same);
+    TEST_ASSERT(commands >= 4 && commands <= 8);
+    TEST_ASSERT_EQUAL(1, direct);
+    
+    return TEST_RESULT_PASS;
+}
+
+// Test that a failed ring read is reported with the device name, which
+// is freed with the device before the log is read
+test_result_t test_storage_ring_error() {
+    storage_ring_t ring;
+    storage_cqe_t cqe;
+    klog_record_t record;
+    char message[KLOG_LINE_SIZE];
+    unsigned char* buffer = (unsigned char*) allocate_block();
+    
+    TEST_ASSERT_NOT_NULL(buffer);
+    TEST_ASSERT_EQUAL(0, storage_test_setup());
+    
+    unsigned long long seq = klog_next_seq();
+    block_dev_t* bdev = storage_open(STORAGE_TEST_DEVICE);
+    int opened = bdev != NULL && storage_ring_init(&ring, 8, NULL, NULL) == 0;
+    unsigned int reaped = 0;
+    
+    if (opened) {
+        storage_test_fail_sector = 20;
+        storage_ring_prep_read(storage_ring_get_sqe(&ring), bdev, 16, 8, buffer, buffer);
+        storage_ring_wait(&ring, 1);
+        reaped = storage_ring_reap(&ring, &cqe, 1);
+        storage_test_fail_sector = 0xFFFFFFFF;
+        storage_ring_destroy(&ring);
+    }
+    
+    if (bdev) {
+        storage_close(bdev);
+    }
+    
+    storage_test_teardown();
+    free_block(buffer);
+    
+    TEST_ASSERT(opened);
+    TEST_ASSERT_EQUAL(1, (int) reaped);
+    TEST_ASSERT_EQUAL(-1, cqe.result);
+    
+    int found = 0;
+    
+    while (!found && klog_read(&seq, &record)) {
+        found = record.subsystem && strcmp(record.subsystem, "storage_ring") == 0;
+    }
+    
+    TEST_ASSERT(found);
+    klog_format(&record, message, sizeof(message));
+    TEST_ASSERT_STRING_EQUAL(STORAGE_TEST_DEVICE ": read of 8 sectors at 16 failed\n", message);
+    
+    return TEST_RESULT_PASS;
+}
+
+// Page cache mappings written back through a log of page indices
+#define STORAGE_TEST_LOG_SIZE 64
+
+static unsigned int storage_test_log[STORAGE_TEST_LOG_SIZE];
+static unsigned int storage_test_logged = 0;
+static unsigned int storage_test_fail_index = 0xFFFFFFFF;
+static int storage_test_owner;
+static int storage_test_other_owner;
+
+// Mapping read function (pages start zeroed)
+static int storage_test_readpage(page_mapping_t* mapping, unsigned int index, void* buffer) {
+    (void) mapping;
+    (void) index;
+    
+    memset(buffer, 0, PAGE_CACHE_PAGE_SIZE);
+    
+    return 0;
+}
+
+// Mapping write function (logs the page, or fails the chosen one)
+static int storage_test_writepage(page_mapping_t* mapping, unsigned int index, const void* buffer) {
+    (void) mapping;
+    (void) buffer;
+    
+    if (index == storage_test_fail_index) {
+        return -1;
+    }
+    
+    if (storage_test_logged < STORAGE_TEST_LOG_SIZE) {
+        storage_test_log[storage_test_logged] = index;
+    }
+    
+    storage_test_logged++;
+    
+    return 0;
+}
+
+static const page_mapping_ops_t storage_test_mapping_ops = {storage_test_readpage, storage_test_writepage};
+
+// Test that a sync writes a mapping's dirty pages in page order
+test_result_t test_storage_writeback_order() {
+    static const unsigned int dirtied[] = {70000, 5, 4096, 3, 64, 63, 262144, 0};
+    static const unsigned int sorted[] = {0, 3, 5, 63, 64, 4096, 70000, 262144};
+    unsigned char buffer[100];
+    
+    page_mapping_t* mapping = page_cache_get_mapping(&storage_test_owner, 1, &storage_test_mapping_ops, NULL);
+    TEST_ASSERT_NOT_NULL(mapping);
+    
+    memset(buffer, 0xA5, sizeof(buffer));
+    storage_test_logged = 0;
+    
+    for (unsigned int i = 0; i < 8; i++) {
+        TEST_ASSERT_EQUAL(100, page_cache_write(mapping, (unsigned long long) dirtied[i] * PAGE_CACHE_PAGE_SIZE, buffer, sizeof(buffer)));
+    }
+    
+    unsigned int dirty = mapping->nr_dirty;
+    int result = page_cache_sync(mapping);
+    unsigned int logged = storage_test_logged;
+    int ordered = logged == 8;
+    
+    for (unsigned int i = 0; ordered && i < 8; i++) {
+        ordered = storage_test_log[i] == sorted[i];
+    }
+    
+    unsigned int left = mapping->nr_dirty;
+    page_cache_release_mapping(mapping);
+    page_cache_drop_owner(&storage_test_owner);
+    
+    TEST_ASSERT_EQUAL(8, (int) dirty);
+    TEST_ASSERT_EQUAL(0, result);
+    TEST_ASSERT(ordered);
+    TEST_ASSERT_EQUAL(0, (int) left);
+    
+    return TEST_RESULT_PASS;
+}
+
+// Test that syncing one owner leaves other owners' pages dirty
+test_result_t test_storage_writeback_owner() {
+    unsigned char buffer[PAGE_CACHE_PAGE_SIZE];
+    
+    page_mapping_t* mine = page_cache_get_mapping(&storage_test_owner, 1, &storage_test_mapping_ops, NULL);
+    page_mapping_t* other = page_cache_get_mapping(&storage_test_other_owner, 1, &storage_test_mapping_ops, NULL);
+    TEST_ASSERT_NOT_NULL(mine);
+    TEST_ASSERT_NOT_NULL(other);
+    
+    memset(buffer, 0x3C, sizeof(buffer));
+    
+    for (unsigned int i = 0; i < 4; i++) {
+        page_cache_write(mine, i * PAGE_CACHE_PAGE_SIZE, buffer, sizeof(buffer));
+        page_cache_write(other, i * PAGE_CACHE_PAGE_SIZE, buffer, sizeof(buffer));
+    }
+    
+    page_cache_write(other, 4 * PAGE_CACHE_PAGE_SIZE, buffer, sizeof(buffer));
+    
+    storage_test_logged = 0;
+    int result = page_cache_sync_owner(&storage_test_other_owner);
+    unsigned int logged = storage_test_logged;
+    unsigned int mine_dirty = mine->nr_dirty;
+    unsigned int other_dirty = other->nr_dirty;
+    
+    page_cache_release_mapping(mine);
+    page_cache_release_mapping(other);
+    page_cache_drop_owner(&storage_test_owner);
+    page_cache_drop_owner(&storage_test_other_owner);
+    
+    TEST_ASSERT_EQUAL(0, result);
+    TEST_ASSERT_EQUAL(5, (int) logged);
+    TEST_ASSERT_EQUAL(4, (int) mine_dirty);
+    TEST_ASSERT_EQUAL(0, (int) other_dirty);
+    
+    return TEST_RESULT_PASS;
+}
+
+// Test that a page whose writeback fails stays dirty and fails the sync
+test_result_t test_storage_writeback_error() {
+    unsigned char buffer[10];
+    page_cache_stats_t before;
+    page_cache_stats_t after;
+    
+    page_mapping_t* mapping = page_cache_get_mapping(&storage_test_owner, 1, &storage_test_mapping_ops, NULL);
+    TEST_ASSERT_NOT_NULL(mapping);
+    
+    page_cache_get_stats(&before);
+    memset(buffer, 0x77, sizeof(buffer));
+    page_cache_write(mapping, 7 * PAGE_CACHE_PAGE_SIZE, buffer, sizeof(buffer));
+    page_cache_write(mapping, 8 * PAGE_CACHE_PAGE_SIZE, buffer, sizeof(buffer));
+    
+    storage_test_logged = 0;
+    storage_test_fail_index = 7;
+    int failed = page_cache_sync(mapping);
+    unsigned int failed_dirty = mapping->nr_dirty;
+    
+    storage_test_fail_index = 0xFFFFFFFF;
+    int retried = page_cache_sync(mapping);
+    unsigned int retried_dirty = mapping->nr_dirty;
+    unsigned int logged = storage_test_logged;
+    
+    // Invalidating a dirty mapping drops its pages from the dirty count
+    page_cache_write(mapping, 0, buffer, sizeof(buffer));
+    page_cache_invalidate(mapping);
+    page_cache_get_stats(&after);
+    unsigned int invalidated_dirty = mapping->nr_dirty;
+    
+    page_cache_release_mapping(mapping);
+    page_cache_drop_owner(&storage_test_owner);
+    
+    TEST_ASSERT(failed != 0);
+    TEST_ASSERT_EQUAL(1, (int) failed_dirty);
+    TEST_ASSERT_EQUAL(0, retried);
+    TEST_ASSERT_EQUAL(0, (int) retried_dirty);
+    TEST_ASSERT_EQUAL(2, (int) logged);
+    TEST_ASSERT_EQUAL(0, (int) invalidated_dirty);
+    TEST_ASSERT_EQUAL(before.dirty_pages, after.dirty_pages);
+    
+    return TEST_RESULT_PASS;
+}
+
+// Journal layout: 1K blocks, 128 log blocks in two extents (logical 0-63
+// at block 128, 64-127 at block 320); home blocks lie below block 128
+#define STORAGE_TEST_BLOCK_SIZE 1024
+#define STORAGE_TEST_JOURNAL_BLOCKS 128
+#define STORAGE_TEST_JOURNAL_SEQUENCE 5
+
+// Journal superblock fields the tests read or corrupt
+#define STORAGE_TEST_JOURNAL_START    0x1C
+#define STORAGE_TEST_JOURNAL_INCOMPAT 0x28
+
+// Journal block map
+static int storage_test_journal_bmap(void* context, unsigned int logical, unsigned long long* physical, unsigned int* run) {
+    (void) context;
+    
+    if (logical >= STORAGE_TEST_JOURNAL_BLOCKS) {
+        return -1;
+    }
+    
+    if (logical < 64) {
+        *physical = 128 + logical;
+        *run = 64 - logical;
+    } else {
+        *physical = 320 + logical - 64;
+        *run = STORAGE_TEST_JOURNAL_BLOCKS - logical;
+    }
+    
+    return 0;
+}
+
+// Get a block of the device (or of the snapshot in the shadow copy)
+static unsigned char* storage_test_block(unsigned char* disk, unsigned long long block) {
+    return disk + block * STORAGE_TEST_BLOCK_SIZE;
+}
+
+// Get a log block of the device (or of the snapshot)
+static unsigned char* storage_test_journal_block(unsigned char* disk, unsigned int logical) {
+    unsigned long long physical = 0;
+    unsigned int run = 0;
+    
+    storage_test_journal_bmap(NULL, logical, &physical, &run);
+    
+    return storage_test_block(disk, physical);
+}
+
+// Big-endian fields, as the journal stores them
+static void storage_test_put_be32(unsigned char* field, unsigned int value) {
+    field[0] = (unsigned char) (value >> 24);
+    field[1] = (unsigned char) (value >> 16);
+    field[2] = (unsigned char) (value >> 8);
+    field[3] = (unsigned char) value;
+}
+
+static unsigned int storage_test_get_be32(const unsigned char* field) {
+    return ((unsigned int) field[0] << 24) | ((unsigned int) field[1] << 16) | ((unsigned int) field[2] << 8) | field[3];
+}
+
+// Write a clean journal superblock (v2, log from block 1)
+static void storage_test_journal_format() {
+    unsigned char* superblock = storage_test_journal_block(storage_test_disk, 0);
+    
+    memset(superblock, 0, STORAGE_TEST_BLOCK_SIZE);
+    storage_test_put_be32(superblock, JBD2_MAGIC);
+    storage_test_put_be32(superblock + 4, JBD2_SUPERBLOCK_V2);
+    storage_test_put_be32(superblock + 0x0C, STORAGE_TEST_BLOCK_SIZE);
+    storage_test_put_be32(superblock + 0x10, STORAGE_TEST_JOURNAL_BLOCKS);
+    storage_test_put_be32(superblock + 0x14, 1);
+    storage_test_put_be32(superblock + 0x18, STORAGE_TEST_JOURNAL_SEQUENCE);
+    
+    for (unsigned int i = 0; i < 16; i++) {
+        superblock[0x30 + i] = (unsigned char) i;
+    }
+}
+
+// Load the journal from the memory device (recovering it if needed)
+static jbd2_journal_t* storage_test_journal_load() {
+    storage_test_bdev = storage_open(STORAGE_TEST_DEVICE);
+    
+    if (!storage_test_bdev) {
+        return NULL;
+    }
+    
+    storage_test_journal = jbd2_load(storage_test_bdev, page_cache_get_device(storage_test_bdev), STORAGE_TEST_BLOCK_SIZE,
+                                     storage_test_journal_bmap, NULL, STORAGE_TEST_JOURNAL_BLOCKS);
+    
+    if (!storage_test_journal) {
+        storage_close(storage_test_bdev);
+        storage_test_bdev = NULL;
+    }
+    
+    return storage_test_journal;
+}
+
+// Close the journal, checkpointing it, and the device handle
+static int storage_test_journal_unload() {
+    int result = jbd2_destroy(storage_test_journal);
+    
+    storage_close(storage_test_bdev);
+    storage_test_journal = NULL;
+    storage_test_bdev = NULL;
+    
+    return result;
+}
+
+// Copy the device into the shadow copy, as a crash at this point would leave it
+static void storage_test_snapshot() {
+    memcpy(storage_test_shadow, storage_test_disk, STORAGE_TEST_SECTORS * 512);
+}
+
+// Restart the device from the snapshot, dropping everything it has cached
+static int storage_test_crash(unsigned int read_only) {
+    storage_unregister_device(STORAGE_TEST_DEVICE);
+    memcpy(storage_test_disk, storage_test_shadow, STORAGE_TEST_SECTORS * 512);
+    
+    return storage_test_register(read_only);
+}
+
+// Fill a block in a handle of its own
+static int storage_test_journal_modify(unsigned long long block, unsigned char value) {
+    jbd2_handle_t handle;
+    
+    if (jbd2_start(storage_test_journal, 2, &handle) != 0) {
+        return -1;
+    }
+    
+    unsigned char* data = jbd2_get_write_access(&handle, block);
+    
+    if (data) {
+        memset(data, value, STORAGE_TEST_BLOCK_SIZE);
+    }
+    
+    return jbd2_stop(&handle) == 0 && data ? 0 : -1;
+}
+
+// Commit transaction 5 (blocks 10, starting with the journal magic, and 11)
+static test_result_t storage_test_journal_first() {
+    jbd2_handle_t handle;
+    
+    storage_test_journal_format();
+    TEST_ASSERT_NOT_NULL(storage_test_journal_load());
+    TEST_ASSERT_EQUAL(2, (int) storage_test_journal->extent_count);
+    TEST_ASSERT_EQUAL(STORAGE_TEST_JOURNAL_SEQUENCE, (int) jbd2_running_tid(storage_test_journal));
+    
+    TEST_ASSERT_EQUAL(0, jbd2_start(storage_test_journal, 4, &handle));
+    unsigned char* data = jbd2_get_write_access(&handle, 10);
+    TEST_ASSERT_NOT_NULL(data);
+    memset(data, 0xAA, STORAGE_TEST_BLOCK_SIZE);
+    storage_test_put_be32(data, JBD2_MAGIC);
+    
+    data = jbd2_get_write_access(&handle, 11);
+    TEST_ASSERT_NOT_NULL(data);
+    memset(data, 0xBB, STORAGE_TEST_BLOCK_SIZE);
+    TEST_ASSERT(jbd2_get_write_access(&handle, 11) == data);
+    TEST_ASSERT_EQUAL(0, jbd2_stop(&handle));
+    
+    // Blocks in the running transaction are pinned: a cache sync leaves
+    // their homes alone
+    page_cache_sync(storage_test_journal->cache);
+    TEST_ASSERT_EQUAL(0, storage_test_block(storage_test_disk, 10)[5]);
+    TEST_ASSERT_EQUAL(0, storage_test_block(storage_test_disk, 11)[5]);
+    
+    TEST_ASSERT_EQUAL(0, jbd2_commit_tid(storage_test_journal, STORAGE_TEST_JOURNAL_SEQUENCE));
+    TEST_ASSERT_EQUAL(STORAGE_TEST_JOURNAL_SEQUENCE, (int) storage_test_journal->committed_tid);
+    
+    return TEST_RESULT_PASS;
+}
+
+// Commits, crash and replay of a journal with an escaped block
+static test_result_t storage_test_journal_replay() {
+    unsigned char* disk = storage_test_disk;
+    
+    TEST_ASSERT_EQUAL(TEST_RESULT_PASS, storage_test_journal_first());
+    
+    // A second fsync of the same transaction is free
+    unsigned int commands = storage_test_commands;
+    TEST_ASSERT_EQUAL(0, jbd2_commit_tid(storage_test_journal, STORAGE_TEST_JOURNAL_SEQUENCE));
+    TEST_ASSERT_EQUAL(commands, storage_test_commands);
+    TEST_ASSERT_EQUAL(1ULL, storage_test_journal->stats.requests_batched);
+    TEST_ASSERT_EQUAL(1, (int) storage_test_get_be32(storage_test_journal_block(disk, 0) + STORAGE_TEST_JOURNAL_START));
+    
+    storage_test_snapshot();
+    
+    // Transaction 6 rewrites block 11 while it is pinned; a checkpoint
+    // writes the newest committed copy, not the running one
+    TEST_ASSERT_EQUAL(0, storage_test_journal_modify(11, 0xCC));
+    TEST_ASSERT_EQUAL(0, jbd2_commit(storage_test_journal));
+    TEST_ASSERT_EQUAL(0, storage_test_journal_modify(11, 0xEE));
+    TEST_ASSERT_EQUAL(0, jbd2_checkpoint(storage_test_journal));
+    TEST_ASSERT_EQUAL(0xCC, storage_test_block(disk, 11)[7]);
+    TEST_ASSERT_EQUAL(0, (int) storage_test_get_be32(storage_test_journal_block(disk, 0) + STORAGE_TEST_JOURNAL_START));
+    TEST_ASSERT_EQUAL(0, storage_test_journal_unload());
+    
+    // Recovery from the snapshot replays transaction 5, unescaping block 10
+    TEST_ASSERT_EQUAL(0, storage_test_crash(0));
+    TEST_ASSERT_NOT_NULL(storage_test_journal_load());
+    TEST_ASSERT_EQUAL(2ULL, storage_test_journal->stats.replayed);
+    TEST_ASSERT_EQUAL(STORAGE_TEST_JOURNAL_SEQUENCE + 1, (int) jbd2_running_tid(storage_test_journal));
+    TEST_ASSERT_EQUAL(JBD2_MAGIC, storage_test_get_be32(storage_test_block(disk, 10)));
+    TEST_ASSERT_EQUAL(0xAA, storage_test_block(disk, 10)[9]);
+    TEST_ASSERT_EQUAL(0xBB, storage_test_block(disk, 11)[9]);
+    TEST_ASSERT_EQUAL(0, (int) storage_test_get_be32(storage_test_journal_block(disk, 0) + STORAGE_TEST_JOURNAL_START));
+    TEST_ASSERT_EQUAL(0, storage_test_journal_unload());
+    
+    return TEST_RESULT_PASS;
+}
+
+// Revoked blocks, a torn commit and journals that must not load
+static test_result_t storage_test_journal_revoke() {
+    jbd2_handle_t handle;
+    unsigned char* disk = storage_test_disk;
+    
+    // Transaction 6 rewrites 11, adds 12 and revokes 10
+    TEST_ASSERT_EQUAL(TEST_RESULT_PASS, storage_test_journal_first());
+    TEST_ASSERT_EQUAL(0, jbd2_start(storage_test_journal, 4, &handle));
+    unsigned char* data = jbd2_get_write_access(&handle, 11);
+    TEST_ASSERT_NOT_NULL(data);
+    memset(data, 0xCC, STORAGE_TEST_BLOCK_SIZE);
+    data = jbd2_get_write_access(&handle, 12);
+    TEST_ASSERT_NOT_NULL(data);
+    memset(data, 0xDD, STORAGE_TEST_BLOCK_SIZE);
+    TEST_ASSERT_EQUAL(0, jbd2_revoke(&handle, 10));
+    TEST_ASSERT_EQUAL(0, jbd2_stop(&handle));
+    TEST_ASSERT_EQUAL(0, jbd2_commit(storage_test_journal));
+    
+    storage_test_snapshot();
+    TEST_ASSERT_EQUAL(0, storage_test_journal_unload());
+    
+    // The revoke record keeps transaction 5's copy of block 10 out
+    TEST_ASSERT_EQUAL(0, storage_test_crash(0));
+    TEST_ASSERT_NOT_NULL(storage_test_journal_load());
+    TEST_ASSERT_EQUAL(0, storage_test_block(disk, 10)[9]);
+    TEST_ASSERT_EQUAL(0xCC, storage_test_block(disk, 11)[9]);
+    TEST_ASSERT_EQUAL(0xDD, storage_test_block(disk, 12)[9]);
+    TEST_ASSERT_EQUAL(0, storage_test_journal_unload());
+    
+    // Without its commit block transaction 6 is not replayed at all
+    unsigned int commits = 0;
+    
+    for (unsigned int i = 1; i < STORAGE_TEST_JOURNAL_BLOCKS && commits < 2; i++) {
+        unsigned char* block = storage_test_journal_block(storage_test_shadow, i);
+    
+        if (storage_test_get_be32(block) == JBD2_MAGIC && storage_test_get_be32(block + 4) == JBD2_COMMIT_BLOCK && ++commits == 2) {
+            memset(block, 0, STORAGE_TEST_BLOCK_SIZE);
+        }
+    }
+    
+    TEST_ASSERT_EQUAL(2, (int) commits);
+    TEST_ASSERT_EQUAL(0, storage_test_crash(0));
+    TEST_ASSERT_NOT_NULL(storage_test_journal_load());
+    TEST_ASSERT_EQUAL(2ULL, storage_test_journal->stats.replayed);
+    TEST_ASSERT_EQUAL(STORAGE_TEST_JOURNAL_SEQUENCE + 1, (int) jbd2_running_tid(storage_test_journal));
+    TEST_ASSERT_EQUAL(JBD2_MAGIC, storage_test_get_be32(storage_test_block(disk, 10)));
+    TEST_ASSERT_EQUAL(0xBB, storage_test_block(disk, 11)[9]);
+    TEST_ASSERT_EQUAL(0, storage_test_block(disk, 12)[9]);
+    TEST_ASSERT_EQUAL(0, storage_test_journal_unload());
+    
+    // A read-only device cannot be recovered, and checksummed logs are not understood
+    TEST_ASSERT_EQUAL(0, storage_test_crash(1));
+    TEST_ASSERT_NULL(storage_test_journal_load());
+    
+    storage_test_put_be32(storage_test_journal_block(storage_test_shadow, 0) + STORAGE_TEST_JOURNAL_INCOMPAT, JBD2_FEATURE_INCOMPAT_CSUM_V3);
+    TEST_ASSERT_EQUAL(0, storage_test_crash(0));
+    TEST_ASSERT_NULL(storage_test_journal_load());
+    
+    return TEST_RESULT_PASS;
+}
+
+// Many small transactions wrapping the log, with checkpoints in between
+static test_result_t storage_test_journal_wrap() {
+    unsigned char* disk = storage_test_disk;
+    
+    storage_test_journal_format();
+    TEST_ASSERT_NOT_NULL(storage_test_journal_load());
+    
+    for (unsigned int i = 0; i < 200; i++) {
+        TEST_ASSERT_EQUAL(0, storage_test_journal_modify(20 + i % 50, (unsigned char) i));
+    
+        if (i % 3 == 0) {
+            TEST_ASSERT_EQUAL(0, jbd2_commit(storage_test_journal));
+        }
+    
+        if (i % 40 == 39) {
+            TEST_ASSERT_EQUAL(0, jbd2_checkpoint(storage_test_journal));
+        }
+    }
+    
+    TEST_ASSERT_EQUAL(0, jbd2_commit(storage_test_journal));
+    TEST_ASSERT(storage_test_journal->stats.blocks_logged > STORAGE_TEST_JOURNAL_BLOCKS);
+    
+    unsigned int committed = storage_test_journal->committed_tid;
+    storage_test_snapshot();
+    TEST_ASSERT_EQUAL(0, storage_test_journal_unload());
+    
+    for (unsigned int i = 150; i < 200; i++) {
+        TEST_ASSERT_EQUAL((unsigned char) i, storage_test_block(disk, 20 + i % 50)[3]);
+    }
+    
+    // Recovery finds the same blocks in the log's uncheckpointed tail
+    TEST_ASSERT_EQUAL(0, storage_test_crash(0));
+    TEST_ASSERT_NOT_NULL(storage_test_journal_load());
+    TEST_ASSERT_EQUAL(committed + 1, jbd2_running_tid(storage_test_journal));
+    
+    for (unsigned int i = 150; i < 200; i++) {
+        TEST_ASSERT_EQUAL((unsigned char) i, storage_test_block(disk, 20 + i % 50)[3]);
+    }
+    
+    TEST_ASSERT_EQUAL(0, storage_test_journal_unload());
+    
+    return TEST_RESULT_PASS;
+}
+
+// Test that a crash after a commit is replayed from the log
+test_result_t test_storage_journal_replay() {
+    TEST_ASSERT_EQUAL(0, storage_test_setup());
+    
+    test_result_t result = storage_test_journal_replay();
+    
+    storage_test_teardown();
+    
+    return result;
+}
+
+// Test revoke records and logs that recovery must reject
+test_result_t test_storage_journal_revoke() {
+    TEST_ASSERT_EQUAL(0, storage_test_setup());
+    
+    test_result_t result = storage_test_journal_revoke();
+    
+    storage_test_teardown();
+    
+    return result;
+}
+
+// Test a log that wraps several times
+test_result_t test_storage_journal_wrap() {
+    TEST_ASSERT_EQUAL(0, storage_test_setup());
+    
+    test_result_t result = storage_test_journal_wrap();
+    
+    storage_test_teardown();
+    
+    return result;
+}
+
+// Initialize storage tests
+void storage_tests_init() {
+    // Add test suites
+    test_add_suite("storage", "Block layer and cache tests on a memory device");
+    
+    // Add test cases
+    test_add_case("storage", "queue_shadow", "Test plugged random writes against a shadow copy", test_storage_queue_shadow);
+    test_add_case("storage", "queue_merge", "Test merging of backward contiguous writes", test_storage_queue_merge);
+    test_add_case("storage", "ring_error", "Test the report of a failed ring read", test_storage_ring_error);
+    test_add_case("storage", "writeback_order", "Test page cache writeback in page order", test_storage_writeback_order);
+    test_add_case("storage", "writeback_owner", "Test page cache sync of one owner", test_storage_writeback_owner);
+    test_add_case("storage", "writeback_error", "Test a failed page cache writeback", test_storage_writeback_error);
+    test_add_case("storage", "journal_replay", "Test journal commit and crash recovery", test_storage_journal_replay);
+    test_add_case("storage", "journal_revoke", "Test journal revoke records and torn commits", test_storage_journal_revoke);
+    test_add_case("storage", "journal_wrap", "Test a journal log that wraps", test_storage_journal_wrap);
+}
+
+// Run storage tests
+void storage_tests_run() {
+    test_run_suite("storage");
+}
@@ -0,0 +1,13 @@
+/**
+ * LightOS Testing
+ * Storage tests header
+ */
+
+#ifndef STORAGE_TESTS_H
+#define STORAGE_TESTS_H
+
+// Storage test functions
+void storage_tests_init();
+void storage_tests_run();
+
+#endif /* STORAGE_TESTS_H */
@@ -423,7 +423,7 @@ int test_run_case(const char* suite_name, const char* name) {
     return 0;
 }
 
-// Run all tests
+// Run all tests; returns the number that failed or hit an error
 int test_run_all() {
     terminal_write("Running all tests...\n");
     
@@ -444,7 +444,7 @@ int test_run_all() {
     // Print results
     test_print_results();
     
-    return 0;
+    return failed_tests + error_tests;
 }
 
 // Print test results
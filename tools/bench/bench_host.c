@@ -0,0 +1,170 @@
+/**
+ * LightOS Tools
+ * Host services for the storage benchmark
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench_host.h"
+
+static unsigned long long host_random_state = 0x2545F4914F6CDD1DULL;
+static unsigned long long host_time_offset = 0;
+
+// Print formatted output
+void host_printf(const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+}
+
+// Print formatted output from a va_list
+void host_vprintf(const char* fmt, __builtin_va_list args) {
+    vprintf(fmt, args);
+}
+
+// Get monotonic time in nanoseconds
+unsigned long long host_time_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long) now.tv_sec * 1000000000ULL + now.tv_nsec + host_time_offset;
+}
+
+// Move the clock forward (tests of expiry and idle timers)
+void host_time_advance(unsigned long long ns) {
+    host_time_offset += ns;
+}
+
+// Allocate page-aligned memory
+void* host_alloc(unsigned long long size) {
+    void* address = NULL;
+
+    if (posix_memalign(&address, 4096, size) != 0) {
+        return NULL;
+    }
+
+    return address;
+}
+
+// Free memory from host_alloc
+void host_free(void* address) {
+    free(address);
+}
+
+// Seed the random number generator
+void host_srandom(unsigned long long seed) {
+    host_random_state = seed ? seed : 0x2545F4914F6CDD1DULL;
+}
+
+// Get the next pseudo-random number
+unsigned long long host_random() {
+    host_random_state ^= host_random_state << 13;
+    host_random_state ^= host_random_state >> 7;
+    host_random_state ^= host_random_state << 17;
+    return host_random_state;
+}
+
+// Open (and size) a backing file
+int host_file_open(const char* path, unsigned long long size, int direct) {
+    int flags = O_RDWR | O_CREAT;
+
+#ifdef O_DIRECT
+    if (direct) {
+        flags |= O_DIRECT;
+    }
+#endif
+
+    int fd = open(path, flags, 0644);
+
+    if (fd < 0 && direct) {
+        // Some filesystems (tmpfs) refuse O_DIRECT
+        fd = open(path, O_RDWR | O_CREAT, 0644);
+    }
+
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+
+    if (ftruncate(fd, (off_t) size) != 0) {
+        perror("ftruncate");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// Read from a backing file
+int host_file_pread(int fd, void* buffer, unsigned int size, unsigned long long offset) {
+    return pread(fd, buffer, size, (off_t) offset) == (ssize_t) size ? 0 : -1;
+}
+
+// Write to a backing file
+int host_file_pwrite(int fd, const void* buffer, unsigned int size, unsigned long long offset) {
+    return pwrite(fd, buffer, size, (off_t) offset) == (ssize_t) size ? 0 : -1;
+}
+
+// Flush a backing file to stable storage
+int host_file_sync(int fd) {
+    return fdatasync(fd);
+}
+
+// Close a backing file
+void host_file_close(int fd) {
+    close(fd);
+}
+
+// Get the size of a file; 0 if it does not exist
+unsigned long long host_file_size(const char* path) {
+    struct stat st;
+
+    if (stat(path, &st) != 0) {
+        return 0;
+    }
+
+    return (unsigned long long) st.st_size;
+}
+
+// Run a shell command
+int host_run(const char* command) {
+    fflush(stdout);
+
+    int status = system(command);
+
+    if (status == -1 || !WIFEXITED(status)) {
+        return -1;
+    }
+
+    return WEXITSTATUS(status);
+}
+
+// Start a thread; returns 0 on failure
+unsigned long long host_thread_start(void* (*function)(void*), void* arg) {
+    pthread_t thread;
+
+    if (pthread_create(&thread, NULL, function, arg) != 0) {
+        return 0;
+    }
+
+    return (unsigned long long) thread;
+}
+
+// Wait for a thread to finish
+void host_thread_join(unsigned long long thread) {
+    pthread_join((pthread_t) thread, NULL);
+}
+
+// Sleep for a number of microseconds
+void host_sleep_us(unsigned int us) {
+    usleep(us);
+}
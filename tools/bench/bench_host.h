@@ -0,0 +1,45 @@
+/**
+ * LightOS Tools
+ * Host services for the storage benchmark
+ *
+ * The benchmark links the kernel's block layer into a normal host program.
+ * Kernel sources only see this header, so they never mix with the host C
+ * library's headers.
+ */
+
+#ifndef BENCH_HOST_H
+#define BENCH_HOST_H
+
+// Output
+void host_printf(const char* fmt, ...);
+void host_vprintf(const char* fmt, __builtin_va_list args);
+
+// Monotonic time in nanoseconds, moved forward by host_time_advance()
+unsigned long long host_time_ns();
+void host_time_advance(unsigned long long ns);
+
+// Page-aligned memory
+void* host_alloc(unsigned long long size);
+void host_free(void* address);
+
+// Pseudo-random numbers (xorshift, reproducible across runs)
+void host_srandom(unsigned long long seed);
+unsigned long long host_random();
+
+// Backing files (direct bypasses the host page cache where supported)
+int host_file_open(const char* path, unsigned long long size, int direct);
+int host_file_pread(int fd, void* buffer, unsigned int size, unsigned long long offset);
+int host_file_pwrite(int fd, const void* buffer, unsigned int size, unsigned long long offset);
+int host_file_sync(int fd);
+void host_file_close(int fd);
+unsigned long long host_file_size(const char* path);
+
+// Run a shell command; returns its exit status
+int host_run(const char* command);
+
+// Threads (device emulators run beside the driver that polls them)
+unsigned long long host_thread_start(void* (*function)(void*), void* arg);
+void host_thread_join(unsigned long long thread);
+void host_sleep_us(unsigned int us);
+
+#endif /* BENCH_HOST_H */
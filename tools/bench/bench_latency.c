@@ -0,0 +1,85 @@
+/**
+ * LightOS Tools
+ * Latency histogram implementation
+ */
+
+#include "bench_latency.h"
+#include "../../libc/string.h"
+
+// Get the bucket holding a value
+static unsigned int bench_latency_bucket(unsigned long long ns) {
+    if (ns < BENCH_LATENCY_SUB_BUCKETS) {
+        return (unsigned int) ns;
+    }
+
+    unsigned int shift = 63 - __builtin_clzll(ns) - BENCH_LATENCY_SUB_BITS;
+
+    return ((shift + 1) << BENCH_LATENCY_SUB_BITS) + (unsigned int) ((ns >> shift) & (BENCH_LATENCY_SUB_BUCKETS - 1));
+}
+
+// Get the highest value a bucket holds
+static unsigned long long bench_latency_bucket_max(unsigned int bucket) {
+    if (bucket < BENCH_LATENCY_SUB_BUCKETS) {
+        return bucket;
+    }
+
+    unsigned int shift = (bucket >> BENCH_LATENCY_SUB_BITS) - 1;
+    unsigned long long low = (unsigned long long) (BENCH_LATENCY_SUB_BUCKETS + (bucket & (BENCH_LATENCY_SUB_BUCKETS - 1))) << shift;
+
+    return low + ((1ULL << shift) - 1);
+}
+
+// Empty a histogram
+void bench_latency_reset(bench_latency_t* latency) {
+    memset(latency, 0, sizeof(bench_latency_t));
+}
+
+// Record one latency
+void bench_latency_add(bench_latency_t* latency, unsigned long long ns) {
+    latency->buckets[bench_latency_bucket(ns)]++;
+
+    if (latency->count == 0 || ns < latency->min_ns) {
+        latency->min_ns = ns;
+    }
+
+    if (ns > latency->max_ns) {
+        latency->max_ns = ns;
+    }
+
+    latency->count++;
+    latency->total_ns += ns;
+}
+
+// Get the mean latency
+unsigned long long bench_latency_mean(const bench_latency_t* latency) {
+    return latency->count ? latency->total_ns / latency->count : 0;
+}
+
+// Get the latency below which per_mille thousandths of the values fall
+//
+// The answer is the top of the bucket holding that value, capped by the
+// largest value seen.
+unsigned long long bench_latency_percentile(const bench_latency_t* latency, unsigned int per_mille) {
+    if (latency->count == 0) {
+        return 0;
+    }
+
+    // Rank of the value wanted, counting from 1
+    unsigned long long rank = (latency->count * per_mille + 999) / 1000;
+    unsigned long long seen = 0;
+
+    if (rank == 0) {
+        rank = 1;
+    }
+
+    for (unsigned int bucket = 0; bucket < BENCH_LATENCY_BUCKETS; bucket++) {
+        seen += latency->buckets[bucket];
+
+        if (seen >= rank) {
+            unsigned long long ns = bench_latency_bucket_max(bucket);
+            return ns < latency->max_ns ? ns : latency->max_ns;
+        }
+    }
+
+    return latency->max_ns;
+}
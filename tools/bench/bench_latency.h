@@ -0,0 +1,36 @@
+/**
+ * LightOS Tools
+ * Latency histogram header
+ */
+
+#ifndef BENCH_LATENCY_H
+#define BENCH_LATENCY_H
+
+// Sub-buckets per power of two, as a shift (values are kept to within 1/16)
+#define BENCH_LATENCY_SUB_BITS 4
+#define BENCH_LATENCY_SUB_BUCKETS (1 << BENCH_LATENCY_SUB_BITS)
+
+// Buckets covering every 64-bit nanosecond value
+#define BENCH_LATENCY_BUCKETS ((64 - BENCH_LATENCY_SUB_BITS + 1) * BENCH_LATENCY_SUB_BUCKETS)
+
+// Log-linear latency histogram
+//
+// Values below BENCH_LATENCY_SUB_BUCKETS get a bucket each; above that,
+// every power of two is split into BENCH_LATENCY_SUB_BUCKETS equal
+// buckets. Recording is a shift and an increment, and percentiles are
+// read back with the same relative precision at any scale.
+typedef struct {
+    unsigned long long buckets[BENCH_LATENCY_BUCKETS];
+    unsigned long long count;
+    unsigned long long total_ns;
+    unsigned long long min_ns;
+    unsigned long long max_ns;
+} bench_latency_t;
+
+// Latency histogram functions
+void bench_latency_reset(bench_latency_t* latency);
+void bench_latency_add(bench_latency_t* latency, unsigned long long ns);
+unsigned long long bench_latency_mean(const bench_latency_t* latency);
+unsigned long long bench_latency_percentile(const bench_latency_t* latency, unsigned int per_mille);
+
+#endif /* BENCH_LATENCY_H */
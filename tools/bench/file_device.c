@@ -0,0 +1,192 @@
+/**
+ * LightOS Tools
+ * File-backed storage device implementation
+ *
+ * Registers a storage device whose sectors live in a host file, or in a
+ * memory image when no file is given, so the block layer can be exercised
+ * and timed outside the kernel.
+ */
+
+#include "file_device.h"
+#include "bench_host.h"
+#include "../../drivers/storage.h"
+#include "../../kernel/kernel.h"
+#include "../../libc/string.h"
+
+// Backing file state
+typedef struct {
+    char name[32];
+    int used;
+    int fd;
+    unsigned char* memory;              // Memory image (instead of a file)
+    file_device_stats_t stats;
+} file_device_t;
+
+static file_device_t file_devices[FILE_DEVICE_MAX];
+
+// Find a device slot by name
+static file_device_t* file_device_find(const char* name) {
+    for (int i = 0; i < FILE_DEVICE_MAX; i++) {
+        if (file_devices[i].used && strcmp(file_devices[i].name, name) == 0) {
+            return &file_devices[i];
+        }
+    }
+
+    return NULL;
+}
+
+// Close a slot's backing file or free its memory image
+static void file_device_release(file_device_t* file) {
+    if (file->memory) {
+        host_free(file->memory);
+    } else {
+        host_file_close(file->fd);
+    }
+
+    file->used = 0;
+    file->fd = -1;
+    file->memory = NULL;
+}
+
+// File device read function
+static int file_read_sectors(storage_device_t* dev, unsigned int start_sector, unsigned int sector_count, void* buffer) {
+    file_device_t* file = (file_device_t*) dev->private_data;
+    unsigned int size = sector_count * dev->sector_size;
+
+    unsigned long long offset = (unsigned long long) start_sector * dev->sector_size;
+
+    file->stats.reads++;
+    file->stats.read_bytes += size;
+
+    if (file->memory) {
+        memcpy(buffer, file->memory + offset, size);
+        return 0;
+    }
+
+    return host_file_pread(file->fd, buffer, size, offset);
+}
+
+// File device write function
+static int file_write_sectors(storage_device_t* dev, unsigned int start_sector, unsigned int sector_count, const void* buffer) {
+    file_device_t* file = (file_device_t*) dev->private_data;
+    unsigned int size = sector_count * dev->sector_size;
+
+    unsigned long long offset = (unsigned long long) start_sector * dev->sector_size;
+
+    file->stats.writes++;
+    file->stats.written_bytes += size;
+
+    if (file->memory) {
+        memcpy(file->memory + offset, buffer, size);
+        return 0;
+    }
+
+    return host_file_pwrite(file->fd, buffer, size, offset);
+}
+
+// File device flush function
+static int file_flush(storage_device_t* dev) {
+    file_device_t* file = (file_device_t*) dev->private_data;
+
+    file->stats.flushes++;
+
+    return file->memory ? 0 : host_file_sync(file->fd);
+}
+
+// Create a file-backed device and register it with the storage subsystem
+//
+// Without a path the device is a zeroed memory image of the given size.
+int file_device_create(const char* name, const char* path, unsigned long long size, unsigned int sector_size, int direct) {
+    if (!name || sector_size == 0 || strlen(name) >= 32) {
+        return -1;
+    }
+
+    file_device_t* file = NULL;
+
+    for (int i = 0; i < FILE_DEVICE_MAX; i++) {
+        if (!file_devices[i].used) {
+            file = &file_devices[i];
+            break;
+        }
+    }
+
+    if (!file) {
+        terminal_write("Error: Maximum number of file devices reached\n");
+        return -1;
+    }
+
+    int fd = -1;
+    unsigned char* memory = NULL;
+
+    if (path) {
+        fd = host_file_open(path, size, direct);
+    } else {
+        memory = (unsigned char*) host_alloc(size);
+    }
+
+    if (fd < 0 && !memory) {
+        return -1;
+    }
+
+    if (memory) {
+        memset(memory, 0, size);
+    }
+
+    storage_device_t device;
+    memset(&device, 0, sizeof(storage_device_t));
+    strcpy(device.name, name);
+    device.type = STORAGE_TYPE_SSD;
+    device.size = size;
+    device.sector_size = sector_size;
+    device.read_sectors = file_read_sectors;
+    device.write_sectors = file_write_sectors;
+    device.flush = file_flush;
+    device.private_data = file;
+
+    strcpy(file->name, name);
+    file->used = 1;
+    file->fd = fd;
+    file->memory = memory;
+    memset(&file->stats, 0, sizeof(file_device_stats_t));
+
+    if (storage_register_device(&device) != 0) {
+        file_device_release(file);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Unregister a file-backed device and close its file
+int file_device_destroy(const char* name) {
+    file_device_t* file = file_device_find(name);
+
+    if (!file || storage_unregister_device(name) != 0) {
+        return -1;
+    }
+
+    file_device_release(file);
+
+    return 0;
+}
+
+// Get a device's command counters
+int file_device_get_stats(const char* name, file_device_stats_t* stats) {
+    file_device_t* file = file_device_find(name);
+
+    if (!file || !stats) {
+        return -1;
+    }
+
+    *stats = file->stats;
+    return 0;
+}
+
+// Reset a device's command counters
+void file_device_reset_stats(const char* name) {
+    file_device_t* file = file_device_find(name);
+
+    if (file) {
+        memset(&file->stats, 0, sizeof(file_device_stats_t));
+    }
+}
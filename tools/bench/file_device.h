@@ -0,0 +1,27 @@
+/**
+ * LightOS Tools
+ * File-backed storage device header
+ */
+
+#ifndef FILE_DEVICE_H
+#define FILE_DEVICE_H
+
+// Maximum number of file-backed devices
+#define FILE_DEVICE_MAX 4
+
+// Command counters for one device
+typedef struct {
+    unsigned long long reads;
+    unsigned long long writes;
+    unsigned long long flushes;
+    unsigned long long read_bytes;
+    unsigned long long written_bytes;
+} file_device_stats_t;
+
+// File-backed device functions
+int file_device_create(const char* name, const char* path, unsigned long long size, unsigned int sector_size, int direct);
+int file_device_destroy(const char* name);
+int file_device_get_stats(const char* name, file_device_stats_t* stats);
+void file_device_reset_stats(const char* name);
+
+#endif /* FILE_DEVICE_H */
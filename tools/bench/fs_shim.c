@@ -0,0 +1,105 @@
+/**
+ * LightOS Tools
+ * Kernel services for the file system benchmark
+ *
+ * Fills in what the file system manager, the caches and the FAT32 driver
+ * need beyond kernel_shim.c: memory accounting, the current process, the
+ * calendar, the node tree, and the file systems the tree has no driver for.
+ */
+
+#include "../../kernel/ktime.h"
+#include "../../kernel/memory.h"
+#include "../../kernel/process.h"
+#include "../../kernel/filesystem.h"
+
+// Memory the caches see as free (they never come under pressure)
+#define FS_SHIM_FREE_MEMORY (1024U * 1024 * 1024)
+
+// Get memory usage in bytes
+void memory_stats(unsigned int* total, unsigned int* used, unsigned int* free) {
+    if (total) {
+        *total = FS_SHIM_FREE_MEMORY;
+    }
+
+    if (used) {
+        *used = 0;
+    }
+
+    if (free) {
+        *free = FS_SHIM_FREE_MEMORY;
+    }
+}
+
+// Register a shrinker (memory never runs out, so it is never called)
+int memory_register_shrinker(memory_shrinker_t shrinker) {
+    (void) shrinker;
+    return 0;
+}
+
+// Reclaim scopes (nothing to keep out)
+void memory_noreclaim_begin() {
+}
+
+void memory_noreclaim_end() {
+}
+
+// No processes: files are opened from the kernel's table
+process_t* process_current() {
+    return NULL;
+}
+
+// The clock has no wall time, so files are dated at the epoch
+void ktime_to_date(unsigned long long real_ns, rtc_time_t* time) {
+    (void) real_ns;
+    time->year = 1970;
+    time->month = 1;
+    time->day = 1;
+    time->hour = 0;
+    time->minute = 0;
+    time->second = 0;
+}
+
+unsigned long long ktime_from_date(const rtc_time_t* time) {
+    (void) time;
+    return 0;
+}
+
+// No node tree: the file systems are only reached through their paths, so
+// there are no directory entries to invalidate
+fs_node_t* fs_namei(const char* path) {
+    (void) path;
+    return NULL;
+}
+
+// File systems registered by fs_manager_init() that have no driver here
+int ext2_init() {
+    return 0;
+}
+
+int ext3_init() {
+    return 0;
+}
+
+int fat16_init() {
+    return 0;
+}
+
+int ntfs_init() {
+    return 0;
+}
+
+int iso9660_init() {
+    return 0;
+}
+
+int btrfs_init() {
+    return 0;
+}
+
+int xfs_init() {
+    return 0;
+}
+
+int zfs_init() {
+    return 0;
+}
@@ -0,0 +1,654 @@
+/**
+ * LightOS Tools
+ * File system and block layer benchmark
+ *
+ * A small fio: runs sequential, random and mixed read/write jobs against a
+ * file-backed or memory device. Each job runs first on the raw device
+ * through a storage ring at every queue depth asked for, then on a file of
+ * a freshly formatted FAT32 volume through the file system manager and the
+ * page cache, and reports IOPS, bandwidth and latency percentiles.
+ *
+ * Usage: io_bench [-d] [-m] [-c] [-s size_mb] [-f file_mb] [-n requests]
+ *                 [-b block_kb] [-q depth[,depth...]] [-r read_percent] [file]
+ */
+
+#include "bench_host.h"
+#include "bench_latency.h"
+#include "file_device.h"
+#include "../../drivers/storage.h"
+#include "../../drivers/storage_ring.h"
+#include "../../kernel/filesystem_ext.h"
+#include "../../kernel/dcache.h"
+#include "../../kernel/icache.h"
+#include "../../kernel/page_cache.h"
+#include "../../libc/string.h"
+
+#define IO_DEVICE "bench0"
+#define IO_SECTOR_SIZE 512
+#define IO_MOUNT_POINT "/bench"
+#define IO_FILE "/io_bench.dat"
+#define IO_FILE_PATH IO_MOUNT_POINT IO_FILE
+
+// Most queue depths in one run
+#define IO_MAX_DEPTHS 8
+
+// Read share that stands for the configured mix
+#define IO_MIXED 0xFFFFFFFF
+
+// FAT32 layout written by io_format
+#define IO_FAT_RESERVED 32
+#define IO_FAT_COUNT 2
+#define IO_FAT_FSINFO 1
+#define IO_FAT_BACKUP 6
+#define IO_CLUSTER_SIZE 4096
+#define IO_FORMAT_CHUNK (64 * 1024)
+
+// Benchmark configuration
+typedef struct {
+    const char* path;                   // NULL for a memory image
+    unsigned long long size;            // Device size in bytes
+    unsigned long long file_size;       // Test file size in bytes
+    unsigned int requests;              // Requests per job
+    unsigned int block_size;            // Request size in bytes
+    unsigned int depths[IO_MAX_DEPTHS]; // Ring queue depths
+    unsigned int depth_count;
+    unsigned int read_percent;          // Reads in the mixed job
+    int direct;                         // Bypass the host page cache
+    int csv;                            // Comma-separated output
+} io_config_t;
+
+// Access pattern of one job
+typedef struct {
+    const char* name;
+    unsigned int read_percent;          // 0 writes only, 100 reads only
+    int random;
+} io_job_t;
+
+// Result of one job
+typedef struct {
+    unsigned long long elapsed_ns;
+    unsigned long long bytes;           // Moved by successful requests
+    unsigned int completed;             // Requests finished, failed or not
+    unsigned int errors;                // Failed requests or bad data
+    bench_latency_t latency;
+} io_result_t;
+
+// Ring request in flight
+typedef struct {
+    unsigned char* buffer;
+    unsigned int block;
+    int write;
+    unsigned long long start_ns;
+    io_result_t* result;
+} io_slot_t;
+
+static const io_job_t io_jobs[] = {
+    { "seqwrite", 0, 0 },
+    { "randwrite", 0, 1 },
+    { "seqread", 100, 0 },
+    { "randread", 100, 1 },
+    { "randrw", IO_MIXED, 1 },
+};
+
+static io_config_t config;
+static block_dev_t* io_bdev = NULL;
+static io_result_t io_result;
+
+// Ring slots, with the free ones on a stack
+static io_slot_t io_slots[STORAGE_RING_MAX_ENTRIES];
+static io_slot_t* io_free_slots[STORAGE_RING_MAX_ENTRIES];
+static unsigned int io_free_count = 0;
+
+// Parse a decimal number, returning the character after it
+static const char* io_parse(const char* str, unsigned long long* value) {
+    *value = 0;
+
+    while (*str >= '0' && *str <= '9') {
+        *value = *value * 10 + (*str - '0');
+        str++;
+    }
+
+    return str;
+}
+
+// Parse a comma-separated list of queue depths
+static int io_parse_depths(const char* str) {
+    config.depth_count = 0;
+
+    while (*str && config.depth_count < IO_MAX_DEPTHS) {
+        unsigned long long depth;
+        const char* end = io_parse(str, &depth);
+
+        if (end == str || depth == 0 || depth >= STORAGE_RING_MAX_ENTRIES || (*end && *end != ',')) {
+            return -1;
+        }
+
+        config.depths[config.depth_count++] = (unsigned int) depth;
+        str = *end ? end + 1 : end;
+    }
+
+    return *str || config.depth_count == 0 ? -1 : 0;
+}
+
+// Pick the block for the i-th request of a job
+static unsigned int io_pick_block(const io_job_t* job, unsigned int i, unsigned int blocks) {
+    if (job->random) {
+        return (unsigned int) (host_random() % blocks);
+    }
+
+    return i % blocks;
+}
+
+// Decide whether the next request of a job is a write
+static int io_pick_write(const io_job_t* job) {
+    unsigned int read_percent = job->read_percent == IO_MIXED ? config.read_percent : job->read_percent;
+
+    if (read_percent == 0 || read_percent == 100) {
+        return read_percent == 0;
+    }
+
+    return host_random() % 100 >= read_percent;
+}
+
+// Stamp a buffer with the block it belongs to
+static void io_fill(unsigned char* buffer, unsigned int block) {
+    unsigned int* words = (unsigned int*) buffer;
+
+    for (unsigned int i = 0; i < config.block_size / sizeof(unsigned int); i++) {
+        words[i] = block * 2654435761u + i;
+    }
+}
+
+// Check a buffer's stamp (blocks never written read back as zeroes)
+static int io_check(const unsigned char* buffer, unsigned int block) {
+    const unsigned int* words = (const unsigned int*) buffer;
+
+    if (words[0] == 0 && words[1] == 0) {
+        return 1;
+    }
+
+    return words[0] == block * 2654435761u && words[config.block_size / sizeof(unsigned int) - 1] ==
+           block * 2654435761u + config.block_size / sizeof(unsigned int) - 1;
+}
+
+// Store little-endian values in an on-disk structure
+static void io_put16(unsigned char* p, unsigned int value) {
+    p[0] = (unsigned char) value;
+    p[1] = (unsigned char) (value >> 8);
+}
+
+static void io_put32(unsigned char* p, unsigned int value) {
+    io_put16(p, value);
+    io_put16(p + 2, value >> 16);
+}
+
+// Write an empty FAT32 file system over the whole device
+//
+// Clusters are 4 KB, so file data lines up with the page cache and with the
+// requests of the block layer jobs.
+static int io_format() {
+    unsigned int total = (unsigned int) (config.size / IO_SECTOR_SIZE);
+    unsigned int cluster_sectors = IO_CLUSTER_SIZE / IO_SECTOR_SIZE;
+    unsigned int chunk_sectors = IO_FORMAT_CHUNK / IO_SECTOR_SIZE;
+
+    // FATs sized for the clusters left after the FATs themselves
+    unsigned int per_fat_sector = (256 * cluster_sectors + IO_FAT_COUNT) / 2;
+    unsigned int fat_sectors = (total - IO_FAT_RESERVED + per_fat_sector - 1) / per_fat_sector;
+    unsigned int data_start = IO_FAT_RESERVED + IO_FAT_COUNT * fat_sectors;
+
+    unsigned char* buffer = (unsigned char*) host_alloc(IO_FORMAT_CHUNK);
+
+    if (!buffer) {
+        return -1;
+    }
+
+    // Clear the reserved area, both FATs and the root directory cluster
+    int result = 0;
+    memset(buffer, 0, IO_FORMAT_CHUNK);
+
+    for (unsigned int sector = 0; sector < data_start + cluster_sectors && result == 0; sector += chunk_sectors) {
+        unsigned int count = data_start + cluster_sectors - sector;
+        result = bdev_write_sectors(io_bdev, sector, count < chunk_sectors ? count : chunk_sectors, buffer);
+    }
+
+    // Boot sector, with a backup copy
+    unsigned char* boot = buffer;
+    boot[0] = 0xEB;
+    boot[1] = 0x58;
+    boot[2] = 0x90;
+    memcpy(boot + 3, "LIGHTOS ", 8);
+    io_put16(boot + 11, IO_SECTOR_SIZE);
+    boot[13] = (unsigned char) cluster_sectors;
+    io_put16(boot + 14, IO_FAT_RESERVED);
+    boot[16] = IO_FAT_COUNT;
+    boot[21] = 0xF8;
+    io_put32(boot + 32, total);
+    io_put32(boot + 36, fat_sectors);
+    io_put32(boot + 44, 2);
+    io_put16(boot + 48, IO_FAT_FSINFO);
+    io_put16(boot + 50, IO_FAT_BACKUP);
+    boot[64] = 0x80;
+    boot[66] = 0x29;
+    io_put32(boot + 67, 0x4C4F5342);
+    memcpy(boot + 71, "IO_BENCH   FAT32   ", 19);
+    boot[510] = 0x55;
+    boot[511] = 0xAA;
+
+    if (result == 0) {
+        result = bdev_write_sectors(io_bdev, 0, 1, boot);
+    }
+
+    if (result == 0) {
+        result = bdev_write_sectors(io_bdev, IO_FAT_BACKUP, 1, boot);
+    }
+
+    // FSInfo sector: free count unknown, allocation starts after the root
+    unsigned char* fsinfo = buffer + IO_SECTOR_SIZE;
+    io_put32(fsinfo, 0x41615252);
+    io_put32(fsinfo + 484, 0x61417272);
+    io_put32(fsinfo + 488, 0xFFFFFFFF);
+    io_put32(fsinfo + 492, 3);
+    io_put32(fsinfo + 508, 0xAA550000);
+
+    if (result == 0) {
+        result = bdev_write_sectors(io_bdev, IO_FAT_FSINFO, 1, fsinfo);
+    }
+
+    // Reserved entries and the root directory's one-cluster chain
+    unsigned char* fat = buffer + 2 * IO_SECTOR_SIZE;
+    memset(fat, 0, IO_SECTOR_SIZE);
+    io_put32(fat, 0x0FFFFFF8);
+    io_put32(fat + 4, 0x0FFFFFFF);
+    io_put32(fat + 8, 0x0FFFFFFF);
+
+    for (unsigned int i = 0; i < IO_FAT_COUNT && result == 0; i++) {
+        result = bdev_write_sectors(io_bdev, IO_FAT_RESERVED + i * fat_sectors, 1, fat);
+    }
+
+    if (result == 0) {
+        result = bdev_flush(io_bdev);
+    }
+
+    host_free(buffer);
+
+    return result;
+}
+
+// Return a completed request's slot and record its latency
+static void io_ring_complete(storage_ring_t* ring, const storage_cqe_t* cqe) {
+    io_slot_t* slot = (io_slot_t*) cqe->user_data;
+    (void) ring;
+
+    // Flushes carry no slot
+    if (!slot) {
+        return;
+    }
+
+    bench_latency_add(&slot->result->latency, host_time_ns() - slot->start_ns);
+    slot->result->completed++;
+
+    if (cqe->result != 0 || (!slot->write && !io_check(slot->buffer, slot->block))) {
+        slot->result->errors++;
+    } else {
+        slot->result->bytes += config.block_size;
+    }
+
+    io_free_slots[io_free_count++] = slot;
+}
+
+// Run a job on the raw device, keeping up to depth requests in flight
+//
+// A new request is queued as soon as one completes, as fio does, so each
+// request's latency includes the time it waited behind the others.
+static void io_run_block(const io_job_t* job, unsigned int depth, io_result_t* result) {
+    storage_ring_t ring;
+    unsigned int sectors = config.block_size / IO_SECTOR_SIZE;
+    unsigned int blocks = (unsigned int) (config.size / config.block_size);
+
+    if (storage_ring_init(&ring, depth + 1, io_ring_complete, NULL) != 0) {
+        result->errors = config.requests;
+        return;
+    }
+
+    // Separate buffers, as independent callers would use
+    unsigned int allocated = 0;
+    io_free_count = 0;
+
+    for (; allocated < depth; allocated++) {
+        io_slots[allocated].buffer = (unsigned char*) host_alloc(config.block_size);
+
+        if (!io_slots[allocated].buffer) {
+            break;
+        }
+
+        io_slots[allocated].result = result;
+        io_free_slots[io_free_count++] = &io_slots[allocated];
+    }
+
+    if (allocated < depth) {
+        result->errors = config.requests;
+    } else {
+        unsigned long long start = host_time_ns();
+        unsigned int issued = 0;
+        int writes = 0;
+
+        while (result->completed < config.requests) {
+            while (io_free_count > 0 && issued < config.requests) {
+                io_slot_t* slot = io_free_slots[--io_free_count];
+                storage_sqe_t* sqe = storage_ring_get_sqe(&ring);
+
+                slot->block = io_pick_block(job, issued, blocks);
+                slot->write = io_pick_write(job);
+                slot->start_ns = host_time_ns();
+
+                if (slot->write) {
+                    io_fill(slot->buffer, slot->block);
+                    storage_ring_prep_write(sqe, io_bdev, slot->block * sectors, sectors, slot->buffer, slot);
+                    writes = 1;
+                } else {
+                    storage_ring_prep_read(sqe, io_bdev, slot->block * sectors, sectors, slot->buffer, slot);
+                }
+
+                issued++;
+            }
+
+            if (storage_ring_wait(&ring, 1) < 0) {
+                result->errors += issued - result->completed;
+                break;
+            }
+
+            storage_ring_reap(&ring, NULL, depth + 1);
+        }
+
+        // Written data counts once it is on stable storage
+        if (writes) {
+            storage_ring_prep_flush(storage_ring_get_sqe(&ring), io_bdev, NULL);
+
+            if (storage_ring_wait(&ring, 1) < 0) {
+                result->errors++;
+            }
+
+            storage_ring_reap(&ring, NULL, depth + 1);
+        }
+
+        result->elapsed_ns = host_time_ns() - start;
+    }
+
+    for (unsigned int i = 0; i < allocated; i++) {
+        host_free(io_slots[i].buffer);
+    }
+
+    storage_ring_destroy(&ring);
+}
+
+// Write out cached data and drop clean pages, so a job starts cold
+static void io_drop_caches() {
+    fs_sync();
+    page_cache_shrink(PAGE_CACHE_MAX_PAGES);
+}
+
+// Run a job on the test file, one request at a time
+//
+// Requests go through the file system manager's view of the mounted volume
+// and the page cache; a job that wrote anything ends with an fsync, which
+// counts in its run time but not in any request's latency.
+static void io_run_vfs(filesystem_t* fs, const io_job_t* job, io_result_t* result) {
+    unsigned char* buffer = (unsigned char*) host_alloc(config.block_size);
+    unsigned int blocks = (unsigned int) (config.file_size / config.block_size);
+    int fd = fs->open ? fs->open(fs, IO_FILE, O_RDWR) : 0;
+
+    if (!buffer || fd < 0) {
+        result->errors = config.requests;
+
+        if (buffer) {
+            host_free(buffer);
+        }
+
+        return;
+    }
+
+    unsigned long long start = host_time_ns();
+    int writes = 0;
+
+    for (unsigned int i = 0; i < config.requests; i++) {
+        unsigned int block = io_pick_block(job, i, blocks);
+        unsigned int offset = block * config.block_size;
+        int write = io_pick_write(job);
+        int done;
+
+        if (write) {
+            io_fill(buffer, block);
+        }
+
+        unsigned long long issued = host_time_ns();
+
+        if (write) {
+            done = fs->write(fs, IO_FILE, buffer, config.block_size, offset);
+            writes = 1;
+        } else {
+            done = fs->read(fs, IO_FILE, buffer, config.block_size, offset);
+        }
+
+        bench_latency_add(&result->latency, host_time_ns() - issued);
+        result->completed++;
+
+        if (done != (int) config.block_size || (!write && !io_check(buffer, block))) {
+            result->errors++;
+        } else {
+            result->bytes += config.block_size;
+        }
+    }
+
+    if (writes && fs_fsync(IO_FILE_PATH) != 0) {
+        result->errors++;
+    }
+
+    result->elapsed_ns = host_time_ns() - start;
+
+    if (fs->close) {
+        fs->close(fs, fd);
+    }
+
+    host_free(buffer);
+}
+
+// Create the test file and write all of it
+static int io_layout(filesystem_t* fs) {
+    unsigned char* buffer = (unsigned char*) host_alloc(config.block_size);
+    int fd = fs->open(fs, IO_FILE, O_RDWR | O_CREAT);
+    int result = buffer && fd >= 0 ? 0 : -1;
+
+    for (unsigned int block = 0; result == 0 && block < config.file_size / config.block_size; block++) {
+        io_fill(buffer, block);
+
+        if (fs->write(fs, IO_FILE, buffer, config.block_size, block * config.block_size) != (int) config.block_size) {
+            result = -1;
+        }
+    }
+
+    if (result == 0 && fs_fsync(IO_FILE_PATH) != 0) {
+        result = -1;
+    }
+
+    if (fd >= 0 && fs->close) {
+        fs->close(fs, fd);
+    }
+
+    if (buffer) {
+        host_free(buffer);
+    }
+
+    return result;
+}
+
+// Print a latency in microseconds with one decimal
+static void io_print_us(unsigned long long ns) {
+    host_printf(" %7llu.%llu", ns / 1000, ns % 1000 / 100);
+}
+
+// Print one result line
+static void io_report(const char* job, const char* layer, unsigned int depth, const io_result_t* result) {
+    unsigned long long us = result->elapsed_ns / 1000;
+
+    if (us == 0) {
+        us = 1;
+    }
+
+    unsigned long long iops = (unsigned long long) result->completed * 1000000ULL / us;
+    unsigned long long kbps = result->bytes / 1024 * 1000000ULL / us;
+    const bench_latency_t* latency = &result->latency;
+
+    if (config.csv) {
+        host_printf("%s,%s,%u,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%u\n", job, layer, depth, iops, kbps,
+                    bench_latency_mean(latency), bench_latency_percentile(latency, 500),
+                    bench_latency_percentile(latency, 900), bench_latency_percentile(latency, 990),
+                    bench_latency_percentile(latency, 999), latency->max_ns, result->errors);
+        return;
+    }
+
+    host_printf("%-10s %-5s %5u %9llu %8llu.%llu", job, layer, depth, iops, kbps / 1024, (kbps % 1024) * 10 / 1024);
+    io_print_us(bench_latency_mean(latency));
+    io_print_us(bench_latency_percentile(latency, 500));
+    io_print_us(bench_latency_percentile(latency, 900));
+    io_print_us(bench_latency_percentile(latency, 990));
+    io_print_us(bench_latency_percentile(latency, 999));
+    io_print_us(latency->max_ns);
+    host_printf(" %6u\n", result->errors);
+}
+
+// Start a job's result and its random sequence
+static void io_start(unsigned int job) {
+    memset(&io_result, 0, sizeof(io_result_t));
+    bench_latency_reset(&io_result.latency);
+    host_srandom(1 + job);
+}
+
+// Entry point
+int main(int argc, char** argv) {
+    unsigned long long value;
+
+    config.path = "/tmp/lightos-iobench.img";
+    config.size = 256ULL * 1024 * 1024;
+    config.file_size = 64ULL * 1024 * 1024;
+    config.requests = 16384;
+    config.block_size = 4096;
+    config.depths[0] = 1;
+    config.depths[1] = 32;
+    config.depth_count = 2;
+    config.read_percent = 70;
+    config.direct = 0;
+    config.csv = 0;
+
+    for (int i = 1; i < argc; i++) {
+        int bad = 0;
+
+        if (strcmp(argv[i], "-d") == 0) {
+            config.direct = 1;
+        } else if (strcmp(argv[i], "-m") == 0) {
+            config.path = NULL;
+        } else if (strcmp(argv[i], "-c") == 0) {
+            config.csv = 1;
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            io_parse(argv[++i], &value);
+            config.size = value * 1024 * 1024;
+        } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            io_parse(argv[++i], &value);
+            config.file_size = value * 1024 * 1024;
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            io_parse(argv[++i], &value);
+            config.requests = (unsigned int) value;
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            io_parse(argv[++i], &value);
+            config.block_size = (unsigned int) value * 1024;
+        } else if (strcmp(argv[i], "-q") == 0 && i + 1 < argc) {
+            bad = io_parse_depths(argv[++i]) != 0;
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            io_parse(argv[++i], &value);
+            config.read_percent = (unsigned int) value;
+        } else if (argv[i][0] != '-') {
+            config.path = argv[i];
+        } else {
+            bad = 1;
+        }
+
+        if (bad) {
+            host_printf("Usage: %s [-d] [-m] [-c] [-s size_mb] [-f file_mb] [-n requests] [-b block_kb] "
+                        "[-q depth[,depth...]] [-r read_percent] [file]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    // The file must fit on the volume next to the FATs, and offsets are 32 bits
+    if (config.block_size == 0 || config.block_size > STORAGE_MAX_REQUEST_BYTES || config.requests == 0 ||
+        config.read_percent > 100 || config.file_size < config.block_size || config.file_size > config.size / 2 ||
+        config.size > 0xFFFFFFFFULL) {
+        host_printf("Invalid configuration\n");
+        return 2;
+    }
+
+    dcache_init();
+    icache_init();
+    page_cache_init();
+    fs_manager_init();
+    storage_init();
+
+    if (file_device_create(IO_DEVICE, config.path, config.size, IO_SECTOR_SIZE, config.direct) != 0) {
+        return 1;
+    }
+
+    io_bdev = storage_open(IO_DEVICE);
+
+    if (!config.csv) {
+        host_printf("\n%s: %llu MB, %llu MB file, %u x %u KB requests, %u%% reads when mixed%s\n\n",
+                    config.path ? config.path : "memory", config.size / (1024 * 1024),
+                    config.file_size / (1024 * 1024), config.requests, config.block_size / 1024,
+                    config.read_percent, config.direct ? ", O_DIRECT" : "");
+        host_printf("%-10s %-5s %5s %9s %10s %9s %9s %9s %9s %9s %9s %6s\n", "job", "layer", "depth", "IOPS", "MB/s",
+                    "avg us", "p50 us", "p90 us", "p99 us", "p99.9 us", "max us", "errors");
+    } else {
+        host_printf("job,layer,depth,iops,kbps,avg_ns,p50_ns,p90_ns,p99_ns,p999_ns,max_ns,errors\n");
+    }
+
+    int errors = 0;
+    unsigned int job_count = sizeof(io_jobs) / sizeof(io_jobs[0]);
+
+    // Raw device at each queue depth
+    for (unsigned int job = 0; job < job_count; job++) {
+        for (unsigned int i = 0; i < config.depth_count; i++) {
+            io_start(job);
+            io_run_block(&io_jobs[job], config.depths[i], &io_result);
+            io_report(io_jobs[job].name, "block", config.depths[i], &io_result);
+            errors += io_result.errors;
+        }
+    }
+
+    // A file on a new FAT32 volume
+    filesystem_t* fs = NULL;
+
+    if (io_format() != 0 || fs_mount("fat32", IO_DEVICE, IO_MOUNT_POINT, 0) != 0) {
+        host_printf("Failed to set up the FAT32 volume\n");
+        errors++;
+    } else {
+        fs = fs_get_filesystem("fat32");
+
+        if (io_layout(fs) != 0) {
+            host_printf("Failed to write the test file\n");
+            errors++;
+        } else {
+            for (unsigned int job = 0; job < job_count; job++) {
+                io_drop_caches();
+                io_start(job);
+                io_run_vfs(fs, &io_jobs[job], &io_result);
+                io_report(io_jobs[job].name, "vfs", 1, &io_result);
+                errors += io_result.errors;
+            }
+        }
+
+        fs_unmount(IO_MOUNT_POINT);
+    }
+
+    storage_close(io_bdev);
+    file_device_destroy(IO_DEVICE);
+
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,104 @@
+/**
+ * LightOS Tools
+ * Kernel services for the storage benchmark
+ *
+ * Provides just enough of the kernel (console, memory blocks and time) for
+ * drivers/storage.c and the code built on it to run as a host program. The
+ * kernel log is kernel/klog.c itself, echoing to the console.
+ */
+
+#include "bench_host.h"
+#include "../../kernel/kernel.h"
+#include "../../kernel/cpu.h"
+#include "../../kernel/ktime.h"
+#include "../../kernel/memory.h"
+
+// No calibrated clocksource: ktime_get_ns() uses ktime_pit_get_ns()
+ktime_clocksource_t ktime_clock;
+
+// Write a string to the console
+void terminal_write(const char* data) {
+    host_printf("%s", data);
+}
+
+// Write a string to the console (colors are ignored)
+void terminal_write_color(const char* data, enum vga_color fg, enum vga_color bg) {
+    (void) fg;
+    (void) bg;
+    host_printf("%s", data);
+}
+
+// Allocate a memory block
+void* allocate_block() {
+    return host_alloc(MEMORY_BLOCK_SIZE);
+}
+
+// Allocate contiguous memory blocks
+void* allocate_blocks(unsigned int count) {
+    return host_alloc((unsigned long long) count * MEMORY_BLOCK_SIZE);
+}
+
+// Allocate a memory block without reclaim (there is none on the host)
+void* allocate_block_noreclaim() {
+    return allocate_block();
+}
+
+// Allocate contiguous memory blocks without reclaim
+void* allocate_blocks_noreclaim(unsigned int count) {
+    return allocate_blocks(count);
+}
+
+// Free a memory block
+void free_block(void* address) {
+    host_free(address);
+}
+
+// Free contiguous memory blocks
+void free_blocks(void* address, unsigned int count) {
+    (void) count;
+    host_free(address);
+}
+
+// Index of the CPU the program acts as (tests move it to another CPU)
+static unsigned int shim_cpu_index = 0;
+
+// Set the current CPU's index
+void cpu_set_index(unsigned int index) {
+    shim_cpu_index = index;
+}
+
+// Get the current CPU's index
+unsigned int cpu_index() {
+    return shim_cpu_index;
+}
+
+// Act as a four-CPU package, so drivers set up more than one queue
+unsigned int cpu_count_limit() {
+    return 4;
+}
+
+// Get time since start in nanoseconds
+unsigned long long ktime_pit_get_ns() {
+    return host_time_ns();
+}
+
+// No hardware to probe; the benchmark registers its own devices
+int detect_ata_devices() {
+    return 0;
+}
+
+int detect_nvme_devices() {
+    return 0;
+}
+
+int detect_virtio_devices() {
+    return 0;
+}
+
+int detect_usb_storage_devices() {
+    return 0;
+}
+
+int detect_sd_devices() {
+    return 0;
+}
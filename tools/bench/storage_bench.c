@@ -0,0 +1,331 @@
+/**
+ * LightOS Tools
+ * Block layer benchmark
+ *
+ * Runs the kernel's block layer against a file-backed device and compares
+ * one synchronous call per request with batched submission through a
+ * storage ring, for sequential and random reads and writes.
+ *
+ * Usage: storage_bench [-d] [-s size_mb] [-n requests] [-q depth] [-b block_kb] [file]
+ */
+
+#include "bench_host.h"
+#include "file_device.h"
+#include "../../drivers/storage.h"
+#include "../../drivers/storage_ring.h"
+#include "../../libc/string.h"
+
+#define BENCH_DEVICE "bench0"
+#define BENCH_SECTOR_SIZE 512
+
+// Benchmark configuration
+typedef struct {
+    const char* path;
+    unsigned long long size;            // Device size in bytes
+    unsigned int requests;              // Requests per test
+    unsigned int depth;                 // Ring queue depth
+    unsigned int block_size;            // Request size in bytes
+    int direct;                         // Bypass the host page cache
+} bench_config_t;
+
+// Result of one test
+typedef struct {
+    unsigned long long elapsed_ns;
+    unsigned long long commands;        // Device commands issued
+    unsigned int errors;                // Failed requests or bad data
+} bench_result_t;
+
+static bench_config_t config;
+static block_dev_t* bench_bdev = NULL;
+static unsigned int bench_blocks = 0;   // Device size in requests
+
+// No page cache: direct device writes need no invalidation, and removed
+// devices leave nothing cached behind
+void page_cache_device_written(void* device, unsigned long long start_sector, unsigned int sector_count) {
+    (void) device;
+    (void) start_sector;
+    (void) sector_count;
+}
+
+void page_cache_drop_owner(void* owner) {
+    (void) owner;
+}
+
+// Parse a decimal number
+static unsigned long long bench_parse(const char* str) {
+    unsigned long long value = 0;
+
+    while (*str >= '0' && *str <= '9') {
+        value = value * 10 + (*str - '0');
+        str++;
+    }
+
+    return value;
+}
+
+// Pick the block for the i-th request of a test
+static unsigned int bench_block(unsigned int i, int random) {
+    if (random) {
+        return (unsigned int) (host_random() % bench_blocks);
+    }
+
+    return i % bench_blocks;
+}
+
+// Stamp a buffer with the block it belongs to
+static void bench_fill(unsigned char* buffer, unsigned int block) {
+    unsigned int* words = (unsigned int*) buffer;
+
+    for (unsigned int i = 0; i < config.block_size / sizeof(unsigned int); i++) {
+        words[i] = block * 2654435761u + i;
+    }
+}
+
+// Check a buffer's stamp (blocks never written read back as zeroes)
+static int bench_check(const unsigned char* buffer, unsigned int block) {
+    const unsigned int* words = (const unsigned int*) buffer;
+
+    if (words[0] == 0 && words[1] == 0) {
+        return 1;
+    }
+
+    return words[0] == block * 2654435761u && words[config.block_size / sizeof(unsigned int) - 1] ==
+           block * 2654435761u + config.block_size / sizeof(unsigned int) - 1;
+}
+
+// Get the number of device commands issued so far
+static unsigned long long bench_commands() {
+    file_device_stats_t stats;
+
+    if (file_device_get_stats(BENCH_DEVICE, &stats) != 0) {
+        return 0;
+    }
+
+    return stats.reads + stats.writes + stats.flushes;
+}
+
+// Issue every request with its own synchronous call
+static void bench_sync(int write, int random, bench_result_t* result) {
+    unsigned char* buffer = (unsigned char*) host_alloc(config.block_size);
+    unsigned int sectors = config.block_size / BENCH_SECTOR_SIZE;
+
+    if (!buffer) {
+        result->errors = config.requests;
+        return;
+    }
+
+    unsigned long long commands = bench_commands();
+    unsigned long long start = host_time_ns();
+
+    for (unsigned int i = 0; i < config.requests; i++) {
+        unsigned int block = bench_block(i, random);
+
+        if (write) {
+            bench_fill(buffer, block);
+
+            if (bdev_write_sectors(bench_bdev, block * sectors, sectors, buffer) != 0) {
+                result->errors++;
+            }
+        } else if (bdev_read_sectors(bench_bdev, block * sectors, sectors, buffer) != 0 || !bench_check(buffer, block)) {
+            result->errors++;
+        }
+    }
+
+    if (write && bdev_flush(bench_bdev) != 0) {
+        result->errors++;
+    }
+
+    result->elapsed_ns = host_time_ns() - start;
+    result->commands = bench_commands() - commands;
+
+    host_free(buffer);
+}
+
+// Ring completion state for one in-flight request
+typedef struct {
+    unsigned char* buffer;
+    unsigned int block;
+    int write;
+    bench_result_t* result;
+} bench_slot_t;
+
+// Check a completed request
+static void bench_complete(storage_ring_t* ring, const storage_cqe_t* cqe) {
+    bench_slot_t* slot = (bench_slot_t*) cqe->user_data;
+    (void) ring;
+
+    // Flushes carry no slot
+    if (!slot) {
+        return;
+    }
+
+    if (cqe->result != 0 || (!slot->write && !bench_check(slot->buffer, slot->block))) {
+        slot->result->errors++;
+    }
+}
+
+// Keep up to config.depth requests in flight through a storage ring
+static void bench_ring(int write, int random, bench_result_t* result) {
+    storage_ring_t ring;
+    bench_slot_t slots[STORAGE_RING_MAX_ENTRIES];
+    unsigned int sectors = config.block_size / BENCH_SECTOR_SIZE;
+
+    if (storage_ring_init(&ring, config.depth + 1, bench_complete, NULL) != 0) {
+        result->errors = config.requests;
+        return;
+    }
+
+    // Separate buffers, as independent callers would use
+    unsigned int allocated = 0;
+
+    for (; allocated < config.depth; allocated++) {
+        slots[allocated].buffer = (unsigned char*) host_alloc(config.block_size);
+
+        if (!slots[allocated].buffer) {
+            break;
+        }
+
+        slots[allocated].write = write;
+        slots[allocated].result = result;
+    }
+
+    if (allocated < config.depth) {
+        result->errors = config.requests;
+    } else {
+        unsigned long long commands = bench_commands();
+        unsigned long long start = host_time_ns();
+        unsigned int issued = 0;
+
+        while (issued < config.requests) {
+            unsigned int batch = config.requests - issued < config.depth ? config.requests - issued : config.depth;
+
+            for (unsigned int i = 0; i < batch; i++) {
+                bench_slot_t* slot = &slots[i];
+                storage_sqe_t* sqe = storage_ring_get_sqe(&ring);
+
+                slot->block = bench_block(issued + i, random);
+
+                if (write) {
+                    bench_fill(slot->buffer, slot->block);
+                    storage_ring_prep_write(sqe, bench_bdev, slot->block * sectors, sectors, slot->buffer, slot);
+                } else {
+                    storage_ring_prep_read(sqe, bench_bdev, slot->block * sectors, sectors, slot->buffer, slot);
+                }
+            }
+
+            if (write && issued + batch == config.requests) {
+                storage_ring_prep_flush(storage_ring_get_sqe(&ring), bench_bdev, NULL);
+            }
+
+            if (storage_ring_wait(&ring, batch) < 0) {
+                result->errors++;
+            }
+
+            storage_ring_reap(&ring, NULL, config.depth + 1);
+            issued += batch;
+        }
+
+        result->elapsed_ns = host_time_ns() - start;
+        result->commands = bench_commands() - commands;
+    }
+
+    for (unsigned int i = 0; i < allocated; i++) {
+        host_free(slots[i].buffer);
+    }
+
+    storage_ring_destroy(&ring);
+}
+
+// Print one result line
+static void bench_report(const char* test, const char* mode, const bench_result_t* result) {
+    unsigned long long us = result->elapsed_ns / 1000;
+
+    if (us == 0) {
+        us = 1;
+    }
+
+    unsigned long long iops = (unsigned long long) config.requests * 1000000ULL / us;
+    unsigned long long kbps = (unsigned long long) config.requests * (config.block_size / 1024) * 1000000ULL / us;
+
+    host_printf("%-10s %-6s %10llu %10llu.%llu %10llu %8llu.%02llu %6u\n", test, mode, iops, kbps / 1024,
+                (kbps % 1024) * 10 / 1024, result->commands, result->elapsed_ns / config.requests / 1000,
+                (result->elapsed_ns / config.requests % 1000) / 10, result->errors);
+}
+
+// Run one pattern both ways
+static int bench_run(const char* test, int write, int random) {
+    bench_result_t sync_result;
+    bench_result_t ring_result;
+
+    memset(&sync_result, 0, sizeof(bench_result_t));
+    memset(&ring_result, 0, sizeof(bench_result_t));
+
+    host_srandom(1 + write * 2 + random);
+    bench_sync(write, random, &sync_result);
+    bench_report(test, "sync", &sync_result);
+
+    host_srandom(1 + write * 2 + random);
+    bench_ring(write, random, &ring_result);
+    bench_report(test, "ring", &ring_result);
+
+    return sync_result.errors + ring_result.errors;
+}
+
+// Entry point
+int main(int argc, char** argv) {
+    config.path = "/tmp/lightos-bench.img";
+    config.size = 64ULL * 1024 * 1024;
+    config.requests = 16384;
+    config.depth = 32;
+    config.block_size = 4096;
+    config.direct = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-d") == 0) {
+            config.direct = 1;
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            config.size = bench_parse(argv[++i]) * 1024 * 1024;
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            config.requests = (unsigned int) bench_parse(argv[++i]);
+        } else if (strcmp(argv[i], "-q") == 0 && i + 1 < argc) {
+            config.depth = (unsigned int) bench_parse(argv[++i]);
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            config.block_size = (unsigned int) bench_parse(argv[++i]) * 1024;
+        } else if (argv[i][0] != '-') {
+            config.path = argv[i];
+        } else {
+            host_printf("Usage: %s [-d] [-s size_mb] [-n requests] [-q depth] [-b block_kb] [file]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    if (config.depth == 0 || config.depth >= STORAGE_RING_MAX_ENTRIES || config.block_size == 0 ||
+        config.block_size > STORAGE_MAX_REQUEST_BYTES || config.requests == 0 || config.size < config.block_size) {
+        host_printf("Invalid configuration\n");
+        return 2;
+    }
+
+    storage_init();
+
+    if (file_device_create(BENCH_DEVICE, config.path, config.size, BENCH_SECTOR_SIZE, config.direct) != 0) {
+        return 1;
+    }
+
+    bench_bdev = storage_open(BENCH_DEVICE);
+    bench_blocks = (unsigned int) (config.size / config.block_size);
+
+    host_printf("\n%s: %llu MB, %u x %u KB requests, ring depth %u%s\n\n", config.path, config.size / (1024 * 1024),
+                config.requests, config.block_size / 1024, config.depth, config.direct ? ", O_DIRECT" : "");
+    host_printf("%-10s %-6s %10s %12s %10s %11s %6s\n", "test", "mode", "IOPS", "MB/s", "commands", "us/request", "errors");
+
+    int errors = 0;
+    errors += bench_run("seqwrite", 1, 0);
+    errors += bench_run("randwrite", 1, 1);
+    errors += bench_run("seqread", 0, 0);
+    errors += bench_run("randread", 0, 1);
+
+    storage_close(bench_bdev);
+    file_device_destroy(BENCH_DEVICE);
+
+    return errors ? 1 : 0;
+}
@@ -99,12 +99,17 @@ build_kernel() {
     gcc -c kernel/memory.c -o build/memory.o -ffreestanding -O2 -Wall -Wextra
     gcc -c kernel/process.c -o build/process.o -ffreestanding -O2 -Wall -Wextra
     gcc -c kernel/filesystem.c -o build/filesystem.o -ffreestanding -O2 -Wall -Wextra
+    gcc -c kernel/dcache.c -o build/dcache.o -ffreestanding -O2 -Wall -Wextra
+    gcc -c kernel/page_cache.c -o build/page_cache.o -ffreestanding -O2 -Wall -Wextra
+    gcc -c kernel/klog.c -o build/klog.o -ffreestanding -O2 -Wall -Wextra
+    gcc -c kernel/ktime.c -o build/ktime.o -ffreestanding -O2 -Wall -Wextra
     
     # Compile the init system
     gcc -c init/init.c -o build/init.o -ffreestanding -O2 -Wall -Wextra
     
     # Compile the drivers
     gcc -c drivers/keyboard.c -o build/keyboard.o -ffreestanding -O2 -Wall -Wextra
+    gcc -c drivers/serial.c -o build/serial.o -ffreestanding -O2 -Wall -Wextra
     
     # Compile the networking
     gcc -c networking/network.c -o build/network.o -ffreestanding -O2 -Wall -Wextra
@@ -120,9 +125,10 @@ build_kernel() {
     
     # Compile the C library
     gcc -c libc/string.c -o build/string.o -ffreestanding -O2 -Wall -Wextra
+    gcc -c libc/hashmap.c -o build/hashmap.o -ffreestanding -O2 -Wall -Wextra
     
     # Link the kernel
-    ld -o build/kernel.bin -T kernel/linker.ld build/kernel_entry.o build/kernel.o build/memory.o build/process.o build/filesystem.o build/init.o build/keyboard.o build/network.o build/server.o build/gui.o build/cli.o build/string.o --oformat binary
+    ld -o build/kernel.bin -T kernel/linker.ld build/kernel_entry.o build/kernel.o build/memory.o build/process.o build/filesystem.o build/dcache.o build/page_cache.o build/klog.o build/ktime.o build/init.o build/keyboard.o build/serial.o build/network.o build/server.o build/gui.o build/cli.o build/string.o build/hashmap.o --oformat binary
     
     print_success "Kernel built successfully."
 }
@@ -0,0 +1,1102 @@
+/**
+ * LightOS Tools
+ * Host tests for the file systems and the block layer
+ *
+ * Links the kernel's storage stack into a host program, like the
+ * benchmarks, and runs it against ext4 images made by mkfs.ext4 (see
+ * make_images.sh). Files are checked against the tree the images were
+ * built from. The kernel's own storage and hash map suites run here too,
+ * together with the cases that need the host: a clock that can be moved forward (queue
+ * deadlines, dirty page expiry), and the virtio-blk and NVMe drivers
+ * against emulated devices (see virtio_emu.c and nvme_emu.c).
+ *
+ * Usage: fs_test <image directory>
+ */
+
+#include "../bench/bench_host.h"
+#include "../bench/file_device.h"
+#include "virtio_emu.h"
+#include "nvme_emu.h"
+#include "../../testing/test_framework.h"
+#include "../../testing/storage_tests.h"
+#include "../../testing/hashmap_tests.h"
+#include "../../testing/klog_tests.h"
+#include "../../testing/dcache_tests.h"
+#include "../../drivers/storage.h"
+#include "../../drivers/storage_ring.h"
+#include "../../drivers/virtio_blk.h"
+#include "../../drivers/nvme.h"
+#include "../../kernel/kernel.h"
+#include "../../kernel/cpu.h"
+#include "../../kernel/filesystem_ext.h"
+#include "../../kernel/dcache.h"
+#include "../../kernel/icache.h"
+#include "../../kernel/klog.h"
+#include "../../kernel/ktime.h"
+#include "../../kernel/page_cache.h"
+#include "../../libc/string.h"
+
+#define FSTEST_DEVICE "hd0"
+#define FSTEST_SECTOR_SIZE 512
+#define FSTEST_MOUNT_POINT "/mnt"
+
+// Largest read done in one call
+#define FSTEST_CHUNK (1024 * 1024)
+
+// Directory holding the images and the tree they were built from
+static const char* fstest_dir = NULL;
+
+// Read buffers (file system and host file)
+static unsigned char fstest_buffer[FSTEST_CHUNK];
+static unsigned char fstest_expected[FSTEST_CHUNK];
+
+// Build the path of something in the image directory
+static void fstest_path(char* path, const char* name) {
+    strcpy(path, fstest_dir);
+    strcat(path, "/");
+    strcat(path, name);
+}
+
+// Build a name ending in a number, zero-padded to digits (0 for no padding)
+static void fstest_name(char* name, const char* prefix, unsigned int number, unsigned int digits) {
+    char text[16];
+    unsigned int count = 0;
+
+    do {
+        text[count++] = '0' + number % 10;
+        number /= 10;
+    } while (number > 0 || count < digits);
+
+    strcpy(name, prefix);
+
+    unsigned int length = strlen(name);
+
+    for (unsigned int i = 0; i < count; i++) {
+        name[length + i] = text[count - 1 - i];
+    }
+
+    name[length + count] = '\0';
+}
+
+// Attach an image as the test device and mount it; NULL if either fails
+static filesystem_t* fstest_mount(const char* image) {
+    char path[256];
+    fstest_path(path, image);
+
+    unsigned long long size = host_file_size(path);
+
+    if (size == 0) {
+        host_printf("Missing image %s (run make_images.sh)\n", path);
+        return NULL;
+    }
+
+    if (file_device_create(FSTEST_DEVICE, path, size, FSTEST_SECTOR_SIZE, 0) != 0) {
+        return NULL;
+    }
+
+    if (fs_mount("ext4", FSTEST_DEVICE, FSTEST_MOUNT_POINT, 0) != 0) {
+        file_device_destroy(FSTEST_DEVICE);
+        return NULL;
+    }
+
+    return fs_get_filesystem("ext4");
+}
+
+// Unmount the test device and detach its image; returns 0 on success
+static int fstest_unmount() {
+    int result = fs_unmount(FSTEST_MOUNT_POINT);
+
+    file_device_destroy(FSTEST_DEVICE);
+
+    return result;
+}
+
+// Compare a file with its copy in the source tree, reading chunk bytes at a
+// time, in order or at random offsets; returns 0 if they match
+static int fstest_compare(filesystem_t* fs, const char* path, unsigned int chunk, int random) {
+    char host_path[256];
+    fstest_path(host_path, "root");
+    strcat(host_path, path);
+
+    unsigned long long size = host_file_size(host_path);
+    int fd = host_file_open(host_path, size, 0);
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    int result = 0;
+    unsigned long long offset = 0;
+
+    for (unsigned int i = 0; result == 0 && (random ? i < 300 : offset < size); i++) {
+        if (random) {
+            offset = host_random() % size;
+        }
+
+        unsigned int expected = size - offset < chunk ? (unsigned int) (size - offset) : chunk;
+        int got = fs->read(fs, path, fstest_buffer, chunk, (unsigned int) offset);
+
+        if (got != (int) expected || host_file_pread(fd, fstest_expected, expected, offset) != 0 ||
+            memcmp(fstest_buffer, fstest_expected, expected) != 0) {
+            host_printf("%s differs at offset %llu (%d of %u)\n", path, offset, got, expected);
+            result = -1;
+        }
+
+        offset += expected;
+    }
+
+    // Reading at the end gives nothing
+    if (result == 0 && fs->read(fs, path, fstest_buffer, chunk, (unsigned int) size) != 0) {
+        result = -1;
+    }
+
+    host_file_close(fd);
+
+    return result;
+}
+
+// Check every file of the source tree on a mounted image
+static test_result_t fstest_check_tree(filesystem_t* fs) {
+    TEST_ASSERT_EQUAL(0, fstest_compare(fs, "/big", 4096, 0));
+    TEST_ASSERT_EQUAL(0, fstest_compare(fs, "/big", 100000, 0));
+    TEST_ASSERT_EQUAL(0, fstest_compare(fs, "/big", 7000, 1));
+    TEST_ASSERT_EQUAL(0, fstest_compare(fs, "/sparse", 4096, 0));
+    TEST_ASSERT_EQUAL(0, fstest_compare(fs, "/sparse", 7000, 1));
+    TEST_ASSERT_EQUAL(0, fstest_compare(fs, "/odd", 1000, 0));
+    TEST_ASSERT_EQUAL(0, fstest_compare(fs, "/a/b/c/deep", 4096, 0));
+
+    // Names spread over several directory blocks
+    char path[64];
+    char expected[8];
+
+    for (unsigned int i = 0; i < 400; i++) {
+        fstest_name(path, "/many/file_with_long_name_", i, 4);
+        fstest_name(expected, "x", i, 0);
+
+        memset(fstest_buffer, 0, 16);
+        TEST_ASSERT_EQUAL((int) strlen(expected), fs->read(fs, path, fstest_buffer, 16, 0));
+        TEST_ASSERT_STRING_EQUAL(expected, (char*) fstest_buffer);
+    }
+
+    // Missing names, and a directory read as a file
+    TEST_ASSERT_EQUAL(-1, fs->read(fs, "/nope", fstest_buffer, 1, 0));
+    TEST_ASSERT_EQUAL(-1, fs->read(fs, "/a/nope/x", fstest_buffer, 1, 0));
+    TEST_ASSERT_EQUAL(-1, fs->read(fs, "/a", fstest_buffer, 1, 0));
+
+    fs_stat_t stat;
+    TEST_ASSERT_EQUAL(0, fs->stat(fs, "/", &stat));
+    TEST_ASSERT_EQUAL(0, fs->stat(fs, "/big", &stat));
+    TEST_ASSERT_EQUAL(20000000ULL, stat.size);
+
+    int fd = fs->open(fs, "/odd", 0);
+    TEST_ASSERT(fd >= 0);
+    TEST_ASSERT_EQUAL(0, fs->close(fs, fd));
+    TEST_ASSERT_EQUAL(-1, fs->close(fs, fd));
+
+    return TEST_RESULT_PASS;
+}
+
+// Mount an image, check its tree and unmount it again
+static test_result_t fstest_read_image(const char* image) {
+    filesystem_t* fs = fstest_mount(image);
+    TEST_ASSERT_NOT_NULL(fs);
+
+    test_result_t result = fstest_check_tree(fs);
+
+    TEST_ASSERT_EQUAL(0, fstest_unmount());
+
+    return result;
+}
+
+// Test the extent read path with 4K blocks
+test_result_t test_ext4_read_4k() {
+    return fstest_read_image("img4k.ext4");
+}
+
+// Test the extent read path with 1K blocks (deeper extent trees)
+test_result_t test_ext4_read_1k() {
+    return fstest_read_image("img1k.ext4");
+}
+
+// Test files mapped through direct and indirect blocks
+test_result_t test_ext4_read_block_map() {
+    return fstest_read_image("imgmap.ext4");
+}
+
+// Test that sequential reads go out as large readahead requests
+test_result_t test_ext4_readahead() {
+    filesystem_t* fs = fstest_mount("img4k.ext4");
+    TEST_ASSERT_NOT_NULL(fs);
+
+    file_device_stats_t before;
+    file_device_stats_t after;
+
+    file_device_get_stats(FSTEST_DEVICE, &before);
+    test_result_t result = fstest_compare(fs, "/big", 4096, 0) == 0 ? TEST_RESULT_PASS : TEST_RESULT_FAIL;
+    file_device_get_stats(FSTEST_DEVICE, &after);
+
+    // 4883 pages; page by page would take a request each
+    host_printf("(%llu requests) ", after.reads - before.reads);
+    TEST_ASSERT(after.reads - before.reads < 1000);
+
+    TEST_ASSERT_EQUAL(0, fstest_unmount());
+
+    return result;
+}
+
+// Test lookups in a 20003-entry directory indexed by a two-level htree
+test_result_t test_ext4_htree() {
+    filesystem_t* fs = fstest_mount("htree.ext4");
+    TEST_ASSERT_NOT_NULL(fs);
+
+    char path[300];
+    fs_stat_t stat;
+    file_device_stats_t before;
+    file_device_stats_t after;
+
+    // A few cold lookups read one path down the index each; a linear scan
+    // would read the whole directory (over 500 blocks) for the first one
+    file_device_get_stats(FSTEST_DEVICE, &before);
+
+    for (unsigned int i = 0; i < 10; i++) {
+        fstest_name(path, "/huge/entry_", i * 1999, 6);
+        strcat(path, ".dat");
+        TEST_ASSERT_EQUAL(0, fs->stat(fs, path, &stat));
+    }
+
+    file_device_get_stats(FSTEST_DEVICE, &after);
+    host_printf("(%llu requests) ", after.reads - before.reads);
+    TEST_ASSERT(after.reads - before.reads < 60);
+
+    for (unsigned int i = 0; i < 20000; i++) {
+        fstest_name(path, "/huge/entry_", i, 6);
+        strcat(path, ".dat");
+        TEST_ASSERT_EQUAL(0, fs->stat(fs, path, &stat));
+    }
+
+    // Names outside the numbered pattern: UTF-8, long (the file table keeps
+    // whole paths of up to 255 bytes), dotted
+    TEST_ASSERT_EQUAL(0, fs->stat(fs, "/huge/\xc3\xa9t\xc3\xa9_caf\xc3\xa9", &stat));
+    TEST_ASSERT_EQUAL(0, fs->stat(fs, "/huge/.hidden", &stat));
+
+    strcpy(path, "/huge/");
+    unsigned int length = strlen(path);
+    memset(path + length, 'A', 240);
+    path[length + 240] = '\0';
+    TEST_ASSERT_EQUAL(0, fs->stat(fs, path, &stat));
+
+    // Missing names hash somewhere too; a small directory has no index
+    TEST_ASSERT_EQUAL(-1, fs->stat(fs, "/huge/entry_020000.dat", &stat));
+    TEST_ASSERT_EQUAL(-1, fs->stat(fs, "/huge/nonexistent", &stat));
+    TEST_ASSERT_EQUAL(1, fs->read(fs, "/small/x", fstest_buffer, 16, 0));
+
+    TEST_ASSERT_EQUAL(0, fstest_unmount());
+
+    return TEST_RESULT_PASS;
+}
+
+// Size of the file streamed by the write tests, and where the scattered
+// blocks of the sparse one start
+#define FSTEST_STREAM_SIZE (4 * 1024 * 1024)
+#define FSTEST_HOLES_BASE (8 * 1024 * 1024)
+
+// Run an e2fsprogs command on an image, quietly; returns its exit status
+static int fstest_e2fsprogs(const char* program, const char* image, const char* filter) {
+    char path[256];
+    char command[768];
+
+    fstest_path(path, image);
+    strcpy(command, "PATH=\"$PATH:/sbin:/usr/sbin\" ");
+    strcat(command, program);
+    strcat(command, " '");
+    strcat(command, path);
+    strcat(command, "' 2> /dev/null");
+    strcat(command, filter);
+
+    return host_run(command);
+}
+
+// Copy an image (a fresh one to write to, or a crash-time snapshot)
+static int fstest_copy_image(const char* from, const char* to) {
+    char from_path[256];
+    char to_path[256];
+    char command[600];
+
+    fstest_path(from_path, from);
+    fstest_path(to_path, to);
+    strcpy(command, "cp '");
+    strcat(command, from_path);
+    strcat(command, "' '");
+    strcat(command, to_path);
+    strcat(command, "'");
+
+    return host_run(command);
+}
+
+// Fill a buffer with data that depends only on the file offset
+static void fstest_fill(unsigned char* buffer, unsigned int size, unsigned long long offset, unsigned int seed) {
+    for (unsigned int i = 0; i < size; i++) {
+        unsigned long long position = offset + i;
+        buffer[i] = (unsigned char) (position * 31 + seed + (position >> 12));
+    }
+}
+
+// Write a streamed file, a sparse one and two rewrites, fsyncing each
+static test_result_t fstest_write_files(filesystem_t* fs) {
+    for (unsigned int offset = 0; offset < FSTEST_STREAM_SIZE; offset += 65536) {
+        fstest_fill(fstest_buffer, 65536, offset, 1);
+        TEST_ASSERT_EQUAL(65536, fs->write(fs, "/stream", fstest_buffer, 65536, offset));
+    }
+
+    TEST_ASSERT_EQUAL(4, fs->write(fs, "/holes", "head", 4, 10));
+    TEST_ASSERT_EQUAL(4, fs->write(fs, "/holes", "tail", 4, 3 * 1024 * 1024 + 100));
+
+    for (unsigned int i = 0; i < 100; i++) {
+        unsigned int offset = FSTEST_HOLES_BASE + (i * 37 % 512) * 4096;
+        fstest_fill(fstest_buffer, 4096, offset, 3);
+        TEST_ASSERT_EQUAL(4096, fs->write(fs, "/holes", fstest_buffer, 4096, offset));
+    }
+
+    // Past the end, leaving a gap, and over existing data
+    TEST_ASSERT_EQUAL(1, fs->write(fs, "/small", "X", 1, 10000));
+    fstest_fill(fstest_buffer, 5000, 7000, 9);
+    TEST_ASSERT_EQUAL(5000, fs->write(fs, "/old", fstest_buffer, 5000, 7000));
+
+    TEST_ASSERT_EQUAL(0, fs->fsync(fs, "/stream"));
+    TEST_ASSERT_EQUAL(0, fs->fsync(fs, "/holes"));
+    TEST_ASSERT_EQUAL(0, fs->fsync(fs, "/small"));
+    TEST_ASSERT_EQUAL(0, fs->fsync(fs, "/old"));
+
+    return TEST_RESULT_PASS;
+}
+
+// Check what fstest_write_files() wrote
+static test_result_t fstest_check_files(filesystem_t* fs) {
+    fs_stat_t stat;
+
+    TEST_ASSERT_EQUAL(0, fs->stat(fs, "/stream", &stat));
+    TEST_ASSERT_EQUAL((unsigned long long) FSTEST_STREAM_SIZE, stat.size);
+
+    for (unsigned int offset = 0; offset < FSTEST_STREAM_SIZE; offset += FSTEST_CHUNK) {
+        TEST_ASSERT_EQUAL(FSTEST_CHUNK, fs->read(fs, "/stream", fstest_buffer, FSTEST_CHUNK, offset));
+        fstest_fill(fstest_expected, FSTEST_CHUNK, offset, 1);
+        TEST_ASSERT(memcmp(fstest_buffer, fstest_expected, FSTEST_CHUNK) == 0);
+    }
+
+    // Holes read as zeros
+    memset(fstest_expected, 0, 10);
+    TEST_ASSERT_EQUAL(14, fs->read(fs, "/holes", fstest_buffer, 14, 0));
+    TEST_ASSERT(memcmp(fstest_buffer, fstest_expected, 10) == 0 && memcmp(fstest_buffer + 10, "head", 4) == 0);
+    TEST_ASSERT_EQUAL(4, fs->read(fs, "/holes", fstest_buffer, 4, 3 * 1024 * 1024 + 100));
+    TEST_ASSERT(memcmp(fstest_buffer, "tail", 4) == 0);
+
+    for (unsigned int i = 0; i < 100; i++) {
+        unsigned int offset = FSTEST_HOLES_BASE + (i * 37 % 512) * 4096;
+        fstest_fill(fstest_expected, 4096, offset, 3);
+        TEST_ASSERT_EQUAL(4096, fs->read(fs, "/holes", fstest_buffer, 4096, offset));
+        TEST_ASSERT(memcmp(fstest_buffer, fstest_expected, 4096) == 0);
+    }
+
+    TEST_ASSERT_EQUAL(10001, fs->read(fs, "/small", fstest_buffer, 20000, 0));
+    TEST_ASSERT(memcmp(fstest_buffer, "hello small file", 16) == 0);
+    TEST_ASSERT_EQUAL(0, fstest_buffer[9999]);
+    TEST_ASSERT_EQUAL('X', fstest_buffer[10000]);
+
+    fstest_fill(fstest_expected, 5000, 7000, 9);
+    TEST_ASSERT_EQUAL(5000, fs->read(fs, "/old", fstest_buffer, 5000, 7000));
+    TEST_ASSERT(memcmp(fstest_buffer, fstest_expected, 5000) == 0);
+
+    return TEST_RESULT_PASS;
+}
+
+// Write to a copy of an image, unmount it, and have e2fsck check the result
+static test_result_t fstest_write_image(const char* image) {
+    TEST_ASSERT_EQUAL(0, fstest_copy_image(image, "work.ext4"));
+
+    filesystem_t* fs = fstest_mount("work.ext4");
+    TEST_ASSERT_NOT_NULL(fs);
+
+    test_result_t result = fstest_write_files(fs);
+
+    TEST_ASSERT_EQUAL(0, fstest_unmount());
+    TEST_ASSERT_EQUAL(TEST_RESULT_PASS, result);
+    TEST_ASSERT_EQUAL(0, fstest_e2fsprogs("e2fsck -fn", "work.ext4", " > /dev/null"));
+
+    fs = fstest_mount("work.ext4");
+    TEST_ASSERT_NOT_NULL(fs);
+
+    result = fstest_check_files(fs);
+
+    TEST_ASSERT_EQUAL(0, fstest_unmount());
+
+    return result;
+}
+
+// Test writes to a 4K-block image
+test_result_t test_ext4_write_4k() {
+    return fstest_write_image("rw4k.ext4");
+}
+
+// Test writes to a 1K-block image
+test_result_t test_ext4_write_1k() {
+    return fstest_write_image("rw1k.ext4");
+}
+
+// Test that fsynced writes survive a crash, replayed by this journal code
+// and by e2fsck
+test_result_t test_ext4_crash_replay() {
+    TEST_ASSERT_EQUAL(0, fstest_copy_image("rw1k.ext4", "work.ext4"));
+
+    filesystem_t* fs = fstest_mount("work.ext4");
+    TEST_ASSERT_NOT_NULL(fs);
+
+    // The device holds everything fsync wrote, but the metadata is only
+    // in the journal until a checkpoint: copy it as a crash would leave it
+    test_result_t result = fstest_write_files(fs);
+    int copied = fstest_copy_image("work.ext4", "crash.ext4");
+
+    TEST_ASSERT_EQUAL(0, fstest_unmount());
+    TEST_ASSERT_EQUAL(TEST_RESULT_PASS, result);
+    TEST_ASSERT_EQUAL(0, copied);
+    TEST_ASSERT_EQUAL(0, fstest_e2fsprogs("dumpe2fs -h", "crash.ext4", " | grep -q needs_recovery"));
+    TEST_ASSERT_EQUAL(0, fstest_copy_image("crash.ext4", "crash-fsck.ext4"));
+
+    // Mounting replays the journal; e2fsck then finds nothing to fix
+    fs = fstest_mount("crash.ext4");
+    TEST_ASSERT_NOT_NULL(fs);
+
+    result = fstest_check_files(fs);
+
+    TEST_ASSERT_EQUAL(0, fstest_unmount());
+    TEST_ASSERT_EQUAL(TEST_RESULT_PASS, result);
+    TEST_ASSERT_EQUAL(0, fstest_e2fsprogs("e2fsck -fn", "crash.ext4", " > /dev/null"));
+
+    // e2fsck replays the same journal (exit status 1: file system changed)
+    int status = fstest_e2fsprogs("e2fsck -fy", "crash-fsck.ext4", " > /dev/null");
+    TEST_ASSERT(status == 0 || status == 1);
+    TEST_ASSERT_EQUAL(0, fstest_e2fsprogs("e2fsck -fn", "crash-fsck.ext4", " > /dev/null"));
+
+    fs = fstest_mount("crash-fsck.ext4");
+    TEST_ASSERT_NOT_NULL(fs);
+
+    result = fstest_check_files(fs);
+
+    TEST_ASSERT_EQUAL(0, fstest_unmount());
+
+    return result;
+}
+
+// Test that a queued write is dispatched once it passes its deadline
+test_result_t test_storage_queue_deadline() {
+    unsigned char buffer[512];
+    file_device_stats_t stats;
+    storage_queue_stats_t queue;
+
+    TEST_ASSERT_EQUAL(0, file_device_create("mem0", NULL, 1024 * 1024, FSTEST_SECTOR_SIZE, 0));
+
+    memset(buffer, 0x5A, sizeof(buffer));
+    storage_plug();
+    storage_write_sectors("mem0", 10, 1, buffer);
+    file_device_get_stats("mem0", &stats);
+    unsigned long long queued = stats.writes;
+
+    // The next write finds the first one expired and runs the queue, oldest
+    // request first
+    host_time_advance(STORAGE_WRITE_EXPIRE_NS + 1);
+    storage_write_sectors("mem0", 500, 1, buffer);
+    file_device_get_stats("mem0", &stats);
+    unsigned long long expired = stats.writes;
+
+    int result = storage_unplug();
+    storage_get_queue_stats("mem0", &queue);
+    file_device_destroy("mem0");
+
+    TEST_ASSERT_EQUAL(0, result);
+    TEST_ASSERT_EQUAL(0ULL, queued);
+    TEST_ASSERT_EQUAL(2ULL, expired);
+    TEST_ASSERT_EQUAL(1ULL, queue.expired);
+
+    return TEST_RESULT_PASS;
+}
+
+// Pages written back by the page cache tests' mappings
+static unsigned int fstest_writepages = 0;
+static int fstest_owner;
+
+// Mapping read function (pages start zeroed)
+static int fstest_readpage(page_mapping_t* mapping, unsigned int index, void* buffer) {
+    (void) mapping;
+    (void) index;
+    memset(buffer, 0, PAGE_CACHE_PAGE_SIZE);
+    return 0;
+}
+
+// Mapping write function (counts pages)
+static int fstest_writepage(page_mapping_t* mapping, unsigned int index, const void* buffer) {
+    (void) mapping;
+    (void) index;
+    (void) buffer;
+    fstest_writepages++;
+    return 0;
+}
+
+static const page_mapping_ops_t fstest_mapping_ops = {fstest_readpage, fstest_writepage};
+
+// Dirty a run of whole pages
+static int fstest_dirty_pages(page_mapping_t* mapping, unsigned int first, unsigned int count) {
+    for (unsigned int i = first; i < first + count; i++) {
+        if (page_cache_write(mapping, (unsigned long long) i * PAGE_CACHE_PAGE_SIZE, fstest_buffer, PAGE_CACHE_PAGE_SIZE) != PAGE_CACHE_PAGE_SIZE) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Test that the flusher leaves young dirty pages alone and writes expired ones
+test_result_t test_storage_writeback_expiry() {
+    page_mapping_t* mapping = page_cache_get_mapping(&fstest_owner, 1, &fstest_mapping_ops, NULL);
+    TEST_ASSERT_NOT_NULL(mapping);
+
+    // Under the background threshold nothing is written until the pages expire
+    fstest_writepages = 0;
+    TEST_ASSERT_EQUAL(0, fstest_dirty_pages(mapping, 0, 100));
+    TEST_ASSERT_EQUAL(0, (int) fstest_writepages);
+
+    host_time_advance(PAGE_CACHE_FLUSH_INTERVAL_NS + 1);
+    page_cache_flusher_run();
+    unsigned int young = fstest_writepages;
+
+    host_time_advance(PAGE_CACHE_DIRTY_EXPIRE_NS);
+    page_cache_flusher_run();
+    unsigned int expired = fstest_writepages;
+    unsigned int left = mapping->nr_dirty;
+
+    page_cache_release_mapping(mapping);
+    page_cache_drop_owner(&fstest_owner);
+
+    TEST_ASSERT_EQUAL(0, (int) young);
+    TEST_ASSERT_EQUAL(100, (int) expired);
+    TEST_ASSERT_EQUAL(0, (int) left);
+
+    return TEST_RESULT_PASS;
+}
+
+// Test the background and limit dirty thresholds
+test_result_t test_storage_writeback_thresholds() {
+    page_cache_stats_t stats;
+
+    // The counts below are absolute, so nothing else may be dirty
+    page_cache_get_stats(&stats);
+    TEST_ASSERT_EQUAL(0, (int) stats.dirty_pages);
+
+    page_mapping_t* older = page_cache_get_mapping(&fstest_owner, 1, &fstest_mapping_ops, NULL);
+    page_mapping_t* newer = page_cache_get_mapping(&fstest_owner, 2, &fstest_mapping_ops, NULL);
+    page_mapping_t* bulk = page_cache_get_mapping(&fstest_owner, 3, &fstest_mapping_ops, NULL);
+    TEST_ASSERT_NOT_NULL(older);
+    TEST_ASSERT_NOT_NULL(newer);
+    TEST_ASSERT_NOT_NULL(bulk);
+
+    // Over the background threshold writers carry on; the flusher writes
+    // the oldest mapping first, down to the threshold
+    fstest_writepages = 0;
+    TEST_ASSERT_EQUAL(0, fstest_dirty_pages(older, 0, 150));
+    host_time_advance(1000);
+    TEST_ASSERT_EQUAL(0, fstest_dirty_pages(newer, 0, 100));
+    page_cache_get_stats(&stats);
+    unsigned int background_written = fstest_writepages;
+    unsigned long long throttled = stats.throttled;
+
+    page_cache_flusher_run();
+    page_cache_get_stats(&stats);
+    unsigned int flushed = fstest_writepages;
+    unsigned int flushed_dirty = stats.dirty_pages;
+    unsigned int older_dirty = older->nr_dirty;
+    unsigned int newer_dirty = newer->nr_dirty;
+
+    // Over the limit a writer writes back before it dirties more
+    TEST_ASSERT_EQUAL(0, fstest_dirty_pages(bulk, 0, 600));
+    page_cache_get_stats(&stats);
+    unsigned long long limit_throttled = stats.throttled - throttled;
+    unsigned int limit_dirty = stats.dirty_pages;
+
+    int result = page_cache_sync_owner(&fstest_owner);
+    page_cache_release_mapping(older);
+    page_cache_release_mapping(newer);
+    page_cache_release_mapping(bulk);
+    page_cache_drop_owner(&fstest_owner);
+
+    host_printf("(%u flushed, %llu throttled) ", flushed, limit_throttled);
+    TEST_ASSERT_EQUAL(0, (int) background_written);
+    TEST_ASSERT_EQUAL(PAGE_CACHE_DIRTY_BACKGROUND, (int) flushed_dirty);
+    TEST_ASSERT_EQUAL(150 - (int) flushed, (int) older_dirty);
+    TEST_ASSERT_EQUAL(100, (int) newer_dirty);
+    TEST_ASSERT(limit_throttled > 0);
+    TEST_ASSERT(limit_dirty <= PAGE_CACHE_DIRTY_LIMIT);
+    TEST_ASSERT_EQUAL(0, result);
+
+    return TEST_RESULT_PASS;
+}
+
+// Emulated virtio-blk devices (16 MB each), named vda to vdd by the driver
+#define FSTEST_VIRTIO_SECTORS 32768
+
+static const virtio_emu_config_t fstest_virtio_configs[] = {
+    {1, 1, 512, 65536, 30, FSTEST_VIRTIO_SECTORS},      // Indirect tables, event index
+    {0, 0, 512, 65536, 30, FSTEST_VIRTIO_SECTORS},      // Chains in the ring, NO_NOTIFY flag
+    {1, 1, 4096, 65536, 30, FSTEST_VIRTIO_SECTORS},     // 4K blocks
+    {0, 1, 512, 4096, 8, FSTEST_VIRTIO_SECTORS},        // Small size_max and seg_max
+};
+
+#define FSTEST_VIRTIO_DEVICES (sizeof(fstest_virtio_configs) / sizeof(fstest_virtio_configs[0]))
+
+// Writes in flight at once through a ring
+#define FSTEST_VIRTIO_BATCH 200
+
+// The driver keeps its devices for good, so they are probed once
+static int fstest_virtio_state = -1;
+
+// Start the emulator and probe its devices; returns 0 if all came up
+static int fstest_virtio_start() {
+    if (fstest_virtio_state < 0) {
+        fstest_virtio_state = 0;
+
+        for (unsigned int i = 0; i < FSTEST_VIRTIO_DEVICES; i++) {
+            if (virtio_emu_add(&fstest_virtio_configs[i]) != (int) i) {
+                return -1;
+            }
+        }
+
+        if (virtio_emu_start() == 0 && virtio_blk_init() == (int) FSTEST_VIRTIO_DEVICES) {
+            fstest_virtio_state = 1;
+        }
+    }
+
+    return fstest_virtio_state == 1 ? 0 : -1;
+}
+
+// Write and read a device directly and through a ring, checking its disk
+static test_result_t fstest_virtio_check(unsigned int index) {
+    TEST_ASSERT_EQUAL(0, fstest_virtio_start());
+
+    virtio_blk_t* vblk = virtio_blk_get_device(index);
+    unsigned char* disk = virtio_emu_disk(index);
+    TEST_ASSERT_NOT_NULL(vblk);
+
+    char name[4] = "vda";
+    name[2] += index;
+    block_dev_t* bdev = storage_open(name);
+    TEST_ASSERT_NOT_NULL(bdev);
+
+    unsigned int sector_size = vblk->sector_size;
+    unsigned int sectors = FSTEST_VIRTIO_SECTORS / (sector_size / 512);
+    virtio_emu_stats_t before;
+    virtio_emu_get_stats(index, &before);
+
+    // A large transfer from unaligned buffers is split by max_transfer
+    unsigned int count = (FSTEST_CHUNK - sector_size) / sector_size;
+    host_srandom(index + 1);
+
+    for (unsigned int i = 0; i < FSTEST_CHUNK; i++) {
+        fstest_expected[i] = (unsigned char) host_random();
+    }
+
+    TEST_ASSERT_EQUAL(0, bdev_write_sectors(bdev, 10, count, fstest_expected + 100));
+    TEST_ASSERT(memcmp(disk + 10 * sector_size, fstest_expected + 100, count * sector_size) == 0);
+    TEST_ASSERT_EQUAL(0, bdev_read_sectors(bdev, 10, count, fstest_buffer + 8));
+    TEST_ASSERT(memcmp(fstest_buffer + 8, fstest_expected + 100, count * sector_size) == 0);
+    TEST_ASSERT_EQUAL(0, bdev_flush(bdev));
+    TEST_ASSERT(bdev_read_sectors(bdev, sectors - 2, 4, fstest_buffer) != 0);
+
+    // Scattered 4K writes and a flush in flight together
+    storage_ring_t ring;
+    storage_cqe_t cqes[FSTEST_VIRTIO_BATCH + 1];
+    unsigned int per_block = 4096 / sector_size;
+    TEST_ASSERT_EQUAL(0, storage_ring_init(&ring, 256, NULL, NULL));
+
+    for (unsigned int i = 0; i < FSTEST_VIRTIO_BATCH; i++) {
+        unsigned int block = (i * 37) % FSTEST_VIRTIO_BATCH;
+        storage_ring_prep_write(storage_ring_get_sqe(&ring), bdev, 1000 + block * per_block, per_block, fstest_expected + i * 4096, NULL);
+    }
+
+    storage_ring_prep_flush(storage_ring_get_sqe(&ring), bdev, NULL);
+    TEST_ASSERT_EQUAL(FSTEST_VIRTIO_BATCH + 1, storage_ring_submit(&ring));
+    TEST_ASSERT_EQUAL(FSTEST_VIRTIO_BATCH + 1, storage_ring_wait(&ring, FSTEST_VIRTIO_BATCH + 1));
+    TEST_ASSERT_EQUAL(FSTEST_VIRTIO_BATCH + 1, (int) storage_ring_reap(&ring, cqes, FSTEST_VIRTIO_BATCH + 1));
+
+    for (unsigned int i = 0; i <= FSTEST_VIRTIO_BATCH; i++) {
+        TEST_ASSERT_EQUAL(0, cqes[i].result);
+    }
+
+    for (unsigned int i = 0; i < FSTEST_VIRTIO_BATCH; i++) {
+        unsigned int block = (i * 37) % FSTEST_VIRTIO_BATCH;
+        TEST_ASSERT(memcmp(disk + (1000 + block * per_block) * sector_size, fstest_expected + i * 4096, 4096) == 0);
+        storage_ring_prep_read(storage_ring_get_sqe(&ring), bdev, 1000 + block * per_block, per_block, fstest_buffer + i * 4096, NULL);
+    }
+
+    TEST_ASSERT_EQUAL(FSTEST_VIRTIO_BATCH, storage_ring_submit(&ring));
+    TEST_ASSERT_EQUAL(FSTEST_VIRTIO_BATCH, storage_ring_wait(&ring, FSTEST_VIRTIO_BATCH));
+    TEST_ASSERT_EQUAL(FSTEST_VIRTIO_BATCH, (int) storage_ring_reap(&ring, cqes, FSTEST_VIRTIO_BATCH));
+    TEST_ASSERT(memcmp(fstest_buffer, fstest_expected, FSTEST_VIRTIO_BATCH * 4096) == 0);
+
+    storage_ring_destroy(&ring);
+    storage_close(bdev);
+
+    // Every request kept to the device's limits; requests were batched
+    // and kicks held back while the device was busy
+    virtio_emu_stats_t after;
+    virtio_emu_get_stats(index, &after);
+    unsigned long long requests = after.requests - before.requests;
+    host_printf("(%llu requests, %llu kicks, %llu suppressed) ", requests, vblk->notifications, vblk->suppressed);
+
+    TEST_ASSERT_EQUAL(0ULL, after.errors);
+    TEST_ASSERT(after.flushes - before.flushes >= 2);
+    TEST_ASSERT(after.max_batch > 1);
+    TEST_ASSERT(vblk->notifications > 0 && vblk->notifications < requests);
+
+    if (fstest_virtio_configs[index].indirect) {
+        TEST_ASSERT(after.indirect > before.indirect);
+    } else {
+        TEST_ASSERT_EQUAL(before.indirect, after.indirect);
+    }
+
+    return TEST_RESULT_PASS;
+}
+
+// Test requests described by indirect tables, with event index notifications
+test_result_t test_virtio_indirect() {
+    return fstest_virtio_check(0);
+}
+
+// Test requests chained in the ring, with the NO_NOTIFY flag
+test_result_t test_virtio_chained() {
+    TEST_ASSERT_EQUAL(0, fstest_virtio_start());
+    TEST_ASSERT_EQUAL(0ULL, virtio_blk_get_device(1)->features & (1ULL << VIRTIO_RING_F_EVENT_IDX));
+
+    return fstest_virtio_check(1);
+}
+
+// Test a device with 4K logical blocks
+test_result_t test_virtio_block_4k() {
+    TEST_ASSERT_EQUAL(0, fstest_virtio_start());
+    TEST_ASSERT_EQUAL(4096, (int) virtio_blk_get_device(2)->sector_size);
+
+    return fstest_virtio_check(2);
+}
+
+// Test a device whose size_max and seg_max force small requests
+test_result_t test_virtio_size_max() {
+    TEST_ASSERT_EQUAL(0, fstest_virtio_start());
+    TEST_ASSERT_EQUAL(4096, (int) virtio_blk_get_device(3)->segment_size);
+    TEST_ASSERT_EQUAL(8 * 4096, (int) virtio_blk_get_device(3)->max_transfer);
+
+    return fstest_virtio_check(3);
+}
+
+// Register the virtio-blk tests
+static void fstest_virtio_init() {
+    test_add_suite("virtio", "virtio-blk driver against an emulated device");
+
+    test_add_case("virtio", "indirect", "Indirect descriptors and event index", test_virtio_indirect);
+    test_add_case("virtio", "chained", "Chained descriptors and NO_NOTIFY", test_virtio_chained);
+    test_add_case("virtio", "block_4k", "A device with 4K blocks", test_virtio_block_4k);
+    test_add_case("virtio", "size_max", "Requests split by size_max and seg_max", test_virtio_size_max);
+}
+
+// Emulated NVMe controllers (16 MB namespaces), named nvme0n1 and nvme1n1
+#define FSTEST_NVME_SIZE (16 * 1024 * 1024)
+
+static const nvme_emu_config_t fstest_nvme_configs[] = {
+    {512, FSTEST_NVME_SIZE / 512, 0, 4},                // Four queues, no transfer limit
+    {4096, FSTEST_NVME_SIZE / 4096, 3, 2},              // 4K sectors, 32 KB transfers
+};
+
+#define FSTEST_NVME_CONTROLLERS (sizeof(fstest_nvme_configs) / sizeof(fstest_nvme_configs[0]))
+
+// Commands in flight at once, several times the command IDs of a queue
+#define FSTEST_NVME_BATCH 200
+
+// The driver keeps its controllers for good, so they are probed once
+static int fstest_nvme_state = -1;
+
+// Start the emulator and probe its controllers; returns 0 if all came up
+static int fstest_nvme_start() {
+    if (fstest_nvme_state < 0) {
+        fstest_nvme_state = 0;
+
+        for (unsigned int i = 0; i < FSTEST_NVME_CONTROLLERS; i++) {
+            if (nvme_emu_add(&fstest_nvme_configs[i]) != (int) i) {
+                return -1;
+            }
+        }
+
+        if (nvme_emu_start() == 0 && nvme_init() == (int) FSTEST_NVME_CONTROLLERS) {
+            fstest_nvme_state = 1;
+        }
+    }
+
+    return fstest_nvme_state == 1 ? 0 : -1;
+}
+
+// Open a controller's namespace
+static block_dev_t* fstest_nvme_open(unsigned int index) {
+    char name[8] = "nvme0n1";
+    name[4] += index;
+
+    return storage_open(name);
+}
+
+// Count a finished command
+static void fstest_nvme_done(storage_hw_request_t* request) {
+    (*(unsigned int*) request->private_data)++;
+}
+
+// Write and read transfers that start at every kind of offset in a page
+static test_result_t fstest_nvme_check_prps(unsigned int index) {
+    TEST_ASSERT_EQUAL(0, fstest_nvme_start());
+
+    nvme_controller_t* ctrl = nvme_get_controller(index);
+    unsigned char* disk = nvme_emu_disk(index);
+    block_dev_t* bdev = fstest_nvme_open(index);
+    TEST_ASSERT_NOT_NULL(ctrl);
+    TEST_ASSERT_NOT_NULL(bdev);
+
+    unsigned int sector_size = ctrl->sector_size;
+    nvme_emu_stats_t before;
+    nvme_emu_get_stats(index, &before);
+
+    host_srandom(index + 100);
+
+    for (unsigned int i = 0; i < FSTEST_CHUNK; i++) {
+        fstest_expected[i] = (unsigned char) host_random();
+    }
+
+    // One page, two pages (PRP2 names the second), three and more (a
+    // list), the controller's limit, and a 1 MB transfer split at it
+    static const unsigned int offsets[] = {0, 8, 512, 4092};
+    unsigned int lengths[] = {sector_size, 4096, 8192, 3 * 4096, ctrl->max_transfer, FSTEST_CHUNK - 8192};
+    unsigned int sector = 16;
+
+    for (unsigned int i = 0; i < sizeof(offsets) / sizeof(offsets[0]); i++) {
+        for (unsigned int j = 0; j < sizeof(lengths) / sizeof(lengths[0]); j++) {
+            unsigned int count = lengths[j] / sector_size;
+            unsigned char* source = fstest_expected + offsets[i];
+            unsigned char* target = fstest_buffer + (offsets[i] + 4) % 4096;
+
+            TEST_ASSERT_EQUAL(0, bdev_write_sectors(bdev, sector, count, source));
+            TEST_ASSERT(memcmp(disk + (unsigned long long) sector * sector_size, source, count * sector_size) == 0);
+            TEST_ASSERT_EQUAL(0, bdev_read_sectors(bdev, sector, count, target));
+            TEST_ASSERT(memcmp(target, source, count * sector_size) == 0);
+
+            sector += count;
+            sector = sector * sector_size >= FSTEST_NVME_SIZE - FSTEST_CHUNK ? 16 : sector;
+        }
+    }
+
+    TEST_ASSERT_EQUAL(0, bdev_flush(bdev));
+    TEST_ASSERT(bdev_read_sectors(bdev, FSTEST_NVME_SIZE / sector_size - 2, 4, fstest_buffer) != 0);
+    storage_close(bdev);
+
+    nvme_emu_stats_t after;
+    nvme_emu_get_stats(index, &after);
+
+    TEST_ASSERT_EQUAL(0ULL, after.errors);
+    TEST_ASSERT(after.prp_lists > before.prp_lists);
+    TEST_ASSERT(after.unaligned > before.unaligned);
+    TEST_ASSERT(after.flushes > before.flushes);
+
+    return TEST_RESULT_PASS;
+}
+
+// Test PRP entries and lists on a controller with 512-byte sectors
+test_result_t test_nvme_prp_512() {
+    return fstest_nvme_check_prps(0);
+}
+
+// Test PRP entries and lists on a controller with 4K sectors and a
+// transfer limit
+test_result_t test_nvme_prp_4k() {
+    TEST_ASSERT_EQUAL(0, fstest_nvme_start());
+    TEST_ASSERT_EQUAL(32 * 1024, (int) nvme_get_controller(1)->max_transfer);
+
+    return fstest_nvme_check_prps(1);
+}
+
+// Test more commands than a queue has command IDs, committed after the
+// submitter moved to another CPU
+test_result_t test_nvme_cid_wrap() {
+    static storage_hw_request_t requests[FSTEST_NVME_BATCH];
+
+    TEST_ASSERT_EQUAL(0, fstest_nvme_start());
+
+    nvme_controller_t* ctrl = nvme_get_controller(0);
+    unsigned char* disk = nvme_emu_disk(0);
+    block_dev_t* bdev = fstest_nvme_open(0);
+    TEST_ASSERT_NOT_NULL(bdev);
+
+    nvme_emu_stats_t before;
+    nvme_emu_get_stats(0, &before);
+
+    unsigned int done = 0;
+    unsigned int submitted = 0;
+    cpu_set_index(0);
+
+    for (unsigned int i = 0; i < FSTEST_NVME_BATCH; i++) {
+        memset(&requests[i], 0, sizeof(storage_hw_request_t));
+        requests[i].opcode = STORAGE_OP_WRITE;
+        requests[i].start_sector = 1000 + ((i * 37) % FSTEST_NVME_BATCH) * 8;
+        requests[i].sector_count = 8;
+        requests[i].buffer = fstest_expected + i * 4096;
+        requests[i].result = 1;
+        requests[i].done = fstest_nvme_done;
+        requests[i].private_data = &done;
+
+        if (bdev_submit(bdev, &requests[i]) == 0) {
+            submitted++;
+        }
+    }
+
+    // The last commands were queued on CPU 0's queue and not yet rung
+    cpu_set_index(1);
+    bdev_commit(bdev);
+
+    unsigned long long deadline = host_time_ns() + 5 * NSEC_PER_SEC;
+
+    while (done < submitted && host_time_ns() < deadline) {
+        bdev_poll(bdev);
+    }
+
+    cpu_set_index(0);
+    storage_close(bdev);
+
+    TEST_ASSERT_EQUAL(FSTEST_NVME_BATCH, (int) submitted);
+    TEST_ASSERT_EQUAL(FSTEST_NVME_BATCH, (int) done);
+
+    for (unsigned int i = 0; i < FSTEST_NVME_BATCH; i++) {
+        TEST_ASSERT_EQUAL(0, requests[i].result);
+        TEST_ASSERT(memcmp(disk + requests[i].start_sector * 512, fstest_expected + i * 4096, 4096) == 0);
+    }
+
+    // Every command ID was reused, none while still in flight, and the
+    // submission and completion queues wrapped several times
+    nvme_emu_stats_t after;
+    nvme_emu_get_stats(0, &after);
+    TEST_ASSERT_EQUAL(4, (int) ctrl->io_queue_count);
+    TEST_ASSERT_EQUAL(0ULL, after.errors);
+    TEST_ASSERT_EQUAL((unsigned long long) NVME_IO_QUEUE_DEPTH - 1, after.max_inflight);
+    TEST_ASSERT_EQUAL((unsigned long long) FSTEST_NVME_BATCH, after.queue_commands[0] - before.queue_commands[0]);
+
+    for (unsigned int q = 1; q < NVME_EMU_MAX_QUEUES; q++) {
+        TEST_ASSERT_EQUAL(before.queue_commands[q], after.queue_commands[q]);
+    }
+
+    return TEST_RESULT_PASS;
+}
+
+// Test that a controller that stops completing commands is failed once
+// the I/O timeout runs out
+test_result_t test_nvme_timeout() {
+    storage_hw_request_t request;
+    unsigned int done = 0;
+
+    TEST_ASSERT_EQUAL(0, fstest_nvme_start());
+
+    nvme_controller_t* ctrl = nvme_get_controller(1);
+    block_dev_t* bdev = fstest_nvme_open(1);
+    TEST_ASSERT_NOT_NULL(bdev);
+
+    nvme_emu_stall(1, 1);
+
+    memset(&request, 0, sizeof(storage_hw_request_t));
+    request.opcode = STORAGE_OP_READ;
+    request.start_sector = 8;
+    request.sector_count = 1;
+    request.buffer = fstest_buffer;
+    request.done = fstest_nvme_done;
+    request.private_data = &done;
+
+    int submitted = bdev_submit(bdev, &request);
+    bdev_commit(bdev);
+
+    // Nothing completes, but the timeout has not run out yet
+    for (int i = 0; i < 100; i++) {
+        bdev_poll(bdev);
+    }
+
+    unsigned int early = done;
+    int failed_early = ctrl->failed;
+
+    host_time_advance(NVME_IO_TIMEOUT_NS + NSEC_PER_SEC);
+    bdev_poll(bdev);
+
+    int later = bdev_read_sectors(bdev, 8, 1, fstest_buffer);
+    storage_close(bdev);
+
+    TEST_ASSERT_EQUAL(0, submitted);
+    TEST_ASSERT_EQUAL(0, (int) early);
+    TEST_ASSERT_EQUAL(0, failed_early);
+    TEST_ASSERT_EQUAL(1, (int) done);
+    TEST_ASSERT_EQUAL(-1, request.result);
+    TEST_ASSERT_EQUAL(1, ctrl->failed);
+    TEST_ASSERT_EQUAL(-1, later);
+
+    return TEST_RESULT_PASS;
+}
+
+// Register the NVMe tests
+static void fstest_nvme_init() {
+    test_add_suite("nvme", "NVMe driver against an emulated controller");
+
+    test_add_case("nvme", "prp_512", "PRP entries and lists, 512-byte sectors", test_nvme_prp_512);
+    test_add_case("nvme", "prp_4k", "PRP entries and lists, 4K sectors and a transfer limit", test_nvme_prp_4k);
+    test_add_case("nvme", "cid_wrap", "Command ID exhaustion, queue wraparound and a CPU move", test_nvme_cid_wrap);
+    test_add_case("nvme", "timeout", "A stalled controller failed by the I/O timeout", test_nvme_timeout);
+}
+
+// Register the ext4 tests
+static void fstest_ext4_init() {
+    test_add_suite("ext4", "ext4 against images made by mkfs.ext4");
+
+    test_add_case("ext4", "read_4k", "Read files from a 4K-block image", test_ext4_read_4k);
+    test_add_case("ext4", "read_1k", "Read files from a 1K-block image", test_ext4_read_1k);
+    test_add_case("ext4", "read_block_map", "Read files from a block-mapped image", test_ext4_read_block_map);
+    test_add_case("ext4", "readahead", "Read a large file with few device requests", test_ext4_readahead);
+    test_add_case("ext4", "htree", "Look up names through a directory index", test_ext4_htree);
+    test_add_case("ext4", "write_4k", "Write to a 4K-block image and check it with e2fsck", test_ext4_write_4k);
+    test_add_case("ext4", "write_1k", "Write to a 1K-block image and check it with e2fsck", test_ext4_write_1k);
+    test_add_case("ext4", "crash_replay", "Replay fsynced writes after a crash", test_ext4_crash_replay);
+}
+
+int main(int argc, char** argv) {
+    if (argc != 2) {
+        host_printf("Usage: %s <image directory>\n", argv[0]);
+        return 2;
+    }
+
+    fstest_dir = argv[1];
+
+    klog_init();
+    dcache_init();
+    icache_init();
+    page_cache_init();
+    fs_manager_init();
+    storage_init();
+
+    test_framework_init();
+    storage_tests_init();
+    hashmap_tests_init();
+    klog_tests_init();
+    dcache_tests_init();
+    test_add_case("storage", "queue_deadline", "Test deadline dispatch of a queued write", test_storage_queue_deadline);
+    test_add_case("storage", "writeback_expiry", "Test page cache writeback of expired pages", test_storage_writeback_expiry);
+    test_add_case("storage", "writeback_thresholds", "Test the page cache dirty thresholds", test_storage_writeback_thresholds);
+    fstest_ext4_init();
+    fstest_virtio_init();
+    fstest_nvme_init();
+
+    int failed = test_run_all();
+    virtio_emu_stop();
+    nvme_emu_stop();
+
+    return failed == 0 ? 0 : 1;
+}
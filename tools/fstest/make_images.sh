@@ -0,0 +1,93 @@
+#!/bin/bash
+# LightOS File System Test Images
+# This script builds the ext4 images the host file system tests read
+
+# Exit on error
+set -e
+
+DIR="${1:-build/fstest}"
+MKFS="${MKFS:-mkfs.ext4}"
+
+PATH="$PATH:/sbin:/usr/sbin"
+
+if ! command -v "$MKFS" > /dev/null; then
+    echo "$MKFS not found; install e2fsprogs to build the test images"
+    exit 1
+fi
+
+mkdir -p "$DIR"
+
+# Files every image holds: a large file, a sparse file with enough extents
+# for a depth-2 tree at 1K blocks, an odd-sized file, a nested directory
+# and a directory that spans several blocks
+ROOT="$DIR/root"
+
+if [ ! -d "$ROOT" ]; then
+    mkdir -p "$ROOT/a/b/c" "$ROOT/many"
+
+    dd if=/dev/urandom of="$ROOT/big" bs=1000000 count=20 status=none
+    dd if=/dev/urandom of="$ROOT/odd" bs=12345 count=1 status=none
+    printf 'hello deep\n' > "$ROOT/a/b/c/deep"
+
+    for ((i = 0; i < 3000; i += 2)); do
+        dd if=/dev/urandom of="$ROOT/sparse" bs=4096 seek=$i count=1 conv=notrunc status=none
+    done
+
+    printf 'tail' >> "$ROOT/sparse"
+
+    for ((i = 0; i < 400; i++)); do
+        printf 'x%d' $i > "$ROOT/many/$(printf 'file_with_long_name_%04d' $i)"
+    done
+fi
+
+# Build an image unless it is already there: make_image <name> <size> <mkfs options>
+make_image() {
+    local image="$DIR/$1"
+    local size="$2"
+    shift 2
+
+    if [ ! -f "$image" ]; then
+        "$MKFS" -q -F "$@" "$image.tmp" "$size" > /dev/null
+        mv "$image.tmp" "$image"
+    fi
+}
+
+# Read path: extents at both block sizes, and a block-mapped file system
+make_image img4k.ext4 64M -b 4096 -d "$ROOT"
+make_image img1k.ext4 64M -b 1024 -d "$ROOT"
+make_image imgmap.ext4 64M -b 1024 -O ^extent,^64bit,^flex_bg -d "$ROOT"
+
+# Directory index: 20003 entries under a two-level htree (e2fsck -D builds
+# the index, since mkfs.ext4 -d writes directories unindexed)
+HTREE_ROOT="$DIR/htree_root"
+
+if [ ! -d "$HTREE_ROOT" ]; then
+    mkdir -p "$HTREE_ROOT/huge" "$HTREE_ROOT/small"
+
+    seq -f "$HTREE_ROOT/huge/entry_%06g.dat" 0 19999 | xargs touch
+    touch "$HTREE_ROOT/huge/$(printf '\303\251t\303\251_caf\303\251')"
+    touch "$HTREE_ROOT/huge/$(printf 'A%.0s' $(seq 1 240))"
+    touch "$HTREE_ROOT/huge/.hidden"
+    printf 'x' > "$HTREE_ROOT/small/x"
+fi
+
+if [ ! -f "$DIR/htree.ext4" ]; then
+    "$MKFS" -q -F -b 1024 -N 30000 -d "$HTREE_ROOT" "$DIR/htree.ext4.tmp" 128M > /dev/null
+    "${E2FSCK:-e2fsck}" -fyD "$DIR/htree.ext4.tmp" > /dev/null 2>&1 || [ $? -le 1 ]
+    mv "$DIR/htree.ext4.tmp" "$DIR/htree.ext4"
+fi
+
+# Write path: ext4 writes only into files that exist, and only without
+# metadata checksums (jbd2 does not understand checksummed journals)
+RW_ROOT="$DIR/rw_root"
+
+if [ ! -d "$RW_ROOT" ]; then
+    mkdir -p "$RW_ROOT"
+
+    touch "$RW_ROOT/stream" "$RW_ROOT/holes"
+    printf 'hello small file' > "$RW_ROOT/small"
+    dd if=/dev/urandom of="$RW_ROOT/old" bs=20000 count=1 status=none
+fi
+
+make_image rw4k.ext4 64M -b 4096 -O ^metadata_csum -d "$RW_ROOT"
+make_image rw1k.ext4 64M -b 1024 -O ^metadata_csum -d "$RW_ROOT"
@@ -0,0 +1,535 @@
+/**
+ * LightOS Tools
+ * Host NVMe controller emulator
+ *
+ * Stands in for up to two NVMe controllers on the emulated PCI bus (see
+ * pci_emu.c) so the driver can run unchanged in a host program. Each
+ * controller has one namespace kept in memory, an admin queue and up to
+ * four I/O queue pairs. A thread watches the enable bit and the doorbells,
+ * fetches new commands, checks their PRP entries and command IDs the way
+ * a controller would, and posts completions with phase tags. A controller
+ * can be stalled, so commands are fetched by no one and the driver's I/O
+ * timeout runs out.
+ */
+
+#include "nvme_emu.h"
+#include "pci_emu.h"
+#include "../bench/bench_host.h"
+#include "../../drivers/nvme.h"
+#include "../../libc/string.h"
+
+// BAR layout: registers, then doorbells with a 4-byte stride
+#define NVME_EMU_BAR_SIZE 0x2000
+
+// Queue entries offered to the driver (CAP.MQES + 1)
+#define NVME_EMU_QUEUE_ENTRIES 256
+
+// Command IDs tracked per queue (the driver uses one per queue slot)
+#define NVME_EMU_MAX_CIDS 1024
+
+// Marks a completion that holds no command ID
+#define NVME_EMU_NO_CID 0xFFFF
+
+// Data segments one command may be split into
+#define NVME_EMU_MAX_SEGMENTS 1024
+
+// Status codes (generic command status unless noted)
+#define NVME_EMU_SC_INVALID_OPCODE 0x01
+#define NVME_EMU_SC_INVALID_FIELD  0x02
+#define NVME_EMU_SC_CID_CONFLICT   0x03
+#define NVME_EMU_SC_PRP_OFFSET     0x13
+#define NVME_EMU_SC_LBA_RANGE      0x80
+#define NVME_EMU_SC_INVALID_NS     0x0B
+#define NVME_EMU_SC_INVALID_QUEUE  0x101 // Command specific status
+
+// One submission/completion queue pair
+typedef struct {
+    int live;
+    nvme_command_t* sq;
+    volatile nvme_completion_t* cq;
+    unsigned short size;
+    unsigned short sq_head;
+    unsigned short cq_tail;
+    unsigned short cq_head;             // Last head the driver wrote
+    unsigned char phase;
+    unsigned int inflight;
+    unsigned char busy[NVME_EMU_MAX_CIDS];
+    unsigned short posted[NVME_EMU_QUEUE_ENTRIES]; // Command ID each completion releases
+} nvme_emu_queue_t;
+
+// Data segment in driver memory
+typedef struct {
+    unsigned char* address;
+    unsigned int length;
+} nvme_emu_segment_t;
+
+// Emulated controller
+typedef struct {
+    nvme_emu_config_t config;
+    unsigned char config_space[PCI_EMU_CONFIG_SIZE];
+    volatile unsigned char* bar;
+    unsigned char* disk;
+    int enabled;
+    volatile int stalled;
+    nvme_emu_queue_t queues[NVME_EMU_MAX_QUEUES + 1]; // Admin queue first
+    nvme_emu_segment_t segments[NVME_EMU_MAX_SEGMENTS];
+    nvme_emu_stats_t stats;
+} nvme_emu_controller_t;
+
+static nvme_emu_controller_t nvme_emu_controllers[NVME_EMU_MAX_CONTROLLERS];
+static int nvme_emu_count = 0;
+static volatile int nvme_emu_running = 0;
+static unsigned long long nvme_emu_thread = 0;
+
+// Register access within a BAR
+static unsigned int nvme_emu_read32(nvme_emu_controller_t* ctrl, unsigned int offset) {
+    return __atomic_load_n((volatile unsigned int*) (ctrl->bar + offset), __ATOMIC_ACQUIRE);
+}
+
+static unsigned long long nvme_emu_read64(nvme_emu_controller_t* ctrl, unsigned int offset) {
+    return *(volatile unsigned long long*) (ctrl->bar + offset);
+}
+
+static void nvme_emu_write32(nvme_emu_controller_t* ctrl, unsigned int offset, unsigned int value) {
+    __atomic_store_n((volatile unsigned int*) (ctrl->bar + offset), value, __ATOMIC_RELEASE);
+}
+
+static void nvme_emu_write64(nvme_emu_controller_t* ctrl, unsigned int offset, unsigned long long value) {
+    *(volatile unsigned long long*) (ctrl->bar + offset) = value;
+}
+
+// Set up a queue pair at the driver's memory
+static void nvme_emu_queue_init(nvme_emu_queue_t* queue, void* sq, void* cq, unsigned short size) {
+    memset(queue, 0, sizeof(nvme_emu_queue_t));
+    queue->live = 1;
+    queue->sq = (nvme_command_t*) sq;
+    queue->cq = (volatile nvme_completion_t*) cq;
+    queue->size = size;
+    queue->phase = 1;
+}
+
+// Describe a command's data with segments, checking its PRP entries;
+// returns the number of segments or -1
+static int nvme_emu_prps(nvme_emu_controller_t* ctrl, const nvme_command_t* command, unsigned int bytes) {
+    unsigned long long address = command->prp1;
+    unsigned int first = NVME_PAGE_SIZE - (address & (NVME_PAGE_SIZE - 1));
+    int count = 0;
+
+    if (address & 3) {
+        return -1;
+    }
+
+    if (address & (NVME_PAGE_SIZE - 1)) {
+        ctrl->stats.unaligned++;
+    }
+
+    first = bytes < first ? bytes : first;
+    ctrl->segments[count].address = (unsigned char*) address;
+    ctrl->segments[count++].length = first;
+    bytes -= first;
+
+    if (bytes == 0) {
+        return count;
+    }
+
+    // A second page is named by PRP2 itself
+    if (bytes <= NVME_PAGE_SIZE) {
+        if (command->prp2 & (NVME_PAGE_SIZE - 1)) {
+            return -1;
+        }
+
+        ctrl->segments[count].address = (unsigned char*) command->prp2;
+        ctrl->segments[count++].length = bytes;
+        return count;
+    }
+
+    unsigned long long* list = (unsigned long long*) command->prp2;
+
+    if (command->prp2 & 7) {
+        return -1;
+    }
+
+    ctrl->stats.prp_lists++;
+
+    while (bytes > 0) {
+        if (count >= NVME_EMU_MAX_SEGMENTS) {
+            return -1;
+        }
+
+        // The last entry of a list page points to the next list page
+        if (((unsigned long long) list & (NVME_PAGE_SIZE - 1)) == NVME_PAGE_SIZE - 8 && bytes > NVME_PAGE_SIZE) {
+            if (*list & 7) {
+                return -1;
+            }
+
+            list = (unsigned long long*) *list;
+            continue;
+        }
+
+        if (*list & (NVME_PAGE_SIZE - 1)) {
+            return -1;
+        }
+
+        unsigned int length = bytes < NVME_PAGE_SIZE ? bytes : NVME_PAGE_SIZE;
+        ctrl->segments[count].address = (unsigned char*) *list;
+        ctrl->segments[count++].length = length;
+        bytes -= length;
+        list++;
+    }
+
+    return count;
+}
+
+// Run an I/O command; returns its status
+static unsigned int nvme_emu_io(nvme_emu_controller_t* ctrl, const nvme_command_t* command) {
+    if (command->nsid != 1) {
+        return NVME_EMU_SC_INVALID_NS;
+    }
+
+    if (command->opcode == NVME_CMD_FLUSH) {
+        ctrl->stats.flushes++;
+        return 0;
+    }
+
+    if (command->opcode != NVME_CMD_READ && command->opcode != NVME_CMD_WRITE) {
+        return NVME_EMU_SC_INVALID_OPCODE;
+    }
+
+    unsigned long long lba = command->cdw10 | ((unsigned long long) command->cdw11 << 32);
+    unsigned int blocks = (command->cdw12 & 0xFFFF) + 1;
+    unsigned int bytes = blocks * ctrl->config.sector_size;
+
+    if (lba + blocks > ctrl->config.sectors) {
+        return NVME_EMU_SC_LBA_RANGE;
+    }
+
+    if (ctrl->config.mdts && bytes > (unsigned int) NVME_PAGE_SIZE << ctrl->config.mdts) {
+        return NVME_EMU_SC_INVALID_FIELD;
+    }
+
+    int count = nvme_emu_prps(ctrl, command, bytes);
+
+    if (count < 0) {
+        return NVME_EMU_SC_PRP_OFFSET;
+    }
+
+    unsigned char* disk = ctrl->disk + lba * ctrl->config.sector_size;
+
+    for (int i = 0; i < count; i++) {
+        if (command->opcode == NVME_CMD_READ) {
+            memcpy(ctrl->segments[i].address, disk, ctrl->segments[i].length);
+        } else {
+            memcpy(disk, ctrl->segments[i].address, ctrl->segments[i].length);
+        }
+
+        disk += ctrl->segments[i].length;
+    }
+
+    return 0;
+}
+
+// Fill in an identify data structure
+static unsigned int nvme_emu_identify(nvme_emu_controller_t* ctrl, const nvme_command_t* command) {
+    unsigned char* data = (unsigned char*) command->prp1;
+
+    if (command->cdw10 == NVME_IDENTIFY_CONTROLLER) {
+        memset(data, 0, NVME_PAGE_SIZE);
+        data[77] = ctrl->config.mdts;
+        return 0;
+    }
+
+    if (command->cdw10 == NVME_IDENTIFY_NAMESPACE && command->nsid == 1) {
+        unsigned char shift = 0;
+
+        while ((1u << shift) < ctrl->config.sector_size) {
+            shift++;
+        }
+
+        memset(data, 0, NVME_PAGE_SIZE);
+        memcpy(data, &ctrl->config.sectors, 8);
+        data[26] = 0;                   // LBA format 0
+        data[128 + 2] = shift;
+        return 0;
+    }
+
+    return NVME_EMU_SC_INVALID_FIELD;
+}
+
+// Run an admin command; returns its status
+static unsigned int nvme_emu_admin(nvme_emu_controller_t* ctrl, const nvme_command_t* command, unsigned int* result) {
+    unsigned int id = command->cdw10 & 0xFFFF;
+    unsigned short size = (unsigned short) ((command->cdw10 >> 16) + 1);
+
+    switch (command->opcode) {
+        case NVME_ADMIN_IDENTIFY:
+            return nvme_emu_identify(ctrl, command);
+
+        case NVME_ADMIN_SET_FEATURES:
+            if ((command->cdw10 & 0xFF) != NVME_FEATURE_NUM_QUEUES) {
+                return NVME_EMU_SC_INVALID_FIELD;
+            }
+
+            *result = ((ctrl->config.queues - 1) << 16) | (ctrl->config.queues - 1);
+            return 0;
+
+        case NVME_ADMIN_CREATE_CQ:
+            // Only physically contiguous queues are offered
+            if (id == 0 || id > ctrl->config.queues || size > NVME_EMU_QUEUE_ENTRIES || !(command->cdw11 & 1)) {
+                return NVME_EMU_SC_INVALID_QUEUE;
+            }
+
+            ctrl->queues[id].cq = (volatile nvme_completion_t*) command->prp1;
+            ctrl->queues[id].size = size;
+            return 0;
+
+        case NVME_ADMIN_CREATE_SQ:
+            // Each submission queue completes into the completion queue of
+            // the same ID, as the driver sets them up
+            if (id == 0 || id > ctrl->config.queues || !ctrl->queues[id].cq || ctrl->queues[id].size != size ||
+                (command->cdw11 >> 16) != id) {
+                return NVME_EMU_SC_INVALID_QUEUE;
+            }
+
+            nvme_emu_queue_init(&ctrl->queues[id], (void*) command->prp1, (void*) ctrl->queues[id].cq, size);
+            return 0;
+
+        default:
+            return NVME_EMU_SC_INVALID_OPCODE;
+    }
+}
+
+// Release the command IDs of completions the driver has consumed
+static void nvme_emu_reap(nvme_emu_controller_t* ctrl, nvme_emu_queue_t* queue, unsigned int id) {
+    unsigned short head = (unsigned short) nvme_emu_read32(ctrl, NVME_DOORBELL_BASE + (2 * id + 1) * 4);
+
+    while (queue->cq_head != head && queue->cq_head != queue->cq_tail) {
+        unsigned short cid = queue->posted[queue->cq_head];
+
+        if (cid != NVME_EMU_NO_CID) {
+            queue->busy[cid] = 0;
+            queue->inflight--;
+        }
+
+        queue->cq_head = (queue->cq_head + 1) % queue->size;
+    }
+}
+
+// Fetch and complete new commands on one queue; returns the number served
+static unsigned int nvme_emu_serve(nvme_emu_controller_t* ctrl, unsigned int id) {
+    nvme_emu_queue_t* queue = &ctrl->queues[id];
+    unsigned short tail = (unsigned short) nvme_emu_read32(ctrl, NVME_DOORBELL_BASE + 2 * id * 4);
+    unsigned int served = 0;
+
+    // The completion queue head is read after the tail, so a command ID
+    // the driver reused is seen as released
+    nvme_emu_reap(ctrl, queue, id);
+
+    if (tail >= queue->size) {
+        return 0;
+    }
+
+    while (queue->sq_head != tail) {
+        // Leave the command where it is while the completion queue is full
+        if ((queue->cq_tail + 1) % queue->size == queue->cq_head) {
+            break;
+        }
+
+        nvme_command_t command = queue->sq[queue->sq_head];
+        unsigned short posted = NVME_EMU_NO_CID;
+        unsigned int status;
+        unsigned int result = 0;
+
+        queue->sq_head = (queue->sq_head + 1) % queue->size;
+
+        if (command.cid >= NVME_EMU_MAX_CIDS || queue->busy[command.cid]) {
+            // The ID belongs to a command still in flight
+            ctrl->stats.errors++;
+            status = NVME_EMU_SC_CID_CONFLICT;
+        } else {
+            posted = command.cid;
+            queue->busy[command.cid] = 1;
+            queue->inflight++;
+
+            if (queue->inflight > ctrl->stats.max_inflight) {
+                ctrl->stats.max_inflight = queue->inflight;
+            }
+
+            if (id == 0) {
+                status = nvme_emu_admin(ctrl, &command, &result);
+            } else {
+                ctrl->stats.commands++;
+                ctrl->stats.queue_commands[id - 1]++;
+                status = nvme_emu_io(ctrl, &command);
+
+                if (status != 0) {
+                    ctrl->stats.errors++;
+                }
+            }
+        }
+
+        volatile nvme_completion_t* entry = &queue->cq[queue->cq_tail];
+        entry->result = result;
+        entry->sq_head = queue->sq_head;
+        entry->sq_id = (unsigned short) id;
+        entry->cid = command.cid;
+        queue->posted[queue->cq_tail] = posted;
+
+        // The phase tag goes last: it makes the entry valid
+        __atomic_store_n(&entry->status, (unsigned short) ((status << 1) | queue->phase), __ATOMIC_RELEASE);
+
+        queue->cq_tail = (queue->cq_tail + 1) % queue->size;
+
+        if (queue->cq_tail == 0) {
+            queue->phase ^= 1;
+        }
+
+        served++;
+    }
+
+    return served;
+}
+
+// Follow the enable bit, then serve every live queue
+static unsigned int nvme_emu_poll(nvme_emu_controller_t* ctrl) {
+    unsigned int enable = nvme_emu_read32(ctrl, NVME_REG_CC) & NVME_CC_ENABLE;
+
+    if (enable && !ctrl->enabled) {
+        unsigned int aqa = nvme_emu_read32(ctrl, NVME_REG_AQA);
+        void* sq = (void*) nvme_emu_read64(ctrl, NVME_REG_ASQ);
+        void* cq = (void*) nvme_emu_read64(ctrl, NVME_REG_ACQ);
+
+        memset(ctrl->queues, 0, sizeof(ctrl->queues));
+        nvme_emu_queue_init(&ctrl->queues[0], sq, cq, (unsigned short) ((aqa & 0xFFF) + 1));
+        memset((void*) (ctrl->bar + NVME_DOORBELL_BASE), 0, NVME_EMU_BAR_SIZE - NVME_DOORBELL_BASE);
+        ctrl->enabled = 1;
+        nvme_emu_write32(ctrl, NVME_REG_CSTS, NVME_CSTS_READY);
+    } else if (!enable && ctrl->enabled) {
+        // A reset drops every queue
+        memset(ctrl->queues, 0, sizeof(ctrl->queues));
+        ctrl->enabled = 0;
+        nvme_emu_write32(ctrl, NVME_REG_CSTS, 0);
+    }
+
+    if (!ctrl->enabled) {
+        return 0;
+    }
+
+    unsigned int served = nvme_emu_serve(ctrl, 0);
+
+    for (unsigned int id = 1; id <= ctrl->config.queues && !ctrl->stalled; id++) {
+        if (ctrl->queues[id].live) {
+            served += nvme_emu_serve(ctrl, id);
+        }
+    }
+
+    return served;
+}
+
+// Controller thread: poll every controller until stopped
+static void* nvme_emu_run(void* arg) {
+    (void) arg;
+
+    while (nvme_emu_running) {
+        unsigned int served = 0;
+
+        for (int i = 0; i < nvme_emu_count; i++) {
+            served += nvme_emu_poll(&nvme_emu_controllers[i]);
+        }
+
+        if (served == 0) {
+            host_sleep_us(20);
+        }
+    }
+
+    return NULL;
+}
+
+// Add a controller; returns its index (the driver names it nvme0n1, ...)
+int nvme_emu_add(const nvme_emu_config_t* config) {
+    if (nvme_emu_count >= NVME_EMU_MAX_CONTROLLERS || nvme_emu_running ||
+        config->queues == 0 || config->queues > NVME_EMU_MAX_QUEUES) {
+        return -1;
+    }
+
+    nvme_emu_controller_t* ctrl = &nvme_emu_controllers[nvme_emu_count];
+    memset(ctrl, 0, sizeof(nvme_emu_controller_t));
+    ctrl->config = *config;
+
+    ctrl->bar = (volatile unsigned char*) host_alloc(NVME_EMU_BAR_SIZE);
+    ctrl->disk = (unsigned char*) host_alloc(config->sectors * config->sector_size);
+
+    if (!ctrl->bar || !ctrl->disk) {
+        return -1;
+    }
+
+    memset((void*) ctrl->bar, 0, NVME_EMU_BAR_SIZE);
+    memset(ctrl->disk, 0, config->sectors * config->sector_size);
+
+    // CAP: MQES, contiguous queues required, 2 s enable timeout, doorbell
+    // stride 4, NVM command set, 4 KB minimum page size
+    unsigned long long cap = (NVME_EMU_QUEUE_ENTRIES - 1) | (1ULL << 16) | (4ULL << 24) | (1ULL << 37);
+    nvme_emu_write64(ctrl, NVME_REG_CAP, cap);
+    nvme_emu_write32(ctrl, NVME_REG_VS, 0x00010400);
+
+    pci_device_t id;
+    memset(&id, 0, sizeof(pci_device_t));
+    id.vendor_id = 0x1B36;              // QEMU's NVMe controller
+    id.device_id = 0x0010;
+    id.class_code = NVME_PCI_CLASS;
+    id.subclass = NVME_PCI_SUBCLASS;
+    id.prog_if = 0x02;
+
+    if (pci_emu_add(&id, ctrl->config_space, ctrl->bar) < 0) {
+        return -1;
+    }
+
+    return nvme_emu_count++;
+}
+
+// Start serving the controllers added so far
+int nvme_emu_start() {
+    if (nvme_emu_running) {
+        return 0;
+    }
+
+    nvme_emu_running = 1;
+    nvme_emu_thread = host_thread_start(nvme_emu_run, NULL);
+
+    if (!nvme_emu_thread) {
+        nvme_emu_running = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+// Stop the controller thread
+void nvme_emu_stop() {
+    if (!nvme_emu_running) {
+        return;
+    }
+
+    nvme_emu_running = 0;
+    host_thread_join(nvme_emu_thread);
+}
+
+// Stop (or resume) fetching I/O commands on a controller
+void nvme_emu_stall(int index, int stalled) {
+    if (index >= 0 && index < nvme_emu_count) {
+        nvme_emu_controllers[index].stalled = stalled;
+    }
+}
+
+// Get a controller's namespace contents
+unsigned char* nvme_emu_disk(int index) {
+    return index >= 0 && index < nvme_emu_count ? nvme_emu_controllers[index].disk : NULL;
+}
+
+// Get a controller's command counters
+void nvme_emu_get_stats(int index, nvme_emu_stats_t* stats) {
+    if (index >= 0 && index < nvme_emu_count) {
+        *stats = nvme_emu_controllers[index].stats;
+    } else {
+        memset(stats, 0, sizeof(nvme_emu_stats_t));
+    }
+}
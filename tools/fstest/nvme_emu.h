@@ -0,0 +1,42 @@
+/**
+ * LightOS Tools
+ * Host NVMe controller emulator header
+ */
+
+#ifndef NVME_EMU_H
+#define NVME_EMU_H
+
+// Maximum number of emulated controllers (one PCI function each)
+#define NVME_EMU_MAX_CONTROLLERS 2
+
+// Maximum number of I/O queue pairs a controller grants
+#define NVME_EMU_MAX_QUEUES 4
+
+// What an emulated controller offers the driver
+typedef struct {
+    unsigned int sector_size;
+    unsigned long long sectors;
+    unsigned char mdts;                 // Transfer limit is 4 KB << mdts (0: none)
+    unsigned int queues;                // I/O queue pairs granted
+} nvme_emu_config_t;
+
+// Commands seen by one controller
+typedef struct {
+    unsigned long long commands;        // I/O commands
+    unsigned long long flushes;
+    unsigned long long prp_lists;       // Commands whose data needed a PRP list
+    unsigned long long unaligned;       // Commands whose data started inside a page
+    unsigned long long errors;          // Commands that broke the controller's rules
+    unsigned long long max_inflight;    // Most command IDs in use at once on a queue
+    unsigned long long queue_commands[NVME_EMU_MAX_QUEUES];
+} nvme_emu_stats_t;
+
+// Emulator functions
+int nvme_emu_add(const nvme_emu_config_t* config);
+int nvme_emu_start();
+void nvme_emu_stop();
+void nvme_emu_stall(int index, int stalled);
+unsigned char* nvme_emu_disk(int index);
+void nvme_emu_get_stats(int index, nvme_emu_stats_t* stats);
+
+#endif /* NVME_EMU_H */
@@ -0,0 +1,148 @@
+/**
+ * LightOS Tools
+ * Host PCI bus emulator
+ *
+ * Stands in for the kernel's PCI bus code so drivers can run unchanged in
+ * a host program. The device emulators add their functions here, each
+ * with a configuration space and a memory BAR 0 of their own; the
+ * functions sit on bus 0, numbered in the order they were added.
+ * Configuration writes and enable bits are ignored.
+ */
+
+#include "pci_emu.h"
+#include "../../libc/string.h"
+
+// Emulated function
+typedef struct {
+    pci_device_t id;
+    unsigned char* config_space;
+    volatile unsigned char* bar;
+} pci_emu_function_t;
+
+static pci_emu_function_t pci_emu_functions[PCI_EMU_MAX_FUNCTIONS];
+static int pci_emu_count = 0;
+
+// Find the function a pci_device_t was handed out for
+static pci_emu_function_t* pci_emu_lookup(const pci_device_t* pci) {
+    if (pci->bus != 0 || pci->device >= pci_emu_count) {
+        return NULL;
+    }
+
+    return &pci_emu_functions[pci->device];
+}
+
+// Add a function; returns its device number
+int pci_emu_add(const pci_device_t* id, unsigned char* config_space, volatile unsigned char* bar) {
+    if (pci_emu_count >= PCI_EMU_MAX_FUNCTIONS) {
+        return -1;
+    }
+
+    pci_emu_function_t* function = &pci_emu_functions[pci_emu_count];
+    function->id = *id;
+    function->id.bus = 0;
+    function->id.device = (unsigned char) pci_emu_count;
+    function->id.function = 0;
+    function->config_space = config_space;
+    function->bar = bar;
+
+    // The identity is readable from configuration space too
+    memcpy(config_space + PCI_VENDOR_ID, &id->vendor_id, 2);
+    memcpy(config_space + PCI_DEVICE_ID, &id->device_id, 2);
+    config_space[PCI_CLASS_REVISION + 1] = id->prog_if;
+    config_space[PCI_CLASS_REVISION + 2] = id->subclass;
+    config_space[PCI_CLASS_REVISION + 3] = id->class_code;
+
+    return pci_emu_count++;
+}
+
+// PCI bus: the emulated functions are the only devices on it
+unsigned int pci_read_config(const pci_device_t* pci, unsigned int offset) {
+    pci_emu_function_t* function = pci_emu_lookup(pci);
+    unsigned int value = 0xFFFFFFFF;
+
+    if (function && offset <= PCI_EMU_CONFIG_SIZE - 4) {
+        memcpy(&value, function->config_space + offset, 4);
+    }
+
+    return value;
+}
+
+unsigned short pci_read_config16(const pci_device_t* pci, unsigned int offset) {
+    pci_emu_function_t* function = pci_emu_lookup(pci);
+    unsigned short value = 0xFFFF;
+
+    if (function && offset <= PCI_EMU_CONFIG_SIZE - 2) {
+        memcpy(&value, function->config_space + offset, 2);
+    }
+
+    return value;
+}
+
+unsigned char pci_read_config8(const pci_device_t* pci, unsigned int offset) {
+    pci_emu_function_t* function = pci_emu_lookup(pci);
+    return function && offset < PCI_EMU_CONFIG_SIZE ? function->config_space[offset] : 0xFF;
+}
+
+void pci_write_config(const pci_device_t* pci, unsigned int offset, unsigned int value) {
+    (void) pci;
+    (void) offset;
+    (void) value;
+}
+
+void pci_write_config16(const pci_device_t* pci, unsigned int offset, unsigned short value) {
+    (void) pci;
+    (void) offset;
+    (void) value;
+}
+
+int pci_find_class(unsigned char class_code, unsigned char subclass, pci_device_t* devices, int max) {
+    int found = 0;
+
+    for (int i = 0; i < pci_emu_count && found < max; i++) {
+        if (pci_emu_functions[i].id.class_code == class_code && pci_emu_functions[i].id.subclass == subclass) {
+            devices[found++] = pci_emu_functions[i].id;
+        }
+    }
+
+    return found;
+}
+
+int pci_find_device(unsigned short vendor_id, unsigned short device_id, pci_device_t* devices, int max) {
+    int found = 0;
+
+    for (int i = 0; i < pci_emu_count && found < max; i++) {
+        if (pci_emu_functions[i].id.vendor_id == vendor_id && pci_emu_functions[i].id.device_id == device_id) {
+            devices[found++] = pci_emu_functions[i].id;
+        }
+    }
+
+    return found;
+}
+
+unsigned long long pci_get_bar(const pci_device_t* pci, int bar, int* is_io) {
+    pci_emu_function_t* function = pci_emu_lookup(pci);
+    *is_io = 0;
+    return function && bar == 0 ? (unsigned long long) function->bar : 0;
+}
+
+void pci_enable(const pci_device_t* pci, unsigned short flags) {
+    (void) pci;
+    (void) flags;
+}
+
+unsigned int pci_find_capability(const pci_device_t* pci, unsigned char id, unsigned int start) {
+    pci_emu_function_t* function = pci_emu_lookup(pci);
+
+    if (!function) {
+        return 0;
+    }
+
+    unsigned char* config_space = function->config_space;
+    unsigned int position = start ? config_space[start + 1] : config_space[PCI_CAPABILITIES];
+
+    while (position && config_space[position] != id) {
+        position = config_space[position + 1];
+    }
+
+    return position;
+}
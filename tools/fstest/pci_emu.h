@@ -0,0 +1,20 @@
+/**
+ * LightOS Tools
+ * Host PCI bus emulator header
+ */
+
+#ifndef PCI_EMU_H
+#define PCI_EMU_H
+
+#include "../../drivers/pci.h"
+
+// Maximum number of emulated functions on the bus
+#define PCI_EMU_MAX_FUNCTIONS 8
+
+// Size of a function's configuration space
+#define PCI_EMU_CONFIG_SIZE 256
+
+// PCI bus emulator functions
+int pci_emu_add(const pci_device_t* id, unsigned char* config_space, volatile unsigned char* bar);
+
+#endif /* PCI_EMU_H */
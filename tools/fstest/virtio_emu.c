@@ -0,0 +1,376 @@
+/**
+ * LightOS Tools
+ * Host virtio-blk device emulator
+ *
+ * Stands in for up to four modern virtio-blk functions on the emulated
+ * PCI bus (see pci_emu.c) so the driver can run unchanged in a host
+ * program. Each function has a
+ * memory BAR (common configuration at 0, notify at 0x1000, device
+ * configuration at 0x2000) described by vendor capabilities in its
+ * configuration space. A thread polls the avail rings, checks every
+ * request against the limits the device offered and serves it from a
+ * memory disk. Notifications are not trapped: the thread polls, and
+ * publishes avail_event or VIRTQ_USED_F_NO_NOTIFY so the driver's
+ * suppression logic sees a device that is busy part of the time.
+ */
+
+#include "virtio_emu.h"
+#include "pci_emu.h"
+#include "../bench/bench_host.h"
+#include "../../drivers/virtio_blk.h"
+#include "../../libc/string.h"
+
+// BAR layout
+#define VIRTIO_EMU_COMMON   0x0000
+#define VIRTIO_EMU_NOTIFY   0x1000
+#define VIRTIO_EMU_DEVICE   0x2000
+#define VIRTIO_EMU_BAR_SIZE 0x3000
+
+// Vendor capabilities in configuration space
+#define VIRTIO_EMU_CAP_COMMON 0x40
+#define VIRTIO_EMU_CAP_NOTIFY 0x54
+#define VIRTIO_EMU_CAP_DEVICE 0x6C
+
+// Queue offered to the driver
+#define VIRTIO_EMU_QUEUE_SIZE 256
+
+// Descriptors one request may use (header, data, status)
+#define VIRTIO_EMU_MAX_CHAIN (VIRTIO_BLK_MAX_SEGMENTS + 2)
+
+// Emulated function
+typedef struct {
+    virtio_emu_config_t config;
+    unsigned char config_space[PCI_EMU_CONFIG_SIZE];
+    volatile unsigned char* bar;
+    unsigned char* disk;
+    unsigned short last_avail;
+    int queue_live;
+    virtio_emu_stats_t stats;
+} virtio_emu_device_t;
+
+static virtio_emu_device_t virtio_emu_devices[VIRTIO_EMU_MAX_DEVICES];
+static int virtio_emu_count = 0;
+static volatile int virtio_emu_running = 0;
+static unsigned long long virtio_emu_thread = 0;
+
+// Register access within a BAR
+static unsigned short virtio_emu_read16(virtio_emu_device_t* dev, unsigned int offset) {
+    return *(volatile unsigned short*) (dev->bar + offset);
+}
+
+static unsigned long long virtio_emu_read64(virtio_emu_device_t* dev, unsigned int offset) {
+    return *(volatile unsigned long long*) (dev->bar + offset);
+}
+
+static void virtio_emu_write16(virtio_emu_device_t* dev, unsigned int offset, unsigned short value) {
+    *(volatile unsigned short*) (dev->bar + offset) = value;
+}
+
+static void virtio_emu_write32(virtio_emu_device_t* dev, unsigned int offset, unsigned int value) {
+    *(volatile unsigned int*) (dev->bar + offset) = value;
+}
+
+static void virtio_emu_write64(virtio_emu_device_t* dev, unsigned int offset, unsigned long long value) {
+    *(volatile unsigned long long*) (dev->bar + offset) = value;
+}
+
+// Add a vendor capability pointing into BAR 0
+static void virtio_emu_add_cap(virtio_emu_device_t* dev, unsigned int at, unsigned int next, unsigned char type, unsigned int offset, unsigned char length) {
+    dev->config_space[at] = PCI_CAP_VENDOR;
+    dev->config_space[at + 1] = (unsigned char) next;
+    dev->config_space[at + 2] = length;
+    dev->config_space[at + 3] = type;
+    dev->config_space[at + 4] = 0;
+    memcpy(dev->config_space + at + 8, &offset, 4);
+}
+
+// Collect a request's descriptors from the ring or its indirect table
+static int virtio_emu_collect(virtio_emu_device_t* dev, virtq_desc_t* ring, unsigned short size, unsigned short head, virtq_desc_t* chain) {
+    virtq_desc_t* table = ring;
+    unsigned int limit = size;
+    unsigned int index = head;
+    unsigned int count = 0;
+
+    if (ring[head].flags & VIRTQ_DESC_F_INDIRECT) {
+        if (!dev->config.indirect || ring[head].len % sizeof(virtq_desc_t) != 0) {
+            return -1;
+        }
+
+        table = (virtq_desc_t*) ring[head].addr;
+        limit = ring[head].len / sizeof(virtq_desc_t);
+        index = 0;
+        dev->stats.indirect++;
+    } else {
+        dev->stats.chained++;
+    }
+
+    while (count < VIRTIO_EMU_MAX_CHAIN && index < limit) {
+        chain[count++] = table[index];
+
+        if (!(table[index].flags & VIRTQ_DESC_F_NEXT)) {
+            return count;
+        }
+
+        index = table[index].next;
+    }
+
+    return -1;
+}
+
+// Serve one request; returns the bytes written into driver memory
+static unsigned int virtio_emu_request(virtio_emu_device_t* dev, virtq_desc_t* ring, unsigned short size, unsigned short head) {
+    virtq_desc_t chain[VIRTIO_EMU_MAX_CHAIN];
+    int count = virtio_emu_collect(dev, ring, size, head, chain);
+
+    if (count < 2) {
+        dev->stats.errors++;
+        return 0;
+    }
+
+    virtio_blk_header_t* header = (virtio_blk_header_t*) chain[0].addr;
+    unsigned char* status = (unsigned char*) chain[count - 1].addr;
+
+    if ((chain[0].flags & VIRTQ_DESC_F_WRITE) || !(chain[count - 1].flags & VIRTQ_DESC_F_WRITE) || chain[count - 1].len != 1) {
+        dev->stats.errors++;
+        return 0;
+    }
+
+    dev->stats.requests++;
+
+    if (header->type == VIRTIO_BLK_T_FLUSH) {
+        dev->stats.flushes++;
+        *status = VIRTIO_BLK_S_OK;
+        return 1;
+    }
+
+    // Data descriptors must respect size_max, seg_max and the block size
+    int reading = header->type == VIRTIO_BLK_T_IN;
+    unsigned long long offset = header->sector * 512;
+    unsigned long long total = 0;
+
+    for (int i = 1; i < count - 1; i++) {
+        if (chain[i].len > dev->config.size_max || !(chain[i].flags & VIRTQ_DESC_F_WRITE) != !reading) {
+            total = ~0ULL;
+            break;
+        }
+
+        total += chain[i].len;
+    }
+
+    if ((header->type != VIRTIO_BLK_T_IN && header->type != VIRTIO_BLK_T_OUT) || count - 2 > (int) dev->config.seg_max ||
+        total > dev->config.sectors * 512 - offset || offset > dev->config.sectors * 512 ||
+        total % dev->config.block_size != 0 || offset % dev->config.block_size != 0) {
+        dev->stats.errors++;
+        *status = 1;
+        return 1;
+    }
+
+    for (int i = 1; i < count - 1; i++) {
+        if (reading) {
+            memcpy((void*) chain[i].addr, dev->disk + offset, chain[i].len);
+        } else {
+            memcpy(dev->disk + offset, (void*) chain[i].addr, chain[i].len);
+        }
+
+        offset += chain[i].len;
+    }
+
+    *status = VIRTIO_BLK_S_OK;
+    return reading ? (unsigned int) total + 1 : 1;
+}
+
+// Drain one device's avail ring; returns the number of requests served
+static unsigned int virtio_emu_poll(virtio_emu_device_t* dev) {
+    unsigned char status = dev->bar[VIRTIO_EMU_COMMON + VIRTIO_COMMON_STATUS];
+
+    // A reset (or a queue not yet enabled) starts the rings over
+    if (!(status & VIRTIO_STATUS_DRIVER_OK) || !virtio_emu_read16(dev, VIRTIO_EMU_COMMON + VIRTIO_COMMON_Q_ENABLE)) {
+        dev->last_avail = 0;
+        dev->queue_live = 0;
+        return 0;
+    }
+
+    unsigned short size = virtio_emu_read16(dev, VIRTIO_EMU_COMMON + VIRTIO_COMMON_Q_SIZE);
+    virtq_desc_t* ring = (virtq_desc_t*) virtio_emu_read64(dev, VIRTIO_EMU_COMMON + VIRTIO_COMMON_Q_DESC);
+    volatile virtq_avail_t* avail = (volatile virtq_avail_t*) virtio_emu_read64(dev, VIRTIO_EMU_COMMON + VIRTIO_COMMON_Q_AVAIL);
+    volatile virtq_used_t* used = (volatile virtq_used_t*) virtio_emu_read64(dev, VIRTIO_EMU_COMMON + VIRTIO_COMMON_Q_USED);
+    volatile unsigned short* avail_event = (volatile unsigned short*) &used->ring[size];
+
+    dev->queue_live = 1;
+
+    unsigned short avail_idx = __atomic_load_n(&avail->idx, __ATOMIC_ACQUIRE);
+
+    if (avail_idx == dev->last_avail) {
+        // Idle: ask to be told about the next request
+        if (dev->config.event_idx) {
+            *avail_event = dev->last_avail;
+        } else {
+            used->flags = 0;
+        }
+
+        return 0;
+    }
+
+    // Busy: the driver need not notify while the ring is drained
+    if (!dev->config.event_idx) {
+        used->flags = VIRTQ_USED_F_NO_NOTIFY;
+    }
+
+    // Let a batch build up, as a device behind a real bus would
+    host_sleep_us(5);
+
+    unsigned int served = 0;
+
+    while ((avail_idx = __atomic_load_n(&avail->idx, __ATOMIC_ACQUIRE)) != dev->last_avail) {
+        unsigned short batch = (unsigned short) (avail_idx - dev->last_avail);
+
+        if (batch > dev->stats.max_batch) {
+            dev->stats.max_batch = batch;
+        }
+
+        while (dev->last_avail != avail_idx) {
+            unsigned short head = avail->ring[dev->last_avail % size];
+            unsigned int length = head < size ? virtio_emu_request(dev, ring, size, head) : 0;
+            unsigned short used_idx = used->idx;
+
+            used->ring[used_idx % size].id = head;
+            used->ring[used_idx % size].len = length;
+            __atomic_store_n(&used->idx, (unsigned short) (used_idx + 1), __ATOMIC_RELEASE);
+
+            dev->last_avail++;
+            served++;
+        }
+    }
+
+    if (dev->config.event_idx) {
+        *avail_event = dev->last_avail;
+    }
+
+    return served;
+}
+
+// Device thread: poll every function until stopped
+static void* virtio_emu_run(void* arg) {
+    (void) arg;
+
+    while (virtio_emu_running) {
+        unsigned int served = 0;
+
+        for (int i = 0; i < virtio_emu_count; i++) {
+            served += virtio_emu_poll(&virtio_emu_devices[i]);
+        }
+
+        if (served == 0) {
+            host_sleep_us(20);
+        }
+    }
+
+    return NULL;
+}
+
+// Add a function; returns its index (the driver names it vda, vdb, ...)
+int virtio_emu_add(const virtio_emu_config_t* config) {
+    if (virtio_emu_count >= VIRTIO_EMU_MAX_DEVICES || virtio_emu_running) {
+        return -1;
+    }
+
+    virtio_emu_device_t* dev = &virtio_emu_devices[virtio_emu_count];
+    memset(dev, 0, sizeof(virtio_emu_device_t));
+    dev->config = *config;
+
+    dev->bar = (volatile unsigned char*) host_alloc(VIRTIO_EMU_BAR_SIZE);
+    dev->disk = (unsigned char*) host_alloc(config->sectors * 512);
+
+    if (!dev->bar || !dev->disk) {
+        return -1;
+    }
+
+    memset((void*) dev->bar, 0, VIRTIO_EMU_BAR_SIZE);
+    memset(dev->disk, 0, config->sectors * 512);
+
+    // Configuration space: the capability list, notify multiplier after its cap
+    unsigned int multiplier = 4;
+    dev->config_space[PCI_STATUS] = PCI_STATUS_CAPABILITIES;
+    dev->config_space[PCI_CAPABILITIES] = VIRTIO_EMU_CAP_COMMON;
+    virtio_emu_add_cap(dev, VIRTIO_EMU_CAP_COMMON, VIRTIO_EMU_CAP_NOTIFY, VIRTIO_PCI_CAP_COMMON_CFG, VIRTIO_EMU_COMMON, 16);
+    virtio_emu_add_cap(dev, VIRTIO_EMU_CAP_NOTIFY, VIRTIO_EMU_CAP_DEVICE, VIRTIO_PCI_CAP_NOTIFY_CFG, VIRTIO_EMU_NOTIFY, 20);
+    memcpy(dev->config_space + VIRTIO_EMU_CAP_NOTIFY + 16, &multiplier, 4);
+    virtio_emu_add_cap(dev, VIRTIO_EMU_CAP_DEVICE, 0, VIRTIO_PCI_CAP_DEVICE_CFG, VIRTIO_EMU_DEVICE, 16);
+
+    // Feature words are not banked by DFSELECT (nothing traps the write),
+    // so both halves read the same: bit 0 is VERSION_1 in the high word
+    // and a legacy bit the driver does not accept in the low word
+    unsigned int features = 1 | (1u << VIRTIO_BLK_F_SIZE_MAX) | (1u << VIRTIO_BLK_F_SEG_MAX) |
+                            (1u << VIRTIO_BLK_F_BLK_SIZE) | (1u << VIRTIO_BLK_F_FLUSH);
+
+    if (config->indirect) {
+        features |= 1u << VIRTIO_RING_F_INDIRECT_DESC;
+    }
+
+    if (config->event_idx) {
+        features |= 1u << VIRTIO_RING_F_EVENT_IDX;
+    }
+
+    virtio_emu_write32(dev, VIRTIO_EMU_COMMON + VIRTIO_COMMON_DF, features);
+    virtio_emu_write16(dev, VIRTIO_EMU_COMMON + VIRTIO_COMMON_NUMQ, 1);
+    virtio_emu_write16(dev, VIRTIO_EMU_COMMON + VIRTIO_COMMON_Q_SIZE, VIRTIO_EMU_QUEUE_SIZE);
+    virtio_emu_write16(dev, VIRTIO_EMU_COMMON + VIRTIO_COMMON_Q_NOFF, 3);
+
+    virtio_emu_write64(dev, VIRTIO_EMU_DEVICE, config->sectors);
+    virtio_emu_write32(dev, VIRTIO_EMU_DEVICE + 8, config->size_max);
+    virtio_emu_write32(dev, VIRTIO_EMU_DEVICE + 12, config->seg_max);
+    virtio_emu_write32(dev, VIRTIO_EMU_DEVICE + 20, config->block_size);
+
+    pci_device_t id;
+    memset(&id, 0, sizeof(pci_device_t));
+    id.vendor_id = VIRTIO_PCI_VENDOR;
+    id.device_id = VIRTIO_PCI_BLK_MODERN;
+    id.class_code = 0x01;
+
+    if (pci_emu_add(&id, dev->config_space, dev->bar) < 0) {
+        return -1;
+    }
+
+    return virtio_emu_count++;
+}
+
+// Start serving the functions added so far
+int virtio_emu_start() {
+    if (virtio_emu_running) {
+        return 0;
+    }
+
+    virtio_emu_running = 1;
+    virtio_emu_thread = host_thread_start(virtio_emu_run, NULL);
+
+    if (!virtio_emu_thread) {
+        virtio_emu_running = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+// Stop the device thread (requests after this time out in the driver)
+void virtio_emu_stop() {
+    if (!virtio_emu_running) {
+        return;
+    }
+
+    virtio_emu_running = 0;
+    host_thread_join(virtio_emu_thread);
+}
+
+// Get a function's disk contents
+unsigned char* virtio_emu_disk(int index) {
+    return index >= 0 && index < virtio_emu_count ? virtio_emu_devices[index].disk : NULL;
+}
+
+// Get a function's request counters
+void virtio_emu_get_stats(int index, virtio_emu_stats_t* stats) {
+    if (index >= 0 && index < virtio_emu_count) {
+        *stats = virtio_emu_devices[index].stats;
+    } else {
+        memset(stats, 0, sizeof(virtio_emu_stats_t));
+    }
+}
@@ -0,0 +1,39 @@
+/**
+ * LightOS Tools
+ * Host virtio-blk device emulator header
+ */
+
+#ifndef VIRTIO_EMU_H
+#define VIRTIO_EMU_H
+
+// Maximum number of emulated devices (one PCI function each)
+#define VIRTIO_EMU_MAX_DEVICES 4
+
+// What an emulated device offers the driver
+typedef struct {
+    int indirect;                       // VIRTIO_RING_F_INDIRECT_DESC
+    int event_idx;                      // VIRTIO_RING_F_EVENT_IDX, else VIRTQ_USED_F_NO_NOTIFY
+    unsigned int block_size;
+    unsigned int size_max;              // Largest data descriptor
+    unsigned int seg_max;               // Data descriptors per request
+    unsigned long long sectors;         // Capacity in 512-byte sectors
+} virtio_emu_config_t;
+
+// Requests seen by one device
+typedef struct {
+    unsigned long long requests;
+    unsigned long long indirect;        // Requests in an indirect table
+    unsigned long long chained;         // Requests chained in the ring
+    unsigned long long flushes;
+    unsigned long long errors;          // Requests that broke the device's limits
+    unsigned long long max_batch;       // Most avail entries found at once
+} virtio_emu_stats_t;
+
+// Emulator functions
+int virtio_emu_add(const virtio_emu_config_t* config);
+int virtio_emu_start();
+void virtio_emu_stop();
+unsigned char* virtio_emu_disk(int index);
+void virtio_emu_get_stats(int index, virtio_emu_stats_t* stats);
+
+#endif /* VIRTIO_EMU_H */
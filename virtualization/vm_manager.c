@@ -8,10 +8,14 @@
 #include "../kernel/memory.h"
 #include "../kernel/process.h"
 #include "../libc/string.h"
+#include "../libc/hashmap.h"
 
 // Maximum number of VMs
 #define MAX_VMS 64
 
+// Name lookup table size
+#define VM_MAP_CAPACITY 128
+
 // Maximum number of disks per VM
 #define MAX_DISKS_PER_VM 16
 
@@ -22,6 +26,10 @@
 static vm_t* vms[MAX_VMS];
 static unsigned int vm_count = 0;
 
+// VM name index
+static hashmap_entry_t vm_map_entries[VM_MAP_CAPACITY];
+static hashmap_t vm_map;
+
 // Initialize the VM manager
 void vm_manager_init() {
     terminal_write("Initializing VM manager...\n");
@@ -32,6 +40,7 @@ void vm_manager_init() {
     }
     
     vm_count = 0;
+    hashmap_init(&vm_map, vm_map_entries, VM_MAP_CAPACITY);
     
     terminal_write("VM manager initialized\n");
 }
@@ -44,13 +53,11 @@ int vm_create(const char* name, vm_type_t type, unsigned int vcpus, unsigned lon
     }
     
     // Check if a VM with the same name already exists
-    for (unsigned int i = 0; i < vm_count; i++) {
-        if (strcmp(vms[i]->name, name) == 0) {
-            terminal_write("Error: VM with name '");
-            terminal_write(name);
-            terminal_write("' already exists\n");
-            return -1;
-        }
+    if (hashmap_get(&vm_map, name)) {
+        terminal_write("Error: VM with name '");
+        terminal_write(name);
+        terminal_write("' already exists\n");
+        return -1;
     }
     
     // Check if we have room for another VM
@@ -99,8 +106,9 @@ int vm_create(const char* name, vm_type_t type, unsigned int vcpus, unsigned lon
     vm->custom_config = NULL;
     vm->private_data = NULL;
     
-    // Add the VM to the array
+    // Add the VM to the array and the name index
     vms[vm_count++] = vm;
+    hashmap_insert(&vm_map, vm->name, vm);
     
     terminal_write("Created VM '");
     terminal_write(name);
@@ -148,6 +156,7 @@ int vm_destroy(const char* name) {
         free_block(vms[index]->custom_config);
     }
     
+    hashmap_remove(&vm_map, vms[index]->name);
     free_block(vms[index]);
     
     // Remove the VM from the array by shifting all subsequent VMs
@@ -503,14 +512,7 @@ vm_t* vm_get(const char* name) {
         return NULL;
     }
     
-    // Find the VM
-    for (unsigned int i = 0; i < vm_count; i++) {
-        if (strcmp(vms[i]->name, name) == 0) {
-            return vms[i];
-        }
-    }
-    
-    return NULL;
+    return (vm_t*)hashmap_get(&vm_map, name);
 }
 
 // Get the state of a VM